@@ -47,6 +47,62 @@ function read_uint64(view, offset)
 	return high * 4294967295 + low;
 }
 
+// reads the varints, zig-zag encoded signed varints and strings of version 2
+// of the torrent update format, advancing offset past them. Values are exact
+// up to 53 bits
+function varint_reader(view, offset)
+{
+	this.view = view;
+	this.offset = offset;
+}
+
+varint_reader.prototype.varint = function()
+{
+	var v = 0;
+	var scale = 1;
+	for (;;)
+	{
+		var b = this.view.getUint8(this.offset++);
+		v += (b & 0x7f) * scale;
+		if (b < 0x80) return v;
+		scale *= 128;
+	}
+}
+
+varint_reader.prototype.signed = function()
+{
+	var v = this.varint();
+	return (v % 2 == 0) ? v / 2 : -(v + 1) / 2;
+}
+
+varint_reader.prototype.string = function()
+{
+	var len = this.varint();
+	var str = '';
+	for (var j = 0; j < len; ++j)
+		str += String.fromCharCode(this.view.getUint8(this.offset++));
+	return str;
+}
+
+// bitmasks may be wider than the 32 bits the bit operators work on. They're
+// kept as the 7 bit groups of the varint, see mask_bit()
+varint_reader.prototype.mask = function()
+{
+	var groups = [];
+	for (;;)
+	{
+		var b = this.view.getUint8(this.offset++);
+		groups.push(b & 0x7f);
+		if (b < 0x80) return groups;
+	}
+}
+
+function mask_bit(groups, bit)
+{
+	var g = Math.floor(bit / 7);
+	return g < groups.length && ((groups[g] >> (bit % 7)) & 1) != 0;
+}
+
 function _check_error(e, callback)
 {
 	if (e == 0) return false;
@@ -60,6 +116,7 @@ function _check_error(e, callback)
 		case 4: error = 'invalid argument'; break;
 		case 5: error = 'truncated message'; break;
 		case 6: error = 'resource not found'; break;
+		case 7: error = 'timed out'; break;
 	}
 	
 	console.log("ERROR: " + error);
@@ -97,15 +154,32 @@ libtorrent_connection = function(url, callback)
 		}
 		else
 		{
-			// This is a function call
-
+			// This is a function call. The bittorrent client pushes
+			// updates to subscribers this way
+			var handler = self._subscriptions[fun];
+			if (typeof(handler) === 'undefined') return;
+			handler(view);
 		}
 
 	};
 	this._socket.binaryType = "arraybuffer";
 	this._frame = 0;
+	this._epoch = 0;
+	// the format torrent updates are asked for in, and the values of the
+	// counters version 2 sends differences of, per torrent
+	this._updates_version = 2;
+	this._counters = {};
 	this._stats_frame = 0;
+	// the last get_file_updates frame, per torrent
+	this._file_frames = {};
+	// the last get_peer_updates frame and peers, per torrent
+	this._peer_frames = {};
+	this._peers = {};
+	// the frame and torrents of the last get_view response
+	this._view_frame = 0;
+	this._view = {};
 	this._transactions = {}
+	this._subscriptions = {}
 	this._tid = 0;
 }
 
@@ -113,7 +187,7 @@ libtorrent_connection.prototype['list_settings'] = function(callback)
 {
 	if (this._socket.readyState != WebSocket.OPEN)
 	{
-		window.setTimeout( function() { callback("socket closed"); }, 0);
+		setTimeout( function() { callback("socket closed"); }, 0);
 		return;
 	}
 	
@@ -182,13 +256,13 @@ libtorrent_connection.prototype['get_settings'] = function(settings, callback)
 	// TODO: factor out this RPC boiler plate
 	if (this._socket.readyState != WebSocket.OPEN)
 	{
-		window.setTimeout( function() { callback("socket closed"); }, 0);
+		setTimeout( function() { callback("socket closed"); }, 0);
 		return;
 	}
 
 	if (typeof(this._settings) === 'undefined')
 	{
-		window.setTimeout( function() { callback("must call list_settings first"); }, 0);
+		setTimeout( function() { callback("must call list_settings first"); }, 0);
 		return;
 	}
 
@@ -260,13 +334,93 @@ libtorrent_connection.prototype['get_settings'] = function(settings, callback)
 	this._socket.send(call);
 }
 
+// returns the settings that changed since frame, as an object mapping
+// settings-id -> value, and the frame to pass in the next call. An empty
+// settings list means all settings
+libtorrent_connection.prototype['get_settings_updates'] = function(frame, settings, callback)
+{
+	if (this._socket.readyState != WebSocket.OPEN)
+	{
+		setTimeout( function() { callback("socket closed"); }, 0);
+		return;
+	}
+
+	if (typeof(this._settings) === 'undefined')
+	{
+		setTimeout( function() { callback("must call list_settings first"); }, 0);
+		return;
+	}
+
+	var tid = this._tid++;
+	if (this._tid > 65535) this._tid = 0;
+
+	var self = this;
+	this._transactions[tid] = function(view, fun, e)
+	{
+		if (_check_error(e, callback)) return;
+		var next_frame = view.getUint32(4);
+		var num_settings = view.getUint16(8);
+		var offset = 10;
+
+		var ret = {};
+		for (var i = 0; i < num_settings; ++i)
+		{
+			var id = view.getUint16(offset);
+			offset += 2;
+			var type = self._settings[id];
+			if (typeof(type) !== 'number' || type < 0 || type > 2)
+			{
+				if (typeof(callback) !== 'undefined') callback("invalid setting ID (" + id + ")");
+				return;
+			}
+			switch (type)
+			{
+				case 0: // string
+					var n = read_string16(view, offset);
+					ret[id] = n;
+					offset += 2 + n.length;
+					break;
+				case 1: // int
+					ret[id] = view.getUint32(offset);
+					offset += 4;
+					break;
+				case 2: // bool
+					ret[id] = view.getUint8(offset) ? true : false;
+					offset += 1;
+					break;
+			};
+		}
+		if (typeof(callback) !== 'undefined') callback(ret, next_frame);
+	}
+
+	var call = new ArrayBuffer(9 + settings.length * 2);
+	var view = new DataView(call);
+	// function 28
+	view.setUint8(0, 28);
+	// transaction-id
+	view.setUint16(1, tid);
+	view.setUint32(3, frame);
+	// num settings
+	view.setUint16(7, settings.length);
+
+	var offset = 9;
+	for (var i = 0; i < settings.length; ++i)
+	{
+		view.setUint16(offset, settings[i]);
+		offset += 2;
+	}
+
+	console.log('CALL get_settings_updates( frame: ' + frame + ' num: ' + settings.length + ' ) tid = ' + tid);
+	this._socket.send(call);
+}
+
 // settings is an object mapping settings-id -> value
 libtorrent_connection.prototype['set_settings'] = function(settings, callback)
 {
 	// TODO: factor out this RPC boiler plate
 	if (this._socket.readyState != WebSocket.OPEN)
 	{
-		window.setTimeout( function() { callback("socket closed"); }, 0);
+		setTimeout( function() { callback("socket closed"); }, 0);
 		return;
 	}
 
@@ -349,11 +503,352 @@ libtorrent_connection.prototype['set_settings'] = function(settings, callback)
 	this._socket.send(call);
 }
 
+// parses the fields in the bitmask mask_low, of one torrent in the format
+// of get-torrent-updates, into torrent. Returns the offset following them
+function parse_torrent_fields(view, offset, mask_low, torrent)
+{
+	for (var field = 0; field < 32; ++field)
+	{
+		var mask = 1 << field;
+		if ((mask_low & mask) == 0) continue;
+		switch (field)
+		{
+			case 0: // flags
+				// skip high bytes, since we can't
+				// represent 64 bits in one field anyway
+				offset += 4;
+				torrent['flags'] = view.getUint32(offset);
+				offset += 4;
+				break;
+			case 1: // name
+				var name = read_string16(view, offset);
+				offset += 2 + name.length;
+				torrent['name'] = name;
+				break;
+			case 2: // total-uploaded
+				torrent['total-uploaded'] = read_uint64(view, offset);
+				offset += 8;
+				break;
+			case 3: // total-downloaded
+				torrent['total-downloaded'] = read_uint64(view, offset);
+				offset += 8;
+				break;
+			case 4: // added-time
+				torrent['added-time'] = read_uint64(view, offset);
+				offset += 8;
+				break;
+			case 5: // completed-time
+				torrent['completed-time'] = read_uint64(view, offset);
+				offset += 8;
+				break;
+			case 6: // upload-rate
+				torrent['upload-rate'] = view.getUint32(offset);
+				offset += 4;
+				break;
+			case 7: // download-rate
+				torrent['download-rate'] = view.getUint32(offset);
+				offset += 4;
+				break;
+			case 8: // progress
+				torrent['progress'] = view.getUint32(offset);
+				offset += 4;
+				break;
+			case 9: // error
+				var e = read_string16(view, offset);
+				offset += 2 + e.length;
+				torrent['error'] = e;
+				break;
+			case 10: // connected-peers
+				torrent['connected-peers'] = view.getUint32(offset);
+				offset += 4;
+				break;
+			case 11: // connected-seeds
+				torrent['connected-seeds'] = view.getUint32(offset);
+				offset += 4;
+				break;
+			case 12: // downloaded-pieces
+				torrent['downloaded-pieces'] = view.getUint32(offset);
+				offset += 4;
+				break;
+			case 13: // total-done
+				torrent['total-done'] = read_uint64(view, offset);
+				offset += 8;
+				break;
+			case 14: // distributed-copies
+				var integer = view.getUint32(offset);
+				offset += 4;
+				var fraction = view.getUint32(offset);
+				offset += 4;
+				torrent['distributed-copies'] = integer + (fraction / 1000.0);
+				break;
+			case 15: // all-time-upload
+				torrent['all-time-upload'] = read_uint64(view, offset);
+				offset += 8;
+				break;
+			case 16: // all-time-download
+				torrent['all-time-download'] = read_uint64(view, offset);
+				offset += 8;
+				break;
+			case 17: // unchoked-peers
+				torrent['unchoked-peers'] = view.getUint32(offset);
+				offset += 4;
+				break;
+			case 18: // num-connections
+				torrent['num-connections'] = view.getUint32(offset);
+				offset += 4;
+				break;
+			case 19: // queue-position
+				torrent['queue-position'] = view.getUint32(offset);
+				offset += 4;
+				break;
+			case 20: // state
+				torrent['state'] = view.getUint8(offset);
+				offset += 1;
+				break;
+			case 21: // failed-bytes
+				torrent['failed-bytes'] = read_uint64(view, offset);
+				offset += 8;
+				break;
+			case 22: // redundant-bytes
+				torrent['redundant-bytes'] = read_uint64(view, offset);
+				offset += 8;
+				break;
+			case 23: // labels
+			{
+				var num_labels = view.getUint8(offset);
+				offset += 1;
+				var labels = [];
+				for (var j = 0; j < num_labels; ++j)
+				{
+					var l = read_string16(view, offset);
+					offset += 2 + l.length;
+					labels.push(decodeURIComponent(escape(l)));
+				}
+				torrent['labels'] = labels;
+				break;
+			}
+		}
+	}
+	return offset;
+}
+
+// parses torrent updates starting at offset, in the format returned by
+// get-torrent-updates and pushed to subscribers. Updates the current frame
+libtorrent_connection.prototype._parse_updates = function(view, offset)
+{
+	this._frame = view.getUint32(offset);
+	var num_torrents = view.getUint32(offset + 4);
+	var num_removed_torrents = view.getUint32(offset + 8);
+	console.log('frame: ' + this._frame + ' num-torrents: ' + num_torrents + ' num-removed-torrents: ' + num_removed_torrents);
+	var ret = {};
+	offset += 12;
+	for (var i = 0; i < num_torrents; ++i)
+	{
+		var infohash = read_infohash(view, offset);
+		offset += 20;
+		var torrent = {};
+
+//		var mask_high = view.getUint32(offset);
+		offset += 4;
+		var mask_low = view.getUint32(offset);
+		offset += 4;
+
+		offset = parse_torrent_fields(view, offset, mask_low, torrent);
+		ret[infohash] = torrent;
+	}
+
+	var removed = [];
+	for (var i = 0; i < num_removed_torrents; ++i)
+	{
+		removed.push(read_infohash(view, offset));
+		offset += 20;
+	}
+	ret['removed'] = removed;
+
+	// servers that keep their history across restarts follow up with its
+	// epoch. When it changes, the frame numbers start over and the update
+	// is a full one
+	if (offset + 4 <= view.byteLength)
+	{
+		var epoch = view.getUint32(offset);
+		if (this._epoch != 0 && epoch != this._epoch) ret['reset'] = true;
+		this._epoch = epoch;
+		ret['epoch'] = epoch;
+		offset += 4;
+	}
+
+	// a full update has every torrent, the ones that aren't in it are gone
+	if (offset + 1 <= view.byteLength && (view.getUint8(offset) & 1))
+		ret['reset'] = true;
+	return ret;
+}
+
+// the fields of version 2 of the torrent update format, by field id, and how
+// they're encoded. 'c' are counters, which are sent as the difference from
+// the previous value when the client has it
+var torrent_fields_v2 =
+[
+	['flags', 'u'],
+	['name', 's'],
+	['total-uploaded', 'c'],
+	['total-downloaded', 'c'],
+	['added-time', 'i'],
+	['completed-time', 'i'],
+	['upload-rate', 'i'],
+	['download-rate', 'i'],
+	['progress', 'i'],
+	['error', 's'],
+	['connected-peers', 'i'],
+	['connected-seeds', 'i'],
+	['downloaded-pieces', 'i'],
+	['total-done', 'c'],
+	['distributed-copies', 'copies'],
+	['all-time-upload', 'c'],
+	['all-time-download', 'c'],
+	['unchoked-peers', 'i'],
+	['num-connections', 'i'],
+	['queue-position', 'i'],
+	['state', 'u'],
+	['failed-bytes', 'c'],
+	['redundant-bytes', 'c'],
+	['labels', 'labels'],
+	['save-path', 's'],
+	['next-announce', 'i'],
+	['current-tracker', 's'],
+	['total-payload-uploaded', 'c'],
+	['total-payload-downloaded', 'c'],
+	['payload-upload-rate', 'i'],
+	['payload-download-rate', 'i'],
+	['num-complete', 'i'],
+	['num-incomplete', 'i'],
+	['list-seeds', 'i'],
+	['list-peers', 'i'],
+	['connect-candidates', 'i'],
+	['total-done-all', 'c'],
+	['total-wanted', 'i'],
+	['block-size', 'i'],
+	['uploads-limit', 'i'],
+	['connections-limit', 'i'],
+	['storage-mode', 'i'],
+	['up-bandwidth-queue', 'i'],
+	['down-bandwidth-queue', 'i'],
+	['active-time', 'c'],
+	['finished-time', 'c'],
+	['seeding-time', 'c'],
+	['seed-rank', 'i'],
+	['last-scrape', 'i'],
+	['priority', 'i'],
+	['last-seen-complete', 'i'],
+	['time-since-upload', 'i'],
+	['time-since-download', 'i']
+];
+
+// parses torrent updates in version 2 of the format. The counters sent as
+// differences are added to the values from the previous updates, the
+// callback is passed the same values as for version 1
+libtorrent_connection.prototype._parse_updates_v2 = function(view, offset)
+{
+	var r = new varint_reader(view, offset);
+	this._frame = r.varint();
+	var num_torrents = r.varint();
+	var num_removed_torrents = r.varint();
+	console.log('frame: ' + this._frame + ' num-torrents: ' + num_torrents + ' num-removed-torrents: ' + num_removed_torrents);
+	var ret = {};
+	for (var i = 0; i < num_torrents; ++i)
+	{
+		var infohash = read_infohash(view, r.offset);
+		r.offset += 20;
+		var mask = r.mask();
+		var deltas = r.mask();
+
+		if (!this._counters.hasOwnProperty(infohash)) this._counters[infohash] = {};
+		var counters = this._counters[infohash];
+		var torrent = {};
+		for (var f = 0; f < torrent_fields_v2.length; ++f)
+		{
+			if (!mask_bit(mask, f)) continue;
+			var name = torrent_fields_v2[f][0];
+			switch (torrent_fields_v2[f][1])
+			{
+				case 'u':
+					torrent[name] = r.varint();
+					break;
+				case 'i':
+					torrent[name] = r.signed();
+					break;
+				case 'c':
+					var v = r.signed();
+					if (mask_bit(deltas, f) && counters.hasOwnProperty(name))
+						v += counters[name];
+					counters[name] = v;
+					torrent[name] = v;
+					break;
+				case 's':
+					torrent[name] = r.string();
+					break;
+				case 'copies':
+					var integer = r.signed();
+					var fraction = r.signed();
+					torrent[name] = integer + (fraction / 1000.0);
+					break;
+				case 'labels':
+					var num_labels = r.varint();
+					var labels = [];
+					for (var j = 0; j < num_labels; ++j)
+						labels.push(decodeURIComponent(escape(r.string())));
+					torrent[name] = labels;
+					break;
+			}
+		}
+		ret[infohash] = torrent;
+	}
+
+	var removed = [];
+	for (var i = 0; i < num_removed_torrents; ++i)
+	{
+		var ih = read_infohash(view, r.offset);
+		r.offset += 20;
+		delete this._counters[ih];
+		removed.push(ih);
+	}
+	ret['removed'] = removed;
+
+	var epoch = r.varint();
+	if (this._epoch != 0 && epoch != this._epoch) ret['reset'] = true;
+	this._epoch = epoch;
+	ret['epoch'] = epoch;
+
+	// a full update has every torrent, the ones that aren't in it are gone
+	if (r.offset < view.byteLength && (r.varint() & 1)) ret['reset'] = true;
+	return ret;
+}
+
+// builds a get-torrent-updates or subscribe-torrent-updates call. mask may be
+// wider than 32 bits
+libtorrent_connection.prototype._updates_call = function(fun, tid, mask)
+{
+	var call = new ArrayBuffer(19);
+	var view = new DataView(call);
+	view.setUint8(0, fun);
+	// transaction-id
+	view.setUint16(1, tid);
+	// frame-number
+	view.setUint32(3, this._frame);
+	view.setUint32(7, Math.floor(mask / 4294967296));
+	view.setUint32(11, mask % 4294967296);
+	// epoch of the frame-number
+	view.setUint32(15, this._epoch);
+	return call;
+}
+
+// requests the torrent updates since the last call. The updates are asked
+// for in version 2 of the format (function 26), falling back to version 1
+// (function 0) if the bittorrent client doesn't know it
 libtorrent_connection.prototype['get_updates'] = function(mask, callback)
 {
 	if (this._socket.readyState != WebSocket.OPEN)
 	{
-		window.setTimeout( function() { callback("socket closed"); }, 0);
+		setTimeout( function() { callback("socket closed"); }, 0);
 		return;
 	}
 	
@@ -363,162 +858,109 @@ libtorrent_connection.prototype['get_updates'] = function(mask, callback)
 	// this is the handler of the response for this call. It first
 	// parses out the return value, the passes it on to the user
 	// supplied callback.
+	var self = this;
+	var version = this._updates_version;
+	this._transactions[tid] = function(view, fun, e)
+	{
+		if (e == 1 && version == 2)
+		{
+			self._updates_version = 1;
+			self['get_updates'](mask, callback);
+			return;
+		}
+		if (_check_error(e, callback)) return;
+
+		var ret = version == 2
+			? self._parse_updates_v2(view, 4)
+			: self._parse_updates(view, 4);
+
+		if (typeof(callback) !== 'undefined') callback(ret);
+	};
+
+	var call = this._updates_call(version == 2 ? 26 : 0, tid, mask);
+
+	console.log('CALL get_updates( frame: ' + this._frame + ' mask: ' + mask.toString(16) + ' version: ' + version + ' ) tid = ' + tid);
+	this._socket.send(call);
+}
+
+// requests a window of the torrents, sorted and filtered by the bittorrent
+// client. sort is one of the torrent-view sort keys, 0x80 set for descending
+// order. An empty label includes torrents regardless of their labels. The
+// callback is passed an object with 'matching' (the number of torrents
+// matching filter, search and label) and 'torrents', the torrents of the
+// window in order, with their 'info-hash' and all fields in mask. Only the
+// fields that changed are sent for torrents that were in the previous window
+libtorrent_connection.prototype['get_view'] = function(sort, filter, search
+	, label, offset, limit, mask, callback)
+{
+	if (this._socket.readyState != WebSocket.OPEN)
+	{
+		setTimeout( function() { callback("socket closed"); }, 0);
+		return;
+	}
+
+	var tid = this._tid++;
+	if (this._tid > 65535) this._tid = 0;
+
 	var self = this;
 	this._transactions[tid] = function(view, fun, e)
 	{
 		if (_check_error(e, callback)) return;
 
-		self._frame = view.getUint32(4);
-		var num_torrents = view.getUint32(8);
-		var num_removed_torrents = view.getUint32(12);
-		console.log('frame: ' + self._frame + ' num-torrents: ' + num_torrents + ' num-removed-torrents: ' + num_removed_torrents);
-		ret = {};
+		self._view_frame = view.getUint32(4);
+		var matching = view.getUint32(8);
+		var num_torrents = view.getUint32(12);
 		var offset = 16;
+		var torrents = [];
+		var window_torrents = {};
 		for (var i = 0; i < num_torrents; ++i)
 		{
 			var infohash = read_infohash(view, offset);
 			offset += 20;
-			var torrent = {};
-
-//			var mask_high = view.getUint32(offset);
 			offset += 4;
 			var mask_low = view.getUint32(offset);
 			offset += 4;
 
-			for (var field = 0; field < 32; ++field)
-			{
-				var mask = 1 << field;
-				if ((mask_low & mask) == 0) continue;
-				switch (field)
-				{
-					case 0: // flags
-						// skip high bytes, since we can't
-						// represent 64 bits in one field anyway
-						offset += 4;
-						torrent['flags'] = view.getUint32(offset);
-						offset += 4;
-						break;
-					case 1: // name
-						var name = read_string16(view, offset);
-						offset += 2 + name.length;
-						torrent['name'] = name;
-						break;
-					case 2: // total-uploaded
-						torrent['total-uploaded'] = read_uint64(view, offset);
-						offset += 8;
-						break;
-					case 3: // total-downloaded
-						torrent['total-downloaded'] = read_uint64(view, offset);
-						offset += 8;
-						break;
-					case 4: // added-time
-						torrent['added-time'] = read_uint64(view, offset);
-						offset += 8;
-						break;
-					case 5: // completed-time
-						torrent['completed-time'] = read_uint64(view, offset);
-						offset += 8;
-						break;
-					case 6: // upload-rate
-						torrent['upload-rate'] = view.getUint32(offset);
-						offset += 4;
-						break;
-					case 7: // download-rate
-						torrent['download-rate'] = view.getUint32(offset);
-						offset += 4;
-						break;
-					case 8: // progress
-						torrent['progress'] = view.getUint32(offset);
-						offset += 4;
-						break;
-					case 9: // error
-						var e = read_string16(view, offset);
-						offset += 2 + e.length;
-						torrent['error'] = e;
-						break;
-					case 10: // connected-peers
-						torrent['connected-peers'] = view.getUint32(offset);
-						offset += 4;
-						break;
-					case 11: // connected-seeds
-						torrent['connected-seeds'] = view.getUint32(offset);
-						offset += 4;
-						break;
-					case 12: // downloaded-pieces
-						torrent['downloaded-pieces'] = view.getUint32(offset);
-						offset += 4;
-						break;
-					case 13: // total-done
-						torrent['total-done'] = read_uint64(view, offset);
-						offset += 8;
-						break;
-					case 14: // distributed-copies
-						var integer = view.getUint32(offset);
-						offset += 4;
-						var fraction = view.getUint32(offset);
-						offset += 4;
-						torrent['distributed-copies'] = integer + (fraction / 1000.0);
-						break;
-					case 15: // all-time-upload
-						torrent['all-time-upload'] = read_uint64(view, offset);
-						offset += 8;
-						break;
-					case 16: // all-time-download
-						torrent['all-time-download'] = read_uint64(view, offset);
-						offset += 8;
-						break;
-					case 17: // unchoked-peers
-						torrent['unchoked-peers'] = view.getUint32(offset);
-						offset += 4;
-						break;
-					case 18: // num-connections
-						torrent['num-connections'] = view.getUint32(offset);
-						offset += 4;
-						break;
-					case 19: // queue-position
-						torrent['queue-position'] = view.getUint32(offset);
-						offset += 4;
-						break;
-					case 20: // state
-						torrent['state'] = view.getUint8(offset);
-						offset += 1;
-						break;
-					case 21: // failed-bytes
-						torrent['failed-bytes'] = read_uint64(view, offset);
-						offset += 8;
-						break;
-					case 22: // redundant-bytes
-						torrent['redundant-bytes'] = read_uint64(view, offset);
-						offset += 8;
-						break;
-				}
-			}
-			ret[infohash] = torrent;
-		}
-
-		var removed = [];
-		for (var i = 0; i < num_removed_torrents; ++i)
-		{
-			removed.push(read_infohash(view, offset));
-			offset += 20;
+			// start out with the fields of the previous window
+			var torrent = self._view.hasOwnProperty(infohash)
+				? self._view[infohash] : { 'info-hash': infohash };
+			offset = parse_torrent_fields(view, offset, mask_low, torrent);
+			window_torrents[infohash] = torrent;
+			torrents.push(torrent);
 		}
-		ret['removed'] = removed;
+		self._view = window_torrents;
 
-		if (typeof(callback) !== 'undefined') callback(ret);
+		if (typeof(callback) !== 'undefined')
+			callback({ 'matching': matching, 'torrents': torrents });
 	};
 
-	var call = new ArrayBuffer(15);
+	// the search string and label are sent as UTF-8
+	var str = unescape(encodeURIComponent(search));
+	var lbl = unescape(encodeURIComponent(label));
+	var call = new ArrayBuffer(29 + str.length + lbl.length);
 	var view = new DataView(call);
-	// function 0
-	view.setUint8(0, 0);
+	// function 23
+	view.setUint8(0, 23);
 	// transaction-id
 	view.setUint16(1, tid);
 	// frame-number
-	view.setUint32(3, this._frame);
+	view.setUint32(3, this._view_frame);
+	// field-bitmask
 	view.setUint32(7, 0);
 	view.setUint32(11, mask);
-
-	console.log('CALL get_updates( frame: ' + this._frame + ' mask: ' + mask.toString(16) + ' ) tid = ' + tid);
+	view.setUint8(15, sort);
+	view.setUint8(16, filter);
+	view.setUint32(17, offset);
+	view.setUint32(21, limit);
+	view.setUint16(25, str.length);
+	for (var i = 0; i < str.length; ++i)
+		view.setUint8(27 + i, str.charCodeAt(i));
+	view.setUint16(27 + str.length, lbl.length);
+	for (var i = 0; i < lbl.length; ++i)
+		view.setUint8(29 + str.length + i, lbl.charCodeAt(i));
+
+	console.log('CALL get_view( sort: ' + sort + ' filter: ' + filter + ' search: ' + search
+		+ ' label: ' + label + ' offset: ' + offset + ' limit: ' + limit + ' ) tid = ' + tid);
 	this._socket.send(call);
 }
 
@@ -527,7 +969,7 @@ libtorrent_connection.prototype['list_stats'] = function(callback)
 	// TODO: factor out this RPC boiler plate
 	if (this._socket.readyState != WebSocket.OPEN)
 	{
-		window.setTimeout( function() { callback("socket closed"); }, 0);
+		setTimeout( function() { callback("socket closed"); }, 0);
 		return;
 	}
 
@@ -569,18 +1011,39 @@ libtorrent_connection.prototype['list_stats'] = function(callback)
 	this._socket.send(call);
 }
 
+// parses stats counters starting at offset, in the format returned by
+// get-stats and pushed to subscribers. Updates the current stats frame
+libtorrent_connection.prototype._parse_stats = function(view, offset)
+{
+	this._stats_frame = view.getUint32(offset);
+
+	var num_updates = view.getUint16(offset + 4);
+	offset += 6;
+
+	// read values
+	var ret = {};
+	for (var i = 0; i < num_updates; ++i)
+	{
+		var id = view.getUint16(offset);
+		var val = read_uint64(view, offset + 2);
+		offset += 10;
+		ret[this._stats[id]] = val;
+	}
+	return ret;
+}
+
 libtorrent_connection.prototype['get_stats'] = function(stats, callback)
 {
 	// TODO: factor out this RPC boiler plate
 	if (this._socket.readyState != WebSocket.OPEN)
 	{
-		window.setTimeout( function() { callback("socket closed"); }, 0);
+		setTimeout( function() { callback("socket closed"); }, 0);
 		return;
 	}
 
 	if (this._stats == null)
 	{
-		window.setTimeout( function() { callback("need to call list_stats first"); }, 0);
+		setTimeout( function() { callback("need to call list_stats first"); }, 0);
 		return;
 	}
 
@@ -592,27 +1055,110 @@ libtorrent_connection.prototype['get_stats'] = function(stats, callback)
 	{
 		if (_check_error(e, callback)) return;
 
-		self._stats_frame = view.getUint32(4);
+		var ret = self._parse_stats(view, 4);
+		if (typeof(callback) !== 'undefined') callback(ret);
+	};
 
-		var num_updates = view.getUint16(8);
-		var offset = 10;
+	var call = new ArrayBuffer(3 + 4 + 2 + stats.length * 2);
+	var view = new DataView(call);
+	// function 18
+	view.setUint8(0, 18);
+	// transaction-id
+	view.setUint16(1, tid);
+	// frame number
+	view.setUint32(3, this._stats_frame);
+	// num-stats
+	view.setUint16(7, stats.length);
 
-		// read values
-		var ret = {};
-		for (var i = 0; i < num_updates; ++i)
+	var offset = 9;
+	for (i in stats)
+	{
+		view.setUint16(offset, stats[i]);
+		offset += 2;
+	}
+
+	console.log('CALL get_stats () tid = ' + tid);
+	this._socket.send(call);
+}
+
+// subscribe to torrent updates. The callback is called with the same
+// argument as the get_updates callback, every time the bittorrent client
+// pushes an update
+libtorrent_connection.prototype['subscribe_updates'] = function(mask, callback)
+{
+	if (this._socket.readyState != WebSocket.OPEN)
+	{
+		setTimeout( function() { callback("socket closed"); }, 0);
+		return;
+	}
+
+	var tid = this._tid++;
+	if (this._tid > 65535) this._tid = 0;
+
+	var self = this;
+	var version = this._updates_version;
+	this._transactions[tid] = function(view, fun, e)
+	{
+		if (e == 1 && version == 2)
 		{
-			var id = view.getUint16(offset);
-			var val = read_uint64(view, offset + 2);
-			offset += 10;
-			ret[self._stats[id]] = val;
+			self._updates_version = 1;
+			self['subscribe_updates'](mask, callback);
+			return;
 		}
+		if (_check_error(e, callback)) return;
+	};
+
+	// version 2 updates are pushed as function 27
+	this._subscriptions[version == 2 ? 27 : 20] = function(view)
+	{
+		// pushed calls don't have an error code, the arguments start at 3
+		var ret = version == 2
+			? self._parse_updates_v2(view, 3)
+			: self._parse_updates(view, 3);
+		if (typeof(callback) !== 'undefined') callback(ret);
+	};
+
+	var call = this._updates_call(version == 2 ? 27 : 20, tid, mask);
+
+	console.log('CALL subscribe_updates( frame: ' + this._frame + ' mask: ' + mask.toString(16) + ' version: ' + version + ' ) tid = ' + tid);
+	this._socket.send(call);
+}
+
+// subscribe to stats counters. The callback is called with the same argument
+// as the get_stats callback, every time the bittorrent client pushes an update
+libtorrent_connection.prototype['subscribe_stats'] = function(stats, callback)
+{
+	if (this._socket.readyState != WebSocket.OPEN)
+	{
+		setTimeout( function() { callback("socket closed"); }, 0);
+		return;
+	}
+
+	if (this._stats == null)
+	{
+		setTimeout( function() { callback("need to call list_stats first"); }, 0);
+		return;
+	}
+
+	var tid = this._tid++;
+	if (this._tid > 65535) this._tid = 0;
+
+	var self = this;
+	this._transactions[tid] = function(view, fun, e)
+	{
+		if (_check_error(e, callback)) return;
+	};
+
+	this._subscriptions[21] = function(view)
+	{
+		var ret = self._parse_stats(view, 3);
 		if (typeof(callback) !== 'undefined') callback(ret);
 	};
 
 	var call = new ArrayBuffer(3 + 4 + 2 + stats.length * 2);
 	var view = new DataView(call);
-	// function 18
-	view.setUint8(0, 18);
+	// function 21
+	view.setUint8(0, 21);
 	// transaction-id
 	view.setUint16(1, tid);
 	// frame number
@@ -627,7 +1173,36 @@ libtorrent_connection.prototype['get_stats'] = function(stats, callback)
 		offset += 2;
 	}
 
-	console.log('CALL get_stats () tid = ' + tid);
+	console.log('CALL subscribe_stats () tid = ' + tid);
+	this._socket.send(call);
+}
+
+libtorrent_connection.prototype['unsubscribe'] = function(callback)
+{
+	if (this._socket.readyState != WebSocket.OPEN)
+	{
+		setTimeout( function() { callback("socket closed"); }, 0);
+		return;
+	}
+
+	var tid = this._tid++;
+	if (this._tid > 65535) this._tid = 0;
+
+	this._subscriptions = {};
+	this._transactions[tid] = function(view, fun, e)
+	{
+		if (_check_error(e, callback)) return;
+		if (typeof(callback) !== 'undefined') callback(null);
+	};
+
+	var call = new ArrayBuffer(3);
+	var view = new DataView(call);
+	// function 22
+	view.setUint8(0, 22);
+	// transaction-id
+	view.setUint16(1, tid);
+
+	console.log('CALL unsubscribe () tid = ' + tid);
 	this._socket.send(call);
 }
 
@@ -635,7 +1210,7 @@ libtorrent_connection.prototype['get_file_updates'] = function(ih, callback)
 {
 	if (this._socket.readyState != WebSocket.OPEN)
 	{
-		window.setTimeout( function() { callback("socket closed"); }, 0);
+		setTimeout( function() { callback("socket closed"); }, 0);
 		return;
 	}
 	
@@ -652,6 +1227,7 @@ libtorrent_connection.prototype['get_file_updates'] = function(ih, callback)
 
 		var frame = view.getUint32(4);
 		var num_files = view.getUint32(8);
+		self._file_frames[ih] = frame;
 		console.log('frame: ' + frame + ' num-files: ' + num_files);
 		ret = [];
 		var offset = 12;
@@ -697,6 +1273,10 @@ libtorrent_connection.prototype['get_file_updates'] = function(ih, callback)
 						file['downloaded'] = read_uint64(view, offset);
 						offset += 8;
 						break;
+					case 4: // priority
+						file['priority'] = view.getUint8(offset);
+						offset += 1;
+						break;
 				}
 			}
 			ret.push(file);
@@ -720,12 +1300,143 @@ libtorrent_connection.prototype['get_file_updates'] = function(ih, callback)
 		offset += 1;
 	}
 
-	// frame-number
-	view.setUint32(offset, 0);
+	// frame-number. Only files that changed since the last call
+	// are returned
+	var frame = this._file_frames[ih];
+	if (typeof(frame) === 'undefined') frame = 0;
+	view.setUint32(offset, frame);
 
 	console.log('CALL get_file_updates() tid = ' + tid);
 	this._socket.send(call);
 }
+// reads an endpoint of get-peer-updates. Returns the endpoint as a string
+// and the number of bytes it took
+function read_endpoint(view, offset)
+{
+	var len = view.getUint8(offset);
+	var addr = '';
+	if (len == 4)
+	{
+		for (var i = 0; i < 4; ++i)
+			addr += (i > 0 ? '.' : '') + view.getUint8(offset + 1 + i);
+	}
+	else
+	{
+		for (var i = 0; i < len; i += 2)
+			addr += (i > 0 ? ':' : '') + view.getUint16(offset + 1 + i).toString(16);
+		addr = '[' + addr + ']';
+	}
+	var port = view.getUint16(offset + 1 + len);
+	return [addr + ':' + port, 3 + len];
+}
+
+libtorrent_connection.prototype['get_peer_updates'] = function(ih, callback)
+{
+	if (this._socket.readyState != WebSocket.OPEN)
+	{
+		setTimeout( function() { callback("socket closed"); }, 0);
+		return;
+	}
+	
+	var tid = this._tid++;
+	if (this._tid > 65535) this._tid = 0;
+
+	// this is the handler of the response for this call. It first
+	// parses out the return value, the passes it on to the user
+	// supplied callback.
+	var self = this;
+	this._transactions[tid] = function(view, fun, e)
+	{
+		if (_check_error(e, callback)) return;
+
+		var frame = view.getUint32(4);
+		var full = view.getUint8(8);
+		var num_peers = view.getUint32(9);
+		self._peer_frames[ih] = frame;
+
+		// the updates are merged into the peers we already know about,
+		// unless this is the complete list
+		var peers = self._peers[ih];
+		if (full || typeof(peers) === 'undefined') peers = {};
+		var offset = 13;
+		for (var i = 0; i < num_peers; ++i)
+		{
+			var ep = read_endpoint(view, offset);
+			offset += ep[1];
+			var peer = peers[ep[0]];
+			if (typeof(peer) === 'undefined') peer = { 'ip': ep[0] };
+
+			var field_mask = view.getUint16(offset)
+			offset += 2;
+
+			for (var field = 0; field < 16; ++field)
+			{
+				var bit = 1 << field;
+				if ((field_mask & bit) == 0) continue;
+				switch (field)
+				{
+					case 0: peer['flags'] = view.getUint32(offset); offset += 4; break;
+					case 1: peer['source'] = view.getUint8(offset); offset += 1; break;
+					case 2:
+						var client = read_string16(view, offset);
+						offset += 2 + client.length;
+						peer['client'] = client;
+						break;
+					case 3: peer['num-pieces'] = view.getUint32(offset); offset += 4; break;
+					case 4: peer['download-rate'] = view.getUint32(offset); offset += 4; break;
+					case 5: peer['upload-rate'] = view.getUint32(offset); offset += 4; break;
+					case 6: peer['download-queue'] = view.getUint32(offset); offset += 4; break;
+					case 7: peer['upload-queue'] = view.getUint32(offset); offset += 4; break;
+					case 8: peer['total-download'] = read_uint64(view, offset); offset += 8; break;
+					case 9: peer['total-upload'] = read_uint64(view, offset); offset += 8; break;
+					case 10: peer['hash-failures'] = view.getUint32(offset); offset += 4; break;
+					case 11: peer['send-buffer'] = view.getUint32(offset); offset += 4; break;
+					case 12: peer['last-request'] = view.getUint32(offset); offset += 4; break;
+					case 13: peer['last-active'] = view.getUint32(offset); offset += 4; break;
+				}
+			}
+			peers[ep[0]] = peer;
+		}
+
+		var num_removed = view.getUint32(offset);
+		offset += 4;
+		for (var i = 0; i < num_removed; ++i)
+		{
+			var ep = read_endpoint(view, offset);
+			offset += ep[1];
+			delete peers[ep[0]];
+		}
+		self._peers[ih] = peers;
+
+		var ret = [];
+		for (var k in peers) ret.push(peers[k]);
+		if (typeof(callback) !== 'undefined') callback(ret);
+	};
+
+	var call = new ArrayBuffer(27);
+	var view = new DataView(call);
+	// function 24
+	view.setUint8(0, 24);
+	// transaction-id
+	view.setUint16(1, tid);
+
+	var offset = 3;
+	for (var i = 0; i < 40; i += 2)
+	{
+		var b = parseInt(ih.substring(i, i + 2), 16);
+		view.setUint8(offset, b);
+		offset += 1;
+	}
+
+	// frame-number. Only peers that changed since the last call
+	// are returned
+	var frame = this._peer_frames[ih];
+	if (typeof(frame) === 'undefined') frame = 0;
+	view.setUint32(offset, frame);
+
+	console.log('CALL get_peer_updates() tid = ' + tid);
+	this._socket.send(call);
+}
 libtorrent_connection.prototype['start'] = function(info_hashes, callback)
 { this._send_simple_call(1, info_hashes, callback); };
 
@@ -765,6 +1476,70 @@ libtorrent_connection.prototype['set_sequential_download'] = function(info_hashe
 libtorrent_connection.prototype['clear_sequential_download'] = function(info_hashes, callback)
 { this._send_simple_call(13, info_hashes, callback); };
 
+// replaces the labels of the torrents. The callback is passed the number of
+// torrents whose labels were set
+libtorrent_connection.prototype['set_labels'] = function(info_hashes, labels, callback)
+{
+	if (this._socket.readyState != WebSocket.OPEN)
+	{
+		setTimeout( function() { callback("socket closed"); }, 0);
+		return;
+	}
+
+	var tid = this._tid++;
+	if (this._tid > 65535) this._tid = 0;
+
+	// the labels are sent as UTF-8
+	var encoded = [];
+	var size = 3 + 2 + info_hashes.length * 20 + 1;
+	for (var i = 0; i < labels.length; ++i)
+	{
+		encoded.push(unescape(encodeURIComponent(labels[i])));
+		size += 2 + encoded[i].length;
+	}
+
+	var call = new ArrayBuffer(size);
+	var view = new DataView(call);
+	// function 25
+	view.setUint8(0, 25);
+	// transaction-id
+	view.setUint16(1, tid);
+	view.setUint16(3, info_hashes.length);
+
+	var offset = 5;
+	for (ih in info_hashes)
+	{
+		for (var i = 0; i < 40; i += 2)
+		{
+			var b = parseInt(info_hashes[ih].substring(i, i + 2), 16);
+			view.setUint8(offset, b);
+			offset += 1;
+		}
+	}
+	view.setUint8(offset, encoded.length);
+	offset += 1;
+	for (var i = 0; i < encoded.length; ++i)
+	{
+		view.setUint16(offset, encoded[i].length);
+		offset += 2;
+		for (var j = 0; j < encoded[i].length; ++j)
+		{
+			view.setUint8(offset, encoded[i].charCodeAt(j));
+			offset += 1;
+		}
+	}
+
+	this._transactions[tid] = function(view, fun, e)
+	{
+		if (_check_error(e, callback)) return;
+		var num_torrents = view.getUint16(4);
+		if (typeof(callback) !== 'undefined') callback(num_torrents);
+	};
+
+	console.log('CALL set_labels( labels: ' + labels.join(', ') + ' ) tid = ' + tid);
+	this._socket.send(call);
+}
+
 libtorrent_connection.prototype._send_simple_call = function(fun_id, info_hashes, callback)
 {
 	var call = new ArrayBuffer(3 + 2 + info_hashes.length * 20);
@@ -772,7 +1547,7 @@ libtorrent_connection.prototype._send_simple_call = function(fun_id, info_hashes
 
 	if (fun_id < 1 || fun_id > 13)
 	{
-		window.setTimeout( function() { callback("socket closed"); }, 0);
+		setTimeout( function() { callback("socket closed"); }, 0);
 		return;
 	}
 
@@ -836,10 +1611,45 @@ fields =
 	'queue_position': 1 << 19,
 	'state': 1 << 20,
 	'failed_bytes': 1 << 21,
-	'redundant_bytes': 1 << 22
+	'redundant_bytes': 1 << 22,
+	'labels': 1 << 23,
+
+	// only sent in version 2 of the update format. Fields from 31 up don't
+	// fit in the 32 bits of the bit operators, add them to the mask instead
+	'save_path': 1 << 24,
+	'next_announce': 1 << 25,
+	'current_tracker': 1 << 26,
+	'total_payload_uploaded': 1 << 27,
+	'total_payload_downloaded': 1 << 28,
+	'payload_upload_rate': 1 << 29,
+	'payload_download_rate': 1 << 30,
+	'num_complete': Math.pow(2, 31),
+	'num_incomplete': Math.pow(2, 32),
+	'list_seeds': Math.pow(2, 33),
+	'list_peers': Math.pow(2, 34),
+	'connect_candidates': Math.pow(2, 35),
+	'total_done_all': Math.pow(2, 36),
+	'total_wanted': Math.pow(2, 37),
+	'block_size': Math.pow(2, 38),
+	'uploads_limit': Math.pow(2, 39),
+	'connections_limit': Math.pow(2, 40),
+	'storage_mode': Math.pow(2, 41),
+	'up_bandwidth_queue': Math.pow(2, 42),
+	'down_bandwidth_queue': Math.pow(2, 43),
+	'active_time': Math.pow(2, 44),
+	'finished_time': Math.pow(2, 45),
+	'seeding_time': Math.pow(2, 46),
+	'seed_rank': Math.pow(2, 47),
+	'last_scrape': Math.pow(2, 48),
+	'priority': Math.pow(2, 49),
+	'last_seen_complete': Math.pow(2, 50),
+	'time_since_upload': Math.pow(2, 51),
+	'time_since_download': Math.pow(2, 52)
 };
 
-// prevent the compiler from optimizing these away
-window['libtorrent_connection'] = libtorrent_connection;
-window['fields'] = fields;
+// prevent the compiler from optimizing these away. The connection can also
+// be used from a web worker, whose global object is self
+var lt_global = typeof(window) !== 'undefined' ? window : self;
+lt_global['libtorrent_connection'] = libtorrent_connection;
+lt_global['fields'] = fields;
 
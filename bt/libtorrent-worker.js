@@ -0,0 +1,253 @@
+// a web worker that keeps the connection to the bittorrent client, decodes
+// the torrent updates and keeps the state of all torrents, off the page's
+// main thread. The page is posted the changes since the last update, and
+// the order of the torrents when it changes. See torrent-table.js for the
+// page's side.
+//
+// messages from the page:
+//
+//   { 'cmd': 'connect', 'url': url, 'mask': fields }
+//   { 'cmd': 'sort', 'field': name, 'descending': bool }
+//   { 'cmd': 'call', 'id': id, 'fun': name, 'args': [...] }
+//      calls a function of libtorrent_connection, the result is posted back
+//      as { 'type': 'result', 'id': id, 'ret': ... }
+//
+// messages to the page:
+//
+//   { 'type': 'state', 'state': state } the connection's status, "OK" once
+//      connected
+//   { 'type': 'diff', ... } see post_diff()
+//   { 'type': 'order', 'order': Int32Array } the slots of the torrents, in
+//      the order they're sorted in
+
+importScripts('libtorrent-webui.js');
+
+var conn = null;
+
+// torrents are kept in slots. The numeric fields are stored in a typed
+// array per field, the others in plain arrays. The slots of removed torrents
+// are reused
+var capacity = 0;
+var numbers = {};
+var strings = {};
+var info_hashes = [];
+var slots = {};
+var free_slots = [];
+var num_torrents = 0;
+
+// the fields that aren't numbers
+var string_fields = {};
+for (var f = 0; f < torrent_fields_v2.length; ++f)
+{
+	var kind = torrent_fields_v2[f][1];
+	if (kind == 's' || kind == 'labels') string_fields[torrent_fields_v2[f][0]] = true;
+}
+
+var sort_field = null;
+var sort_descending = false;
+
+function grow(size)
+{
+	if (size <= capacity) return;
+	var new_capacity = Math.max(1024, capacity * 2);
+	while (new_capacity < size) new_capacity *= 2;
+	for (var name in numbers)
+	{
+		var a = new Float64Array(new_capacity);
+		a.set(numbers[name]);
+		numbers[name] = a;
+	}
+	capacity = new_capacity;
+}
+
+function column(name)
+{
+	if (string_fields.hasOwnProperty(name))
+	{
+		if (!strings.hasOwnProperty(name)) strings[name] = [];
+		return strings[name];
+	}
+	if (!numbers.hasOwnProperty(name)) numbers[name] = new Float64Array(capacity);
+	return numbers[name];
+}
+
+function clear()
+{
+	numbers = {};
+	strings = {};
+	info_hashes = [];
+	slots = {};
+	free_slots = [];
+	num_torrents = 0;
+	capacity = 0;
+}
+
+// the order of the live torrents by the sort field. Torrents that compare
+// equal keep the order of their slots
+function sorted_order()
+{
+	var order = new Int32Array(num_torrents);
+	var n = 0;
+	for (var i = 0; i < info_hashes.length; ++i)
+		if (info_hashes[i] !== null) order[n++] = i;
+
+	if (sort_field === null) return order;
+
+	var col = column(sort_field);
+	var dir = sort_descending ? -1 : 1;
+	var keys = Array.prototype.slice.call(order);
+	keys.sort(function(a, b)
+	{
+		var va = col[a];
+		var vb = col[b];
+		if (va === undefined) va = '';
+		if (vb === undefined) vb = '';
+		if (va < vb) return -dir;
+		if (va > vb) return dir;
+		return a - b;
+	});
+	order.set(keys);
+	return order;
+}
+
+function post_order()
+{
+	var order = sorted_order();
+	postMessage({ 'type': 'order', 'order': order }, [order.buffer]);
+}
+
+// the diff has the torrents added (with their slots), the slots of the
+// torrents removed, and for each field the slots that changed with their new
+// values. The typed arrays are transferred, not copied
+function post_diff(updates)
+{
+	var added = [];
+	var removed = [];
+	var changed = {};
+	var reorder = false;
+
+	if (updates['reset'])
+	{
+		clear();
+		reorder = true;
+	}
+
+	var removed_hashes = updates['removed'];
+	for (var i = 0; i < removed_hashes.length; ++i)
+	{
+		var ih = removed_hashes[i];
+		if (!slots.hasOwnProperty(ih)) continue;
+		var slot = slots[ih];
+		delete slots[ih];
+		info_hashes[slot] = null;
+		for (var name in numbers) numbers[name][slot] = 0;
+		for (var name in strings) strings[name][slot] = undefined;
+		free_slots.push(slot);
+		removed.push(slot);
+		--num_torrents;
+		reorder = true;
+	}
+
+	for (var ih in updates)
+	{
+		if (ih == 'removed' || ih == 'reset' || ih == 'epoch') continue;
+		var t = updates[ih];
+		var slot;
+		if (slots.hasOwnProperty(ih))
+		{
+			slot = slots[ih];
+		}
+		else
+		{
+			slot = free_slots.length > 0 ? free_slots.pop() : info_hashes.length;
+			grow(slot + 1);
+			slots[ih] = slot;
+			info_hashes[slot] = ih;
+			++num_torrents;
+			added.push([slot, ih]);
+			reorder = true;
+		}
+
+		for (var name in t)
+		{
+			column(name)[slot] = t[name];
+			if (!changed.hasOwnProperty(name)) changed[name] = [];
+			changed[name].push(slot);
+			if (name == sort_field) reorder = true;
+		}
+	}
+
+	var transfer = [];
+	var fields = {};
+	for (var name in changed)
+	{
+		var s = new Int32Array(changed[name]);
+		var col = column(name);
+		var values;
+		if (string_fields.hasOwnProperty(name))
+		{
+			values = [];
+			for (var i = 0; i < s.length; ++i) values.push(col[s[i]]);
+		}
+		else
+		{
+			values = new Float64Array(s.length);
+			for (var i = 0; i < s.length; ++i) values[i] = col[s[i]];
+			transfer.push(values.buffer);
+		}
+		transfer.push(s.buffer);
+		fields[name] = { 'slots': s, 'values': values };
+	}
+
+	var removed_slots = new Int32Array(removed);
+	transfer.push(removed_slots.buffer);
+	postMessage({
+		'type': 'diff',
+		'reset': updates['reset'] === true,
+		'added': added,
+		'removed': removed_slots,
+		'fields': fields,
+		'num_torrents': num_torrents
+	}, transfer);
+
+	if (reorder) post_order();
+}
+
+onmessage = function(ev)
+{
+	var m = ev.data;
+	switch (m['cmd'])
+	{
+		case 'connect':
+			clear();
+			conn = new libtorrent_connection(m['url'], function(state)
+			{
+				postMessage({ 'type': 'state', 'state': state });
+				if (state != 'OK') return;
+				conn['subscribe_updates'](m['mask'], function(updates)
+				{
+					if (typeof(updates) === 'string')
+					{
+						postMessage({ 'type': 'state', 'state': updates });
+						return;
+					}
+					post_diff(updates);
+				});
+			});
+			break;
+		case 'sort':
+			sort_field = m['field'];
+			sort_descending = m['descending'];
+			post_order();
+			break;
+		case 'call':
+			if (conn === null) break;
+			var args = m['args'].slice(0);
+			args.push(function(ret)
+			{
+				postMessage({ 'type': 'result', 'id': m['id'], 'ret': ret });
+			});
+			conn[m['fun']].apply(conn, args);
+			break;
+	}
+};
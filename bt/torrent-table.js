@@ -0,0 +1,227 @@
+// a table of torrents, fed by libtorrent-worker.js, which does the
+// connection and the decoding of the updates. Only the rows scrolled into
+// view exist in the document, and they're redrawn at most once per
+// animation frame, however many updates arrive in between.
+//
+// container is an element for the table to fill, with a fixed height and
+// overflow: auto. columns is a list of [field, title] for the columns, and a
+// column may have a third element, a function formatting its values.
+// options may have:
+//
+//   'row_height'  the height of a row, in pixels (default 20)
+//   'worker'      the url of the worker script (default libtorrent-worker.js)
+//   'controls'    a function returning the content of the first cell of a
+//                 row, given a torrent's info-hash. When not set, there's no
+//                 such cell
+//   'on_state'    called with the state of the connection
+function torrent_table(container, url, columns, options)
+{
+	this._container = container;
+	this._columns = columns;
+	this._options = options || {};
+	this._row_height = this._options['row_height'] || 20;
+
+	// the state of the torrents, mirrored from the worker, by slot
+	this._columns_data = {};
+	this._info_hashes = [];
+	this._order = new Int32Array(0);
+	this._updated = {};
+
+	this._rows = [];
+	this._dirty = false;
+	this._calls = {};
+	this._next_call = 0;
+
+	this._sort_field = null;
+	this._sort_descending = false;
+
+	container.style.overflow = 'auto';
+	container.style.position = 'relative';
+
+	this._table = document.createElement('table');
+	this._table.style.position = 'absolute';
+	this._table.style.top = '0px';
+	this._table.style.borderCollapse = 'collapse';
+	var head = this._table.createTHead().insertRow(-1);
+	var self = this;
+	if (this._options['controls']) head.appendChild(document.createElement('th'));
+	for (var i = 0; i < columns.length; ++i)
+	{
+		var th = document.createElement('th');
+		th.textContent = columns[i][1];
+		th.style.cursor = 'pointer';
+		th.onclick = (function(field) { return function() { self.sort(field); }; })(columns[i][0]);
+		head.appendChild(th);
+	}
+	this._body = document.createElement('tbody');
+	this._table.appendChild(this._body);
+
+	// makes the scrollbar match the number of torrents
+	this._spacer = document.createElement('div');
+	container.appendChild(this._spacer);
+	container.appendChild(this._table);
+	container.onscroll = function() { self._invalidate(); };
+
+	var mask = 0;
+	for (var i = 0; i < columns.length; ++i)
+	{
+		var name = columns[i][0].replace(/-/g, '_');
+		if (fields.hasOwnProperty(name)) mask += fields[name];
+	}
+
+	this._worker = new Worker(this._options['worker'] || 'libtorrent-worker.js');
+	this._worker.onmessage = function(ev) { self._on_message(ev.data); };
+	this._worker.postMessage({ 'cmd': 'connect', 'url': url, 'mask': mask });
+}
+
+// calls a function of libtorrent_connection in the worker. The arguments
+// can't have functions in them, callback is called with the result
+torrent_table.prototype['call'] = function(fun, args, callback)
+{
+	var id = this._next_call++;
+	if (callback) this._calls[id] = callback;
+	this._worker.postMessage({ 'cmd': 'call', 'id': id, 'fun': fun, 'args': args });
+};
+
+// sorts by field. Sorting by the same field again reverses the order
+torrent_table.prototype['sort'] = function(field)
+{
+	if (this._sort_field == field) this._sort_descending = !this._sort_descending;
+	else this._sort_descending = false;
+	this._sort_field = field;
+	this._worker.postMessage({ 'cmd': 'sort', 'field': field
+		, 'descending': this._sort_descending });
+};
+
+torrent_table.prototype._on_message = function(m)
+{
+	switch (m['type'])
+	{
+		case 'state':
+			if (this._options['on_state']) this._options['on_state'](m['state']);
+			break;
+		case 'result':
+			var cb = this._calls[m['id']];
+			delete this._calls[m['id']];
+			if (cb) cb(m['ret']);
+			break;
+		case 'order':
+			this._order = m['order'];
+			this._invalidate();
+			break;
+		case 'diff':
+			this._apply_diff(m);
+			break;
+	}
+};
+
+torrent_table.prototype._apply_diff = function(m)
+{
+	if (m['reset'])
+	{
+		this._columns_data = {};
+		this._info_hashes = [];
+	}
+
+	// the cells changed by this update are highlighted until the next one
+	this._updated = {};
+
+	var removed = m['removed'];
+	for (var i = 0; i < removed.length; ++i)
+	{
+		this._info_hashes[removed[i]] = null;
+		for (var name in this._columns_data)
+			this._columns_data[name][removed[i]] = undefined;
+	}
+
+	var added = m['added'];
+	for (var i = 0; i < added.length; ++i)
+		this._info_hashes[added[i][0]] = added[i][1];
+
+	var f = m['fields'];
+	for (var name in f)
+	{
+		if (!this._columns_data.hasOwnProperty(name)) this._columns_data[name] = [];
+		var col = this._columns_data[name];
+		var slots = f[name]['slots'];
+		var values = f[name]['values'];
+		var updated = {};
+		for (var i = 0; i < slots.length; ++i)
+		{
+			col[slots[i]] = values[i];
+			updated[slots[i]] = true;
+		}
+		this._updated[name] = updated;
+	}
+	this._invalidate();
+};
+
+torrent_table.prototype._invalidate = function()
+{
+	if (this._dirty) return;
+	this._dirty = true;
+	var self = this;
+	requestAnimationFrame(function()
+	{
+		self._dirty = false;
+		self._render();
+	});
+};
+
+// draws the rows in view, reusing the row elements
+torrent_table.prototype._render = function()
+{
+	var order = this._order;
+	var height = this._row_height;
+	var controls = this._options['controls'];
+	this._spacer.style.height = ((order.length + 1) * height) + 'px';
+
+	var first = Math.floor(this._container.scrollTop / height);
+	var count = Math.ceil(this._container.clientHeight / height) + 1;
+	if (first + count > order.length) count = Math.max(0, order.length - first);
+	this._table.style.top = (first * height) + 'px';
+
+	while (this._rows.length < count)
+	{
+		var row = this._body.insertRow(-1);
+		row.style.height = height + 'px';
+		var cells = this._columns.length + (controls ? 1 : 0);
+		for (var j = 0; j < cells; ++j) row.insertCell(-1);
+		this._rows.push(row);
+	}
+
+	for (var i = 0; i < this._rows.length; ++i)
+	{
+		var row = this._rows[i];
+		if (i >= count)
+		{
+			row.style.display = 'none';
+			continue;
+		}
+		row.style.display = '';
+		var slot = order[first + i];
+		var ih = this._info_hashes[slot];
+		var c = 0;
+		if (controls)
+		{
+			// only rebuilt when the row shows another torrent
+			if (row._ih !== ih) row.cells[c].innerHTML = controls(ih);
+			++c;
+		}
+		row._ih = ih;
+		for (var j = 0; j < this._columns.length; ++j, ++c)
+		{
+			var name = this._columns[j][0];
+			var fmt = this._columns[j][2];
+			var col = this._columns_data[name];
+			var v = col === undefined ? undefined : col[slot];
+			var text = v === undefined ? '' : (fmt ? fmt(v) : String(v));
+			var cell = row.cells[c];
+			if (cell.textContent !== text) cell.textContent = text;
+			var updated = this._updated[name];
+			cell.className = updated !== undefined && updated[slot] ? 'updated' : '';
+		}
+	}
+};
+
+window['torrent_table'] = torrent_table;
@@ -36,7 +36,27 @@ from multiprocessing.pool import ThreadPool
 
 thread_pool = ThreadPool(8)
 
-stat = open(sys.argv[1])
+# the logs are written in a binary format (see stats_log.hpp). gnuplot needs
+# them as text, which the stats_log_dump tool converts them to. The text
+# version is kept next to the binary log and only regenerated when the log
+# changes
+def text_log(path):
+	f = open(path, 'rb')
+	magic = f.read(8)
+	f.close()
+	if magic != 'LTSTATS1': return path
+
+	text = os.path.splitext(path)[0] + '.log'
+	try:
+		if os.stat(text).st_mtime > os.stat(path).st_mtime: return text
+	except: pass
+
+	if os.system('./stats_log_dump "%s" >"%s"' % (path, text)) != 0:
+		print 'failed to convert "%s", is stats_log_dump built?' % path
+		sys.exit(1)
+	return text
+
+stat = open(text_log(sys.argv[1]))
 line = stat.readline()
 while not 'second:' in line:
 	line = stat.readline()
@@ -582,7 +602,7 @@ while os.path.exists(os.path.join(log_file_path, log_file)):
 		if not 'type' in options:
 			options['type'] = line_graph
 
-		script = gen_report(i[0], i[1], i[4], i[2], g, os.path.join(log_file_path, log_file), options)
+		script = gen_report(i[0], i[1], i[4], i[2], g, text_log(os.path.join(log_file_path, log_file)), options)
 		if script != None: scripts.append(script)
 	generations.append(g)
 	g += 1
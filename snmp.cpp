@@ -38,38 +38,48 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <libtorrent/thread.hpp>
 #include <libtorrent/alert_types.hpp>
 #include <libtorrent/alert_observer.hpp>
+#include <algorithm>
+#include <libtorrent/performance_counters.hpp>
 
 #include "alert_handler.hpp"
+#include "stats_snapshot.hpp"
 
-using libtorrent::mutex;
-using libtorrent::alert;
-using libtorrent::session_stats_alert;
-using libtorrent::alert_cast;
 using libtorrent::alert_handler;
+using libtorrent::stats_snapshot;
 
 // TODO: could this be moved into snmp_interface?
 // the callback function doesn't appear to have a userdata pointer...
-mutex counter_mutex;
-std::vector<boost::uint64_t> global_counters;
+stats_snapshot const* global_stats = NULL;
 
 u_char* var_counter(struct variable *vp,
 	oid* name, size_t* length, int exact, size_t* var_len
 	, WriteMethod ** write_method)
 {
-	if (vp->namelen != 3) return NULL;
+	if (vp->namelen != 2 || global_stats == NULL) return NULL;
 
-	int counter_index = (int(vp->name[0]) << 24) | (int(vp->name[1]) << 16) | int(vp->name[2]);
+	int counter_index = int(vp->name[1]);
 
-	static boost::uint32_t return_value;
-
-	mutex::scoped_lock l(counter_mutex);
-	if (counter_index < 0 || counter_index >= global_counters.size())
+	if (counter_index < 0 || counter_index >= libtorrent::counters::num_counters)
 		return NULL;
 
-	*var_len = sizeof(boost::uint32_t);
-	// deliberately truncate to 32 bits. That's the SNMP integer size
-	return_value = boost::uint32_t(global_counters[counter_index]);
-	return (u_char*)return_value;
+	// the counters are read from the last published sample, without
+	// locking
+	std::uint64_t const value = global_stats->stats().value(counter_index);
+
+	if (vp->type == ASN_COUNTER64)
+	{
+		static counter64 return_value;
+		return_value.high = value >> 32;
+		return_value.low = value & 0xffffffff;
+		*var_len = sizeof(return_value);
+		return (u_char*)&return_value;
+	}
+
+	// gauges are 32 bits, saturate rather than wrap
+	static u_long return_value;
+	return_value = (std::min)(value, std::uint64_t(0xffffffff));
+	*var_len = sizeof(return_value);
+	return (u_char*)&return_value;
 }
 
 
@@ -99,13 +109,14 @@ std::string write_mib()
 		char buf[1024];
 		snprintf(buf, sizeof(buf)
 			, "%s OBJECT-TYPE\n"
-			"\tSYNTAX INTEGER\n"
+			"\tSYNTAX %s\n"
 			"\tMAX-ACCESS read\n"
 			"\tSTATUS current\n"
 			"\tDESCRIPTION \"\"\n"
 			"\tDEFVAL { 0 }\n"
 			"\t::= { performance_counters %d }\n\n"
-			, i->name, int(std::distance(stats.begin(), i)));
+			, i->name, i->type == stats_metric::type_counter ? "Counter64" : "Gauge32"
+			, int(std::distance(stats.begin(), i)));
 
 		ret += buf;
 	}
@@ -122,13 +133,11 @@ void sighandler(int s)
 	quit = true;
 }
 
-struct snmp_interface : libtorrent::alert_observer
+struct snmp_interface
 {
-	snmp_interface(libtorrent::alert_handler* h)
-		: m_alerts(h)
+	snmp_interface(stats_snapshot const* stats)
 	{
-		m_alerts->subscribe(this, 0
-			, session_stats_alert::alert_type, 0);
+		global_stats = stats;
 
 		using libtorrent::stats_metric;
 
@@ -146,7 +155,7 @@ struct snmp_interface : libtorrent::alert_observer
 			switch (i->type)
 			{
 				case stats_metric::type_counter:
-					m.type = ASN_COUNTER;
+					m.type = ASN_COUNTER64;
 					break;
 				case stats_metric::type_gauge:
 					m.type = ASN_GAUGE;
@@ -185,21 +194,8 @@ struct snmp_interface : libtorrent::alert_observer
 
 	~snmp_interface()
 	{
-		m_alerts->unsubscribe(this);
-	}
-
-	void handle_alert(alert const* a)
-	{
-		session_stats_alert const* su = alert_cast<session_stats_alert>(a);
-		if (su == NULL) return;
-
-		mutex::scoped_lock l(counter_mutex);
-		global_counters.swap(const_cast<session_stats_alert*>(su)->values);
+		global_stats = NULL;
 	}
-
-private:
-
-	libtorrent::alert_handler* m_alerts;
 };
 
 int main()
@@ -217,13 +213,16 @@ int main()
 	signal(SIGINT, &sighandler);
 
 	alert_handler alerts(ses);
-	snmp_interface snmp(&alerts);
+	stats_snapshot stats(ses, &alerts);
+	snmp_interface snmp(&stats);
 
-	while (!quit)
+	// sample the counters once a second, even without any torrents posting
+	// stats_alerts
+	alerts.run([&]
 	{
-		usleep(1000000);
-		alerts.dispatch_alerts();
-		ses.post_session_stats();
-	}
+		if (quit) return false;
+		stats.request(libtorrent::milliseconds(stats_snapshot::sample_interval_ms - 100));
+		return true;
+	}, 1000);
 
 }
@@ -38,6 +38,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <cstdarg>
 #include <memory>
 #include <condition_variable>
+#include <thread>
+#include <atomic>
 
 #include "alert_handler.hpp"
 #include "alert_observer.hpp"
@@ -45,11 +47,107 @@ POSSIBILITY OF SUCH DAMAGE.
 namespace libtorrent
 {
 
+	typedef std::vector<alert_handler::alert_ptr> alert_batch;
+
+	// the queue and thread delivering alerts to a threaded observer
+	struct observer_thread
+	{
+		explicit observer_thread(alert_observer* o)
+			: m_observer(o), m_queued(0), m_stop(false) {}
+
+		// queues up a batch of alerts, waiting for there to be room for it
+		void post(alert_batch& batch)
+		{
+			std::unique_lock<std::mutex> l(m_mutex);
+			while (m_queued >= alert_handler::max_queued_alerts && !m_stop)
+				m_cond.wait(l);
+			if (m_stop) return;
+			m_queued += batch.size();
+			m_batches.push_back(alert_batch());
+			m_batches.back().swap(batch);
+			m_cond.notify_all();
+		}
+
+		// once this returns, the observer won't be called again. Unless it's
+		// called from the observer itself, it also waits for the thread
+		void stop()
+		{
+			std::unique_lock<std::mutex> l(m_mutex);
+			m_stop = true;
+			m_cond.notify_all();
+			l.unlock();
+
+			if (m_thread.get_id() == std::this_thread::get_id())
+				m_thread.detach();
+			else if (m_thread.joinable())
+				m_thread.join();
+		}
+
+		// the thread holds on to the object, it may outlive its entry in
+		// the alert_handler when the observer unsubscribes itself
+		static void start(std::shared_ptr<observer_thread> const& self)
+		{
+			self->m_thread = std::thread(&observer_thread::run, self);
+		}
+
+	private:
+
+		static void run(std::shared_ptr<observer_thread> self)
+		{
+			std::unique_lock<std::mutex> l(self->m_mutex);
+			for (;;)
+			{
+				while (self->m_batches.empty() && !self->m_stop)
+					self->m_cond.wait(l);
+				if (self->m_stop) break;
+
+				alert_batch batch;
+				batch.swap(self->m_batches.front());
+				self->m_batches.pop_front();
+				l.unlock();
+
+				for (alert_batch::iterator i = batch.begin(), end(batch.end());
+					i != end && !self->m_stop; ++i)
+				{
+					self->m_observer->handle_alert(i->get());
+				}
+				if (!self->m_stop) self->m_observer->alerts_dispatched();
+
+				l.lock();
+				self->m_queued -= batch.size();
+				self->m_cond.notify_all();
+			}
+		}
+
+		alert_observer* const m_observer;
+		std::thread m_thread;
+
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
+		std::deque<alert_batch> m_batches;
+
+		// the number of alerts in m_batches
+		int m_queued;
+		std::atomic<bool> m_stop;
+	};
+
 	alert_handler::alert_handler(session& ses)
 		: m_abort(false)
+		, m_alerts_pending(false)
 		, m_ses(ses)
 	{}
 
+	alert_handler::~alert_handler()
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		workers_t workers;
+		workers.swap(m_workers);
+		l.unlock();
+
+		for (workers_t::iterator i = workers.begin(); i != workers.end(); ++i)
+			i->second->stop();
+	}
+
 	void alert_handler::subscribe(alert_observer* o, int flags, ...)
 	{
 		int types[64];
@@ -70,6 +168,14 @@ namespace libtorrent
 
 	void alert_handler::dispatch_alerts(std::vector<alert*>& alerts) const
 	{
+		// the observers that were passed alerts in this batch
+		std::vector<alert_observer*> notified;
+
+		// the alerts for each threaded observer. They're queued up once all
+		// alerts have been seen, as one batch per observer
+		typedef std::map<std::shared_ptr<observer_thread>, alert_batch> batches_t;
+		batches_t batches;
+
 		for (std::vector<alert*>::const_iterator i = alerts.begin()
 			, end(alerts.end()); i != end; ++i)
 		{
@@ -77,28 +183,72 @@ namespace libtorrent
 			int type = a->type();
 
 			// copy this vector since handlers may unsubscribe while we're looping
+			std::unique_lock<std::mutex> l(m_mutex);
 			std::vector<alert_observer*> alert_dispatchers = m_observers[type];
+			std::vector<std::shared_ptr<observer_thread> > threads;
+			if (!m_workers.empty())
 			{
-				for (std::vector<alert_observer*>::const_iterator k = alert_dispatchers.begin()
-					, end(alert_dispatchers.end()); k != end; ++k)
+				for (std::vector<alert_observer*>::iterator k = alert_dispatchers.begin();
+					k != alert_dispatchers.end();)
 				{
-					(*k)->handle_alert(a);
+					workers_t::const_iterator w = m_workers.find(*k);
+					if (w == m_workers.end())
+					{
+						++k;
+						continue;
+					}
+					threads.push_back(w->second);
+					k = alert_dispatchers.erase(k);
 				}
 			}
+			l.unlock();
+
+			for (std::vector<alert_observer*>::const_iterator k = alert_dispatchers.begin()
+				, end(alert_dispatchers.end()); k != end; ++k)
+			{
+				(*k)->handle_alert(a);
+				if (std::find(notified.begin(), notified.end(), *k) == notified.end())
+					notified.push_back(*k);
+			}
 
-			std::deque<promise_t> promises;
+			std::promise<alert_ptr> promise;
+			bool waiting = false;
+			{
+				waiters_t& w = m_waiters[type];
+				std::unique_lock<std::mutex> wl(w.mutex);
+				if (w.waiting)
+				{
+					promise.swap(w.promise);
+					w.future = alert_future();
+					w.waiting = false;
+					waiting = true;
+				}
+			}
 
-			std::unique_lock<std::mutex> l(m_mutex);
-			promises.swap(m_promises[type]);
-			l.unlock();
+			// the alert is only valid until the next time alerts are popped
+			// from the session. The threaded observers and the futures waiting
+			// for it all share one copy of it
+			if (threads.empty() && !waiting) continue;
+			alert_ptr copy(a->clone().release());
 
-			for (std::deque<promise_t>::iterator i = promises.begin()
-				, end(promises.end()); i != end; ++i)
+			for (std::vector<std::shared_ptr<observer_thread> >::iterator k = threads.begin()
+				, end(threads.end()); k != end; ++k)
 			{
-				(*i)->set_value(a->clone().release());
+				batches[*k].push_back(copy);
 			}
+
+			if (waiting) promise.set_value(copy);
 		}
 		alerts.clear();
+
+		for (batches_t::iterator i = batches.begin(); i != batches.end(); ++i)
+			i->first->post(i->second);
+
+		for (std::vector<alert_observer*>::const_iterator i = notified.begin()
+			, end(notified.end()); i != end; ++i)
+		{
+			(*i)->alerts_dispatched();
+		}
 	}
 
 	void alert_handler::dispatch_alerts() const
@@ -108,8 +258,52 @@ namespace libtorrent
 		dispatch_alerts(alert_queue);
 	}
 
+	void alert_handler::on_alert_notify()
+	{
+		// this is called from within the session, it must not call back
+		// into it
+		std::unique_lock<std::mutex> l(m_notify_mutex);
+		m_alerts_pending = true;
+		m_notify_cond.notify_all();
+	}
+
+	void alert_handler::run(std::function<bool()> const& tick, int tick_interval)
+	{
+		typedef std::chrono::steady_clock clock;
+		clock::time_point next_tick = clock::now()
+			+ std::chrono::milliseconds(tick_interval);
+
+		m_ses.set_alert_notify(std::bind(&alert_handler::on_alert_notify, this));
+
+		// the notification only fires when the alert queue goes from empty
+		// to non-empty. Any alerts posted before it was installed are picked
+		// up by this first pass
+		dispatch_alerts();
+
+		for (;;)
+		{
+			std::unique_lock<std::mutex> l(m_notify_mutex);
+			while (!m_alerts_pending && clock::now() < next_tick)
+				m_notify_cond.wait_until(l, next_tick);
+			bool const pending = m_alerts_pending;
+			m_alerts_pending = false;
+			l.unlock();
+
+			if (pending) dispatch_alerts();
+
+			clock::time_point const now = clock::now();
+			if (now < next_tick) continue;
+
+			if (!tick()) break;
+			next_tick = now + std::chrono::milliseconds(tick_interval);
+		}
+
+		m_ses.set_alert_notify(std::function<void()>());
+	}
+
 	void alert_handler::unsubscribe(alert_observer* o)
 	{
+		std::unique_lock<std::mutex> l(m_mutex);
 		for (int i = 0; i < o->num_types; ++i)
 		{
 			int type = o->types[i];
@@ -123,11 +317,29 @@ namespace libtorrent
 			if (j != alert_observers.end()) alert_observers.erase(j);
 		}
 		o->num_types = 0;
+
+		workers_t::iterator w = m_workers.find(o);
+		if (w == m_workers.end()) return;
+		std::shared_ptr<observer_thread> t = w->second;
+		m_workers.erase(w);
+		l.unlock();
+
+		// wait for the observer to not be in a call any more, unless this is
+		// the observer unsubscribing itself
+		t->stop();
 	}
 
 	void alert_handler::subscribe_impl(int const* type_list, int num_types
 		, alert_observer* o, int flags)
 	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		if ((flags & threaded) && m_workers.count(o) == 0)
+		{
+			std::shared_ptr<observer_thread> t = std::make_shared<observer_thread>(o);
+			observer_thread::start(t);
+			m_workers[o] = t;
+		}
+
 		memset(o->types, 0, sizeof(o->types));
 		o->flags = flags;
 		for (int i = 0; i < num_types; ++i)
@@ -148,38 +360,41 @@ namespace libtorrent
 		}
 	}
 
-	std::future<alert*> alert_handler::subscribe_impl(int cat)
+	alert_handler::alert_future alert_handler::subscribe_impl(int type)
 	{
-		std::unique_lock<std::mutex> l(m_mutex);
+		waiters_t& w = m_waiters[type];
+		std::unique_lock<std::mutex> l(w.mutex);
 		if (m_abort)
 		{
-			std::promise<alert*> promise;
-			promise.set_value(NULL);
-			return promise.get_future();
+			std::promise<alert_ptr> promise;
+			promise.set_value(alert_ptr());
+			return promise.get_future().share();
 		}
 
-		m_promises[cat].push_back(std::make_shared<std::promise<alert*> >());
+		if (!w.waiting)
+		{
+			w.promise = std::promise<alert_ptr>();
+			w.future = w.promise.get_future().share();
+			w.waiting = true;
+		}
 		// TODO: enable this alert in the alert mask in m_ses
-		return m_promises[cat].back()->get_future();
+		return w.future;
 	}
 
 	void alert_handler::abort()
 	{
-		std::unique_lock<std::mutex> l(m_mutex);
-
 		m_abort = true;
 
-		std::deque<promise_t> promises;
+		// subscribe_impl() checks m_abort with the type's lock held. Once
+		// we've held each lock, no new waiters can be added
 		for (int i = 0; i < num_alert_types; ++i)
 		{
-			promises.clear();
-			promises.swap(m_promises[i]);
-
-			for (std::deque<promise_t>::iterator i = promises.begin()
-				, end(promises.end()); i != end; ++i)
-			{
-				(*i)->set_value(NULL);
-			}
+			waiters_t& w = m_waiters[i];
+			std::unique_lock<std::mutex> l(w.mutex);
+			if (!w.waiting) continue;
+			w.promise.set_value(alert_ptr());
+			w.future = alert_future();
+			w.waiting = false;
 		}
 	}
 
@@ -39,12 +39,17 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <mutex>
 #include <deque>
 #include <future>
+#include <map>
+#include <functional>
+#include <condition_variable>
+#include <atomic>
 
 namespace libtorrent
 {
 
 struct alert_observer;
 struct alert_handler;
+struct observer_thread;
 
 // block until the specified alert is posted to
 // the alert_handler, return a copy of the alert
@@ -56,6 +61,20 @@ TORRENT_EXPORT std::auto_ptr<alert> wait_for_alert(alert_handler& h, int type);
 struct TORRENT_EXPORT alert_handler
 {
 	alert_handler(session& ses);
+	~alert_handler();
+
+	enum subscribe_flags_t
+	{
+		// the observer is passed its alerts on a thread of its own, in the
+		// same order, instead of on the thread calling dispatch_alerts().
+		// Alerts are copied for it, and alerts_dispatched() is called after
+		// each batch. Such an observer must not expect to be called on any
+		// particular thread. If it falls more than max_queued_alerts behind,
+		// dispatch_alerts() waits for it to catch up
+		threaded = 1
+	};
+
+	enum { max_queued_alerts = 10000 };
 
 	// TODO 2: move the responsibility of picking which
 	// alert types to subscribe to to the observer
@@ -66,9 +85,20 @@ struct TORRENT_EXPORT alert_handler
 	void dispatch_alerts() const;
 	void unsubscribe(alert_observer* o);
 
-	// the future may return NULL if the alert_handler is aborted.
+	// runs the alert loop on the calling thread. Alerts are dispatched as
+	// soon as the session signals that there are any, and tick() is called
+	// every tick_interval milliseconds. Returns once tick() returns false.
+	// No other thread may call dispatch_alerts() while this is running
+	void run(std::function<bool()> const& tick, int tick_interval = 500);
+
+	typedef std::shared_ptr<alert const> alert_ptr;
+	typedef std::shared_future<alert_ptr> alert_future;
+
+	// everyone waiting for the next alert of a type is handed the same
+	// future, and the same copy of the alert. The future holds NULL if the
+	// alert_handler is aborted.
 	template <class T>
-	std::future<alert*> subscribe()
+	alert_future subscribe()
 	{
 		return subscribe_impl(T::alert_type);
 	}
@@ -78,18 +108,40 @@ struct TORRENT_EXPORT alert_handler
 private:
 
 	void subscribe_impl(int const* type_list, int num_types, alert_observer* o, int flags);
-	std::future<alert*> subscribe_impl(int cat);
+	alert_future subscribe_impl(int type);
+
+	// called by the session, from its own thread, when alerts are posted
+	void on_alert_notify();
 
 	std::vector<alert_observer*> m_observers[num_alert_types];
 
+	// the observers subscribed as threaded, and their threads
+	typedef std::map<alert_observer*, std::shared_ptr<observer_thread> > workers_t;
+	workers_t m_workers;
+
+	// protects m_observers and m_workers
 	mutable std::mutex m_mutex;
-	using promise_t = std::shared_ptr<std::promise<alert*> >;
-	mutable std::deque<promise_t> m_promises[num_alert_types];
+
+	// the (std::future-based) subscriptions to the next alert of one type
+	struct waiters_t
+	{
+		waiters_t() : waiting(false) {}
+		std::mutex mutex;
+		bool waiting;
+		std::promise<alert_ptr> promise;
+		alert_future future;
+	};
+	mutable waiters_t m_waiters[num_alert_types];
 
 	// when set to true, all outstanding (std::future-based) subscriptions
 	// are cancelled, and new such subscriptions are disabled, by failing
 	// immediately
-	bool m_abort;
+	std::atomic<bool> m_abort;
+
+	// set by on_alert_notify() to wake up run()
+	std::mutex m_notify_mutex;
+	std::condition_variable m_notify_cond;
+	bool m_alerts_pending;
 
 	session& m_ses;
 };
@@ -47,6 +47,11 @@ struct alert_observer
 
 	alert_observer(): num_types(0), flags(0) {}
 	virtual void handle_alert(alert const* a) = 0;
+
+	// called once at the end of each dispatch_alerts() in which this
+	// observer was passed at least one alert. Observers that batch up work
+	// per alert can flush it here
+	virtual void alerts_dispatched() {}
 private:
 	std::uint8_t types[64];
 	int num_types;
@@ -0,0 +1,495 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "alert_trace.hpp"
+#include "alert_handler.hpp"
+#include "status_encoding.hpp"
+
+#include "libtorrent/session.hpp"
+#include "libtorrent/alert_types.hpp"
+#include "libtorrent/bencode.hpp"
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+namespace libtorrent
+{
+namespace
+{
+	char const magic[] = "LTALERT1";
+	int const magic_size = 8;
+
+	void write_varint(std::vector<char>& out, std::uint64_t v)
+	{
+		while (v >= 0x80)
+		{
+			out.push_back(char(v | 0x80));
+			v >>= 7;
+		}
+		out.push_back(char(v));
+	}
+
+	void write_signed(std::vector<char>& out, std::int64_t v)
+	{
+		write_varint(out, (std::uint64_t(v) << 1) ^ std::uint64_t(v >> 63));
+	}
+
+	void write_string(std::vector<char>& out, std::string const& s)
+	{
+		write_varint(out, s.size());
+		out.insert(out.end(), s.begin(), s.end());
+	}
+
+	void write_hash(std::vector<char>& out, sha1_hash const& h)
+	{
+		out.insert(out.end(), h.begin(), h.end());
+	}
+
+	// returns false if the varint runs past end
+	bool read_varint(char const*& ptr, char const* end, std::uint64_t& v)
+	{
+		v = 0;
+		for (int shift = 0; ptr != end && shift < 64; shift += 7)
+		{
+			std::uint8_t const c = std::uint8_t(*ptr++);
+			v |= std::uint64_t(c & 0x7f) << shift;
+			if ((c & 0x80) == 0) return true;
+		}
+		return false;
+	}
+
+	// reads a signed varint into any integer or enum type
+	template <class T>
+	bool read_int(char const*& ptr, char const* end, T& v)
+	{
+		std::uint64_t u;
+		if (!read_varint(ptr, end, u)) return false;
+		v = T(std::int64_t(u >> 1) ^ -std::int64_t(u & 1));
+		return true;
+	}
+
+	bool read_string(char const*& ptr, char const* end, std::string& s)
+	{
+		std::uint64_t len;
+		if (!read_varint(ptr, end, len) || len > std::uint64_t(end - ptr)) return false;
+		s.assign(ptr, len);
+		ptr += len;
+		return true;
+	}
+
+	bool read_hash(char const*& ptr, char const* end, sha1_hash& h)
+	{
+		if (end - ptr < sha1_hash::size) return false;
+		std::copy(ptr, ptr + sha1_hash::size, h.begin());
+		ptr += sha1_hash::size;
+		return true;
+	}
+
+	// reads a varint from the (uncompressed) gzip stream
+	bool read_varint(gzFile f, std::uint64_t& v)
+	{
+		v = 0;
+		for (int shift = 0; shift < 64; shift += 7)
+		{
+			int const c = gzgetc(f);
+			if (c < 0) return false;
+			v |= std::uint64_t(c & 0x7f) << shift;
+			if ((c & 0x80) == 0) return true;
+		}
+		return false;
+	}
+
+	error_code errno_error()
+	{
+		return error_code(errno, boost::system::generic_category());
+	}
+
+	bool all_torrents(torrent_status const&) { return true; }
+}
+
+alert_trace_writer::alert_trace_writer()
+	: m_file(NULL)
+	, m_batch_size(0)
+	, m_last_timestamp(0)
+{}
+
+alert_trace_writer::~alert_trace_writer()
+{
+	close();
+}
+
+bool alert_trace_writer::open(std::string const& filename
+	, std::int64_t start_time, error_code& ec)
+{
+	close();
+
+	errno = 0;
+	m_file = gzopen(filename.c_str(), "wb");
+	if (m_file == NULL)
+	{
+		ec = errno ? errno_error() : error_code(boost::system::errc::not_enough_memory
+			, boost::system::generic_category());
+		return false;
+	}
+
+	std::vector<char> header(magic, magic + magic_size);
+	write_varint(header, start_time);
+	gzwrite(m_file, &header[0], header.size());
+	m_last_timestamp = 0;
+	return true;
+}
+
+void alert_trace_writer::torrent_added(torrent_status const& st)
+{
+	m_batch.push_back(trace_alert::torrent_added);
+	encode_status(m_batch, st);
+	++m_batch_size;
+}
+
+void alert_trace_writer::state_update(std::vector<torrent_status> const& st)
+{
+	m_batch.push_back(trace_alert::state_update);
+	write_varint(m_batch, st.size());
+	for (std::vector<torrent_status>::const_iterator i = st.begin()
+		, end(st.end()); i != end; ++i)
+	{
+		encode_status(m_batch, *i);
+	}
+	++m_batch_size;
+}
+
+void alert_trace_writer::torrent_alert(int type, sha1_hash const& ih)
+{
+	TORRENT_ASSERT(type == trace_alert::torrent_removed
+		|| type == trace_alert::torrent_finished
+		|| type == trace_alert::metadata_received
+		|| type == trace_alert::resume_failed);
+	m_batch.push_back(type);
+	write_hash(m_batch, ih);
+	++m_batch_size;
+}
+
+void alert_trace_writer::torrent_updated(sha1_hash const& old_ih
+	, sha1_hash const& new_ih)
+{
+	m_batch.push_back(trace_alert::torrent_updated);
+	write_hash(m_batch, old_ih);
+	write_hash(m_batch, new_ih);
+	++m_batch_size;
+}
+
+void alert_trace_writer::resume_saved(sha1_hash const& ih, entry const& resume_data)
+{
+	m_batch.push_back(trace_alert::resume_saved);
+	write_hash(m_batch, ih);
+	std::vector<char> buf;
+	bencode(std::back_inserter(buf), resume_data);
+	write_varint(m_batch, buf.size());
+	m_batch.insert(m_batch.end(), buf.begin(), buf.end());
+	++m_batch_size;
+}
+
+void alert_trace_writer::rss_item(feed_item const& item)
+{
+	m_batch.push_back(trace_alert::rss_item);
+	write_hash(m_batch, item.info_hash);
+	write_string(m_batch, item.url);
+	write_string(m_batch, item.uuid);
+	write_string(m_batch, item.title);
+	write_string(m_batch, item.description);
+	write_string(m_batch, item.comment);
+	write_string(m_batch, item.category);
+	write_signed(m_batch, item.size);
+	++m_batch_size;
+}
+
+void alert_trace_writer::end_batch(std::int64_t timestamp)
+{
+	if (m_batch_size == 0 || m_file == NULL) return;
+
+	std::vector<char> header;
+	write_varint(header, timestamp - m_last_timestamp);
+	write_varint(header, m_batch_size);
+	write_varint(header, m_batch.size());
+	gzwrite(m_file, &header[0], header.size());
+	gzwrite(m_file, &m_batch[0], m_batch.size());
+
+	m_last_timestamp = timestamp;
+	m_batch.clear();
+	m_batch_size = 0;
+}
+
+void alert_trace_writer::close()
+{
+	if (m_file == NULL) return;
+	end_batch(m_last_timestamp);
+	gzclose(m_file);
+	m_file = NULL;
+}
+
+alert_recorder::alert_recorder(session& ses, alert_handler* h)
+	: m_ses(ses)
+	, m_alerts(h)
+	, m_batch_time(-1)
+{}
+
+alert_recorder::~alert_recorder()
+{
+	stop();
+}
+
+bool alert_recorder::start(std::string const& filename, error_code& ec)
+{
+	stop();
+	if (!m_trace.open(filename, time(NULL), ec)) return false;
+	m_start = time_now();
+
+	std::vector<torrent_status> torrents;
+	m_ses.get_torrent_status(&torrents, &all_torrents, 0xffffffff);
+	for (std::vector<torrent_status>::iterator i = torrents.begin()
+		, end(torrents.end()); i != end; ++i)
+	{
+		m_trace.torrent_added(*i);
+	}
+	m_trace.end_batch(0);
+
+	m_alerts->subscribe(this, 0, add_torrent_alert::alert_type
+		, state_update_alert::alert_type
+		, torrent_removed_alert::alert_type
+		, torrent_finished_alert::alert_type
+		, metadata_received_alert::alert_type
+		, torrent_update_alert::alert_type
+		, save_resume_data_alert::alert_type
+		, save_resume_data_failed_alert::alert_type
+		, rss_item_alert::alert_type
+		, 0);
+	return true;
+}
+
+void alert_recorder::stop()
+{
+	if (!m_trace.is_open()) return;
+	m_alerts->unsubscribe(this);
+	m_trace.close();
+	m_batch_time = -1;
+}
+
+void alert_recorder::handle_alert(alert const* a)
+{
+	if (!m_trace.is_open()) return;
+
+	if (m_batch_time < 0)
+		m_batch_time = total_microseconds(time_now() - m_start);
+
+	if (add_torrent_alert const* ta = alert_cast<add_torrent_alert>(a))
+	{
+		// failed adds leave nothing behind for the observers to track
+		if (ta->error) return;
+		m_trace.torrent_added(ta->handle.status());
+	}
+	else if (state_update_alert const* su = alert_cast<state_update_alert>(a))
+	{
+		m_trace.state_update(su->status);
+	}
+	else if (torrent_removed_alert const* td = alert_cast<torrent_removed_alert>(a))
+	{
+		m_trace.torrent_alert(trace_alert::torrent_removed, td->info_hash);
+	}
+	else if (torrent_finished_alert const* tf = alert_cast<torrent_finished_alert>(a))
+	{
+		m_trace.torrent_alert(trace_alert::torrent_finished, tf->handle.info_hash());
+	}
+	else if (metadata_received_alert const* mr = alert_cast<metadata_received_alert>(a))
+	{
+		m_trace.torrent_alert(trace_alert::metadata_received, mr->handle.info_hash());
+	}
+	else if (torrent_update_alert const* tu = alert_cast<torrent_update_alert>(a))
+	{
+		m_trace.torrent_updated(tu->old_ih, tu->new_ih);
+	}
+	else if (save_resume_data_alert const* sr = alert_cast<save_resume_data_alert>(a))
+	{
+		if (sr->resume_data)
+			m_trace.resume_saved(sr->handle.info_hash(), *sr->resume_data);
+	}
+	else if (save_resume_data_failed_alert const* sf = alert_cast<save_resume_data_failed_alert>(a))
+	{
+		m_trace.torrent_alert(trace_alert::resume_failed, sf->handle.info_hash());
+	}
+	else if (rss_item_alert const* ri = alert_cast<rss_item_alert>(a))
+	{
+		m_trace.rss_item(ri->item);
+	}
+}
+
+void alert_recorder::alerts_dispatched()
+{
+	if (m_batch_time < 0) return;
+	m_trace.end_batch(m_batch_time);
+	m_batch_time = -1;
+}
+
+alert_trace_reader::alert_trace_reader()
+	: m_file(NULL)
+	, m_start_time(0)
+	, m_timestamp(0)
+{}
+
+alert_trace_reader::~alert_trace_reader()
+{
+	if (m_file) gzclose(m_file);
+}
+
+bool alert_trace_reader::open(std::string const& filename, error_code& ec)
+{
+	if (m_file) gzclose(m_file);
+	m_timestamp = 0;
+	m_alerts.clear();
+
+	errno = 0;
+	m_file = gzopen(filename.c_str(), "rb");
+	if (m_file == NULL)
+	{
+		ec = errno ? errno_error() : error_code(boost::system::errc::not_enough_memory
+			, boost::system::generic_category());
+		return false;
+	}
+
+	char header[magic_size];
+	std::uint64_t start_time;
+	if (gzread(m_file, header, magic_size) != magic_size
+		|| memcmp(header, magic, magic_size) != 0
+		|| !read_varint(m_file, start_time))
+	{
+		ec.assign(boost::system::errc::invalid_argument, boost::system::generic_category());
+		gzclose(m_file);
+		m_file = NULL;
+		return false;
+	}
+	m_start_time = start_time;
+	return true;
+}
+
+bool alert_trace_reader::next()
+{
+	m_alerts.clear();
+	if (m_file == NULL) return false;
+
+	std::uint64_t delta;
+	std::uint64_t num_alerts;
+	std::uint64_t size;
+	if (!read_varint(m_file, delta)
+		|| !read_varint(m_file, num_alerts)
+		|| !read_varint(m_file, size)
+		|| size == 0 || size > 0x7fffffff)
+		return false;
+
+	std::vector<char> buf(size);
+	if (gzread(m_file, &buf[0], unsigned(size)) != int(size)) return false;
+
+	// every alert takes at least one byte
+	if (num_alerts > size) return false;
+	m_alerts.resize(num_alerts);
+	char const* ptr = &buf[0];
+	char const* const end = ptr + size;
+	for (std::vector<trace_alert>::iterator i = m_alerts.begin()
+		, alerts_end(m_alerts.end()); i != alerts_end; ++i)
+	{
+		trace_alert& ta = *i;
+		if (ptr == end) return false;
+		ta.type = std::uint8_t(*ptr++);
+		switch (ta.type)
+		{
+			case trace_alert::torrent_added:
+				ta.status.resize(1);
+				if (!decode_status(ptr, end, ta.status[0])) return false;
+				ta.info_hash = ta.status[0].info_hash;
+				break;
+			case trace_alert::state_update:
+			{
+				std::uint64_t num;
+				if (!read_varint(ptr, end, num) || num > std::uint64_t(end - ptr))
+					return false;
+				ta.status.resize(num);
+				for (std::vector<torrent_status>::iterator k = ta.status.begin()
+					, status_end(ta.status.end()); k != status_end; ++k)
+				{
+					if (!decode_status(ptr, end, *k)) return false;
+				}
+				break;
+			}
+			case trace_alert::torrent_removed:
+			case trace_alert::torrent_finished:
+			case trace_alert::metadata_received:
+			case trace_alert::resume_failed:
+				if (!read_hash(ptr, end, ta.info_hash)) return false;
+				break;
+			case trace_alert::torrent_updated:
+				if (!read_hash(ptr, end, ta.info_hash)
+					|| !read_hash(ptr, end, ta.new_info_hash))
+					return false;
+				break;
+			case trace_alert::resume_saved:
+			{
+				std::uint64_t len;
+				if (!read_hash(ptr, end, ta.info_hash)
+					|| !read_varint(ptr, end, len)
+					|| len > std::uint64_t(end - ptr))
+					return false;
+				ta.resume_data = boost::make_shared<entry>(bdecode(ptr, ptr + len));
+				ptr += len;
+				break;
+			}
+			case trace_alert::rss_item:
+				if (!read_hash(ptr, end, ta.item.info_hash)
+					|| !read_string(ptr, end, ta.item.url)
+					|| !read_string(ptr, end, ta.item.uuid)
+					|| !read_string(ptr, end, ta.item.title)
+					|| !read_string(ptr, end, ta.item.description)
+					|| !read_string(ptr, end, ta.item.comment)
+					|| !read_string(ptr, end, ta.item.category)
+					|| !read_int(ptr, end, ta.item.size))
+					return false;
+				ta.info_hash = ta.item.info_hash;
+				break;
+			default:
+				return false;
+		}
+	}
+
+	m_timestamp += delta;
+	return true;
+}
+
+}
+
@@ -0,0 +1,209 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_ALERT_TRACE_HPP
+#define TORRENT_ALERT_TRACE_HPP
+
+#include "alert_observer.hpp"
+#include "libtorrent/error_code.hpp"
+#include "libtorrent/torrent_status.hpp"
+#include "libtorrent/rss.hpp"
+#include "libtorrent/entry.hpp"
+#include "libtorrent/time.hpp"
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <zlib.h>
+
+namespace libtorrent
+{
+	struct alert_handler;
+	class session;
+
+	/*
+		A recording of the alerts torrent_history, save_resume and
+		rss_filter_handler consume. The file is a gzip stream of:
+
+			"LTALERT1"            magic
+			varint                the unix time the recording was started
+
+		followed by one record per call to dispatch_alerts():
+
+			varint                microseconds since the previous batch
+			varint                number of alerts in the batch
+			varint                size of the alerts, in bytes
+			(uint8, payload)...   the type and payload of each alert
+
+		Torrents are identified by their info-hash, since handles don't
+		outlive the session. The torrents already in the session when the
+		recording starts make up a first batch of torrent_added alerts.
+		A trace cut short can be read up to its last complete batch.
+	*/
+
+	struct trace_alert
+	{
+		enum type_t
+		{
+			// status holds the torrent
+			torrent_added,
+			// status holds every torrent in the update
+			state_update,
+			torrent_removed,
+			torrent_finished,
+			metadata_received,
+			// info_hash is the old info-hash
+			torrent_updated,
+			resume_saved,
+			resume_failed,
+			rss_item,
+
+			num_types
+		};
+
+		trace_alert(): type(torrent_added) {}
+
+		int type;
+		sha1_hash info_hash;
+
+		// torrent_updated
+		sha1_hash new_info_hash;
+
+		// torrent_added and state_update
+		std::vector<torrent_status> status;
+
+		// resume_saved
+		boost::shared_ptr<entry> resume_data;
+
+		// rss_item
+		feed_item item;
+	};
+
+	struct alert_trace_writer
+	{
+		alert_trace_writer();
+		~alert_trace_writer();
+
+		// creates (or truncates) filename and writes the header to it
+		bool open(std::string const& filename, std::int64_t start_time
+			, error_code& ec);
+
+		bool is_open() const { return m_file != NULL; }
+
+		// these add an alert to the current batch
+		void torrent_added(torrent_status const& st);
+		void state_update(std::vector<torrent_status> const& st);
+		// for the alerts that only carry an info-hash
+		void torrent_alert(int type, sha1_hash const& ih);
+		void torrent_updated(sha1_hash const& old_ih, sha1_hash const& new_ih);
+		void resume_saved(sha1_hash const& ih, entry const& resume_data);
+		void rss_item(feed_item const& item);
+
+		// writes the current batch, if it's not empty. timestamp is when the
+		// batch was dispatched, in microseconds since the start time
+		void end_batch(std::int64_t timestamp);
+
+		// writes the current batch and closes the file
+		void close();
+
+	private:
+
+		gzFile m_file;
+
+		// the encoded alerts of the current batch
+		std::vector<char> m_batch;
+		int m_batch_size;
+
+		std::int64_t m_last_timestamp;
+	};
+
+	// records the alerts it's subscribed to, one batch per dispatch
+	struct alert_recorder : alert_observer
+	{
+		alert_recorder(session& ses, alert_handler* h);
+		~alert_recorder();
+
+		// the torrents already in the session are recorded as a first batch
+		// of torrent_added alerts
+		bool start(std::string const& filename, error_code& ec);
+		void stop();
+
+		bool is_recording() const { return m_trace.is_open(); }
+
+		virtual void handle_alert(alert const* a);
+		virtual void alerts_dispatched();
+
+	private:
+
+		session& m_ses;
+		alert_handler* m_alerts;
+
+		alert_trace_writer m_trace;
+
+		time_point m_start;
+
+		// when the first alert of the batch being dispatched was seen, or
+		// -1 if it's not been seen yet
+		std::int64_t m_batch_time;
+	};
+
+	struct alert_trace_reader
+	{
+		alert_trace_reader();
+		~alert_trace_reader();
+
+		// returns false if the file can't be opened or isn't a trace
+		bool open(std::string const& filename, error_code& ec);
+
+		std::int64_t start_time() const { return m_start_time; }
+
+		// advances to the next batch. Returns false at the end of the trace,
+		// or at the first incomplete or corrupt batch
+		bool next();
+
+		// the microseconds between the start of the recording and the
+		// current batch
+		std::int64_t timestamp() const { return m_timestamp; }
+
+		std::vector<trace_alert> const& alerts() const { return m_alerts; }
+
+	private:
+
+		gzFile m_file;
+		std::int64_t m_start_time;
+		std::int64_t m_timestamp;
+		std::vector<trace_alert> m_alerts;
+	};
+}
+
+#endif
+
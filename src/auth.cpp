@@ -44,6 +44,9 @@ extern "C" {
 #include <string.h> // for strcmp() 
 #include <stdio.h>
 #include <sys/time.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 
 namespace libtorrent
 {
@@ -51,6 +54,111 @@ namespace libtorrent
 const static read_only_permissions read_perms;
 const static full_permissions full_perms;
 
+namespace {
+
+	// a recently verified Authorization header. The cache is direct-mapped
+	// by the digest of the header and the auth_interface that verified it.
+	// Each slot is guarded by a sequence lock, so lookups never block. A
+	// lookup racing with a store is a miss, and a store racing with another
+	// one is dropped.
+	struct cached_credential
+	{
+		cached_credential()
+			: seq(0), auth(NULL), perms(NULL), expires(0), generation(0)
+		{
+			for (int i = 0; i < 5; ++i) digest[i] = 0;
+		}
+
+		// odd while the slot is being written to
+		std::atomic<std::uint32_t> seq;
+
+		std::atomic<std::uint32_t> digest[5];
+		std::atomic<auth_interface const*> auth;
+		std::atomic<permissions_interface const*> perms;
+
+		// in seconds, on the steady clock
+		std::atomic<std::int64_t> expires;
+
+		// the value of credential_generation when this was verified
+		std::atomic<std::uint32_t> generation;
+	};
+
+	enum { credential_cache_size = 1024 };
+
+	cached_credential credential_cache[credential_cache_size];
+
+	// incremented to invalidate every entry in the cache
+	std::atomic<std::uint32_t> credential_generation(0);
+
+	std::int64_t now_seconds()
+	{
+		return std::chrono::duration_cast<std::chrono::seconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	sha1_hash credential_key(char const* header, auth_interface const* a)
+	{
+		hasher h;
+		h.update((char const*)&a, sizeof(a));
+		h.update(header, strlen(header));
+		return h.final();
+	}
+
+	permissions_interface const* lookup_credential(sha1_hash const& key
+		, auth_interface const* a)
+	{
+		std::uint32_t words[5];
+		memcpy(words, &key[0], sizeof(words));
+		cached_credential& e = credential_cache[words[0] % credential_cache_size];
+
+		std::uint32_t const seq = e.seq.load(std::memory_order_acquire);
+		if (seq & 1) return NULL;
+
+		bool match = true;
+		for (int i = 0; i < 5; ++i)
+			if (e.digest[i].load(std::memory_order_relaxed) != words[i]) match = false;
+		auth_interface const* auth = e.auth.load(std::memory_order_relaxed);
+		permissions_interface const* perms = e.perms.load(std::memory_order_relaxed);
+		std::int64_t const expires = e.expires.load(std::memory_order_relaxed);
+		std::uint32_t const generation = e.generation.load(std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (e.seq.load(std::memory_order_relaxed) != seq) return NULL;
+
+		if (!match || auth != a) return NULL;
+		if (generation != credential_generation.load(std::memory_order_relaxed)) return NULL;
+		if (expires < now_seconds()) return NULL;
+		return perms;
+	}
+
+	void store_credential(sha1_hash const& key, auth_interface const* a
+		, permissions_interface const* perms, std::uint32_t generation)
+	{
+		std::uint32_t words[5];
+		memcpy(words, &key[0], sizeof(words));
+		cached_credential& e = credential_cache[words[0] % credential_cache_size];
+
+		std::uint32_t seq = e.seq.load(std::memory_order_relaxed);
+		if ((seq & 1) || !e.seq.compare_exchange_strong(seq, seq + 1
+			, std::memory_order_relaxed)) return;
+		std::atomic_thread_fence(std::memory_order_release);
+
+		for (int i = 0; i < 5; ++i)
+			e.digest[i].store(words[i], std::memory_order_relaxed);
+		e.auth.store(a, std::memory_order_relaxed);
+		e.perms.store(perms, std::memory_order_relaxed);
+		e.expires.store(now_seconds() + credential_cache_ttl, std::memory_order_relaxed);
+		e.generation.store(generation, std::memory_order_relaxed);
+
+		e.seq.store(seq + 2, std::memory_order_release);
+	}
+}
+
+void flush_credential_cache()
+{
+	credential_generation.fetch_add(1);
+}
+
 auth::auth()
 {
 	// default groups are:
@@ -110,6 +218,7 @@ void auth::add_account(std::string const& user, std::string const& pwd, int grou
 	{
 		i->second.hash = i->second.password_hash(pwd);
 		i->second.group = group;
+		flush_credential_cache();
 	}
 }
 
@@ -125,6 +234,7 @@ void auth::remove_account(std::string const& user)
 	std::map<std::string, account_t>::iterator i = m_accounts.find(user);
 	if (i == m_accounts.end()) return;
 	m_accounts.erase(i);
+	flush_credential_cache();
 }
 
 /**
@@ -144,6 +254,7 @@ void auth::set_group(int g, permissions_interface const* perms)
 	if (g >= m_groups.size())
 		m_groups.resize(g+1, NULL);
 	m_groups[g] = perms;
+	flush_credential_cache();
 }
 
 /**
@@ -225,6 +336,7 @@ void auth::load_accounts(std::string const& filename, error_code& ec)
 	std::unique_lock<std::mutex> l(m_mutex);
 
 	m_accounts.clear();
+	flush_credential_cache();
 
 	char username[512];
 	char pwdhash[41];
@@ -250,12 +362,25 @@ void auth::load_accounts(std::string const& filename, error_code& ec)
 	\param conn the mongoos connection object
 	\param auth the auth_interface object
 	\return the permission object appropriate for the user, or NULL in case authentication failed.
+
+	Successful authentications are remembered for credential_cache_ttl seconds.
+	Within that time, a request with the same Authorization header is only looked
+	up in the cache, without asking auth.
 */
 permissions_interface const* parse_http_auth(mg_connection* conn, auth_interface const* auth)
 {
 	std::string user;
 	std::string pwd;
 	char const* authorization = mg_get_header(conn, "authorization");
+
+	sha1_hash const key = credential_key(authorization ? authorization : "", auth);
+	permissions_interface const* cached = lookup_credential(key, auth);
+	if (cached) return cached;
+
+	// if the accounts change while we verify, the result mustn't be cached
+	// as valid for the new generation
+	std::uint32_t const generation = credential_generation.load();
+
 	if (authorization)
 	{
 		authorization = strcasestr(authorization, "basic ");
@@ -275,6 +400,7 @@ permissions_interface const* parse_http_auth(mg_connection* conn, auth_interface
 
 	permissions_interface const* perms = auth->find_user(user, pwd);
 	if (perms == NULL) return NULL;
+	store_credential(key, auth, perms, generation);
 	return perms;
 }
 
@@ -48,6 +48,14 @@ namespace libtorrent
 {
 	permissions_interface const* parse_http_auth(mg_connection* conn, auth_interface const* auth);
 
+	/// forgets all credentials parse_http_auth() has verified. This must be
+	/// called when an account's password or permissions change (auth does
+	/// this itself), or the old ones remain valid for up to
+	/// credential_cache_ttl seconds
+	void flush_credential_cache();
+
+	enum { credential_cache_ttl = 60 };
+
 	/**
 		Implements simple access control. Users can be added, removed, saved and load from
 		a plain text file. Access permissions are controlled via groups. There are two default
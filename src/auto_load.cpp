@@ -33,13 +33,21 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "auto_load.hpp"
 
 #include <functional>
+#include <future>
+#include <thread>
 
 #include "libtorrent/add_torrent_params.hpp"
 #include "libtorrent/torrent_info.hpp"
 #include "libtorrent/session.hpp"
 #include "libtorrent/error_code.hpp"
+#include "libtorrent/file.hpp"
 #include "save_settings.hpp"
 
+#if defined __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
 using namespace std::placeholders;
 
 namespace libtorrent
@@ -48,8 +56,13 @@ namespace libtorrent
 auto_load::auto_load(session& s, save_settings_interface* sett)
 	: m_ses(s)
 	, m_timer(m_ios)
+	, m_retry_timer(m_ios)
 	, m_settings(sett)
 	, m_remove_files(true)
+#if defined __linux__
+	, m_watch(m_ios)
+	, m_events(4096)
+#endif
 	, m_dir("./autoload")
 	, m_scan_interval(20)
 	, m_abort(false)
@@ -75,6 +88,8 @@ auto_load::~auto_load()
 	m_abort = true;
 	l.unlock();
 	m_timer.cancel();
+	m_retry_timer.cancel();
+	m_ios.post(std::bind(&auto_load::stop_watch, this));
 	m_thread.join();
 }
 
@@ -110,6 +125,8 @@ void auto_load::set_auto_load_dir(std::string const& dir)
 	if (m_settings) m_settings->set_str("autoload_dir", dir);
 	l.unlock();
 
+	m_ios.post(std::bind(&auto_load::start_watch, this));
+
 	// reset the timeout to use the new interval
 	error_code ec;
 	m_timer.expires_from_now(seconds(0), ec);
@@ -124,11 +141,15 @@ void auto_load::set_scan_interval(int s)
 	if (m_settings) m_settings->set_int("autoload_interval", s);
 	l.unlock();
 
+	// this stops the watch if auto loading was disabled
+	m_ios.post(std::bind(&auto_load::start_watch, this));
+
 	// interval of 0 means disabled
 	if (m_scan_interval == 0)
 	{
 		error_code ec;
 		m_timer.cancel(ec);
+		m_retry_timer.cancel(ec);
 		return;
 	}
 
@@ -157,55 +178,295 @@ void auto_load::thread_fun()
 	}
 }
 
-void auto_load::on_scan(error_code const& e)
+void auto_load::prune_loaded(std::vector<std::string> const& names)
 {
-	if (e) return;
+	boost::unordered_set<std::string> present(names.begin(), names.end());
+	for (boost::unordered_set<std::string>::iterator i = m_already_loaded.begin();
+		i != m_already_loaded.end();)
+	{
+		if (present.count(*i)) ++i;
+		else i = m_already_loaded.erase(i);
+	}
+	for (boost::unordered_set<std::string>::iterator i = m_failed.begin();
+		i != m_failed.end();)
+	{
+		if (present.count(*i)) ++i;
+		else i = m_failed.erase(i);
+	}
+}
+
+bool auto_load::watching() const
+{
+#if defined __linux__
+	return m_watch.is_open();
+#else
+	return false;
+#endif
+}
+
+void auto_load::stop_watch()
+{
+#if defined __linux__
+	// this cancels the outstanding read
+	error_code ec;
+	m_watch.close(ec);
+#endif
+}
+
+void auto_load::start_watch()
+{
+	stop_watch();
+
+#if defined __linux__
 	std::unique_lock<std::mutex> l(m_mutex);
-	if (m_abort) return;
+	if (m_abort || m_scan_interval == 0) return;
+	std::string path = m_dir;
+	l.unlock();
 
-	// interval of 0 means disabled
-	if (m_scan_interval == 0) return;
-	
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) return;
+
+	// IN_CLOSE_WRITE is posted once a file has been completely written,
+	// IN_MOVED_TO when it's been moved into the directory. IN_DELETE and
+	// IN_MOVED_FROM tell us which names to forget
+	if (inotify_add_watch(fd, path.c_str()
+		, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM) < 0)
+	{
+		::close(fd);
+		return;
+	}
+
+	error_code ec;
+	m_watch.assign(fd, ec);
+	if (ec)
+	{
+		::close(fd);
+		return;
+	}
+	async_read_events();
+#endif
+}
+
+#if defined __linux__
+void auto_load::async_read_events()
+{
+	m_watch.async_read_some(boost::asio::buffer(m_events)
+		, std::bind(&auto_load::on_events, this, _1, _2));
+}
+
+void auto_load::on_events(error_code const& e, std::size_t bytes)
+{
+	if (e == boost::asio::error::operation_aborted) return;
+
+	std::unique_lock<std::mutex> l(m_mutex);
+	if (m_abort) return;
 	std::string path = m_dir;
 	bool remove_files = m_remove_files;
 	l.unlock();
 
 	error_code ec;
-	for (directory dir(path, ec); !ec && !dir.done(); dir.next(ec))
+	if (e)
 	{
-		if (extension(dir.file()) != ".torrent") continue;
-		if (m_already_loaded.count(dir.file()))
+		// fall back to scanning the directory
+		stop_watch();
+		m_timer.expires_from_now(seconds(0), ec);
+		m_timer.async_wait(std::bind(&auto_load::on_scan, this, _1));
+		return;
+	}
+
+	std::vector<std::string> names;
+	bool rescan = false;
+	bool lost_watch = false;
+	for (char const* i = &m_events[0], *end = i + bytes; i < end;)
+	{
+		inotify_event const* ev = reinterpret_cast<inotify_event const*>(i);
+		i += sizeof(inotify_event) + ev->len;
+
+		// if events were dropped, or the directory went away, we don't know
+		// what we've missed
+		if (ev->mask & IN_Q_OVERFLOW) rescan = true;
+		if (ev->mask & IN_IGNORED) lost_watch = true;
+		if (ev->mask & (IN_Q_OVERFLOW | IN_IGNORED)) continue;
+		if (ev->len == 0) continue;
+
+		std::string name(ev->name);
+		if (extension(name) != ".torrent") continue;
+
+		if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
 		{
-			if (remove_files)
-			{
-				std::string file_path = combine_path(path, dir.file());
-				remove(file_path, ec);
-				if (!ec) m_already_loaded.erase(m_already_loaded.find(dir.file()));
-			}
+			m_already_loaded.erase(name);
+			m_failed.erase(name);
 			continue;
 		}
+		names.push_back(name);
+	}
 
-		error_code tec;
-		std::string file_path = combine_path(path, dir.file());
-		shared_ptr<torrent_info> ti = libtorrent::make_shared<torrent_info>(file_path, boost::ref(tec));
+	if (!names.empty()) load_files(path, names, remove_files);
 
-		// assume the file isn't fully written yet.
-		if (tec) continue;
+	// the scan tries to watch the directory again
+	if (lost_watch) stop_watch();
 
-		l.lock();
-		add_torrent_params p = m_params_model;
-		l.unlock();
+	if (rescan || lost_watch)
+	{
+		m_timer.expires_from_now(seconds(0), ec);
+		m_timer.async_wait(std::bind(&auto_load::on_scan, this, _1));
+	}
+
+	if (watching()) async_read_events();
+}
+#endif
+
+namespace
+{
+	// parses every stride'th file in names, starting at first. The files
+	// that fail to parse are left as NULL in ret
+	void parse_torrents(std::string const& path
+		, std::vector<std::string> const& names
+		, std::vector<shared_ptr<torrent_info> >& ret
+		, int first, int stride)
+	{
+		for (int i = first; i < int(names.size()); i += stride)
+		{
+			error_code ec;
+			shared_ptr<torrent_info> ti = libtorrent::make_shared<torrent_info>(
+				combine_path(path, names[i]), boost::ref(ec));
+			if (!ec) ret[i] = ti;
+		}
+	}
+}
 
-		p.ti = ti;
+void auto_load::load_files(std::string const& path
+	, std::vector<std::string>& names, bool remove_files)
+{
+	error_code ec;
+	for (std::vector<std::string>::iterator i = names.begin(); i != names.end();)
+	{
+		if (m_already_loaded.count(*i) == 0)
+		{
+			++i;
+			continue;
+		}
+
+		if (remove_files)
+		{
+			remove(combine_path(path, *i), ec);
+			if (!ec) m_already_loaded.erase(*i);
+		}
+		i = names.erase(i);
+	}
+	if (names.empty()) return;
+
+	// the parsing is what's expensive. Split it up across threads, this
+	// one included
+	std::vector<shared_ptr<torrent_info> > torrents(names.size());
+	int threads = (std::min)(int(names.size())
+		, (std::max)(1, int(std::thread::hardware_concurrency())));
+	std::vector<std::future<void> > jobs;
+	for (int i = 1; i < threads; ++i)
+	{
+		jobs.push_back(std::async(std::launch::async, &parse_torrents
+			, std::cref(path), std::cref(names), std::ref(torrents), i, threads));
+	}
+	parse_torrents(path, names, torrents, 0, threads);
+	for (std::vector<std::future<void> >::iterator i = jobs.begin()
+		, end(jobs.end()); i != end; ++i)
+	{
+		i->wait();
+	}
+
+	std::unique_lock<std::mutex> l(m_mutex);
+	add_torrent_params model = m_params_model;
+	l.unlock();
+
+	bool failed = false;
+	for (int i = 0; i < int(names.size()); ++i)
+	{
+		// assume the file isn't fully written yet. Try it again later
+		if (!torrents[i])
+		{
+			m_failed.insert(names[i]);
+			failed = true;
+			continue;
+		}
+		m_failed.erase(names[i]);
+
+		add_torrent_params p = model;
+		p.ti = torrents[i];
 		m_ses.async_add_torrent(p);
 
 		// TODO: there should be a configuration option to
 		// move the torrent file into a different directory
 		if (remove_files)
-			remove(file_path, ec);
+			remove(combine_path(path, names[i]), ec);
 		else
-			m_already_loaded.insert(dir.file());
+			m_already_loaded.insert(names[i]);
+	}
+
+	// without a watch, the periodic scan picks up the failed files again
+	if (!failed || !watching()) return;
+
+	l.lock();
+	int interval = m_scan_interval;
+	l.unlock();
+	if (interval == 0) return;
+
+	m_retry_timer.expires_from_now(seconds(interval), ec);
+	m_retry_timer.async_wait(std::bind(&auto_load::on_retry, this, _1));
+}
+
+void auto_load::on_retry(error_code const& e)
+{
+	if (e) return;
+	std::unique_lock<std::mutex> l(m_mutex);
+	if (m_abort || m_scan_interval == 0) return;
+	std::string path = m_dir;
+	bool remove_files = m_remove_files;
+	l.unlock();
+
+	// the ones that have left the directory are dropped
+	std::vector<std::string> names;
+	for (boost::unordered_set<std::string>::iterator i = m_failed.begin()
+		, end(m_failed.end()); i != end; ++i)
+	{
+		if (exists(combine_path(path, *i))) names.push_back(*i);
 	}
+	m_failed.clear();
+	if (!names.empty()) load_files(path, names, remove_files);
+}
+
+void auto_load::on_scan(error_code const& e)
+{
+	if (e) return;
+	std::unique_lock<std::mutex> l(m_mutex);
+	if (m_abort) return;
+
+	// interval of 0 means disabled
+	if (m_scan_interval == 0) return;
+	
+	std::string path = m_dir;
+	bool remove_files = m_remove_files;
+	l.unlock();
+
+	// if the directory couldn't be watched before (maybe it didn't exist),
+	// try again. Once it's watched, this scan only needs to pick up files
+	// that were added before the watch started
+	if (!watching()) start_watch();
+
+	error_code ec;
+	std::vector<std::string> names;
+	for (directory dir(path, ec); !ec && !dir.done(); dir.next(ec))
+	{
+		if (extension(dir.file()) != ".torrent") continue;
+		names.push_back(dir.file());
+	}
+
+	// this is the full listing, names that aren't in it have left the
+	// directory
+	if (!ec) prune_loaded(names);
+	load_files(path, names, remove_files);
+
+	// new files are picked up as they're added
+	if (watching()) return;
 
 	l.lock();
 	int interval = m_scan_interval;
@@ -219,4 +480,3 @@ void auto_load::on_scan(error_code const& e)
 }
 
 }
-
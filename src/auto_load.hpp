@@ -37,6 +37,12 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/deadline_timer.hpp"
 #include "libtorrent/io_service.hpp"
 #include <mutex>
+#include <vector>
+#include <boost/unordered_set.hpp>
+
+#if defined __linux__
+#include <boost/asio/posix/stream_descriptor.hpp>
+#endif
 
 namespace libtorrent
 {
@@ -63,21 +69,60 @@ namespace libtorrent
 
 		void on_scan(error_code const& ec);
 
+		// tries to load the files that failed to parse again
+		void on_retry(error_code const& ec);
+
+		// adds the .torrent files with these names in path, parsing them in
+		// parallel. Files that have been loaded already are skipped. The ones
+		// that fail to parse are retried at the next scan interval
+		void load_files(std::string const& path, std::vector<std::string>& names
+			, bool remove_files);
+
+		// (re)starts watching m_dir for new files. If it's not possible
+		// (or not supported), the directory is scanned periodically instead
+		void start_watch();
+		void stop_watch();
+		bool watching() const;
+
+#if defined __linux__
+		void async_read_events();
+		void on_events(error_code const& e, std::size_t bytes);
+#endif
+
+		// forgets the loaded names that aren't in names, the full
+		// listing of the directory
+		void prune_loaded(std::vector<std::string> const& names);
+
 		void thread_fun();
 
 		session& m_ses;
 		boost::asio::io_service m_ios;
 		deadline_timer m_timer;
+		deadline_timer m_retry_timer;
 		save_settings_interface* m_settings;
 
 		// whether or not to remove .torrent files
 		// as they are loaded
 		bool m_remove_files;
 
-		// when not removing files, keep track of
-		// the ones we've already loaded to not
-		// add them again
-		std::set<std::string> m_already_loaded;
+		// when not removing files, keep track of the ones we've already
+		// loaded to not add them again. Names are forgotten once the file
+		// leaves the directory (when it's deleted, moved away or missing from
+		// a scan), so this never outgrows the directory itself
+		boost::unordered_set<std::string> m_already_loaded;
+
+		// the files that failed to parse, most likely because they weren't
+		// fully written yet. They're retried every scan interval until
+		// they load or leave the directory
+		boost::unordered_set<std::string> m_failed;
+
+#if defined __linux__
+		// the inotify instance watching m_dir. While it's open, files are
+		// picked up as they have been written or moved into the directory,
+		// rather than by periodic scans
+		boost::asio::posix::stream_descriptor m_watch;
+		std::vector<char> m_events;
+#endif
 
 		add_torrent_params m_params_model;
 		std::string m_dir;
@@ -85,7 +130,8 @@ namespace libtorrent
 		bool m_abort;
 
 		// used to protect m_abort, m_scan_interval, m_dir,
-		// m_remove_files and m_params_model
+		// m_remove_files and m_params_model. The rest is only
+		// touched by m_thread
 		mutable std::mutex m_mutex;
 
 		// this needs to be last in order to be initialized
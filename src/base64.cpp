@@ -30,30 +30,407 @@ POSSIBILITY OF SUCH DAMAGE.
 
 */
 
+#include "base64.hpp"
+
 #include <string>
 #include <string.h>
+#include <stdint.h>
+#include <algorithm>
 
-extern "C" {
-#include "cdecode.h"
-}
+// the x86 codecs are picked at runtime, based on what the CPU supports.
+// SSE2 (for the constants) is part of x86-64, so 32 bit builds just use the
+// scalar code
+#if defined __GNUC__ && defined __x86_64__
+#define TORRENT_BASE64_X86 1
+#include <immintrin.h>
+#elif defined __ARM_NEON && defined __aarch64__
+#define TORRENT_BASE64_NEON 1
+#include <arm_neon.h>
+#endif
 
 namespace libtorrent
 {
 
+namespace
+{
+	char const alphabet[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	// maps characters to their 6 bit values, or 0xff for characters
+	// outside of the alphabet
+	struct decode_table_t
+	{
+		decode_table_t()
+		{
+			memset(v, 0xff, sizeof(v));
+			for (int i = 0; i < 64; ++i) v[uint8_t(alphabet[i])] = uint8_t(i);
+		}
+		uint8_t v[256];
+	};
+	decode_table_t const decode_table;
+
+	// the vectorized codecs process as many whole blocks as they can
+	// starting at in, and advance in and out past them. Decoding stops at
+	// the first block with a character outside of the alphabet, which is
+	// then left to the scalar code
+	typedef void (*blocks_fun)(char const*& in, char const* end, char*& out);
+
+	void no_blocks(char const*&, char const*, char*&) {}
+
+#ifdef TORRENT_BASE64_X86
+
+	// these are the classic SSSE3 base64 algorithms. decode_block()
+	// translates 16 characters to their 6 bit values by looking up the high
+	// and low nibble of each, and fails if any of them is outside the
+	// alphabet. pack_block() then merges the 6 bit values into 12 bytes,
+	// at the bottom of each 16 byte lane
+
+	__m128i const decode_lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11
+		, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	__m128i const decode_lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08
+		, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	__m128i const decode_lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71
+		, 0, 0, 0, 0, 0, 0, 0, 0);
+	__m128i const pack_shuffle = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8
+		, 14, 13, 12, -1, -1, -1, -1);
+
+	// spreads 12 bytes over 16, two bytes for every character
+	__m128i const encode_shuffle = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7
+		, 10, 9, 11, 10);
+	__m128i const encode_lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52
+		, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52
+		, '+' - 62, '/' - 63, 'A', 0, 0);
+
+	__attribute__((target("ssse3")))
+	bool decode_block(__m128i& str)
+	{
+		__m128i const mask_2f = _mm_set1_epi8(0x2f);
+		__m128i const hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+		__m128i const lo_nibbles = _mm_and_si128(str, mask_2f);
+		__m128i const hi = _mm_shuffle_epi8(decode_lut_hi, hi_nibbles);
+		__m128i const lo = _mm_shuffle_epi8(decode_lut_lo, lo_nibbles);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi)
+			, _mm_setzero_si128())) != 0xffff) return false;
+
+		__m128i const eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+		__m128i const roll = _mm_shuffle_epi8(decode_lut_roll
+			, _mm_add_epi8(eq_2f, hi_nibbles));
+		str = _mm_add_epi8(str, roll);
+		return true;
+	}
+
+	__attribute__((target("ssse3")))
+	__m128i pack_block(__m128i str)
+	{
+		str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+		str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+		return _mm_shuffle_epi8(str, pack_shuffle);
+	}
+
+	// the opposite of decode_block() and pack_block(), turns the first 12
+	// bytes of in into 16 characters
+	__attribute__((target("ssse3")))
+	__m128i encode_block(__m128i in)
+	{
+		in = _mm_shuffle_epi8(in, encode_shuffle);
+		__m128i const t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+		__m128i const t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+		__m128i const t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+		__m128i const t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+		__m128i const indices = _mm_or_si128(t1, t3);
+
+		__m128i offset = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+		__m128i const less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+		offset = _mm_or_si128(offset, _mm_and_si128(less, _mm_set1_epi8(13)));
+		return _mm_add_epi8(_mm_shuffle_epi8(encode_lut, offset), indices);
+	}
+
+	__attribute__((target("ssse3")))
+	void decode_blocks_ssse3(char const*& in, char const* end, char*& out)
+	{
+		// each block writes 16 bytes of which 12 are used. With at least 24
+		// characters left, the output buffer has room for that
+		while (end - in >= 24)
+		{
+			__m128i str = _mm_loadu_si128(reinterpret_cast<__m128i const*>(in));
+			if (!decode_block(str)) break;
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out), pack_block(str));
+			in += 16;
+			out += 12;
+		}
+	}
+
+	__attribute__((target("ssse3")))
+	void encode_blocks_ssse3(char const*& in, char const* end, char*& out)
+	{
+		// each block reads 16 bytes of which 12 are encoded
+		while (end - in >= 16)
+		{
+			__m128i const str = _mm_loadu_si128(reinterpret_cast<__m128i const*>(in));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out), encode_block(str));
+			in += 12;
+			out += 16;
+		}
+	}
+
+	// the AVX2 versions do the same thing on two 16 byte lanes at a time
+
+	__attribute__((target("avx2")))
+	void decode_blocks_avx2(char const*& in, char const* end, char*& out)
+	{
+		__m256i const lut_lo = _mm256_broadcastsi128_si256(decode_lut_lo);
+		__m256i const lut_hi = _mm256_broadcastsi128_si256(decode_lut_hi);
+		__m256i const lut_roll = _mm256_broadcastsi128_si256(decode_lut_roll);
+		__m256i const shuffle = _mm256_broadcastsi128_si256(pack_shuffle);
+		__m256i const mask_2f = _mm256_set1_epi8(0x2f);
+
+		// each block writes 32 bytes of which 24 are used, which needs at
+		// least 48 characters left to fit in the output buffer
+		while (end - in >= 48)
+		{
+			__m256i str = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(in));
+			__m256i const hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+			__m256i const lo_nibbles = _mm256_and_si256(str, mask_2f);
+			__m256i const hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+			__m256i const lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+			if (!_mm256_testz_si256(lo, hi)) break;
+
+			__m256i const eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+			str = _mm256_add_epi8(str, _mm256_shuffle_epi8(lut_roll
+				, _mm256_add_epi8(eq_2f, hi_nibbles)));
+
+			str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+			str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+			str = _mm256_shuffle_epi8(str, shuffle);
+			// move the 12 bytes of the upper lane down next to the lower one
+			str = _mm256_permutevar8x32_epi32(str, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), str);
+			in += 32;
+			out += 24;
+		}
+	}
+
+	__attribute__((target("avx2")))
+	void encode_blocks_avx2(char const*& in, char const* end, char*& out)
+	{
+		__m256i const shuffle = _mm256_broadcastsi128_si256(encode_shuffle);
+		__m256i const lut = _mm256_broadcastsi128_si256(encode_lut);
+
+		// the two lanes are loaded from in and in + 12, which reads 28 bytes
+		while (end - in >= 28)
+		{
+			__m256i str = _mm256_inserti128_si256(_mm256_castsi128_si256(
+				_mm_loadu_si128(reinterpret_cast<__m128i const*>(in)))
+				, _mm_loadu_si128(reinterpret_cast<__m128i const*>(in + 12)), 1);
+
+			str = _mm256_shuffle_epi8(str, shuffle);
+			__m256i const t0 = _mm256_and_si256(str, _mm256_set1_epi32(0x0fc0fc00));
+			__m256i const t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+			__m256i const t2 = _mm256_and_si256(str, _mm256_set1_epi32(0x003f03f0));
+			__m256i const t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+			__m256i const indices = _mm256_or_si256(t1, t3);
+
+			__m256i offset = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+			__m256i const less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+			offset = _mm256_or_si256(offset, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+			str = _mm256_add_epi8(_mm256_shuffle_epi8(lut, offset), indices);
+
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), str);
+			in += 24;
+			out += 32;
+		}
+	}
+
+#endif // TORRENT_BASE64_X86
+
+#ifdef TORRENT_BASE64_NEON
+
+	// NEON has de-interleaving loads and stores, which take care of
+	// splitting 64 characters into the four characters of each group, and
+	// table lookups of up to 64 bytes, which handle the translation
+
+	uint8x16x4_t load_table(uint8_t const* t)
+	{
+		uint8x16x4_t ret;
+		ret.val[0] = vld1q_u8(t);
+		ret.val[1] = vld1q_u8(t + 16);
+		ret.val[2] = vld1q_u8(t + 32);
+		ret.val[3] = vld1q_u8(t + 48);
+		return ret;
+	}
+
+	void decode_blocks_neon(char const*& in, char const* end, char*& out)
+	{
+		uint8x16x4_t const lut_lo = load_table(decode_table.v);
+		uint8x16x4_t const lut_hi = load_table(decode_table.v + 64);
+		uint8x16_t const offset = vdupq_n_u8(64);
+
+		while (end - in >= 64)
+		{
+			uint8x16x4_t str = vld4q_u8(reinterpret_cast<uint8_t const*>(in));
+
+			// characters >= 128 miss both tables and are caught by their
+			// high bit, just like the 0xff of invalid characters
+			uint8x16_t error = vdupq_n_u8(0);
+			for (int i = 0; i < 4; ++i)
+			{
+				uint8x16_t const c = str.val[i];
+				str.val[i] = vqtbx4q_u8(vqtbl4q_u8(lut_lo, c), lut_hi, vsubq_u8(c, offset));
+				error = vorrq_u8(error, vorrq_u8(c, str.val[i]));
+			}
+			if (vmaxvq_u8(error) >= 0x80) break;
+
+			uint8x16x3_t bytes;
+			bytes.val[0] = vorrq_u8(vshlq_n_u8(str.val[0], 2), vshrq_n_u8(str.val[1], 4));
+			bytes.val[1] = vorrq_u8(vshlq_n_u8(str.val[1], 4), vshrq_n_u8(str.val[2], 2));
+			bytes.val[2] = vorrq_u8(vshlq_n_u8(str.val[2], 6), str.val[3]);
+			vst3q_u8(reinterpret_cast<uint8_t*>(out), bytes);
+			in += 64;
+			out += 48;
+		}
+	}
+
+	void encode_blocks_neon(char const*& in, char const* end, char*& out)
+	{
+		uint8x16x4_t const lut = load_table(reinterpret_cast<uint8_t const*>(alphabet));
+
+		while (end - in >= 48)
+		{
+			uint8x16x3_t const bytes = vld3q_u8(reinterpret_cast<uint8_t const*>(in));
+
+			uint8x16x4_t str;
+			str.val[0] = vshrq_n_u8(bytes.val[0], 2);
+			str.val[1] = vorrq_u8(vandq_u8(vshlq_n_u8(bytes.val[0], 4), vdupq_n_u8(0x30))
+				, vshrq_n_u8(bytes.val[1], 4));
+			str.val[2] = vorrq_u8(vandq_u8(vshlq_n_u8(bytes.val[1], 2), vdupq_n_u8(0x3c))
+				, vshrq_n_u8(bytes.val[2], 6));
+			str.val[3] = vandq_u8(bytes.val[2], vdupq_n_u8(0x3f));
+			for (int i = 0; i < 4; ++i)
+				str.val[i] = vqtbl4q_u8(lut, str.val[i]);
+			vst4q_u8(reinterpret_cast<uint8_t*>(out), str);
+			in += 48;
+			out += 64;
+		}
+	}
+
+#endif // TORRENT_BASE64_NEON
+
+	struct codec_t
+	{
+		char const* name;
+		blocks_fun decode;
+		blocks_fun encode;
+	};
+
+	codec_t pick_codec()
+	{
+		codec_t c = { "scalar", &no_blocks, &no_blocks };
+#if defined TORRENT_BASE64_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+		{
+			c.name = "avx2";
+			c.decode = &decode_blocks_avx2;
+			c.encode = &encode_blocks_avx2;
+		}
+		else if (__builtin_cpu_supports("ssse3"))
+		{
+			c.name = "ssse3";
+			c.decode = &decode_blocks_ssse3;
+			c.encode = &encode_blocks_ssse3;
+		}
+#elif defined TORRENT_BASE64_NEON
+		c.name = "neon";
+		c.decode = &decode_blocks_neon;
+		c.encode = &encode_blocks_neon;
+#endif
+		return c;
+	}
+
+	codec_t const& codec()
+	{
+		static codec_t const c = pick_codec();
+		return c;
+	}
+}
+
+int base64_decode(char const* in, int len, char* out)
+{
+	blocks_fun const blocks = codec().decode;
+	char const* const end = in + len;
+	char* ptr = out;
+
+	// the bits decoded but not yet written. Whenever nbits is 0 we're at
+	// the start of a group of 4 characters, where the vectorized decoder
+	// can pick up
+	uint32_t bits = 0;
+	int nbits = 0;
+
+	while (in != end)
+	{
+		blocks(in, end, ptr);
+
+		// decode whatever stopped the vectorized decoder (typically white
+		// space or padding) one character at a time, and continue up to
+		// the end of the next group
+		char const* const stop = end - in > 64 ? in + 64 : end;
+		for (; in != end && (in < stop || nbits != 0); ++in)
+		{
+			int const v = decode_table.v[uint8_t(*in)];
+			if (v == 0xff) continue;
+			bits = (bits << 6) | v;
+			nbits += 6;
+			if (nbits < 8) continue;
+			nbits -= 8;
+			*ptr++ = char(bits >> nbits);
+		}
+	}
+	return int(ptr - out);
+}
+
+int base64_encode(char const* in, int len, char* out)
+{
+	char const* const end = in + len;
+	char* ptr = out;
+
+	codec().encode(in, end, ptr);
+
+	for (; end - in >= 3; in += 3)
+	{
+		uint32_t const v = (uint32_t(uint8_t(in[0])) << 16)
+			| (uint32_t(uint8_t(in[1])) << 8) | uint8_t(in[2]);
+		*ptr++ = alphabet[v >> 18];
+		*ptr++ = alphabet[(v >> 12) & 0x3f];
+		*ptr++ = alphabet[(v >> 6) & 0x3f];
+		*ptr++ = alphabet[v & 0x3f];
+	}
+
+	if (in != end)
+	{
+		uint32_t v = uint32_t(uint8_t(in[0])) << 16;
+		if (end - in > 1) v |= uint32_t(uint8_t(in[1])) << 8;
+		*ptr++ = alphabet[v >> 18];
+		*ptr++ = alphabet[(v >> 12) & 0x3f];
+		*ptr++ = end - in > 1 ? alphabet[(v >> 6) & 0x3f] : '=';
+		*ptr++ = '=';
+	}
+	return int(ptr - out);
+}
+
 std::string base64decode(std::string const& in)
 {
 	std::string ret;
 	if (in.size() < 4) return ret;
 
-	// approximate length of output
-	ret.resize(in.size() * 6 / 8 + 1);
-
-	base64_decodestate ctx;
-	base64_init_decodestate(&ctx);
-	int len = base64_decode_block(in.c_str(), in.size(), &ret[0], &ctx);
-	ret.resize(len);
+	ret.resize(base64_decoded_size(in.size()));
+	ret.resize(base64_decode(in.c_str(), in.size(), &ret[0]));
 	return ret;
 }
 
+char const* base64_implementation()
+{
+	return codec().name;
+}
+
 }
 
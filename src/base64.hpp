@@ -37,7 +37,28 @@ POSSIBILITY OF SUCH DAMAGE.
 
 namespace libtorrent
 {
+	// the number of bytes base64_decode() may write when decoding len
+	// characters, and the number of characters base64_encode() writes when
+	// encoding len bytes
+	inline int base64_decoded_size(int len) { return len / 4 * 3 + 3; }
+	inline int base64_encoded_size(int len) { return (len + 2) / 3 * 4; }
+
+	// decodes len base64 characters from in into out, which must have room
+	// for base64_decoded_size(len) bytes. Characters outside of the base64
+	// alphabet (like white space and padding) are skipped. Returns the
+	// number of bytes written
+	int base64_decode(char const* in, int len, char* out);
+
+	// encodes len bytes from in into out, with padding. out must have room
+	// for base64_encoded_size(len) characters. Returns the number of
+	// characters written
+	int base64_encode(char const* in, int len, char* out);
+
 	std::string base64decode(std::string const& in);
+
+	// the name of the implementation picked for this CPU, "avx2", "ssse3",
+	// "neon" or "scalar"
+	char const* base64_implementation();
 }
 
 #endif
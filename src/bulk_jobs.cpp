@@ -0,0 +1,327 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "bulk_jobs.hpp"
+#include "session_set.hpp"
+#include "auth_interface.hpp"
+
+#include "libtorrent/session.hpp"
+#include "libtorrent/torrent_handle.hpp"
+#include "libtorrent/assert.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+namespace libtorrent
+{
+	namespace
+	{
+		void apply_to_sessions(session_set& sessions, int op
+			, sha1_hash const& ih, std::string const& path)
+		{
+			torrent_handle h = sessions.find_torrent(ih);
+			if (!h.is_valid()) return;
+
+			switch (op)
+			{
+				case bulk_jobs::remove_op:
+					sessions.remove_torrent(h);
+					break;
+				case bulk_jobs::remove_data_op:
+					sessions.remove_torrent(h, session::delete_files);
+					break;
+				case bulk_jobs::recheck_op:
+					h.force_recheck();
+					break;
+				case bulk_jobs::move_op:
+					h.move_storage(path);
+					break;
+			}
+		}
+	}
+
+	bool bulk_jobs::pending_key::operator<(pending_key const& rhs) const
+	{
+		if (ih != rhs.ih) return ih < rhs.ih;
+		if (op != rhs.op) return op < rhs.op;
+		return path < rhs.path;
+	}
+
+	bulk_jobs::bulk_jobs(session_set& sessions, int rate)
+		: m_apply(std::bind(&apply_to_sessions, std::ref(sessions)
+			, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3))
+		, m_next_id(1)
+		, m_rate(rate)
+		, m_quit(false)
+	{
+		m_thread = std::thread(&bulk_jobs::worker_thread, this);
+	}
+
+	bulk_jobs::bulk_jobs(apply_fun const& fun, int rate)
+		: m_apply(fun)
+		, m_next_id(1)
+		, m_rate(rate)
+		, m_quit(false)
+	{
+		m_thread = std::thread(&bulk_jobs::worker_thread, this);
+	}
+
+	bulk_jobs::~bulk_jobs()
+	{
+		{
+			std::unique_lock<std::mutex> l(m_mutex);
+			m_quit = true;
+		}
+		m_cond.notify_all();
+		m_thread.join();
+	}
+
+	char const* bulk_jobs::operation_name(int op)
+	{
+		static char const* const names[] = { "remove", "remove-data", "recheck", "move" };
+		if (op < 0 || op >= num_operations) return "";
+		return names[op];
+	}
+
+	bool bulk_jobs::allowed(permissions_interface const* p, int op)
+	{
+		switch (op)
+		{
+			case remove_op: return p->allow_remove();
+			case remove_data_op: return p->allow_remove() && p->allow_remove_data();
+			case recheck_op: return p->allow_recheck();
+			// like the other changes to a torrent's properties
+			case move_op: return p->allow_set_settings(-1);
+		}
+		return false;
+	}
+
+	int bulk_jobs::submit(int op, std::vector<sha1_hash> const& torrents
+		, std::string const& path)
+	{
+		std::shared_ptr<job> j = std::make_shared<job>();
+		j->st.operation = op;
+		j->st.path = path;
+		j->st.done = 0;
+		j->st.cancelled = false;
+		j->st.finished = false;
+
+		std::unique_lock<std::mutex> l(m_mutex);
+		j->st.id = m_next_id;
+
+		int first_pending = 0;
+		pending_key k;
+		k.op = op;
+		k.path = path;
+		for (std::vector<sha1_hash>::const_iterator i = torrents.begin()
+			, end(torrents.end()); i != end; ++i)
+		{
+			k.ih = *i;
+
+			// removing a torrent twice would have the second one find it
+			// gone. If one of them deletes the data, the first one does
+			if (op == remove_op || op == remove_data_op)
+			{
+				pending_key other = k;
+				other.op = op == remove_op ? remove_data_op : remove_op;
+				std::map<pending_key, int>::iterator o = m_pending.find(other);
+				if (o != m_pending.end())
+				{
+					if (op == remove_data_op) upgrade(o->second, *i);
+					if (first_pending == 0) first_pending = o->second;
+					continue;
+				}
+			}
+
+			std::pair<std::map<pending_key, int>::iterator, bool> r
+				= m_pending.insert(std::make_pair(k, j->st.id));
+			if (!r.second)
+			{
+				if (first_pending == 0) first_pending = r.first->second;
+				continue;
+			}
+			j->torrents.push_back(*i);
+		}
+
+		// everything was already queued. There's nothing to add
+		if (j->torrents.empty() && first_pending != 0) return first_pending;
+
+		++m_next_id;
+		j->st.total = int(j->torrents.size());
+		m_jobs.push_back(j);
+		if (j->torrents.empty()) finish(j);
+		l.unlock();
+		m_cond.notify_all();
+		return j->st.id;
+	}
+
+	void bulk_jobs::upgrade(int id, sha1_hash const& ih)
+	{
+		for (std::deque<std::shared_ptr<job> >::iterator i = m_jobs.begin()
+			, end(m_jobs.end()); i != end; ++i)
+		{
+			if ((*i)->st.id != id) continue;
+			TORRENT_ASSERT((*i)->st.operation == remove_op);
+			(*i)->with_data.insert(ih);
+			return;
+		}
+	}
+
+	bool bulk_jobs::cancel(int id)
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		for (std::deque<std::shared_ptr<job> >::iterator i = m_jobs.begin()
+			, end(m_jobs.end()); i != end; ++i)
+		{
+			if ((*i)->st.id != id) continue;
+			std::shared_ptr<job> j = *i;
+			j->st.cancelled = true;
+			finish(j);
+			return true;
+		}
+		return false;
+	}
+
+	bool bulk_jobs::status(int id, job_status& st) const
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		for (std::deque<std::shared_ptr<job> >::const_iterator i = m_jobs.begin()
+			, end(m_jobs.end()); i != end; ++i)
+		{
+			if ((*i)->st.id != id) continue;
+			st = (*i)->st;
+			return true;
+		}
+		for (std::deque<std::shared_ptr<job> >::const_iterator i = m_finished.begin()
+			, end(m_finished.end()); i != end; ++i)
+		{
+			if ((*i)->st.id != id) continue;
+			st = (*i)->st;
+			return true;
+		}
+		return false;
+	}
+
+	void bulk_jobs::jobs(std::vector<job_status>& ret) const
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		for (std::deque<std::shared_ptr<job> >::const_iterator i = m_jobs.begin()
+			, end(m_jobs.end()); i != end; ++i)
+			ret.push_back((*i)->st);
+		for (std::deque<std::shared_ptr<job> >::const_iterator i = m_finished.begin()
+			, end(m_finished.end()); i != end; ++i)
+			ret.push_back((*i)->st);
+	}
+
+	void bulk_jobs::set_rate(int per_second)
+	{
+		{
+			std::unique_lock<std::mutex> l(m_mutex);
+			m_rate = per_second;
+		}
+		m_cond.notify_all();
+	}
+
+	int bulk_jobs::rate() const
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		return m_rate;
+	}
+
+	void bulk_jobs::finish(std::shared_ptr<job> const& j)
+	{
+		j->st.finished = true;
+
+		// the torrents a cancelled job didn't get to are no longer waiting
+		pending_key k;
+		k.op = j->st.operation;
+		k.path = j->st.path;
+		for (std::deque<sha1_hash>::iterator i = j->torrents.begin()
+			, end(j->torrents.end()); i != end; ++i)
+		{
+			k.ih = *i;
+			std::map<pending_key, int>::iterator p = m_pending.find(k);
+			if (p != m_pending.end() && p->second == j->st.id) m_pending.erase(p);
+		}
+		j->torrents.clear();
+
+		std::deque<std::shared_ptr<job> >::iterator i
+			= std::find(m_jobs.begin(), m_jobs.end(), j);
+		if (i != m_jobs.end()) m_jobs.erase(i);
+
+		m_finished.push_back(j);
+		if (int(m_finished.size()) > max_finished_jobs) m_finished.pop_front();
+	}
+
+	void bulk_jobs::worker_thread()
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		for (;;)
+		{
+			while (m_jobs.empty() && !m_quit) m_cond.wait(l);
+			if (m_quit) return;
+
+			std::shared_ptr<job> j = m_jobs.front();
+			TORRENT_ASSERT(!j->torrents.empty());
+			sha1_hash const ih = j->torrents.front();
+			j->torrents.pop_front();
+
+			// from here on, a new request for the torrent is a new one
+			pending_key k;
+			k.ih = ih;
+			k.op = j->st.operation;
+			k.path = j->st.path;
+			m_pending.erase(k);
+
+			int const op = j->with_data.count(ih) ? int(remove_data_op)
+				: j->st.operation;
+			std::string const path = j->st.path;
+			l.unlock();
+
+			m_apply(op, ih, path);
+
+			l.lock();
+			++j->st.done;
+			if (!j->st.finished && j->torrents.empty()) finish(j);
+
+			if (m_rate <= 0) continue;
+
+			// spread the torrents out over time, to give the session a
+			// chance to keep up
+			std::chrono::steady_clock::time_point const next
+				= std::chrono::steady_clock::now()
+				+ std::chrono::microseconds(1000000 / m_rate);
+			while (!m_quit && m_cond.wait_until(l, next) != std::cv_status::timeout);
+		}
+	}
+}
+
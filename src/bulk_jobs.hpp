@@ -0,0 +1,182 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_BULK_JOBS_HPP
+#define TORRENT_BULK_JOBS_HPP
+
+#include "libtorrent/sha1_hash.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace libtorrent
+{
+	struct session_set;
+	struct permissions_interface;
+
+	// carries out operations on many torrents at once, like removing or
+	// rechecking thousands of them, in the background. The torrents are
+	// visited one at a time, at a limited rate, so the session (and its
+	// disk thread) isn't flooded with requests and the RPC that asked for
+	// it can respond right away. Jobs are run in the order they're
+	// submitted
+	struct bulk_jobs
+	{
+		enum operation_t
+		{
+			remove_op,
+			remove_data_op,
+			recheck_op,
+			move_op,
+			num_operations
+		};
+
+		struct job_status
+		{
+			int id;
+			int operation;
+
+			// the destination of move_op
+			std::string path;
+
+			// the number of torrents in the job, and the number visited so
+			// far. A torrent that's gone by the time it's visited counts as
+			// visited
+			int total;
+			int done;
+
+			bool cancelled;
+			bool finished;
+		};
+
+		// carries out op on the torrent, if it's still there
+		typedef std::function<void(int op, sha1_hash const& ih
+			, std::string const& path)> apply_fun;
+
+		// the operations are applied to the torrents of sessions. rate is
+		// the number of torrents per second, 0 means no limit
+		explicit bulk_jobs(session_set& sessions, int rate = default_rate);
+		explicit bulk_jobs(apply_fun const& fun, int rate = default_rate);
+
+		// the jobs still waiting are dropped
+		~bulk_jobs();
+
+		enum { default_rate = 100, max_finished_jobs = 16 };
+
+		// queues op on the torrents. Torrents already waiting for the same
+		// operation (with the same path) in an earlier job are left out of
+		// this one. So are torrents waiting to be removed, when removing
+		// them with their data, but they're removed with their data by the
+		// earlier job. Returns the id of the new job, or of the job waiting
+		// for the first torrent if all of them were left out. Ids start at 1
+		int submit(int op, std::vector<sha1_hash> const& torrents
+			, std::string const& path = std::string());
+
+		// stops the job. The torrents it has visited stay that way. Returns
+		// false if there's no such job or it has already finished
+		bool cancel(int id);
+
+		// looks up a job in progress, waiting or recently finished
+		bool status(int id, job_status& st) const;
+
+		// appends the jobs in progress and waiting, in order, followed by
+		// the last max_finished_jobs ones that finished
+		void jobs(std::vector<job_status>& ret) const;
+
+		void set_rate(int per_second);
+		int rate() const;
+
+		static char const* operation_name(int op);
+
+		// whether the user may submit or cancel jobs of the operation
+		static bool allowed(permissions_interface const* p, int op);
+
+	private:
+
+		struct job
+		{
+			job_status st;
+			std::deque<sha1_hash> torrents;
+
+			// the torrents of a remove_op job a remove_data_op was submitted
+			// for, while they were waiting. They're removed with their data
+			std::set<sha1_hash> with_data;
+		};
+
+		// a torrent waiting for an operation, to coalesce requests for the
+		// same one
+		struct pending_key
+		{
+			sha1_hash ih;
+			int op;
+			std::string path;
+			bool operator<(pending_key const& rhs) const;
+		};
+
+		void worker_thread();
+
+		// moves j to the finished jobs. m_mutex must be held
+		void finish(std::shared_ptr<job> const& j);
+
+		// has the remove_op job id remove ih with its data. m_mutex must be
+		// held
+		void upgrade(int id, sha1_hash const& ih);
+
+		apply_fun m_apply;
+
+		mutable std::mutex m_mutex;
+		std::condition_variable m_cond;
+
+		// the job in progress is at the front
+		std::deque<std::shared_ptr<job> > m_jobs;
+		std::deque<std::shared_ptr<job> > m_finished;
+
+		// the job every waiting torrent is in
+		std::map<pending_key, int> m_pending;
+
+		int m_next_id;
+		int m_rate;
+		bool m_quit;
+		std::thread m_thread;
+	};
+}
+
+#endif
+
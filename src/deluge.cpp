@@ -31,9 +31,11 @@ POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <deque>
+#include <algorithm>
 #include <functional>
 #include <memory>
 #include <mutex>
+#include <limits>
 
 #include "libtorrent/session.hpp"
 #include "libtorrent/session_status.hpp"
@@ -41,11 +43,15 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/socket.hpp"
 #include "libtorrent/io.hpp"
 #include "libtorrent/puff.hpp"
+#include "libtorrent/hex.hpp" // for from_hex
 #include "disk_space.hpp"
 #include "no_auth.hpp"
 #include "deluge.hpp"
 #include "rencode.hpp"
 #include "base64.hpp"
+#include "torrent_history.hpp"
+#include "alert_handler.hpp"
+#include "libtorrent/alert_types.hpp"
 #include <zlib.h>
 
 using namespace libtorrent;
@@ -60,12 +66,32 @@ enum rpc_type_t
 	RPC_EVENT = 3
 };
 
-deluge::deluge(session& s, std::string pem_path, auth_interface const* auth)
+static std::vector<std::string> rpc_function_names();
+
+// the number of TLS sessions kept for clients to resume, and for how many
+// seconds
+static const int tls_session_cache_size = 1024;
+static const int tls_session_timeout = 3600;
+
+static char const tls_ciphers[] =
+	"ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
+	"ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:"
+	"ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305:"
+	"ECDHE-ECDSA-AES128-SHA:ECDHE-RSA-AES128-SHA:"
+	"ECDHE-ECDSA-AES256-SHA:ECDHE-RSA-AES256-SHA:"
+	"AES128-GCM-SHA256:AES256-GCM-SHA384:AES128-SHA:AES256-SHA:"
+	"!aNULL:!eNULL:!MD5:!RC4";
+
+deluge::deluge(session& s, std::string pem_path, torrent_history* hist
+	, alert_handler* alerts, auth_interface const* auth)
 	: m_ses(s)
+	, m_hist(hist)
+	, m_alerts(alerts)
 	, m_auth(auth)
-	, m_listen_socket(nullptr)
+	, m_accept_strand(m_ios)
 	, m_context(m_ios, boost::asio::ssl::context::sslv23)
 	, m_shutdown(false)
+	, m_rpc_stats("deluge", rpc_function_names(), rpc_stats::handshake_metrics)
 {
 	if (m_auth == nullptr)
 	{
@@ -79,6 +105,28 @@ deluge::deluge(session& s, std::string pem_path, auth_interface const* auth)
 		boost::asio::ssl::context::default_workarounds
 		| boost::asio::ssl::context::no_sslv2
 		| boost::asio::ssl::context::single_dh_use);
+
+	// clients reconnect often. A client resuming its previous session,
+	// by ticket or by session ID, skips the key exchange and the
+	// certificate. Tickets are enabled by default, with a key generated
+	// for this context
+	SSL_CTX* ctx = m_context.native_handle();
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ctx, tls_session_cache_size);
+	SSL_CTX_set_timeout(ctx, tls_session_timeout);
+	SSL_CTX_set_session_id_context(ctx
+		, reinterpret_cast<unsigned char const*>("deluge"), 6);
+
+	// the full handshakes prefer ECDHE, which is cheaper than RSA key
+	// exchange for the server and forward secret. RSA key exchange is
+	// left at the end for old clients
+	SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+	if (SSL_CTX_set_cipher_list(ctx, tls_ciphers) != 1)
+		fprintf(stderr, "failed to set TLS ciphers\n");
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	SSL_CTX_set_ecdh_auto(ctx, 1);
+#endif
+
 	error_code ec;
 //	m_context.set_password_callback(std::bind(&server::get_password, this));
 	m_context.use_certificate_chain_file(pem_path.c_str(), ec);
@@ -94,68 +142,555 @@ deluge::deluge(session& s, std::string pem_path, auth_interface const* auth)
 		return;
 	}
 //	m_context.use_tmp_dh_file("dh512.pem");
+
+	m_alerts->subscribe(this, 0
+		, add_torrent_alert::alert_type
+		, torrent_removed_alert::alert_type
+		, state_changed_alert::alert_type
+		, torrent_paused_alert::alert_type
+		, torrent_resumed_alert::alert_type
+		, torrent_finished_alert::alert_type
+		, torrent_error_alert::alert_type
+		, file_renamed_alert::alert_type
+		, 0);
 }
 
 deluge::~deluge()
 {
+	m_alerts->unsubscribe(this);
+	stop();
 }
 
-void deluge::accept_thread(int port)
+const static no_permissions no_perms;
+
+// the size of the receive buffer. Messages are inflated and tokenized as
+// they arrive, so this doesn't limit the message size
+static const int receive_buffer_size = 16 * 1024;
+
+// the inflated buffer grows by this much at a time
+static const int inflate_chunk_size = 64 * 1024;
+
+// don't let the client send infinitely big messages. This is the limit
+// of the uncompressed size, so there's no guessing of compression ratios
+static const int max_message_size = 16 * 1024 * 1024;
+
+// after a message that grew the inflate buffer or the token pool past
+// these, they're released, for a connection to not hold on to the memory
+// of its largest message
+static const int max_kept_inflated = 4 * inflate_chunk_size;
+static const int max_kept_tokens = 16 * 1024;
+
+// once this many bytes are waiting to be sent to a client, we stop reading
+// requests from it and drop events, until it catches up
+static const int max_send_queue = 1024 * 1024;
+
+// the names of the events clients can register interest in, in the order
+// of deluge::event_t
+static char const* const event_names[] = {
+	"TorrentAddedEvent",
+	"TorrentRemovedEvent",
+	"TorrentStateChangedEvent",
+	"TorrentFinishedEvent",
+	"TorrentResumedEvent",
+	"TorrentFileRenamedEvent",
+};
+
+// compresses the messages streamed out of a rencoder. Each message is its
+// own zlib stream. The deflate state is reset rather than reallocated
+// between messages
+struct deflate_sink : rencoder::sink
 {
-	tcp::acceptor socket(m_ios);
-	m_listen_socket = &socket;
+	deflate_sink() : m_out(NULL), m_ok(false)
+	{
+		memset(&m_zs, 0, sizeof(m_zs));
+		m_ok = deflateInit(&m_zs, 9) == Z_OK;
+	}
+	~deflate_sink() { if (m_ok) deflateEnd(&m_zs); }
+
+	// the compressed bytes are appended to out
+	void set_output(std::vector<char>* out) { m_out = out; }
+
+	virtual void write(char const* buf, int len, bool finish)
+	{
+		TORRENT_ASSERT(m_out);
+		if (!m_ok || (len == 0 && !finish)) return;
+
+		m_zs.next_in = (Bytef*)buf;
+		m_zs.avail_in = len;
+
+		int ret;
+		do
+		{
+			std::size_t const pos = m_out->size();
+			m_out->resize(pos + (std::max)(len + 64, 4096));
+			m_zs.next_out = (Bytef*)&(*m_out)[pos];
+			m_zs.avail_out = m_out->size() - pos;
+			ret = deflate(&m_zs, finish ? Z_FINISH : Z_NO_FLUSH);
+			m_out->resize(m_out->size() - m_zs.avail_out);
+		} while (ret == Z_OK && (finish || m_zs.avail_in > 0));
+
+		if (ret != Z_OK && ret != Z_STREAM_END)
+			fprintf(stderr, "deflate: %d\n", ret);
+
+		if (finish) deflateReset(&m_zs);
+	}
+
+private:
+	std::vector<char>* m_out;
+	z_stream m_zs;
+	bool m_ok;
+};
+
+// every thread running the io_service (and the alert thread) has its own
+// encoder. The responses are encoded and compressed synchronously, so it's
+// never used by more than one message at a time
+struct response_encoder
+{
+	response_encoder() : out(&sink) {}
+	deflate_sink sink;
+	rencoder out;
+};
+
+static response_encoder& thread_encoder()
+{
+	static thread_local response_encoder enc;
+	return enc;
+}
+
+// a connection from a deluge client. All of its handlers run on its strand,
+// so any number of threads can be running the io_service, and an idle
+// connection doesn't hold up any of them
+struct deluge::connection : std::enable_shared_from_this<deluge::connection>
+{
+	connection(deluge& d)
+		: m_deluge(d)
+		, m_sock(d.m_ios, d.m_context)
+		, m_strand(d.m_ios)
+		, m_buffer(receive_buffer_size)
+		, m_inflated_use(0)
+		, m_zlib_ok(false)
+		, m_writing(false)
+		, m_read_blocked(false)
+	{
+		// initialize to no-permissions. The only way to
+		// increase the permission level is to log in
+		m_st.perms = &no_perms;
+		m_st.frame = -1;
+		m_st.event_interest = 0;
+
+		memset(&m_zs, 0, sizeof(m_zs));
+		int const ret = inflateInit(&m_zs);
+		if (ret != Z_OK)
+			fprintf(stderr, "inflateInit failed: %d\n", ret);
+		else
+			m_zlib_ok = true;
+	}
+
+	~connection()
+	{
+		if (m_zlib_ok) inflateEnd(&m_zs);
+	}
+
+	ssl_socket::lowest_layer_type& socket() { return m_sock.lowest_layer(); }
+
+	void start();
+
+	// closes the socket from any thread
+	void shutdown()
+	{ m_strand.post(std::bind(&connection::close, shared_from_this())); }
+
+	// sends the events the client is interested in, from any thread
+	void post_events(std::shared_ptr<std::vector<pending_event> const> events)
+	{ m_strand.post(std::bind(&connection::send_events, shared_from_this(), events)); }
+
+private:
+
+	void close();
+
+	void on_handshake(error_code const& ec);
+	void read();
+	void on_read(error_code const& ec, std::size_t bytes_transferred);
+	bool handle_input(char const* buf, int len);
+	bool handle_message();
+	void send_events(std::shared_ptr<std::vector<pending_event> const> events);
+	void flush();
+	void on_write(error_code const& ec);
+
+	deluge& m_deluge;
+	ssl_socket m_sock;
+	io_service::strand m_strand;
 
+	// when the handshake started, for its latency
+	time_point m_handshake_start;
+
+	// the receive buffer. Whatever is read is inflated right away
+	std::vector<char> m_buffer;
+
+	// the message being received, inflated. The first m_inflated_use bytes
+	// are valid
+	std::vector<char> m_inflated;
+	int m_inflated_use;
+
+	// each message is its own zlib stream. The stream is reset once a
+	// message ends, and the remaining input belongs to the next one
+	z_stream m_zs;
+	bool m_zlib_ok;
+
+	// tokenizes m_inflated as it grows
+	rdecoder m_decoder;
+
+	// the compressed messages (responses and events) waiting to be sent.
+	// Everything queued up while a write is in progress is sent with the
+	// next one
+	std::vector<char> m_send_queue;
+
+	// the messages currently being written
+	std::vector<char> m_out;
+	bool m_writing;
+
+	// set when the send queue grew too big to issue another read. The read
+	// is issued once the queue drains
+	bool m_read_blocked;
+
+	conn_state m_st;
+};
+
+void deluge::connection::start()
+{
+	if (!m_zlib_ok) return;
+	m_handshake_start = clock_type::now();
+	m_sock.async_handshake(boost::asio::ssl::stream_base::server
+		, m_strand.wrap(std::bind(&connection::on_handshake, shared_from_this(), _1)));
+}
+
+void deluge::connection::close()
+{
 	error_code ec;
-	socket.open(tcp::v4(), ec);
+	m_sock.lowest_layer().close(ec);
+}
+
+void deluge::connection::on_handshake(error_code const& ec)
+{
+	rpc_stats::handshake_stats& hs = *m_deluge.m_rpc_stats.handshakes();
 	if (ec)
 	{
-		fprintf(stderr, "open: %s\n", ec.message().c_str());
+		++hs.failed;
+		fprintf(stderr, "ssl handshake: %s\n", ec.message().c_str());
+		close();
 		return;
 	}
-	socket.set_option(tcp::acceptor::reuse_address(true), ec);
+	if (SSL_session_reused(m_sock.native_handle()))
+		++hs.resumed;
+	else
+		++hs.full;
+	hs.latency_us.record(total_microseconds(clock_type::now() - m_handshake_start));
+	read();
+}
+
+void deluge::connection::read()
+{
+	m_sock.async_read_some(boost::asio::buffer(&m_buffer[0], m_buffer.size())
+		, m_strand.wrap(std::bind(&connection::on_read, shared_from_this(), _1, _2)));
+}
+
+void deluge::connection::on_read(error_code const& ec, std::size_t bytes_transferred)
+{
 	if (ec)
 	{
-		fprintf(stderr, "reuse address: %s\n", ec.message().c_str());
+		fprintf(stderr, "read: %s\n", ec.message().c_str());
+		close();
 		return;
 	}
-	socket.bind(tcp::endpoint(address_v4::any(), port), ec);
-	if (ec)
+	TORRENT_ASSERT(bytes_transferred > 0);
+
+	if (!handle_input(&m_buffer[0], bytes_transferred))
 	{
-		fprintf(stderr, "bind: %s\n", ec.message().c_str());
+		close();
+		return;
+	}
+
+	flush();
+
+	// don't let a client queue up unbounded responses by not reading them
+	if (int(m_send_queue.size() + m_out.size()) > max_send_queue)
+	{
+		m_read_blocked = true;
 		return;
 	}
-	socket.listen(5, ec);
+	read();
+}
+
+void deluge::connection::send_events(std::shared_ptr<std::vector<pending_event> const> events)
+{
+	// a client that can't keep up misses events. It still gets the current
+	// state from get_torrents_status
+	if (int(m_send_queue.size() + m_out.size()) > max_send_queue) return;
+
+	for (std::vector<pending_event>::const_iterator i = events->begin()
+		, end(events->end()); i != end; ++i)
+	{
+		if ((m_st.event_interest & (1 << i->type)) == 0) continue;
+		m_send_queue.insert(m_send_queue.end(), i->message.begin(), i->message.end());
+	}
+	flush();
+}
+
+void deluge::connection::flush()
+{
+	if (m_writing || m_send_queue.empty()) return;
+
+	m_out.swap(m_send_queue);
+	m_writing = true;
+	boost::asio::async_write(m_sock, boost::asio::buffer(&m_out[0], m_out.size())
+		, m_strand.wrap(std::bind(&connection::on_write, shared_from_this(), _1)));
+}
+
+void deluge::connection::on_write(error_code const& ec)
+{
+	m_writing = false;
+	m_out.clear();
 	if (ec)
 	{
-		fprintf(stderr, "listen: %s\n", ec.message().c_str());
+		fprintf(stderr, "write: %s\n", ec.message().c_str());
+		close();
 		return;
 	}
+	flush();
 
-	TORRENT_ASSERT(m_threads.empty());
-	for (int i = 0; i < 5; ++i)
-		m_threads.emplace_back(std::bind(&deluge::connection_thread, this));
+	if (m_read_blocked && int(m_send_queue.size() + m_out.size()) <= max_send_queue)
+	{
+		m_read_blocked = false;
+		read();
+	}
+}
 
-	do_accept();
-	m_ios.run();
+// inflates the compressed bytes and tokenizes the result as it goes. There
+// may be any number of messages (or fractions of them) in the buffer. Returns
+// false if the connection should be closed
+bool deluge::connection::handle_input(char const* buf, int len)
+{
+	m_zs.next_in = (Bytef*)buf;
+	m_zs.avail_in = len;
 
-	for (auto& t : m_threads) t.join();
+	while (m_zs.avail_in > 0)
+	{
+		if (int(m_inflated.size()) - m_inflated_use < inflate_chunk_size)
+		{
+			if (int(m_inflated.size()) >= max_message_size)
+			{
+				fprintf(stderr, "message size exceeds %d bytes\n", max_message_size);
+				return false;
+			}
+			m_inflated.resize((std::min)(int(m_inflated.size()) + inflate_chunk_size
+				, max_message_size));
+		}
+
+		m_zs.next_out = (Bytef*)&m_inflated[m_inflated_use];
+		m_zs.avail_out = m_inflated.size() - m_inflated_use;
+
+		int const ret = inflate(&m_zs, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END)
+		{
+			fprintf(stderr, "inflate: %d\n", ret);
+			return false;
+		}
+
+		m_inflated_use = m_inflated.size() - m_zs.avail_out;
+
+		// reject malformed messages as soon as possible, rather than
+		// once they've been received in full
+		int const status = m_decoder.feed(&m_inflated[0], m_inflated_use);
+		if (status < 0)
+		{
+			fprintf(stderr, "invalid rencoded message\n");
+			return false;
+		}
+
+		if (ret != Z_STREAM_END) continue;
+
+		// the zlib stream ends where the message ends, it must have
+		// contained a complete item
+		if (status != 1 || !handle_message()) return false;
+
+		m_decoder.reset();
+		m_decoder.shrink(max_kept_tokens);
+		m_inflated_use = 0;
+		if (int(m_inflated.capacity()) > max_kept_inflated)
+			std::vector<char>().swap(m_inflated);
+		inflateReset(&m_zs);
+	}
+	return true;
+}
+
+// dispatches the RPC call(s) in the message that was just decoded. Returns
+// false if it's malformed
+bool deluge::connection::handle_message()
+{
+	rtok_t const* tokens = m_decoder.tokens();
+
+	// an RPC call is at least 5 tokens
+	// list, ID, method, args, kwargs
+	if (m_decoder.num_tokens() < 5) return false;
+
+	// each RPC call must be a list of the 4 items
+	// it could also be multiple RPC calls wrapped
+	// in a list.
+	if (tokens[0].type() != type_list) return false;
+
+	// the responses are compressed into the send queue as they're being
+	// encoded
+	response_encoder& enc = thread_encoder();
+	enc.sink.set_output(&m_send_queue);
+	m_st.buf = &m_inflated[0];
+	m_st.out = &enc.out;
+
+	if (tokens[1].type() == type_list)
+	{
+		int num_items = tokens->num_items();
+		for (rtok_t const* rpc = &tokens[1]; num_items; --num_items, rpc = skip_item(rpc))
+		{
+			m_st.tokens = rpc;
+			m_deluge.incoming_rpc(&m_st);
+			enc.out.finish();
+		}
+	}
+	else
+	{
+		m_st.tokens = tokens;
+		m_deluge.incoming_rpc(&m_st);
+		enc.out.finish();
+	}
+	enc.sink.set_output(NULL);
+
+	return true;
+}
+
+static char const* deluge_state_str(torrent_status::state_t st)
+{
+	switch (st)
+	{
+		case torrent_status::checking_files:
+		case torrent_status::checking_resume_data:
+			return "Checking";
+		case torrent_status::allocating:
+			return "Allocating";
+		case torrent_status::finished:
+		case torrent_status::seeding:
+			return "Seeding";
+		default:
+			return "Downloading";
+	}
+}
+
+// event messages are compressed once, here, and the same bytes are sent to
+// every interested connection
+void deluge::queue_event(event_t type, rencoder const& out)
+{
+	m_events.push_back(pending_event());
+	m_events.back().type = type;
+
+	deflate_sink& sink = thread_encoder().sink;
+	sink.set_output(&m_events.back().message);
+	sink.write(out.data(), out.len(), true);
+	sink.set_output(NULL);
+}
+
+void deluge::handle_alert(alert const* a)
+{
+	// [ RPC_EVENT, event-name, [ args ] ]
+	rencoder out;
+	out.append_list(3);
+	out.append_int(RPC_EVENT);
+
+	if (add_torrent_alert const* ta = alert_cast<add_torrent_alert>(a))
+	{
+		if (ta->error) return;
+		out.append_string(event_names[torrent_added_event]);
+		out.append_list(2);
+		out.append_string(to_hex(ta->handle.info_hash().to_string()));
+		out.append_bool(false); // from state
+		queue_event(torrent_added_event, out);
+	}
+	else if (torrent_removed_alert const* td = alert_cast<torrent_removed_alert>(a))
+	{
+		out.append_string(event_names[torrent_removed_event]);
+		out.append_list(1);
+		out.append_string(to_hex(td->info_hash.to_string()));
+		queue_event(torrent_removed_event, out);
+	}
+	else if (torrent_finished_alert const* tf = alert_cast<torrent_finished_alert>(a))
+	{
+		out.append_string(event_names[torrent_finished_event]);
+		out.append_list(1);
+		out.append_string(to_hex(tf->handle.info_hash().to_string()));
+		queue_event(torrent_finished_event, out);
+	}
+	else if (torrent_resumed_alert const* tr = alert_cast<torrent_resumed_alert>(a))
+	{
+		out.append_string(event_names[torrent_resumed_event]);
+		out.append_list(1);
+		out.append_string(to_hex(tr->handle.info_hash().to_string()));
+		queue_event(torrent_resumed_event, out);
+	}
+	else if (file_renamed_alert const* fr = alert_cast<file_renamed_alert>(a))
+	{
+		out.append_string(event_names[torrent_file_renamed_event]);
+		out.append_list(3);
+		out.append_string(to_hex(fr->handle.info_hash().to_string()));
+		out.append_int(fr->index);
+		out.append_string(fr->new_name());
+		queue_event(torrent_file_renamed_event, out);
+	}
+	else
+	{
+		// the rest are state changes
+		char const* state = NULL;
+		if (state_changed_alert const* sc = alert_cast<state_changed_alert>(a))
+			state = deluge_state_str(sc->state);
+		else if (alert_cast<torrent_paused_alert>(a))
+			state = "Paused";
+		else if (alert_cast<torrent_error_alert>(a))
+			state = "Error";
+		if (state == NULL) return;
+
+		out.append_string(event_names[torrent_state_changed_event]);
+		out.append_list(2);
+		out.append_string(to_hex(static_cast<torrent_alert const*>(a)->handle.info_hash().to_string()));
+		out.append_string(state);
+		queue_event(torrent_state_changed_event, out);
+	}
+}
+
+void deluge::alerts_dispatched()
+{
+	if (m_events.empty()) return;
+
+	std::shared_ptr<std::vector<pending_event> > events
+		= std::make_shared<std::vector<pending_event> >();
+	events->swap(m_events);
 
 	std::unique_lock<std::mutex> l(m_mutex);
-	m_threads.clear();
-	m_jobs.clear();
+	for (std::vector<std::weak_ptr<connection> >::iterator i = m_connections.begin()
+		, end(m_connections.end()); i != end; ++i)
+	{
+		std::shared_ptr<connection> c = i->lock();
+		if (c) c->post_events(events);
+	}
 }
 
+// this is called from start(), before m_ios is run, and from on_accept() on
+// m_accept_strand. m_shutdown is only set on the strand, it can't change under
+// us
 void deluge::do_accept()
 {
 	TORRENT_ASSERT(!m_shutdown);
-	ssl_socket* sock = new ssl_socket(m_ios, m_context);
-	auto& s = sock->lowest_layer();
-	m_listen_socket->async_accept(s, std::bind(&deluge::on_accept, this, _1, sock));
+	std::shared_ptr<connection> c = std::make_shared<connection>(*this);
+	m_listen_socket->async_accept(c->socket()
+		, m_accept_strand.wrap(std::bind(&deluge::on_accept, this, _1, c)));
 }
 
-void deluge::on_accept(error_code const& ec, ssl_socket* s)
+void deluge::on_accept(error_code const& ec, std::shared_ptr<connection> c)
 {
-	std::unique_ptr<ssl_socket> sock(s);
 	if (ec)
 	{
 		do_stop();
@@ -163,10 +698,18 @@ void deluge::on_accept(error_code const& ec, ssl_socket* s)
 	}
 
 	fprintf(stderr, "accepted connection\n");
-	std::unique_lock<std::mutex> l(m_mutex);
-	m_jobs.push_back(std::move(sock));
-	m_cond.notify_one();
-	l.unlock();
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		if (m_shutdown) return;
+
+		// keep track of the connections, to be able to close them when
+		// shutting down
+		m_connections.erase(std::remove_if(m_connections.begin(), m_connections.end()
+			, [](std::weak_ptr<connection> const& w) { return w.expired(); })
+			, m_connections.end());
+		m_connections.push_back(c);
+	}
+	c->start();
 
 	do_accept();
 }
@@ -192,8 +735,17 @@ handler_map_t handlers[] =
 	{"core.get_torrents_status", "[{}[]b]{}", &deluge::handle_get_torrents_status},
 	{"core.add_torrent_file", "[ss{}]{}", &deluge::handle_add_torrent_file},
 	{"core.get_filter_tree", "[b]{}", &deluge::handle_get_filter_tree},
+	{"label.set_torrent", "[ss]{}", &deluge::handle_set_torrent_label},
 };
 
+static std::vector<std::string> rpc_function_names()
+{
+	std::vector<std::string> ret;
+	for (int i = 0; i < sizeof(handlers)/sizeof(handlers[0]); ++i)
+		ret.push_back(handlers[i].method);
+	return ret;
+}
+
 void deluge::incoming_rpc(deluge::conn_state* st)
 {
 	rencoder& out = *st->out;
@@ -225,6 +777,10 @@ void deluge::incoming_rpc(deluge::conn_state* st)
 	{
 		if (handlers[i].method != method) continue;
 
+		// the response size is what's encoded, before compression
+		rpc_stats::call call(m_rpc_stats, i);
+		std::int64_t const start_len = out.total_len();
+
 		if (!validate_structure(tokens+3, handlers[i].args))
 		{
 			output_error(tokens[1].integer(buf), "invalid arguments", out);
@@ -232,6 +788,7 @@ void deluge::incoming_rpc(deluge::conn_state* st)
 		}
 
 		(this->*handlers[i].fun)(st);
+		call.add_bytes(out.total_len() - start_len);
 		return;
 	}
 
@@ -274,6 +831,24 @@ void deluge::handle_set_event_interest(conn_state* st)
 
 	int id = st->tokens[1].integer(st->buf);
 
+	// [ id, method, [ [ event-name, ... ] ], {} ]
+	rtok_t const* names = &tokens[4];
+	int const num_names = names->num_items();
+	++names;
+	for (int i = 0; i < num_names; ++i, ++names)
+	{
+		std::string const name = names->string(buf);
+		bool found = false;
+		for (int k = 0; k < sizeof(event_names)/sizeof(event_names[0]); ++k)
+		{
+			if (name != event_names[k]) continue;
+			st->event_interest |= 1 << k;
+			found = true;
+			break;
+		}
+		if (!found) fprintf(stderr, "unsupported event: %s\n", name.c_str());
+	}
+
 	// [ RPC_RESPONSE, req-id, [True] ]
 
 	out.append_list(3);
@@ -547,10 +1122,123 @@ char const* torrent_keys[] = {
 	"trackers",
 
 	"tracker_status",
-	"upload_payload_rate"
+	"upload_payload_rate",
+	"label"
+};
+
+// the torrent_history fields each of the torrent_keys is derived from, ending
+// with no_field. Keys that aren't derived from any field are constants, they're
+// only sent in diff mode the first time a torrent is sent. Keys that are
+// derived from untracked (the torrent's rate limits) are queried from the
+// torrent handle, and sent whenever any other requested key is. Keys derived
+// from label_field change with the torrent's labels
+enum { no_field = -1, untracked = -2, label_field = -3 };
+typedef torrent_history_entry te;
+static int const torrent_key_fields[][5] = {
+	{ te::active_time, no_field },
+	{ te::all_time_download, no_field },
+	{ te::storage_mode, no_field },
+	{ te::distributed_copies, no_field },
+	{ te::download_payload_rate, no_field },
+
+	{ te::download_payload_rate, te::total_wanted_done, te::total_wanted, no_field },
+	{ no_field }, // file_priorities
+	{ no_field }, // hash
+	{ te::auto_managed, no_field },
+	{ te::is_finished, no_field },
+
+	{ te::connections_limit, no_field },
+	{ untracked, no_field },
+	{ te::uploads_limit, no_field },
+	{ untracked, no_field },
+	{ te::error, no_field },
+
+	{ no_field }, // move_on_completed_path
+	{ no_field }, // move_on_completed
+	{ no_field }, // move_completed_path
+	{ no_field }, // move_completed
+	{ te::name, no_field },
+
+	{ te::next_announce, no_field },
+	{ te::num_peers, no_field },
+	{ te::num_seeds, no_field },
+	{ te::paused, no_field },
+	{ no_field }, // prioritize_first_last
+
+	{ te::progress, no_field },
+	{ te::queue_position, no_field },
+	{ no_field }, // remove_at_ratio
+	{ te::save_path, no_field },
+	{ te::seeding_time, no_field },
+
+	{ no_field }, // seeds_peers_ratio
+	{ te::seed_rank, no_field },
+	{ te::state, te::paused, te::error, te::auto_managed, no_field },
+	{ no_field }, // stop_at_ratio
+	{ no_field }, // stop_ratio
+
+	{ te::added_time, no_field },
+	{ te::total_done, no_field },
+	{ te::total_payload_download, no_field },
+	{ te::total_payload_upload, no_field },
+	{ te::list_peers, no_field },
+
+	{ te::list_seeds, no_field },
+	{ te::total_upload, no_field },
+	{ te::total_wanted, no_field },
+	{ te::current_tracker, no_field },
+	{ no_field }, // trackers
+
+	{ no_field }, // tracker_status
+	{ te::upload_payload_rate, no_field },
+	{ label_field, no_field },
 };
 
-bool yes(torrent_status const& st) { return true;}
+static_assert(sizeof(torrent_key_fields)/sizeof(torrent_key_fields[0])
+	== sizeof(torrent_keys)/sizeof(torrent_keys[0])
+	, "every torrent key needs its fields");
+
+// returns the subset of the keys in key_mask that changed after the
+// specified frame
+static std::uint64_t changed_keys(torrent_history_entry const& e, int frame
+	, std::uint64_t key_mask)
+{
+	// a torrent that was added after the frame has every field stamped
+	// with the frame it was added in
+	bool is_new = true;
+	for (int i = 0; i < torrent_history_entry::num_fields; ++i)
+	{
+		if (e.frame(i) > frame) continue;
+		is_new = false;
+		break;
+	}
+	if (is_new) return key_mask;
+
+	std::uint64_t ret = 0;
+	std::uint64_t untracked_keys = 0;
+	for (int k = 0; k < int(sizeof(torrent_keys)/sizeof(torrent_keys[0])); ++k)
+	{
+		if ((key_mask & (1LL << k)) == 0) continue;
+		for (int const* f = torrent_key_fields[k]; *f != no_field; ++f)
+		{
+			if (*f == untracked)
+			{
+				untracked_keys |= 1LL << k;
+				break;
+			}
+			if (*f == label_field)
+			{
+				if (e.labels_frame > frame) ret |= 1LL << k;
+				break;
+			}
+			if (e.frame(*f) <= frame) continue;
+			ret |= 1LL << k;
+			break;
+		}
+	}
+	if (ret) ret |= untracked_keys;
+	return ret;
+}
 
 // input [id, method, [ { ... }, [ ... ], bool ] ]
 //                   filter_dict  keys    diff
@@ -601,20 +1289,47 @@ void deluge::handle_get_torrents_status(conn_state* st)
 		}
 	}
 
-	num_keys -= num_invalid_keys;
-	if (num_keys == 0)
+	// no (valid) keys means all keys
+	if (num_keys == num_invalid_keys)
+		key_mask = (1LL << (sizeof(torrent_keys)/sizeof(torrent_keys[0]))) - 1;
+
+	// the only filter supported is "label", as set by the label plugin. Its
+	// value is a label, or a list whose first item is. Other filters are
+	// ignored, all torrents match them
+	std::string label;
+	int const num_filters = filter_dict->num_items();
+	rtok_t const* f = filter_dict + 1;
+	for (int i = 0; i < num_filters; ++i, f = skip_item(skip_item(f)))
 	{
-		key_mask = ~0LL;
-		num_keys = sizeof(torrent_keys)/sizeof(torrent_keys[0]);
+		if (f->type() != type_string || f->string(buf) != "label") continue;
+		if (f[1].type() == type_string) label = f[1].string(buf);
+		else if (f[1].type() == type_list && f[1].num_items() > 0
+			&& f[2].type() == type_string) label = f[2].string(buf);
 	}
 
-	// TODO: use a predicate function to only return torrents that match
-	// the filter dict
+	// in diff mode, only the keys that changed since the last list sent
+	// on this connection are included. Torrents where none of them did are
+	// left out entirely
+	bool const diff_mode = diff->type() == type_bool && diff->boolean(buf);
+	int const since_frame = diff_mode ? st->frame : -1;
 
-	// TODO: pass in a query_mask depending on key_mask
+	// capture the frame before asking for the updates, anything that
+	// changes while we're building the response will have a later frame
+	st->frame = m_hist->frame();
 
-	std::vector<torrent_status> torrents;
-	m_ses.get_torrent_status(&torrents, yes, 0xffffffff);
+	// a full list of the torrents with a label is looked up in the
+	// history's label index
+	std::vector<history_entry_ptr> torrents;
+	if (!label.empty() && since_frame < 0)
+	{
+		m_hist->query_torrents(torrent_index::queue_position, false
+			, torrent_index::all, "", label, 0, (std::numeric_limits<int>::max)()
+			, torrents);
+	}
+	else
+	{
+		m_hist->updated_fields_since(since_frame, torrents);
+	}
 
 	out.append_list(3);
 	out.append_int(RPC_RESPONSE);
@@ -622,17 +1337,27 @@ void deluge::handle_get_torrents_status(conn_state* st)
 
 	out.append_dict();
 
-	for (std::vector<torrent_status>::iterator i = torrents.begin()
-		, end(torrents.end()); i != end; ++i)
+	for (std::vector<history_entry_ptr>::iterator e = torrents.begin()
+		, end(torrents.end()); e != end; ++e)
 	{
+		if (!label.empty() && !(*e)->has_label(label)) continue;
+		std::uint64_t const mask = diff_mode
+			? changed_keys(**e, since_frame, key_mask) : key_mask;
+		if (mask == 0) continue;
+
+		int torrent_keys_count = 0;
+		for (std::uint64_t m = mask; m; m &= m - 1) ++torrent_keys_count;
+
+		torrent_status const* i = &(*e)->status;
+
 		// key in the dict
-		out.append_string(to_hex(i->info_hash.to_string()));
+		out.append_string((*e)->json->info_hash, 40);
 
 		// the value, is a dict
-		bool need_term = out.append_dict(num_keys);
+		bool need_term = out.append_dict(torrent_keys_count);
 
 #define MAYBE_ADD(op) \
-		if (key_mask & (1LL << idx)) { \
+		if (mask & (1LL << idx)) { \
 			out.append_string(torrent_keys[idx]); \
 			op; \
 		} \
@@ -653,7 +1378,7 @@ void deluge::handle_get_torrents_status(conn_state* st)
 		MAYBE_ADD(out.append_int(i->download_payload_rate > 0
 			? (i->total_wanted - i->total_wanted_done) / i->download_payload_rate : -1));
 		MAYBE_ADD(out.append_list(0)); // TODO: support file_priorities
-		MAYBE_ADD(out.append_string(i->info_hash.to_string()));
+		MAYBE_ADD(out.append_string((*e)->json->info_hash, 40));
 		MAYBE_ADD(out.append_bool(i->auto_managed));
 		MAYBE_ADD(out.append_bool(i->is_finished));
 
@@ -667,7 +1392,7 @@ void deluge::handle_get_torrents_status(conn_state* st)
 		MAYBE_ADD(out.append_bool(false)); // move on completed
 		MAYBE_ADD(out.append_string("")); // move completed path
 		MAYBE_ADD(out.append_bool(false)); // move completed
-		MAYBE_ADD(out.append_string(i->handle.name()));
+		MAYBE_ADD(out.append_string(i->name));
 
 		MAYBE_ADD(out.append_int(total_seconds(i->next_announce)));
 		MAYBE_ADD(out.append_int(i->num_peers));
@@ -678,7 +1403,7 @@ void deluge::handle_get_torrents_status(conn_state* st)
 		MAYBE_ADD(out.append_float(i->progress));
 		MAYBE_ADD(out.append_int(i->queue_position));
 		MAYBE_ADD(out.append_bool(false)); // remove at ratio
-		MAYBE_ADD(out.append_string(i->handle.save_path()));
+		MAYBE_ADD(out.append_string(*(*e)->path));
 		MAYBE_ADD(out.append_int(i->seeding_time));
 
 		MAYBE_ADD(out.append_int(0)); // seeds peers ratio
@@ -696,11 +1421,13 @@ void deluge::handle_get_torrents_status(conn_state* st)
 		MAYBE_ADD(out.append_int(i->list_seeds));
 		MAYBE_ADD(out.append_int(i->total_upload));
 		MAYBE_ADD(out.append_int(i->total_wanted));
-		MAYBE_ADD(out.append_string(i->current_tracker));
+		MAYBE_ADD(out.append_string(*(*e)->tracker));
 		MAYBE_ADD(out.append_list(0)); // trackers
 
 		MAYBE_ADD(out.append_string("")); // tracker status
 		MAYBE_ADD(out.append_int(i->upload_payload_rate));
+		// the label plugin has one label per torrent
+		MAYBE_ADD(out.append_string((*e)->labels ? (*e)->labels->front() : std::string()));
 		TORRENT_ASSERT(idx == sizeof(torrent_keys)/sizeof(torrent_keys[0]));
 
 		if (need_term) out.append_term();
@@ -800,6 +1527,31 @@ void deluge::handle_add_torrent_file(conn_state* st)
 	out.append_int(h.id());
 }
 
+// writes a filter category, as a list of [name, count] pairs
+static void append_filter(rencoder& out
+	, std::vector<std::pair<std::string, int> > const& items, bool show_zero)
+{
+	int num_items = 0;
+	for (std::vector<std::pair<std::string, int> >::const_iterator i = items.begin()
+		, end(items.end()); i != end; ++i)
+	{
+		if (show_zero || i->second > 0 || i == items.begin()) ++num_items;
+	}
+
+	bool need_term = out.append_list(num_items);
+	for (std::vector<std::pair<std::string, int> >::const_iterator i = items.begin()
+		, end(items.end()); i != end; ++i)
+	{
+		// "All" is always included
+		if (!show_zero && i->second == 0 && i != items.begin()) continue;
+		out.append_list(2);
+		out.append_string(i->first);
+		out.append_int(i->second);
+	}
+	if (need_term) out.append_term();
+}
+
+// input [id, method, [ show_zero_hits ], {} ]
 void deluge::handle_get_filter_tree(conn_state* st)
 {
 	rencoder& out = *st->out;
@@ -813,23 +1565,99 @@ void deluge::handle_get_filter_tree(conn_state* st)
 	}
 
 	int id = tokens[1].integer(buf);
+	bool const show_zero = tokens[4].boolean(buf);
 
-	session_status sst = m_ses.status();
+	// the history keeps these counts up to date, there's no need to look
+	// at the torrents
+	torrent_counts c;
+	m_hist->get_counts(c);
+
+	std::vector<std::pair<std::string, int> > items;
 
 	out.append_list(3);
 	out.append_int(RPC_RESPONSE);
 	out.append_int(id);
-	out.append_dict(1);
+	out.append_dict(3);
+
+	// these categories match the ones returned by deluge_state_str()
 	out.append_string("state");
-	out.append_list(2);
+	items.push_back(std::make_pair("All", c.total));
+	items.push_back(std::make_pair("Downloading"
+		, c.state[torrent_status::downloading]
+		+ c.state[torrent_status::downloading_metadata]));
+	items.push_back(std::make_pair("Seeding"
+		, c.state[torrent_status::seeding]
+		+ c.state[torrent_status::finished]));
+	items.push_back(std::make_pair("Active", c.active));
+	items.push_back(std::make_pair("Paused", c.paused));
+	items.push_back(std::make_pair("Queued", c.queued));
+	items.push_back(std::make_pair("Checking"
+		, c.state[torrent_status::checking_files]
+		+ c.state[torrent_status::checking_resume_data]
+		+ c.state[torrent_status::queued_for_checking]));
+	items.push_back(std::make_pair("Allocating", c.state[torrent_status::allocating]));
+	items.push_back(std::make_pair("Error", c.error));
+	append_filter(out, items, show_zero);
+
+	out.append_string("tracker_host");
+	items.clear();
+	items.push_back(std::make_pair("All", c.total));
+	for (std::map<std::string, int>::const_iterator i = c.trackers.begin()
+		, end(c.trackers.end()); i != end; ++i)
+	{
+		items.push_back(*i);
+	}
+	append_filter(out, items, show_zero);
+
+	out.append_string("label");
+	items.clear();
+	items.push_back(std::make_pair("All", c.total));
+	for (std::map<std::string, int>::const_iterator i = c.labels.begin()
+		, end(c.labels.end()); i != end; ++i)
+	{
+		items.push_back(*i);
+	}
+	append_filter(out, items, show_zero);
+}
+
+// input [id, method, [ torrent_id, label ], {} ]
+// the label plugin's way of setting a torrent's label. An empty label
+// removes it
+void deluge::handle_set_torrent_label(conn_state* st)
+{
+	rencoder& out = *st->out;
+	char const* buf = st->buf;
+	rtok_t const*tokens = st->tokens;
+
+	if (!st->perms->allow_queue_change())
+	{
+		output_error(tokens[1].integer(buf), "permission denied", out);
+		return;
+	}
+
+	int id = tokens[1].integer(buf);
+	std::string const torrent_id = tokens[4].string(buf);
+	std::string const label = tokens[5].string(buf);
+
+	sha1_hash ih;
+	if (torrent_id.size() != 40 || !from_hex(torrent_id.c_str(), 40, (char*)&ih[0]))
+	{
+		output_error(id, "invalid torrent id", out);
+		return;
+	}
 
-	out.append_list(2);
-	out.append_string("All");
-	out.append_int(sst.num_torrents);
+	std::vector<std::string> labels;
+	if (!label.empty()) labels.push_back(label);
+	if (!m_hist->set_labels(ih, labels))
+	{
+		output_error(id, "unknown torrent", out);
+		return;
+	}
 
-	out.append_list(2);
-	out.append_string("Paused");
-	out.append_int(sst.num_paused_torrents);
+	out.append_list(3);
+	out.append_int(RPC_RESPONSE);
+	out.append_int(id);
+	out.append_none();
 }
 
 void deluge::handle_get_config_values(conn_state* st)
@@ -846,6 +1674,16 @@ void deluge::handle_get_config_values(conn_state* st)
 	int num_keys = keys->num_items();
 	++keys;
 
+	// validate the keys up-front. The response may already have been
+	// streamed out in part by the time we'd find an invalid one
+	rtok_t const* k = keys;
+	for (int i = 0; i < num_keys; ++i, k = skip_item(k))
+	{
+		if (k->type() == type_string) continue;
+		output_error(id, "invalid argument", out);
+		return;
+	}
+
 	// [ RPC_RESPONSE, req-id, <config value> ]
 
 	out.append_list(3);
@@ -854,16 +1692,11 @@ void deluge::handle_get_config_values(conn_state* st)
 	bool need_term = out.append_dict(num_keys);
 	for (int i = 0; i < num_keys; ++i, keys = skip_item(keys))
 	{
-		if (keys->type() != type_string)
-		{
-			out.clear();
-			output_error(id, "invalid argument", out);
-			return;
-		}
 		std::string config_name = keys->string(buf);
 		out.append_string(config_name);
 		output_config_value(config_name, sett, out, st->perms);
 	}
+	if (need_term) out.append_term();
 }
 
 void deluge::handle_get_session_status(conn_state* st)
@@ -919,6 +1752,7 @@ void deluge::handle_get_session_status(conn_state* st)
 
 void deluge::output_error(int id, char const* msg, rencoder& out)
 {
+	rpc_stats::set_error();
 	// [ RPC_ERROR, req-id, [msg, args, trace] ]
 
 	out.append_list(3);
@@ -930,239 +1764,78 @@ void deluge::output_error(int id, char const* msg, rencoder& out)
 	out.append_string(""); // stack-trace
 }
 
-const static no_permissions no_perms;
-
-void deluge::connection_thread()
+void deluge::start(int port)
 {
-	conn_state st;
-	// initialize to no-permissions. The only way to
-	// increase the permission level is to log in
-	st.perms = &no_perms;
-
-	std::unique_lock<std::mutex> l(m_mutex);
-	while (!m_shutdown)
-	{
-		l.lock();
-		while (!m_shutdown && m_jobs.empty())
-			m_cond.wait(l);
-
-		if (m_shutdown) return;
-
-		fprintf(stderr, "connection thread woke up: %d\n", int(m_jobs.size()));
-
-		std::unique_ptr<ssl_socket> sock = std::move(m_jobs.front());
-		m_jobs.erase(m_jobs.begin());
-		l.unlock();
-
-		error_code ec;
-		sock->handshake(boost::asio::ssl::stream_base::server, ec);
-		if (ec)
-		{
-			fprintf(stderr, "ssl handshake: %s\n", ec.message().c_str());
-			sock->lowest_layer().close(ec);
-			continue;
-		}
-		fprintf(stderr, "SSL handshake done\n");
-
-		std::vector<char> buffer;
-		std::vector<char> inflated;
-		buffer.resize(2048);
-		do
-		{
-			int buffer_use = 0;
-			error_code ec;
-
-			int ret;
-			z_stream strm;
-
-read_some_more:
-			TORRENT_ASSERT(buffer.size() > 0);
-			TORRENT_ASSERT(buffer.size() - buffer_use > 0);
-			ret = sock->read_some(boost::asio::buffer(&buffer[buffer_use]
-				, buffer.size() - buffer_use), ec);
-			if (ec)
-			{
-				fprintf(stderr, "read: %s\n", ec.message().c_str());
-				break;
-			}
-			TORRENT_ASSERT(ret > 0);
-//			fprintf(stderr, "read %d bytes (%d/%d)\n", int(ret), buffer_use, int(buffer.size()));
-
-			buffer_use += ret;
-
-parse_message:
-			// assume no more than a 1:10 compression ratio
-			inflated.resize(buffer_use * 10);
-
-			memset(&strm, 0, sizeof(strm));
-			ret = inflateInit(&strm);
-			if (ret != Z_OK)
-			{
-				fprintf(stderr, "inflateInit failed: %d\n", ret);
-				break;
-			}
-			strm.next_in = (Bytef*)&buffer[0];
-			strm.avail_in = buffer_use;
-
-			strm.next_out = (Bytef*)&inflated[0];
-			strm.avail_out = inflated.size();
-
-			ret = inflate(&strm, Z_NO_FLUSH);
-
-			// TODO: in some cases we should just abort as well
-			if (ret != Z_STREAM_END)
-			{
-				if (buffer_use + 512 > buffer.size())
-				{
-					// don't let the client send infinitely
-					// big messages
-					if (buffer_use > 1024 * 1024)
-					{
-						fprintf(stderr, "compressed message size exceeds 1 MB\n");
-						break;
-					}
-					// make sure we have enough space in the
-					// incoming buffer.
-					buffer.resize(buffer_use + buffer_use / 2 + 512);
-				}
-				inflateEnd(&strm);
-				fprintf(stderr, "inflate: %d\n", ret);
-				goto read_some_more;
-			}
-
-			// truncate the out buffer to only contain the message
-			inflated.resize(inflated.size() - strm.avail_out);
-
-			int consumed_bytes = (char*)strm.next_in - &buffer[0];
-			TORRENT_ASSERT(consumed_bytes > 0);
-
-			inflateEnd(&strm);
-
-			rtok_t tokens[200];
-			ret = rdecode(tokens, 200, &inflated[0], inflated.size());
-
-//			fprintf(stderr, "rdecode: %d\n", ret);
-
-			rencoder out;
-
-			// an RPC call is at least 5 tokens
-			// list, ID, method, args, kwargs
-			if (ret < 5) break;
-
-			// each RPC call must be a list of the 4 items
-			// it could also be multiple RPC calls wrapped
-			// in a list.
-			if (tokens[0].type() != type_list) break;
-
-			st.tokens = tokens;
-			st.buf = &inflated[0];
-			st.out = &out;
-
-			if (tokens[1].type() == type_list)
-			{
-				int num_items = tokens->num_items();
-				for (rtok_t* rpc = &tokens[1]; num_items; --num_items, rpc = skip_item(rpc))
-				{
-					incoming_rpc(&st);
-					write_response(out, *sock, ec);
-					out.clear();
-					if (ec) break;
-				}
-				if (ec) break;
-			}
-			else
-			{
-				incoming_rpc(&st);
-				write_response(out, *sock, ec);
-				if (ec) break;
-			}
-
-			// flush anything written to the SSL socket
-			BIO* bio = SSL_get_wbio(sock->native_handle());
-			TORRENT_ASSERT(bio);
-			if (bio) BIO_flush(bio);
-
-			buffer.erase(buffer.begin(), buffer.begin() + consumed_bytes);
-			buffer_use -= consumed_bytes;
-//			fprintf(stderr, "consumed %d bytes (%d left)\n", consumed_bytes, buffer_use);
-	
-			// there's still data in the in-buffer that may be a message
-			// don't get stuck in read if we have more messages to parse
-			if (buffer_use > 0) goto parse_message;
-	
-			if (buffer.size() < 2048) buffer.resize(2048);
+	if (!m_threads.empty())
+		stop();
 
-		} while (!m_shutdown);
+	m_ios.reset();
+	m_shutdown = false;
+	m_listen_socket.reset(new tcp::acceptor(m_ios));
 
-		fprintf(stderr, "closing connection\n");
-		sock->shutdown(ec);
-		sock->lowest_layer().close(ec);
+	error_code ec;
+	m_listen_socket->open(tcp::v4(), ec);
+	if (ec)
+	{
+		fprintf(stderr, "open: %s\n", ec.message().c_str());
+		return;
 	}
-
-}
-
-void deluge::write_response(rencoder const& out, ssl_socket& sock, error_code& ec)
-{
-	// ----
-	rtok_t tmp[2000];
-	int r = rdecode(tmp, 2000, out.data(), out.len());
-	TORRENT_ASSERT(r > 0);
-	printf("==> ");
-	print_rtok(tmp, out.data());
-	printf("\n");
-	// ----
-
-	z_stream strm;
-	memset(&strm, 0, sizeof(strm));
-	int ret = deflateInit(&strm, 9);
-	if (ret != Z_OK) return;
-
-	std::vector<char> deflated(out.len() * 3);
-	strm.next_in = (Bytef*)out.data();
-	strm.avail_in = out.len();
-	strm.next_out = (Bytef*)&deflated[0];
-	strm.avail_out = deflated.size();
-
-	ret = deflate(&strm, Z_FINISH);
-
-	deflated.resize(deflated.size() - strm.avail_out);
-	deflateEnd(&strm);
-	if (ret != Z_STREAM_END) return;
-
-	ret = boost::asio::write(sock, boost::asio::buffer(&deflated[0], deflated.size()), ec);
+	m_listen_socket->set_option(tcp::acceptor::reuse_address(true), ec);
 	if (ec)
 	{
-		fprintf(stderr, "write: %s\n", ec.message().c_str());
+		fprintf(stderr, "reuse address: %s\n", ec.message().c_str());
+		return;
+	}
+	m_listen_socket->bind(tcp::endpoint(address_v4::any(), port), ec);
+	if (ec)
+	{
+		fprintf(stderr, "bind: %s\n", ec.message().c_str());
+		return;
+	}
+	m_listen_socket->listen(5, ec);
+	if (ec)
+	{
+		fprintf(stderr, "listen: %s\n", ec.message().c_str());
 		return;
 	}
-//	fprintf(stderr, "wrote %d bytes\n", ret);
-}
 
-void deluge::start(int port)
-{
-	if (m_accept_thread)
-		stop();
+	do_accept();
 
-	m_accept_thread.reset(new std::thread(&deluge::accept_thread, this, port));
+	// the io_service runs until the listen socket and all connections
+	// have been closed
+	int const num_threads = (std::max)(2u, std::thread::hardware_concurrency());
+	for (int i = 0; i < num_threads; ++i)
+		m_threads.emplace_back([this] { m_ios.run(); });
 }
 
 void deluge::do_stop()
 {
-	std::unique_lock<std::mutex> l(m_mutex);
-	m_shutdown = true;
-	m_cond.notify_all();
-	if (m_listen_socket)
+	std::vector<std::weak_ptr<connection> > connections;
 	{
-		m_listen_socket->close();
-		m_listen_socket = nullptr;
+		std::unique_lock<std::mutex> l(m_mutex);
+		m_shutdown = true;
+		connections.swap(m_connections);
+	}
+
+	error_code ec;
+	if (m_listen_socket) m_listen_socket->close(ec);
+
+	for (std::vector<std::weak_ptr<connection> >::iterator i = connections.begin()
+		, end(connections.end()); i != end; ++i)
+	{
+		std::shared_ptr<connection> c = i->lock();
+		if (!c) continue;
+		c->shutdown();
 	}
 }
 
 void deluge::stop()
 {
-	m_ios.post(std::bind(&deluge::do_stop, this));
+	if (m_threads.empty()) return;
 
-	m_accept_thread->join();
-	m_accept_thread.reset();
-}
+	m_accept_strand.post(std::bind(&deluge::do_stop, this));
 
+	for (auto& t : m_threads) t.join();
+	m_threads.clear();
+	m_listen_socket.reset();
+}
@@ -37,10 +37,11 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <mutex>
 #include <thread>
 #include <memory>
-#include <condition_variable>
 #include "libtorrent/socket.hpp"
 #include "libtorrent/io_service.hpp"
 #include "libtorrent/settings_pack.hpp"
+#include "alert_observer.hpp"
+#include "rpc_stats.hpp"
 
 #include <boost/asio/ssl.hpp>
 
@@ -53,10 +54,13 @@ namespace libtorrent
 	struct rencoder;
 	struct permissions_interface;
 	struct auth_interface;
+	struct torrent_history;
+	struct alert_handler;
 
-	struct deluge
+	struct deluge : alert_observer
 	{
-		deluge(session& s, std::string pem_path, auth_interface const* auth = NULL);
+		deluge(session& s, std::string pem_path, torrent_history* hist
+			, alert_handler* alerts, auth_interface const* auth = NULL);
 		~deluge();
 
 		void start(int port);
@@ -71,6 +75,15 @@ namespace libtorrent
 			char const* buf;
 			rencoder* out;
 			permissions_interface const* perms;
+
+			// the history frame of the last torrent list sent on this
+			// connection. get_torrents_status in diff mode only sends what
+			// changed since then. -1 means no list has been sent yet
+			int frame;
+
+			// a bitmask of the events the client has asked for with
+			// set_event_interest, indexed by event_t
+			std::uint32_t event_interest;
 		};
 
 		void handle_login(conn_state* st);
@@ -86,36 +99,75 @@ namespace libtorrent
 		void handle_get_torrents_status(conn_state* st);
 		void handle_add_torrent_file(conn_state* st);
 		void handle_get_filter_tree(conn_state* st);
+		void handle_set_torrent_label(conn_state* st);
+
+		virtual void handle_alert(alert const* a);
+		virtual void alerts_dispatched();
 
 	private:
 
+		// the events that can be pushed to clients
+		enum event_t
+		{
+			torrent_added_event,
+			torrent_removed_event,
+			torrent_state_changed_event,
+			torrent_finished_event,
+			torrent_resumed_event,
+			torrent_file_renamed_event,
+			num_events
+		};
+
+		// an event message, rencoded and compressed, ready to be sent
+		struct pending_event
+		{
+			event_t type;
+			std::vector<char> message;
+		};
+
+		void queue_event(event_t type, rencoder const& out);
+
 		void incoming_rpc(conn_state* st);
 		void output_error(int id, char const* msg, rencoder& out);
 		void output_config_value(std::string set_name, libtorrent::settings_pack const& sett
 			, rencoder& out, permissions_interface const* p);
 
-		void write_response(rencoder const& output, ssl_socket& sock, error_code& ec);
-
-		void accept_thread(int port);
-		void connection_thread();
+		struct connection;
 
 		void do_accept();
 		void do_stop();
-		void on_accept(error_code const& ec, ssl_socket* sock);
+		void on_accept(error_code const& ec, std::shared_ptr<connection> c);
 
 		session& m_ses;
+		torrent_history* m_hist;
+		alert_handler* m_alerts;
 		auth_interface const* m_auth;
 		add_torrent_params m_params_model;
 		io_service m_ios;
-		tcp::acceptor* m_listen_socket;
-		std::unique_ptr<std::thread> m_accept_thread;
+		std::unique_ptr<tcp::acceptor> m_listen_socket;
+
+		// the accept handler and do_stop() run on this strand, for the
+		// listen socket to not be closed while an accept is being started
+		// on it, by another thread running m_ios
+		io_service::strand m_accept_strand;
+
+		// the threads running m_ios. The accept handler and all
+		// connections run on these
 		std::vector<std::thread> m_threads;
-		std::mutex m_mutex;
-		std::condition_variable m_cond;
 		boost::asio::ssl::context m_context;
 
-		std::vector<std::unique_ptr<ssl_socket>> m_jobs;
+		// protects m_connections and m_shutdown
+		std::mutex m_mutex;
+		std::vector<std::weak_ptr<connection> > m_connections;
 		bool m_shutdown;
+
+		// the events generated by the alerts in the current dispatch. They
+		// are sent to the interested connections in one batch once the
+		// dispatch is done. Only touched by the alert dispatching thread
+		std::vector<pending_event> m_events;
+
+		// indexed by the handlers of incoming_rpc()
+		rpc_stats m_rpc_stats;
 	};
 
 }
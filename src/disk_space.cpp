@@ -33,24 +33,147 @@ POSSIBILITY OF SUCH DAMAGE.
 // for statfs()
 #include <sys/param.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
 #ifdef __linux__
 #include <sys/vfs.h>
 #endif
 
 #include "disk_space.hpp"
+#include <vector>
+#include <set>
 
 namespace libtorrent
 {
 
-std::int64_t free_disk_space(std::string const& path)
+namespace
+{
+	std::int64_t read_free_space(std::string const& path)
+	{
+		// TODO: support windows
+
+		struct statfs fs;
+		int ret = statfs(path.c_str(), &fs);
+		if (ret < 0) return -1;
+
+		return std::int64_t(fs.f_bavail) * fs.f_bsize;
+	}
+}
+
+disk_space_monitor::disk_space_monitor()
+	: m_new_paths(false)
+	, m_quit(false)
+{
+	m_thread = std::thread(&disk_space_monitor::refresh_thread, this);
+}
+
+disk_space_monitor::~disk_space_monitor()
+{
+	std::unique_lock<std::mutex> l(m_mutex);
+	m_quit = true;
+	m_cond.notify_all();
+	l.unlock();
+	m_thread.join();
+}
+
+std::int64_t disk_space_monitor::free_space(std::string const& path)
 {
-	// TODO: support windows
+	std::unique_lock<std::mutex> l(m_mutex);
+	path_entry& p = m_paths[path];
+	p.last_request = clock_type::now();
+	if (!p.resolved)
+	{
+		m_new_paths = true;
+		m_cond.notify_all();
 
-	struct statfs fs;
-	int ret = statfs(path.c_str(), &fs);
-	if (ret < 0) return -1;
+		clock_type::time_point const deadline = clock_type::now()
+			+ std::chrono::milliseconds(first_sample_ms);
+		while (!p.resolved && !m_quit
+			&& m_cond.wait_until(l, deadline) != std::cv_status::timeout);
+		if (!p.resolved) return -1;
+	}
 
-	return std::int64_t(fs.f_bavail) * fs.f_bsize;
+	std::map<dev_t, std::int64_t>::iterator i = m_free.find(p.device);
+	return i == m_free.end() ? -1 : i->second;
+}
+
+void disk_space_monitor::refresh_thread()
+{
+	std::vector<std::string> paths;
+	std::vector<std::pair<dev_t, std::int64_t> > free;
+	std::vector<std::pair<std::string, dev_t> > devices;
+	std::set<dev_t> seen;
+
+	std::unique_lock<std::mutex> l(m_mutex);
+	while (!m_quit)
+	{
+		// forget the paths nobody has asked about in a while
+		clock_type::time_point const now = clock_type::now();
+		paths.clear();
+		for (std::map<std::string, path_entry>::iterator i = m_paths.begin();
+			i != m_paths.end();)
+		{
+			if (now - i->second.last_request > std::chrono::seconds(forget_after))
+			{
+				m_paths.erase(i++);
+				continue;
+			}
+			paths.push_back(i->first);
+			++i;
+		}
+		m_new_paths = false;
+		l.unlock();
+
+		// each file system is only read once, for the first of its paths
+		free.clear();
+		devices.clear();
+		seen.clear();
+		for (std::vector<std::string>::iterator i = paths.begin()
+			, end(paths.end()); i != end; ++i)
+		{
+			struct stat st;
+			if (stat(i->c_str(), &st) < 0) continue;
+			devices.push_back(std::make_pair(*i, st.st_dev));
+			if (!seen.insert(st.st_dev).second) continue;
+			free.push_back(std::make_pair(st.st_dev, read_free_space(*i)));
+		}
+
+		l.lock();
+		for (std::vector<std::pair<dev_t, std::int64_t> >::iterator i = free.begin()
+			, end(free.end()); i != end; ++i)
+		{
+			m_free[i->first] = i->second;
+		}
+
+		// paths that couldn't be read are resolved too, for requests to
+		// not keep waiting for them. They're reported as unknown
+		for (std::vector<std::string>::iterator i = paths.begin()
+			, end(paths.end()); i != end; ++i)
+		{
+			std::map<std::string, path_entry>::iterator p = m_paths.find(*i);
+			if (p == m_paths.end()) continue;
+			p->second.resolved = true;
+			p->second.device = dev_t(-1);
+		}
+		for (std::vector<std::pair<std::string, dev_t> >::iterator i = devices.begin()
+			, end(devices.end()); i != end; ++i)
+		{
+			std::map<std::string, path_entry>::iterator p = m_paths.find(i->first);
+			if (p == m_paths.end()) continue;
+			p->second.device = i->second;
+		}
+		m_cond.notify_all();
+
+		clock_type::time_point const deadline = clock_type::now()
+			+ std::chrono::seconds(refresh_interval);
+		while (!m_quit && !m_new_paths
+			&& m_cond.wait_until(l, deadline) != std::cv_status::timeout);
+	}
+}
+
+std::int64_t free_disk_space(std::string const& path)
+{
+	static disk_space_monitor monitor;
+	return monitor.free_space(path);
 }
 
 }
@@ -34,10 +34,73 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_DISK_SPACE_HPP
 
 #include <string>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
 #include <boost/cstdint.hpp>
+#include <sys/types.h> // for dev_t
 
 namespace libtorrent
 {
+	// keeps the free space of the file systems paths are on. statfs() may
+	// block for a long time on network file systems, so it's only ever
+	// called from a thread of the monitor's own. Requests get the last value
+	// it read. Paths on the same file system share one value
+	struct disk_space_monitor
+	{
+		disk_space_monitor();
+		~disk_space_monitor();
+
+		// the free space in bytes of the file system path is on, as of the
+		// last refresh, or -1 if it's not known. The first time a path is
+		// asked for, this waits up to first_sample_ms for it to be read
+		std::int64_t free_space(std::string const& path);
+
+		enum
+		{
+			// how often the file systems are read, in seconds
+			refresh_interval = 10,
+
+			first_sample_ms = 200,
+
+			// paths nobody has asked about in this many seconds are
+			// no longer refreshed
+			forget_after = 300
+		};
+
+	private:
+
+		typedef std::chrono::steady_clock clock_type;
+
+		struct path_entry
+		{
+			path_entry() : resolved(false) {}
+			dev_t device;
+			bool resolved;
+			clock_type::time_point last_request;
+		};
+
+		void refresh_thread();
+
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
+
+		std::map<std::string, path_entry> m_paths;
+
+		// the free space of each file system, by its device
+		std::map<dev_t, std::int64_t> m_free;
+
+		// set when a path is added, to have it read right away
+		bool m_new_paths;
+
+		bool m_quit;
+		std::thread m_thread;
+	};
+
+	// the free space of the file system path is on, from a disk_space_monitor
+	// shared by the whole process
 	std::int64_t free_disk_space(std::string const& path);
 }
 
@@ -61,7 +61,8 @@ namespace libtorrent
 				dup2(fileno(m_file), STDOUT_FILENO);
 				dup2(fileno(m_file), STDERR_FILENO);
 			}
-			m_alerts->subscribe(this, 0
+			if (m_file) m_log.reset(new log_ring(m_file));
+			m_alerts->subscribe(this, alert_handler::threaded
 				, peer_disconnected_alert::alert_type
 				, peer_error_alert::alert_type
 				, save_resume_data_failed_alert::alert_type
@@ -84,22 +85,17 @@ namespace libtorrent
 	error_logger::~error_logger()
 	{
 		m_alerts->unsubscribe(this);
+		// the writer is done with the file once the log is destructed
+		m_log.reset();
 		if (m_file) fclose(m_file);
 	}
 
 	void error_logger::handle_alert(alert const* a)
 	{
-		if (m_file == NULL) return;
-		time_t now = time(NULL);
-		char timestamp[256];
-		strncpy(timestamp, ctime(&now), sizeof(timestamp));
-		for (int i = 0; i < sizeof(timestamp); ++i)
-		{
-			if (timestamp[i] != '\n' && timestamp[i] != '\r') continue;
-			timestamp[i] = '\0';
-			break;
-		}
+		if (!m_log) return;
 
+		// the records are formatted here, but time stamped and written to
+		// the file by the log's own thread
 		switch (a->type())
 		{
 			case peer_error_alert::alert_type:
@@ -110,7 +106,7 @@ namespace libtorrent
 				if (pe->error != error_code(336027900, boost::asio::error::get_ssl_category()))
 #endif
 				{
-					fprintf(m_file, "%s\terror [%s] (%s:%d) %s\n", timestamp
+					m_log->post(log_ring::peer_error, "error [%s] (%s:%d) %s"
 						, print_endpoint(pe->ip).c_str(), pe->error.category().name()
 						, pe->error.value(), pe->error.message().c_str());
 				}
@@ -141,7 +137,7 @@ namespace libtorrent
 					&& pd->error != error_code(libtorrent::errors::timed_out)
 					&& pd->error != error_code(libtorrent::errors::timed_out_no_handshake)
 					&& pd->error != error_code(libtorrent::errors::upload_upload_connection))
-					fprintf(m_file, "%s\tdisconnect [%s][%s] (%s:%d) %s\n", timestamp
+					m_log->post(log_ring::peer_disconnect, "disconnect [%s][%s] (%s:%d) %s"
 						, print_endpoint(pd->ip).c_str(), operation_name(pd->operation)
 						, pd->error.category().name(), pd->error.value(), pd->error.message().c_str());
 				break;
@@ -150,7 +146,7 @@ namespace libtorrent
 			{
 				save_resume_data_failed_alert const* rs= alert_cast<save_resume_data_failed_alert>(a);
 				if (rs && rs->error != error_code(libtorrent::errors::resume_data_not_modified))
-					fprintf(m_file, "%s\tsave-resume-failed (%s:%d) %s\n", timestamp
+					m_log->post(log_ring::torrent_error, "save-resume-failed (%s:%d) %s"
 						, rs->error.category().name(), rs->error.value()
 						, rs->message().c_str());
 			}
@@ -158,7 +154,7 @@ namespace libtorrent
 			{
 				torrent_delete_failed_alert const* td = alert_cast<torrent_delete_failed_alert>(a);
 				if (td)
-					fprintf(m_file, "%s\tstorage-delete-failed (%s:%d) %s\n", timestamp
+					m_log->post(log_ring::torrent_error, "storage-delete-failed (%s:%d) %s"
 						, td->error.category().name(), td->error.value()
 						, td->message().c_str());
 			}
@@ -166,7 +162,7 @@ namespace libtorrent
 			{
 				storage_moved_failed_alert const* sm = alert_cast<storage_moved_failed_alert>(a);
 				if (sm)
-					fprintf(m_file, "%s\tstorage-move-failed (%s:%d) %s\n", timestamp
+					m_log->post(log_ring::torrent_error, "storage-move-failed (%s:%d) %s"
 						, sm->error.category().name(), sm->error.value()
 						, sm->message().c_str());
 			}
@@ -174,7 +170,7 @@ namespace libtorrent
 			{
 				file_rename_failed_alert const* rn = alert_cast<file_rename_failed_alert>(a);
 				if (rn)
-					fprintf(m_file, "%s\tfile-rename-failed (%s:%d) %s\n", timestamp
+					m_log->post(log_ring::torrent_error, "file-rename-failed (%s:%d) %s"
 						, rn->error.category().name(), rn->error.value()
 						, rn->message().c_str());
 			}
@@ -182,7 +178,7 @@ namespace libtorrent
 			{
 				torrent_error_alert const* te = alert_cast<torrent_error_alert>(a);
 				if (te)
-					fprintf(m_file, "%s\ttorrent-error (%s:%d) %s\n", timestamp
+					m_log->post(log_ring::torrent_error, "torrent-error (%s:%d) %s"
 						, te->error.category().name(), te->error.value()
 						, te->message().c_str());
 			}
@@ -190,14 +186,14 @@ namespace libtorrent
 			{
 				hash_failed_alert const* hf = alert_cast<hash_failed_alert>(a);
 				if (hf)
-					fprintf(m_file, "%s\thash-failed %s\n", timestamp
+					m_log->post(log_ring::torrent_error, "hash-failed %s"
 						, hf->message().c_str());
 			}
 			case file_error_alert::alert_type:
 			{
 				file_error_alert const* fe = alert_cast<file_error_alert>(a);
 				if (fe)
-					fprintf(m_file, "%s\tfile-error (%s:%d) %s\n", timestamp
+					m_log->post(log_ring::torrent_error, "file-error (%s:%d) %s"
 						, fe->error.category().name(), fe->error.value()
 						, fe->message().c_str());
 			}
@@ -205,7 +201,7 @@ namespace libtorrent
 			{
 				metadata_failed_alert const* mf = alert_cast<metadata_failed_alert>(a);
 				if (mf)
-					fprintf(m_file, "%s\tmetadata-error (%s:%d) %s\n", timestamp
+					m_log->post(log_ring::torrent_error, "metadata-error (%s:%d) %s"
 						, mf->error.category().name(), mf->error.value()
 						, mf->message().c_str());
 			}
@@ -213,7 +209,7 @@ namespace libtorrent
 			{
 				udp_error_alert const* ue = alert_cast<udp_error_alert>(a);
 				if (ue)
-					fprintf(m_file, "%s\tudp-error (%s:%d) %s %s\n", timestamp
+					m_log->post(log_ring::network_error, "udp-error (%s:%d) %s %s"
 						, ue->error.category().name(), ue->error.value()
 						, print_endpoint(ue->endpoint).c_str()
 						, ue->error.message().c_str());
@@ -222,7 +218,7 @@ namespace libtorrent
 			{
 				listen_failed_alert const* lf = alert_cast<listen_failed_alert>(a);
 				if (lf)
-					fprintf(m_file, "%s\tlisten-error (%s:%d) %s\n", timestamp
+					m_log->post(log_ring::network_error, "listen-error (%s:%d) %s"
 						, lf->error.category().name(), lf->error.value()
 						, lf->message().c_str());
 			}
@@ -230,7 +226,7 @@ namespace libtorrent
 			{
 				rss_alert const* ra = alert_cast<rss_alert>(a);
 				if (ra && ra->state == rss_alert::state_error)
-					fprintf(m_file, "%s\trss-error (%s:%d) %s %s\n", timestamp
+					m_log->post(log_ring::network_error, "rss-error (%s:%d) %s %s"
 						, ra->error.category().name(), ra->error.value()
 						, ra->error.message().c_str()
 						, ra->url.c_str());
@@ -239,14 +235,14 @@ namespace libtorrent
 			{
 				invalid_request_alert const* ira = alert_cast<invalid_request_alert>(a);
 				if (ira)
-					fprintf(m_file, "%s\tinvalid-request %s\n", timestamp
+					m_log->post(log_ring::peer_error, "invalid-request %s"
 						, ira->message().c_str());
 			}
 			case mmap_cache_alert::alert_type:
 			{
 				mmap_cache_alert const* ma = alert_cast<mmap_cache_alert>(a);
 				if (ma)
-					fprintf(m_file, "%s\tmmap-cache-error (%s:%d )%s\n", timestamp
+					m_log->post(log_ring::torrent_error, "mmap-cache-error (%s:%d )%s"
 						, ma->error.category().name(), ma->error.value()
 						, ma->message().c_str());
 			}
@@ -34,6 +34,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_ERROR_LOGGER_HPP
 
 #include "alert_observer.hpp"
+#include "log_ring.hpp"
+#include <memory>
 #include <string>
 #include <stdio.h> // for FILE
 
@@ -50,8 +52,14 @@ struct error_logger : libtorrent::alert_observer
 
 	void handle_alert(alert const* a);
 
+	// the log the errors are written to, for other parts to log to the
+	// same file. NULL if there's no log file. During peer disconnect
+	// storms, sample the peer_disconnect category
+	log_ring* log() const { return m_log.get(); }
+
 private:
 	FILE* m_file;
+	std::unique_ptr<log_ring> m_log;
 	alert_handler* m_alerts;
 };
 
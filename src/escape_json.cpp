@@ -32,76 +32,154 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <string>
 #include <string.h>
-#include <stdio.h>
 #include <boost/cstdint.hpp>
-#include <iconv.h>
 #include <vector>
-#include <mutex>
+
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "escape_json.hpp"
-#include "libtorrent/utf8.hpp"
-#include "libtorrent/assert.hpp"
 
 namespace libtorrent
 {
 
-std::string escape_json(std::string const& input)
+namespace
 {
-	if (input.empty()) return "";
-
-	std::vector<std::uint32_t> wide;
-	wide.resize(input.size());
-
-	static std::mutex iconv_mutex;
-	// only one thread can use this handle at a time
-	std::unique_lock<std::mutex> l(iconv_mutex);
-
-	static iconv_t iconv_handle = iconv_open("UTF-32", "UTF-8");
-	if (iconv_handle == iconv_t(-1)) return "(iconv error)";
-
-	size_t insize = input.size();
-	size_t outsize = insize * sizeof(std::uint32_t);
-	char const* in = input.c_str();
-	char* out = (char*)&wide[0];
-	size_t retval = iconv(iconv_handle, (char**)&in, &insize
-		, &out, &outsize);
-	l.unlock();
-
-	if (retval == (size_t)-1) return "(iconv error)";
-	if (insize != 0) return "(iconv error)";
-	if (outsize > input.size() * 4) return "(iconv error)";
-	TORRENT_ASSERT(wide.size() >= outsize);
-	wide.resize(wide.size() - outsize / sizeof(std::uint32_t));
-
-	std::string ret;
-	for (std::vector<std::uint32_t>::const_iterator s = wide.begin(); s != wide.end(); ++s)
+	bool needs_escape(std::uint8_t c)
+	{
+		return c < 0x20 || c >= 0x80 || c == '"' || c == '\\';
+	}
+
+	// returns the number of bytes at the start of the range that can be
+	// copied to the output verbatim
+	int safe_prefix(char const* in, char const* end)
+	{
+		char const* p = in;
+#if defined __SSE2__
+		__m128i const space = _mm_set1_epi8(0x20);
+		__m128i const quote = _mm_set1_epi8('"');
+		__m128i const backslash = _mm_set1_epi8('\\');
+		while (end - p >= 16)
+		{
+			__m128i const v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+			// the compare is signed, so bytes >= 0x80 are less than space too
+			__m128i const m = _mm_or_si128(_mm_cmplt_epi8(v, space)
+				, _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+			if (_mm_movemask_epi8(m) != 0) break;
+			p += 16;
+		}
+#else
+		std::uint64_t const ones = 0x0101010101010101ULL;
+		std::uint64_t const high = 0x8080808080808080ULL;
+		while (end - p >= 8)
+		{
+			std::uint64_t v;
+			memcpy(&v, p, 8);
+			// set the high bit of every byte that is < 0x20, '"' or '\\'.
+			// bytes that already have the high bit set need escaping too
+			std::uint64_t const q = v ^ (ones * '"');
+			std::uint64_t const b = v ^ (ones * '\\');
+			std::uint64_t const m = ((v - ones * 0x20) & ~v)
+				| ((q - ones) & ~q) | ((b - ones) & ~b) | v;
+			if (m & high) break;
+			p += 8;
+		}
+#endif
+		while (p < end && !needs_escape(*p)) ++p;
+		return p - in;
+	}
+
+	// decodes one UTF-8 sequence. Returns the number of bytes consumed, or 0
+	// if the sequence is invalid (truncated, overlong, a surrogate or out of
+	// range)
+	int decode_utf8(std::uint8_t const* p, std::uint8_t const* end
+		, std::uint32_t& cp)
 	{
-		if (*s > 0x1f && *s < 0x80 && *s != '"' && *s != '\\')
+		int len;
+		std::uint32_t min;
+		if ((p[0] & 0xe0) == 0xc0) { len = 2; min = 0x80; cp = p[0] & 0x1f; }
+		else if ((p[0] & 0xf0) == 0xe0) { len = 3; min = 0x800; cp = p[0] & 0x0f; }
+		else if ((p[0] & 0xf8) == 0xf0) { len = 4; min = 0x10000; cp = p[0] & 0x07; }
+		else return 0;
+
+		if (end - p < len) return 0;
+		for (int i = 1; i < len; ++i)
 		{
-			ret += *s;
+			if ((p[i] & 0xc0) != 0x80) return 0;
+			cp = (cp << 6) | (p[i] & 0x3f);
 		}
-		else
+		if (cp < min || cp > 0x10ffff) return 0;
+		if (cp >= 0xd800 && cp <= 0xdfff) return 0;
+		return len;
+	}
+
+	void append_escape(std::vector<char>& out, std::uint32_t c)
+	{
+		static char const hex[] = "0123456789abcdef";
+		char const buf[6] = { '\\', 'u', hex[(c >> 12) & 0xf]
+			, hex[(c >> 8) & 0xf], hex[(c >> 4) & 0xf], hex[c & 0xf] };
+		out.insert(out.end(), buf, buf + 6);
+	}
+}
+
+std::string escape_json(std::string const& input)
+{
+	std::vector<char> out;
+	escape_json(input.c_str(), int(input.size()), out);
+	return std::string(out.begin(), out.end());
+}
+
+void escape_json(char const* in, int len, std::vector<char>& out)
+{
+	char const* end = in + len;
+	while (in < end)
+	{
+		int const n = safe_prefix(in, end);
+		out.insert(out.end(), in, in + n);
+		in += n;
+		if (in == end) break;
+
+		std::uint8_t const c = *in;
+		if (c >= 0x80)
 		{
-			ret += '\\';
-			switch(*s)
+			// everything outside of ASCII is emitted as \u escapes. Invalid
+			// sequences are replaced by U+FFFD, one byte at a time
+			std::uint32_t cp;
+			int seq_len = decode_utf8(reinterpret_cast<std::uint8_t const*>(in)
+				, reinterpret_cast<std::uint8_t const*>(end), cp);
+			if (seq_len == 0)
+			{
+				cp = 0xfffd;
+				seq_len = 1;
+			}
+			if (cp >= 0x10000)
+			{
+				cp -= 0x10000;
+				append_escape(out, 0xd800 + (cp >> 10));
+				append_escape(out, 0xdc00 + (cp & 0x3ff));
+			}
+			else
 			{
-				case '"': ret += '"'; break;
-				case '\\': ret += '\\'; break;
-				case '\n': ret += 'n'; break;
-				case '\r': ret += 'r'; break;
-				case '\t': ret += 't'; break;
-				case '\b': ret += 'b'; break;
-				case '\f': ret += 'f'; break;
-				default:
-				{
-					char buf[20];
-					snprintf(buf, sizeof(buf), "u%04x", std::uint16_t(*s));
-					ret += buf;
-				}
+				append_escape(out, cp);
 			}
+			in += seq_len;
+			continue;
+		}
+
+		switch (c)
+		{
+			case '"': out.push_back('\\'); out.push_back('"'); break;
+			case '\\': out.push_back('\\'); out.push_back('\\'); break;
+			case '\n': out.push_back('\\'); out.push_back('n'); break;
+			case '\r': out.push_back('\\'); out.push_back('r'); break;
+			case '\t': out.push_back('\\'); out.push_back('t'); break;
+			case '\b': out.push_back('\\'); out.push_back('b'); break;
+			case '\f': out.push_back('\\'); out.push_back('f'); break;
+			default: append_escape(out, c);
 		}
+		++in;
 	}
-	return ret;
 }
 
 }
@@ -34,10 +34,14 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_ESCAPE_JSON_HPP
 
 #include <string>
+#include <vector>
 
 namespace libtorrent
 {
 	std::string escape_json(std::string const& in);
+
+	// appends the escaped string to out (without quotes)
+	void escape_json(char const* in, int len, std::vector<char>& out);
 }
 
 #endif
@@ -34,19 +34,25 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "file_downloader.hpp"
 #include "no_auth.hpp"
 #include "auth.hpp"
+#include "file_requests.hpp"
+#include "log_ring.hpp"
 
 #include "libtorrent/session.hpp"
 #include "libtorrent/extensions.hpp"
 #include "libtorrent/peer_id.hpp" // for sha1_hash
 #include "libtorrent/alert_types.hpp"
 #include "libtorrent/torrent.hpp"
+#include "libtorrent/disk_io_thread.hpp" // for cache_status
 #include "libtorrent/aux_/escape_string.hpp" // for escape_string
+#include "libtorrent/hex.hpp" // for to_hex
 
 #include <boost/shared_array.hpp>
 #include <map>
-#include <queue>
+#include <limits>
 #include <mutex>
-#include <condition_variable>
+#include <fcntl.h> // for open
+#include <unistd.h> // for close
+#include <chrono>
 
 extern "C" {
 #include "local_mongoose.h"
@@ -54,31 +60,50 @@ extern "C" {
 
 namespace libtorrent
 {
-	struct piece_entry
+	namespace
 	{
-		boost::shared_array<char> buffer;
-		int size;
-		int piece;
-		// we want ascending order!
-		bool operator<(piece_entry const& rhs) const { return piece > rhs.piece; }
-	};
+		enum { num_cache_metrics = 6 };
 
-	struct torrent_piece_queue
-	{
-		// this is the range of pieces we're interested in
-		int begin;
-		int end;
-		// end may not progress past this. This is end of file
-		// or end of request
-		int finish;
-		std::priority_queue<piece_entry> queue;
-		std::condition_variable cond;
-		std::mutex queue_mutex;
-	};
+		std::vector<rpc_metric> cache_metric_names()
+		{
+			static struct { char const* name; bool counter; } const names[num_cache_metrics] =
+			{
+				{ "file_downloader.cache.size", false },
+				{ "file_downloader.cache.max_size", false },
+				{ "file_downloader.cache.pieces", false },
+				{ "file_downloader.cache.hits", true },
+				{ "file_downloader.cache.misses", true },
+				{ "file_downloader.cache.evictions", true },
+			};
+			std::vector<rpc_metric> ret(num_cache_metrics);
+			for (int i = 0; i < num_cache_metrics; ++i)
+			{
+				ret[i].name = names[i].name;
+				ret[i].counter = names[i].counter;
+			}
+			return ret;
+		}
+
+		std::uint64_t cache_metric(piece_cache::stats_t const& cs, int m)
+		{
+			switch (m)
+			{
+				case 0: return cs.size;
+				case 1: return cs.max_size;
+				case 2: return cs.num_pieces;
+				case 3: return cs.hits;
+				case 4: return cs.misses;
+				case 5: return cs.evictions;
+			}
+			TORRENT_ASSERT(false);
+			return 0;
+		}
+	}
 
 	struct request_t
 	{
-		request_t(std::string filename, std::set<request_t*>& list, std::mutex& m)
+		request_t(std::string filename, std::set<request_t*>& list, std::mutex& m
+			, log_ring* log)
 			: start_time(clock_type::now())
 			, file(filename)
 			, request_size(0)
@@ -89,6 +114,7 @@ namespace libtorrent
 			, state(0)
 			, m_requests(list)
 			, m_mutex(m)
+			, m_log(log)
 		{
 			std::unique_lock<std::mutex> l(m_mutex);
 			m_requests.insert(this);
@@ -97,8 +123,15 @@ namespace libtorrent
 		~request_t()
 		{
 			std::unique_lock<std::mutex> l(m_mutex);
-			debug_print(clock_type::now());
 			m_requests.erase(this);
+			l.unlock();
+
+			if (m_log == NULL) return;
+			m_log->post(log_ring::request, "request %.3f s [%" PRIu64 "-%" PRIu64 "/%" PRIu64 "] "
+				"sent: %" PRIu64 " [p: %d] [s: %d] %s"
+				, total_milliseconds(clock_type::now() - start_time) / 1000.f
+				, start_offset, start_offset + request_size, file_size
+				, bytes_sent, piece, state, file.c_str());
 		}
 
 		void debug_print(time_point now) const
@@ -146,102 +179,176 @@ namespace libtorrent
 	private:
 		std::set<request_t*>& m_requests;
 		std::mutex& m_mutex;
+		log_ring* m_log;
 	};
 
-	// TODO: replace this with file_requests class
-	struct piece_alert_dispatch : plugin
+	// decides how far ahead of the client libtorrent is asked for pieces, and
+	// how urgent each of them is. The window covers a number of seconds worth
+	// of what the client is consuming, and the deadlines are staggered by
+	// when the client is expected to need each piece. Until the client's rate
+	// is known, the deadlines are 100 ms apart
+	struct read_ahead
 	{
-		void on_alert(alert const* a)
+		read_ahead(int piece_size, int max_bytes)
+			: m_piece_size(piece_size)
+			, m_max_bytes((std::max)(max_bytes, piece_size))
+			, m_consume_rate(0)
+			, m_download_rate(0)
+			, m_sample_start(clock_type::now())
+			, m_sample_bytes(0)
+		{}
+
+		// seconds of consumption to keep requested ahead of the client
+		enum { lookahead_seconds = 10 };
+
+		// ask for pieces twice as early as the client would need them
+		enum { deadline_margin = 2 };
+
+		// records bytes sent to the client. Returns true when a new rate
+		// sample was taken, which is a good time to update the download rate
+		bool sent(int bytes, time_point now)
 		{
-			read_piece_alert const* p = alert_cast<read_piece_alert>(a);
-			if (p == NULL) return;
+			m_sample_bytes += bytes;
+			int const ms = total_milliseconds(now - m_sample_start);
+			if (ms < 1000) return false;
+
+			double const rate = m_sample_bytes * 1000.0 / ms;
+			m_consume_rate = m_consume_rate == 0 ? rate : m_consume_rate * 0.7 + rate * 0.3;
+			m_sample_start = now;
+			m_sample_bytes = 0;
+			return true;
+		}
 
-//			fprintf(stderr, "piece: %d\n", p->piece);
+		void set_download_rate(int rate) { m_download_rate = rate; }
 
-			std::unique_lock<std::mutex> l(m_mutex);
-			typedef std::multimap<sha1_hash, torrent_piece_queue*>::iterator iter;
-			shared_ptr<torrent> t = p->handle.native_handle();
+		// the number of pieces to have requested ahead of the one being
+		// sent
+		int window() const
+		{
+			std::int64_t bytes = std::int64_t(m_consume_rate * lookahead_seconds);
 
-			std::pair<iter, iter> range = m_torrents.equal_range(t->info_hash());
-			if (range.first == m_torrents.end()) return;
+			// when the swarm can't keep up with the client, spread the
+			// requests over more pieces, to have more peers working on them
+			if (m_download_rate > 0 && m_download_rate < m_consume_rate)
+				bytes = std::int64_t(bytes * m_consume_rate / m_download_rate);
 
-			for (iter i = range.first; i != range.second; ++i)
-			{
-				std::unique_lock<std::mutex> l2(i->second->queue_mutex);
-				if (p->piece < i->second->begin || p->piece >= i->second->end)
-					continue;
-				piece_entry pe;
-				pe.buffer = p->buffer;
-				pe.piece = p->piece;
-				pe.size = p->size;
-
-				i->second->queue.push(pe);
-				if (pe.piece == i->second->begin)
-					i->second->cond.notify_all();
-			}
+			bytes = (std::min)(bytes, std::int64_t(m_max_bytes));
+			return (std::max)(int(bytes / m_piece_size), int(min_pieces));
 		}
 
-		void subscribe(sha1_hash const& ih, torrent_piece_queue* pq)
+		// the deadline, in milliseconds, for a piece starting this many bytes
+		// ahead of where the client is. A slow client far behind the piece
+		// could need more than fits in an int, those are clamped
+		int deadline(std::int64_t bytes_ahead) const
 		{
-			std::unique_lock<std::mutex> l(m_mutex);
-			m_torrents.insert(std::make_pair(ih, pq));
+			double const ms = m_consume_rate < 1.0
+				? 100.0 * (bytes_ahead / m_piece_size)
+				: bytes_ahead * 1000.0 / (m_consume_rate * deadline_margin);
+			return int((std::min)(ms, double((std::numeric_limits<int>::max)())));
 		}
 
-		// if the pieces pointer is specified, it's filled in with pieces
-		// that were part of the 'pq' request, and are also still parts of
-		// other requests, that are still outstanding
-		void unsubscribe(sha1_hash const& ih, torrent_piece_queue* pq
-			, std::set<int>* pieces = NULL)
-		{
-			std::unique_lock<std::mutex> l(m_mutex);
-			typedef std::multimap<sha1_hash, torrent_piece_queue*>::iterator iter;
+	private:
+
+		// always keep a few pieces in flight, for the disk reads of the
+		// pieces we already have to overlap with sending
+		enum { min_pieces = 4 };
+
+		int const m_piece_size;
+		int const m_max_bytes;
 
-			std::pair<iter, iter> range = m_torrents.equal_range(ih);
-			if (range.first == m_torrents.end()) return;
+		// moving average of the rate the client is reading at, bytes/s
+		double m_consume_rate;
 
-			iter to_delete = m_torrents.end();
+		// the torrent's payload download rate, bytes/s
+		int m_download_rate;
 
-			for (iter i = range.first; i != range.second; ++i)
+		time_point m_sample_start;
+		std::int64_t m_sample_bytes;
+	};
+
+	typedef std::pair<std::int64_t, std::int64_t> byte_range;
+
+	// the most parts a multipart response is made up of. Requests for more
+	// ranges than this are sent the whole file instead
+	enum { max_ranges = 64 };
+
+	// parses the value of a Range header into the byte ranges, inclusive,
+	// that are within the file. They're sorted, and overlapping or adjacent
+	// ranges are merged. Returns false if the header is malformed and should
+	// be ignored
+	static bool parse_ranges(char const* str, std::int64_t file_size
+		, std::vector<byte_range>& ranges)
+	{
+		if (strncmp(str, "bytes=", 6) != 0) return false;
+		str += 6;
+
+		for (;;)
+		{
+			while (*str == ' ' || *str == '\t') ++str;
+
+			char* end;
+			std::int64_t first;
+			std::int64_t last = file_size - 1;
+			if (*str == '-')
+			{
+				// the last n bytes of the file
+				std::int64_t const n = strtoll(str + 1, &end, 10);
+				if (end == str + 1 || n < 0) return false;
+				first = n == 0 ? file_size : (std::max)(file_size - n, std::int64_t(0));
+			}
+			else
 			{
-				if (i->second != pq)
+				first = strtoll(str, &end, 10);
+				if (end == str || *end != '-' || first < 0) return false;
+				str = end + 1;
+				end = const_cast<char*>(str);
+
+				// if the end of a range is not specified, the end of file
+				// is implied
+				if (*str >= '0' && *str <= '9')
 				{
-					if (pieces)
-					{
-						for (int k = (std::max)(pq->begin, i->second->begin)
-							, end((std::min)(pq->end, i->second->end)); k < end; ++k)
-						{
-							pieces->insert(k);
-						}
-					}
-					continue;
+					last = strtoll(str, &end, 10);
+					if (last < first) return false;
 				}
-
-				to_delete = i;
-
-				// if we want to know the pieces that are still in use, we need to
-				// continue and iterate over all other torrents
-				if (!pieces) break;
 			}
+			str = end;
 
-			if (to_delete != m_torrents.end())
-				m_torrents.erase(to_delete);
-		}
-
-	private:
+			// ranges starting past the end of the file are dropped, ranges
+			// reaching past it are cut short
+			if (first < file_size)
+				ranges.push_back(byte_range(first, (std::min)(last, file_size - 1)));
 
-		std::mutex m_mutex;
-		std::multimap<sha1_hash, torrent_piece_queue*> m_torrents;
+			while (*str == ' ' || *str == '\t') ++str;
+			if (*str == '\0') break;
+			if (*str != ',') return false;
+			++str;
+		}
 
-	};
+		std::sort(ranges.begin(), ranges.end());
+		std::vector<byte_range> merged;
+		for (std::vector<byte_range>::iterator i = ranges.begin(); i != ranges.end(); ++i)
+		{
+			if (!merged.empty() && i->first <= merged.back().second + 1)
+				merged.back().second = (std::max)(merged.back().second, i->second);
+			else
+				merged.push_back(*i);
+		}
+		ranges.swap(merged);
+		if (int(ranges.size()) > max_ranges)
+		{
+			ranges.clear();
+			return false;
+		}
+		return true;
+	}
 
 	file_downloader::file_downloader(session& s, auth_interface const* auth)
 		: m_ses(s)
 		, m_auth(auth)
-		, m_dispatch(new piece_alert_dispatch())
-// TODO: this number needs to be proportional to the rate at which a file
-// is downloaded
-		, m_queue_size(20 * 1024 * 1024)
+		, m_pieces(new file_requests(128 * 1024 * 1024))
+		, m_queue_size(64 * 1024 * 1024)
 		, m_attachment(true)
+		, m_log(NULL)
 	{
 		if (m_auth == NULL)
 		{
@@ -249,7 +356,10 @@ namespace libtorrent
 			m_auth = &n;
 		}
 
-		m_ses.add_extension(boost::static_pointer_cast<libtorrent::plugin>(m_dispatch));
+		m_ses.add_extension(boost::static_pointer_cast<libtorrent::plugin>(m_pieces));
+
+		m_cache_metrics.reset(new metric_source(cache_metric_names()
+			, [this](int m) { return cache_metric(cache_stats(), m); }));
 	}
 
 	bool file_downloader::handle_http(mg_connection* conn,
@@ -314,111 +424,251 @@ namespace libtorrent
 		}
 
 		std::int64_t const file_size = ti->files().file_size(file);
-		std::int64_t range_first_byte = 0;
-		std::int64_t range_last_byte = file_size - 1;
-		bool range_request = false;
 
-		char const* range = mg_get_header(conn, "range");
-		if (range)
+		// the content of a file in a torrent never changes, the info-hash and
+		// file index make a strong validator
+		char etag[60];
+		snprintf(etag, sizeof(etag), "\"%s-%d\"", to_hex(info_hash.to_string()).c_str(), file);
+
+		char const* if_none_match = mg_get_header(conn, "if-none-match");
+		if (if_none_match && (strcmp(if_none_match, "*") == 0 || strstr(if_none_match, etag)))
 		{
-			range = strstr(range, "bytes=");
-			if (range)
-			{
-				range += 6; // skip bytes=
-				char const* divider = strchr(range, '-');
-				if (divider)
-				{
-					range_first_byte = strtoll(range, NULL, 10);
+			mg_printf(conn, "HTTP/1.1 304 Not Modified\r\n"
+				"ETag: %s\r\n\r\n", etag);
+			return true;
+		}
 
-					// if the end of a range is not specified, the end of file
-					// is implied
-					if (divider[1] != '\0')
-						range_last_byte = strtoll(divider+1, NULL, 10);
-					else
-						range_last_byte = file_size - 1;
+		char const* range = mg_get_header(conn, "range");
 
-					range_request = true;
-				}
+		// the range only applies if the client's copy is the one we have.
+		// Dates can't be validated, those get the whole file
+		char const* if_range = mg_get_header(conn, "if-range");
+		if (if_range && strcmp(if_range, etag) != 0) range = NULL;
+
+		std::vector<byte_range> ranges;
+		bool range_request = false;
+		if (range && parse_ranges(range, file_size, ranges))
+		{
+			if (ranges.empty())
+			{
+				mg_printf(conn, "HTTP/1.1 416 Requested Range Not Satisfiable\r\n"
+					"Content-Range: bytes */%" PRId64 "\r\n"
+					"Content-Length: 0\r\n\r\n"
+					, file_size);
+				return true;
 			}
+			range_request = true;
 		}
-
-		peer_request req = ti->map_file(file, range_first_byte, 0);
-		int piece_size = ti->piece_length();
-		int first_piece = req.piece;
-		int end_piece = ti->map_file(file, range_last_byte, 0).piece + 1;
-		std::uint64_t offset = req.start;
-
-		if (range_request && (range_first_byte > range_last_byte
-			|| range_last_byte >= file_size
-			|| range_first_byte < 0))
+		else if (file_size > 0)
 		{
-			mg_printf(conn, "HTTP/1.1 416 Requested Range Not Satisfiable\r\n"
-				"Content-Length: %" PRId64 "\r\n\r\n"
-				, file_size);
-			return true;
+			ranges.push_back(byte_range(0, file_size - 1));
 		}
 
-		printf("GET range: %" PRId64 " - %" PRId64 "\n", range_first_byte, range_last_byte);
-
-		torrent_piece_queue pq;
-		pq.begin = first_piece;
-		pq.finish = end_piece;
-		pq.end = (std::min)(first_piece + (std::max)(m_queue_size / ti->piece_length(), 1), pq.finish);
-
-		m_dispatch->subscribe(info_hash, &pq);
+		std::string const fname = ti->files().file_name(file);
+		char const* mime = mg_get_builtin_mime_type(fname.c_str());
 
-		int priority_cursor = pq.begin;
+		// with more than one range, every part is preceded by its own headers
+		char boundary[60];
+		snprintf(boundary, sizeof(boundary), "byteranges-%s", to_hex(info_hash.to_string()).c_str());
+		std::vector<std::string> part_headers;
+		std::int64_t content_length = 0;
+		std::int64_t data_length = 0;
+		for (std::vector<byte_range>::iterator i = ranges.begin(); i != ranges.end(); ++i)
+		{
+			printf("GET range: %" PRId64 " - %" PRId64 "\n", i->first, i->second);
+			data_length += i->second - i->first + 1;
+			if (ranges.size() == 1) continue;
+
+			char buf[300];
+			snprintf(buf, sizeof(buf), "\r\n--%s\r\n"
+				"Content-Type: %s\r\n"
+				"Content-Range: bytes %" PRId64 "-%" PRId64 "/%" PRId64 "\r\n\r\n"
+				, boundary, mime, i->first, i->second, file_size);
+			part_headers.push_back(buf);
+			content_length += part_headers.back().size();
+		}
+		char trailer[80];
+		snprintf(trailer, sizeof(trailer), "\r\n--%s--\r\n", boundary);
+		if (ranges.size() > 1) content_length += strlen(trailer);
+		content_length += data_length;
 
-		request_t r(ti->files().file_path(file), m_requests, m_mutex);
-		r.request_size = range_last_byte - range_first_byte + 1;
-		r.file_size = ti->files().file_size(file);
-		r.start_offset = range_first_byte;
+		request_t r(ti->files().file_path(file), m_requests, m_mutex, m_log);
+		r.request_size = data_length;
+		r.file_size = file_size;
+		r.start_offset = ranges.empty() ? 0 : ranges.front().first;
 
-		std::string fname = ti->files().file_name(file);
 		r.state = request_t::writing_to_socket;
 		mg_printf(conn, "HTTP/1.1 %s\r\n"
 			"Content-Length: %" PRId64 "\r\n"
-			"Content-Type: %s\r\n"
+			"ETag: %s\r\n"
 			"%s%s%s"
 			"Accept-Ranges: bytes\r\n"
 			, range_request ? "206 Partial Content" : "200 OK"
-			, range_last_byte - range_first_byte + 1
-			, mg_get_builtin_mime_type(ti->files().file_name(file).c_str())
+			, content_length
+			, etag
 			, m_attachment ? "Content-Disposition: attachment; filename=" : ""
 			, m_attachment ? escape_string(fname.c_str(), fname.size()).c_str() : ""
 			, m_attachment ? "\r\n" : "");
 
-		if (range_request)
+		if (ranges.size() > 1)
 		{
-			mg_printf(conn, "Content-Range: bytes %" PRId64 "-%" PRId64 "/%" PRId64 "\r\n\r\n"
-				, range_first_byte, range_last_byte, file_size);
+			mg_printf(conn, "Content-Type: multipart/byteranges; boundary=%s\r\n\r\n"
+				, boundary);
+		}
+		else if (range_request)
+		{
+			mg_printf(conn, "Content-Type: %s\r\n"
+				"Content-Range: bytes %" PRId64 "-%" PRId64 "/%" PRId64 "\r\n\r\n"
+				, mime, ranges.front().first, ranges.front().second, file_size);
 		}
 		else
 		{
-			mg_printf(conn, "\r\n");
+			mg_printf(conn, "Content-Type: %s\r\n\r\n", mime);
 		}
 		r.state = request_t::waiting_for_libtorrent;
 
-		std::int64_t left_to_send = range_last_byte - range_first_byte + 1;
-//		printf("left_to_send: %" PRId64 " bytes\n", left_to_send);
-
-		// increase the priority of this range to 5
+		// the parts are fetched as one plan. The pieces of all of them have
+		// their priority raised to 5 up front, while the parts are sent in
+		// order. The ranges are sorted, so the pieces are too
 		std::vector<std::pair<int, int> > pieces_in_req;
-		pieces_in_req.resize(pq.finish - pq.begin);
-		int p = pq.begin;
-		for (int i = 0; i < pieces_in_req.size(); ++i)
+		for (std::vector<byte_range>::iterator i = ranges.begin(); i != ranges.end(); ++i)
 		{
-			pieces_in_req[i] = std::make_pair(p, 5);
-			++p;
+			int const end_piece = ti->map_file(file, i->second, 0).piece + 1;
+			for (int p = ti->map_file(file, i->first, 0).piece; p < end_piece; ++p)
+			{
+				if (!pieces_in_req.empty() && pieces_in_req.back().first >= p) continue;
+				pieces_in_req.push_back(std::make_pair(p, 5));
+			}
 		}
 		h.prioritize_pieces(pieces_in_req);
 
+		bool ok = true;
+		for (int i = 0; ok && i < int(ranges.size()); ++i)
+		{
+			if (!part_headers.empty())
+			{
+				ok = mg_write(conn, part_headers[i].c_str(), part_headers[i].size())
+					== int(part_headers[i].size());
+				if (!ok) break;
+			}
+			ok = send_range(conn, h, *ti, info_hash, file
+				, ranges[i].first, ranges[i].second, r);
+		}
+		if (ok && !part_headers.empty())
+			mg_write(conn, trailer, strlen(trailer));
+
+//		printf("done, sent %" PRId64 " bytes\n", r.bytes_sent);
+
+		// TODO: this doesn't work right if there are overlapping requests
+
+		// restore piece priorities
+		for (int i = 0; i < pieces_in_req.size(); ++i)
+			pieces_in_req[i].second = 1;
+		h.prioritize_pieces(pieces_in_req);
+
+		return true;
+	}
+
+	bool file_downloader::send_range(mg_connection* conn, torrent_handle const& h
+		, torrent_info const& ti, sha1_hash const& info_hash, int file
+		, std::int64_t range_first_byte, std::int64_t range_last_byte
+		, request_t& r)
+	{
+		peer_request req = ti.map_file(file, range_first_byte, 0);
+		int piece_size = ti.piece_length();
+		int first_piece = req.piece;
+		int end_piece = ti.map_file(file, range_last_byte, 0).piece + 1;
+		std::uint64_t offset = req.start;
+
+		// the leading pieces of the range we already have are sent straight
+		// from the file on disk. The piece pipeline only takes over from the
+		// first piece we're missing
+		int disk_end_piece = first_piece;
+		int fd = -1;
+		{
+			torrent_status st = h.status(torrent_handle::query_pieces
+				| torrent_handle::query_save_path);
+			if (!st.pieces.empty())
+			{
+				while (disk_end_piece < end_piece && st.pieces.get_bit(disk_end_piece))
+					++disk_end_piece;
+			}
+			if (disk_end_piece > first_piece)
+			{
+				// a piece passes its hash check before it's written to disk.
+				// The ones still in the write cache may not be in the file
+				// yet, they're read through the pipeline instead. Pieces
+				// don't go back into the write cache once they're checked, so
+				// the ones not in it now are on disk
+				cache_status cs;
+				m_ses.get_cache_info(&cs, h);
+				for (std::vector<cached_piece_info>::iterator i = cs.pieces.begin()
+					, end(cs.pieces.end()); i != end; ++i)
+				{
+					if (i->kind != cached_piece_info::write_cache) continue;
+					if (i->piece < first_piece || i->piece >= disk_end_piece) continue;
+					disk_end_piece = i->piece;
+				}
+			}
+			if (disk_end_piece > first_piece)
+			{
+				std::string const path = ti.files().file_path(file, st.save_path);
+				fd = open(path.c_str(), O_RDONLY);
+				if (fd < 0) disk_end_piece = first_piece;
+			}
+		}
+
+		std::int64_t left_to_send = range_last_byte - range_first_byte + 1;
+
+		if (fd >= 0)
+		{
+			// the file offset where the first missing piece starts
+			std::int64_t const disk_end = std::int64_t(disk_end_piece) * piece_size
+				- ti.files().file_offset(file);
+			std::int64_t const disk_bytes = (std::min)(disk_end - range_first_byte
+				, left_to_send);
+
+			r.state = request_t::writing_to_socket;
+			std::int64_t const ret = mg_send_file_range(conn, fd
+				, range_first_byte, disk_bytes);
+			close(fd);
+			r.state = request_t::waiting_for_libtorrent;
+
+			r.bytes_sent += ret;
+			left_to_send -= ret;
+			if (ret < disk_bytes)
+			{
+				if (ret < 0)
+					fprintf(stderr, "interrupted (sent %" PRId64 " of %" PRId64
+						" bytes from disk) errno: (%d) %s\n", ret, disk_bytes, errno
+						, strerror(errno));
+				else
+					fprintf(stderr, "interrupted (sent %" PRId64 " of %" PRId64
+						" bytes from disk)\n", ret, disk_bytes);
+				return false;
+			}
+			if (left_to_send == 0) return true;
+
+			// the first missing piece starts inside the file, so its data
+			// starts at the beginning of the piece
+			first_piece = disk_end_piece;
+			offset = 0;
+		}
+
+		read_ahead ra(piece_size, m_queue_size);
+
+		torrent_piece_queue pq;
+		pq.begin = first_piece;
+		pq.finish = end_piece;
+		pq.end = (std::min)(first_piece + ra.window(), pq.finish);
+
+		int priority_cursor = pq.begin;
+
 		while (priority_cursor < pq.end)
 		{
 //			printf("set_piece_deadline: %d\n", priority_cursor);
-			h.set_piece_deadline(priority_cursor
-				, 100 * (priority_cursor - pq.begin)
-				, torrent_handle::alert_when_available);
+			m_pieces->request_piece(h, info_hash, &pq, priority_cursor
+				, ra.deadline(std::int64_t(priority_cursor - pq.begin) * piece_size));
 			++priority_cursor;
 		}
 
@@ -429,7 +679,14 @@ namespace libtorrent
 			// TODO: come up with some way to abort
 			while (pq.queue.empty() || pq.queue.top().piece > i)
 			{
-				pq.cond.wait(l);
+				// if the piece we're waiting for is late, make it as urgent
+				// as it gets. This also re-issues the read, in case it was lost
+				if (pq.cond.wait_for(l, std::chrono::seconds(2)) == std::cv_status::timeout)
+				{
+					l.unlock();
+					h.set_piece_deadline(i, 0, torrent_handle::alert_when_available);
+					l.lock();
+				}
 				// TODO: we may have woken up because of a SIGPIPE and this
 				// connection may have been broken. Test to see if our connection
 				// to the client is still open, and if it isn't, abort
@@ -445,7 +702,9 @@ namespace libtorrent
 				continue;
 			}
 
-			pq.end = (std::min)(pq.end + 1, pq.finish);
+			// the window only ever grows. Pieces that have been asked for
+			// stay requested
+			pq.end = (std::max)(pq.end, (std::min)(i + 1 + ra.window(), pq.finish));
 			pq.begin = (std::min)(pq.begin + 1, pq.end);
 
 			l.unlock();
@@ -453,9 +712,8 @@ namespace libtorrent
 			while (priority_cursor < pq.end)
 			{
 //				printf("set_piece_deadline: %d\n", priority_cursor);
-				h.set_piece_deadline(priority_cursor
-					, 100 * (priority_cursor - i)
-					, torrent_handle::alert_when_available);
+				m_pieces->request_piece(h, info_hash, &pq, priority_cursor
+					, ra.deadline(std::int64_t(priority_cursor - i) * piece_size));
 				++priority_cursor;
 			}
 
@@ -490,6 +748,11 @@ namespace libtorrent
 				}
 				TORRENT_ASSERT(r.bytes_sent + ret<= r.request_size);
 				r.bytes_sent += ret;
+
+				// once a second, when the client's rate is sampled, also
+				// pick up the rate the torrent is downloading at
+				if (ra.sent(ret, clock_type::now()))
+					ra.set_download_rate(h.status(0).download_payload_rate);
 				r.state = request_t::waiting_for_libtorrent;
 
 				left_to_send -= ret;
@@ -501,29 +764,36 @@ namespace libtorrent
 			offset = 0;
 		}
 
-		std::set<int> still_in_use;
-		m_dispatch->unsubscribe(info_hash, &pq, &still_in_use);
+		// only the pieces no other stream is waiting for lose their deadline
+		std::vector<int> orphaned;
+		m_pieces->cancel(info_hash, &pq, pq.begin, priority_cursor, orphaned);
 
-		for (int k = pq.begin; k < priority_cursor; ++k)
+		for (std::vector<int>::iterator k = orphaned.begin(); k != orphaned.end(); ++k)
 		{
-			if (still_in_use.count(k)) continue;
-			printf("reset_piece_deadline: %d\n", k);
-			h.reset_piece_deadline(k);
+			printf("reset_piece_deadline: %d\n", *k);
+			h.reset_piece_deadline(*k);
 		}
-//		printf("done, sent %" PRId64 " bytes\n", r.bytes_sent);
 
-		// TODO: this doesn't work right if there are overlapping requests
+		return left_to_send == 0;
+	}
 
-		// restore piece priorities
-		for (int i = 0; i < pieces_in_req.size(); ++i)
-			pieces_in_req[i].second = 1;
-		h.prioritize_pieces(pieces_in_req);
+	void file_downloader::set_cache_size(std::int64_t bytes)
+	{
+		m_pieces->cache().set_max_size(bytes);
+	}
 
-		return true;
+	piece_cache::stats_t file_downloader::cache_stats() const
+	{
+		return m_pieces->cache().stats();
 	}
 
 	void file_downloader::debug_print_requests() const
 	{
+		piece_cache::stats_t const cs = cache_stats();
+		printf("piece cache: %d pieces, %" PRId64 " / %" PRId64 " bytes "
+			"hits: %" PRId64 " misses: %" PRId64 " evictions: %" PRId64 "\n"
+			, cs.num_pieces, cs.size, cs.max_size, cs.hits, cs.misses, cs.evictions);
+
 		time_point now = clock_type::now();
 		std::unique_lock<std::mutex> l(m_mutex);
 		for (std::set<request_t*>::const_iterator i = m_requests.begin()
@@ -36,14 +36,18 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/torrent_handle.hpp" // for shared_ptr
 #include <boost/shared_ptr.hpp>
 #include "webui.hpp"
+#include "piece_cache.hpp"
+#include "rpc_stats.hpp"
 #include <mutex>
 #include <set>
+#include <memory>
 
 namespace libtorrent
 {
-	struct piece_alert_dispatch;
+	struct file_requests;
 	struct auth_interface;
 	struct request_t;
+	struct log_ring;
 	class session;
 
 	struct file_downloader : http_handler
@@ -54,15 +58,35 @@ namespace libtorrent
 			mg_request_info const* request_info);
 
 		void set_disposition(bool attachment) { m_attachment = attachment; }
+
+		// the pieces read for streams are cached, to be shared by all
+		// streams of the same file. Defaults to 128 MB
+		void set_cache_size(std::int64_t bytes);
+
+		// the cache stats are also exported along with the RPC metrics, as
+		// file_downloader.cache.*
+		piece_cache::stats_t cache_stats() const;
 		void debug_print_requests() const;
 
+		// every request is logged here when it completes. Requests aren't
+		// logged by default
+		void set_log(log_ring* log) { m_log = log; }
+
 	private:
 
+		// sends the bytes [first, last] of the file. Returns false if the
+		// client went away
+		bool send_range(mg_connection* conn, torrent_handle const& h
+			, torrent_info const& ti, sha1_hash const& info_hash, int file
+			, std::int64_t first, std::int64_t last, request_t& r);
+
 		session& m_ses;
 		auth_interface const* m_auth;
 
-		libtorrent::shared_ptr<piece_alert_dispatch> m_dispatch;
+		libtorrent::shared_ptr<file_requests> m_pieces;
 
+		// the most bytes to read ahead of a client. The read-ahead is sized
+		// by the rate the client consumes the file at, up to this
 		int m_queue_size;
 
 		// controls the content disposition of files. Defaults to true
@@ -71,6 +95,11 @@ namespace libtorrent
 
 		mutable std::mutex m_mutex;
 		std::set<request_t*> m_requests;
+
+		log_ring* m_log;
+
+		// this is last, to be unregistered before m_pieces is destroyed
+		std::unique_ptr<metric_source> m_cache_metrics;
 	};
 }
 
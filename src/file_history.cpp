@@ -0,0 +1,249 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "file_history.hpp"
+#include "torrent_history.hpp"
+#include "alert_handler.hpp"
+#include "escape_json.hpp"
+#include "libtorrent/alert_types.hpp"
+#include "libtorrent/torrent_handle.hpp"
+
+namespace libtorrent
+{
+	file_json_strings::file_json_strings(file_storage const& fs)
+	{
+		names.reserve(fs.num_files());
+		paths.reserve(fs.num_files());
+		for (int i = 0; i < fs.num_files(); ++i)
+		{
+			names.push_back(escape_json(fs.file_name(i)));
+			paths.push_back(escape_json(fs.file_path(i)));
+		}
+	}
+
+	file_entry_ptr read_files(torrent_handle const& h)
+	{
+		boost::shared_ptr<torrent_info const> t = h.torrent_file();
+		if (!t) return file_entry_ptr();
+
+		file_storage const& fs = t->files();
+		std::shared_ptr<file_history_entry> ret = std::make_shared<file_history_entry>();
+		ret->torrent = t;
+		ret->frame = 1;
+		ret->static_frame = 1;
+		ret->json = std::make_shared<file_json_strings>(fs);
+		ret->total_done = -1;
+		h.file_progress(ret->progress, torrent_handle::piece_granularity);
+		ret->priority = h.file_priorities();
+
+		// just in case
+		ret->progress.resize(fs.num_files(), 0);
+		ret->priority.resize(fs.num_files(), 1);
+		ret->progress_frame.resize(fs.num_files(), 1);
+		ret->priority_frame.resize(fs.num_files(), 1);
+		return ret;
+	}
+
+	file_history::file_history(alert_handler* h, torrent_history const* hist)
+		: m_alerts(h)
+		, m_hist(hist)
+		, m_frame(0)
+		, m_last_eviction(clock_type::now())
+	{
+		m_alerts->subscribe(this, 0
+			, torrent_removed_alert::alert_type
+			, file_renamed_alert::alert_type
+			, 0);
+	}
+
+	file_history::~file_history()
+	{
+		m_alerts->unsubscribe(this);
+	}
+
+	int file_history::frame() const
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		return m_frame;
+	}
+
+	void file_history::watched_torrents(std::vector<sha1_hash>& ret) const
+	{
+		time_point const now = clock_type::now();
+		std::unique_lock<std::mutex> l(m_mutex);
+		for (std::map<sha1_hash, watched_files>::const_iterator i = m_torrents.begin()
+			, end(m_torrents.end()); i != end; ++i)
+		{
+			if (now - i->second.last_request > seconds(watch_timeout)) continue;
+			ret.push_back(i->first);
+		}
+	}
+
+	void file_history::priorities_changed(sha1_hash const& ih)
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		std::map<sha1_hash, watched_files>::iterator i = m_torrents.find(ih);
+		if (i != m_torrents.end()) i->second.stale_priorities = true;
+	}
+
+	void file_history::evict_unwatched(time_point now)
+	{
+		if (now - m_last_eviction < seconds(watch_timeout / 2)) return;
+		m_last_eviction = now;
+
+		for (std::map<sha1_hash, watched_files>::iterator i = m_torrents.begin();
+			i != m_torrents.end();)
+		{
+			if (now - i->second.last_request > seconds(watch_timeout))
+				m_torrents.erase(i++);
+			else
+				++i;
+		}
+	}
+
+	file_entry_ptr file_history::get_file_updates(torrent_handle const& h)
+	{
+		sha1_hash const ih = h.info_hash();
+		time_point const now = clock_type::now();
+
+		file_entry_ptr e;
+		bool stale_priorities = false;
+		{
+			std::unique_lock<std::mutex> l(m_mutex);
+			evict_unwatched(now);
+			std::map<sha1_hash, watched_files>::iterator i = m_torrents.find(ih);
+			if (i != m_torrents.end())
+			{
+				e = i->second.entry;
+				i->second.last_request = now;
+
+				// cleared before reading the priorities, for a change made
+				// while we're reading them to not be lost
+				stale_priorities = i->second.stale_priorities;
+				i->second.stale_priorities = false;
+			}
+		}
+
+		// the file progress is only read at piece granularity. It can only
+		// change when the torrent completes a piece, and when it does,
+		// total_done changes too. If the torrent_history doesn't know about
+		// the torrent, always refresh
+		torrent_status const st = m_hist->get_torrent_status(ih);
+		bool const progress_current = e && st.handle.is_valid()
+			&& st.total_done == e->total_done;
+		if (progress_current && !stale_priorities)
+			return e;
+
+		boost::shared_ptr<torrent_info const> t = h.torrent_file();
+		if (!t) return file_entry_ptr();
+
+		file_storage const& fs = t->files();
+
+		std::shared_ptr<file_history_entry> ne = std::make_shared<file_history_entry>();
+		ne->torrent = t;
+		ne->total_done = st.total_done;
+		if (progress_current) ne->progress = e->progress;
+		else h.file_progress(ne->progress, torrent_handle::piece_granularity);
+		ne->priority = h.file_priorities();
+
+		// just in case
+		ne->progress.resize(fs.num_files(), 0);
+		ne->priority.resize(fs.num_files(), 1);
+
+		// escaping all the file names is the expensive part of a new
+		// entry. Do it outside of the lock
+		std::shared_ptr<file_json_strings const> json;
+		if (!e || e->progress.size() != ne->progress.size())
+			json = std::make_shared<file_json_strings>(fs);
+
+		std::unique_lock<std::mutex> l(m_mutex);
+
+		// someone else may have refreshed the entry while we were reading
+		// the progress, compare against the most recent one
+		watched_files& w = m_torrents[ih];
+		w.last_request = now;
+		file_entry_ptr& cur = w.entry;
+		int const frame = m_frame + 1;
+		bool changed = false;
+
+		if (!cur || cur->progress.size() != ne->progress.size())
+		{
+			ne->static_frame = frame;
+			ne->json = json ? json : std::make_shared<file_json_strings>(fs);
+			ne->progress_frame.resize(ne->progress.size(), frame);
+			ne->priority_frame.resize(ne->priority.size(), frame);
+			changed = true;
+		}
+		else
+		{
+			ne->static_frame = cur->static_frame;
+			ne->json = cur->json;
+			ne->progress_frame = cur->progress_frame;
+			ne->priority_frame = cur->priority_frame;
+			for (int i = 0; i < int(ne->progress.size()); ++i)
+			{
+				if (ne->progress[i] != cur->progress[i])
+				{
+					ne->progress_frame[i] = frame;
+					changed = true;
+				}
+				if (ne->priority[i] != cur->priority[i])
+				{
+					ne->priority_frame[i] = frame;
+					changed = true;
+				}
+			}
+		}
+
+		if (changed) m_frame = frame;
+		ne->frame = m_frame;
+		cur = ne;
+		return cur;
+	}
+
+	void file_history::handle_alert(alert const* a)
+	{
+		if (torrent_removed_alert const* ta = alert_cast<torrent_removed_alert>(a))
+		{
+			std::unique_lock<std::mutex> l(m_mutex);
+			m_torrents.erase(ta->info_hash);
+		}
+		else if (file_renamed_alert const* fr = alert_cast<file_renamed_alert>(a))
+		{
+			// the file names are only sent once. Forget about the torrent to
+			// have them all sent again, with a new frame
+			std::unique_lock<std::mutex> l(m_mutex);
+			m_torrents.erase(fr->handle.info_hash());
+		}
+	}
+}
+
@@ -0,0 +1,175 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_FILE_HISTORY_HPP
+#define TORRENT_FILE_HISTORY_HPP
+
+#include "alert_observer.hpp"
+#include "libtorrent/sha1_hash.hpp"
+#include "libtorrent/torrent_info.hpp"
+#include "libtorrent/time.hpp"
+#include <boost/shared_ptr.hpp>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <map>
+#include <cstdint>
+
+namespace libtorrent
+{
+	struct alert_handler;
+	struct torrent_history;
+	struct torrent_handle;
+
+	// the JSON forms of the file names and paths of a torrent, escaped but
+	// not quoted. They're shared between the versions of a file entry, and
+	// only built again when the static fields of the files change
+	struct file_json_strings
+	{
+		explicit file_json_strings(file_storage const& fs);
+
+		// the file names, as sent by uTorrent getfiles
+		std::vector<std::string> names;
+
+		// the paths within the torrent, as sent by Transmission
+		std::vector<std::string> paths;
+	};
+
+	// the file progress of a torrent, along with the frame numbers each
+	// file was last modified in. Entries are immutable once published,
+	// updates replace them with a new copy
+	struct file_history_entry
+	{
+		// the torrent the files belong to. This is where the name, flags
+		// and size of files come from
+		boost::shared_ptr<torrent_info const> torrent;
+
+		// the frame this entry is up to date as of. Any later change to the
+		// files of this torrent is stamped with a later frame
+		int frame;
+
+		// the frame the static fields of the files (flags, name and size)
+		// were recorded in. They are only sent to clients that haven't seen
+		// this frame
+		int static_frame;
+
+		// never null for entries handed out by the file_history
+		std::shared_ptr<file_json_strings const> json;
+
+		// the torrent's total_done from the torrent_history when the file
+		// progress was last read. If it hasn't changed, neither has the
+		// progress of any file
+		std::int64_t total_done;
+
+		// the number of bytes downloaded of each file, and the frame each
+		// one last changed in
+		std::vector<std::int64_t> progress;
+		std::vector<int> progress_frame;
+
+		// the priority of each file, and the frame each one last changed in
+		std::vector<int> priority;
+		std::vector<int> priority_frame;
+
+		// either the progress or the priority of the file changed after
+		// the frame
+		bool file_changed(int i, int since) const
+		{ return progress_frame[i] > since || priority_frame[i] > since; }
+	};
+
+	typedef std::shared_ptr<file_history_entry const> file_entry_ptr;
+
+	// reads the files of a torrent right away, without keeping them. All
+	// fields are stamped with frame 1. Returns an empty pointer if the
+	// torrent doesn't have metadata
+	file_entry_ptr read_files(torrent_handle const& h);
+
+	// tracks the files of the torrents clients are looking at. Torrents are
+	// added the first time they're asked for and removed when they're removed
+	// from the session, or when nobody has asked about them for
+	// watch_timeout seconds.
+	struct file_history : alert_observer
+	{
+		file_history(alert_handler* h, torrent_history const* hist);
+		~file_history();
+
+		// returns the files of the specified torrent, refreshing them first
+		// if the torrent has downloaded anything since last time, or its
+		// priorities were changed. Returns an empty pointer if the torrent
+		// doesn't have metadata.
+		file_entry_ptr get_file_updates(torrent_handle const& h);
+
+		// the file priorities can't be told to have changed from the
+		// torrent's status. Whoever changes them calls this to have them
+		// read again the next time the torrent is asked for
+		void priorities_changed(sha1_hash const& ih);
+
+		// the current frame number
+		int frame() const;
+
+		// appends the torrents clients have asked about in the last
+		// watch_timeout seconds
+		void watched_torrents(std::vector<sha1_hash>& ret) const;
+
+		virtual void handle_alert(alert const* a);
+
+		enum { watch_timeout = 60 };
+
+	private:
+
+		struct watched_files
+		{
+			watched_files() : stale_priorities(false) {}
+
+			file_entry_ptr entry;
+			time_point last_request;
+			bool stale_priorities;
+		};
+
+		// forgets the torrents nobody has asked about in watch_timeout
+		// seconds. Must be called with m_mutex held
+		void evict_unwatched(time_point now);
+
+		alert_handler* m_alerts;
+		torrent_history const* m_hist;
+
+		mutable std::mutex m_mutex;
+		std::map<sha1_hash, watched_files> m_torrents;
+
+		// incremented every time a file entry changes
+		int m_frame;
+
+		time_point m_last_eviction;
+	};
+}
+
+#endif
+
@@ -34,165 +34,321 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "libtorrent/alert_types.hpp"
 #include "libtorrent/torrent.hpp"
+#include "libtorrent/torrent_status.hpp"
 
 //#define DLOG printf
 #define DLOG if (false) printf
 
-using namespace libtorrent;
-
-std::size_t file_requests::hash_value(piece_request const& r) const
+namespace libtorrent
 {
-	sha1_hash const& h = r.info_hash;
-	return (h[0] | (h[1] << 8) | (h[2] << 16) | (h[3] << 24)) ^ r.piece;
-}
+	std::size_t file_requests::piece_key_hash::operator()(piece_key const& k) const
+	{
+		return hash_value(k.info_hash) ^ k.piece;
+	}
 
-file_requests::file_requests()
-	: m_next_timeout(m_requests.begin())
-{
-}
+	file_requests::file_requests(std::int64_t cache_size)
+		: m_next_timeout(0)
+		, m_cache(cache_size)
+	{}
 
-void file_requests::on_alert(alert const* a)
-{
-	read_piece_alert const* p = alert_cast<read_piece_alert>(a);
-	if (p)
+	file_requests::shard& file_requests::shard_for(piece_key const& k)
 	{
-		shared_ptr<torrent> t = p->handle.native_handle();
+		return m_shards[piece_key_hash()(k) % num_shards];
+	}
 
-		piece_request rq;
-		rq.info_hash = t->info_hash();
-		rq.piece = p->piece;
-		typedef requests_t::iterator iter;
+	bool file_requests::have_piece(torrent_handle const& h, sha1_hash const& ih
+		, int piece)
+	{
+		std::unique_lock<std::mutex> l(m_have_mutex);
+		std::map<sha1_hash, bitfield>::iterator i = m_have_pieces.find(ih);
+		if (i != m_have_pieces.end())
+			return piece < i->second.size() && i->second.get_bit(piece);
+		l.unlock();
 
-		DLOG("read_piece_alert: %d (%s)\n", p->piece, p->ec.message().c_str());
-		std::unique_lock<std::mutex> l(m_mutex);
-		std::pair<iter, iter> range = m_requests.equal_range(rq);
-		if (range.first == m_requests.end()) return;
+		// don't hold the mutex while waiting for libtorrent. The alert
+		// handler needs it
+		torrent_status st = h.status(torrent_handle::query_pieces);
 
-		piece_entry pe;
-		pe.buffer = p->buffer;
-		pe.piece = p->piece;
-		pe.size = p->size;
-		for (iter i = range.first; i != range.second; ++i)
+		// without metadata there are no pieces to keep track of yet
+		if (st.pieces.empty()) return false;
+
+		l.lock();
+		i = m_have_pieces.insert(std::make_pair(ih, st.pieces)).first;
+		return piece < i->second.size() && i->second.get_bit(piece);
+	}
+
+	void file_requests::deliver(waiters& w, piece_entry const& pe)
+	{
+		for (std::vector<torrent_piece_queue*>::iterator i = w.queues.begin()
+			, end(w.queues.end()); i != end; ++i)
 		{
-			i->promise->set_value(pe);
-			if (m_next_timeout == i)
-				++m_next_timeout;
+			torrent_piece_queue* pq = *i;
+			std::unique_lock<std::mutex> l(pq->queue_mutex);
+			pq->queue.push(pe);
+			if (pe.piece <= pq->begin)
+				pq->cond.notify_all();
 		}
-		m_requests.erase(range.first, range.second);
 
-		DLOG("outstanding requests: ");
-		for (iter i = m_requests.begin(); i != m_requests.end(); ++i)
+		for (std::vector<piece_promise>::iterator i = w.promises.begin()
+			, end(w.promises.end()); i != end; ++i)
 		{
-			TORRENT_ASSERT(i->info_hash != rq.info_hash || i->piece != rq.piece);
-			DLOG("(%02x%02x, %d) ", i->info_hash[0], i->info_hash[1], i->piece);
+			i->promise->set_value(pe);
 		}
-		DLOG("\n");
-		return;
 	}
 
-	piece_finished_alert const* pf = alert_cast<piece_finished_alert>(a);
-	if (pf)
+	void file_requests::on_alert(alert const* a)
 	{
-		DLOG("piece_finished: %d\n", pf->piece_index);
-		libtorrent::shared_ptr<torrent> t = pf->handle.native_handle();
-		piece_request rq;
-		rq.info_hash = t->info_hash();
-		rq.piece = pf->piece_index;
-		typedef requests_t::iterator iter;
-		m_have_pieces[rq.info_hash].insert(pf->piece_index);
-
-		std::unique_lock<std::mutex> l(m_mutex);
-		std::pair<iter, iter> range = m_requests.equal_range(rq);
-		if (range.first == m_requests.end()) return;
-		l.unlock();
+		read_piece_alert const* p = alert_cast<read_piece_alert>(a);
+		if (p)
+		{
+			shared_ptr<torrent> t = p->handle.native_handle();
+
+			piece_key k;
+			k.info_hash = t->info_hash();
+			k.piece = p->piece;
+
+			DLOG("read_piece_alert: %d (%s)\n", p->piece, p->ec.message().c_str());
+
+			piece_entry pe;
+			pe.buffer = p->buffer;
+			pe.piece = p->piece;
+			pe.size = p->size;
+
+			shard& s = shard_for(k);
+			std::unique_lock<std::mutex> l(s.mutex);
+			requests_t::iterator i = s.requests.find(k);
+			if (i == s.requests.end()) return;
+
+			// the streams may go away as soon as they're no longer in the
+			// map, so they're handed the piece before releasing the mutex
+			bool const cache = !i->second.queues.empty();
+			deliver(i->second, pe);
+			s.requests.erase(i);
+			l.unlock();
+
+			// only pieces read for streams are cached
+			if (cache && !p->ec) m_cache.insert(k.info_hash, p->piece, p->buffer, p->size);
+			return;
+		}
+
+		piece_finished_alert const* pf = alert_cast<piece_finished_alert>(a);
+		if (pf)
+		{
+			DLOG("piece_finished: %d\n", pf->piece_index);
+			shared_ptr<torrent> t = pf->handle.native_handle();
+
+			piece_key k;
+			k.info_hash = t->info_hash();
+			k.piece = pf->piece_index;
+
+			std::unique_lock<std::mutex> hl(m_have_mutex);
+			std::map<sha1_hash, bitfield>::iterator h = m_have_pieces.find(k.info_hash);
+			if (h != m_have_pieces.end() && k.piece < h->second.size())
+				h->second.set_bit(k.piece);
+			hl.unlock();
+
+			// streams asked with a deadline, libtorrent reads those pieces by
+			// itself. Futures need the read to be issued
+			shard& s = shard_for(k);
+			std::unique_lock<std::mutex> l(s.mutex);
+			requests_t::iterator i = s.requests.find(k);
+			if (i == s.requests.end() || i->second.reading
+				|| i->second.promises.empty()) return;
+			i->second.reading = true;
+			l.unlock();
+
+			DLOG("read_piece: %d\n", pf->piece_index);
+			pf->handle.read_piece(pf->piece_index);
+			return;
+		}
+
+		// if a torrent is removed, abort any piece requests. If it's
+		// stopped, the futures are given up on, streams keep waiting
+		torrent_removed_alert const* tr = alert_cast<torrent_removed_alert>(a);
+		if (tr)
+		{
+			m_cache.evict_torrent(tr->info_hash);
+			std::unique_lock<std::mutex> l(m_have_mutex);
+			m_have_pieces.erase(tr->info_hash);
+			l.unlock();
+			remove_torrent(tr->info_hash, true);
+			return;
+		}
 
-		DLOG("read_piece: %d\n", pf->piece_index);
-		pf->handle.read_piece(pf->piece_index);
-		return;
+		torrent_paused_alert const* tp = alert_cast<torrent_paused_alert>(a);
+		if (tp)
+		{
+			remove_torrent(tp->handle.native_handle()->info_hash(), false);
+			return;
+		}
 	}
 
-	// if a torrent is stopped or removed, abort any piece requests
-	piece_request rq;
-	torrent_removed_alert const* tr = alert_cast<torrent_removed_alert>(a);
-	torrent_paused_alert const* tp = alert_cast<torrent_paused_alert>(a);
-	if (tr)
+	void file_requests::remove_torrent(sha1_hash const& ih, bool abort_streams)
 	{
-		rq.info_hash = tr->info_hash;
+		piece_entry pe;
+		pe.size = 0;
+
+		for (int k = 0; k < num_shards; ++k)
+		{
+			shard& s = m_shards[k];
+			std::unique_lock<std::mutex> l(s.mutex);
+			for (requests_t::iterator i = s.requests.begin(); i != s.requests.end();)
+			{
+				if (i->first.info_hash != ih)
+				{
+					++i;
+					continue;
+				}
+
+				i->second.promises.clear();
+				if (abort_streams)
+				{
+					pe.piece = i->first.piece;
+					deliver(i->second, pe);
+					i->second.queues.clear();
+				}
+
+				if (i->second.queues.empty())
+					i = s.requests.erase(i);
+				else
+					++i;
+			}
+		}
 	}
-	else if (tp)
+
+	void file_requests::on_tick()
 	{
-		rq.info_hash = tp->handle.native_handle()->info_hash();
-	}
-	else return;
+		// one shard is checked for timed out futures per tick
+		shard& s = m_shards[m_next_timeout];
+		m_next_timeout = (m_next_timeout + 1) % num_shards;
 
-	// remove all requests for the torrent
-	rq.piece = 0;
-	typedef requests_t::iterator iter;
+		time_point const now = clock_type::now();
 
-	std::unique_lock<std::mutex> l(m_mutex);
-	iter first = m_requests.lower_bound(rq);
-	rq.piece = INT_MAX;
-	iter last = m_requests.upper_bound(rq);
-	if (first == last) return;
+		std::unique_lock<std::mutex> l(s.mutex);
+		for (requests_t::iterator i = s.requests.begin(); i != s.requests.end();)
+		{
+			std::vector<piece_promise>& pr = i->second.promises;
+			for (int k = 0; k < int(pr.size());)
+			{
+				if (pr[k].timeout >= now)
+				{
+					++k;
+					continue;
+				}
+				pr[k] = pr.back();
+				pr.pop_back();
+			}
+
+			if (pr.empty() && i->second.queues.empty())
+				i = s.requests.erase(i);
+			else
+				++i;
+		}
+	}
 
-	for (iter i = first; i != last; ++i)
+	std::shared_future<piece_entry> file_requests::read_piece(torrent_handle const& h
+		, int piece, int timeout_ms)
 	{
-		if (i != m_next_timeout) continue;
-		m_next_timeout = last;
-		break;
-	}
+		TORRENT_ASSERT(piece >= 0);
+		TORRENT_ASSERT(piece < h.torrent_file()->num_pieces());
+
+		piece_key k;
+		k.info_hash = h.info_hash();
+		k.piece = piece;
+
+		piece_promise pr;
+		pr.promise.reset(new std::promise<piece_entry>());
+		pr.timeout = clock_type::now() + milliseconds(timeout_ms);
+		std::shared_future<piece_entry> ret(pr.promise->get_future());
+
+		bool const have = have_piece(h, k.info_hash, piece);
+
+		shard& s = shard_for(k);
+		std::unique_lock<std::mutex> l(s.mutex);
+		waiters& w = s.requests[k];
+		w.promises.push_back(pr);
+		bool const read = have && !w.reading;
+		if (read) w.reading = true;
+		l.unlock();
 
-	m_requests.erase(first, last);
+		DLOG("piece_priority: %d <- 7\n", piece);
+		h.piece_priority(piece, 7);
+		if (read)
+		{
+			DLOG("read_piece: %d\n", piece);
+			h.read_piece(piece);
+		}
+		return ret;
+	}
 
-}
+	void file_requests::request_piece(torrent_handle const& h, sha1_hash const& ih
+		, torrent_piece_queue* pq, int piece, int deadline_ms)
+	{
+		piece_entry pe;
+		if (m_cache.find(ih, piece, pe.buffer, pe.size))
+		{
+			pe.piece = piece;
+			std::unique_lock<std::mutex> l(pq->queue_mutex);
+			pq->queue.push(pe);
+			return;
+		}
 
-void file_requests::on_tick()
-{
-	std::unique_lock<std::mutex> l(m_mutex);
+		piece_key k;
+		k.info_hash = ih;
+		k.piece = piece;
 
-	if (m_next_timeout == m_requests.end())
-		m_next_timeout = m_requests.begin();
+		bool const have = have_piece(h, ih, piece);
+		time_point const deadline = clock_type::now()
+			+ milliseconds(deadline_ms);
 
-	ptime now = time_now();
+		shard& s = shard_for(k);
+		std::unique_lock<std::mutex> l(s.mutex);
+		waiters& w = s.requests[k];
+		w.queues.push_back(pq);
 
-	if (m_next_timeout != m_requests.end())
-	{
-		if (m_next_timeout->timeout < now)
+		// pieces we have are just read. Pieces we don't have are only asked
+		// for again if this request is more urgent than the previous ones
+		bool issue = false;
+		if (have)
 		{
-			requests_t::iterator to_remove = m_next_timeout;
-			++m_next_timeout;
-			m_requests.erase(to_remove);
+			issue = !w.reading;
+			w.reading = true;
 		}
-		else
+		else if (!w.reading && deadline < w.deadline)
 		{
-			++m_next_timeout;
+			issue = true;
+			w.deadline = deadline;
 		}
+		l.unlock();
+
+		if (!issue) return;
+		if (have)
+			h.read_piece(piece);
+		else
+			h.set_piece_deadline(piece, deadline_ms, torrent_handle::alert_when_available);
 	}
-}
 
-std::shared_future<piece_entry> file_requests::read_piece(torrent_handle const& h, int piece, int timeout_ms)
-{
-	TORRENT_ASSERT(piece >= 0);
-	TORRENT_ASSERT(piece < h.torrent_file()->num_pieces());
-
-	piece_request rq;
-	rq.info_hash = h.info_hash();
-	rq.piece = piece;
-	rq.promise.reset(new std::promise<piece_entry>());
-	rq.timeout = time_now() + milliseconds(timeout_ms);
-
-	std::unique_lock<std::mutex> l(m_mutex);
-	m_requests.insert(rq);
-	l.unlock();
-
-	DLOG("piece_priority: %d <- 7\n", piece);
-	h.piece_priority(piece, 7);
-//	h.set_piece_deadline(piece, 0, torrent_handle::alert_when_available);
-	if (m_have_pieces[rq.info_hash].count(piece))
+	void file_requests::cancel(sha1_hash const& ih, torrent_piece_queue const* pq
+		, int first, int last, std::vector<int>& orphaned)
 	{
-		DLOG("read_piece: %d\n", piece);
-		h.read_piece(piece);
+		piece_key k;
+		k.info_hash = ih;
+		for (k.piece = first; k.piece < last; ++k.piece)
+		{
+			shard& s = shard_for(k);
+			std::unique_lock<std::mutex> l(s.mutex);
+			requests_t::iterator i = s.requests.find(k);
+			if (i == s.requests.end()) continue;
+
+			std::vector<torrent_piece_queue*>& q = i->second.queues;
+			std::vector<torrent_piece_queue*>::iterator j = std::find(q.begin(), q.end(), pq);
+			if (j == q.end()) continue;
+			q.erase(j);
+
+			if (!q.empty() || !i->second.promises.empty()) continue;
+			s.requests.erase(i);
+			orphaned.push_back(k.piece);
+		}
 	}
-	return std::shared_future<piece_entry>(rq.promise->get_future());
 }
 
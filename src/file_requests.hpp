@@ -35,59 +35,147 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <boost/shared_array.hpp>
 #include <future>
-#include <set>
-#include <boost/functional/hash.hpp>
+#include <queue>
+#include <vector>
+#include <unordered_map>
+#include <map>
+#include <condition_variable>
 
 #include <mutex> // for mutex
 #include "libtorrent/torrent_handle.hpp"
 #include "libtorrent/peer_id.hpp" // for sha1_hash
 #include "libtorrent/extensions.hpp" // for plugin
-#include "libtorrent/time.hpp" // for ptime
+#include "libtorrent/bitfield.hpp"
+#include "libtorrent/time.hpp" // for time_point
+#include "piece_cache.hpp"
 
-using libtorrent::sha1_hash;
-using std::mutex;
-
-struct piece_entry
-{
-	boost::shared_array<char> buffer;
-	int size;
-	int piece;
-};
-
-// this is a session plugin which wraps the concept of reading pieces
-// from torrents, returning futures for when those pieces are complete
-struct file_requests : libtorrent::plugin
+namespace libtorrent
 {
-	file_requests();
-	void on_alert(libtorrent::alert const* a);
-	void on_tick();
-	std::shared_future<piece_entry> read_piece(libtorrent::torrent_handle const& h
-		, int piece, int timeout_ms);
-
-private:
-
-	struct piece_request
+	struct piece_entry
 	{
-		sha1_hash info_hash;
+		boost::shared_array<char> buffer;
+		int size;
 		int piece;
-		std::shared_ptr<std::promise<piece_entry> > promise;
-		libtorrent::ptime timeout;
-		bool operator==(piece_request const& rq) const
-		{ return rq.info_hash == info_hash && rq.piece == piece; }
-		bool operator<(piece_request const& rq) const
-		{ return info_hash == rq.info_hash ? piece < rq.piece : info_hash < rq.info_hash; }
+		// we want ascending order!
+		bool operator<(piece_entry const& rhs) const { return piece > rhs.piece; }
 	};
 
-	std::size_t hash_value(piece_request const& r) const;
-
-	std::mutex m_mutex;
-	typedef std::multiset<piece_request> requests_t;
-	requests_t m_requests;
-	requests_t::iterator m_next_timeout;
+	// the pieces delivered to one stream, in the order it will send them
+	struct torrent_piece_queue
+	{
+		// this is the range of pieces we're interested in
+		int begin;
+		int end;
+		// end may not progress past this. This is end of file
+		// or end of request
+		int finish;
+		std::priority_queue<piece_entry> queue;
+		std::condition_variable cond;
+		std::mutex queue_mutex;
+	};
 
-	// TOOD: figure out a way to clear out info-hashes
-	std::map<sha1_hash, std::set<int> > m_have_pieces;
-};
+	// this is a session plugin which wraps the concept of reading pieces
+	// from torrents. Pieces are delivered either to the queue of a stream or
+	// through a future. Everyone waiting for the same piece shares a single
+	// read, and a read_piece_alert is routed to its waiters with one hash
+	// lookup
+	struct file_requests : plugin
+	{
+		file_requests(std::int64_t cache_size = 128 * 1024 * 1024);
+		void on_alert(alert const* a);
+		void on_tick();
+
+		std::shared_future<piece_entry> read_piece(torrent_handle const& h
+			, int piece, int timeout_ms);
+
+		// asks for a piece to be pushed onto pq, within deadline_ms. Pieces in
+		// the cache are pushed right away. If the piece is already being read,
+		// the request joins it, and libtorrent is only told about it again if
+		// this deadline is sooner. If the torrent is removed, pq is handed an
+		// empty piece
+		void request_piece(torrent_handle const& h, sha1_hash const& ih
+			, torrent_piece_queue* pq, int piece, int deadline_ms);
+
+		// withdraws pq's requests for the pieces [first, last). The pieces
+		// nobody else is waiting for any more are appended to orphaned
+		void cancel(sha1_hash const& ih, torrent_piece_queue const* pq
+			, int first, int last, std::vector<int>& orphaned);
+
+		piece_cache& cache() { return m_cache; }
+
+	private:
+
+		struct piece_key
+		{
+			sha1_hash info_hash;
+			int piece;
+			bool operator==(piece_key const& k) const
+			{ return k.piece == piece && k.info_hash == info_hash; }
+		};
+
+		struct piece_key_hash
+		{
+			std::size_t operator()(piece_key const& k) const;
+		};
+
+		struct piece_promise
+		{
+			std::shared_ptr<std::promise<piece_entry> > promise;
+			time_point timeout;
+		};
+
+		// everyone waiting for one piece
+		struct waiters
+		{
+			waiters(): reading(false), deadline(time_point::max()) {}
+			std::vector<torrent_piece_queue*> queues;
+			std::vector<piece_promise> promises;
+
+			// true once read_piece() has been issued for the piece
+			bool reading;
+
+			// the soonest deadline libtorrent has been given for the piece
+			time_point deadline;
+		};
+
+		typedef std::unordered_map<piece_key, waiters, piece_key_hash> requests_t;
+
+		// the requests are split up into shards by piece, to let streams
+		// request pieces and alerts be dispatched without contending on a
+		// single mutex
+		struct shard
+		{
+			std::mutex mutex;
+			requests_t requests;
+		};
+
+		enum { num_shards = 16 };
+
+		shard& shard_for(piece_key const& k);
+
+		// returns whether the torrent has the piece. The first time a torrent
+		// is asked about, its pieces are queried from libtorrent
+		bool have_piece(torrent_handle const& h, sha1_hash const& ih, int piece);
+
+		// hands out the piece to its waiters. Must be called with the shard
+		// mutex held
+		void deliver(waiters& w, piece_entry const& pe);
+
+		void remove_torrent(sha1_hash const& ih, bool abort_streams);
+
+		shard m_shards[num_shards];
+
+		// the shard to look for timed out futures in, on the next tick
+		int m_next_timeout;
+
+		std::mutex m_have_mutex;
+		std::map<sha1_hash, bitfield> m_have_pieces;
+
+		// the pieces recently read for any stream, to serve other streams of
+		// the same file without reading them again
+		piece_cache m_cache;
+	};
+}
 
 #endif // FILE_REQUESTS_HPP_
 
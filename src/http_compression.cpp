@@ -0,0 +1,318 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "http_compression.hpp"
+
+#include <algorithm>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <zlib.h>
+
+extern "C" {
+#include "local_mongoose.h"
+}
+
+namespace libtorrent
+{
+	namespace
+	{
+		// the q value of one element of an Accept-Encoding header, between
+		// begin and end, or 1 if there isn't one
+		double quality(char const* begin, char const* end)
+		{
+			for (char const* i = begin; i < end; ++i)
+			{
+				if (*i != ';') continue;
+				++i;
+				while (i < end && *i == ' ') ++i;
+				if (end - i < 2 || (i[0] != 'q' && i[0] != 'Q') || i[1] != '=')
+					continue;
+				return strtod(i + 2, NULL);
+			}
+			return 1.;
+		}
+
+		// the compressed output. Like the response buffers, it's reused
+		// across the requests served by a thread
+		std::vector<char>& compressed_buffer()
+		{
+			static thread_local std::vector<char> buf;
+			return buf;
+		}
+
+		// the most capacity the compressed buffer keeps between responses.
+		// A larger one, left behind by a large response, is released rather
+		// than held by the thread until it exits
+		const std::size_t max_kept_compressed = 1024 * 1024;
+
+		void trim_compressed_buffer()
+		{
+			std::vector<char>& buf = compressed_buffer();
+			if (buf.capacity() > max_kept_compressed)
+				std::vector<char>().swap(buf);
+		}
+	}
+
+	int accepted_coding(char const* accept_encoding)
+	{
+		if (accept_encoding == NULL) return identity_coding;
+
+		double gzip = -1.;
+		double deflate = -1.;
+		double any = -1.;
+
+		char const* i = accept_encoding;
+		while (*i != 0)
+		{
+			while (*i == ' ' || *i == ',') ++i;
+			char const* end = strchr(i, ',');
+			if (end == NULL) end = i + strlen(i);
+
+			char const* name_end = i;
+			while (name_end < end && *name_end != ';' && *name_end != ' ')
+				++name_end;
+			int const len = name_end - i;
+
+			if (len == 4 && strncasecmp(i, "gzip", 4) == 0)
+				gzip = quality(name_end, end);
+			else if (len == 6 && strncasecmp(i, "x-gzip", 6) == 0)
+				gzip = (std::max)(gzip, quality(name_end, end));
+			else if (len == 7 && strncasecmp(i, "deflate", 7) == 0)
+				deflate = quality(name_end, end);
+			else if (len == 1 && *i == '*')
+				any = quality(name_end, end);
+			i = end;
+		}
+
+		// a coding that isn't listed is covered by *, if it is
+		if (gzip < 0.) gzip = any;
+		if (deflate < 0.) deflate = any;
+
+		if (gzip > 0. && gzip >= deflate) return gzip_coding;
+		if (deflate > 0.) return deflate_coding;
+		return identity_coding;
+	}
+
+	char const* coding_name(int coding)
+	{
+		switch (coding)
+		{
+			case gzip_coding: return "gzip";
+			case deflate_coding: return "deflate";
+		}
+		return "identity";
+	}
+
+	body_compressor::body_compressor(int coding, int level)
+		: m_stream(new z_stream)
+	{
+		memset(m_stream, 0, sizeof(z_stream));
+		// 16 + 15 means a gzip header and the largest window. Plain 15 is
+		// the zlib format, which is what HTTP calls deflate
+		int const window_bits = coding == gzip_coding ? 16 + 15 : 15;
+		if (deflateInit2(m_stream, (std::min)((std::max)(level, 1), 9)
+			, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			delete m_stream;
+			m_stream = NULL;
+		}
+	}
+
+	body_compressor::~body_compressor()
+	{
+		if (m_stream == NULL) return;
+		deflateEnd(m_stream);
+		delete m_stream;
+	}
+
+	bool body_compressor::compress(char const* buf, int len
+		, std::vector<char>& out, bool finish)
+	{
+		if (m_stream == NULL) return false;
+		z_stream& zs = *m_stream;
+		zs.next_in = (Bytef*)buf;
+		zs.avail_in = len;
+
+		for (;;)
+		{
+			size_t const used = out.size();
+			size_t const chunk = (std::max)(size_t(4096), size_t(zs.avail_in / 2));
+			out.resize(used + chunk);
+			zs.next_out = reinterpret_cast<Bytef*>(&out[used]);
+			zs.avail_out = chunk;
+			int const ret = deflate(&zs, finish ? Z_FINISH : Z_NO_FLUSH);
+			out.resize(used + chunk - zs.avail_out);
+
+			if (ret == Z_STREAM_END) return true;
+
+			// Z_BUF_ERROR just means no progress was possible
+			if (ret != Z_OK && ret != Z_BUF_ERROR) return false;
+
+			// the compressor holds on to what it hasn't output yet, until
+			// the next piece or the end of the stream
+			if (!finish && zs.avail_in == 0) return true;
+		}
+	}
+
+	http_response_writer::http_response_writer(mg_connection* conn
+		, char const* content_type, http_compression const& comp)
+		: m_conn(conn)
+		, m_content_type(content_type)
+		, m_comp(comp)
+		, m_coding(comp.level > 0
+			? accepted_coding(mg_get_header(conn, "accept-encoding"))
+			: identity_coding)
+		, m_chunked(false)
+	{}
+
+	http_response_writer::~http_response_writer() {}
+
+	void http_response_writer::write(std::vector<char>& buf)
+	{
+		if (buf.empty()) return;
+
+		if (!m_chunked)
+		{
+			m_chunked = true;
+			if (m_coding != identity_coding)
+				m_compressor.reset(new body_compressor(m_coding, m_comp.level));
+
+			mg_printf(m_conn, "HTTP/1.1 200 OK\r\n"
+				"Content-Type: %s\r\n"
+				"Transfer-Encoding: chunked\r\n"
+				"%s%s%s%s"
+				"\r\n"
+				, m_content_type
+				, m_comp.level > 0 ? "Vary: Accept-Encoding\r\n" : ""
+				, m_compressor ? "Content-Encoding: " : ""
+				, m_compressor ? coding_name(m_coding) : ""
+				, m_compressor ? "\r\n" : "");
+		}
+
+		if (m_compressor)
+		{
+			std::vector<char>& out = compressed_buffer();
+			out.clear();
+			if (!m_compressor->compress(&buf[0], buf.size(), out, false))
+				fprintf(stderr, "ERROR: failed to compress response\n");
+			send_chunk(out.empty() ? NULL : &out[0], out.size());
+		}
+		else
+		{
+			send_chunk(&buf[0], buf.size());
+		}
+		buf.clear();
+	}
+
+	void http_response_writer::finish(std::vector<char>& buf)
+	{
+		if (m_chunked)
+		{
+			if (m_compressor)
+			{
+				std::vector<char>& out = compressed_buffer();
+				out.clear();
+				if (!m_compressor->compress(buf.empty() ? "" : &buf[0], buf.size()
+					, out, true))
+					fprintf(stderr, "ERROR: failed to compress response\n");
+				send_chunk(out.empty() ? NULL : &out[0], out.size());
+				trim_compressed_buffer();
+			}
+			else if (!buf.empty())
+			{
+				send_chunk(&buf[0], buf.size());
+			}
+			// the last chunk
+			mg_write(m_conn, "0\r\n\r\n", 5);
+			buf.clear();
+			return;
+		}
+
+		// the whole body is here. Small ones aren't worth compressing
+		int coding = m_coding;
+		if (buf.empty() || int(buf.size()) < m_comp.min_size)
+			coding = identity_coding;
+		std::vector<char>& out = compressed_buffer();
+		if (coding != identity_coding)
+		{
+			out.clear();
+			body_compressor c(coding, m_comp.level);
+			if (!c.compress(&buf[0], buf.size(), out, true))
+				coding = identity_coding;
+		}
+
+		char const* body = buf.empty() ? "" : &buf[0];
+		int body_len = buf.size();
+		if (coding != identity_coding)
+		{
+			body = &out[0];
+			body_len = out.size();
+		}
+
+		char header[300];
+		int const header_len = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %d\r\n"
+			"%s%s%s%s"
+			"\r\n"
+			, m_content_type, body_len
+			, m_comp.level > 0 ? "Vary: Accept-Encoding\r\n" : ""
+			, coding != identity_coding ? "Content-Encoding: " : ""
+			, coding != identity_coding ? coding_name(coding) : ""
+			, coding != identity_coding ? "\r\n" : "");
+
+		mg_iovec const iov[2] = {
+			{ header, size_t(header_len) },
+			{ body, size_t(body_len) }
+		};
+		mg_writev(m_conn, iov, 2);
+		buf.clear();
+		trim_compressed_buffer();
+	}
+
+	// writes the buffer as one chunk of a response with chunked transfer
+	// encoding. An empty chunk would end the response, so it's skipped
+	void http_response_writer::send_chunk(char const* buf, int len)
+	{
+		if (len == 0) return;
+		char header[20];
+		int const header_len = snprintf(header, sizeof(header), "%x\r\n", len);
+		mg_iovec const iov[3] = {
+			{ header, size_t(header_len) },
+			{ buf, size_t(len) },
+			{ "\r\n", 2 }
+		};
+		mg_writev(m_conn, iov, 3);
+	}
+}
+
@@ -0,0 +1,130 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_HTTP_COMPRESSION_HPP
+#define TORRENT_HTTP_COMPRESSION_HPP
+
+#include <vector>
+#include <memory>
+
+struct mg_connection;
+struct z_stream_s;
+
+namespace libtorrent
+{
+	// how dynamically generated responses, like the JSON of the uTorrent
+	// and transmission RPCs, are compressed for clients that accept it
+	struct http_compression
+	{
+		http_compression() : level(6), min_size(1024) {}
+
+		// the zlib compression level, 1 (fastest) to 9 (smallest). 0
+		// turns compression off
+		int level;
+
+		// responses smaller than this many bytes are sent as they are
+		int min_size;
+	};
+
+	// the content codings a response may be compressed with
+	enum content_coding { identity_coding, gzip_coding, deflate_coding };
+
+	// picks the coding for a response from the request's Accept-Encoding
+	// header (which may be NULL). gzip is preferred over deflate. Codings
+	// listed with q=0 are not acceptable
+	int accepted_coding(char const* accept_encoding);
+
+	// the name of the coding, as used in the Content-Encoding header
+	char const* coding_name(int coding);
+
+	// a deflate stream, in a gzip or zlib wrapper depending on the coding,
+	// fed the body of a response a piece at a time
+	struct body_compressor
+	{
+		body_compressor(int coding, int level);
+		~body_compressor();
+
+		// compresses len bytes at buf and appends the output to out. The
+		// last piece is passed with finish set, to end the stream. Returns
+		// false if zlib fails
+		bool compress(char const* buf, int len, std::vector<char>& out
+			, bool finish);
+
+	private:
+
+		body_compressor(body_compressor const&);
+		body_compressor& operator=(body_compressor const&);
+
+		z_stream_s* m_stream;
+	};
+
+	// sends a 200 OK response whose body is formatted into a buffer. The
+	// headers are held back until the first write(), so a body that is
+	// complete by then (i.e. only passed to finish()) is sent with a
+	// Content-Length and compressed only if it's at least min_size bytes.
+	// A body that's written in pieces is sent with chunked transfer
+	// encoding, and compressed whenever the client accepts it, since its
+	// size isn't known up front
+	struct http_response_writer
+	{
+		http_response_writer(mg_connection* conn, char const* content_type
+			, http_compression const& comp);
+		~http_response_writer();
+
+		// sends the body formatted so far, and clears buf. Only HTTP/1.1
+		// clients may be sent a body in pieces
+		void write(std::vector<char>& buf);
+
+		// sends the rest of the body, and ends the response
+		void finish(std::vector<char>& buf);
+
+	private:
+
+		void send_chunk(char const* buf, int len);
+
+		mg_connection* m_conn;
+		char const* m_content_type;
+		http_compression m_comp;
+
+		// the coding the client accepts, or identity_coding if compression
+		// is turned off
+		int m_coding;
+
+		// set once the headers have been sent for a chunked response.
+		// m_compressor is set if it's compressed
+		bool m_chunked;
+		std::unique_ptr<body_compressor> m_compressor;
+	};
+}
+
+#endif
+
@@ -32,7 +32,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "webui.hpp"
 #include <string>
-#include <set>
+#include <boost/unordered_set.hpp>
 
 namespace libtorrent
 {
@@ -49,7 +49,7 @@ namespace libtorrent
 
 		private:
 
-		std::set<std::string> m_whitelist;
+		boost::unordered_set<std::string> m_whitelist;
 	};
 
 }
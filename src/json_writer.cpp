@@ -0,0 +1,95 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "json_writer.hpp"
+#include "escape_json.hpp"
+#include <stdio.h>
+
+namespace libtorrent
+{
+	void json_writer::unsigned_integer(std::uint64_t val)
+	{
+		// format the digits backwards into a local buffer
+		char buf[20];
+		char* ptr = buf + sizeof(buf);
+		do
+		{
+			*--ptr = '0' + val % 10;
+			val /= 10;
+		} while (val > 0);
+		raw(ptr, buf + sizeof(buf) - ptr);
+	}
+
+	void json_writer::integer(std::int64_t val)
+	{
+		if (val < 0)
+		{
+			raw('-');
+			// negate as unsigned, to not overflow on INT64_MIN
+			unsigned_integer(~std::uint64_t(val) + 1);
+			return;
+		}
+		unsigned_integer(val);
+	}
+
+	void json_writer::floating(double val)
+	{
+		char buf[350];
+		int len = snprintf(buf, sizeof(buf), "%f", val);
+		if (len < 0) return;
+		if (len >= int(sizeof(buf))) len = sizeof(buf) - 1;
+		raw(buf, len);
+	}
+
+	void json_writer::string(char const* str, int len)
+	{
+		raw('"');
+		escape_json(str, len, m_buf);
+		raw('"');
+	}
+
+	void json_writer::hex(char const* bytes, int len)
+	{
+		static char const hex_chars[] = "0123456789abcdef";
+		std::size_t const pos = m_buf.size();
+		m_buf.resize(pos + len * 2 + 2);
+		char* ptr = &m_buf[pos];
+		*ptr++ = '"';
+		for (int i = 0; i < len; ++i)
+		{
+			*ptr++ = hex_chars[std::uint8_t(bytes[i]) >> 4];
+			*ptr++ = hex_chars[std::uint8_t(bytes[i]) & 0xf];
+		}
+		*ptr++ = '"';
+	}
+}
+
@@ -0,0 +1,92 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_JSON_WRITER_HPP
+#define TORRENT_JSON_WRITER_HPP
+
+#include "libtorrent/sha1_hash.hpp"
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <string.h>
+
+namespace libtorrent
+{
+	// appends JSON values to a buffer. Unlike appendf() and escape_json(),
+	// values are formatted straight into the buffer, without allocating
+	// memory for each one. The buffer is owned by the caller, which
+	// typically reuses it across requests to not allocate at all once it
+	// has grown large enough.
+	struct json_writer
+	{
+		json_writer(std::vector<char>& buf) : m_buf(buf) {}
+
+		// appends the string as-is, without quoting or escaping
+		void raw(char const* str, int len)
+		{ m_buf.insert(m_buf.end(), str, str + len); }
+		void raw(char const* str) { raw(str, strlen(str)); }
+		void raw(char c) { m_buf.push_back(c); }
+
+		void integer(std::int64_t val);
+		void unsigned_integer(std::uint64_t val);
+
+		// formatted as "%f" by printf
+		void floating(double val);
+
+		void boolean(bool val) { if (val) raw("true", 4); else raw("false", 5); }
+
+		// appends a quoted string, escaped to be valid JSON. The input is
+		// expected to be UTF-8
+		void string(char const* str, int len);
+		void string(char const* str) { string(str, strlen(str)); }
+		void string(std::string const& str) { string(str.c_str(), str.size()); }
+
+		// appends a quoted string that has already been escaped
+		void escaped(char const* str, int len)
+		{ raw('"'); raw(str, len); raw('"'); }
+		void escaped(char const* str) { escaped(str, strlen(str)); }
+		void escaped(std::string const& str) { escaped(str.c_str(), str.size()); }
+
+		// appends a quoted string of the bytes in lower case hex
+		void hex(char const* bytes, int len);
+		void hex(sha1_hash const& h) { hex((char const*)&h[0], h.size); }
+
+		std::vector<char>& buffer() { return m_buf; }
+
+	private:
+
+		std::vector<char>& m_buf;
+	};
+}
+
+#endif
+
@@ -32,7 +32,6 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "libtorrent_webui.hpp"
 #include "libtorrent/io.hpp"
-#include "libtorrent/buffer.hpp"
 #include "libtorrent/session.hpp"
 #include "libtorrent/session_stats.hpp"
 #include "libtorrent/torrent_info.hpp"
@@ -40,7 +39,12 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "local_mongoose.h"
 #include "auth.hpp"
 #include "torrent_history.hpp"
+#include "peer_history.hpp"
+#include "bulk_jobs.hpp"
 #include <string.h>
+#include <algorithm>
+#include <limits.h> // for INT_MAX
+#include <chrono>
 
 #include "alert_handler.hpp"
 
@@ -48,16 +52,65 @@ namespace libtorrent
 {
 	namespace io = libtorrent::detail;
 
-	libtorrent_webui::libtorrent_webui(session& ses, torrent_history const* hist
-		, auth_interface const* auth, alert_handler* alert)
+	static std::vector<std::string> rpc_function_names();
+
+	libtorrent_webui::libtorrent_webui(session& ses, torrent_history* hist
+		, auth_interface const* auth, alert_handler* alert
+		, stats_snapshot* stats)
 		: m_ses(ses)
+		, m_own_sessions(ses)
+		, m_sessions(&m_own_sessions)
 		, m_hist(hist)
 		, m_auth(auth)
 		, m_alert(alert)
-		, m_stats_frame(0)
-	{}
+		, m_own_files(alert, hist)
+		, m_files(&m_own_files)
+		, m_peers(NULL)
+		, m_bulk(NULL)
+		, m_stats(stats)
+		, m_rpc_stats("libtorrent", rpc_function_names()
+			, rpc_stats::send_queue_metrics)
+		, m_settings_refreshing(false)
+		, m_owner(std::make_shared<call_owner>(this))
+	{
+		set_queue_stats(m_rpc_stats.send_queues());
+
+		std::back_insert_iterator<std::vector<char> > ptr(m_settings_list);
+		io::write_uint32(settings_pack::num_string_settings, ptr);
+		io::write_uint32(settings_pack::num_int_settings, ptr);
+		io::write_uint32(settings_pack::num_bool_settings, ptr);
+		for (int i = 0; i < settings_cache::num_settings(); ++i)
+		{
+			int const name = settings_cache::setting_name(i);
+			char const* n = name_for_setting(name);
+			int len = strlen(n);
+			TORRENT_ASSERT(len < 256);
+			io::write_uint8(len, ptr);
+			std::copy(n, n + len, ptr);
+			TORRENT_ASSERT(name < 65536);
+			io::write_uint16(name, ptr);
+		}
+		m_settings.update(m_ses.get_settings());
 
-	libtorrent_webui::~libtorrent_webui() {}
+		m_alert->subscribe(this, 0
+			, state_update_alert::alert_type
+			, 0);
+		m_stats->subscribe(this);
+	}
+
+	libtorrent_webui::~libtorrent_webui()
+	{
+		// calls still waiting for a stats sample or the executor are
+		// dropped, the ones completing are waited for
+		{
+			std::unique_lock<std::mutex> l(m_owner->mutex);
+			m_owner->self = NULL;
+			while (m_owner->running > 0) m_owner->cond.wait(l);
+		}
+		m_stats->unsubscribe(this);
+		m_alert->unsubscribe(this);
+		set_queue_stats(NULL);
+	}
 
 	bool libtorrent_webui::handle_websocket_connect(mg_connection* conn,
 		mg_request_info const* request_info)
@@ -106,8 +159,27 @@ namespace libtorrent
 		{ "list-stats", &libtorrent_webui::list_stats },
 		{ "get-stats", &libtorrent_webui::get_stats },
 		{ "get-file-updates", &libtorrent_webui::get_file_updates },
+		{ "subscribe-torrent-updates", &libtorrent_webui::subscribe_torrent_updates },
+		{ "subscribe-stats", &libtorrent_webui::subscribe_stats },
+		{ "unsubscribe", &libtorrent_webui::unsubscribe },
+		{ "get-torrent-view", &libtorrent_webui::get_torrent_view },
+		{ "get-peer-updates", &libtorrent_webui::get_peer_updates },
+		{ "set-labels", &libtorrent_webui::set_labels },
+		{ "get-torrent-updates-v2", &libtorrent_webui::get_torrent_updates_v2 },
+		{ "subscribe-torrent-updates-v2", &libtorrent_webui::subscribe_torrent_updates_v2 },
+		{ "get-settings-updates", &libtorrent_webui::get_settings_updates },
+		{ "get-bulk-jobs", &libtorrent_webui::get_bulk_jobs },
+		{ "cancel-bulk-job", &libtorrent_webui::cancel_bulk_job },
 	};
 
+	static std::vector<std::string> rpc_function_names()
+	{
+		std::vector<std::string> ret;
+		for (int i = 0; i < sizeof(functions)/sizeof(functions[0]); ++i)
+			ret.push_back(functions[i].name);
+		return ret;
+	}
+
 	// maps torrent field to RPC field. These fields are the ones defined in
 	// torrent_history_entry
 	int const torrent_field_map[] =
@@ -186,32 +258,588 @@ namespace libtorrent
 		-1, // listen_port
 	};
 
+	// the field the torrent's labels are sent in. They're not part of the
+	// status, they have a frame number of their own
+	int const labels_field = 23;
+
+	// the fields encode_torrent_fields() knows about
+	std::uint64_t const all_torrent_fields = (std::uint64_t(1) << 24) - 1;
+
+	// the flags following the epoch of a torrent update. A full update has
+	// every torrent, the client drops the ones it has that aren't in it
+	int const full_update = 1;
+
+	// the bitmask of the fields of the torrent that have a newer frame
+	// number than frame
+	static std::uint64_t changed_fields(torrent_history_entry const& e
+		, std::uint32_t frame)
+	{
+		std::uint64_t bitmask = 0;
+		for (int k = 0; k < torrent_history_entry::num_fields; ++k)
+		{
+			int f = torrent_field_map[k];
+			if (f < 0) continue;
+			if (e.frame(k) <= int(frame)) continue;
+
+			// this field has changed and should be included in this update
+			bitmask |= std::uint64_t(1) << f;
+		}
+		if (e.labels_frame > int(frame)) bitmask |= std::uint64_t(1) << labels_field;
+		return bitmask;
+	}
+
+	// writes the values of the fields in bitmask, in field order
+	static void encode_torrent_fields(torrent_history_entry const& e
+		, std::uint64_t bitmask
+		, std::back_insert_iterator<std::vector<char> >& ptr)
+	{
+		torrent_status const& s = e.status;
+		for (int f = 0; f < 24; ++f)
+		{
+			if ((bitmask & (std::uint64_t(1) << f)) == 0) continue;
+
+			// write field f to buffer
+			switch (f)
+			{
+				case 0: // flags
+				{
+					std::uint64_t flags = 
+						(s.paused ? 0x001 : 0)
+						| (s.auto_managed ? 0x002 : 0)
+						| (s.sequential_download ? 0x004 : 0)
+						| (s.is_seeding ? 0x008 : 0)
+						| (s.is_finished ? 0x010 : 0)
+						| (s.is_loaded ? 0x020 : 0)
+						| (s.has_metadata ? 0x040 : 0)
+						| (s.has_incoming ? 0x080 : 0)
+						| (s.seed_mode ? 0x100 : 0)
+						| (s.upload_mode ? 0x200 : 0)
+						| (s.share_mode ? 0x400 : 0)
+						| (s.super_seeding ? 0x800 : 0)
+						;
+
+					io::write_uint64(flags, ptr);
+					break;
+				}
+				case 1: // name
+				{
+					std::string name = s.name;
+					if (name.size() > 65535) name.resize(65535);
+					io::write_uint16(name.size(), ptr);
+					std::copy(name.begin(), name.end(), ptr);
+					break;
+				}
+				case 2: // total-uploaded
+					io::write_uint64(s.total_upload, ptr);
+					break;
+				case 3: // total-downloaded
+					io::write_uint64(s.total_download, ptr);
+					break;
+				case 4: // added-time
+					io::write_uint64(s.added_time, ptr);
+					break;
+				case 5: // completed_time
+					io::write_uint64(s.completed_time, ptr);
+					break;
+				case 6: // upload-rate
+					io::write_uint32(s.upload_rate, ptr);
+					break;
+				case 7: // download-rate
+					io::write_uint32(s.download_rate, ptr);
+					break;
+				case 8: // progress
+					io::write_uint32(s.progress_ppm, ptr);
+					break;
+				case 9: // error
+				{
+					std::string e = s.error;
+					if (e.size() > 65535) e.resize(65535);
+					io::write_uint16(e.size(), ptr);
+					std::copy(e.begin(), e.end(), ptr);
+					break;
+				}
+				case 10: // connected-peers
+					io::write_uint32(s.num_peers, ptr);
+					break;
+				case 11: // connected-seeds
+					io::write_uint32(s.num_seeds, ptr);
+					break;
+				case 12: // downloaded-pieces
+					io::write_uint32(s.num_pieces, ptr);
+					break;
+				case 13: // total-done
+					io::write_uint64(s.total_wanted_done, ptr);
+					break;
+				case 14: // distributed-copies
+					io::write_uint32(s.distributed_full_copies, ptr);
+					io::write_uint32(s.distributed_fraction, ptr);
+					break;
+				case 15: // all-time-upload
+					io::write_uint64(s.all_time_upload, ptr);
+					break;
+				case 16: // all-time-download
+					io::write_uint32(s.all_time_download, ptr);
+					break;
+				case 17: // unchoked-peers
+					io::write_uint32(s.num_uploads, ptr);
+					break;
+				case 18: // num-connections
+					io::write_uint32(s.num_connections, ptr);
+					break;
+				case 19: // queue-position
+					io::write_uint32(s.queue_position, ptr);
+					break;
+				case 20: // state
+				{
+					int state;
+					switch (s.state)
+					{
+#ifndef TORRENT_NO_DEPRECATE
+						case torrent_status::queued_for_checking:
+#endif
+						case torrent_status::checking_files:
+						case torrent_status::allocating:
+						case torrent_status::checking_resume_data:
+							state = 0; // checking-files
+							break;
+						case torrent_status::downloading_metadata:
+							state = 1; // downloading-metadata
+							break;
+						case torrent_status::downloading:
+						default:
+							state = 2; // downloading
+							break;
+						case torrent_status::finished:
+						case torrent_status::seeding:
+							state = 3; // seeding
+							break;
+					};
+					io::write_uint8(state, ptr);
+					break;
+				}
+				case 21: // failed-bytes
+					io::write_uint64(s.total_failed_bytes, ptr);
+					break;
+				case 22: // redundant-bytes
+					io::write_uint64(s.total_redundant_bytes, ptr);
+					break;
+				case labels_field:
+				{
+					int const num = e.labels ? (std::min)(int(e.labels->size()), 255) : 0;
+					io::write_uint8(num, ptr);
+					for (int k = 0; k < num; ++k)
+					{
+						std::string const& l = (*e.labels)[k];
+						int const len = (std::min)(int(l.size()), 65535);
+						io::write_uint16(len, ptr);
+						std::copy(l.begin(), l.begin() + len, ptr);
+					}
+					break;
+				}
+				default:
+				TORRENT_ASSERT(false);
+			}
+		}
+	}
+
+	// version 2 of the update format covers all the fields the history
+	// tracks changes of. Integers are zig-zag encoded LEB128 varints, the
+	// bitmasks and flags are unsigned ones and strings have a varint length
+	// prefix. These map torrent_history_entry fields to version 2 fields
+	int const torrent_field_map_v2[] =
+	{
+		20, // state
+		0, // paused
+		0, // auto_managed
+		0, // sequential_download
+		0, // is_seeding
+		0, // is_finished
+		0, // is_loaded
+		0, // has_metadata
+		-1, // progress (progress_ppm is exact enough)
+		8, // progress_ppm
+		9, // error
+		24, // save_path
+		1, // name
+		25, // next_announce
+		-1, // announce_interval (not tracked)
+		26, // current_tracker
+		3, // total_download
+		2, // total_upload
+		28, // total_payload_download
+		27, // total_payload_upload
+		21, // total_failed_bytes
+		22, // total_redundant_bytes
+		7, // download_rate
+		6, // upload_rate
+		30, // download_payload_rate
+		29, // upload_payload_rate
+		11, // num_seeds
+		10, // num_peers
+		31, // num_complete
+		32, // num_incomplete
+		33, // list_seeds
+		34, // list_peers
+		35, // connect_candidates
+		12, // num_pieces
+		36, // total_done
+		13, // total_wanted_done
+		37, // total_wanted
+		14, // distributed_full_copies
+		14, // distributed_fraction
+		14, // distributed_copies
+		38, // block_size
+		17, // num_uploads
+		18, // num_connections
+		-1, // num_undead_peers (not tracked)
+		39, // uploads_limit
+		40, // connections_limit
+		41, // storage_mode
+		42, // up_bandwidth_queue
+		43, // down_bandwidth_queue
+		15, // all_time_upload
+		16, // all_time_download
+		44, // active_time
+		45, // finished_time
+		46, // seeding_time
+		47, // seed_rank
+		48, // last_scrape
+		0, // has_incoming
+		-1, // sparse_regions (not tracked)
+		0, // seed_mode
+		0, // upload_mode
+		0, // share_mode
+		0, // super_seeding
+		49, // priority
+		4, // added_time
+		5, // completed_time
+		50, // last_seen_complete
+		51, // time_since_upload
+		52, // time_since_download
+		19, // queue_position
+		-1, // need_save_resume (internal to save_resume)
+		0, // ip_filter_applies
+		-1, // listen_port (not tracked)
+	};
+
+	int const num_torrent_fields_v2 = 53;
+
+	// the version 2 field of each of torrent_history_entry::counter_fields.
+	// When the client already has the previous value of one of these, the
+	// difference is sent instead of the value
+	int const counter_field_v2[torrent_history_entry::num_counters] =
+	{
+		3, // total_download
+		2, // total_upload
+		28, // total_payload_download
+		27, // total_payload_upload
+		21, // total_failed_bytes
+		22, // total_redundant_bytes
+		36, // total_done
+		13, // total_wanted_done
+		15, // all_time_upload
+		16, // all_time_download
+		44, // active_time
+		45, // finished_time
+		46, // seeding_time
+	};
+
+	static void write_varint(std::vector<char>& out, std::uint64_t v)
+	{
+		while (v >= 0x80)
+		{
+			out.push_back(char(v | 0x80));
+			v >>= 7;
+		}
+		out.push_back(char(v));
+	}
+
+	static void write_signed(std::vector<char>& out, std::int64_t v)
+	{
+		write_varint(out, (std::uint64_t(v) << 1) ^ std::uint64_t(v >> 63));
+	}
+
+	static void write_string(std::vector<char>& out, std::string const& s)
+	{
+		write_varint(out, s.size());
+		out.insert(out.end(), s.begin(), s.end());
+	}
+
+	// the version 2 fields of the torrent that changed after frame. Counters
+	// that changed after current_frame are left for the next update. The
+	// client will be at current_frame, and the difference sent then has to
+	// be from the value it had at that frame
+	static std::uint64_t changed_fields_v2(torrent_history_entry const& e
+		, std::uint32_t frame, std::uint32_t current_frame)
+	{
+		std::uint64_t bitmask = 0;
+		for (int k = 0; k < torrent_history_entry::num_fields; ++k)
+		{
+			int const f = torrent_field_map_v2[k];
+			if (f < 0) continue;
+			if (e.frame(k) <= int(frame)) continue;
+			bitmask |= std::uint64_t(1) << f;
+		}
+		for (int c = 0; c < torrent_history_entry::num_counters; ++c)
+		{
+			if (e.frame(torrent_history_entry::counter_fields[c]) <= int(current_frame)) continue;
+			bitmask &= ~(std::uint64_t(1) << counter_field_v2[c]);
+		}
+		if (e.labels_frame > int(frame)) bitmask |= std::uint64_t(1) << labels_field;
+		return bitmask;
+	}
+
+	// writes the version 2 fields in bitmask, in field order. The counters
+	// in delta_mask are written as the difference from prev, indexed like
+	// torrent_history_entry::counter_fields
+	static void encode_torrent_fields_v2(torrent_history_entry const& e
+		, std::uint64_t bitmask, std::uint64_t delta_mask
+		, std::int64_t const* prev, std::vector<char>& out)
+	{
+		torrent_status const& s = e.status;
+		for (int f = 0; f < num_torrent_fields_v2; ++f)
+		{
+			std::uint64_t const bit = std::uint64_t(1) << f;
+			if ((bitmask & bit) == 0) continue;
+
+			int counter = -1;
+			for (int c = 0; c < torrent_history_entry::num_counters; ++c)
+				if (counter_field_v2[c] == f) counter = c;
+			if (counter >= 0)
+			{
+				std::int64_t v = torrent_history_entry::counter(s, counter);
+				if (delta_mask & bit) v -= prev[counter];
+				write_signed(out, v);
+				continue;
+			}
+
+			switch (f)
+			{
+				case 0: // flags
+					write_varint(out,
+						(s.paused ? 0x001 : 0)
+						| (s.auto_managed ? 0x002 : 0)
+						| (s.sequential_download ? 0x004 : 0)
+						| (s.is_seeding ? 0x008 : 0)
+						| (s.is_finished ? 0x010 : 0)
+						| (s.is_loaded ? 0x020 : 0)
+						| (s.has_metadata ? 0x040 : 0)
+						| (s.has_incoming ? 0x080 : 0)
+						| (s.seed_mode ? 0x100 : 0)
+						| (s.upload_mode ? 0x200 : 0)
+						| (s.share_mode ? 0x400 : 0)
+						| (s.super_seeding ? 0x800 : 0)
+						| (s.ip_filter_applies ? 0x1000 : 0));
+					break;
+				case 1: write_string(out, s.name); break;
+				case 4: write_signed(out, s.added_time); break;
+				case 5: write_signed(out, s.completed_time); break;
+				case 6: write_signed(out, s.upload_rate); break;
+				case 7: write_signed(out, s.download_rate); break;
+				case 8: write_signed(out, s.progress_ppm); break;
+				case 9: write_string(out, s.error); break;
+				case 10: write_signed(out, s.num_peers); break;
+				case 11: write_signed(out, s.num_seeds); break;
+				case 12: write_signed(out, s.num_pieces); break;
+				case 14: // distributed-copies
+					write_signed(out, s.distributed_full_copies);
+					write_signed(out, s.distributed_fraction);
+					break;
+				case 17: write_signed(out, s.num_uploads); break;
+				case 18: write_signed(out, s.num_connections); break;
+				case 19: write_signed(out, s.queue_position); break;
+				case 20: // state
+				{
+					// the states are numbered like in version 1
+					int state;
+					switch (s.state)
+					{
+#ifndef TORRENT_NO_DEPRECATE
+						case torrent_status::queued_for_checking:
+#endif
+						case torrent_status::checking_files:
+						case torrent_status::allocating:
+						case torrent_status::checking_resume_data:
+							state = 0;
+							break;
+						case torrent_status::downloading_metadata:
+							state = 1;
+							break;
+						case torrent_status::downloading:
+						default:
+							state = 2;
+							break;
+						case torrent_status::finished:
+						case torrent_status::seeding:
+							state = 3;
+							break;
+					};
+					write_varint(out, state);
+					break;
+				}
+				case labels_field:
+				{
+					int const num = e.labels ? int(e.labels->size()) : 0;
+					write_varint(out, num);
+					for (int k = 0; k < num; ++k)
+						write_string(out, (*e.labels)[k]);
+					break;
+				}
+				case 24: write_string(out, *e.path); break;
+				case 25: write_signed(out, total_seconds(s.next_announce)); break;
+				case 26: write_string(out, *e.tracker); break;
+				case 29: write_signed(out, s.upload_payload_rate); break;
+				case 30: write_signed(out, s.download_payload_rate); break;
+				case 31: write_signed(out, s.num_complete); break;
+				case 32: write_signed(out, s.num_incomplete); break;
+				case 33: write_signed(out, s.list_seeds); break;
+				case 34: write_signed(out, s.list_peers); break;
+				case 35: write_signed(out, s.connect_candidates); break;
+				case 37: write_signed(out, s.total_wanted); break;
+				case 38: write_signed(out, s.block_size); break;
+				case 39: write_signed(out, s.uploads_limit); break;
+				case 40: write_signed(out, s.connections_limit); break;
+				case 41: write_signed(out, s.storage_mode); break;
+				case 42: write_signed(out, s.up_bandwidth_queue); break;
+				case 43: write_signed(out, s.down_bandwidth_queue); break;
+				case 47: write_signed(out, s.seed_rank); break;
+				case 48: write_signed(out, s.last_scrape); break;
+				case 49: write_signed(out, s.priority); break;
+				case 50: write_signed(out, s.last_seen_complete); break;
+				case 51: write_signed(out, s.time_since_upload); break;
+				case 52: write_signed(out, s.time_since_download); break;
+				default:
+				TORRENT_ASSERT(false);
+			}
+		}
+	}
+
 	// this is one of the key functions in the interface. It goes to
 	// some length to ensure we only send relevant information back,
 	// and in a compact format
 	bool libtorrent_webui::get_torrent_updates(conn_state* st)
+	{
+		return send_torrent_updates(st, 1);
+	}
+
+	bool libtorrent_webui::get_torrent_updates_v2(conn_state* st)
+	{
+		return send_torrent_updates(st, 2);
+	}
+
+	bool libtorrent_webui::send_torrent_updates(conn_state* st, int version)
 	{
 		if (st->len < 12) return error(st, truncated_message);
 
 		std::uint32_t frame = io::read_uint32(st->data);
 		std::uint64_t user_mask = io::read_uint64(st->data);
 		st->len -= 12;
+		frame = read_epoch(st, frame);
 
-		std::vector<torrent_history_entry> torrents;
-		m_hist->updated_fields_since(frame, torrents);
+		// read the frame number before querying the history. Any update
+		// that happens after this will be included in the client's next
+		// request too, rather than being missed
+		std::uint32_t const current_frame = m_hist->frame();
 
-		std::vector<sha1_hash> removed_torrents;
-		m_hist->removed_since(frame, removed_torrents);
+		std::shared_ptr<std::vector<char> const> payload
+			= torrent_updates_payload(frame, current_frame, user_mask, version);
 
-		std::vector<char> response;
-		std::back_insert_iterator<std::vector<char> > ptr(response);
+		char header[4];
+		char* ptr = header;
 
 		io::write_uint8(st->function_id | 0x80, ptr);
 		io::write_uint16(st->transaction_id, ptr);
 		io::write_uint8(no_error, ptr);
 
+		// the payload may be shared with other connections, send it
+		// straight out of the cache
+		send_buffer bufs[] = {
+			send_buffer(header, sizeof(header)),
+			send_buffer(payload->empty() ? NULL : &(*payload)[0], payload->size())
+		};
+		return send_packet(st->conn, 0x2, bufs, 2);
+	}
+
+	std::uint32_t libtorrent_webui::read_epoch(conn_state* st, std::uint32_t frame) const
+	{
+		// clients that don't pass an epoch predate it. Their frame numbers
+		// are taken as they are
+		if (st->len < 4) return frame;
+		std::uint32_t const epoch = io::read_uint32(st->data);
+		st->len -= 4;
+		return m_hist->cursor_frame(epoch, frame);
+	}
+
+	std::shared_ptr<std::vector<char> const> libtorrent_webui::torrent_updates_payload(
+		std::uint32_t frame, std::uint32_t current_frame, std::uint64_t user_mask
+		, int version, int* changes)
+	{
+		// clients that are at the same frame, asking for the same fields,
+		// get the same response. Only encode it once
+		{
+			std::unique_lock<std::mutex> l(m_update_cache_mutex);
+			for (std::vector<update_cache_entry>::iterator i = m_update_cache.begin()
+				, end(m_update_cache.end()); i != end; ++i)
+			{
+				if (i->since_frame != frame
+					|| i->frame != current_frame
+					|| i->user_mask != user_mask
+					|| i->version != version) continue;
+				if (changes) *changes = i->changes;
+				return i->payload;
+			}
+		}
+
+		std::shared_ptr<std::vector<char> > payload = std::make_shared<std::vector<char> >();
+		int const num_changes = encode_torrent_updates(frame, current_frame
+			, user_mask, version, *payload);
+		if (changes) *changes = num_changes;
+
+		std::unique_lock<std::mutex> l(m_update_cache_mutex);
+		// evict responses for frames that have been superseded
+		for (int i = 0; i < int(m_update_cache.size());)
+		{
+			if (m_update_cache[i].frame == current_frame) { ++i; continue; }
+			m_update_cache[i] = m_update_cache.back();
+			m_update_cache.pop_back();
+		}
+		if (m_update_cache.size() >= max_update_cache_size)
+			m_update_cache.erase(m_update_cache.begin());
+
+		update_cache_entry e;
+		e.since_frame = frame;
+		e.frame = current_frame;
+		e.user_mask = user_mask;
+		e.version = version;
+		e.changes = num_changes;
+		e.payload = payload;
+		m_update_cache.push_back(e);
+		return payload;
+	}
+
+	int libtorrent_webui::encode_torrent_updates(std::uint32_t frame
+		, std::uint32_t current_frame, std::uint64_t user_mask, int version
+		, std::vector<char>& response) const
+	{
+		if (version == 2)
+			return encode_torrent_updates_v2(frame, current_frame, user_mask, response);
+
+		// a client behind the history's removal horizon is sent the full
+		// state, flagged for it to drop the torrents it isn't sent
+		std::vector<sha1_hash> removed_torrents;
+		if (!m_hist->removed_since(frame, removed_torrents))
+		{
+			frame = 0;
+			removed_torrents.clear();
+		}
+
+		std::vector<history_entry_ptr> torrents;
+		m_hist->updated_fields_since(frame, torrents);
+
+		std::back_insert_iterator<std::vector<char> > ptr(response);
+
 		// frame number (uint32)
-		io::write_uint32(m_hist->frame(), ptr);
+		io::write_uint32(current_frame, ptr);
 
 		// allocate space for torrent count
 		// this will be filled in later when we know
@@ -221,22 +849,12 @@ namespace libtorrent
 
 		io::write_uint32(removed_torrents.size(), ptr);
 
-		for (std::vector<torrent_history_entry>::iterator i = torrents.begin()
+		for (std::vector<history_entry_ptr>::iterator i = torrents.begin()
 			, end(torrents.end()); i != end; ++i)
 		{
-			std::uint64_t bitmask = 0;
-
-			// look at which fields actually have a newer frame number
-			// than the caller. Don't return fields that haven't changed.
-			for (int k = 0; k < torrent_history_entry::num_fields; ++k)
-			{
-				int f = torrent_field_map[k];
-				if (f < 0) continue;
-				if (i->frame[k] <= frame) continue;
-
-				// this field has changed and should be included in this update
-				bitmask |= 1 << f;
-			}
+			torrent_history_entry const& e = **i;
+			// don't return fields that haven't changed
+			std::uint64_t bitmask = changed_fields(e, frame);
 
 			// only return fields the caller asked for
 			bitmask &= user_mask;
@@ -245,146 +863,12 @@ namespace libtorrent
 
 			++num_torrents;
 			// first write the info-hash
-			std::copy(i->status.info_hash.begin(), i->status.info_hash.end(), ptr);
+			std::copy(e.status.info_hash.begin(), e.status.info_hash.end(), ptr);
 			// then 64 bits of bitmask, indicating which fields
 			// are included in the update for this torrent
 			io::write_uint64(bitmask, ptr);
 
-			torrent_status const& s = i->status;
-
-			for (int f = 0; f < 23; ++f)
-			{
-				if ((bitmask & (1 << f)) == 0) continue;
-
-				// write field f to buffer
-				switch (f)
-				{
-					case 0: // flags
-					{
-						std::uint64_t flags = 
-							(s.paused ? 0x001 : 0)
-							| (s.auto_managed ? 0x002 : 0)
-							| (s.sequential_download ? 0x004 : 0)
-							| (s.is_seeding ? 0x008 : 0)
-							| (s.is_finished ? 0x010 : 0)
-							| (s.is_loaded ? 0x020 : 0)
-							| (s.has_metadata ? 0x040 : 0)
-							| (s.has_incoming ? 0x080 : 0)
-							| (s.seed_mode ? 0x100 : 0)
-							| (s.upload_mode ? 0x200 : 0)
-							| (s.share_mode ? 0x400 : 0)
-							| (s.super_seeding ? 0x800 : 0)
-							;
-
-						io::write_uint64(flags, ptr);
-						break;
-					}
-					case 1: // name
-					{
-						std::string name = s.name;
-						if (name.size() > 65535) name.resize(65535);
-						io::write_uint16(name.size(), ptr);
-						std::copy(name.begin(), name.end(), ptr);
-						break;
-					}
-					case 2: // total-uploaded
-						io::write_uint64(s.total_upload, ptr);
-						break;
-					case 3: // total-downloaded
-						io::write_uint64(s.total_download, ptr);
-						break;
-					case 4: // added-time
-						io::write_uint64(s.added_time, ptr);
-						break;
-					case 5: // completed_time
-						io::write_uint64(s.completed_time, ptr);
-						break;
-					case 6: // upload-rate
-						io::write_uint32(s.upload_rate, ptr);
-						break;
-					case 7: // download-rate
-						io::write_uint32(s.download_rate, ptr);
-						break;
-					case 8: // progress
-						io::write_uint32(s.progress_ppm, ptr);
-						break;
-					case 9: // error
-					{
-						std::string e = s.error;
-						if (e.size() > 65535) e.resize(65535);
-						io::write_uint16(e.size(), ptr);
-						std::copy(e.begin(), e.end(), ptr);
-						break;
-					}
-					case 10: // connected-peers
-						io::write_uint32(s.num_peers, ptr);
-						break;
-					case 11: // connected-seeds
-						io::write_uint32(s.num_seeds, ptr);
-						break;
-					case 12: // downloaded-pieces
-						io::write_uint32(s.num_pieces, ptr);
-						break;
-					case 13: // total-done
-						io::write_uint64(s.total_wanted_done, ptr);
-						break;
-					case 14: // distributed-copies
-						io::write_uint32(s.distributed_full_copies, ptr);
-						io::write_uint32(s.distributed_fraction, ptr);
-						break;
-					case 15: // all-time-upload
-						io::write_uint64(s.all_time_upload, ptr);
-						break;
-					case 16: // all-time-download
-						io::write_uint32(s.all_time_download, ptr);
-						break;
-					case 17: // unchoked-peers
-						io::write_uint32(s.num_uploads, ptr);
-						break;
-					case 18: // num-connections
-						io::write_uint32(s.num_connections, ptr);
-						break;
-					case 19: // queue-position
-						io::write_uint32(s.queue_position, ptr);
-						break;
-					case 20: // state
-					{
-						int state;
-						switch (s.state)
-						{
-#ifndef TORRENT_NO_DEPRECATE
-							case torrent_status::queued_for_checking:
-#endif
-							case torrent_status::checking_files:
-							case torrent_status::allocating:
-							case torrent_status::checking_resume_data:
-								state = 0; // checking-files
-								break;
-							case torrent_status::downloading_metadata:
-								state = 1; // downloading-metadata
-								break;
-							case torrent_status::downloading:
-							default:
-								state = 2; // downloading
-								break;
-							case torrent_status::finished:
-							case torrent_status::seeding:
-								state = 3; // seeding
-								break;
-						};
-						io::write_uint8(state, ptr);
-						break;
-					}
-					case 21: // failed-bytes
-						io::write_uint64(s.total_failed_bytes, ptr);
-						break;
-					case 22: // redundant-bytes
-						io::write_uint64(s.total_redundant_bytes, ptr);
-						break;
-					default:
-					TORRENT_ASSERT(false);
-				}
-			}
+			encode_torrent_fields(e, bitmask, ptr);
 		}
 
 		// now that we know how many torrents we wrote, fill in the
@@ -399,10 +883,71 @@ namespace libtorrent
 			std::copy(i->begin(), i->end(), ptr);
 		}
 
-		return send_packet(st->conn, 0x2, &response[0], response.size());
+		// the history's epoch, for the client to pass back with the frame
+		io::write_uint32(m_hist->epoch(), ptr);
+		io::write_uint8(frame == 0 ? full_update : 0, ptr);
+		return num_torrents + int(removed_torrents.size());
+	}
+
+	int libtorrent_webui::encode_torrent_updates_v2(std::uint32_t frame
+		, std::uint32_t current_frame, std::uint64_t user_mask
+		, std::vector<char>& response) const
+	{
+		std::vector<sha1_hash> removed_torrents;
+		if (!m_hist->removed_since(frame, removed_torrents))
+		{
+			frame = 0;
+			removed_torrents.clear();
+		}
+
+		std::vector<history_entry_ptr> torrents;
+		m_hist->updated_fields_since(frame, torrents);
+
+		// the counts come first, but aren't known until the torrents have
+		// been encoded
+		std::vector<char> body;
+		int num_torrents = 0;
+		std::int64_t prev[torrent_history_entry::num_counters];
+		for (std::vector<history_entry_ptr>::iterator i = torrents.begin()
+			, end(torrents.end()); i != end; ++i)
+		{
+			torrent_history_entry const& e = **i;
+			std::uint64_t const bitmask = changed_fields_v2(e, frame, current_frame)
+				& user_mask;
+			if (bitmask == 0) continue;
+
+			// the counters the client has the previous value of are sent as
+			// the difference from it
+			std::uint64_t delta_mask = 0;
+			for (int c = 0; c < torrent_history_entry::num_counters; ++c)
+			{
+				std::uint64_t const bit = std::uint64_t(1) << counter_field_v2[c];
+				if ((bitmask & bit) && e.previous_value(c, int(frame), prev[c]))
+					delta_mask |= bit;
+			}
+
+			++num_torrents;
+			body.insert(body.end(), e.status.info_hash.begin(), e.status.info_hash.end());
+			write_varint(body, bitmask);
+			write_varint(body, delta_mask);
+			encode_torrent_fields_v2(e, bitmask, delta_mask, prev, body);
+		}
+
+		write_varint(response, current_frame);
+		write_varint(response, num_torrents);
+		write_varint(response, removed_torrents.size());
+		response.insert(response.end(), body.begin(), body.end());
+		for (std::vector<sha1_hash>::iterator i = removed_torrents.begin()
+			, end(removed_torrents.end()); i != end; ++i)
+		{
+			response.insert(response.end(), i->begin(), i->end());
+		}
+		write_varint(response, m_hist->epoch());
+		write_varint(response, frame == 0 ? full_update : 0);
+		return num_torrents + int(removed_torrents.size());
 	}
 
-	int libtorrent_webui::parse_torrent_args(std::vector<torrent_status>& torrents, conn_state* st)
+	int libtorrent_webui::parse_torrent_args(std::vector<history_entry_ptr>& torrents, conn_state* st)
 	{
 		char* ptr = st->data;
 		int num_torrents = io::read_uint16(ptr);
@@ -412,33 +957,99 @@ namespace libtorrent
 		if ((st->len < num_torrents * 20))
 			return invalid_argument_type;
 
+		std::vector<sha1_hash> hashes(num_torrents);
 		for (int i = 0; i < num_torrents; ++i)
-		{
-			sha1_hash h;
-			memcpy(&h[0], &ptr[i*20], 20);
+			memcpy(&hashes[i][0], &ptr[i*20], 20);
 
-			torrent_status ts = m_hist->get_torrent_status(h);
-			if (!ts.handle.is_valid()) continue;
-			torrents.push_back(ts);
-		}
+		// look all of them up in one go, rather than copying the status
+		// of each torrent out of the history
+		m_hist->get_torrents(hashes, torrents);
+
+		// a torrent that's being removed has no valid handle anymore
+		torrents.erase(std::remove_if(torrents.begin(), torrents.end()
+			, [](history_entry_ptr const& e) { return !e->status.handle.is_valid(); })
+			, torrents.end());
 		return no_error;
 	}
 
+	// moving torrents in the queue one at a time reorders the selection
+	// relative to itself, unless they're moved in the right order. Torrents
+	// moved towards the front of the queue are sorted by queue position,
+	// the ones closest to the front first. Torrents moved towards the back
+	// are sorted the other way around
+	static void sort_by_queue_position(std::vector<history_entry_ptr>& torrents
+		, bool front_first)
+	{
+		std::sort(torrents.begin(), torrents.end()
+			, [=](history_entry_ptr const& lhs, history_entry_ptr const& rhs)
+			{
+				return front_first
+					? lhs->status.queue_position < rhs->status.queue_position
+					: lhs->status.queue_position > rhs->status.queue_position;
+			});
+	}
+
 #define TORRENT_APPLY_FUN \
-		std::vector<torrent_status> torrents; \
+		std::vector<history_entry_ptr> torrents; \
+		int ret = parse_torrent_args(torrents, st); \
+		if (ret != no_error) return error(st, ret); \
+		\
+		for (std::vector<history_entry_ptr>::iterator i = torrents.begin() \
+			, end(torrents.end()); i != end; ++i)
+
+	// like TORRENT_APPLY_FUN, but visits the torrents in queue order
+#define TORRENT_APPLY_QUEUE_FUN(front_first) \
+		std::vector<history_entry_ptr> torrents; \
 		int ret = parse_torrent_args(torrents, st); \
 		if (ret != no_error) return error(st, ret); \
+		sort_by_queue_position(torrents, front_first); \
 		\
-		for (std::vector<torrent_status>::iterator i = torrents.begin() \
+		for (std::vector<history_entry_ptr>::iterator i = torrents.begin() \
+			, end(torrents.end()); i != end; ++i)
+
+	// the list of labels follows the torrents
+	bool libtorrent_webui::set_labels(conn_state* st)
+	{
+		std::vector<history_entry_ptr> torrents;
+		int ret = parse_torrent_args(torrents, st);
+		if (ret != no_error) return error(st, ret);
+
+		char* ptr = st->data;
+		int const num_torrents = io::read_uint16(ptr);
+		ptr += num_torrents * 20;
+		int left = st->len - 2 - num_torrents * 20;
+		if (left < 1) return error(st, truncated_message);
+
+		int const num_labels = io::read_uint8(ptr);
+		--left;
+		std::vector<std::string> labels;
+		for (int i = 0; i < num_labels; ++i)
+		{
+			if (left < 2) return error(st, truncated_message);
+			int const len = io::read_uint16(ptr);
+			left -= 2;
+			if (left < len) return error(st, truncated_message);
+			labels.push_back(std::string(ptr, len));
+			ptr += len;
+			left -= len;
+		}
+
+		int num_set = 0;
+		for (std::vector<history_entry_ptr>::iterator i = torrents.begin()
 			, end(torrents.end()); i != end; ++i)
+		{
+			if (m_hist->set_labels((*i)->status.info_hash, labels)) ++num_set;
+		}
+		return respond(st, 0, num_set);
+	}
 
 	bool libtorrent_webui::start(conn_state* st)
 	{
 		TORRENT_APPLY_FUN
 		{
-			i->handle.auto_managed(true);
-			i->handle.clear_error();
-			i->handle.resume();
+			(*i)->status.handle.auto_managed(true);
+			(*i)->status.handle.clear_error();
+			(*i)->status.handle.resume();
 		}
 		return respond(st, 0, torrents.size());
 	}
@@ -447,8 +1058,8 @@ namespace libtorrent
 	{
 		TORRENT_APPLY_FUN
 		{
-			i->handle.auto_managed(false);
-			i->handle.pause();
+			(*i)->status.handle.auto_managed(false);
+			(*i)->status.handle.pause();
 		}
 		return respond(st, 0, torrents.size());
 	}
@@ -457,7 +1068,7 @@ namespace libtorrent
 	{
 		TORRENT_APPLY_FUN
 		{
-			i->handle.auto_managed(true);
+			(*i)->status.handle.auto_managed(true);
 		}
 		return respond(st, 0, torrents.size());
 	}
@@ -465,134 +1076,158 @@ namespace libtorrent
 	{
 		TORRENT_APPLY_FUN
 		{
-			i->handle.auto_managed(false);
+			(*i)->status.handle.auto_managed(false);
 		}
 		return respond(st, 0, torrents.size());
 	}
 	bool libtorrent_webui::queue_up(conn_state* st)
 	{
-		TORRENT_APPLY_FUN
+		TORRENT_APPLY_QUEUE_FUN(true)
 		{
-			i->handle.queue_position_up();
+			(*i)->status.handle.queue_position_up();
 		}
 		return respond(st, 0, torrents.size());
 	}
 	bool libtorrent_webui::queue_down(conn_state* st)
 	{
-		TORRENT_APPLY_FUN
+		TORRENT_APPLY_QUEUE_FUN(false)
 		{
-			i->handle.queue_position_down();
+			(*i)->status.handle.queue_position_down();
 		}
 		return respond(st, 0, torrents.size());
 	}
 	bool libtorrent_webui::queue_top(conn_state* st)
 	{
-		TORRENT_APPLY_FUN
+		TORRENT_APPLY_QUEUE_FUN(false)
 		{
-			i->handle.queue_position_top();
+			(*i)->status.handle.queue_position_top();
 		}
 		return respond(st, 0, torrents.size());
 	}
 	bool libtorrent_webui::queue_bottom(conn_state* st)
 	{
-		TORRENT_APPLY_FUN
+		TORRENT_APPLY_QUEUE_FUN(true)
 		{
-			i->handle.queue_position_bottom();
+			(*i)->status.handle.queue_position_bottom();
 		}
 		return respond(st, 0, torrents.size());
 	}
 	bool libtorrent_webui::remove(conn_state* st)
 	{
+		if (m_bulk) return submit_bulk_job(st, bulk_jobs::remove_op);
 		TORRENT_APPLY_FUN
 		{
-			m_ses.remove_torrent(i->handle);
+			m_sessions->remove_torrent((*i)->status.handle);
 		}
 		return respond(st, 0, torrents.size());
 	}
 	bool libtorrent_webui::remove_and_data(conn_state* st)
 	{
+		if (m_bulk) return submit_bulk_job(st, bulk_jobs::remove_data_op);
 		TORRENT_APPLY_FUN
 		{
-			m_ses.remove_torrent(i->handle, session::delete_files);
+			m_sessions->remove_torrent((*i)->status.handle, session::delete_files);
 		}
 		return respond(st, 0, torrents.size());
 	}
 	bool libtorrent_webui::force_recheck(conn_state* st)
 	{
+		if (m_bulk) return submit_bulk_job(st, bulk_jobs::recheck_op);
 		TORRENT_APPLY_FUN
 		{
-			i->handle.force_recheck();
+			(*i)->status.handle.force_recheck();
 		}
 		return respond(st, 0, torrents.size());
 	}
-	bool libtorrent_webui::set_sequential_download(conn_state* st)
+
+	// the torrents are removed or rechecked in the background, at the rate
+	// of the bulk_jobs. The response only says how many were queued
+	bool libtorrent_webui::submit_bulk_job(conn_state* st, int op)
 	{
-		TORRENT_APPLY_FUN
-		{
-			i->handle.set_sequential_download(true);
-		}
+		std::vector<history_entry_ptr> torrents;
+		int ret = parse_torrent_args(torrents, st);
+		if (ret != no_error) return error(st, ret);
+
+		std::vector<sha1_hash> hashes;
+		hashes.reserve(torrents.size());
+		for (std::vector<history_entry_ptr>::iterator i = torrents.begin()
+			, end(torrents.end()); i != end; ++i)
+			hashes.push_back((*i)->status.info_hash);
+		m_bulk->submit(op, hashes);
 		return respond(st, 0, torrents.size());
 	}
-	bool libtorrent_webui::clear_sequential_download(conn_state* st)
+
+	bool libtorrent_webui::get_bulk_jobs(conn_state* st)
 	{
-		TORRENT_APPLY_FUN
-		{
-			i->handle.set_sequential_download(false);
-		}
-		return respond(st, 0, torrents.size());
-	}
-
-#undef TORRENT_APPLY_FUN
+		std::vector<bulk_jobs::job_status> jobs;
+		if (m_bulk) m_bulk->jobs(jobs);
 
-	bool libtorrent_webui::list_settings(conn_state* st)
-	{
 		std::vector<char> response;
 		std::back_insert_iterator<std::vector<char> > ptr(response);
 
 		io::write_uint8(st->function_id | 0x80, ptr);
 		io::write_uint16(st->transaction_id, ptr);
 		io::write_uint8(no_error, ptr);
+		io::write_uint16(jobs.size(), ptr);
 
-		io::write_uint32(settings_pack::num_string_settings, ptr);
-		io::write_uint32(settings_pack::num_int_settings, ptr);
-		io::write_uint32(settings_pack::num_bool_settings, ptr);
-
-		for (int i = settings_pack::string_type_base;
-			i < settings_pack::max_string_setting_internal; ++i)
+		for (std::vector<bulk_jobs::job_status>::iterator i = jobs.begin()
+			, end(jobs.end()); i != end; ++i)
 		{
-			char const* n = name_for_setting(i);
-			int len = strlen(n);
-			TORRENT_ASSERT(len < 256);
-			io::write_uint8(len, ptr);
-			std::copy(n, n + len, ptr);
-			TORRENT_ASSERT(i < 65536);
-			io::write_uint16(i, ptr);
+			io::write_uint32(i->id, ptr);
+			io::write_uint8(i->operation, ptr);
+			io::write_uint8((i->cancelled ? 1 : 0) | (i->finished ? 2 : 0), ptr);
+			io::write_uint32(i->total, ptr);
+			io::write_uint32(i->done, ptr);
+			io::write_uint16(i->path.size(), ptr);
+			std::copy(i->path.begin(), i->path.end(), ptr);
 		}
 
-		for (int i = settings_pack::int_type_base;
-			i < settings_pack::max_int_setting_internal; ++i)
+		return send_packet(st->conn, 0x2, &response[0], response.size());
+	}
+
+	bool libtorrent_webui::cancel_bulk_job(conn_state* st)
+	{
+		if (st->len < 4) return error(st, invalid_number_of_args);
+		char* iptr = st->data;
+		int const id = io::read_uint32(iptr);
+		if (m_bulk == NULL || !m_bulk->cancel(id))
+			return error(st, invalid_argument);
+		return error(st, no_error);
+	}
+	bool libtorrent_webui::set_sequential_download(conn_state* st)
+	{
+		TORRENT_APPLY_FUN
 		{
-			char const* n = name_for_setting(i);
-			int len = strlen(n);
-			TORRENT_ASSERT(len < 256);
-			io::write_uint8(len, ptr);
-			std::copy(n, n + len, ptr);
-			TORRENT_ASSERT(i < 65536);
-			io::write_uint16(i, ptr);
+			(*i)->status.handle.set_sequential_download(true);
 		}
-
-		for (int i = settings_pack::bool_type_base;
-			i < settings_pack::max_bool_setting_internal; ++i)
+		return respond(st, 0, torrents.size());
+	}
+	bool libtorrent_webui::clear_sequential_download(conn_state* st)
+	{
+		TORRENT_APPLY_FUN
 		{
-			char const* n = name_for_setting(i);
-			int len = strlen(n);
-			TORRENT_ASSERT(len < 256);
-			io::write_uint8(len, ptr);
-			std::copy(n, n + len, ptr);
-			TORRENT_ASSERT(i < 65536);
-			io::write_uint16(i, ptr);
+			(*i)->status.handle.set_sequential_download(false);
 		}
-		return send_packet(st->conn, 0x2, &response[0], response.size());
+		return respond(st, 0, torrents.size());
+	}
+
+#undef TORRENT_APPLY_FUN
+#undef TORRENT_APPLY_QUEUE_FUN
+
+	bool libtorrent_webui::list_settings(conn_state* st)
+	{
+		char header[4];
+		char* ptr = header;
+
+		io::write_uint8(st->function_id | 0x80, ptr);
+		io::write_uint16(st->transaction_id, ptr);
+		io::write_uint8(no_error, ptr);
+
+		send_buffer bufs[] = {
+			send_buffer(header, sizeof(header)),
+			send_buffer(&m_settings_list[0], m_settings_list.size())
+		};
+		return send_packet(st->conn, 0x2, bufs, 2);
 	}
 
 	bool libtorrent_webui::set_settings(conn_state* st)
@@ -641,11 +1276,54 @@ namespace libtorrent
 			}
 		}
 
-		m_ses.apply_settings(pack);
+		m_sessions->apply_settings(pack);
+
+		// the session applies the settings before it answers the refresh
+		refresh_settings(true);
 
 		return error(st, no_error);
 	}
 
+	// appends the value of the setting, in the encoding of its type. Returns
+	// false if name isn't a setting
+	static bool write_setting(std::vector<char>& out, settings_pack const& s
+		, int name)
+	{
+		std::back_insert_iterator<std::vector<char> > ptr(out);
+		if (name >= settings_pack::string_type_base && name < settings_pack::max_string_setting_internal)
+		{
+			std::string const& v = s.get_str(name);
+			io::write_uint16(v.length(), ptr);
+			std::copy(v.begin(), v.end(), ptr);
+		}
+		else if (name >= settings_pack::int_type_base && name < settings_pack::max_int_setting_internal)
+		{
+			io::write_uint32(s.get_int(name), ptr);
+		}
+		else if (name >= settings_pack::bool_type_base && name < settings_pack::max_bool_setting_internal)
+		{
+			io::write_uint8(s.get_bool(name), ptr);
+		}
+		else
+		{
+			return false;
+		}
+		return true;
+	}
+
+	void libtorrent_webui::refresh_settings(bool force)
+	{
+		if (!force && clock_type::now() - m_settings.last_update()
+			< seconds(settings_max_age)) return;
+		if (m_settings_refreshing.exchange(true)) return;
+
+		m_executor.post([this]
+		{
+			m_settings.update(m_ses.get_settings());
+			m_settings_refreshing = false;
+		});
+	}
+
 	bool libtorrent_webui::get_settings(conn_state* st)
 	{
 		char* iptr = st->data;
@@ -653,7 +1331,7 @@ namespace libtorrent
 		int num_settings = io::read_uint16(iptr);
 		st->len -= 2;
 
-		if (st->len < num_settings * 2) return invalid_argument_type;
+		if (st->len < num_settings * 2) return error(st, invalid_argument_type);
 
 		std::vector<char> response;
 		std::back_insert_iterator<std::vector<char> > ptr(response);
@@ -664,34 +1342,80 @@ namespace libtorrent
 
 		io::write_uint16(num_settings, ptr);
 
-		settings_pack s = m_ses.get_settings();
+		// the settings may be up to settings_max_age seconds old. Asking
+		// the session would hold up this thread until it gets around to it
+		std::shared_ptr<settings_pack const> s = m_settings.settings();
+		refresh_settings(false);
 
 		for (int i = 0; i < num_settings; ++i)
 		{
 			int sett = io::read_uint16(iptr);
-			if (sett >= settings_pack::string_type_base && sett < settings_pack::max_string_setting_internal)
-			{
-				std::string const& v = s.get_str(sett);
-				io::write_uint16(v.length(), ptr);
-				std::copy(v.begin(), v.end(), ptr);
-			}
-			else if (sett >= settings_pack::int_type_base && sett < settings_pack::max_int_setting_internal)
-			{
-				io::write_uint32(s.get_int(sett), ptr);
-			}
-			else if (sett >= settings_pack::bool_type_base && sett < settings_pack::max_bool_setting_internal)
-			{
-				io::write_uint8(s.get_bool(sett), ptr);
-			}
-			else
-			{
+			if (!write_setting(response, *s, sett))
 				return error(st, invalid_argument);
-			}
 		}
 
 		return send_packet(st->conn, 0x2, &response[0], response.size());
 	}
 
+	// like get-settings, but only returns the settings that changed since
+	// the frame the client passes in. With no settings specified, all the
+	// ones that changed are returned
+	bool libtorrent_webui::get_settings_updates(conn_state* st)
+	{
+		char* iptr = st->data;
+		if (st->len < 6) return error(st, invalid_number_of_args);
+		int const frame = io::read_uint32(iptr);
+		int const num_settings = io::read_uint16(iptr);
+		st->len -= 6;
+
+		if (st->len < num_settings * 2) return error(st, invalid_argument_type);
+
+		std::vector<int> wanted;
+		for (int i = 0; i < num_settings; ++i)
+		{
+			int const sett = io::read_uint16(iptr);
+			if (settings_cache::index(sett) < 0) return error(st, invalid_argument);
+			wanted.push_back(sett);
+		}
+		std::sort(wanted.begin(), wanted.end());
+
+		// the frame is read first. A change made after it is sent again
+		// next time, rather than missed
+		int const current_frame = m_settings.frame();
+		std::vector<int> changed;
+		m_settings.changed_since(frame, changed);
+		std::shared_ptr<settings_pack const> s = m_settings.settings();
+		refresh_settings(false);
+
+		std::vector<char> response;
+		std::back_insert_iterator<std::vector<char> > ptr(response);
+
+		io::write_uint8(st->function_id | 0x80, ptr);
+		io::write_uint16(st->transaction_id, ptr);
+		io::write_uint8(no_error, ptr);
+		io::write_uint32(current_frame, ptr);
+
+		// the number of settings is filled in once they've been counted
+		int const count_pos = response.size();
+		io::write_uint16(0, ptr);
+
+		int count = 0;
+		for (std::vector<int>::iterator i = changed.begin()
+			, end(changed.end()); i != end; ++i)
+		{
+			if (!wanted.empty()
+				&& !std::binary_search(wanted.begin(), wanted.end(), *i)) continue;
+			io::write_uint16(*i, ptr);
+			write_setting(response, *s, *i);
+			++count;
+		}
+
+		char* cptr = &response[count_pos];
+		io::write_uint16(count, cptr);
+
+		return send_packet(st->conn, 0x2, &response[0], response.size());
+	}
+
 	bool libtorrent_webui::list_stats(conn_state* st)
 	{
 		std::vector<char> response;
@@ -715,18 +1439,193 @@ namespace libtorrent
 			std::copy(i->name, i->name + len, ptr);
 		}
 
+		// the RPC metrics follow the session counters, by their ids
+		std::vector<rpc_metric> rpc = rpc_metrics();
+		for (int i = 0; i < int(rpc.size()); ++i)
+		{
+			io::write_uint16(counters::num_counters + rpc[i].id, ptr);
+			io::write_uint8(rpc[i].counter ? stats_metric::type_counter
+				: stats_metric::type_gauge, ptr);
+			int len = (std::min)(int(rpc[i].name.size()), 255);
+			io::write_uint8(len, ptr);
+			std::copy(rpc[i].name.begin(), rpc[i].name.begin() + len, ptr);
+		}
+
+		// fill in the number of stats, now that we know it
+		char* count_ptr = &response[4];
+		io::write_uint16(stats.size() + rpc.size(), count_ptr);
+
 		return send_packet(st->conn, 0x2, &response[0], response.size());
 	}
 
-	bool libtorrent_webui::get_stats(conn_state* st)
+	int libtorrent_webui::parse_stats_ids(conn_state* st, std::uint32_t& frame
+		, std::vector<int>& ids) const
 	{
 		char* iptr = st->data;
-		if (st->len < 6) return error(st, invalid_number_of_args);
-		std::uint32_t frame = io::read_uint32(iptr);
+		if (st->len < 6) return invalid_number_of_args;
+		frame = io::read_uint32(iptr);
 		int num_stats = io::read_uint16(iptr);
 		st->len -= 6;
 
-		if (st->len < num_stats * 2) return error(st, invalid_number_of_args);
+		if (st->len < num_stats * 2) return invalid_number_of_args;
+
+		// metrics without a live source are accepted, they're just left out
+		// of the updates until there is one
+		int const num_rpc_metrics = num_rpc_metric_ids();
+
+		ids.reserve(num_stats);
+		for (int i = 0; i < num_stats; ++i)
+		{
+			int c = io::read_uint16(iptr);
+			if (c < 0 || c >= counters::num_counters + num_rpc_metrics)
+				return invalid_argument;
+			ids.push_back(c);
+		}
+		return no_error;
+	}
+
+	void libtorrent_webui::encode_stats(std::uint32_t since
+		, std::vector<int> const& ids, std::vector<char>& out) const
+	{
+		std::vector<int> counter_ids;
+		std::vector<int> rpc_ids;
+		for (std::vector<int>::const_iterator i = ids.begin()
+			, end(ids.end()); i != end; ++i)
+		{
+			if (*i < counters::num_counters) counter_ids.push_back(*i);
+			else rpc_ids.push_back(*i);
+		}
+
+		int const start = out.size();
+		m_stats->stats().encode(since, counter_ids, out);
+		if (rpc_ids.empty()) return;
+
+		char const* count_ptr = &out[start + 4];
+		int num_updates = io::read_uint16(count_ptr);
+
+		std::back_insert_iterator<std::vector<char> > ptr(out);
+		for (std::vector<int>::iterator i = rpc_ids.begin()
+			, end(rpc_ids.end()); i != end; ++i)
+		{
+			std::uint64_t value;
+			if (!rpc_metric_value(*i - counters::num_counters, value)) continue;
+			io::write_uint16(*i, ptr);
+			io::write_uint64(value, ptr);
+			++num_updates;
+		}
+
+		char* count_out = &out[start + 4];
+		io::write_uint16(num_updates, count_out);
+	}
+
+	bool libtorrent_webui::get_stats(conn_state* st)
+	{
+		std::uint32_t frame;
+		std::vector<int> ids;
+		int const e = parse_stats_ids(st, frame, ids);
+		if (e != no_error) return error(st, e);
+
+		// a sample taken in the last second is as good as a new one. With
+		// many clients polling, this keeps it to one request per second.
+		// When a new one is needed, the response is written by the alert
+		// thread once it arrives
+		deferred_call const c = defer(st);
+		m_stats->async_sample([c, frame, ids](bool got_sample)
+		{
+			c.complete([&](libtorrent_webui& self, conn_state* st) -> bool
+			{
+				if (!got_sample) return self.error(st, timed_out);
+
+				std::vector<char> response;
+				std::back_insert_iterator<std::vector<char> > ptr(response);
+
+				io::write_uint8(st->function_id | 0x80, ptr);
+				io::write_uint16(st->transaction_id, ptr);
+				io::write_uint8(no_error, ptr);
+
+				self.encode_stats(frame, ids, response);
+				return self.send_packet(st->conn, 0x2, &response[0], response.size());
+			});
+		});
+		return true;
+	}
+
+	libtorrent_webui::deferred_call libtorrent_webui::defer(conn_state* st)
+	{
+		deferred_call c;
+		c.owner = m_owner;
+		c.conn = st->conn;
+		c.ref = connection(st->conn);
+		c.function_id = st->function_id;
+		c.transaction_id = st->transaction_id;
+		c.perms = st->perms;
+		c.start = rpc_stats::defer();
+		return c;
+	}
+
+	// returns a window of the torrents, sorted and filtered by the server.
+	// Clients only ever hold the torrents they show
+	bool libtorrent_webui::get_torrent_view(conn_state* st)
+	{
+		if (st->len < 24) return error(st, truncated_message);
+
+		std::uint32_t const frame = io::read_uint32(st->data);
+		std::uint64_t const user_mask = io::read_uint64(st->data);
+		int sort = io::read_uint8(st->data);
+		bool const descending = (sort & 0x80) != 0;
+		sort &= 0x7f;
+		int const filter = io::read_uint8(st->data);
+		std::uint32_t const offset = io::read_uint32(st->data);
+		std::uint32_t const limit = (std::min)(io::read_uint32(st->data)
+			, std::uint32_t(max_view_size));
+		int const search_len = io::read_uint16(st->data);
+		st->len -= 24;
+		if (st->len < search_len) return error(st, truncated_message);
+		std::string const search(st->data, search_len);
+		st->data += search_len;
+		st->len -= search_len;
+
+		// the label is optional, older clients don't send it
+		std::string label;
+		if (st->len >= 2)
+		{
+			int const label_len = io::read_uint16(st->data);
+			st->len -= 2;
+			if (st->len < label_len) return error(st, truncated_message);
+			label.assign(st->data, label_len);
+			st->data += label_len;
+			st->len -= label_len;
+		}
+
+		if (sort >= torrent_index::num_sort_keys
+			|| filter >= torrent_index::num_filters
+			|| offset > INT_MAX)
+		{
+			return error(st, invalid_argument);
+		}
+
+		// any update after this is seen by the client's next request
+		std::uint32_t const current_frame = m_hist->frame();
+
+		std::vector<history_entry_ptr> torrents;
+		int const matching = m_hist->query_torrents(sort, descending, filter
+			, search, label, offset, limit, torrents);
+
+		// the torrents the connection was sent at frame. If the client isn't
+		// at the frame of the last response, it's sent everything
+		boost::unordered_set<sha1_hash> previous;
+		{
+			std::unique_lock<std::mutex> l(m_view_mutex);
+			view_state& v = m_views[st->conn];
+			if (frame != 0 && frame == v.frame) previous.swap(v.torrents);
+			v.frame = current_frame;
+			v.torrents.clear();
+			for (std::vector<history_entry_ptr>::iterator i = torrents.begin()
+				, end(torrents.end()); i != end; ++i)
+			{
+				v.torrents.insert((*i)->status.info_hash);
+			}
+		}
 
 		std::vector<char> response;
 		std::back_insert_iterator<std::vector<char> > ptr(response);
@@ -735,71 +1634,188 @@ namespace libtorrent
 		io::write_uint16(st->transaction_id, ptr);
 		io::write_uint8(no_error, ptr);
 
-		std::future<alert*> f
-			= m_alert->subscribe<session_stats_alert>();
-		m_ses.post_session_stats();
-		// wait for the alert to arrive
-		std::auto_ptr<session_stats_alert> ss((session_stats_alert*)f.get());
+		io::write_uint32(current_frame, ptr);
+		io::write_uint32(matching, ptr);
+		io::write_uint32(torrents.size(), ptr);
+
+		for (std::vector<history_entry_ptr>::iterator i = torrents.begin()
+			, end(torrents.end()); i != end; ++i)
+		{
+			torrent_history_entry const& e = **i;
+			std::uint64_t bitmask = previous.count(e.status.info_hash)
+				? changed_fields(e, frame) : all_torrent_fields;
+			bitmask &= user_mask;
+
+			std::copy(e.status.info_hash.begin(), e.status.info_hash.end(), ptr);
+			io::write_uint64(bitmask, ptr);
+			encode_torrent_fields(e, bitmask, ptr);
+		}
+
+		return send_packet(st->conn, 0x2, &response[0], response.size());
+	}
+
+	bool libtorrent_webui::get_file_updates(conn_state* st)
+	{
+		char* iptr = st->data;
+		if (st->len != 24) return error(st, invalid_number_of_args);
+		sha1_hash ih;
+		std::copy(iptr, iptr+20, &ih[0]);
+		iptr += 20;
+		int const frame = io::read_uint32(iptr);
+
+		deferred_call const c = defer(st);
+		m_executor.post([c, ih, frame]
+		{
+			c.complete([&](libtorrent_webui& self, conn_state* st)
+			{ return self.send_file_updates(st, ih, frame); });
+		});
+		return true;
+	}
+
+	bool libtorrent_webui::send_file_updates(conn_state* st, sha1_hash const& ih
+		, int frame)
+	{
+		torrent_handle h = m_sessions->find_torrent(ih);
+		if (!h.is_valid()) return error(st, invalid_argument);
 
-		if (ss.get() == NULL) return error(st, no_such_function);
-		TORRENT_ASSERT(ss.get());
+		file_entry_ptr e = m_files->get_file_updates(h);
+		if (!e) return error(st, resource_not_found);
 
-		std::unique_lock<std::mutex> l(m_stats_mutex);
-		++m_stats_frame;
-		io::write_uint32(m_stats_frame, ptr);
+		file_storage const& fs = e->torrent->files();
+		int const num_files = e->progress.size();
 
-		std::uint64_t* stats = ss->values;
+		// torrents may have a very large number of files. Stream the
+		// response rather than building all of it up-front
+		websocket_writer out(*this, st->conn, 0x2);
 
-		if (m_stats.size() < counters::num_counters)
-			m_stats.resize(counters::num_counters
-				, std::pair<std::uint64_t, std::uint32_t>(0, 0));
+		std::vector<char> response;
+		std::back_insert_iterator<std::vector<char> > ptr(response);
 
-		// we'll fill in the counter later
-		int counter_pos = response.size();
-		io::write_uint16(0, ptr);
+		io::write_uint8(st->function_id | 0x80, ptr);
+		io::write_uint16(st->transaction_id, ptr);
+		io::write_uint8(no_error, ptr);
+
+		// frame number
+		io::write_uint32(e->frame, ptr);
 
-		// first update our copy of the stats, and update their frame counters
-		for (int i = 0; i < counters::num_counters; ++i)
+		// number of files
+		io::write_uint32(num_files, ptr);
+
+		// the flags, name and size of files never change. They're only
+		// sent the first time
+		bool const send_static = e->static_frame > frame;
+
+		int mask_pos = 0;
+		for (int i = 0; i < num_files; ++i)
 		{
-			if (m_stats[i].first != stats[i])
+			if ((i % 8) == 0)
 			{
-				m_stats[i].second = m_stats_frame;
-				m_stats[i].first = stats[i];
+				// we'll fill in the bitmask as we go
+				mask_pos = response.size();
+				io::write_uint8(0, ptr);
 			}
-		}
 
-		int num_updates = 0;
-		for (int i = 0; i < num_stats; ++i)
-		{
-			int c = io::read_uint16(iptr);
-			if (c < 0 || c > m_stats.size())
-				return error(st, invalid_argument);
+			int field_mask = send_static ? 0x7 : 0;
+			if (e->progress_frame[i] > frame) field_mask |= 0x8;
+			if (e->priority_frame[i] > frame) field_mask |= 0x10;
+			if (field_mask == 0) continue;
 
-			if (m_stats[c].second <= frame) continue;
-			io::write_uint16(c, ptr);
-			io::write_uint64(m_stats[c].first, ptr);
-			++num_updates;
+			response[mask_pos] |= 0x80 >> (i & 7);
+
+			// file update bitmask
+			io::write_uint16(field_mask, ptr);
+
+			if (field_mask & 0x1)
+			{
+				// flags
+				io::write_uint8(fs.file_flags(i), ptr);
+			}
+
+			if (field_mask & 0x2)
+			{
+				// name
+				std::string name = fs.file_path(i);
+				if (name.size() > 65535) name.resize(65535);
+				io::write_uint16(name.size(), ptr);
+				std::copy(name.begin(), name.end(), ptr);
+			}
+
+			if (field_mask & 0x4)
+			{
+				// total-size
+				io::write_uint64(fs.file_size(i), ptr);
+			}
+
+			// total downloaded
+			if (field_mask & 0x8)
+				io::write_uint64(e->progress[i], ptr);
+
+			// priority
+			if (field_mask & 0x10)
+				io::write_uint8(e->priority[i], ptr);
+
+			if (response.size() < websocket_writer::fragment_size) continue;
+
+			// keep the bitmask we're still filling in, in the buffer
+			if ((i % 8) != 7) continue;
+			if (!out.write(&response[0], response.size())) return false;
+			response.clear();
 		}
 
-		// now that we know what the number of updates is, fill it in
-		char* counter_ptr = &response[counter_pos];
-		io::write_uint16(num_updates, counter_ptr);
+		if (!response.empty() && !out.write(&response[0], response.size()))
+			return false;
+		return out.finish();
+	}
 
-		return send_packet(st->conn, 0x2, &response[0], response.size());
+	static void write_endpoint(tcp::endpoint const& ep
+		, std::back_insert_iterator<std::vector<char> >& ptr)
+	{
+		if (ep.address().is_v4())
+		{
+			address_v4::bytes_type const b = ep.address().to_v4().to_bytes();
+			io::write_uint8(b.size(), ptr);
+			std::copy(b.begin(), b.end(), ptr);
+		}
+		else
+		{
+			address_v6::bytes_type const b = ep.address().to_v6().to_bytes();
+			io::write_uint8(b.size(), ptr);
+			std::copy(b.begin(), b.end(), ptr);
+		}
+		io::write_uint16(ep.port(), ptr);
 	}
 
-	bool libtorrent_webui::get_file_updates(conn_state* st)
+	bool libtorrent_webui::get_peer_updates(conn_state* st)
 	{
 		char* iptr = st->data;
 		if (st->len != 24) return error(st, invalid_number_of_args);
 		sha1_hash ih;
 		std::copy(iptr, iptr+20, &ih[0]);
 		iptr += 20;
-		std::uint32_t frame = io::read_uint32(iptr);
+		int const frame = io::read_uint32(iptr);
+
+		deferred_call const c = defer(st);
+		m_executor.post([c, ih, frame]
+		{
+			c.complete([&](libtorrent_webui& self, conn_state* st)
+			{ return self.send_peer_updates(st, ih, frame); });
+		});
+		return true;
+	}
 
-		torrent_handle h = m_ses.find_torrent(ih);
+	bool libtorrent_webui::send_peer_updates(conn_state* st, sha1_hash const& ih
+		, int frame)
+	{
+		torrent_handle h = m_sessions->find_torrent(ih);
 		if (!h.is_valid()) return error(st, invalid_argument);
 
+		peer_entry_ptr e = m_peers ? m_peers->get_peers(h) : read_peers(h);
+		if (!e) return error(st, resource_not_found);
+
+		std::vector<peer_history_peer const*> peers;
+		std::vector<tcp::endpoint> removed;
+		bool const incremental = e->updates_since(m_peers ? frame : 0, peers, removed);
+
 		std::vector<char> response;
 		std::back_insert_iterator<std::vector<char> > ptr(response);
 
@@ -807,55 +1823,234 @@ namespace libtorrent
 		io::write_uint16(st->transaction_id, ptr);
 		io::write_uint8(no_error, ptr);
 
-		std::vector<std::int64_t> fp;
-		h.file_progress(fp, torrent_handle::piece_granularity);
+		io::write_uint32(e->frame, ptr);
 
-		shared_ptr<const torrent_info> t = h.torrent_file();
-		if (!t) return error(st, resource_not_found);
+		// 1 means the peers are the complete list, and any other peer the
+		// client knows about is gone
+		io::write_uint8(incremental ? 0 : 1, ptr);
 
-		file_storage const& fs = t->files();
+		io::write_uint32(peers.size(), ptr);
+		for (std::vector<peer_history_peer const*>::iterator i = peers.begin()
+			, end(peers.end()); i != end; ++i)
+		{
+			peer_history_peer const& p = **i;
+			write_endpoint(p.ip, ptr);
 
-		// just in case
-		fp.resize(fs.num_files(), 0);
+			std::uint16_t field_mask = 0;
+			for (int k = 0; k < peer_history_peer::num_fields; ++k)
+			{
+				if (!incremental || p.frame[k] > frame) field_mask |= 1 << k;
+			}
+			io::write_uint16(field_mask, ptr);
+
+			peer_state const& ps = p.state;
+			if (field_mask & (1 << peer_history_peer::flags))
+				io::write_uint32(ps.flags, ptr);
+			if (field_mask & (1 << peer_history_peer::source))
+				io::write_uint8(ps.source, ptr);
+			if (field_mask & (1 << peer_history_peer::client))
+			{
+				std::string const& c = ps.client;
+				int const len = (std::min)(int(c.size()), 65535);
+				io::write_uint16(len, ptr);
+				std::copy(c.begin(), c.begin() + len, ptr);
+			}
+			if (field_mask & (1 << peer_history_peer::num_pieces))
+				io::write_uint32(ps.num_pieces, ptr);
+			if (field_mask & (1 << peer_history_peer::down_speed))
+				io::write_uint32(ps.down_speed, ptr);
+			if (field_mask & (1 << peer_history_peer::up_speed))
+				io::write_uint32(ps.up_speed, ptr);
+			if (field_mask & (1 << peer_history_peer::download_queue_length))
+				io::write_uint32(ps.download_queue_length, ptr);
+			if (field_mask & (1 << peer_history_peer::upload_queue_length))
+				io::write_uint32(ps.upload_queue_length, ptr);
+			if (field_mask & (1 << peer_history_peer::total_download))
+				io::write_uint64(ps.total_download, ptr);
+			if (field_mask & (1 << peer_history_peer::total_upload))
+				io::write_uint64(ps.total_upload, ptr);
+			if (field_mask & (1 << peer_history_peer::num_hashfails))
+				io::write_uint32(ps.num_hashfails, ptr);
+			if (field_mask & (1 << peer_history_peer::send_buffer_size))
+				io::write_uint32(ps.send_buffer_size, ptr);
+			if (field_mask & (1 << peer_history_peer::last_request))
+				io::write_uint32(ps.last_request, ptr);
+			if (field_mask & (1 << peer_history_peer::last_active))
+				io::write_uint32(ps.last_active, ptr);
+		}
 
-		// frame number
-		io::write_uint32(0, ptr);
+		io::write_uint32(removed.size(), ptr);
+		for (std::vector<tcp::endpoint>::iterator i = removed.begin()
+			, end(removed.end()); i != end; ++i)
+		{
+			write_endpoint(*i, ptr);
+		}
 
-		// number of files
-		io::write_uint32(fs.num_files(), ptr);
+		return send_packet(st->conn, 0x2, &response[0], response.size());
+	}
+
+	bool libtorrent_webui::subscribe_torrent_updates(conn_state* st)
+	{
+		return subscribe_updates(st, 1);
+	}
+
+	bool libtorrent_webui::subscribe_torrent_updates_v2(conn_state* st)
+	{
+		return subscribe_updates(st, 2);
+	}
+
+	bool libtorrent_webui::subscribe_updates(conn_state* st, int version)
+	{
+		if (st->len < 12) return error(st, truncated_message);
+
+		std::uint32_t frame = io::read_uint32(st->data);
+		std::uint64_t user_mask = io::read_uint64(st->data);
+		st->len -= 12;
+		frame = read_epoch(st, frame);
 
-		// TODO: we should really just send differences since last time
-		// for now, just send full updates
-		for (int i = 0; i < fs.num_files(); ++i)
 		{
-			if ((i % 8) == 0)
+			std::unique_lock<std::mutex> l(m_subscription_mutex);
+			subscription& s = m_subscriptions[st->conn];
+			s.torrent_updates = true;
+			s.version = version;
+			s.frame = frame;
+			s.user_mask = user_mask;
+		}
+		return error(st, no_error);
+	}
+
+	bool libtorrent_webui::subscribe_stats(conn_state* st)
+	{
+		std::uint32_t frame;
+		std::vector<int> ids;
+		int const e = parse_stats_ids(st, frame, ids);
+		if (e != no_error) return error(st, e);
+
+		{
+			std::unique_lock<std::mutex> l(m_subscription_mutex);
+			subscription& s = m_subscriptions[st->conn];
+			s.stats_frame = frame;
+			s.stats.swap(ids);
+		}
+		return error(st, no_error);
+	}
+
+	bool libtorrent_webui::unsubscribe(conn_state* st)
+	{
+		std::unique_lock<std::mutex> l(m_subscription_mutex);
+		m_subscriptions.erase(st->conn);
+		l.unlock();
+		return error(st, no_error);
+	}
+
+	void libtorrent_webui::handle_alert(alert const* a)
+	{
+		if (state_update_alert const* su = alert_cast<state_update_alert>(a))
+		{
+			std::uint32_t const current_frame = m_hist->frame();
+
+			std::map<mg_connection*, subscription> subscribers;
+			{
+				std::unique_lock<std::mutex> l(m_subscription_mutex);
+				subscribers = m_subscriptions;
+			}
+
+			bool want_stats = false;
+			for (std::map<mg_connection*, subscription>::iterator i = subscribers.begin()
+				, end(subscribers.end()); i != end; ++i)
 			{
-				std::uint8_t mask = 0xff;
-				if (fs.num_files() - i < 8)
-					mask <<= 8 - fs.num_files() + i;
-				io::write_uint8(mask, ptr);
+				subscription& s = i->second;
+				if (!s.stats.empty()) want_stats = true;
+				if (!s.torrent_updates || s.frame == current_frame) continue;
+
+				int const function = s.version == 2
+					? subscribe_torrent_updates_v2_id : subscribe_torrent_updates_id;
+
+				// if the last update is still waiting to be sent, the client
+				// is falling behind. Rather than queuing another one, replace
+				// it with an update covering both
+				std::uint32_t const since = is_queued(i->first, function)
+					? s.push_frame : s.frame;
+
+				// subscribers at the same frame share the same encoded update
+				int changes = 0;
+				std::shared_ptr<std::vector<char> const> payload
+					= torrent_updates_payload(since, current_frame, s.user_mask
+						, s.version, &changes);
+
+				// don't push empty updates
+				if (changes > 0)
+				{
+					call_rpc(i->first, function, &(*payload)[0], payload->size()
+						, function);
+				}
+
+				std::unique_lock<std::mutex> l(m_subscription_mutex);
+				std::map<mg_connection*, subscription>::iterator it
+					= m_subscriptions.find(i->first);
+				if (it == m_subscriptions.end()) continue;
+				it->second.frame = current_frame;
+				if (changes > 0) it->second.push_frame = since;
 			}
 
-			// file update bitmask (all 4 fields)
-			io::write_uint16(0xf, ptr);
+			// subscribers get stats pushed once per frame. The counters are
+			// pushed once the session_stats_alert arrives, in on_stats()
+			if (want_stats) m_stats->request(milliseconds(stats_snapshot::sample_interval_ms - 100));
+		}
+	}
 
-			// flags
-			io::write_uint8(fs.file_flags(i), ptr);
+	void libtorrent_webui::on_stats(session_stats_alert const*, int)
+	{
+		std::map<mg_connection*, subscription> subscribers;
+		{
+			std::unique_lock<std::mutex> l(m_subscription_mutex);
+			subscribers = m_subscriptions;
+		}
 
-			// name
-			std::string name = fs.file_path(i);
-			if (name.size() > 65535) name.resize(65535);
-			io::write_uint16(name.size(), ptr);
-			std::copy(name.begin(), name.end(), ptr);
+		std::vector<std::pair<mg_connection*, std::vector<char> > > updates;
+		std::uint32_t const current_frame = m_stats->stats().frame();
 
-			// total-size
-			io::write_uint64(fs.file_size(i), ptr);
+		for (std::map<mg_connection*, subscription>::iterator i = subscribers.begin()
+			, end(subscribers.end()); i != end; ++i)
+		{
+			subscription& s = i->second;
+			if (s.stats.empty()) continue;
 
-			// total downloaded
-			io::write_uint64(fp[i], ptr);
+			updates.push_back(std::make_pair(i->first, std::vector<char>()));
+			encode_stats(s.stats_frame, s.stats, updates.back().second);
 		}
 
-		return send_packet(st->conn, 0x2, &response[0], response.size());
+		for (std::vector<std::pair<mg_connection*, std::vector<char> > >::iterator i
+			= updates.begin(), end(updates.end()); i != end; ++i)
+		{
+			std::vector<char> const& payload = i->second;
+
+			// the number of counters follow the frame number. Don't push
+			// empty updates
+			char const* count = &payload[4];
+			if (io::read_uint16(count) != 0)
+			{
+				call_rpc(i->first, subscribe_stats_id, &payload[0], payload.size());
+			}
+
+			std::unique_lock<std::mutex> l2(m_subscription_mutex);
+			std::map<mg_connection*, subscription>::iterator it
+				= m_subscriptions.find(i->first);
+			if (it != m_subscriptions.end()) it->second.stats_frame = current_frame;
+		}
+	}
+
+	void libtorrent_webui::handle_end_request(mg_connection* conn)
+	{
+		{
+			std::unique_lock<std::mutex> l(m_subscription_mutex);
+			m_subscriptions.erase(conn);
+		}
+		{
+			std::unique_lock<std::mutex> l(m_view_mutex);
+			m_views.erase(conn);
+		}
+		websocket_handler::handle_end_request(conn);
 	}
 
 	char const* fun_name(int function_id)
@@ -868,20 +2063,11 @@ namespace libtorrent
 		return functions[function_id].name;
 	}
 
-	bool libtorrent_webui::handle_websocket_data(mg_connection* conn
-		, int bits, char* data, size_t length)
+	bool libtorrent_webui::handle_websocket_message(mg_connection* conn
+		, int type, char* data, size_t length)
 	{
-		// TODO: this should really be handled at one layer below
-		// ping
-		if ((bits & 0xf) == 0x9)
-		{
-			// send pong
-			fprintf(stderr, "PING\n");
-			return send_packet(conn, 0xa, NULL, 0);
-		}
-
-		// only support binary, non-fragmented frames
-		if ((bits & 0xf) != 0x2)
+		// only support binary messages
+		if (type != 0x2)
 		{
 			fprintf(stderr, "ERROR: received packet that's not in binary mode\n");
 			return false;
@@ -924,6 +2110,9 @@ namespace libtorrent
 //			fprintf(stderr, "CALL: %s (%d bytes arguments)\n", fun_name(st.function_id), st.len);
 			if (st.function_id >= 0 && st.function_id < sizeof(functions)/sizeof(functions[0]))
 			{
+				// the response is queued, not written, by the call. Its size
+				// is counted as it's queued
+				rpc_stats::call c(m_rpc_stats, st.function_id);
 				return (this->*functions[st.function_id].handler)(&st);
 			}
 			else
@@ -950,6 +2139,8 @@ namespace libtorrent
 
 	bool libtorrent_webui::error(conn_state* st, int error)
 	{
+		if (error != no_error) rpc_stats::set_error();
+
 		char rpc[4];
 		char* ptr = &rpc[0];
 		io::write_uint8(st->function_id | 0x80, ptr);
@@ -959,10 +2150,11 @@ namespace libtorrent
 		return send_packet(st->conn, 0x2, rpc, 4);
 	}
 
-	bool libtorrent_webui::call_rpc(mg_connection* conn, int function, char const* data, int len)
+	bool libtorrent_webui::call_rpc(mg_connection* conn, int function, char const* data, int len
+		, int key)
 	{
-		buffer buf(len + 3);
-		char* ptr = &buf[0];
+		char header[3];
+		char* ptr = header;
 		TORRENT_ASSERT(function >= 0 && function < 128);
 
 		// function id
@@ -972,9 +2164,11 @@ namespace libtorrent
 		std::uint16_t tid = m_transaction_id++;
 		io::write_uint16(tid, ptr);
 
-		if (len > 0) memcpy(ptr, data, len);
-
-		return send_packet(conn, 0x2, &buf[0], buf.size());
+		send_buffer bufs[] = {
+			send_buffer(header, sizeof(header)),
+			send_buffer(data, len)
+		};
+		return send_packet(conn, 0x2, bufs, 2, key);
 	}
 
 }
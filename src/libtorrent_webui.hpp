@@ -34,8 +34,20 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_LIBTORRENT_WEBUI_HPP
 
 #include "websocket_handler.hpp"
+#include "alert_observer.hpp"
+#include "stats_snapshot.hpp"
+#include "rpc_stats.hpp"
+#include "rpc_executor.hpp"
+#include "settings_cache.hpp"
+#include "file_history.hpp"
+#include "session_set.hpp"
+#include "torrent_history.hpp" // for history_entry_ptr
 #include "libtorrent/torrent_handle.hpp"
 #include <boost/atomic.hpp>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
 
 struct mg_connection;
 
@@ -45,18 +57,54 @@ namespace libtorrent
 	struct torrent_history;
 	struct auth_interface;
 	struct alert_handler;
+	struct peer_history;
+	struct bulk_jobs;
 	class session;
 
-	struct libtorrent_webui : websocket_handler
+	// the torrent_history passed in must be subscribed to the alert_handler
+	// before this object is constructed, to have torrent updates pushed
+	// to subscribers after the history has been updated
+	struct libtorrent_webui : websocket_handler, alert_observer, stats_observer
 	{
-		libtorrent_webui(session& ses, torrent_history const* hist
-			, auth_interface const* auth, alert_handler* alerts);
+		libtorrent_webui(session& ses, torrent_history* hist
+			, auth_interface const* auth, alert_handler* alerts
+			, stats_snapshot* stats);
 		~libtorrent_webui();
 
+		// passes the commands that concern the session as a whole, like
+		// adding and removing torrents and changing settings, on to a set of
+		// sessions rather than just the one this was constructed with. NULL
+		// goes back to that one. Updates are pushed to subscribers as the
+		// first session's torrent updates are handled
+		void set_sessions(session_set* s)
+		{ m_sessions = s ? s : &m_own_sessions; }
+
+		// get-peer-updates is answered from the peer lists kept by peers.
+		// Without one, the peers are read for every request, and always
+		// sent in full
+		void set_peer_history(peer_history* peers)
+		{ m_peers = peers; }
+
+		// shares the file lists of another file_history, like one the other
+		// web UIs use. NULL goes back to the one of this object
+		void set_file_history(file_history* files)
+		{ m_files = files ? files : &m_own_files; }
+
+		// remove, remove_and_data and force_recheck are queued as jobs to
+		// carry out in the background. Without it, they're carried out
+		// before responding
+		void set_bulk_jobs(bulk_jobs* jobs)
+		{ m_bulk = jobs; }
+
 		virtual bool handle_websocket_connect(mg_connection* conn,
 			mg_request_info const* request_info);
-		virtual bool handle_websocket_data(mg_connection* conn
-			, int bits, char* data, size_t length);
+		virtual bool handle_websocket_message(mg_connection* conn
+			, int type, char* data, size_t length);
+		virtual void handle_end_request(mg_connection* conn);
+
+		// pushes updates to subscribed connections
+		virtual void handle_alert(alert const* a);
+		virtual void on_stats(session_stats_alert const* a, int num_changed);
 
 		struct conn_state
 		{
@@ -86,22 +134,156 @@ namespace libtorrent
 		bool list_settings(conn_state* st);
 		bool set_settings(conn_state* st);
 		bool get_settings(conn_state* st);
+		bool get_settings_updates(conn_state* st);
+
+		bool get_bulk_jobs(conn_state* st);
+		bool cancel_bulk_job(conn_state* st);
 
 		bool list_stats(conn_state* st);
 		bool get_stats(conn_state* st);
 
 		bool get_file_updates(conn_state* st);
 
+		bool subscribe_torrent_updates(conn_state* st);
+		bool subscribe_stats(conn_state* st);
+		bool unsubscribe(conn_state* st);
+
+		bool get_torrent_view(conn_state* st);
+
+		bool get_peer_updates(conn_state* st);
+		bool set_labels(conn_state* st);
+
+		// the same as get_torrent_updates and subscribe_torrent_updates,
+		// with the updates in the compact format of version 2
+		bool get_torrent_updates_v2(conn_state* st);
+		bool subscribe_torrent_updates_v2(conn_state* st);
+
+		// the arguments and responses of the two versions differ in the
+		// update format only
+		bool send_torrent_updates(conn_state* st, int version);
+		bool subscribe_updates(conn_state* st, int version);
+
 		// parse the arguments to the simple torrent commands
-		int parse_torrent_args(std::vector<torrent_status>& torrents, conn_state* st);
+		int parse_torrent_args(std::vector<history_entry_ptr>& torrents, conn_state* st);
+
+		// queues op on the torrents in the arguments, as a bulk job
+		bool submit_bulk_job(conn_state* st, int op);
 
-		bool call_rpc(mg_connection* conn, int function, char const* data, int len);
+		// sends a call to the client. A call with a key replaces the previous
+		// one with the same key, if it's still in the send queue
+		bool call_rpc(mg_connection* conn, int function, char const* data, int len
+			, int key = 0);
+
+		// encode the torrent updates since frame into response, not
+		// including the RPC header, in the format of the given version.
+		// Returns the number of torrents updated and removed
+		int encode_torrent_updates(std::uint32_t frame, std::uint32_t current_frame
+			, std::uint64_t user_mask, int version, std::vector<char>& response) const;
+		int encode_torrent_updates_v2(std::uint32_t frame, std::uint32_t current_frame
+			, std::uint64_t user_mask, std::vector<char>& response) const;
+
+		// returns the encoded torrent updates since frame, from the cache
+		// if possible. If changes is set, it's set to the number of torrents
+		// updated and removed
+		std::shared_ptr<std::vector<char> const> torrent_updates_payload(
+			std::uint32_t frame, std::uint32_t current_frame, std::uint64_t user_mask
+			, int version, int* changes = NULL);
+
+		// reads the optional epoch following the frame number of
+		// get-torrent-updates and subscribe-torrent-updates. Returns the
+		// frame to send updates since
+		std::uint32_t read_epoch(conn_state* st, std::uint32_t frame) const;
 
 		bool respond(conn_state* st, int error, int val);
 
+		// like stats_frame::encode(), but ids may also refer to the RPC
+		// metrics, numbered from counters::num_counters. Those don't keep
+		// track of the frame they changed in and are always included
+		void encode_stats(std::uint32_t since, std::vector<int> const& ids
+			, std::vector<char>& out) const;
+
+		// parses the arguments of get-stats and subscribe-stats. Returns
+		// no_error or the error to respond with
+		int parse_stats_ids(conn_state* st, std::uint32_t& frame
+			, std::vector<int>& ids) const;
+
 		// respond with an error to an RPC
 		bool error(conn_state* st, int error);
 
+		// the bodies of get-file-updates and get-peer-updates, once their
+		// arguments have been parsed. They're run on m_executor, since
+		// looking up the torrent and its files or peers waits for the
+		// session
+		bool send_file_updates(conn_state* st, sha1_hash const& ih, int frame);
+		bool send_peer_updates(conn_state* st, sha1_hash const& ih, int frame);
+
+		// deferred calls only complete while this is set. Destruction clears
+		// it and waits for the completions already running
+		struct call_owner
+		{
+			call_owner(libtorrent_webui* s): self(s), running(0) {}
+			std::mutex mutex;
+			std::condition_variable cond;
+			libtorrent_webui* self;
+			int running;
+		};
+
+		// a call that returns before it responds, for the response to be
+		// written once what it waits for is done, without holding on to
+		// the web server thread in the meantime
+		struct deferred_call
+		{
+			std::shared_ptr<call_owner> owner;
+			mg_connection* conn;
+			// the response is dropped if the connection is gone, even if
+			// another one has the same address by now
+			connection_ref ref;
+			int function_id;
+			std::uint16_t transaction_id;
+			permissions_interface const* perms;
+			time_point start;
+
+			// calls f(libtorrent_webui&, conn_state*) to write the response,
+			// with the state the call was made with (but no arguments left).
+			// It's recorded in the RPC stats as the call. Nothing happens if
+			// the libtorrent_webui or the connection is gone
+			template <class F>
+			void complete(F const& f) const
+			{
+				bound_connection b(conn, ref);
+				if (!b.valid()) return;
+
+				std::unique_lock<std::mutex> l(owner->mutex);
+				libtorrent_webui* self = owner->self;
+				if (self == NULL) return;
+				++owner->running;
+				l.unlock();
+
+				{
+					rpc_stats::call c(self->m_rpc_stats, function_id, NULL, start);
+					conn_state st = { conn, function_id, transaction_id, NULL, 0, perms };
+					f(*self, &st);
+				}
+
+				l.lock();
+				if (--owner->running == 0) owner->cond.notify_all();
+			}
+		};
+
+		// takes the call in progress out of the RPC stats, to be recorded
+		// when it completes
+		deferred_call defer(conn_state* st);
+
+		// the function IDs of updates pushed to subscribers. These are
+		// the same as the functions subscribing to them. Pushed torrent
+		// updates are queued with their function ID as key
+		enum
+		{
+			subscribe_torrent_updates_id = 20,
+			subscribe_stats_id = 21,
+			subscribe_torrent_updates_v2_id = 27
+		};
+
 		enum error_t
 		{
 			no_error,
@@ -110,25 +292,127 @@ namespace libtorrent
 			invalid_argument_type,
 			invalid_argument,
 			truncated_message,
-			resource_not_found
+			resource_not_found,
+			timed_out
 		};
 
 	private:
 
 		session& m_ses;
-		torrent_history const* m_hist;
+
+		// the session as a set of one, unless set_sessions() has been called
+		session_set m_own_sessions;
+		session_set* m_sessions;
+		torrent_history* m_hist;
 		auth_interface const* m_auth;
 		alert_handler* m_alert;
 		boost::atomic<int> m_transaction_id;
 
-		std::mutex m_stats_mutex;
-		// TODO: factor this out into its own class
-		// the frame numbers where the stats counters changed
-		std::vector<std::pair<std::uint64_t, std::uint32_t> > m_stats;
-		// the current stats frame (incremented every time) stats
-		// are requested
-		std::uint32_t m_stats_frame;
+		// the file progress of torrents clients have asked about, with
+		// per-file frame numbers for get-file-updates. m_files points to
+		// m_own_files unless set_file_history() has been called
+		file_history m_own_files;
+		file_history* m_files;
+
+		// the cached peer lists, or NULL
+		peer_history* m_peers;
+
+		// the queue of operations on many torrents, or NULL
+		bulk_jobs* m_bulk;
+
+		// cache of encoded get-torrent-updates responses (not including
+		// the RPC header). Entries are evicted as soon as the history
+		// frame advances
+		struct update_cache_entry
+		{
+			std::uint32_t since_frame;
+			std::uint32_t frame;
+			std::uint64_t user_mask;
+			int version;
+			int changes;
+			std::shared_ptr<std::vector<char> const> payload;
+		};
+
+		enum { max_update_cache_size = 16 };
+
+		std::mutex m_update_cache_mutex;
+		std::vector<update_cache_entry> m_update_cache;
+
+		// the last sample of the stats counters and the frames they changed
+		// in
+		stats_snapshot* m_stats;
+
+		// call counts, latency and response sizes of the functions above
+		rpc_stats m_rpc_stats;
+
+		// the state of connections that have subscribed to have updates
+		// pushed to them
+		struct subscription
+		{
+			subscription(): torrent_updates(false), version(1), frame(0)
+				, push_frame(0), user_mask(0), stats_frame(0) {}
+
+			// true if the connection subscribes to torrent updates, and the
+			// format it wants them in
+			bool torrent_updates;
+			int version;
+
+			// the last torrent frame and the fields sent to this connection
+			std::uint32_t frame;
+
+			// the frame the last pushed update started at. If it's still in
+			// the send queue, the next one starts here too and replaces it
+			std::uint32_t push_frame;
+			std::uint64_t user_mask;
+
+			// the last stats frame sent to this connection, and the stats
+			// counters it's subscribed to. If empty, it doesn't subscribe to
+			// stats
+			std::uint32_t stats_frame;
+			std::vector<int> stats;
+		};
+
+		std::mutex m_subscription_mutex;
+		std::map<mg_connection*, subscription> m_subscriptions;
+
+		// the last window of torrents get-torrent-view sent to a connection,
+		// and the frame it was sent at. The torrents that stay in the window
+		// are only sent the fields that changed
+		struct view_state
+		{
+			view_state(): frame(0) {}
+			std::uint32_t frame;
+			boost::unordered_set<sha1_hash> torrents;
+		};
+
+		// the most torrents get-torrent-view returns at a time
+		enum { max_view_size = 10000 };
+
+		std::mutex m_view_mutex;
+		std::map<mg_connection*, view_state> m_views;
+
+		// the response to list-settings, without the RPC header. The list
+		// of settings never changes, it's only encoded once
+		std::vector<char> m_settings_list;
+
+		// get-settings is answered from here. The settings are read from
+		// the session again, on m_executor, when they're asked for and
+		// they're more than settings_max_age seconds old, or after
+		// set-settings
+		settings_cache m_settings;
+		boost::atomic<bool> m_settings_refreshing;
+		enum { settings_max_age = 5 };
+
+		// posts a refresh of m_settings, unless one is already pending. If
+		// force isn't set, only if the settings are too old
+		void refresh_settings(bool force);
+
+		std::shared_ptr<call_owner> m_owner;
 
+		// runs the parts of calls that wait for the session. It's the last
+		// member, for its threads to be joined before anything they use is
+		// destroyed
+		rpc_executor m_executor;
 	};
 }
 
@@ -208,6 +208,46 @@ struct mg_request_info *mg_get_request_info(struct mg_connection *);
 int mg_write(struct mg_connection *, const void *buf, size_t len);
 
 
+// A buffer passed to mg_writev().
+struct mg_iovec {
+  const void *buf;
+  size_t len;
+};
+
+// Send the concatenation of the iovcnt buffers in iov to the client.
+// On plain (non-SSL, non-throttled) connections this is done with as few
+// system calls as the kernel allows, rather than one per buffer.
+// Return values are the same as for mg_write().
+int mg_writev(struct mg_connection *, const struct mg_iovec *iov, int iovcnt);
+
+// Send len bytes of the open file fd, starting at offset, to the client.
+// On plain (non-SSL, non-throttled) connections on Linux this uses
+// sendfile(2) and never copies the data through user space. Otherwise the
+// file is read in chunks and sent with mg_write(). The file position of fd
+// is unspecified afterwards.
+// Return:
+//  number of bytes sent, which is less than len on error or disconnect.
+long long mg_send_file_range(struct mg_connection *, int fd,
+                             long long offset, long long len);
+
+// Return a running count of the bytes written to the connection by all of
+// the functions above. Only the difference between two calls is meaningful,
+// it's the number of bytes written in between.
+long long mg_get_bytes_written(const struct mg_connection *);
+
+
+// Set the value of the Sec-WebSocket-Extensions header sent in the reply to
+// a websocket handshake. Must be called from the websocket_connect callback.
+void mg_set_websocket_extensions(struct mg_connection *,
+                                 const char *extensions);
+
+
+// Shut down both directions of the connection's socket, without closing it.
+// Reads and writes blocked on it, in any thread, return with an error. Safe
+// to call from any thread while the connection is alive.
+void mg_shutdown_connection(struct mg_connection *);
+
+
 // Macros for enabling compiler-specific checks for printf-like arguments.
 #undef PRINTF_FORMAT_STRING
 #if _MSC_VER >= 1400
@@ -0,0 +1,244 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "log_ring.hpp"
+
+#include <chrono>
+#include <algorithm>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+namespace libtorrent
+{
+	namespace
+	{
+		// how often the writer checks the queue, when it's not woken up
+		enum { idle_wakeup_ms = 100 };
+
+		// the time stamp format is the one of ctime(), without the newline
+		void format_time(std::int64_t sec, char* buf, int len)
+		{
+			time_t t = time_t(sec);
+			struct tm tm;
+			localtime_r(&t, &tm);
+			strftime(buf, len, "%a %b %e %H:%M:%S %Y", &tm);
+		}
+
+		std::uint64_t ring_size(int size)
+		{
+			std::uint64_t n = 2;
+			while (n < std::uint64_t(size)) n <<= 1;
+			return n;
+		}
+	}
+
+	log_ring::log_ring(FILE* out, int size)
+		: m_slots(new slot[ring_size(size)])
+		, m_mask(ring_size(size) - 1)
+		, m_out(out)
+		, m_head(0)
+		, m_tail(0)
+		, m_posted(0)
+		, m_dropped(0)
+		, m_sampled_out(0)
+		, m_sleeping(false)
+		, m_quit(false)
+	{
+		for (std::uint64_t i = 0; i <= m_mask; ++i)
+			m_slots[i].sequence.store(i, std::memory_order_relaxed);
+
+		for (int i = 0; i < num_categories; ++i)
+		{
+			m_sample_rate[i].store(1, std::memory_order_relaxed);
+			m_sample_count[i].store(0, std::memory_order_relaxed);
+		}
+
+		m_writer = std::thread(&log_ring::writer_thread, this);
+	}
+
+	log_ring::~log_ring()
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		m_quit = true;
+		m_cond.notify_all();
+		l.unlock();
+		m_writer.join();
+	}
+
+	char const* log_ring::category_name(int category)
+	{
+		static char const* const names[] =
+		{
+			"peer-error",
+			"peer-disconnect",
+			"torrent-error",
+			"network-error",
+			"request",
+		};
+		if (category < 0 || category >= num_categories) return "";
+		return names[category];
+	}
+
+	void log_ring::set_sample_rate(int category, int n)
+	{
+		if (category < 0 || category >= num_categories) return;
+		m_sample_rate[category].store((std::max)(n, 0), std::memory_order_relaxed);
+	}
+
+	bool log_ring::post(int category, char const* fmt, ...)
+	{
+		if (category < 0 || category >= num_categories) return false;
+
+		int const rate = m_sample_rate[category].load(std::memory_order_relaxed);
+		if (rate != 1)
+		{
+			std::uint64_t const n = m_sample_count[category].fetch_add(1, std::memory_order_relaxed);
+			if (rate == 0 || (n % rate) != 0)
+			{
+				m_sampled_out.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+		}
+
+		// claim a slot. The sequence number tells whether the writer is done
+		// with it, and whether another producer got to it first
+		std::uint64_t pos = m_head.load(std::memory_order_relaxed);
+		slot* s;
+		for (;;)
+		{
+			s = &m_slots[pos & m_mask];
+			std::uint64_t const seq = s->sequence.load(std::memory_order_acquire);
+			std::int64_t const diff = std::int64_t(seq - pos);
+			if (diff == 0)
+			{
+				if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+			{
+				// the writer hasn't caught up
+				m_dropped.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			else
+			{
+				pos = m_head.load(std::memory_order_relaxed);
+			}
+		}
+
+		s->r.time = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+		s->r.category = category;
+		va_list args;
+		va_start(args, fmt);
+		int const len = vsnprintf(s->r.message, sizeof(s->r.message), fmt, args);
+		va_end(args);
+		if (len < 0) s->r.message[0] = '\0';
+
+		s->sequence.store(pos + 1, std::memory_order_release);
+		m_posted.fetch_add(1, std::memory_order_relaxed);
+
+		if (m_sleeping.load(std::memory_order_relaxed))
+			m_cond.notify_one();
+		return true;
+	}
+
+	void log_ring::flush()
+	{
+		std::uint64_t const target = m_head.load(std::memory_order_acquire);
+		std::unique_lock<std::mutex> l(m_mutex);
+		m_cond.notify_one();
+		while (m_tail.load(std::memory_order_acquire) < target)
+			m_flushed.wait_for(l, std::chrono::milliseconds(idle_wakeup_ms));
+	}
+
+	int log_ring::drain(char* time_buf, std::int64_t& time_sec)
+	{
+		int ret = 0;
+		std::uint64_t pos = m_tail.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			slot& s = m_slots[pos & m_mask];
+			if (s.sequence.load(std::memory_order_acquire) != pos + 1) break;
+
+			// the time stamp only changes once a second
+			std::int64_t const sec = s.r.time / 1000000;
+			if (sec != time_sec)
+			{
+				format_time(sec, time_buf, 64);
+				time_sec = sec;
+			}
+			if (m_out) fprintf(m_out, "%s\t%s\n", time_buf, s.r.message);
+
+			s.sequence.store(pos + m_mask + 1, std::memory_order_release);
+			++pos;
+			++ret;
+		}
+		m_tail.store(pos, std::memory_order_release);
+		return ret;
+	}
+
+	void log_ring::writer_thread()
+	{
+		char time_buf[64];
+		std::int64_t time_sec = -1;
+		std::uint64_t reported_drops = 0;
+
+		std::unique_lock<std::mutex> l(m_mutex);
+		for (;;)
+		{
+			l.unlock();
+			int const n = drain(time_buf, time_sec);
+
+			std::uint64_t const drops = m_dropped.load(std::memory_order_relaxed);
+			if (drops != reported_drops && m_out)
+			{
+				if (time_sec < 0) format_time(time(NULL), time_buf, 64);
+				fprintf(m_out, "%s\tlog queue full, %d records dropped\n"
+					, time_buf, int(drops - reported_drops));
+				reported_drops = drops;
+			}
+			if (n > 0 && m_out) fflush(m_out);
+
+			l.lock();
+			m_flushed.notify_all();
+			if (n > 0) continue;
+			if (m_quit) break;
+
+			m_sleeping.store(true, std::memory_order_relaxed);
+			m_cond.wait_for(l, std::chrono::milliseconds(idle_wakeup_ms));
+			m_sleeping.store(false, std::memory_order_relaxed);
+		}
+	}
+}
+
@@ -0,0 +1,154 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_LOG_RING_HPP
+#define TORRENT_LOG_RING_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <cstdint>
+#include <stdio.h> // for FILE
+
+namespace libtorrent
+{
+	// a bounded queue of log records, written to a file by a thread of its
+	// own. Posting a record never blocks and never takes a lock, any number
+	// of threads may post at the same time. When the queue is full, records
+	// are dropped (and counted) rather than waited for. Records are stamped
+	// with the time they were posted and logged under a category, and a
+	// category can be sampled to only keep one in every n of its records
+	struct log_ring
+	{
+		enum category_t
+		{
+			peer_error,
+			peer_disconnect,
+			torrent_error,
+			network_error,
+			request,
+			num_categories
+		};
+
+		// the longest message a record holds. Longer ones are truncated
+		enum { max_message = 240 };
+
+		// out is not closed by the ring. The number of records it holds is
+		// rounded up to a power of two
+		explicit log_ring(FILE* out, int size = 4096);
+
+		// writes all records posted so far before returning
+		~log_ring();
+
+		// formats a record and queues it. Returns false if it was sampled
+		// out or the queue was full
+		bool post(int category, char const* fmt, ...)
+#ifdef __GNUC__
+			__attribute__((format(printf, 3, 4)))
+#endif
+			;
+
+		// keep one in every n records of the category. 1 (the default) keeps
+		// all of them, 0 none
+		void set_sample_rate(int category, int n);
+
+		// blocks until the records posted before the call have been written
+		void flush();
+
+		std::uint64_t posted() const { return m_posted.load(std::memory_order_relaxed); }
+		std::uint64_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+		std::uint64_t sampled_out() const { return m_sampled_out.load(std::memory_order_relaxed); }
+
+		static char const* category_name(int category);
+
+	private:
+
+		struct record
+		{
+			// microseconds since the epoch
+			std::int64_t time;
+			int category;
+			char message[max_message];
+		};
+
+		// a slot is free for the producer claiming position p when its
+		// sequence is p, and holds a record for the writer to read when it's
+		// p + 1
+		struct slot
+		{
+			std::atomic<std::uint64_t> sequence;
+			record r;
+		};
+
+		void writer_thread();
+
+		// writes the records that are ready. Returns the number written
+		int drain(char* time_buf, std::int64_t& time_sec);
+
+		std::unique_ptr<slot[]> m_slots;
+		std::uint64_t const m_mask;
+		FILE* m_out;
+
+		// the next position to post to
+		std::atomic<std::uint64_t> m_head;
+
+		// the next position for the writer to read. Only the writer thread
+		// moves it, flush() reads it
+		std::atomic<std::uint64_t> m_tail;
+
+		std::atomic<int> m_sample_rate[num_categories];
+		std::atomic<std::uint64_t> m_sample_count[num_categories];
+
+		std::atomic<std::uint64_t> m_posted;
+		std::atomic<std::uint64_t> m_dropped;
+		std::atomic<std::uint64_t> m_sampled_out;
+
+		// the writer sleeps on m_cond while the queue is empty. Producers
+		// only notify it when it's asleep, and it wakes up by itself every
+		// now and then, in case a notification was missed
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
+		std::condition_variable m_flushed;
+		std::atomic<bool> m_sleeping;
+		bool m_quit;
+
+		std::thread m_writer;
+
+		log_ring(log_ring const&);
+		log_ring& operator=(log_ring const&);
+	};
+}
+
+#endif
+
@@ -0,0 +1,182 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "metrics_exporter.hpp"
+#include "auth.hpp" // for parse_http_auth
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+extern "C" {
+#include "local_mongoose.h"
+}
+
+namespace libtorrent
+{
+namespace
+{
+	// "peer.num_peers_connected" becomes "libtorrent_peer_num_peers_connected".
+	// Metric names may only have letters, digits, underscores and colons
+	std::string metric_name(char const* name)
+	{
+		std::string ret = "libtorrent_";
+		for (; *name; ++name)
+		{
+			char const c = *name;
+			bool const valid = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+				|| (c >= '0' && c <= '9') || c == '_' || c == ':';
+			ret += valid ? c : '_';
+		}
+		return ret;
+	}
+
+	// gauges may be negative, they're stored as two's complement
+	void append_metric(std::string& out, char const* name, bool counter
+		, std::uint64_t value)
+	{
+		char buf[300];
+		// counters end in _total, their metric family doesn't
+		int const len = counter
+			? snprintf(buf, sizeof(buf), "# TYPE %s counter\n%s_total %" PRIu64 "\n"
+				, name, name, value)
+			: snprintf(buf, sizeof(buf), "# TYPE %s gauge\n%s %" PRId64 "\n"
+				, name, name, std::int64_t(value));
+		if (len > 0) out.append(buf, (std::min)(len, int(sizeof(buf)) - 1));
+	}
+}
+
+metrics_exporter::metrics_exporter(stats_snapshot* stats, auth_interface const* auth
+	, webui_base const* web)
+	: m_stats(stats)
+	, m_auth(auth)
+	, m_web(web)
+	, m_page_size(0)
+{
+	std::vector<stats_metric> metrics = session_stats_metrics();
+	for (std::vector<stats_metric>::iterator i = metrics.begin()
+		, end(metrics.end()); i != end; ++i)
+	{
+		metric m;
+		m.name = metric_name(i->name);
+		m.value_index = i->value_index;
+		m.counter = i->type == stats_metric::type_counter;
+		m_metrics.push_back(m);
+	}
+	std::sort(m_metrics.begin(), m_metrics.end()
+		, [](metric const& lhs, metric const& rhs) { return lhs.name < rhs.name; });
+
+	// there's something to serve before the first sample arrives
+	m_page = render();
+	m_stats->subscribe(this);
+}
+
+metrics_exporter::~metrics_exporter()
+{
+	m_stats->unsubscribe(this);
+}
+
+std::shared_ptr<std::string const> metrics_exporter::render() const
+{
+	std::shared_ptr<std::string> page = std::make_shared<std::string>();
+	page->reserve(m_page_size + 1024);
+
+	stats_frame const& stats = m_stats->stats();
+	for (std::vector<metric>::const_iterator i = m_metrics.begin()
+		, end(m_metrics.end()); i != end; ++i)
+	{
+		append_metric(*page, i->name.c_str(), i->counter, stats.value(i->value_index));
+	}
+
+	if (m_web)
+	{
+		webui_stats const s = m_web->stats();
+		append_metric(*page, "libtorrent_webui_active_connections", false, s.active);
+		append_metric(*page, "libtorrent_webui_rejected_requests", true, s.rejected);
+		append_metric(*page, "libtorrent_webui_requests", true, s.requests);
+		append_metric(*page, "libtorrent_webui_unhandled_requests", true, s.unhandled);
+		append_metric(*page, "libtorrent_webui_websocket_connections", true, s.websockets);
+	}
+
+	page->append("# EOF\n");
+	m_page_size = page->size();
+	return page;
+}
+
+void metrics_exporter::on_stats(session_stats_alert const*, int)
+{
+	std::shared_ptr<std::string const> page = render();
+	std::unique_lock<std::mutex> l(m_mutex);
+	m_page.swap(page);
+}
+
+bool metrics_exporter::handle_http(mg_connection* conn
+	, mg_request_info const* request_info)
+{
+	bool const head = strcmp(request_info->request_method, "HEAD") == 0;
+	if (!head && strcmp(request_info->request_method, "GET") != 0) return false;
+
+	permissions_interface const* perms = parse_http_auth(conn, m_auth);
+	if (!perms || !perms->allow_session_status())
+	{
+		mg_printf(conn, "HTTP/1.1 401 Unauthorized\r\n"
+			"WWW-Authenticate: Basic realm=\"BitTorrent\"\r\n"
+			"Content-Length: 0\r\n\r\n");
+		return true;
+	}
+
+	std::shared_ptr<std::string const> page;
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		page = m_page;
+	}
+
+	char header[300];
+	int const header_len = snprintf(header, sizeof(header)
+		, "HTTP/1.1 200 OK\r\n"
+		"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+		"Content-Length: %d\r\n"
+		"Cache-Control: no-cache\r\n\r\n"
+		, int(page->size()));
+
+	mg_iovec iov[2];
+	iov[0].buf = header;
+	iov[0].len = header_len;
+	iov[1].buf = page->data();
+	iov[1].len = head ? 0 : page->size();
+	mg_writev(conn, iov, 2);
+	return true;
+}
+
+}
+
@@ -0,0 +1,98 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_METRICS_EXPORTER_HPP
+#define TORRENT_METRICS_EXPORTER_HPP
+
+#include "webui.hpp"
+#include "stats_snapshot.hpp"
+#include "auth_interface.hpp"
+#include "libtorrent/session_stats.hpp"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+
+namespace libtorrent
+{
+	/**
+		Serves every session stats counter and gauge, and the web server's
+		own counters, in the OpenMetrics text format for Prometheus to
+		scrape. The page is rendered once per stats sample, when it arrives
+		in the snapshot, so serving a scrape is just a copy of that buffer.
+		Register it for the URI it should be served at, like /metrics.
+		Scrapes are authenticated with HTTP basic auth, and need the
+		session status permission.
+	*/
+	struct metrics_exporter : http_handler, stats_observer
+	{
+		/// auth is required. To serve the metrics to anyone, pass a no_auth
+		/// object. web may be NULL, to only export the session counters
+		metrics_exporter(stats_snapshot* stats, auth_interface const* auth
+			, webui_base const* web = NULL);
+		~metrics_exporter();
+
+		virtual bool handle_http(mg_connection* conn
+			, mg_request_info const* request_info);
+
+	private:
+
+		virtual void on_stats(session_stats_alert const* a, int num_changed);
+
+		// renders the current snapshot into a new page
+		std::shared_ptr<std::string const> render() const;
+
+		stats_snapshot* m_stats;
+		auth_interface const* m_auth;
+		webui_base const* m_web;
+
+		// the session_stats_metrics() with their names converted to metric
+		// names, and sorted by name
+		struct metric
+		{
+			std::string name;
+			int value_index;
+			bool counter;
+		};
+		std::vector<metric> m_metrics;
+
+		// the size of the last page rendered, to reserve for the next one
+		mutable std::size_t m_page_size;
+
+		mutable std::mutex m_mutex;
+		std::shared_ptr<std::string const> m_page;
+	};
+}
+
+#endif
+
@@ -125,6 +125,7 @@ typedef long off_t;
 
 #define WINCDECL __cdecl
 #define SHUT_WR 1
+#define SHUT_RDWR 2
 #define snprintf _snprintf
 #define vsnprintf _vsnprintf
 #define mg_sleep(x) Sleep(x)
@@ -205,6 +206,10 @@ struct pollfd {
 #else    // UNIX  specific
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
 #include <sys/poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -254,6 +259,7 @@ typedef int SOCKET;
 #define MAX_CGI_ENVIR_VARS 64
 #define MG_BUF_LEN 8192
 #define MAX_REQUEST_SIZE 16384
+#define IDLE_THREAD_TIMEOUT 30 // seconds
 #define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
 
 #ifdef _WIN32
@@ -443,7 +449,7 @@ enum {
   ACCESS_LOG_FILE, ENABLE_DIRECTORY_LISTING, ERROR_LOG_FILE,
   GLOBAL_PASSWORDS_FILE, INDEX_FILES, ENABLE_KEEP_ALIVE, ACCESS_CONTROL_LIST,
   EXTRA_MIME_TYPES, LISTENING_PORTS, DOCUMENT_ROOT, SSL_CERTIFICATE,
-  NUM_THREADS, RUN_AS_USER, REWRITE, HIDE_FILES, REQUEST_TIMEOUT,
+  NUM_THREADS, MAX_THREADS, RUN_AS_USER, REWRITE, HIDE_FILES, REQUEST_TIMEOUT,
   NUM_OPTIONS
 };
 
@@ -469,6 +475,7 @@ static const char *config_options[] = {
   "document_root",  ".",
   "ssl_certificate", NULL,
   "num_threads", "50",
+  "max_threads", "0",
   "run_as_user", NULL,
   "url_rewrite_patterns", NULL,
   "hide_files_patterns", NULL,
@@ -487,6 +494,9 @@ struct mg_context {
   int num_listening_sockets;
 
   volatile int num_threads;  // Number of threads
+  volatile int num_idle;     // Number of threads waiting for a socket
+  int base_threads;          // Threads that never exit while running
+  int max_threads;           // Most threads to start under load
   pthread_mutex_t mutex;     // Protects (max|num)_threads
   pthread_cond_t  cond;      // Condvar for tracking workers terminations
 
@@ -505,6 +515,7 @@ struct mg_connection {
   struct socket client;       // Connected client
   time_t birth_time;          // Time when request was received
   int64_t num_bytes_sent;     // Total bytes sent to client
+  int64_t num_bytes_written;  // Bytes written by mg_write() and friends, ever
   int64_t content_len;        // Content-Length header value
   int64_t consumed_content;   // How many bytes of content have been read
   char *buf;                  // Buffer for received data
@@ -517,6 +528,7 @@ struct mg_connection {
   int throttle;               // Throttling, bytes/sec. <= 0 means no throttle
   time_t last_throttle_time;  // Last time throttled data was sent
   int64_t last_throttle_bytes;// Bytes sent this second
+  char websocket_extensions[128]; // Sec-WebSocket-Extensions to reply with
 };
 
 // Directory entry
@@ -1608,9 +1620,137 @@ int mg_write(struct mg_connection *conn, const void *buf, size_t len) {
     total = push(NULL, conn->client.sock, conn->ssl, (const char *) buf,
                  (int64_t) len);
   }
+  if (total > 0) {
+    conn->num_bytes_written += total;
+  }
   return (int) total;
 }
 
+long long mg_get_bytes_written(const struct mg_connection *conn) {
+  return conn->num_bytes_written;
+}
+
+int mg_writev(struct mg_connection *conn, const struct mg_iovec *iov,
+              int iovcnt) {
+  int64_t total = 0;
+  int i, n;
+
+#if !defined(_WIN32)
+  if (conn->throttle <= 0 && conn->ssl == NULL) {
+    struct iovec vec[16];
+    struct msghdr msg;
+    int first = 0, vec_len;
+    size_t offset = 0;
+    ssize_t sent;
+
+    // Send up to 16 buffers per call. A short write resumes from the first
+    // buffer that was not sent in full.
+    while (first < iovcnt && conn->ctx->stop_flag == 0) {
+      for (vec_len = 0; vec_len < 16 && first + vec_len < iovcnt; ++vec_len) {
+        vec[vec_len].iov_base = (char *) iov[first + vec_len].buf;
+        vec[vec_len].iov_len = iov[first + vec_len].len;
+      }
+      vec[0].iov_base = (char *) vec[0].iov_base + offset;
+      vec[0].iov_len -= offset;
+
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = vec;
+      msg.msg_iovlen = vec_len;
+      sent = sendmsg(conn->client.sock, &msg, MSG_NOSIGNAL);
+      if (sent <= 0)
+        break;
+      total += sent;
+
+      sent += offset;
+      offset = 0;
+      while (first < iovcnt && (size_t) sent >= iov[first].len) {
+        sent -= iov[first].len;
+        ++first;
+      }
+      offset = (size_t) sent;
+    }
+    conn->num_bytes_written += total;
+    return (int) total;
+  }
+#endif
+
+  // SSL and throttled connections go through mg_write(). Small buffers are
+  // coalesced to not send one SSL record per buffer
+  i = 0;
+  while (i < iovcnt) {
+    char buf[1024];
+    const char *ptr = buf;
+    size_t len = 0;
+
+    while (i < iovcnt && len + iov[i].len <= sizeof(buf)) {
+      memcpy(buf + len, iov[i].buf, iov[i].len);
+      len += iov[i].len;
+      ++i;
+    }
+    if (len == 0) {
+      ptr = (const char *) iov[i].buf;
+      len = iov[i].len;
+      ++i;
+    }
+
+    n = mg_write(conn, ptr, len);
+    if (n > 0)
+      total += n;
+    if (n < (int) len)
+      break;
+  }
+  return (int) total;
+}
+
+long long mg_send_file_range(struct mg_connection *conn, int fd,
+                             long long offset, long long len) {
+  char buf[MG_BUF_LEN];
+  int64_t total = 0;
+  int to_read, num_read, num_written;
+
+#if defined(__linux__)
+  // Plain connections let the kernel copy straight from the page cache to
+  // the socket
+  if (conn->throttle <= 0 && conn->ssl == NULL) {
+    off_t off = (off_t) offset;
+    ssize_t sent;
+    size_t chunk;
+
+    while (total < len && conn->ctx->stop_flag == 0) {
+      chunk = len - total > 0x40000000 ? 0x40000000 : (size_t) (len - total);
+      sent = sendfile(conn->client.sock, fd, &off, chunk);
+      if (sent < 0 && errno == EINTR)
+        continue;
+      if (sent <= 0)
+        break;
+      total += sent;
+    }
+    conn->num_bytes_written += total;
+    return total;
+  }
+#endif
+
+  if (lseek(fd, (off_t) offset, SEEK_SET) == (off_t) -1)
+    return 0;
+
+  while (total < len) {
+    to_read = sizeof(buf);
+    if ((int64_t) to_read > len - total) {
+      to_read = (int) (len - total);
+    }
+    if ((num_read = read(fd, buf, (size_t) to_read)) <= 0) {
+      break;
+    }
+    if ((num_written = mg_write(conn, buf, (size_t) num_read)) > 0) {
+      total += num_written;
+    }
+    if (num_written != num_read) {
+      break;
+    }
+  }
+  return total;
+}
+
 // Print message to buffer. If buffer is large enough to hold the message,
 // return buffer. If buffer is to small, allocate large enough buffer on heap,
 // and return allocated buffer.
@@ -3882,13 +4022,32 @@ static void send_websocket_handshake(struct mg_connection *conn) {
   SHA1Update(&sha_ctx, (unsigned char *) buf, strlen(buf));
   SHA1Final((unsigned char *) sha, &sha_ctx);
   base64_encode((unsigned char *) sha, sizeof(sha), b64_sha);
-  mg_printf(conn, "%s%s%s",
+  mg_printf(conn, "%s%s\r\n%s%s%s\r\n",
             "HTTP/1.1 101 Switching Protocols\r\n"
             "Upgrade: websocket\r\n"
             "Connection: Upgrade\r\n"
-            "Sec-WebSocket-Accept: ", b64_sha, "\r\n\r\n");
+            "Sec-WebSocket-Accept: ", b64_sha,
+            conn->websocket_extensions[0] == '\0' ? "" :
+            "Sec-WebSocket-Extensions: ", conn->websocket_extensions,
+            conn->websocket_extensions[0] == '\0' ? "" : "\r\n");
+}
+
+void mg_set_websocket_extensions(struct mg_connection *conn,
+                                 const char *extensions) {
+  mg_strlcpy(conn->websocket_extensions, extensions,
+             sizeof(conn->websocket_extensions));
+}
+
+void mg_shutdown_connection(struct mg_connection *conn) {
+  if (conn->client.sock != INVALID_SOCKET) {
+    shutdown(conn->client.sock, SHUT_RDWR);
+  }
 }
 
+#ifndef MAX_WEBSOCKET_FRAME_SIZE
+#define MAX_WEBSOCKET_FRAME_SIZE (16 * 1024 * 1024)
+#endif
+
 static void read_websocket(struct mg_connection *conn) {
   unsigned char *buf = (unsigned char *) conn->buf + conn->request_len;
   int bits, n, stop = 0;
@@ -3923,6 +4082,11 @@ static void read_websocket(struct mg_connection *conn) {
     //     |<-------------------conn->data_len------------->|
 
     if (header_len > 0) {
+      // Don't let clients make us allocate arbitrary amounts of memory
+      if (data_len > MAX_WEBSOCKET_FRAME_SIZE) {
+        break;
+      }
+
       // Allocate space to hold websocket payload
       data = mem;
       if (data_len > sizeof(mem) && (data = malloc(data_len)) == NULL) {
@@ -4650,6 +4814,7 @@ static void reset_per_request_attributes(struct mg_connection *conn) {
   conn->num_bytes_sent = conn->consumed_content = 0;
   conn->status_code = -1;
   conn->must_close = conn->request_len = conn->throttle = 0;
+  conn->websocket_extensions[0] = '\0';
 }
 
 static void close_socket_gracefully(struct mg_connection *conn) {
@@ -4869,13 +5034,41 @@ static void process_new_connection(struct mg_connection *conn) {
 
 // Worker threads take accepted socket from the queue
 static int consume_socket(struct mg_context *ctx, struct socket *sp) {
+  int retire = 0;
+#if !defined(_WIN32)
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += IDLE_THREAD_TIMEOUT;
+#endif
+
   (void) pthread_mutex_lock(&ctx->mutex);
   DEBUG_TRACE(("going idle"));
 
-  // If the queue is empty, wait. We're idle at this point.
+  // If the queue is empty, wait. We're idle at this point. Threads beyond
+  // num_threads, started to serve a burst, exit once they have been idle
+  // for IDLE_THREAD_TIMEOUT seconds
+  ctx->num_idle++;
   while (ctx->sq_head == ctx->sq_tail && ctx->stop_flag == 0) {
+#if !defined(_WIN32)
+    if (ctx->num_threads > ctx->base_threads) {
+      if (pthread_cond_timedwait(&ctx->sq_full, &ctx->mutex, &deadline)
+          == ETIMEDOUT && ctx->sq_head == ctx->sq_tail &&
+          ctx->num_threads > ctx->base_threads) {
+        retire = 1;
+        break;
+      }
+      continue;
+    }
+#endif
     pthread_cond_wait(&ctx->sq_full, &ctx->mutex);
   }
+  ctx->num_idle--;
+
+  if (retire) {
+    DEBUG_TRACE(("retiring idle thread"));
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    return 0;
+  }
 
   // If we're stopping, sq_head may be equal to sq_tail.
   if (ctx->sq_head > ctx->sq_tail) {
@@ -4966,6 +5159,17 @@ static void produce_socket(struct mg_context *ctx, const struct socket *sp) {
     DEBUG_TRACE(("queued socket %d", sp->sock));
   }
 
+  // If there are more sockets waiting than idle threads to pick them up,
+  // grow the pool, up to max_threads
+  if (ctx->stop_flag == 0 && ctx->num_threads < ctx->max_threads &&
+      ctx->sq_head - ctx->sq_tail > ctx->num_idle) {
+    if (mg_start_thread(worker_thread, ctx) != 0) {
+      cry(fc(ctx), "Cannot start worker thread: %ld", (long) ERRNO);
+    } else {
+      ctx->num_threads++;
+    }
+  }
+
   (void) pthread_cond_signal(&ctx->sq_full);
   (void) pthread_mutex_unlock(&ctx->mutex);
 }
@@ -5197,8 +5401,13 @@ struct mg_context *mg_start(const struct mg_callbacks *callbacks,
   // Start master (listening) thread
   mg_start_thread(master_thread, ctx);
 
-  // Start worker threads
-  for (i = 0; i < atoi(ctx->config[NUM_THREADS]); i++) {
+  // Start worker threads. More are started as needed, up to max_threads
+  ctx->base_threads = atoi(ctx->config[NUM_THREADS]);
+  ctx->max_threads = atoi(ctx->config[MAX_THREADS]);
+  if (ctx->max_threads < ctx->base_threads) {
+    ctx->max_threads = ctx->base_threads;
+  }
+  for (i = 0; i < ctx->base_threads; i++) {
     if (mg_start_thread(worker_thread, ctx) != 0) {
       cry(fc(ctx), "Cannot start worker thread: %ld", (long) ERRNO);
     } else {
@@ -0,0 +1,157 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "multi_match.hpp"
+
+#include <algorithm>
+#include <deque>
+
+namespace libtorrent
+{
+	namespace
+	{
+		struct compare_edge
+		{
+			bool operator()(std::pair<char, int> const& lhs, char rhs) const
+			{ return lhs.first < rhs; }
+		};
+	}
+
+	multi_match::multi_match()
+		: m_nodes(1)
+		, m_num_patterns(0)
+	{}
+
+	int multi_match::child(int n, char c) const
+	{
+		std::vector<std::pair<char, int> > const& edges = m_nodes[n].edges;
+		std::vector<std::pair<char, int> >::const_iterator i
+			= std::lower_bound(edges.begin(), edges.end(), c, compare_edge());
+		if (i == edges.end() || i->first != c) return -1;
+		return i->second;
+	}
+
+	int multi_match::add(std::string const& pattern)
+	{
+		int n = 0;
+		for (std::string::const_iterator c = pattern.begin(), end(pattern.end());
+			c != end; ++c)
+		{
+			int next = child(n, *c);
+			if (next < 0)
+			{
+				next = m_nodes.size();
+				std::vector<std::pair<char, int> >& edges = m_nodes[n].edges;
+				edges.insert(std::lower_bound(edges.begin(), edges.end(), *c, compare_edge())
+					, std::make_pair(*c, next));
+				// this may reallocate, invalidating edges
+				m_nodes.push_back(node());
+			}
+			n = next;
+		}
+
+		if (m_nodes[n].pattern < 0) m_nodes[n].pattern = m_num_patterns++;
+		return m_nodes[n].pattern;
+	}
+
+	void multi_match::compile()
+	{
+		// visit the nodes breadth first, so that the failure link of a
+		// node's parent is always complete before the node itself
+		std::deque<int> queue;
+		for (std::vector<std::pair<char, int> >::const_iterator i = m_nodes[0].edges.begin()
+			, end(m_nodes[0].edges.end()); i != end; ++i)
+		{
+			m_nodes[i->second].fail = 0;
+			m_nodes[i->second].output = 0;
+			queue.push_back(i->second);
+		}
+
+		while (!queue.empty())
+		{
+			int const n = queue.front();
+			queue.pop_front();
+
+			for (std::vector<std::pair<char, int> >::const_iterator i = m_nodes[n].edges.begin()
+				, end(m_nodes[n].edges.end()); i != end; ++i)
+			{
+				int f = m_nodes[n].fail;
+				int next = child(f, i->first);
+				while (next < 0 && f != 0)
+				{
+					f = m_nodes[f].fail;
+					next = child(f, i->first);
+				}
+				node& c = m_nodes[i->second];
+				c.fail = next < 0 ? 0 : next;
+				c.output = m_nodes[c.fail].pattern >= 0 ? c.fail : m_nodes[c.fail].output;
+				queue.push_back(i->second);
+			}
+		}
+	}
+
+	void multi_match::find(std::string const& text, std::vector<bool>& found) const
+	{
+		found.assign(m_num_patterns, false);
+		if (m_num_patterns == 0) return;
+
+		int n = 0;
+		for (std::string::const_iterator c = text.begin(), end(text.end());
+			c != end; ++c)
+		{
+			int next = child(n, *c);
+			while (next < 0 && n != 0)
+			{
+				n = m_nodes[n].fail;
+				next = child(n, *c);
+			}
+			n = next < 0 ? 0 : next;
+
+			// report every pattern ending here. If one of them has been
+			// seen already, so has the rest of its output chain
+			for (int o = m_nodes[n].pattern >= 0 ? n : m_nodes[n].output;
+				o != 0; o = m_nodes[o].output)
+			{
+				if (found[m_nodes[o].pattern]) break;
+				found[m_nodes[o].pattern] = true;
+			}
+		}
+	}
+
+	void multi_match::clear()
+	{
+		m_nodes.clear();
+		m_nodes.resize(1);
+		m_num_patterns = 0;
+	}
+}
+
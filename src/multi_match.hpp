@@ -0,0 +1,100 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_MULTI_MATCH_HPP
+#define TORRENT_MULTI_MATCH_HPP
+
+#include <string>
+#include <vector>
+#include <utility>
+
+namespace libtorrent
+{
+	/**
+		A set of substrings to search for, all at once. The patterns are
+		compiled into an Aho-Corasick automaton, which finds every pattern
+		occurring in a text in a single pass over it, regardless of the
+		number of patterns. Matching is byte-wise and case sensitive.
+	*/
+	struct multi_match
+	{
+		multi_match();
+
+		/// adds a pattern to search for and returns its index. Adding the
+		/// same pattern twice returns the same index. The pattern may not
+		/// be empty. compile() must be called before find() is.
+		int add(std::string const& pattern);
+
+		/// builds the failure links of the automaton, after patterns have
+		/// been added.
+		void compile();
+
+		/// sets found[i] for every pattern i occurring in text, and clears
+		/// the others. found is resized to the number of patterns.
+		void find(std::string const& text, std::vector<bool>& found) const;
+
+		/// removes all patterns
+		void clear();
+
+		int num_patterns() const { return m_num_patterns; }
+
+	private:
+
+		struct node
+		{
+			node() : fail(0), output(0), pattern(-1) {}
+
+			// the outgoing edges, sorted by character
+			std::vector<std::pair<char, int> > edges;
+
+			// the node for the longest proper suffix of this node's string
+			// that is also in the trie
+			int fail;
+
+			// the nearest node along the failure links that ends a pattern,
+			// or 0 if there is none
+			int output;
+
+			// the pattern ending at this node, or -1
+			int pattern;
+		};
+
+		int child(int n, char c) const;
+
+		// m_nodes[0] is the root
+		std::vector<node> m_nodes;
+		int m_num_patterns;
+	};
+}
+
+#endif
+
@@ -0,0 +1,166 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "multipart.hpp"
+
+#include <algorithm>
+#include <string.h>
+
+namespace libtorrent
+{
+	multipart_parser::multipart_parser(std::string const& boundary, handler& h)
+		: m_delimiter("\r\n--" + boundary)
+		// the first delimiter doesn't have to be preceded by a line break.
+		// Pretend there was one
+		, m_buf("\r\n")
+		, m_header_size(0)
+		, m_handler(h)
+		, m_state(preamble)
+	{}
+
+	bool multipart_parser::incoming(char const* buf, int len)
+	{
+		if (m_state == failed) return false;
+		if (m_state == epilogue) return true;
+
+		m_buf.append(buf, len);
+		std::size_t pos = 0;
+
+		for (;;)
+		{
+			if (m_state == preamble || m_state == body)
+			{
+				std::size_t const d = m_buf.find(m_delimiter, pos);
+				if (d == std::string::npos)
+				{
+					// the end of the buffer may be the start of a delimiter,
+					// everything before that is body (or preamble)
+					std::size_t const keep = (std::min)(m_buf.size() - pos
+						, m_delimiter.size() - 1);
+					std::size_t const end = m_buf.size() - keep;
+					if (m_state == body && end > pos
+						&& !m_handler.on_data(&m_buf[pos], end - pos)) return fail();
+					pos = end;
+					break;
+				}
+
+				if (m_state == body)
+				{
+					if (d > pos && !m_handler.on_data(&m_buf[pos], d - pos)) return fail();
+					if (!m_handler.on_part_end()) return fail();
+				}
+				pos = d + m_delimiter.size();
+				m_state = delimiter;
+			}
+			else if (m_state == delimiter)
+			{
+				// "--" right after the boundary closes the body, otherwise
+				// the line ends (possibly after some white space) and the
+				// next part's headers follow
+				if (m_buf.size() - pos < 2) break;
+				if (m_buf.compare(pos, 2, "--") == 0)
+				{
+					m_state = epilogue;
+					m_buf.clear();
+					return true;
+				}
+				std::size_t const eol = m_buf.find("\r\n", pos);
+				if (eol == std::string::npos)
+				{
+					if (m_buf.size() - pos > 100) return fail();
+					break;
+				}
+				pos = eol + 2;
+				m_headers.clear();
+				m_header_size = 0;
+				m_state = headers;
+			}
+			else if (m_state == headers)
+			{
+				std::size_t const eol = m_buf.find("\r\n", pos);
+				if (eol == std::string::npos)
+				{
+					if (m_header_size + m_buf.size() - pos > max_header_size) return fail();
+					break;
+				}
+
+				m_header_size += eol - pos + 2;
+				if (m_header_size > max_header_size) return fail();
+
+				// an empty line ends the headers
+				if (eol == pos)
+				{
+					pos += 2;
+					m_state = body;
+					if (!m_handler.on_part(m_headers)) return fail();
+					continue;
+				}
+
+				std::size_t const colon = m_buf.find(':', pos);
+				if (colon == std::string::npos || colon > eol) return fail();
+
+				std::string name = m_buf.substr(pos, colon - pos);
+				std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+				std::size_t value = colon + 1;
+				while (value < eol && (m_buf[value] == ' ' || m_buf[value] == '\t')) ++value;
+				m_headers[name] = m_buf.substr(value, eol - value);
+				pos = eol + 2;
+			}
+			else
+			{
+				break;
+			}
+		}
+
+		m_buf.erase(0, pos);
+		return true;
+	}
+
+	std::string multipart_boundary(char const* content_type)
+	{
+		if (content_type == NULL) return std::string();
+		char const* boundary = strstr(content_type, "boundary=");
+		if (boundary == NULL) return std::string();
+		boundary += 9;
+
+		// the boundary may be quoted
+		if (*boundary == '"')
+		{
+			++boundary;
+			char const* end = strchr(boundary, '"');
+			if (end == NULL) return std::string();
+			return std::string(boundary, end);
+		}
+		return std::string(boundary, boundary + strcspn(boundary, "; \t"));
+	}
+}
+
@@ -0,0 +1,110 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_MULTIPART_HPP
+#define TORRENT_MULTIPART_HPP
+
+#include <string>
+#include <map>
+
+namespace libtorrent
+{
+	/**
+		An incremental parser for multipart bodies (like multipart/form-data).
+		The body is fed to it in chunks of any size, as it's read off the
+		connection, and the parts are passed on to a handler as they're found.
+		Only a delimiter's worth of data is buffered, never a whole part.
+	*/
+	struct multipart_parser
+	{
+		struct handler
+		{
+			/// a new part starts, with these headers. The header names are
+			/// lower case. Returning false aborts the parse
+			virtual bool on_part(std::map<std::string, std::string> const& headers) = 0;
+
+			/// the next bytes of the current part's body
+			virtual bool on_data(char const* buf, int len) = 0;
+
+			/// the current part's body is complete
+			virtual bool on_part_end() = 0;
+
+		protected:
+			~handler() {}
+		};
+
+		enum { max_header_size = 8192 };
+
+		multipart_parser(std::string const& boundary, handler& h);
+
+		/// parses the next len bytes of the body. Returns false if the
+		/// body is malformed or the handler aborted. Once that's happened,
+		/// all subsequent calls fail too
+		bool incoming(char const* buf, int len);
+
+		/// true once the closing delimiter has been seen
+		bool done() const { return m_state == epilogue; }
+
+	private:
+
+		enum state_t
+		{
+			preamble,
+			delimiter,
+			headers,
+			body,
+			epilogue,
+			failed
+		};
+
+		bool fail() { m_state = failed; return false; }
+
+		// "\r\n--" and the boundary
+		std::string const m_delimiter;
+
+		// the bytes received that couldn't be parsed yet
+		std::string m_buf;
+
+		std::map<std::string, std::string> m_headers;
+		int m_header_size;
+
+		handler& m_handler;
+		state_t m_state;
+	};
+
+	/// returns the boundary parameter of a multipart content type, or an
+	/// empty string if there is none
+	std::string multipart_boundary(char const* content_type);
+}
+
+#endif
+
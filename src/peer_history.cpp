@@ -0,0 +1,321 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "peer_history.hpp"
+#include "alert_handler.hpp"
+#include "libtorrent/alert_types.hpp"
+#include "libtorrent/peer_info.hpp"
+#include <algorithm>
+
+namespace libtorrent
+{
+	namespace
+	{
+		bool compare_endpoint(peer_history_peer const& lhs, peer_history_peer const& rhs)
+		{ return lhs.ip < rhs.ip; }
+
+		bool same_endpoint(peer_history_peer const& lhs, peer_history_peer const& rhs)
+		{ return lhs.ip == rhs.ip; }
+	}
+
+	peer_state::peer_state()
+		: flags(0)
+		, source(0)
+		, num_pieces(0)
+		, down_speed(0)
+		, up_speed(0)
+		, download_queue_length(0)
+		, upload_queue_length(0)
+		, total_download(0)
+		, total_upload(0)
+		, num_hashfails(0)
+		, send_buffer_size(0)
+		, last_request(0)
+		, last_active(0)
+	{}
+
+	peer_state::peer_state(peer_info const& pi)
+		: flags(pi.flags)
+		, source(pi.source)
+		, client(pi.client)
+		, num_pieces(pi.num_pieces)
+		, down_speed(pi.down_speed)
+		, up_speed(pi.up_speed)
+		, download_queue_length(pi.download_queue_length)
+		, upload_queue_length(pi.upload_queue_length)
+		, total_download(pi.total_download)
+		, total_upload(pi.total_upload)
+		, num_hashfails(pi.num_hashfails)
+		, send_buffer_size(pi.send_buffer_size)
+		, last_request(total_seconds(pi.last_request))
+		, last_active(total_seconds(pi.last_active))
+	{}
+
+#define CMP_SET(x) \
+	if (s.x != state.x) { state.x = s.x; frame[x] = f; changed = true; }
+
+	bool peer_history_peer::update(peer_state const& s, int f)
+	{
+		bool changed = false;
+		CMP_SET(flags);
+		CMP_SET(source);
+		CMP_SET(client);
+		CMP_SET(num_pieces);
+		CMP_SET(down_speed);
+		CMP_SET(up_speed);
+		CMP_SET(download_queue_length);
+		CMP_SET(upload_queue_length);
+		CMP_SET(total_download);
+		CMP_SET(total_upload);
+		CMP_SET(num_hashfails);
+		CMP_SET(send_buffer_size);
+		CMP_SET(last_request);
+		CMP_SET(last_active);
+		return changed;
+	}
+
+#undef CMP_SET
+
+	int peer_history_peer::last_frame() const
+	{
+		return *std::max_element(frame, frame + num_fields);
+	}
+
+	bool peer_history_entry::updates_since(int since
+		, std::vector<peer_history_peer const*>& changed
+		, std::vector<tcp::endpoint>& gone) const
+	{
+		bool const full = since <= 0 || since < horizon;
+		for (std::vector<peer_history_peer>::const_iterator i = peers.begin()
+			, end(peers.end()); i != end; ++i)
+		{
+			if (full || i->last_frame() > since) changed.push_back(&*i);
+		}
+		if (full) return false;
+
+		// removed is in frame order, the ones since the frame are at the end
+		std::vector<std::pair<int, tcp::endpoint> >::const_iterator i = removed.end();
+		while (i != removed.begin() && (i - 1)->first > since) --i;
+		for (; i != removed.end(); ++i) gone.push_back(i->second);
+		return true;
+	}
+
+	peer_history::peer_history(alert_handler* h)
+		: m_alerts(h)
+		, m_frame(0)
+		, m_quit(false)
+	{
+		m_alerts->subscribe(this, 0
+			, torrent_removed_alert::alert_type
+			, 0);
+		m_thread = std::thread(&peer_history::refresh_thread, this);
+	}
+
+	peer_history::~peer_history()
+	{
+		m_alerts->unsubscribe(this);
+
+		std::unique_lock<std::mutex> l(m_mutex);
+		m_quit = true;
+		m_cond.notify_all();
+		l.unlock();
+		m_thread.join();
+	}
+
+	int peer_history::frame() const
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		return m_frame;
+	}
+
+	peer_entry_ptr peer_history::get_peers(torrent_handle const& h)
+	{
+		if (!h.is_valid()) return peer_entry_ptr();
+		sha1_hash const ih = h.info_hash();
+
+		{
+			std::unique_lock<std::mutex> l(m_mutex);
+			watched_torrent& t = m_torrents[ih];
+			t.last_request = clock_type::now();
+			if (t.entry) return t.entry;
+			t.handle = h;
+		}
+
+		// this is the first time anyone asks for this torrent. There's no
+		// previous copy to return
+		return refresh(ih, h);
+	}
+
+	peer_entry_ptr read_peers(torrent_handle const& h)
+	{
+		std::shared_ptr<peer_history_entry> ret = std::make_shared<peer_history_entry>();
+		ret->frame = 1;
+		ret->horizon = 0;
+		if (!h.is_valid()) return ret;
+
+		std::vector<peer_info> info;
+		h.get_peer_info(info);
+
+		std::vector<peer_history_peer>& peers = ret->peers;
+		peers.resize(info.size());
+		for (int i = 0; i < int(info.size()); ++i)
+		{
+			peers[i].ip = info[i].ip;
+			peers[i].state = peer_state(info[i]);
+			std::fill(peers[i].frame, peers[i].frame + peer_history_peer::num_fields, 1);
+		}
+		std::sort(peers.begin(), peers.end(), &compare_endpoint);
+		peers.erase(std::unique(peers.begin(), peers.end(), &same_endpoint)
+			, peers.end());
+		return ret;
+	}
+
+	peer_entry_ptr peer_history::refresh(sha1_hash const& ih, torrent_handle const& h)
+	{
+		peer_entry_ptr const current = read_peers(h);
+
+		std::unique_lock<std::mutex> l(m_mutex);
+
+		// the torrent may have been removed, or stopped being watched, while
+		// we were reading its peers
+		std::map<sha1_hash, watched_torrent>::iterator t = m_torrents.find(ih);
+		if (t == m_torrents.end()) return peer_entry_ptr();
+
+		peer_entry_ptr const cur = t->second.entry;
+		int const frame = m_frame + 1;
+		bool changed = !cur;
+
+		std::shared_ptr<peer_history_entry> ne = std::make_shared<peer_history_entry>();
+		ne->horizon = cur ? cur->horizon : 0;
+		if (cur) ne->removed = cur->removed;
+		ne->peers.reserve(current->peers.size());
+
+		// both lists are sorted by endpoint. Walk them side by side
+		std::vector<peer_history_peer>::const_iterator o;
+		std::vector<peer_history_peer>::const_iterator o_end;
+		if (cur)
+		{
+			o = cur->peers.begin();
+			o_end = cur->peers.end();
+		}
+		for (std::vector<peer_history_peer>::const_iterator i = current->peers.begin()
+			, end(current->peers.end()); i != end; ++i)
+		{
+			for (; cur && o != o_end && o->ip < i->ip; ++o)
+			{
+				ne->removed.push_back(std::make_pair(frame, o->ip));
+				changed = true;
+			}
+
+			if (cur && o != o_end && o->ip == i->ip)
+			{
+				ne->peers.push_back(*o);
+				if (ne->peers.back().update(i->state, frame)) changed = true;
+				++o;
+				continue;
+			}
+
+			ne->peers.push_back(*i);
+			peer_history_peer& p = ne->peers.back();
+			std::fill(p.frame, p.frame + peer_history_peer::num_fields, frame);
+			changed = true;
+		}
+		for (; cur && o != o_end; ++o)
+		{
+			ne->removed.push_back(std::make_pair(frame, o->ip));
+			changed = true;
+		}
+
+		if (!changed) return cur;
+
+		if (ne->removed.size() > max_removed)
+		{
+			int const drop = ne->removed.size() - max_removed;
+			ne->horizon = ne->removed[drop - 1].first;
+			ne->removed.erase(ne->removed.begin(), ne->removed.begin() + drop);
+		}
+
+		m_frame = frame;
+		ne->frame = frame;
+		t->second.entry = ne;
+		return ne;
+	}
+
+	void peer_history::refresh_thread()
+	{
+		std::vector<std::pair<sha1_hash, torrent_handle> > watched;
+
+		std::unique_lock<std::mutex> l(m_mutex);
+		while (!m_quit)
+		{
+			std::chrono::steady_clock::time_point const deadline
+				= std::chrono::steady_clock::now()
+				+ std::chrono::milliseconds(refresh_interval_ms);
+			while (!m_quit && m_cond.wait_until(l, deadline) != std::cv_status::timeout);
+			if (m_quit) break;
+
+			// stop watching the torrents nobody has asked about in a while
+			time_point const now = clock_type::now();
+			watched.clear();
+			for (std::map<sha1_hash, watched_torrent>::iterator i = m_torrents.begin();
+				i != m_torrents.end();)
+			{
+				if (now - i->second.last_request > seconds(watch_timeout))
+				{
+					m_torrents.erase(i++);
+					continue;
+				}
+				watched.push_back(std::make_pair(i->first, i->second.handle));
+				++i;
+			}
+			l.unlock();
+
+			for (std::vector<std::pair<sha1_hash, torrent_handle> >::iterator i = watched.begin()
+				, end(watched.end()); i != end; ++i)
+			{
+				refresh(i->first, i->second);
+			}
+
+			l.lock();
+		}
+	}
+
+	void peer_history::handle_alert(alert const* a)
+	{
+		if (torrent_removed_alert const* ta = alert_cast<torrent_removed_alert>(a))
+		{
+			std::unique_lock<std::mutex> l(m_mutex);
+			m_torrents.erase(ta->info_hash);
+		}
+	}
+}
+
@@ -0,0 +1,208 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_PEER_HISTORY_HPP
+#define TORRENT_PEER_HISTORY_HPP
+
+#include "alert_observer.hpp"
+#include "libtorrent/sha1_hash.hpp"
+#include "libtorrent/socket.hpp"
+#include "libtorrent/torrent_handle.hpp"
+#include "libtorrent/time.hpp"
+#include <condition_variable>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <string>
+#include <map>
+#include <cstdint>
+
+namespace libtorrent
+{
+	struct alert_handler;
+	struct peer_info;
+
+	// the fields of a peer_info that are sent to clients
+	struct peer_state
+	{
+		peer_state();
+		explicit peer_state(peer_info const& pi);
+
+		std::uint32_t flags;
+		int source;
+		std::string client;
+		int num_pieces;
+		int down_speed;
+		int up_speed;
+		int download_queue_length;
+		int upload_queue_length;
+		std::int64_t total_download;
+		std::int64_t total_upload;
+		int num_hashfails;
+		int send_buffer_size;
+
+		// seconds
+		int last_request;
+		int last_active;
+	};
+
+	// a peer of a torrent, along with the frame numbers each of its fields
+	// was last changed in, like torrent_history_entry
+	struct peer_history_peer
+	{
+		tcp::endpoint ip;
+		peer_state state;
+
+		// updates the state and stamps the fields that changed with the
+		// specified frame. Returns false if nothing changed
+		bool update(peer_state const& s, int frame);
+
+		// in the order of the field bitmask in get-peer-updates
+		enum
+		{
+			flags,
+			source,
+			client,
+			num_pieces,
+			down_speed,
+			up_speed,
+			download_queue_length,
+			upload_queue_length,
+			total_download,
+			total_upload,
+			num_hashfails,
+			send_buffer_size,
+			last_request,
+			last_active,
+
+			num_fields
+		};
+
+		int frame[num_fields];
+
+		// the frame of the most recent change to any field
+		int last_frame() const;
+	};
+
+	// the peers of a torrent. Entries are immutable once published, updates
+	// replace them with a new copy
+	struct peer_history_entry
+	{
+		// the frame this entry is up to date as of
+		int frame;
+
+		// the peers that were removed before this frame have been forgotten.
+		// Clients that last saw an earlier frame need the full list
+		int horizon;
+
+		// sorted by endpoint
+		std::vector<peer_history_peer> peers;
+
+		// the endpoints of the peers that were removed and the frame they
+		// were removed in, oldest first
+		std::vector<std::pair<int, tcp::endpoint> > removed;
+
+		// all peers changed since frame, and the endpoints removed since then.
+		// Returns false if frame is before the horizon, in which case the
+		// entire list is returned
+		bool updates_since(int frame, std::vector<peer_history_peer const*>& peers
+			, std::vector<tcp::endpoint>& removed) const;
+	};
+
+	typedef std::shared_ptr<peer_history_entry const> peer_entry_ptr;
+
+	// reads the peers of a torrent right away, without keeping them. All
+	// fields are stamped with frame 1
+	peer_entry_ptr read_peers(torrent_handle const& h);
+
+	// keeps the peer lists of the torrents clients are watching. A torrent is
+	// watched from the first time its peers are asked for, until nobody has
+	// asked for watch_timeout seconds. The lists of watched torrents are
+	// refreshed once a second, on a thread of the peer_history, so requests
+	// are answered from the last copy without waiting for the session
+	struct peer_history : alert_observer
+	{
+		explicit peer_history(alert_handler* h);
+		~peer_history();
+
+		// returns the peers of the specified torrent. The first time a
+		// torrent is asked for its peers are read right away, later calls
+		// return the most recent refresh. Returns an empty pointer if the
+		// torrent is invalid
+		peer_entry_ptr get_peers(torrent_handle const& h);
+
+		// the current frame number
+		int frame() const;
+
+		virtual void handle_alert(alert const* a);
+
+		enum
+		{
+			refresh_interval_ms = 1000,
+			watch_timeout = 30,
+
+			// the number of removed peers remembered per torrent
+			max_removed = 500
+		};
+
+	private:
+
+		struct watched_torrent
+		{
+			torrent_handle handle;
+			peer_entry_ptr entry;
+			time_point last_request;
+		};
+
+		// reads the peers of the torrent and publishes a new entry, with
+		// the changes since the current one
+		peer_entry_ptr refresh(sha1_hash const& ih, torrent_handle const& h);
+
+		void refresh_thread();
+
+		alert_handler* m_alerts;
+
+		mutable std::mutex m_mutex;
+		std::map<sha1_hash, watched_torrent> m_torrents;
+
+		// incremented every time a peer list changes
+		int m_frame;
+
+		std::condition_variable m_cond;
+		bool m_quit;
+		std::thread m_thread;
+	};
+}
+
+#endif
+
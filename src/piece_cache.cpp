@@ -0,0 +1,145 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "piece_cache.hpp"
+
+namespace libtorrent
+{
+	piece_cache::piece_cache(std::int64_t max_size)
+		: m_size(0)
+		, m_max_size(max_size)
+		, m_hits(0)
+		, m_misses(0)
+		, m_evictions(0)
+	{}
+
+	void piece_cache::insert(sha1_hash const& ih, int piece
+		, boost::shared_array<char> const& buffer, int size)
+	{
+		if (size <= 0 || !buffer) return;
+
+		key_t k;
+		k.info_hash = ih;
+		k.piece = piece;
+
+		std::unique_lock<std::mutex> l(m_mutex);
+		if (size > m_max_size) return;
+
+		index_t::iterator i = m_index.find(k);
+		if (i != m_index.end())
+		{
+			m_lru.splice(m_lru.begin(), m_lru, i->second);
+			return;
+		}
+
+		evict(m_max_size - size);
+
+		entry_t e;
+		e.key = k;
+		e.buffer = buffer;
+		e.size = size;
+		m_lru.push_front(e);
+		m_index.insert(std::make_pair(k, m_lru.begin()));
+		m_size += size;
+	}
+
+	bool piece_cache::find(sha1_hash const& ih, int piece
+		, boost::shared_array<char>& buffer, int& size)
+	{
+		key_t k;
+		k.info_hash = ih;
+		k.piece = piece;
+
+		std::unique_lock<std::mutex> l(m_mutex);
+		index_t::iterator i = m_index.find(k);
+		if (i == m_index.end())
+		{
+			++m_misses;
+			return false;
+		}
+
+		++m_hits;
+		m_lru.splice(m_lru.begin(), m_lru, i->second);
+		buffer = i->second->buffer;
+		size = i->second->size;
+		return true;
+	}
+
+	void piece_cache::evict_torrent(sha1_hash const& ih)
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		for (lru_t::iterator i = m_lru.begin(); i != m_lru.end();)
+		{
+			if (i->key.info_hash != ih)
+			{
+				++i;
+				continue;
+			}
+			m_size -= i->size;
+			m_index.erase(i->key);
+			i = m_lru.erase(i);
+		}
+	}
+
+	void piece_cache::set_max_size(std::int64_t max_size)
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		m_max_size = max_size;
+		evict(max_size);
+	}
+
+	void piece_cache::evict(std::int64_t max_size)
+	{
+		while (m_size > max_size && !m_lru.empty())
+		{
+			entry_t const& e = m_lru.back();
+			m_size -= e.size;
+			m_index.erase(e.key);
+			m_lru.pop_back();
+			++m_evictions;
+		}
+	}
+
+	piece_cache::stats_t piece_cache::stats() const
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		stats_t ret;
+		ret.size = m_size;
+		ret.max_size = m_max_size;
+		ret.num_pieces = int(m_lru.size());
+		ret.hits = m_hits;
+		ret.misses = m_misses;
+		ret.evictions = m_evictions;
+		return ret;
+	}
+}
+
@@ -0,0 +1,124 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_PIECE_CACHE_HPP
+#define TORRENT_PIECE_CACHE_HPP
+
+#include "libtorrent/peer_id.hpp" // for sha1_hash
+#include <boost/shared_array.hpp>
+#include <unordered_map>
+#include <list>
+#include <mutex>
+#include <cstdint>
+
+namespace libtorrent
+{
+	// a bounded cache of pieces read from torrents, shared by everyone
+	// streaming from them. The piece buffers are the ones handed out by
+	// read_piece_alert, they're reference counted, so entries are never
+	// copied in or out. The least recently used pieces are evicted first
+	struct piece_cache
+	{
+		piece_cache(std::int64_t max_size);
+
+		// adds the piece, evicting pieces to stay within the size limit. If the
+		// piece is already in the cache, it's marked as recently used
+		void insert(sha1_hash const& ih, int piece
+			, boost::shared_array<char> const& buffer, int size);
+
+		// returns true and fills in buffer and size if the piece is cached
+		bool find(sha1_hash const& ih, int piece
+			, boost::shared_array<char>& buffer, int& size);
+
+		// drops all pieces belonging to the torrent
+		void evict_torrent(sha1_hash const& ih);
+
+		void set_max_size(std::int64_t max_size);
+
+		struct stats_t
+		{
+			// the number of bytes of piece buffers held by the cache. Pieces
+			// that have been evicted may still be held by streams sending them
+			std::int64_t size;
+			std::int64_t max_size;
+			int num_pieces;
+			std::int64_t hits;
+			std::int64_t misses;
+			std::int64_t evictions;
+		};
+
+		stats_t stats() const;
+
+	private:
+
+		struct key_t
+		{
+			sha1_hash info_hash;
+			int piece;
+			bool operator==(key_t const& k) const
+			{ return piece == k.piece && info_hash == k.info_hash; }
+		};
+
+		struct key_hash
+		{
+			std::size_t operator()(key_t const& k) const
+			{ return hash_value(k.info_hash) ^ k.piece; }
+		};
+
+		struct entry_t
+		{
+			key_t key;
+			boost::shared_array<char> buffer;
+			int size;
+		};
+
+		// the caller must hold m_mutex
+		void evict(std::int64_t max_size);
+
+		mutable std::mutex m_mutex;
+
+		// most recently used first
+		typedef std::list<entry_t> lru_t;
+		lru_t m_lru;
+		typedef std::unordered_map<key_t, lru_t::iterator, key_hash> index_t;
+		index_t m_index;
+
+		std::int64_t m_size;
+		std::int64_t m_max_size;
+		std::int64_t m_hits;
+		std::int64_t m_misses;
+		std::int64_t m_evictions;
+	};
+}
+
+#endif
+
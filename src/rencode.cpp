@@ -34,6 +34,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/assert.hpp"
 #include "libtorrent/io.hpp"
 #include <stdlib.h>
+#include <string.h> // for memchr
+#include <algorithm> // for min
+#include <stdio.h> // for snprintf
 
 namespace libtorrent {
 
@@ -347,6 +350,169 @@ int decode_token(char const* buffer, char const*& cursor, rtok_t* tokens, int nu
 	return -1;
 }
 
+rdecoder::rdecoder(int max_tokens)
+	: m_max_tokens(max_tokens)
+	, m_pos(0)
+	, m_done(false)
+{}
+
+void rdecoder::reset()
+{
+	m_tokens.clear();
+	m_stack.clear();
+	m_pos = 0;
+	m_done = false;
+}
+
+void rdecoder::shrink(int max_kept)
+{
+	TORRENT_ASSERT(m_tokens.empty());
+	if (int(m_tokens.capacity()) > max_kept) std::vector<rtok_t>().swap(m_tokens);
+	if (int(m_stack.capacity()) > max_kept) std::vector<container>().swap(m_stack);
+}
+
+int rdecoder::token_size(char const* buffer, int len) const
+{
+	std::uint8_t const code = buffer[m_pos];
+	int const left = len - m_pos;
+
+	int size = 0;
+	if (code == CHR_INT)
+	{
+		// integers are limited to 64 bits, allow for a sign
+		char const* end = (char const*)memchr(buffer + m_pos + 1, CHR_TERM
+			, (std::min)(left - 1, 21));
+		if (end == NULL) return left - 1 >= 21 ? -1 : 0;
+		return end - buffer - m_pos + 1;
+	}
+	else if (code >= '0' && code <= '9')
+	{
+		// the length prefix is terminated by a colon
+		int i = 0;
+		std::int64_t str_len = 0;
+		for (; i < left && buffer[m_pos + i] != ':'; ++i)
+		{
+			char const c = buffer[m_pos + i];
+			if (c < '0' || c > '9' || i >= 9) return -1;
+			str_len = str_len * 10 + c - '0';
+		}
+		if (i == left) return 0;
+		size = i + 1 + str_len;
+	}
+	else if (code == CHR_INT1) size = 2;
+	else if (code == CHR_INT2) size = 3;
+	else if (code == CHR_INT4 || code == CHR_FLOAT32) size = 5;
+	else if (code == CHR_INT8 || code == CHR_FLOAT64) size = 9;
+	else if (code >= STR_FIXED_START && code < STR_FIXED_START + STR_FIXED_COUNT)
+		size = 1 + code - STR_FIXED_START;
+	else
+		size = 1;
+
+	return size > left ? 0 : size;
+}
+
+int rdecoder::item_done(renc_type_t type)
+{
+	while (!m_stack.empty())
+	{
+		container& c = m_stack.back();
+		rtok_t& parent = m_tokens[c.token];
+		if (parent.type() == type_dict)
+		{
+			// keys must be strings
+			if ((c.items & 1) == 0 && type != type_string) return -1;
+			if (c.items & 1)
+				++parent.m_num_items;
+		}
+		else
+		{
+			++parent.m_num_items;
+		}
+		++c.items;
+
+		// terminated containers are closed by their terminator, fixed-size
+		// ones once they're full. Closing one completes an item in its
+		// parent
+		if (c.remaining < 0 || c.items < c.remaining) return 0;
+		type = parent.type();
+		m_stack.pop_back();
+	}
+	m_done = true;
+	return 1;
+}
+
+int rdecoder::decode(char const* buffer, int len)
+{
+	reset();
+	return feed(buffer, len) == 1 ? num_tokens() : -1;
+}
+
+int rdecoder::feed(char const* buffer, int len)
+{
+	while (!m_done && m_pos < len)
+	{
+		std::uint8_t const code = buffer[m_pos];
+
+		if (code == CHR_TERM)
+		{
+			// terminators only end dicts and lists that aren't fixed-size,
+			// and not in between a key and its value
+			if (m_stack.empty()) return -1;
+			container const& c = m_stack.back();
+			if (c.remaining >= 0 || (c.items & 1 && m_tokens[c.token].type() == type_dict))
+				return -1;
+			renc_type_t const type = m_tokens[c.token].type();
+			m_stack.pop_back();
+			++m_pos;
+			if (m_stack.empty())
+			{
+				m_done = true;
+				return 1;
+			}
+			if (item_done(type) < 0) return -1;
+			continue;
+		}
+
+		int const size = token_size(buffer, len);
+		if (size < 0) return -1;
+		if (size == 0) return 0;
+
+		if (int(m_tokens.size()) >= m_max_tokens) return -1;
+		m_tokens.push_back(rtok_t());
+		rtok_t& t = m_tokens.back();
+		t.m_offset = m_pos;
+		t.m_typecode = code;
+		t.m_num_items = 0;
+		m_pos += size;
+
+		int remaining = 0;
+		if (code == CHR_DICT || code == CHR_LIST) remaining = -1;
+		else if (code >= DICT_FIXED_START && code < DICT_FIXED_START + DICT_FIXED_COUNT)
+			remaining = (code - DICT_FIXED_START) * 2;
+		else if (code >= LIST_FIXED_START && code < LIST_FIXED_START + LIST_FIXED_COUNT)
+			remaining = code - LIST_FIXED_START;
+		else
+		{
+			if (item_done(t.type()) < 0) return -1;
+			continue;
+		}
+
+		// an empty fixed-size container is complete right away
+		if (remaining == 0)
+		{
+			if (item_done(t.type()) < 0) return -1;
+			continue;
+		}
+
+		container c;
+		c.token = int(m_tokens.size()) - 1;
+		c.remaining = remaining;
+		c.items = 0;
+		m_stack.push_back(c);
+	}
+	return m_done ? 1 : 0;
+}
+
 // returns the number of tokens that were printed
 int print_rtok(rtok_t const* tokens, char const* buf)
 {
@@ -542,16 +708,38 @@ bool validate_structure(rtok_t const* tokens, char const* fmt)
 	return true;
 }
 
+char* rencoder::grow(int n)
+{
+	if (m_sink && !m_buffer.empty()
+		&& int(m_buffer.size()) + n > m_flush_threshold)
+	{
+		m_sink->write(&m_buffer[0], m_buffer.size(), false);
+		m_flushed += m_buffer.size();
+		m_buffer.clear();
+	}
+	std::size_t const pos = m_buffer.size();
+	m_buffer.resize(pos + n);
+	return &m_buffer[pos];
+}
+
+void rencoder::finish()
+{
+	if (m_sink == NULL) return;
+	m_sink->write(data(), m_buffer.size(), true);
+	m_flushed += m_buffer.size();
+	m_buffer.clear();
+}
+
 bool rencoder::append_list(int size)
 {
 	if (size < 0 || size > LIST_FIXED_COUNT)
 	{
-		m_buffer.push_back(CHR_LIST);
+		*grow(1) = CHR_LIST;
 		return true;
 	}
 	else
 	{
-		m_buffer.push_back(LIST_FIXED_START + size);
+		*grow(1) = LIST_FIXED_START + size;
 		return false;
 	}
 }
@@ -560,62 +748,56 @@ bool rencoder::append_dict(int size)
 {
 	if (size < 0 || size > DICT_FIXED_COUNT)
 	{
-		m_buffer.push_back(CHR_DICT);
+		*grow(1) = CHR_DICT;
 		return true;
 	}
 	else
 	{
-		m_buffer.push_back(DICT_FIXED_START + size);
+		*grow(1) = DICT_FIXED_START + size;
 		return false;
 	}
 }
 
 void rencoder::append_int(std::int64_t i)
 {
+	namespace io = libtorrent::detail;
+
 	if (i >= 0 && i < INT_POS_FIXED_COUNT)
 	{
-		m_buffer.push_back(INT_POS_FIXED_START + i);
+		*grow(1) = INT_POS_FIXED_START + i;
 	}
 	else if (i < 0 && i > -INT_NEG_FIXED_COUNT)
 	{
-		m_buffer.push_back(INT_NEG_FIXED_START - i - 1);
+		*grow(1) = INT_NEG_FIXED_START - i - 1;
 	}
 	else if (i < 0x80 && i >= -0x7f)
 	{
-		m_buffer.push_back(CHR_INT1);
-		m_buffer.push_back(i);
+		char* ptr = grow(2);
+		*ptr++ = CHR_INT1;
+		io::write_int8(i, ptr);
 	}
 	else if (i < 0x8000 && i >= -0x7fff)
 	{
-		m_buffer.push_back(CHR_INT2);
-		m_buffer.push_back(i >> 8);
-		m_buffer.push_back(i & 0xff);
+		char* ptr = grow(3);
+		*ptr++ = CHR_INT2;
+		io::write_int16(i, ptr);
 	}
 	else if (i < 0x80000000 && i >= -0x7fffffff)
 	{
-		m_buffer.push_back(CHR_INT4);
-		m_buffer.push_back((i >> 24) & 0xff);
-		m_buffer.push_back((i >> 16) & 0xff);
-		m_buffer.push_back((i >> 8) & 0xff);
-		m_buffer.push_back((i >> 0) & 0xff);
+		char* ptr = grow(5);
+		*ptr++ = CHR_INT4;
+		io::write_int32(i, ptr);
 	}
 	else // if (i < 0x8000000000000000LL && i >= -0x7fffffffffffffffLL)
 	{
-		m_buffer.push_back(CHR_INT8);
-		m_buffer.push_back((i >> 56) & 0xff);
-		m_buffer.push_back((i >> 48) & 0xff);
-		m_buffer.push_back((i >> 40) & 0xff);
-		m_buffer.push_back((i >> 32) & 0xff);
-		m_buffer.push_back((i >> 24) & 0xff);
-		m_buffer.push_back((i >> 16) & 0xff);
-		m_buffer.push_back((i >> 8) & 0xff);
-		m_buffer.push_back((i >> 0) & 0xff);
+		char* ptr = grow(9);
+		*ptr++ = CHR_INT8;
+		io::write_int64(i, ptr);
 	}
 }
 
 void rencoder::append_float(float f)
 {
-	m_buffer.push_back(CHR_FLOAT32);
 	union
 	{
 		float in;
@@ -623,41 +805,52 @@ void rencoder::append_float(float f)
 	};
 
 	in = f;
-	m_buffer.push_back((out >> 24) & 0xff);
-	m_buffer.push_back((out >> 16) & 0xff);
-	m_buffer.push_back((out >> 8) & 0xff);
-	m_buffer.push_back((out >> 0) & 0xff);
+	namespace io = libtorrent::detail;
+	char* ptr = grow(5);
+	*ptr++ = CHR_FLOAT32;
+	io::write_uint32(out, ptr);
 }
 
 void rencoder::append_none()
 {
-	m_buffer.push_back(CHR_NONE);
+	*grow(1) = CHR_NONE;
 }
 
 void rencoder::append_bool(bool b)
 {
-	m_buffer.push_back(b ? CHR_TRUE : CHR_FALSE);
+	*grow(1) = b ? CHR_TRUE : CHR_FALSE;
 }
 
-void rencoder::append_string(std::string const& s)
+void rencoder::append_string(char const* s, int len)
 {
-	if (s.size() < STR_FIXED_COUNT)
+	if (len < STR_FIXED_COUNT)
 	{
-		m_buffer.push_back(STR_FIXED_START + s.size());
-		m_buffer.insert(m_buffer.end(), s.begin(), s.end());
+		char* ptr = grow(1 + len);
+		*ptr++ = STR_FIXED_START + len;
+		memcpy(ptr, s, len);
+		return;
 	}
-	else
+
+	char header[12];
+	int const header_len = snprintf(header, sizeof(header), "%d:", len);
+	memcpy(grow(header_len), header, header_len);
+
+	// big strings are passed straight on to the sink, rather than being
+	// copied into the buffer first
+	if (m_sink && len >= m_flush_threshold)
 	{
-		char buf[10];
-		int len = snprintf(buf, sizeof(buf), "%d:", int(s.size()));
-		m_buffer.insert(m_buffer.end(), buf, buf + len);
-		m_buffer.insert(m_buffer.end(), s.begin(), s.end());
+		m_sink->write(&m_buffer[0], m_buffer.size(), false);
+		m_sink->write(s, len, false);
+		m_flushed += m_buffer.size() + len;
+		m_buffer.clear();
+		return;
 	}
+	memcpy(grow(len), s, len);
 }
 
 void rencoder::append_term()
 {
-	m_buffer.push_back(CHR_TERM);
+	*grow(1) = CHR_TERM;
 }
 
 }
@@ -36,6 +36,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <boost/cstdint.hpp>
 #include <string>
 #include <vector>
+#include <string.h> // for strlen
 
 namespace libtorrent {
 
@@ -54,6 +55,7 @@ struct rtok_t
 {
 	friend int rdecode(rtok_t* tokens, int num_tokens, char const* buffer, int len);
 	friend int decode_token(char const* buffer, char const*& cursor, rtok_t* tokens, int num_tokens);
+	friend struct rdecoder;
 
 	renc_type_t type() const;
 	// parse out the value of an integer
@@ -65,14 +67,82 @@ struct rtok_t
 	int num_items() const { return m_num_items; }
 private:
 	int m_offset;
-	std::uint8_t m_typecode;
 	// for dicts, this is the number of key-value pairs
 	// for lists, this is the number of elements
-	std::uint16_t m_num_items;
+	std::uint32_t m_num_items;
+	std::uint8_t m_typecode;
 };
 
 int rdecode(rtok_t* tokens, int num_tokens, char const* buffer, int len);
 
+// an incremental rencode tokenizer. It's fed a buffer as it grows, and picks
+// up where it left off the previous call. Tokens are produced as soon as
+// they are complete, so malformed input is rejected as early as possible,
+// and nothing is ever read past the end of the buffer
+struct rdecoder
+{
+	// max_tokens bounds the memory used by the token pool. A 1 MB
+	// get_torrents_status response is about 150k tokens
+	rdecoder(int max_tokens = 1024 * 1024);
+
+	// buffer must start with the bytes passed in to previous calls (since
+	// the last reset()), the tokens refer to offsets into it. Returns 1 once
+	// a complete item has been decoded, 0 if more bytes are needed and -1
+	// if the input is invalid or needs more than max_tokens tokens. Bytes
+	// past the end of a complete item are ignored
+	int feed(char const* buffer, int len);
+
+	// decodes a complete message in one go. Returns the number of tokens,
+	// or -1 if the buffer doesn't hold a complete, valid item. The token
+	// pool is kept from one message to the next, so decoding messages of
+	// similar sizes doesn't allocate
+	int decode(char const* buffer, int len);
+
+	// the tokens of the item. Only complete once feed() returns 1
+	rtok_t const* tokens() const { return m_tokens.empty() ? NULL : &m_tokens[0]; }
+	int num_tokens() const { return int(m_tokens.size()); }
+
+	// the number of bytes the item takes up
+	int size() const { return m_pos; }
+
+	// starts over with a new message. The token pool keeps its capacity
+	void reset();
+
+	// releases the token pool if it has room for more than max_kept
+	// tokens, for one large message to not hold on to its memory for good.
+	// Only valid right after reset()
+	void shrink(int max_kept);
+
+private:
+
+	// returns the size of the token starting at m_pos, 0 if it isn't
+	// complete yet or -1 if it's invalid
+	int token_size(char const* buffer, int len) const;
+
+	// records that an item has been completed
+	int item_done(renc_type_t type);
+
+	struct container
+	{
+		// the index of the container's token
+		int token;
+		// the number of items left in fixed-size containers, counting keys
+		// and values separately. -1 for containers that end with a
+		// terminator
+		int remaining;
+		// the number of items decoded so far, counting keys and values
+		// separately
+		int items;
+	};
+
+	std::vector<rtok_t> m_tokens;
+	std::vector<container> m_stack;
+	int m_max_tokens;
+	// the offset of the next byte to parse
+	int m_pos;
+	bool m_done;
+};
+
 int print_rtok(rtok_t const* tokens, char const* buf);
 
 rtok_t* skip_item(rtok_t* i);
@@ -87,21 +157,64 @@ bool validate_structure(rtok_t const* tokens, char const* fmt);
 
 struct rencoder
 {
+	// receives the encoded bytes of a streaming rencoder
+	struct sink
+	{
+		// finish is set on the last write of each message
+		virtual void write(char const* buf, int len, bool finish) = 0;
+	protected:
+		~sink() {}
+	};
+
+	rencoder(): m_sink(NULL), m_flush_threshold(0), m_flushed(0) {}
+
+	// a streaming rencoder passes the encoded bytes on to the sink as soon as
+	// more than flush_threshold bytes are buffered, and strings that big
+	// are passed on without being copied. Only a single buffer of
+	// flush_threshold bytes is kept, however big the message gets
+	explicit rencoder(sink* s, int flush_threshold = 16 * 1024)
+		: m_sink(s), m_flush_threshold(flush_threshold), m_flushed(0) {}
+
 	bool append_list(int size = -1);
 	bool append_dict(int size = -1);
 	void append_int(std::int64_t i);
 	void append_float(float f);
 	void append_none();
 	void append_bool(bool b);
-	void append_string(std::string const& s);
+	void append_string(char const* s, int len);
+	void append_string(char const* s) { append_string(s, int(strlen(s))); }
+	void append_string(std::string const& s) { append_string(s.data(), int(s.size())); }
 	void append_term();
 
-	char const* data() const { return &m_buffer[0]; }
+	// makes room for another size bytes up-front, to avoid growing the
+	// buffer bit by bit for big messages
+	void reserve(int size) { m_buffer.reserve(m_buffer.size() + size); }
+
+	// passes everything appended so far on to the sink, as the end of the
+	// message. This does nothing if there is no sink
+	void finish();
+
+	// for streaming rencoders, these only refer to the bytes that haven't
+	// been passed on to the sink yet
+	char const* data() const { return m_buffer.empty() ? NULL : &m_buffer[0]; }
 	int len() const { return m_buffer.size(); }
 
+	// the number of bytes encoded since construction, including the ones
+	// passed on to the sink
+	std::int64_t total_len() const { return m_flushed + m_buffer.size(); }
+
 	void clear() { m_buffer.clear(); }
 private:
+
+	// returns a pointer to n new bytes at the end of the buffer
+	char* grow(int n);
+
 	std::vector<char> m_buffer;
+	sink* m_sink;
+	int m_flush_threshold;
+
+	// the number of bytes passed on to the sink
+	std::int64_t m_flushed;
 };
 
 }
@@ -35,21 +35,42 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <vector>
 #include <stdarg.h>
+#include <stdio.h>
 
 namespace libtorrent
 {
+	// appends the printf-formatted string to target. The string is
+	// formatted straight into the buffer, only strings longer than
+	// appendf_reserve need a second pass. For building large responses
+	// field by field, prefer json_writer
+	enum { appendf_reserve = 512 };
+
 	inline void appendf(std::vector<char>& target, char const* fmt, ...)
 	{
-		char* buf;
+		std::size_t const size = target.size();
+		target.resize(size + appendf_reserve);
+
 		va_list args;
 		va_start(args, fmt);
-		int len = vasprintf(&buf, fmt, args);
+		int len = vsnprintf(&target[size], appendf_reserve, fmt, args);
 		va_end(args);
 
-		if (len < 0) return;
+		if (len < 0)
+		{
+			target.resize(size);
+			return;
+		}
+
+		if (len >= appendf_reserve)
+		{
+			// it didn't fit. Now we know how much space it needs
+			target.resize(size + len + 1);
+			va_start(args, fmt);
+			vsnprintf(&target[size], len + 1, fmt, args);
+			va_end(args);
+		}
 
-		target.insert(target.end(), buf, buf + len);
-		free(buf);
+		target.resize(size + len);
 	}
 }
 
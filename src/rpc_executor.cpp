@@ -0,0 +1,95 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+#include "rpc_executor.hpp"
+
+namespace libtorrent
+{
+	rpc_executor::rpc_executor(int num_threads)
+		: m_quit(false)
+	{
+		for (int i = 0; i < num_threads; ++i)
+			m_threads.push_back(std::thread(&rpc_executor::worker_thread, this));
+	}
+
+	rpc_executor::~rpc_executor()
+	{
+		{
+			std::unique_lock<std::mutex> l(m_mutex);
+			m_quit = true;
+			m_jobs.clear();
+		}
+		m_cond.notify_all();
+		for (std::vector<std::thread>::iterator i = m_threads.begin()
+			, end(m_threads.end()); i != end; ++i)
+		{
+			i->join();
+		}
+	}
+
+	void rpc_executor::post(std::function<void()> const& job)
+	{
+		{
+			std::unique_lock<std::mutex> l(m_mutex);
+			if (m_quit) return;
+			m_jobs.push_back(job);
+		}
+		m_cond.notify_one();
+	}
+
+	int rpc_executor::queued() const
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		return int(m_jobs.size());
+	}
+
+	void rpc_executor::worker_thread()
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		for (;;)
+		{
+			while (m_jobs.empty() && !m_quit) m_cond.wait(l);
+			if (m_quit) return;
+
+			std::function<void()> job;
+			job.swap(m_jobs.front());
+			m_jobs.pop_front();
+			l.unlock();
+
+			job();
+
+			// the job's captures are released before taking the lock again
+			job = std::function<void()>();
+			l.lock();
+		}
+	}
+}
+
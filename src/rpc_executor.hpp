@@ -0,0 +1,75 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+#ifndef TORRENT_RPC_EXECUTOR_HPP
+#define TORRENT_RPC_EXECUTOR_HPP
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+namespace libtorrent
+{
+	// runs the parts of RPC calls that block, like calls into the session
+	// that wait for its network thread, on threads of its own. Handlers
+	// post the blocking part here along with writing the response, and
+	// return, rather than holding on to a web server thread while waiting.
+	// Jobs are run in the order they're posted, but several at a time
+	struct rpc_executor
+	{
+		explicit rpc_executor(int num_threads = 2);
+
+		// jobs that haven't started yet are dropped
+		~rpc_executor();
+
+		// job is run on one of the executor's threads
+		void post(std::function<void()> const& job);
+
+		// the number of jobs posted but not started yet
+		int queued() const;
+
+	private:
+
+		void worker_thread();
+
+		mutable std::mutex m_mutex;
+		std::condition_variable m_cond;
+		std::deque<std::function<void()> > m_jobs;
+		bool m_quit;
+		std::vector<std::thread> m_threads;
+	};
+}
+
+#endif
+
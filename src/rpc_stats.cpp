@@ -0,0 +1,473 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "rpc_stats.hpp"
+#include "libtorrent/assert.hpp"
+
+extern "C" {
+#include "local_mongoose.h"
+}
+
+#include <mutex>
+#include <unordered_map>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+namespace libtorrent
+{
+	namespace
+	{
+		struct registered_metric
+		{
+			std::string name;
+			bool counter;
+			// the live source of this metric, or NULL if there is none
+			metric_source const* source;
+			// the index of the metric in the source
+			int index;
+		};
+
+		// every metric that has been registered, indexed by id. Entries are
+		// never removed, to not reuse ids
+		struct metric_registry
+		{
+			std::mutex mutex;
+			std::vector<registered_metric> metrics;
+			std::unordered_map<std::string, int> ids;
+		};
+
+		metric_registry& registry()
+		{
+			static metric_registry r;
+			return r;
+		}
+
+		// the innermost call in progress on this thread
+		thread_local rpc_stats::call* current_call = NULL;
+
+		enum { metrics_per_function = 9 };
+
+		struct metric_desc
+		{
+			char const* name;
+			bool counter;
+		};
+
+		metric_desc const metrics[metrics_per_function] =
+		{
+			{ "calls", true },
+			{ "errors", true },
+			{ "latency_us", true },
+			{ "latency_p50_us", false },
+			{ "latency_p99_us", false },
+			{ "latency_max_us", false },
+			{ "bytes", true },
+			{ "bytes_p99", false },
+			{ "wait_us", true },
+		};
+
+		std::uint64_t metric_value(rpc_stats::function_stats const& f, int m)
+		{
+			switch (m)
+			{
+				case 0: return f.calls.load(std::memory_order_relaxed);
+				case 1: return f.errors.load(std::memory_order_relaxed);
+				case 2: return f.latency_us.sum();
+				case 3: return f.latency_us.quantile(0.5);
+				case 4: return f.latency_us.quantile(0.99);
+				case 5: return f.latency_us.max();
+				case 6: return f.bytes.sum();
+				case 7: return f.bytes.quantile(0.99);
+				case 8: return f.wait_us.sum();
+			}
+			TORRENT_ASSERT(false);
+			return 0;
+		}
+
+		enum { num_queue_metrics = 4 };
+
+		metric_desc const queue_metrics[num_queue_metrics] =
+		{
+			{ "bytes", false },
+			{ "messages", false },
+			{ "coalesced", true },
+			{ "evicted", true },
+		};
+
+		std::uint64_t queue_metric_value(rpc_stats::queue_stats const& q, int m)
+		{
+			switch (m)
+			{
+				case 0: return (std::max)(q.bytes.load(std::memory_order_relaxed), std::int64_t(0));
+				case 1: return (std::max)(q.messages.load(std::memory_order_relaxed), std::int64_t(0));
+				case 2: return q.coalesced.load(std::memory_order_relaxed);
+				case 3: return q.evicted.load(std::memory_order_relaxed);
+			}
+			TORRENT_ASSERT(false);
+			return 0;
+		}
+
+		enum { num_handshake_metrics = 5 };
+
+		metric_desc const handshake_metrics[num_handshake_metrics] =
+		{
+			{ "full", true },
+			{ "resumed", true },
+			{ "failed", true },
+			{ "latency_us", true },
+			{ "latency_p99_us", false },
+		};
+
+		std::uint64_t handshake_metric_value(rpc_stats::handshake_stats const& h, int m)
+		{
+			switch (m)
+			{
+				case 0: return h.full.load(std::memory_order_relaxed);
+				case 1: return h.resumed.load(std::memory_order_relaxed);
+				case 2: return h.failed.load(std::memory_order_relaxed);
+				case 3: return h.latency_us.sum();
+				case 4: return h.latency_us.quantile(0.99);
+			}
+			TORRENT_ASSERT(false);
+			return 0;
+		}
+
+		// the metrics of s, in the order of rpc_stats::metric()
+		std::vector<rpc_metric> metric_names(rpc_stats const& s)
+		{
+			std::vector<rpc_metric> names;
+			for (int f = 0; f < s.num_functions(); ++f)
+			{
+				for (int m = 0; m < metrics_per_function; ++m)
+				{
+					rpc_metric rm;
+					rm.name = "rpc." + s.protocol() + "." + s.function_name(f)
+						+ "." + metrics[m].name;
+					rm.counter = metrics[m].counter;
+					names.push_back(rm);
+				}
+			}
+			for (int m = 0; s.send_queues() && m < num_queue_metrics; ++m)
+			{
+				rpc_metric rm;
+				rm.name = "rpc." + s.protocol() + ".send_queue." + queue_metrics[m].name;
+				rm.counter = queue_metrics[m].counter;
+				names.push_back(rm);
+			}
+			for (int m = 0; s.handshakes() && m < num_handshake_metrics; ++m)
+			{
+				rpc_metric rm;
+				rm.name = "rpc." + s.protocol() + ".handshake." + handshake_metrics[m].name;
+				rm.counter = handshake_metrics[m].counter;
+				names.push_back(rm);
+			}
+			return names;
+		}
+	}
+
+	metric_source::metric_source(std::vector<rpc_metric> const& metrics
+		, std::function<std::uint64_t(int)> const& value)
+		: m_value(value)
+	{
+		metric_registry& r = registry();
+		std::unique_lock<std::mutex> l(r.mutex);
+		m_ids.reserve(metrics.size());
+		for (int i = 0; i < int(metrics.size()); ++i)
+		{
+			std::pair<std::unordered_map<std::string, int>::iterator, bool> const ret
+				= r.ids.insert(std::make_pair(metrics[i].name, int(r.metrics.size())));
+			if (ret.second)
+			{
+				registered_metric m;
+				m.name = metrics[i].name;
+				r.metrics.push_back(m);
+			}
+			registered_metric& m = r.metrics[ret.first->second];
+			m.counter = metrics[i].counter;
+			m.source = this;
+			m.index = i;
+			m_ids.push_back(ret.first->second);
+		}
+	}
+
+	metric_source::~metric_source()
+	{
+		metric_registry& r = registry();
+		std::unique_lock<std::mutex> l(r.mutex);
+		for (std::vector<int>::iterator i = m_ids.begin()
+			, end(m_ids.end()); i != end; ++i)
+		{
+			// the metric may have been taken over by a newer source
+			if (r.metrics[*i].source == this) r.metrics[*i].source = NULL;
+		}
+	}
+
+	log_histogram::log_histogram()
+		: m_sum(0)
+		, m_max(0)
+	{
+		for (int i = 0; i < num_buckets; ++i)
+			m_buckets[i].store(0, std::memory_order_relaxed);
+	}
+
+	int log_histogram::bucket(std::uint64_t v)
+	{
+		if (v < 8) return int(v);
+		int const e = 63 - __builtin_clzll(v);
+		if (e > 39) return num_buckets - 1;
+		// the two bits following the most significant one pick the
+		// quarter within the power of two
+		return 8 + (e - 3) * 4 + int((v >> (e - 2)) & 3);
+	}
+
+	std::uint64_t log_histogram::bucket_max(int b)
+	{
+		TORRENT_ASSERT(b >= 0 && b < num_buckets);
+		if (b < 8) return b;
+		if (b == num_buckets - 1) return (std::numeric_limits<std::uint64_t>::max)();
+		int const e = (b - 8) / 4 + 3;
+		int const quarter = (b - 8) % 4;
+		return (std::uint64_t(4 + quarter + 1) << (e - 2)) - 1;
+	}
+
+	void log_histogram::record(std::uint64_t v)
+	{
+		m_buckets[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+		m_sum.fetch_add(v, std::memory_order_relaxed);
+		std::uint64_t m = m_max.load(std::memory_order_relaxed);
+		while (v > m && !m_max.compare_exchange_weak(m, v, std::memory_order_relaxed));
+	}
+
+	std::uint64_t log_histogram::count() const
+	{
+		std::uint64_t ret = 0;
+		for (int i = 0; i < num_buckets; ++i)
+			ret += m_buckets[i].load(std::memory_order_relaxed);
+		return ret;
+	}
+
+	std::uint64_t log_histogram::sum() const
+	{
+		return m_sum.load(std::memory_order_relaxed);
+	}
+
+	std::uint64_t log_histogram::max() const
+	{
+		return m_max.load(std::memory_order_relaxed);
+	}
+
+	std::uint64_t log_histogram::quantile(double q) const
+	{
+		// take a copy, to look at a consistent set of buckets while
+		// samples keep being recorded
+		std::uint64_t buckets[num_buckets];
+		std::uint64_t total = 0;
+		for (int i = 0; i < num_buckets; ++i)
+		{
+			buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+			total += buckets[i];
+		}
+		if (total == 0) return 0;
+
+		std::uint64_t target = std::uint64_t(std::ceil(q * total));
+		if (target < 1) target = 1;
+		if (target > total) target = total;
+
+		std::uint64_t const largest = max();
+		std::uint64_t seen = 0;
+		for (int i = 0; i < num_buckets; ++i)
+		{
+			seen += buckets[i];
+			if (seen < target) continue;
+			// the top of the bucket may exceed anything that was recorded
+			return (std::min)(bucket_max(i), largest);
+		}
+		return largest;
+	}
+
+	rpc_stats::function_stats::function_stats()
+		: calls(0)
+		, errors(0)
+	{}
+
+	rpc_stats::queue_stats::queue_stats()
+		: bytes(0)
+		, messages(0)
+		, coalesced(0)
+		, evicted(0)
+	{}
+
+	rpc_stats::handshake_stats::handshake_stats()
+		: full(0)
+		, resumed(0)
+		, failed(0)
+	{}
+
+	rpc_stats::rpc_stats(char const* protocol, std::vector<std::string> const& functions
+		, int flags)
+		: m_protocol(protocol)
+		, m_functions(functions)
+		, m_stats(new function_stats[functions.size()])
+		, m_queues((flags & send_queue_metrics) ? new queue_stats : NULL)
+		, m_handshakes((flags & handshake_metrics) ? new handshake_stats : NULL)
+	{
+		m_source.reset(new metric_source(metric_names(*this)
+			, [this](int i) { return metric(i); }));
+	}
+
+	rpc_stats::~rpc_stats() {}
+
+	std::uint64_t rpc_stats::metric(int i) const
+	{
+		int const num_function_metrics = num_functions() * metrics_per_function;
+		if (i < num_function_metrics)
+			return metric_value(m_stats[i / metrics_per_function], i % metrics_per_function);
+		i -= num_function_metrics;
+		if (m_queues && i < num_queue_metrics)
+			return queue_metric_value(*m_queues, i);
+		if (m_queues) i -= num_queue_metrics;
+		TORRENT_ASSERT(m_handshakes && i < num_handshake_metrics);
+		return handshake_metric_value(*m_handshakes, i);
+	}
+
+	rpc_stats::call::call(rpc_stats& s, int function, mg_connection* conn)
+		: m_stats(s)
+		, m_function(function)
+		, m_conn(conn)
+		, m_conn_bytes(conn ? mg_get_bytes_written(conn) : 0)
+		, m_bytes(0)
+		, m_wait_us(0)
+		, m_start(clock_type::now())
+		, m_error(false)
+		, m_parent(current_call)
+	{
+		current_call = this;
+	}
+
+	rpc_stats::call::call(rpc_stats& s, int function, mg_connection* conn
+		, time_point start)
+		: m_stats(s)
+		, m_function(function)
+		, m_conn(conn)
+		, m_conn_bytes(conn ? mg_get_bytes_written(conn) : 0)
+		, m_bytes(0)
+		, m_wait_us(total_microseconds(clock_type::now() - start))
+		, m_start(start)
+		, m_error(false)
+		, m_parent(current_call)
+	{
+		current_call = this;
+	}
+
+	rpc_stats::call::~call()
+	{
+		TORRENT_ASSERT(current_call == this);
+		current_call = m_parent;
+
+		if (m_function < 0 || m_function >= m_stats.num_functions()) return;
+
+		std::uint64_t bytes = m_bytes;
+		if (m_conn) bytes += mg_get_bytes_written(m_conn) - m_conn_bytes;
+
+		function_stats& f = m_stats.m_stats[m_function];
+		f.calls.fetch_add(1, std::memory_order_relaxed);
+		if (m_error) f.errors.fetch_add(1, std::memory_order_relaxed);
+		f.latency_us.record(total_microseconds(clock_type::now() - m_start));
+		f.bytes.record(bytes);
+		f.wait_us.record(m_wait_us);
+	}
+
+	rpc_stats::wait_timer::wait_timer()
+		: m_start(clock_type::now())
+	{}
+
+	rpc_stats::wait_timer::~wait_timer()
+	{
+		if (current_call == NULL) return;
+		current_call->m_wait_us += total_microseconds(clock_type::now() - m_start);
+	}
+
+	void rpc_stats::set_error()
+	{
+		if (current_call) current_call->m_error = true;
+	}
+
+	void rpc_stats::add_bytes(std::uint64_t bytes)
+	{
+		if (current_call) current_call->m_bytes += bytes;
+	}
+
+	time_point rpc_stats::defer()
+	{
+		if (current_call == NULL) return clock_type::now();
+		current_call->m_function = -1;
+		return current_call->m_start;
+	}
+
+	std::vector<rpc_metric> rpc_metrics()
+	{
+		std::vector<rpc_metric> ret;
+		metric_registry& r = registry();
+		std::unique_lock<std::mutex> l(r.mutex);
+		for (int i = 0; i < int(r.metrics.size()); ++i)
+		{
+			registered_metric const& m = r.metrics[i];
+			if (m.source == NULL) continue;
+			rpc_metric rm;
+			rm.name = m.name;
+			rm.counter = m.counter;
+			rm.id = i;
+			ret.push_back(rm);
+		}
+		return ret;
+	}
+
+	bool rpc_metric_value(int id, std::uint64_t& value)
+	{
+		metric_registry& r = registry();
+		std::unique_lock<std::mutex> l(r.mutex);
+		if (id < 0 || id >= int(r.metrics.size())) return false;
+		registered_metric const& m = r.metrics[id];
+		if (m.source == NULL) return false;
+		value = m.source->m_value(m.index);
+		return true;
+	}
+
+	int num_rpc_metric_ids()
+	{
+		metric_registry& r = registry();
+		std::unique_lock<std::mutex> l(r.mutex);
+		return int(r.metrics.size());
+	}
+}
+
@@ -0,0 +1,291 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_RPC_STATS_HPP
+#define TORRENT_RPC_STATS_HPP
+
+#include "libtorrent/time.hpp"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+struct mg_connection;
+
+namespace libtorrent
+{
+	// a histogram with logarithmically sized buckets, four per power of two.
+	// Values below 8 have a bucket each. This keeps the error of the
+	// percentiles below 25% over the whole 64 bit range, in a fixed amount
+	// of memory. Recording a value is a few atomic adds, and never blocks
+	struct log_histogram
+	{
+		enum { num_buckets = 156 };
+
+		log_histogram();
+
+		void record(std::uint64_t v);
+
+		std::uint64_t count() const;
+		std::uint64_t sum() const;
+		std::uint64_t max() const;
+
+		// returns an upper bound of the value the fraction q of the samples
+		// are less than or equal to. 0 if no samples have been recorded
+		std::uint64_t quantile(double q) const;
+
+		// the index of the bucket v falls in, and the largest value in
+		// bucket b
+		static int bucket(std::uint64_t v);
+		static std::uint64_t bucket_max(int b);
+
+	private:
+
+		std::atomic<std::uint64_t> m_buckets[num_buckets];
+		std::atomic<std::uint64_t> m_sum;
+		std::atomic<std::uint64_t> m_max;
+	};
+
+	struct rpc_metric
+	{
+		// rpc.<protocol>.<function>.<property>,
+		// rpc.<protocol>.send_queue.<property> or
+		// rpc.<protocol>.handshake.<property> for the metrics of rpc_stats
+		std::string name;
+		// true for values that only grow, false for the percentiles
+		bool counter;
+		// assigned by name, the first time a metric with this name is
+		// registered. The metric keeps it for the life of the process, also
+		// while no source of it is alive, so ids subscribed to by clients
+		// keep referring to the same metric
+		int id;
+	};
+
+	// a set of metrics listed in a process wide registry while it's alive,
+	// to have them exported along with the session counters (see
+	// rpc_metrics()). Every rpc_stats has one, and other parts of the web UI
+	// may export their own values this way
+	struct metric_source
+	{
+		// value(i) returns the current value of metrics[i]. It's called from
+		// any thread, with the registry locked, until the metric_source is
+		// destroyed. The ids of metrics are ignored. If a live source already
+		// has a metric by one of the names, this one replaces it
+		metric_source(std::vector<rpc_metric> const& metrics
+			, std::function<std::uint64_t(int)> const& value);
+		~metric_source();
+
+	private:
+
+		friend bool rpc_metric_value(int id, std::uint64_t& value);
+
+		std::function<std::uint64_t(int)> m_value;
+
+		// the ids of the metrics, in the order they were passed in
+		std::vector<int> m_ids;
+
+		metric_source(metric_source const&);
+		metric_source& operator=(metric_source const&);
+	};
+
+	// the call counts, errors, latency and response sizes of the RPC
+	// functions of one front-end protocol, exported through a metric_source
+	// while it's alive
+	struct rpc_stats
+	{
+		enum flags_t
+		{
+			// for protocols that queue messages to their connections, to
+			// export queue_stats as well
+			send_queue_metrics = 1,
+
+			// for protocols served over TLS, to export handshake_stats
+			handshake_metrics = 2
+		};
+
+		// functions are the names of the functions of the protocol, indexed
+		// by the function numbers passed to call. flags is a combination of
+		// flags_t, for the metrics of the protocol's connections
+		rpc_stats(char const* protocol, std::vector<std::string> const& functions
+			, int flags = 0);
+		~rpc_stats();
+
+		// measures one call, from construction to destruction. If conn is
+		// specified, the bytes written to it in that time count as the
+		// response size. Calls with a function number of -1 (for instance
+		// requests that turned out not to be RPCs) aren't recorded
+		struct call
+		{
+			call(rpc_stats& s, int function, mg_connection* conn = NULL);
+
+			// completes a call deferred with defer(), on the thread the
+			// response is written from. It's recorded as one call, from
+			// start, and the time it was suspended counts as waiting
+			call(rpc_stats& s, int function, mg_connection* conn, time_point start);
+			~call();
+
+			void set_function(int function) { m_function = function; }
+
+			// for responses not written to a mongoose connection
+			void add_bytes(std::uint64_t bytes) { m_bytes += bytes; }
+
+		private:
+
+			friend struct rpc_stats;
+
+			rpc_stats& m_stats;
+			int m_function;
+			mg_connection* m_conn;
+			long long m_conn_bytes;
+			std::uint64_t m_bytes;
+			std::uint64_t m_wait_us;
+			time_point m_start;
+			bool m_error;
+
+			// the call this one is nested in, on this thread
+			call* m_parent;
+
+			call(call const&);
+			call& operator=(call const&);
+		};
+
+		// measures the time the current thread blocks, waiting for the
+		// session for instance, while in a call. It's reported separately
+		// from (and included in) the latency of the call
+		struct wait_timer
+		{
+			wait_timer();
+			~wait_timer();
+		private:
+			time_point m_start;
+		};
+
+		// marks the call in progress on this thread as failed. Does nothing
+		// if there is none
+		static void set_error();
+
+		// counts bytes queued to be sent as part of the response of the
+		// call in progress on this thread, for responses that aren't written
+		// to the connection by the call itself. Does nothing if there is no
+		// call in progress
+		static void add_bytes(std::uint64_t bytes);
+
+		// marks the call in progress on this thread as deferred, for calls
+		// that return before their response is written. It's not recorded
+		// when it ends, but by the call that completes it, constructed with
+		// the time returned here
+		static time_point defer();
+
+		struct function_stats
+		{
+			function_stats();
+			std::atomic<std::uint64_t> calls;
+			std::atomic<std::uint64_t> errors;
+			log_histogram latency_us;
+			log_histogram bytes;
+			log_histogram wait_us;
+		};
+
+		// the outbound message queues of the protocol's connections, summed
+		// over all of them. bytes and messages are the current depth,
+		// coalesced counts messages replaced by a newer one before they
+		// were sent and evicted the connections closed for falling too far
+		// behind
+		struct queue_stats
+		{
+			queue_stats();
+			std::atomic<std::int64_t> bytes;
+			std::atomic<std::int64_t> messages;
+			std::atomic<std::uint64_t> coalesced;
+			std::atomic<std::uint64_t> evicted;
+		};
+
+		// the TLS handshakes of the protocol's connections. full and resumed
+		// count the completed ones, by whether the client resumed an earlier
+		// session, failed the ones that didn't complete. The latency is
+		// recorded for the completed ones
+		struct handshake_stats
+		{
+			handshake_stats();
+			std::atomic<std::uint64_t> full;
+			std::atomic<std::uint64_t> resumed;
+			std::atomic<std::uint64_t> failed;
+			log_histogram latency_us;
+		};
+
+		// NULL unless the protocol was created with send_queue_metrics
+		queue_stats* send_queues() { return m_queues.get(); }
+		queue_stats const* send_queues() const { return m_queues.get(); }
+
+		// NULL unless the protocol was created with handshake_metrics
+		handshake_stats* handshakes() { return m_handshakes.get(); }
+		handshake_stats const* handshakes() const { return m_handshakes.get(); }
+
+		int num_functions() const { return int(m_functions.size()); }
+		std::string const& protocol() const { return m_protocol; }
+		std::string const& function_name(int i) const { return m_functions[i]; }
+		function_stats const& function(int i) const { return m_stats[i]; }
+
+	private:
+
+		// the value of the i:th metric of this protocol. 9 per function,
+		// followed by 4 for the send queue and 5 for the handshakes, if it
+		// has them
+		std::uint64_t metric(int i) const;
+
+		std::string m_protocol;
+		std::vector<std::string> m_functions;
+		std::unique_ptr<function_stats[]> m_stats;
+		std::unique_ptr<queue_stats> m_queues;
+		std::unique_ptr<handshake_stats> m_handshakes;
+
+		// this is last, to be unregistered before the stats it reads are
+		// destroyed
+		std::unique_ptr<metric_source> m_source;
+	};
+
+	// the metrics of all live metric_source objects, ordered by id
+	std::vector<rpc_metric> rpc_metrics();
+
+	// the current value of the metric with the specified id. Returns false
+	// if there is no such metric, or no live source of it
+	bool rpc_metric_value(int id, std::uint64_t& value);
+
+	// the number of metric ids assigned so far. Every id is less than this
+	int num_rpc_metric_ids();
+}
+
+#endif
+
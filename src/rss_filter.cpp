@@ -46,7 +46,7 @@ namespace libtorrent
 		int source;
 	};
 
-	str_map_t str_map[] =
+	str_map_t const str_map[] =
 	{
 		{"hdtv", item_properties::hd720, item_properties::tv},
 		{"dsr", item_properties::hd720, item_properties::sattelite},
@@ -82,95 +82,126 @@ namespace libtorrent
 		{"576i", item_properties::sd, item_properties::unknown},
 	};
 
-	// these format strings are matches against each individual token
-	char const* ep_format[] =
+	namespace
 	{
-		"s%ue%u", "%ux%u"
-	};
+		bool is_digit(char c) { return c >= '0' && c <= '9'; }
 
-	// these format strings arematches against the raw input string
-	char const* ep_format_raw[] =
-	{
-		"%*[^0123456789]%4u%*[-. ]%2u%*[-. ]%2u"
-	};
+		bool is_token_char(char c)
+		{
+			return (c >= 'a' && c <= 'z') || is_digit(c) || c == '-';
+		}
 
-	void handle_str(char const* str, item_properties& p)
-	{
-		str_map_t* end = str_map + sizeof(str_map)/sizeof(str_map[0]);
-		str_map_t* i = std::find_if(str_map, end, [str](str_map_t const& e) { return strcmp(e.str, str) == 0; });
-		if (i != end)
+		// parses up to max_digits decimal digits at str, advancing it.
+		// returns false if there weren't any
+		bool parse_uint(char const*& str, char const* end, int max_digits, int& ret)
 		{
-			if (i->quality != item_properties::unknown)
-				p.quality = i->quality;
-			if (i->source != item_properties::unknown)
-				p.source = i->source;
+			char const* start = str;
+			ret = 0;
+			while (str != end && str - start < max_digits && is_digit(*str))
+				ret = ret * 10 + *str++ - '0';
+			return str != start;
 		}
 
-		int season;
-		int episode;
-		int day;
-		for (int k = 0; k < sizeof(ep_format)/sizeof(ep_format[0]); ++k)
+		// skips a run of date separators. returns false if there weren't any
+		bool skip_separators(char const*& str, char const* end)
 		{
-			int matches = sscanf(str, ep_format[k], &season, &episode, &day);
-			if (matches == 2)
-			{
-				p.season = season;
-				p.episode = episode;
-				break;
-			}
-			if (matches == 3)
-			{
-				p.season = season;
-				p.episode = episode * 100 + day;
-				break;
-			}
+			char const* start = str;
+			while (str != end && (*str == '-' || *str == '.' || *str == ' ')) ++str;
+			return str != start;
 		}
-	}
 
-	void parse_name(std::string name, item_properties& p)
-	{
-		char* str = &name[0];
-		char* start = str;
+		// a date, like "Foo 2013-05-13", at the first number in the title. The
+		// episode is the month and day (0513), the season is the year
+		void parse_date(std::string const& name, item_properties& p)
+		{
+			char const* str = name.c_str();
+			char const* end = str + name.size();
+			char const* i = std::find_if(str, end, is_digit);
+			if (i == str || i == end) return;
+
+			int year;
+			int month;
+			int day;
+			parse_uint(i, end, 4, year);
+			if (!skip_separators(i, end) || !parse_uint(i, end, 2, month)) return;
+			p.season = year;
+			p.episode = month;
+			if (!skip_separators(i, end) || !parse_uint(i, end, 2, day)) return;
+			p.episode = month * 100 + day;
+		}
 
-		int season;
-		int episode;
-		int day;
-		for (int k = 0; k < sizeof(ep_format_raw)/sizeof(ep_format_raw[0]); ++k)
+		// tokens are lower case. They may name the quality or source, or be
+		// an episode number, like "s01e02" or "1x02"
+		void handle_token(char const* str, int len, item_properties& p)
 		{
-			int matches = sscanf(str, ep_format_raw[k], &season, &episode, &day);
-			if (matches == 2)
-			{
-				p.season = season;
-				p.episode = episode;
-				break;
-			}
-			if (matches == 3)
+			str_map_t const* end = str_map + sizeof(str_map)/sizeof(str_map[0]);
+			for (str_map_t const* i = str_map; i != end; ++i)
 			{
-				p.season = season;
-				p.episode = episode * 100 + day;
-				break;
+				if (i->str[0] != str[0]
+					|| strncmp(i->str, str, len) != 0
+					|| i->str[len] != '\0') continue;
+				if (i->quality != item_properties::unknown)
+					p.quality = i->quality;
+				if (i->source != item_properties::unknown)
+					p.source = i->source;
+				return;
 			}
-		}
 
-		do
-		{
-			*str = to_lower(*str);
-			if (strchr("abcdefghijklmnopqrstuvwxyz0123456789-", *str) == NULL)
+			char const* token_end = str + len;
+			int season;
+			int episode;
+
+			char const* i = str;
+			if (*i == 's')
 			{
-				if (str == start)
+				++i;
+				if (parse_uint(i, token_end, 9, season) && i != token_end && *i == 'e')
 				{
-					++start;
+					++i;
+					if (parse_uint(i, token_end, 9, episode))
+					{
+						p.season = season;
+						p.episode = episode;
+						return;
+					}
 				}
-				else
+			}
+
+			i = str;
+			if (parse_uint(i, token_end, 9, season) && i != token_end && *i == 'x')
+			{
+				++i;
+				if (parse_uint(i, token_end, 9, episode))
 				{
-					*str = '\0';
-					handle_str(start, p);
-					start = str+1;
+					p.season = season;
+					p.episode = episode;
 				}
 			}
-			++str;
-		
-		} while (*str);
+		}
+	}
+
+	void parse_name(std::string const& name, item_properties& p)
+	{
+		parse_date(name, p);
+
+		// tokens longer than this can't be anything we're looking for
+		char token[32];
+		int len = 0;
+		for (std::string::const_iterator i = name.begin(), end(name.end());; ++i)
+		{
+			char const c = i == end ? '\0' : to_lower(*i);
+			if (i != end && is_token_char(c))
+			{
+				if (len < int(sizeof(token))) token[len] = c;
+				++len;
+				continue;
+			}
+
+			if (len > 0 && len < int(sizeof(token)))
+				handle_token(token, len, p);
+			len = 0;
+			if (i == end) break;
+		}
 	}
 
 	rss_filter_handler::rss_filter_handler(alert_handler& h, session& ses)
@@ -214,39 +245,42 @@ namespace libtorrent
 		rss_item_alert const* ri = alert_cast<rss_item_alert>(a);
 		if (ri == NULL) return;
 
-		item_properties p;
-		parse_name(ri->item.title, p);
-
 		std::string exact_title = ri->item.title;
 		std::string normalized_title = normalize_title(exact_title);
 
+		std::unique_lock<std::mutex> l(m_mutex);
+
+		// find every search string of every rule in one pass over each title
+		std::vector<bool> exact_found;
+		std::vector<bool> normalized_found;
+		m_exact.find(exact_title, exact_found);
+		m_normalized.find(normalized_title, normalized_found);
+
+		item_properties p;
+		bool parsed = false;
+
 		for (std::vector<rss_rule_t>::iterator i = m_rules.begin()
 			, end(m_rules.end()); i != end; ++i)
 		{
-			if (i->exact_match)
-			{
-				if (!i->search.empty() && strstr(exact_title.c_str(), i->search.c_str()) == NULL)
-					continue;
+			std::vector<bool> const& found = i->exact_match
+				? exact_found : normalized_found;
 
-				if (!i->search_not.empty() && strstr(exact_title.c_str(), i->search_not.c_str()) != NULL)
-					continue;
-			}
-			else
-			{
-				std::string search = normalize_title(i->search);
-				if (!search.empty() && strstr(normalized_title.c_str(), search.c_str()) == NULL)
-					continue;
-				std::string search_not = normalize_title(i->search_not);
-				if (!search_not.empty() && strstr(normalized_title.c_str(), search_not.c_str()) != NULL)
-					continue;
-			}
+			if (i->search_pattern >= 0 && !found[i->search_pattern])
+				continue;
+
+			if (i->search_not_pattern >= 0 && found[i->search_not_pattern])
+				continue;
 
 			// it's a match!
 
 			if (i->episode_filter)
 			{
-				item_properties p;
-				parse_name(exact_title, p);
+				// only parse the title once, and only if we need it
+				if (!parsed)
+				{
+					parse_name(exact_title, p);
+					parsed = true;
+				}
 
 				// when the episode filter is enabled, only
 				// download files that has a season and episode
@@ -270,6 +304,31 @@ namespace libtorrent
 		}
 	}
 
+	void rss_filter_handler::compile_rules()
+	{
+		m_exact.clear();
+		m_normalized.clear();
+
+		for (std::vector<rss_rule_t>::iterator i = m_rules.begin()
+			, end(m_rules.end()); i != end; ++i)
+		{
+			std::string search = i->search;
+			std::string search_not = i->search_not;
+			multi_match* m = &m_exact;
+			if (!i->exact_match)
+			{
+				search = normalize_title(search);
+				search_not = normalize_title(search_not);
+				m = &m_normalized;
+			}
+			i->search_pattern = search.empty() ? -1 : m->add(search);
+			i->search_not_pattern = search_not.empty() ? -1 : m->add(search_not);
+		}
+
+		m_exact.compile();
+		m_normalized.compile();
+	}
+
 	rss_rule rss_filter_handler::get_rule(int id) const
 	{
 		std::unique_lock<std::mutex> l(m_mutex);
@@ -289,6 +348,7 @@ namespace libtorrent
 		int id = m_next_id++;
 		m_rules.push_back(r);
 		m_rules.back().id = id;
+		compile_rules();
 		return id;
 	}
 
@@ -300,6 +360,7 @@ namespace libtorrent
 		{
 			if (i->id != r.id) continue;
 			*i = r;
+			compile_rules();
 			break;
 		}
 	}
@@ -313,6 +374,7 @@ namespace libtorrent
 		{
 			if (i->id != id) continue;
 			m_rules.erase(i);
+			compile_rules();
 			break;
 		}
 	}
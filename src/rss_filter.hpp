@@ -31,6 +31,7 @@ POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include "alert_observer.hpp"
+#include "multi_match.hpp"
 #include "libtorrent/add_torrent_params.hpp"
 #include "libtorrent/torrent_info.hpp"
 #include <mutex>
@@ -49,6 +50,8 @@ namespace libtorrent
 
 	struct item_properties
 	{
+		item_properties() : season(0), episode(0), quality(0), source(unknown) {}
+
 		int season;
 		int episode;
 		int quality;
@@ -79,7 +82,7 @@ namespace libtorrent
 		\param p the season, episode, source and quality
 		is returned in this parameter.
 	*/
-	void parse_name(std::string name, item_properties& p);
+	void parse_name(std::string const& name, item_properties& p);
 
 	/**
 		strips out all characters that are not alphanumerics (or dash).
@@ -174,16 +177,33 @@ namespace libtorrent
 		virtual void handle_alert(alert const* a);
 
 	private:
+
+		// rebuilds m_exact and m_normalized from m_rules. Must be called
+		// with m_mutex held, whenever a rule's search strings change
+		void compile_rules();
+
 		// the std::mutex protects m_rules and associated state
 		mutable std::mutex m_mutex;
 		struct rss_rule_t : rss_rule
 		{
-			rss_rule_t(rss_rule const& r) : rss_rule(r) {}
+			rss_rule_t(rss_rule const& r)
+				: rss_rule(r), search_pattern(-1), search_not_pattern(-1) {}
 			std::set<std::pair<int,int> > downloaded_episodes;
+
+			// the indices of search and search_not in m_exact or
+			// m_normalized, depending on exact_match. -1 if empty
+			int search_pattern;
+			int search_not_pattern;
 		};
 
 		std::vector<rss_rule_t> m_rules;
 
+		// the search strings of all rules, compiled to be matched against
+		// an item's title in one pass. m_normalized holds the normalized
+		// search strings of the rules without exact_match
+		multi_match m_exact;
+		multi_match m_normalized;
+
 		alert_handler& m_handler;
 		session& m_ses;
 		int m_next_id;
@@ -34,6 +34,12 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "save_settings.hpp" // for load_file and save_file
 
 #include <functional>
+#include <future>
+#include <deque>
+#include <limits>
+#include <algorithm>
+
+#include <zlib.h>
 
 #include "libtorrent/add_torrent_params.hpp"
 #include "libtorrent/session.hpp"
@@ -41,21 +47,276 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/entry.hpp"
 #include "libtorrent/bencode.hpp"
 #include "libtorrent/lazy_entry.hpp"
+#include "libtorrent/bdecode.hpp"
 #include "libtorrent/file.hpp"
 #include "libtorrent/alert_types.hpp"
+#include "libtorrent/time.hpp"
+#include "libtorrent/io.hpp"
+#include "libtorrent/hex.hpp"
 
 #include "alert_handler.hpp"
+#include "torrent_history.hpp"
+#include "rpc_stats.hpp"
 
 namespace s = std::placeholders;
 
 namespace libtorrent
 {
 
-save_resume::save_resume(session& s, std::string const& resume_file, alert_handler* alerts)
+// changes to these fields have the resume data saved soon
+static int const urgent_fields[] =
+{
+	torrent_history_entry::state,
+	torrent_history_entry::paused,
+	torrent_history_entry::auto_managed,
+	torrent_history_entry::sequential_download,
+	torrent_history_entry::is_finished,
+	torrent_history_entry::save_path,
+	torrent_history_entry::name,
+};
+
+// the key the torrent's labels are stored under in its resume data, as a list
+// of strings. libtorrent ignores keys it doesn't know
+static char const labels_key[] = "webui-labels";
+
+namespace {
+
+// the save_resume objects whose load progress is exported
+struct loader_registry
+{
+	std::mutex mutex;
+	std::vector<save_resume const*> loaders;
+};
+
+loader_registry& loaders()
+{
+	static loader_registry r;
+	return r;
+}
+
+enum { num_load_metrics = 6 };
+
+// the load progress of all save_resume objects, summed up
+std::uint64_t load_metric(int m)
+{
+	loader_registry& r = loaders();
+	std::unique_lock<std::mutex> l(r.mutex);
+	std::uint64_t ret = 0;
+	for (std::vector<save_resume const*>::iterator i = r.loaders.begin()
+		, end(r.loaders.end()); i != end; ++i)
+	{
+		save_resume::load_stats_t const st = (*i)->load_stats();
+		switch (m)
+		{
+			case 0: ret += st.total; break;
+			case 1: ret += st.queued; break;
+			case 2: ret += st.added; break;
+			case 3: ret += st.failed; break;
+			case 4: ret += st.lost; break;
+			case 5: ret += st.done; break;
+		}
+	}
+	return ret;
+}
+
+// lost goes down again if the alert of a lost add turns up late, and done
+// is the number of loaders that are done
+std::vector<rpc_metric> load_metric_names()
+{
+	static struct { char const* name; bool counter; } const names[num_load_metrics] =
+	{
+		{ "resume.load.total", false },
+		{ "resume.load.queued", true },
+		{ "resume.load.added", true },
+		{ "resume.load.failed", true },
+		{ "resume.load.lost", false },
+		{ "resume.load.done", false },
+	};
+	std::vector<rpc_metric> ret(num_load_metrics);
+	for (int i = 0; i < num_load_metrics; ++i)
+	{
+		ret[i].name = names[i].name;
+		ret[i].counter = names[i].counter;
+	}
+	return ret;
+}
+
+void add_loader(save_resume const* r)
+{
+	// the metrics are exported for the life of the process, once there's
+	// been a loader. Unregistering them would lock the metric registry
+	// with the loader registry locked, the opposite order of load_metric()
+	static metric_source const source(load_metric_names(), &load_metric);
+
+	loader_registry& reg = loaders();
+	std::unique_lock<std::mutex> l(reg.mutex);
+	reg.loaders.push_back(r);
+}
+
+void remove_loader(save_resume const* r)
+{
+	loader_registry& reg = loaders();
+	std::unique_lock<std::mutex> l(reg.mutex);
+	reg.loaders.erase(std::find(reg.loaders.begin(), reg.loaders.end(), r));
+}
+
+}
+
+// binds the info-hash, and the blob if there is one, and steps the statement.
+// Returns false on failure
+static bool step_statement(sqlite3* db, sqlite3_stmt* stmt, std::string const& ih
+	, std::vector<char> const* blob)
+{
+	if (stmt == NULL) return false;
+
+	int ret = sqlite3_bind_text(stmt, 1, ih.c_str(), 40, SQLITE_STATIC);
+	if (ret == SQLITE_OK && blob)
+		ret = sqlite3_bind_blob(stmt, 2, &(*blob)[0], blob->size(), SQLITE_STATIC);
+
+	bool ok = false;
+	if (ret != SQLITE_OK)
+		printf("failed to bind statement: %s\n", sqlite3_errmsg(db));
+	else if (sqlite3_step(stmt) != SQLITE_DONE)
+		printf("failed to step statement: %s\n", sqlite3_errmsg(db));
+	else
+		ok = true;
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	return ok;
+}
+
+// looks up the blob stored for the info-hash. Returns false if there isn't
+// one
+static bool fetch_blob(sqlite3* db, sqlite3_stmt* stmt, std::string const& ih
+	, std::vector<char>& buf)
+{
+	if (stmt == NULL) return false;
+
+	bool ok = false;
+	if (sqlite3_bind_text(stmt, 1, ih.c_str(), 40, SQLITE_STATIC) != SQLITE_OK)
+	{
+		printf("failed to bind select statement: %s\n", sqlite3_errmsg(db));
+	}
+	else if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_bytes(stmt, 0) > 0)
+	{
+		char const* buffer = (char const*)sqlite3_column_blob(stmt, 0);
+		buf.assign(buffer, buffer + sqlite3_column_bytes(stmt, 0));
+		ok = true;
+	}
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	return ok;
+}
+
+// bencodes the resume data without its info dict into record, and the info
+// dict, if there is one, into info
+static void split_resume(entry const& e, std::vector<char>& record
+	, std::vector<char>& info)
+{
+	record.clear();
+	info.clear();
+	if (e.type() != entry::dictionary_t)
+	{
+		bencode(std::back_inserter(record), e);
+		return;
+	}
+
+	record.push_back('d');
+	for (entry::dictionary_type::const_iterator i = e.dict().begin()
+		, end(e.dict().end()); i != end; ++i)
+	{
+		if (i->first == "info")
+		{
+			bencode(std::back_inserter(info), i->second);
+			continue;
+		}
+		char len[20];
+		snprintf(len, sizeof(len), "%d:", int(i->first.size()));
+		record.insert(record.end(), len, len + strlen(len));
+		record.insert(record.end(), i->first.begin(), i->first.end());
+		bencode(std::back_inserter(record), i->second);
+	}
+	record.push_back('e');
+}
+
+// resume records are stored compressed when that makes them smaller. A
+// compressed record is 'z', followed by the size of the bencoded record
+// (uint32, big endian) and the zlib stream. Anything else is bencoded
+static void compress_record(std::vector<char> const& plain, std::vector<char>& out)
+{
+	uLongf size = compressBound(plain.size());
+	out.resize(5 + size);
+	char* ptr = &out[0];
+	*ptr++ = 'z';
+	detail::write_uint32(plain.size(), ptr);
+	if (compress2((Bytef*)ptr, &size, (Bytef const*)&plain[0], plain.size()
+		, Z_BEST_SPEED) != Z_OK || 5 + size >= plain.size())
+	{
+		out = plain;
+		return;
+	}
+	out.resize(5 + size);
+}
+
+static bool decompress_record(char const* buf, int size, std::vector<char>& out)
+{
+	if (size < 5 || buf[0] != 'z')
+	{
+		out.assign(buf, buf + size);
+		return size > 0;
+	}
+
+	char const* ptr = buf + 1;
+	uLongf len = detail::read_uint32(ptr);
+	if (len == 0 || len > 64 * 1024 * 1024) return false;
+	out.resize(len);
+	if (uncompress((Bytef*)&out[0], &len, (Bytef const*)ptr, size - 5) != Z_OK
+		|| len != out.size())
+	{
+		out.clear();
+		return false;
+	}
+	return true;
+}
+
+// the resume data libtorrent is handed, is the record with the info dict
+// put back in
+static void join_resume(std::vector<char> const& record, char const* info
+	, int info_size, std::vector<char>& out)
+{
+	if (info_size == 0 || record.size() < 2 || record[0] != 'd')
+	{
+		out = record;
+		return;
+	}
+
+	static char const key[] = "4:info";
+	out.clear();
+	out.reserve(record.size() + info_size + 6);
+	out.push_back('d');
+	out.insert(out.end(), key, key + 6);
+	out.insert(out.end(), info, info + info_size);
+	out.insert(out.end(), record.begin() + 1, record.end());
+}
+
+save_resume::save_resume(session& s, std::string const& resume_file
+	, alert_handler* alerts, torrent_history* hist)
 	: m_ses(s)
 	, m_alerts(alerts)
-	, m_cursor(m_torrents.begin())
-	, m_last_save(time_now())
+	, m_hist(hist)
+	, m_db(NULL)
+	, m_insert(NULL)
+	, m_delete(NULL)
+	, m_select(NULL)
+	, m_insert_info(NULL)
+	, m_delete_info(NULL)
+	, m_select_info(NULL)
+	, m_num_writes(0)
+	, m_quit(false)
+	, m_outstanding_adds(0)
+	, m_load_abort(false)
+	, m_hist_frame(-1)
 	, m_interval(minutes(15))
 	, m_num_in_flight(0)
 	, m_shutting_down(false)
@@ -68,6 +329,7 @@ save_resume::save_resume(session& s, std::string const& resume_file, alert_handl
 		, metadata_received_alert::alert_type
 		, torrent_finished_alert::alert_type
 		, 0);
+	add_loader(this);
 
 	// we can use the save_resume object to reload torrents. There is a
 	// potential race condition when adding torrents. We may add a torrent
@@ -79,7 +341,10 @@ save_resume::save_resume(session& s, std::string const& resume_file, alert_handl
 	m_ses.set_load_function(std::bind(
 		&save_resume::load_torrent, this, s::_1, s::_2, s::_3));
 
-	int ret = sqlite3_open(resume_file.c_str(), &m_db);
+	// the database is used both by the writer thread and by libtorrent's
+	// thread, loading torrents
+	int ret = sqlite3_open_v2(resume_file.c_str(), &m_db
+		, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, NULL);
 	if (ret != SQLITE_OK)
 	{
 		fprintf(stderr, "Can't open resume file [%s]: %s\n"
@@ -87,256 +352,496 @@ save_resume::save_resume(session& s, std::string const& resume_file, alert_handl
 		return;
 	}
 
+	// with a write-ahead log, a commit only appends to the log, and readers
+	// don't block the writer. With WAL, synchronous=NORMAL can't corrupt the
+	// database, a power loss may only lose the last commits
+	sqlite3_exec(m_db, "PRAGMA journal_mode=WAL;", NULL, 0, NULL);
+	sqlite3_exec(m_db, "PRAGMA synchronous=NORMAL;", NULL, 0, NULL);
+
+	// the info dicts never change, they're stored once per torrent. The
+	// resume rows only hold the state that changes
 	sqlite3_exec(m_db, "CREATE TABLE TORRENTS("
 		"INFOHASH STRING PRIMARY KEY NOT NULL,"
 		"RESUME BLOB NOT NULL);", NULL, 0, NULL);
+	sqlite3_exec(m_db, "CREATE TABLE METADATA("
+		"INFOHASH STRING PRIMARY KEY NOT NULL,"
+		"INFO BLOB NOT NULL);", NULL, 0, NULL);
 
 	// ignore errors, since the table is likely to already
 	// exist (and sqlite doesn't give a reasonable way to
 	// know what failed programatically).
+
+	if (sqlite3_prepare_v2(m_db, "INSERT OR REPLACE INTO TORRENTS(INFOHASH,RESUME) "
+		"VALUES(?, ?);", -1, &m_insert, NULL) != SQLITE_OK)
+		fprintf(stderr, "failed to prepare insert statement: %s\n", sqlite3_errmsg(m_db));
+	if (sqlite3_prepare_v2(m_db, "DELETE FROM TORRENTS WHERE INFOHASH = :ih;"
+		, -1, &m_delete, NULL) != SQLITE_OK)
+		fprintf(stderr, "failed to prepare remove statement: %s\n", sqlite3_errmsg(m_db));
+	if (sqlite3_prepare_v2(m_db, "SELECT RESUME FROM TORRENTS WHERE INFOHASH = :ih;"
+		, -1, &m_select, NULL) != SQLITE_OK)
+		fprintf(stderr, "failed to prepare select statement: %s\n", sqlite3_errmsg(m_db));
+	if (sqlite3_prepare_v2(m_db, "INSERT OR REPLACE INTO METADATA(INFOHASH,INFO) "
+		"VALUES(?, ?);", -1, &m_insert_info, NULL) != SQLITE_OK)
+		fprintf(stderr, "failed to prepare insert statement: %s\n", sqlite3_errmsg(m_db));
+	if (sqlite3_prepare_v2(m_db, "DELETE FROM METADATA WHERE INFOHASH = :ih;"
+		, -1, &m_delete_info, NULL) != SQLITE_OK)
+		fprintf(stderr, "failed to prepare remove statement: %s\n", sqlite3_errmsg(m_db));
+	if (sqlite3_prepare_v2(m_db, "SELECT INFO FROM METADATA WHERE INFOHASH = :ih;"
+		, -1, &m_select_info, NULL) != SQLITE_OK)
+		fprintf(stderr, "failed to prepare select statement: %s\n", sqlite3_errmsg(m_db));
+
+	// the torrents whose info dict is stored don't need libtorrent to
+	// include it in their resume data
+	sqlite3_stmt* stmt = NULL;
+	if (sqlite3_prepare_v2(m_db, "SELECT INFOHASH FROM METADATA;", -1, &stmt, NULL) == SQLITE_OK)
+	{
+		while (sqlite3_step(stmt) == SQLITE_ROW)
+		{
+			if (sqlite3_column_bytes(stmt, 0) != 40) continue;
+			sha1_hash ih;
+			if (from_hex((char const*)sqlite3_column_text(stmt, 0), 40, (char*)&ih[0]))
+				m_stored_info.insert(ih);
+		}
+	}
+	sqlite3_finalize(stmt);
+
+	m_writer = std::thread(&save_resume::writer_thread, this);
 }
 
 save_resume::~save_resume()
 {
+	remove_loader(this);
 	m_alerts->unsubscribe(this);
+
+	if (m_loader.joinable())
+	{
+		std::unique_lock<std::mutex> l(m_load_mutex);
+		m_load_abort = true;
+		m_load_cond.notify_all();
+		l.unlock();
+		m_loader.join();
+	}
+
+	// the writer commits everything still queued before it exits
+	if (m_writer.joinable())
+	{
+		std::unique_lock<std::mutex> l(m_queue_mutex);
+		m_quit = true;
+		m_queue_cond.notify_all();
+		l.unlock();
+		m_writer.join();
+	}
+
+	sqlite3_finalize(m_insert);
+	sqlite3_finalize(m_delete);
+	sqlite3_finalize(m_select);
+	sqlite3_finalize(m_insert_info);
+	sqlite3_finalize(m_delete_info);
+	sqlite3_finalize(m_select_info);
 	sqlite3_close(m_db);
 	m_db = NULL;
 }
 
+void save_resume::queue_write(pending_write const& w)
+{
+	// without a database, there's nothing to wait for
+	if (!m_writer.joinable())
+	{
+		unpin(w.handle);
+		return;
+	}
+
+	std::unique_lock<std::mutex> l(m_queue_mutex);
+	m_queue.push_back(w);
+	++m_num_writes;
+	if (m_queue.size() == 1 || int(m_queue.size()) >= max_batch)
+		m_queue_cond.notify_all();
+}
+
+void save_resume::writer_thread()
+{
+	std::vector<pending_write> batch;
+	std::vector<char> buf;
+	std::vector<char> record;
+	std::vector<char> info;
+
+	// the torrents whose info dict was written in the current batch
+	std::vector<sha1_hash> stored_info;
+
+	std::unique_lock<std::mutex> l(m_queue_mutex);
+	for (;;)
+	{
+		while (m_queue.empty() && !m_quit)
+			m_queue_cond.wait(l);
+		if (m_queue.empty()) break;
+
+		// let more writes join this batch, to commit them all at once
+		std::chrono::steady_clock::time_point const deadline
+			= std::chrono::steady_clock::now() + std::chrono::milliseconds(commit_delay);
+		while (!m_quit && int(m_queue.size()) < max_batch
+			&& m_queue_cond.wait_until(l, deadline) != std::cv_status::timeout);
+
+		int const num = (std::min)(int(m_queue.size()), int(max_batch));
+		batch.assign(m_queue.begin(), m_queue.begin() + num);
+		m_queue.erase(m_queue.begin(), m_queue.begin() + num);
+		l.unlock();
+
+		sqlite3_exec(m_db, "BEGIN;", NULL, 0, NULL);
+		for (std::vector<pending_write>::iterator i = batch.begin()
+			, end(batch.end()); i != end; ++i)
+		{
+			std::string const ih = to_hex(i->info_hash.to_string());
+			if (!i->resume_data)
+			{
+				step_statement(m_db, m_delete, ih, NULL);
+				step_statement(m_db, m_delete_info, ih, NULL);
+				printf("removing %s\n", ih.c_str());
+				continue;
+			}
+
+			split_resume(*i->resume_data, buf, info);
+			compress_record(buf, record);
+			if (!info.empty() && step_statement(m_db, m_insert_info, ih, &info))
+				stored_info.push_back(i->info_hash);
+			if (step_statement(m_db, m_insert, ih, &record))
+			{
+				printf("saving %s [ %d bytes%s ]\n", ih.c_str(), int(record.size())
+					, info.empty() ? "" : " + info dict");
+			}
+		}
+		bool const committed = sqlite3_exec(m_db, "COMMIT;", NULL, 0, NULL) == SQLITE_OK;
+		if (!committed)
+		{
+			fprintf(stderr, "failed to commit resume data: %s\n", sqlite3_errmsg(m_db));
+			sqlite3_exec(m_db, "ROLLBACK;", NULL, 0, NULL);
+			stored_info.clear();
+		}
+
+		// once the resume data is safely stored, the torrents may be
+		// unloaded, to be loaded back from it
+		for (std::vector<pending_write>::iterator i = batch.begin()
+			, end(batch.end()); i != end; ++i)
+		{
+			unpin(i->handle);
+		}
+		batch.clear();
+
+		l.lock();
+		m_num_writes -= num;
+		m_committed_info.insert(m_committed_info.end(), stored_info.begin()
+			, stored_info.end());
+		stored_info.clear();
+	}
+}
+
 void save_resume::load_torrent(libtorrent::sha1_hash const& ih
 	, std::vector<char>& buf, libtorrent::error_code& ec)
 {
 	ec.clear();
 
-	sqlite3_stmt* stmt = NULL;
-	int ret = sqlite3_prepare_v2(m_db
-		, "SELECT RESUME FROM TORRENTS WHERE INFOHASH = :ih;", -1, &stmt, NULL);
-
-	if (ret != SQLITE_OK)
+	// this is only called from libtorrent's thread, which is the only user
+	// of the select statements. Loading a torrent only needs its info dict.
+	// Torrents saved before the info dicts were stored on their own have it
+	// in their resume data
+	std::string const ih_string = to_hex(ih.to_string());
+	if (fetch_blob(m_db, m_select_info, ih_string, buf))
 	{
-		printf("failed to prepare select statement: %s\n", sqlite3_errmsg(m_db));
-		ec.assign(boost::system::errc::no_such_file_or_directory, boost::system::generic_category());
+		static char const prefix[] = "d4:info";
+		buf.insert(buf.begin(), prefix, prefix + 7);
+		buf.push_back('e');
 		return;
 	}
-	std::string ih_string = to_hex(ih.to_string());
-	ret = sqlite3_bind_text(stmt, 1, ih_string.c_str(), 40, SQLITE_STATIC);
-	if (ret != SQLITE_OK)
-	{
-		printf("failed to bind select statement: %s\n", sqlite3_errmsg(m_db));
-		ec.assign(boost::system::errc::no_such_file_or_directory, boost::system::generic_category());
-		sqlite3_finalize(stmt);
+
+	std::vector<char> record;
+	if (fetch_blob(m_db, m_select, ih_string, record) && !record.empty()
+		&& decompress_record(&record[0], record.size(), buf))
 		return;
-	}
-	ret = sqlite3_step(stmt);
-	if (ret != SQLITE_ROW)
+
+	ec.assign(boost::system::errc::no_such_file_or_directory, boost::system::generic_category());
+}
+
+bool save_resume::has_torrent(torrent_handle const& h) const
+{
+	return m_torrents.count(h) > 0;
+}
+
+bool save_resume::can_unload(torrent_handle const& h) const
+{
+	torrents_t::const_iterator i = m_torrents.find(h);
+	return i != m_torrents.end() && m_stored_info.count(i->second) > 0;
+}
+
+void save_resume::set_kept(torrent_handle const& h, bool keep)
+{
+	std::unique_lock<std::mutex> l(m_kept_mutex);
+	if (keep) m_kept.insert(h);
+	else m_kept.erase(h);
+}
+
+void save_resume::unpin(torrent_handle const& h)
+{
+	if (!h.is_valid()) return;
+	// the lock is held while unpinning, for set_kept() followed by
+	// set_pinned(true) to never be undone by an unpin that saw the torrent
+	// as not kept
+	std::unique_lock<std::mutex> l(m_kept_mutex);
+	if (m_kept.count(h)) return;
+	h.set_pinned(false);
+}
+
+void save_resume::pick_up_committed_info()
+{
+	std::vector<sha1_hash> committed;
 	{
-		printf("failed to step remove statement: %s\n", sqlite3_errmsg(m_db));
-		ec.assign(boost::system::errc::no_such_file_or_directory, boost::system::generic_category());
-		sqlite3_finalize(stmt);
-		return;
+		std::unique_lock<std::mutex> l(m_queue_mutex);
+		if (m_committed_info.empty()) return;
+		committed.swap(m_committed_info);
 	}
 
-	int bytes = sqlite3_column_bytes(stmt, 0);
-	if (bytes == 0)
+	for (std::vector<sha1_hash>::iterator i = committed.begin()
+		, end(committed.end()); i != end; ++i)
 	{
-		printf("empty resume data buffer");
-		ec.assign(boost::system::errc::no_such_file_or_directory, boost::system::generic_category());
-		sqlite3_finalize(stmt);
-		return;
+		// the torrent may have been removed, and its info dict deleted,
+		// since it was written
+		if (m_pending_info.erase(*i) == 0) continue;
+		m_stored_info.insert(*i);
 	}
-
-	void const* buffer = sqlite3_column_blob(stmt, 0);
-	buf.assign((char*)buffer, ((char*)buffer) + bytes);
-
-	sqlite3_step(stmt);
-	sqlite3_finalize(stmt);
 }
 
 void save_resume::handle_alert(alert const* a)
 {
+	pick_up_committed_info();
+
 	add_torrent_alert const* ta = alert_cast<add_torrent_alert>(a);
 	torrent_removed_alert const* td = alert_cast<torrent_removed_alert>(a);
 	save_resume_data_alert const* sr = alert_cast<save_resume_data_alert>(a);
 	save_resume_data_failed_alert const* sf = alert_cast<save_resume_data_failed_alert>(a);
 	metadata_received_alert const* mr = alert_cast<metadata_received_alert>(a);
 	torrent_finished_alert const* tf = alert_cast<torrent_finished_alert>(a);
+
+	// the torrent whose labels were just loaded from its resume data. They
+	// don't need saving again
+	torrent_handle loaded_labels;
 	if (ta)
 	{
+		// torrents added by the loader make room for more
+		if (ta->params.userdata == this)
+		{
+			std::unique_lock<std::mutex> l(m_load_mutex);
+			// the alert of an add the loader gave up waiting for
+			if (m_outstanding_adds > 0) --m_outstanding_adds;
+			else if (m_load_stats.lost > 0) --m_load_stats.lost;
+			if (ta->error) ++m_load_stats.failed;
+			else ++m_load_stats.added;
+			m_load_cond.notify_all();
+		}
+
 		torrent_status st = ta->handle.status(torrent_handle::query_name);
+
+		// the history added the torrent before us, it subscribed first
+		std::vector<std::string> labels;
+		bdecode_node rd;
+		error_code ec;
+		if (ta->params.userdata == this && !ta->error
+			&& !ta->params.resume_data.empty()
+			&& bdecode(&ta->params.resume_data[0], &ta->params.resume_data[0]
+				+ ta->params.resume_data.size(), rd, ec) == 0
+			&& rd.type() == bdecode_node::dict_t)
+		{
+			bdecode_node l = rd.dict_find_list(labels_key);
+			for (int i = 0; i < l.list_size(); ++i)
+			{
+				if (l.list_at(i).type() != bdecode_node::string_t) continue;
+				labels.push_back(l.list_string_value_at(i));
+			}
+		}
+		if (!labels.empty() && m_hist->set_labels(st.info_hash, labels))
+			loaded_labels = ta->handle;
+
 		printf("added torrent: %s\n", st.name.c_str());
-		m_torrents.insert(ta->handle);
+		m_torrents.insert(std::make_pair(ta->handle, st.info_hash));
 		if (st.has_metadata)
 		{
-			ta->handle.save_resume_data(torrent_handle::save_info_dict | torrent_handle::only_if_modified);
-			++m_num_in_flight;
+			save_torrent(ta->handle);
 		}
-
-		if (m_cursor == m_torrents.end())
-			m_cursor = m_torrents.begin();
 	}
 	else if (mr)
 	{
-		mr->handle.save_resume_data(torrent_handle::save_info_dict | torrent_handle::only_if_modified);
-		++m_num_in_flight;
+		save_torrent(mr->handle);
 	}
 	else if (tf)
 	{
-		tf->handle.save_resume_data(torrent_handle::save_info_dict | torrent_handle::only_if_modified);
-		++m_num_in_flight;
+		save_torrent(tf->handle);
 	}
 	else if (td)
 	{
-		bool wrapped = false;
-		boost::unordered_set<torrent_handle>::iterator i = m_torrents.find(td->handle);
+		torrents_t::iterator i = m_torrents.find(td->handle);
 		if (i == m_torrents.end())
 		{
-			// this is a bit sad...
-			// maybe this should be a bimap, so we can look it up by info-hash as well
+			// the handle is no longer valid, look it up by info-hash
 			for (i = m_torrents.begin(); i != m_torrents.end(); ++i)
 			{
-				if (!i->is_valid()) continue;
-				if (i->info_hash() == td->info_hash)
+				if (i->second == td->info_hash)
 					break;
 			}
 			if (i == m_torrents.end()) return;
 		}
-		if (m_cursor == i)
-		{
-			++m_cursor;
-			if (m_cursor == m_torrents.end())
-				wrapped = true;
-		}
-
+		clear_dirty(i->first);
+		m_labels_changed.erase(i->first);
+		set_kept(i->first, false);
 		m_torrents.erase(i);
-		if (wrapped)
-			m_cursor = m_torrents.begin();
-
-		// we need to delete the resume file from the resume directory
-		// as well, to prevent it from being reloaded on next startup
-		sqlite3_stmt* stmt = NULL;
-		int ret = sqlite3_prepare_v2(m_db, "DELETE FROM TORRENTS WHERE INFOHASH = :ih;", -1, &stmt, NULL);
-		if (ret != SQLITE_OK)
-		{
-			printf("failed to prepare remove statement: %s\n", sqlite3_errmsg(m_db));
-			return;
-		}
-		std::string ih = to_hex(td->info_hash.to_string());
-		ret = sqlite3_bind_text(stmt, 1, ih.c_str(), 40, SQLITE_STATIC);
-		if (ret != SQLITE_OK)
-		{
-			printf("failed to bind remove statement: %s\n", sqlite3_errmsg(m_db));
-			sqlite3_finalize(stmt);
-			return;
-		}
-		ret = sqlite3_step(stmt);
-		if (ret != SQLITE_DONE)
-		{
-			printf("failed to step remove statement: %s\n", sqlite3_errmsg(m_db));
-			sqlite3_finalize(stmt);
-			return;
-		}
+		m_stored_info.erase(td->info_hash);
+		m_pending_info.erase(td->info_hash);
 
-		sqlite3_finalize(stmt);
-		printf("removing %s\n", ih.c_str());
+		// we need to delete the resume data from the database as well, to
+		// prevent it from being reloaded on next startup
+		pending_write w;
+		w.info_hash = td->info_hash;
+		queue_write(w);
 	}
 	else if (sr)
 	{
-		TORRENT_ASSERT(m_num_in_flight > 0);
-		--m_num_in_flight;
-		error_code ec;
-		std::vector<char> buf;
-		bencode(std::back_inserter(buf), *sr->resume_data);
-
-		sqlite3_stmt* stmt = NULL;
-		int ret = sqlite3_prepare_v2(m_db, "INSERT OR REPLACE INTO TORRENTS(INFOHASH,RESUME) "
-			"VALUES(?, ?);", -1, &stmt, NULL);
-		if (ret != SQLITE_OK)
-		{
-			fprintf(stderr, "failed to prepare insert statement: %s\n", sqlite3_errmsg(m_db));
-			return;
-		}
+		// resume data may also have been asked for by someone else, like a
+		// replayed alert trace
+		if (m_num_in_flight > 0) --m_num_in_flight;
 
-		std::string ih = to_hex((*sr->resume_data)["info-hash"].string());
-		ret = sqlite3_bind_text(stmt, 1, ih.c_str(), 40, SQLITE_STATIC);
-		if (ret != SQLITE_OK)
-		{
-			printf("failed to bind insert statement: %s\n", sqlite3_errmsg(m_db));
-			sqlite3_finalize(stmt);
-			return;
-		}
-		ret = sqlite3_bind_blob(stmt, 2, &buf[0], buf.size(), SQLITE_STATIC);
-		if (ret != SQLITE_OK)
-		{
-			printf("failed to bind insert statement: %s\n", sqlite3_errmsg(m_db));
-			sqlite3_finalize(stmt);
-			return;
-		}
+		// the entry is bencoded by the writer thread. The torrent stays
+		// pinned until its resume data is committed
+		pending_write w;
+		w.handle = sr->handle;
+		w.info_hash = sha1_hash((*sr->resume_data)["info-hash"].string());
+		w.resume_data = sr->resume_data;
 
-		ret = sqlite3_step(stmt);
-		if (ret != SQLITE_DONE)
+		// the labels are the ones of the torrent now, they may have changed
+		// again since the resume data was asked for. That's picked up as a
+		// change of its own
+		std::vector<history_entry_ptr> entries;
+		m_hist->get_torrents(std::vector<sha1_hash>(1, w.info_hash), entries);
+		if (!entries.empty() && entries[0]->labels)
 		{
-			printf("failed to step insert statement: %s\n", sqlite3_errmsg(m_db));
-			sqlite3_finalize(stmt);
-			return;
+			entry::list_type& l = (*sr->resume_data)[labels_key].list();
+			std::vector<std::string> const& labels = *entries[0]->labels;
+			for (std::vector<std::string>::const_iterator i = labels.begin()
+				, end(labels.end()); i != end; ++i)
+			{
+				l.push_back(entry(*i));
+			}
 		}
-		sqlite3_finalize(stmt);
-		printf("saving %s\n", ih.c_str());
+		queue_write(w);
 
-		sr->handle.set_pinned(false);
+		// once the writer has committed the info dict, it doesn't need to
+		// be part of the resume data anymore. Until then it's asked for
+		// every time, in case the write fails
+		if (sr->resume_data->find_key("info"))
+			m_pending_info.insert(w.info_hash);
 	}
 	else if (sf)
 	{
-		TORRENT_ASSERT(m_num_in_flight > 0);
-		--m_num_in_flight;
+		if (m_num_in_flight > 0) --m_num_in_flight;
 	}
 	
-	// is it time to save resume data for another torrent?
-	if (m_torrents.empty()) return;
-
 	if (m_shutting_down) return;
 
-	// calculate how many torrents we should save this tick. It depends on
-	// how long since we last tried to save one. Every m_interval seconds,
-	// we should have saved all torrents
-	int num_torrents = m_torrents.size();
-	int seconds_since_last = total_seconds(time_now() - m_last_save);
-	int num_to_save = num_torrents * seconds_since_last /
-		total_seconds(m_interval);
-
-	// never save more than all torrents
-	num_to_save = (std::min)(num_to_save, num_torrents);
+	// pick up the torrents that changed since we last looked. The cursor is
+	// taken before the query, for changes made meanwhile to be seen again
+	// rather than missed
+	int const frame = m_hist->frame();
+	std::vector<history_entry_ptr> changed;
+	m_hist->updated_fields_since(m_hist_frame, changed);
 
-	if (num_to_save > 0)
+	time_point const now = time_now();
+	for (std::vector<history_entry_ptr>::iterator i = changed.begin()
+		, end(changed.end()); i != end; ++i)
 	{
-		printf("saving resume data. [ time: %ds num-torrents: %d interval: %ds ]\n"
-			, seconds_since_last, num_to_save, int(total_seconds(m_interval)));
+		torrent_history_entry const& e = **i;
+		bool const labels_changed = e.labels_frame > m_hist_frame
+			&& e.labels_frame > 0 && e.status.handle != loaded_labels;
+		if (!e.status.need_save_resume && !labels_changed) continue;
+
+		// the history may be shared with other sessions. Only the torrents
+		// of this one are saved here
+		if (m_torrents.count(e.status.handle) == 0) continue;
+
+		// changes the user made, or the torrent finishing, are saved soon.
+		// Transfer progress alone is saved once it's been pending for
+		// m_interval, batching all changes made until then
+		bool urgent = labels_changed;
+		if (labels_changed) m_labels_changed.insert(e.status.handle);
+		for (int k = 0; k < int(sizeof(urgent_fields)/sizeof(urgent_fields[0])); ++k)
+			urgent |= e.frame(urgent_fields[k]) > m_hist_frame;
+
+		mark_dirty(e.status.handle, now + (urgent ? seconds(urgent_delay) : m_interval));
 	}
+	m_hist_frame = frame;
 
-	while (num_to_save > 0)
+	// save the torrents that are due, the ones that have waited the longest
+	// first. Only so many saves are outstanding at a time
+	while (!m_save_queue.empty()
+		&& m_save_queue.begin()->first <= now
+		&& m_num_in_flight < max_saves_in_flight)
 	{
-		if (m_cursor == m_torrents.end())
-			m_cursor = m_torrents.begin();
+		torrent_handle h = m_save_queue.begin()->second;
+		save_torrent(h);
+	}
+}
 
-		m_cursor->save_resume_data(torrent_handle::save_info_dict
-			| torrent_handle::only_if_modified);
-		printf("saving resume data for: %s\n", m_cursor->status().name.c_str());
-		++m_num_in_flight;
-		--num_to_save;
-		++m_cursor;
+void save_resume::save_torrent(torrent_handle const& h)
+{
+	clear_dirty(h);
+	h.save_resume_data(resume_flags(h));
+	m_labels_changed.erase(h);
+	++m_num_in_flight;
+}
 
-		m_last_save = time_now();
+int save_resume::resume_flags(torrent_handle const& h) const
+{
+	int const modified = m_labels_changed.count(h)
+		? 0 : int(torrent_handle::only_if_modified);
+	torrents_t::const_iterator i = m_torrents.find(h);
+	if (i != m_torrents.end() && m_stored_info.count(i->second))
+		return modified;
+	return torrent_handle::save_info_dict | modified;
+}
+
+void save_resume::mark_dirty(torrent_handle const& h, time_point deadline)
+{
+	dirty_set_t::iterator i = m_dirty.find(h);
+	if (i != m_dirty.end())
+	{
+		// keep the earliest deadline
+		if (i->second->first <= deadline) return;
+		m_save_queue.erase(i->second);
+		i->second = m_save_queue.insert(std::make_pair(deadline, h));
+		return;
 	}
+	m_dirty.insert(std::make_pair(h, m_save_queue.insert(std::make_pair(deadline, h))));
+}
+
+void save_resume::clear_dirty(torrent_handle const& h)
+{
+	dirty_set_t::iterator i = m_dirty.find(h);
+	if (i == m_dirty.end()) return;
+	m_save_queue.erase(i->second);
+	m_dirty.erase(i);
 }
 
 void save_resume::save_all()
 {
-	for (boost::unordered_set<torrent_handle>::iterator i = m_torrents.begin()
+	for (torrents_t::iterator i = m_torrents.begin()
 		, end(m_torrents.end()); i != end; ++i)
 	{
-		i->save_resume_data(torrent_handle::save_info_dict | torrent_handle::only_if_modified);
+		i->first.save_resume_data(resume_flags(i->first));
 		++m_num_in_flight;
 	}
+	m_labels_changed.clear();
+	m_dirty.clear();
+	m_save_queue.clear();
 	m_shutting_down = true;
+
+	// don't add any more torrents when we're about to quit
+	std::unique_lock<std::mutex> l(m_load_mutex);
+	m_load_abort = true;
+	m_load_cond.notify_all();
 }
 
 bool save_resume::ok_to_quit() const
@@ -346,40 +851,236 @@ bool save_resume::ok_to_quit() const
 	printf("\r%d %c\x1b[K", m_num_in_flight, bar[spinner]);
 	fflush(stdout);
 	spinner = (spinner + 1) & 3;
-	return m_num_in_flight == 0;
+	std::unique_lock<std::mutex> l(m_queue_mutex);
+	return m_num_in_flight == 0 && m_num_writes == 0;
+}
+
+namespace {
+
+// the order torrents are loaded in at startup
+enum load_priority_t
+{
+	load_seeding,
+	load_downloading,
+	load_queued,
+	load_paused,
+	num_load_priorities
+};
+
+struct resume_row
+{
+	std::int64_t rowid;
+	std::vector<char> resume;
+};
+
+// (load priority, row id)
+typedef std::vector<std::pair<int, std::int64_t> > prioritized_rows;
+
+}
+
+// decodes the resume data of the rows to tell which state the torrents were
+// in when they were saved. Runs on a worker thread
+static prioritized_rows prioritize_rows(std::vector<resume_row> const& rows)
+{
+	prioritized_rows ret;
+	ret.reserve(rows.size());
+	std::vector<char> buf;
+	for (std::vector<resume_row>::const_iterator i = rows.begin()
+		, end(rows.end()); i != end; ++i)
+	{
+		// resume data that doesn't decode is loaded last, for libtorrent to
+		// report the error
+		int prio = load_paused;
+		bdecode_node e;
+		error_code ec;
+		if (!i->resume.empty()
+			&& decompress_record(&i->resume[0], i->resume.size(), buf)
+			&& bdecode(&buf[0], &buf[0] + buf.size(), e, ec) == 0
+			&& e.type() == bdecode_node::dict_t)
+		{
+			if (e.dict_find_int_value("paused", 0))
+				prio = e.dict_find_int_value("auto_managed", 0) ? load_queued : load_paused;
+			else
+				prio = e.dict_find_int_value("completed_time", 0) > 0
+					? load_seeding : load_downloading;
+		}
+		ret.push_back(std::make_pair(prio, i->rowid));
+	}
+	return ret;
 }
 
 void save_resume::load(error_code& ec, add_torrent_params model)
 {
-	sqlite3_stmt* stmt = NULL;
-	int ret = sqlite3_prepare_v2(m_db, "SELECT RESUME FROM TORRENTS;", -1, &stmt, NULL);
-	if (ret != SQLITE_OK)
+	// without a database there's nothing to load
+	if (!m_writer.joinable() || m_loader.joinable()) return;
+	m_loader = std::thread(&save_resume::loader_thread, this, model);
+}
+
+save_resume::load_stats_t save_resume::load_stats() const
+{
+	std::unique_lock<std::mutex> l(m_load_mutex);
+	return m_load_stats;
+}
+
+bool save_resume::add_row(sqlite3_stmt* fetch, std::int64_t rowid
+	, add_torrent_params& p, std::vector<char>& record)
+{
+	std::unique_lock<std::mutex> l(m_load_mutex);
+	while (m_outstanding_adds >= max_outstanding_adds && !m_load_abort)
+	{
+		// alerts are dropped when the alert queue is full. If none of the
+		// add_torrent_alerts arrive for a while, they're not waited for
+		// anymore, to not stall loading forever
+		if (m_load_cond.wait_for(l, std::chrono::seconds(add_timeout)) == std::cv_status::timeout
+			&& m_outstanding_adds >= max_outstanding_adds)
+		{
+			m_load_stats.lost += m_outstanding_adds;
+			m_outstanding_adds = 0;
+		}
+	}
+	if (m_load_abort) return false;
+	l.unlock();
+
+	bool ok = false;
+	sqlite3_bind_int64(fetch, 1, rowid);
+	if (sqlite3_step(fetch) == SQLITE_ROW && sqlite3_column_bytes(fetch, 0) > 0
+		&& decompress_record((char const*)sqlite3_column_blob(fetch, 0)
+			, sqlite3_column_bytes(fetch, 0), record))
+	{
+		join_resume(record, (char const*)sqlite3_column_blob(fetch, 1)
+			, sqlite3_column_bytes(fetch, 1), p.resume_data);
+		ok = true;
+	}
+	sqlite3_reset(fetch);
+
+	if (ok) m_ses.async_add_torrent(p);
+
+	l.lock();
+	if (ok)
+	{
+		++m_outstanding_adds;
+		++m_load_stats.queued;
+	}
+	else
+	{
+		++m_load_stats.failed;
+	}
+	return true;
+}
+
+void save_resume::loader_thread(add_torrent_params model)
+{
+	// the rows are read in batches of this many, and this many batches
+	// at most are being prioritized at a time
+	int const batch_size = 1000;
+	int const max_jobs = (std::max)(2u, std::thread::hardware_concurrency());
+
+	sqlite3_stmt* scan = NULL;
+	sqlite3_stmt* fetch = NULL;
+	if (sqlite3_prepare_v2(m_db, "SELECT ROWID, RESUME FROM TORRENTS "
+			"WHERE ROWID > ? ORDER BY ROWID LIMIT ?;", -1, &scan, NULL) != SQLITE_OK
+		|| sqlite3_prepare_v2(m_db, "SELECT TORRENTS.RESUME, METADATA.INFO FROM TORRENTS "
+			"LEFT JOIN METADATA ON TORRENTS.INFOHASH = METADATA.INFOHASH "
+			"WHERE TORRENTS.ROWID = ?;", -1, &fetch, NULL) != SQLITE_OK)
 	{
 		fprintf(stderr, "failed to prepare select statement: %s\n", sqlite3_errmsg(m_db));
+		sqlite3_finalize(scan);
+		sqlite3_finalize(fetch);
+		std::unique_lock<std::mutex> l(m_load_mutex);
+		m_load_stats.done = true;
 		return;
 	}
 
 	add_torrent_params p = model;
-	ret = sqlite3_step(stmt);
-	while (ret == SQLITE_ROW)
+	p.userdata = this;
+	std::vector<char> record;
+
+	// all rows are read and prioritized. The seeding torrents are added as
+	// soon as they're found, for the others only the row ids are kept, to
+	// not hold on to all resume data at once
+	std::vector<std::int64_t> order[num_load_priorities];
+	int num_seeding = 0;
+	bool abort = false;
+	auto take_rows = [&](prioritized_rows const& rows)
+	{
+		for (prioritized_rows::const_iterator i = rows.begin()
+			, end(rows.end()); i != end && !abort; ++i)
+		{
+			if (i->first != load_seeding)
+			{
+				order[i->first].push_back(i->second);
+				continue;
+			}
+			++num_seeding;
+			abort = !add_row(fetch, i->second, p, record);
+		}
+	};
+
+	std::deque<std::future<prioritized_rows> > jobs;
+	std::int64_t last_row = (std::numeric_limits<std::int64_t>::min)();
+	while (!abort)
 	{
-		int bytes = sqlite3_column_bytes(stmt, 0);
-		if (bytes > 0)
+		std::vector<resume_row> batch;
+		sqlite3_bind_int64(scan, 1, last_row);
+		sqlite3_bind_int(scan, 2, batch_size);
+		while (sqlite3_step(scan) == SQLITE_ROW)
 		{
-			void const* buffer = sqlite3_column_blob(stmt, 0);
-			p.resume_data.assign((char*)buffer, ((char*)buffer) + bytes);
-			m_ses.async_add_torrent(p);
+			batch.push_back(resume_row());
+			resume_row& r = batch.back();
+			r.rowid = sqlite3_column_int64(scan, 0);
+			char const* buffer = (char const*)sqlite3_column_blob(scan, 1);
+			r.resume.assign(buffer, buffer + sqlite3_column_bytes(scan, 1));
+			last_row = r.rowid;
 		}
+		sqlite3_reset(scan);
+		if (batch.empty()) break;
 
-		ret = sqlite3_step(stmt);
+		jobs.push_back(std::async(std::launch::async, &prioritize_rows, std::move(batch)));
+
+		// take the batches that are done, not to wait for a full set of
+		// jobs before adding the first torrents
+		while (!jobs.empty() && !abort && (int(jobs.size()) >= max_jobs
+			|| jobs.front().wait_for(std::chrono::seconds(0)) == std::future_status::ready))
+		{
+			prioritized_rows const rows = jobs.front().get();
+			jobs.pop_front();
+			take_rows(rows);
+		}
+
+		std::unique_lock<std::mutex> l(m_load_mutex);
+		abort = abort || m_load_abort;
 	}
-	if (ret != SQLITE_DONE)
+	while (!jobs.empty())
 	{
-		printf("failed to step select statement: %s\n", sqlite3_errmsg(m_db));
-		sqlite3_finalize(stmt);
-		return;
+		prioritized_rows const rows = jobs.front().get();
+		jobs.pop_front();
+		take_rows(rows);
 	}
-	sqlite3_finalize(stmt);
+	sqlite3_finalize(scan);
+
+	int total = num_seeding;
+	for (int k = 0; k < num_load_priorities; ++k) total += order[k].size();
+	std::unique_lock<std::mutex> l(m_load_mutex);
+	m_load_stats.total = total;
+	l.unlock();
+
+	printf("loading %d torrents [ seeding: %d downloading: %d queued: %d paused: %d ]\n"
+		, total, num_seeding, int(order[load_downloading].size())
+		, int(order[load_queued].size()), int(order[load_paused].size()));
+
+	// then the rest are handed to the session in priority order
+	for (int k = 0; k < num_load_priorities && !abort; ++k)
+	{
+		for (std::vector<std::int64_t>::iterator i = order[k].begin()
+			, end(order[k].end()); i != end && !abort; ++i)
+		{
+			abort = !add_row(fetch, *i, p, record);
+		}
+	}
+	sqlite3_finalize(fetch);
+
+	l.lock();
+	m_load_stats.done = true;
 }
 
 }
@@ -37,25 +37,74 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/deadline_timer.hpp"
 #include "libtorrent/io_service.hpp"
 #include "libtorrent/error_code.hpp"
+#include "libtorrent/entry.hpp"
 #include "alert_observer.hpp"
 
 #include <string>
 #include <map>
 #include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
 
 #include <sqlite3.h>
 
 namespace libtorrent
 {
 	struct alert_handler;
+	struct torrent_history;
 
 	struct save_resume : alert_observer
 	{
-		save_resume(session& s, std::string const& resume_file, alert_handler* alerts);
+		// resume data is saved for the torrents hist reports as needing it.
+		// The torrents' labels are saved along with it, and handed back to
+		// hist when the torrents are loaded
+		save_resume(session& s, std::string const& resume_file
+			, alert_handler* alerts, torrent_history* hist);
 		~save_resume();
 
+		// starts adding the torrents in the resume database to the session.
+		// This returns right away, the torrents are added in the background.
+		// Torrents that were running and are complete are added first, as
+		// soon as they're found, then the other running ones, then the
+		// queued, and last the paused ones. Only a bounded number of adds
+		// are outstanding at a time, to not flood the session
 		void load(error_code& ec, add_torrent_params model);
 
+		struct load_stats_t
+		{
+			load_stats_t(): total(0), queued(0), added(0), failed(0), lost(0)
+				, done(false) {}
+
+			// the number of torrents in the resume database. This is only
+			// known once all of them have been prioritized
+			int total;
+
+			// the number of torrents handed to the session so far
+			int queued;
+
+			// the number of torrents the session has finished adding, and that
+			// failed to be added
+			int added;
+			int failed;
+
+			// the number of torrents handed to the session that no
+			// add_torrent_alert arrived for in time. Their alerts were most
+			// likely dropped, the loader stopped waiting for them
+			int lost;
+
+			// true once all torrents have been handed to the session
+			bool done;
+		};
+
+		// the progress of loading the torrents at startup. It's also
+		// exported along with the RPC metrics, as resume.load.*, summed up
+		// over all save_resume objects
+		load_stats_t load_stats() const;
+
 		// implements alert_observer
 		virtual void handle_alert(alert const* a);
 
@@ -65,25 +114,151 @@ namespace libtorrent
 		void load_torrent(libtorrent::sha1_hash const& ih
 			, std::vector<char>& buf, libtorrent::error_code& ec);
 
+		// true if the torrent is in this save_resume's session
+		bool has_torrent(torrent_handle const& h) const;
+
+		// true if the torrent's info dict has been stored, for it to be
+		// loaded back if it's unloaded. These are only to be called from
+		// the alert thread
+		bool can_unload(torrent_handle const& h) const;
+
+		// marks the torrent as kept pinned by someone else, the
+		// torrent_unloader. Committing its resume data then leaves it
+		// pinned. This may be called from any thread
+		void set_kept(torrent_handle const& h, bool keep);
+
 	private:
 
+		// unpins the torrent, unless it's kept pinned by someone else
+		void unpin(torrent_handle const& h);
+
+		// resume data is written to the database by a separate thread, to
+		// never have alert dispatch wait for the disk. The writes are
+		// committed in batches
+		void writer_thread();
+
+		struct pending_write
+		{
+			// the torrent to unpin once its resume data is committed. Invalid
+			// for removals
+			torrent_handle handle;
+			sha1_hash info_hash;
+
+			// NULL means the torrent is to be removed from the database
+			boost::shared_ptr<entry> resume_data;
+		};
+
+		void queue_write(pending_write const& w);
+
+		void loader_thread(add_torrent_params model);
+
+		// waits for room for one more outstanding add, and adds the torrent
+		// in the row to the session. Returns false if loading is aborted
+		bool add_row(sqlite3_stmt* fetch, std::int64_t rowid
+			, add_torrent_params& p, std::vector<char>& record);
+
+		// asks for the resume data, and takes the torrent off the dirty set
+		void save_torrent(torrent_handle const& h);
+
+		// schedules the torrent to be saved no later than deadline
+		void mark_dirty(torrent_handle const& h, time_point deadline);
+		void clear_dirty(torrent_handle const& h);
+
 		session& m_ses;
 		alert_handler* m_alerts;
+		torrent_history* m_hist;
 		sqlite3* m_db;
 
-		// all torrents currently loaded
-		boost::unordered_set<torrent_handle> m_torrents;
+		// prepared once, and reused for every row. The insert and delete
+		// statements are only used by the writer thread
+		sqlite3_stmt* m_insert;
+		sqlite3_stmt* m_delete;
+		sqlite3_stmt* m_select;
+		sqlite3_stmt* m_insert_info;
+		sqlite3_stmt* m_delete_info;
+		sqlite3_stmt* m_select_info;
+
+		// a batch is committed when it has this many writes, or when the
+		// first write in it has waited this many milliseconds
+		enum { max_batch = 512, commit_delay = 500 };
+
+		mutable std::mutex m_queue_mutex;
+		std::condition_variable m_queue_cond;
+		std::deque<pending_write> m_queue;
+
+		// the number of writes queued or being committed. Protected by
+		// m_queue_mutex
+		int m_num_writes;
+		bool m_quit;
+
+		// the torrents whose info dict the writer has committed, for the
+		// alert thread to add them to m_stored_info. Protected by
+		// m_queue_mutex
+		std::vector<sha1_hash> m_committed_info;
+
+		std::thread m_writer;
+
+		// the number of torrents the loader can have handed to the session
+		// and not seen the add_torrent_alert for yet. If no alert arrives for
+		// add_timeout seconds while it's waiting, the outstanding adds are
+		// counted as lost
+		enum { max_outstanding_adds = 50, add_timeout = 10 };
+
+		mutable std::mutex m_load_mutex;
+		std::condition_variable m_load_cond;
+		load_stats_t m_load_stats;
+		int m_outstanding_adds;
+		bool m_load_abort;
+
+		std::thread m_loader;
 
-		// the next torrent to save (may point to end)
-		boost::unordered_set<torrent_handle>::iterator m_cursor;
+		// the save_resume_data flags to use for the torrent. The info dict is
+		// only asked for until it's been stored
+		int resume_flags(torrent_handle const& h) const;
 
-		// the last time we visited a torrent to potentially
-		// save its fast-resume
-		time_point m_last_save;
+		// all torrents currently loaded, and their info-hashes
+		typedef boost::unordered_map<torrent_handle, sha1_hash> torrents_t;
+		torrents_t m_torrents;
 
-		// save resum data for all torrents every X seconds
-		// must be at least 1
+		// the torrents set_kept() was called for. They're not unpinned once
+		// their resume data is committed
+		mutable std::mutex m_kept_mutex;
+		boost::unordered_set<torrent_handle> m_kept;
+
+		// the torrents whose info dict is in the database
+		boost::unordered_set<sha1_hash> m_stored_info;
+
+		// the torrents whose info dict has been handed to the writer, but
+		// isn't known to be committed yet
+		boost::unordered_set<sha1_hash> m_pending_info;
+
+		// moves the torrents in m_committed_info to m_stored_info, unless
+		// they've been removed since
+		void pick_up_committed_info();
+
+		// the torrents whose labels changed since their resume data was last
+		// asked for. libtorrent doesn't know about labels, their resume data
+		// has to be asked for even if it considers it unmodified
+		boost::unordered_set<torrent_handle> m_labels_changed;
+
+		// the torrents with resume data to save, ordered by when they're due
+		typedef std::multimap<time_point, torrent_handle> save_queue_t;
+		save_queue_t m_save_queue;
+
+		// the torrents in m_save_queue, and where they are in it
+		typedef boost::unordered_map<torrent_handle, save_queue_t::iterator> dirty_set_t;
+		dirty_set_t m_dirty;
+
+		// the torrent_history frame we last picked up changes from
+		int m_hist_frame;
+
+		// the longest resume data is left unsaved. Changes the user makes
+		// are saved after urgent_delay seconds
 		time_duration m_interval;
+		enum { urgent_delay = 10 };
+
+		// the most save_resume_data calls to have outstanding
+		enum { max_saves_in_flight = 100 };
 
 		int m_num_in_flight;
 
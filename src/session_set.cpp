@@ -0,0 +1,182 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "session_set.hpp"
+#include "alert_handler.hpp"
+#include "torrent_history.hpp"
+
+#include "libtorrent/torrent_info.hpp"
+
+#include <functional>
+
+namespace libtorrent
+{
+	session_set::session_set(session& primary, torrent_history* hist)
+		: m_hist(hist)
+		, m_next(0)
+		, m_abort(false)
+	{
+		member m;
+		m.ses = &primary;
+		m.alerts = NULL;
+		m_sessions.push_back(m);
+	}
+
+	session_set::~session_set()
+	{
+		stop();
+	}
+
+	int session_set::add(session& ses, alert_handler* alerts)
+	{
+		int const index = int(m_sessions.size());
+		if (m_hist)
+		{
+			int const source = m_hist->add_source(alerts);
+			TORRENT_ASSERT(source == index);
+		}
+
+		member m;
+		m.ses = &ses;
+		m.alerts = alerts;
+		m.loop = std::make_shared<std::thread>(
+			std::bind(&session_set::run_alert_loop, this, &ses, alerts));
+		m_sessions.push_back(m);
+		return index;
+	}
+
+	void session_set::run_alert_loop(session* ses, alert_handler* alerts)
+	{
+		alerts->run([=]
+		{
+			if (m_abort) return false;
+			ses->post_torrent_updates();
+			return true;
+		});
+	}
+
+	void session_set::stop()
+	{
+		m_abort = true;
+		for (std::vector<member>::iterator i = m_sessions.begin()
+			, end(m_sessions.end()); i != end; ++i)
+		{
+			if (!i->loop) continue;
+			i->loop->join();
+			i->loop.reset();
+		}
+	}
+
+	session& session_set::session_for(add_torrent_params const& p)
+	{
+		if (m_sessions.size() == 1) return primary();
+
+		sha1_hash ih = p.info_hash;
+		if (p.ti) ih = p.ti->info_hash();
+		if (ih.is_all_zeros())
+			return *m_sessions[m_next++ % m_sessions.size()].ses;
+
+		return *m_sessions[hash_value(ih) % m_sessions.size()].ses;
+	}
+
+	torrent_handle session_set::find_torrent(sha1_hash const& ih) const
+	{
+		for (std::vector<member>::const_iterator i = m_sessions.begin()
+			, end(m_sessions.end()); i != end; ++i)
+		{
+			torrent_handle h = i->ses->find_torrent(ih);
+			if (h.is_valid()) return h;
+		}
+		return torrent_handle();
+	}
+
+	std::vector<torrent_handle> session_set::get_torrents() const
+	{
+		std::vector<torrent_handle> ret = m_sessions[0].ses->get_torrents();
+		for (int i = 1; i < int(m_sessions.size()); ++i)
+		{
+			std::vector<torrent_handle> h = m_sessions[i].ses->get_torrents();
+			ret.insert(ret.end(), h.begin(), h.end());
+		}
+		return ret;
+	}
+
+	void session_set::remove_torrent(torrent_handle const& h, int options)
+	{
+		if (m_sessions.size() == 1)
+		{
+			primary().remove_torrent(h, options);
+			return;
+		}
+
+		// a handle doesn't know which session it belongs to. Look for the
+		// session that has this torrent under the same handle
+		sha1_hash const ih = h.info_hash();
+		for (std::vector<member>::iterator i = m_sessions.begin()
+			, end(m_sessions.end()); i != end; ++i)
+		{
+			if (i->ses->find_torrent(ih) != h) continue;
+			i->ses->remove_torrent(h, options);
+			return;
+		}
+	}
+
+	session_status session_set::status() const
+	{
+		session_status ret = m_sessions[0].ses->status();
+		for (int i = 1; i < int(m_sessions.size()); ++i)
+		{
+			session_status const st = m_sessions[i].ses->status();
+			ret.upload_rate += st.upload_rate;
+			ret.download_rate += st.download_rate;
+			ret.payload_upload_rate += st.payload_upload_rate;
+			ret.payload_download_rate += st.payload_download_rate;
+			ret.total_upload += st.total_upload;
+			ret.total_download += st.total_download;
+			ret.total_payload_upload += st.total_payload_upload;
+			ret.total_payload_download += st.total_payload_download;
+			ret.num_peers += st.num_peers;
+			ret.num_unchoked += st.num_unchoked;
+		}
+		return ret;
+	}
+
+	void session_set::apply_settings(settings_pack const& p)
+	{
+		for (std::vector<member>::iterator i = m_sessions.begin()
+			, end(m_sessions.end()); i != end; ++i)
+		{
+			i->ses->apply_settings(p);
+		}
+	}
+}
+
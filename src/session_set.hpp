@@ -0,0 +1,122 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_SESSION_SET_HPP
+#define TORRENT_SESSION_SET_HPP
+
+#include "libtorrent/session.hpp"
+#include "libtorrent/add_torrent_params.hpp"
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <memory>
+
+namespace libtorrent
+{
+	struct alert_handler;
+	struct torrent_history;
+
+	// a number of sessions in this process, fronted by the same web UIs.
+	// Torrents are spread over the sessions, and the commands the UIs issue
+	// are passed on to the session the torrent belongs to, or to all of them.
+	// The first session is the one settings are read from. A session_set
+	// with a single session behaves just like calling the session
+	// directly.
+	struct session_set
+	{
+		// hist, if set, is made to pick up the torrents of the sessions
+		// added to the set
+		explicit session_set(session& primary, torrent_history* hist = NULL);
+		~session_set();
+
+		// adds a session. Its alerts are dispatched by alerts, on a thread
+		// of its own running the alert loop, which also posts the session's
+		// torrent updates. Observers should subscribe to alerts before the
+		// session is added. Returns the session's index, which is the same
+		// as the history's source index for it
+		int add(session& ses, alert_handler* alerts);
+
+		int size() const { return int(m_sessions.size()); }
+		session& at(int i) { return *m_sessions[i].ses; }
+		session& primary() { return *m_sessions[0].ses; }
+
+		// the session a new torrent should be added to. Torrents with a known
+		// info-hash always land in the same session, for adding one twice to
+		// not end up with two copies. The others are spread out round-robin
+		session& session_for(add_torrent_params const& p);
+
+		// the handle of the torrent in whichever session has it
+		torrent_handle find_torrent(sha1_hash const& ih) const;
+
+		// the torrents of all sessions
+		std::vector<torrent_handle> get_torrents() const;
+
+		// removes the torrent from the session it belongs to
+		void remove_torrent(torrent_handle const& h, int options = 0);
+
+		// the status of the first session, with the transfer rates, totals
+		// and peer counts of all of them
+		session_status status() const;
+
+		// applies the settings to every session. Settings that have to
+		// differ between the sessions, like the listen interfaces, should be
+		// applied to each of them directly
+		void apply_settings(settings_pack const& p);
+
+		// stops the alert loops of the added sessions and waits for them to
+		// return. This is called by the destructor, but should be called
+		// before the alert_handlers are destructed
+		void stop();
+
+	private:
+
+		struct member
+		{
+			session* ses;
+			alert_handler* alerts;
+			std::shared_ptr<std::thread> loop;
+		};
+
+		void run_alert_loop(session* ses, alert_handler* alerts);
+
+		std::vector<member> m_sessions;
+		torrent_history* m_hist;
+
+		// the next session to add a torrent without info-hash to
+		std::atomic<unsigned int> m_next;
+
+		std::atomic<bool> m_abort;
+	};
+}
+
+#endif
+
@@ -0,0 +1,162 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "settings_cache.hpp"
+
+#include <algorithm>
+
+namespace libtorrent
+{
+	namespace
+	{
+		int const num_strings = settings_pack::max_string_setting_internal
+			- settings_pack::string_type_base;
+		int const num_ints = settings_pack::max_int_setting_internal
+			- settings_pack::int_type_base;
+		int const num_bools = settings_pack::max_bool_setting_internal
+			- settings_pack::bool_type_base;
+
+		bool same_value(settings_pack const& a, settings_pack const& b, int name)
+		{
+			switch (name & settings_pack::type_mask)
+			{
+				case settings_pack::string_type_base:
+					return a.get_str(name) == b.get_str(name);
+				case settings_pack::int_type_base:
+					return a.get_int(name) == b.get_int(name);
+				case settings_pack::bool_type_base:
+					return a.get_bool(name) == b.get_bool(name);
+			}
+			return true;
+		}
+	}
+
+	settings_cache::settings_cache()
+		: m_frames(num_settings(), 0)
+		, m_frame(0)
+	{}
+
+	int settings_cache::num_settings()
+	{
+		return num_strings + num_ints + num_bools;
+	}
+
+	int settings_cache::index(int name)
+	{
+		if (name >= settings_pack::string_type_base
+			&& name < settings_pack::max_string_setting_internal)
+			return name - settings_pack::string_type_base;
+		if (name >= settings_pack::int_type_base
+			&& name < settings_pack::max_int_setting_internal)
+			return num_strings + name - settings_pack::int_type_base;
+		if (name >= settings_pack::bool_type_base
+			&& name < settings_pack::max_bool_setting_internal)
+			return num_strings + num_ints + name - settings_pack::bool_type_base;
+		return -1;
+	}
+
+	int settings_cache::setting_name(int index)
+	{
+		if (index < num_strings) return settings_pack::string_type_base + index;
+		index -= num_strings;
+		if (index < num_ints) return settings_pack::int_type_base + index;
+		index -= num_ints;
+		return settings_pack::bool_type_base + index;
+	}
+
+	bool settings_cache::update(settings_pack const& s)
+	{
+		std::shared_ptr<settings_pack const> next
+			= std::make_shared<settings_pack const>(s);
+
+		std::unique_lock<std::mutex> l(m_mutex);
+		m_last_update = clock_type::now();
+
+		// the first settings are all stamped with frame 1, for clients at
+		// frame 0 to get all of them
+		if (!m_settings)
+		{
+			m_frame = 1;
+			std::fill(m_frames.begin(), m_frames.end(), 1);
+			m_settings = next;
+			return true;
+		}
+
+		int const frame = m_frame + 1;
+		bool changed = false;
+		for (int i = 0; i < int(m_frames.size()); ++i)
+		{
+			if (same_value(*m_settings, s, setting_name(i))) continue;
+			m_frames[i] = frame;
+			changed = true;
+		}
+		m_settings = next;
+		if (changed) m_frame = frame;
+		return changed;
+	}
+
+	std::shared_ptr<settings_pack const> settings_cache::settings() const
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		return m_settings;
+	}
+
+	int settings_cache::frame() const
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		return m_frame;
+	}
+
+	int settings_cache::setting_frame(int name) const
+	{
+		int const i = index(name);
+		if (i < 0) return -1;
+		std::unique_lock<std::mutex> l(m_mutex);
+		return m_frames[i];
+	}
+
+	void settings_cache::changed_since(int frame, std::vector<int>& names) const
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		for (int i = 0; i < int(m_frames.size()); ++i)
+		{
+			if (m_frames[i] > frame) names.push_back(setting_name(i));
+		}
+	}
+
+	time_point settings_cache::last_update() const
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		return m_last_update;
+	}
+}
+
@@ -0,0 +1,94 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_SETTINGS_CACHE_HPP
+#define TORRENT_SETTINGS_CACHE_HPP
+
+#include "libtorrent/settings_pack.hpp"
+#include "libtorrent/time.hpp"
+
+#include <mutex>
+#include <memory>
+#include <vector>
+
+namespace libtorrent
+{
+	// the settings of a session as of the last time they were read, and the
+	// frame number each one last changed in. Readers get the settings from
+	// here rather than asking the session, which waits for its thread. The
+	// settings are immutable once published, update() replaces them
+	struct settings_cache
+	{
+		settings_cache();
+
+		// records the settings read from the session. The ones that differ
+		// from the previous ones are stamped with a new frame. Returns true
+		// if any did
+		bool update(settings_pack const& s);
+
+		// the settings as of the last update. Empty before the first one
+		std::shared_ptr<settings_pack const> settings() const;
+
+		// the current frame number. Settings that haven't changed since the
+		// first update are stamped with frame 1
+		int frame() const;
+
+		// the frame the setting last changed in, or -1 if name isn't a
+		// setting
+		int setting_frame(int name) const;
+
+		// appends the settings that changed after frame
+		void changed_since(int frame, std::vector<int>& names) const;
+
+		// when update() was last called
+		time_point last_update() const;
+
+		// the index of the setting in the frame list, or -1 if name isn't
+		// a setting. Strings come first, then ints, then bools
+		static int index(int name);
+
+		// the setting at index, the inverse of index()
+		static int setting_name(int index);
+		static int num_settings();
+
+	private:
+
+		mutable std::mutex m_mutex;
+		std::shared_ptr<settings_pack const> m_settings;
+		std::vector<int> m_frames;
+		int m_frame;
+		time_point m_last_update;
+	};
+}
+
+#endif
+
@@ -0,0 +1,219 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "static_assets.hpp"
+
+#include "libtorrent/file.hpp"
+#include "libtorrent/hasher.hpp"
+#include "libtorrent/hex.hpp" // for to_hex
+
+extern "C" {
+#include "local_mongoose.h"
+}
+
+#include <zlib.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace libtorrent
+{
+	namespace
+	{
+		bool read_file(std::string const& path, std::string& ret)
+		{
+			FILE* f = fopen(path.c_str(), "rb");
+			if (f == NULL) return false;
+			ret.clear();
+			char buf[16384];
+			int len;
+			while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+				ret.append(buf, len);
+			bool const ok = ferror(f) == 0;
+			fclose(f);
+			return ok;
+		}
+
+		bool gzip(std::string const& in, std::string& out)
+		{
+			z_stream strm;
+			memset(&strm, 0, sizeof(strm));
+			// 16 + 15 means a gzip header and the largest window
+			if (deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + 15
+				, 9, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+
+			out.resize(deflateBound(&strm, in.size()));
+			strm.next_in = (Bytef*)in.data();
+			strm.avail_in = in.size();
+			strm.next_out = (Bytef*)&out[0];
+			strm.avail_out = out.size();
+			int const ret = deflate(&strm, Z_FINISH);
+			out.resize(strm.total_out);
+			deflateEnd(&strm);
+			return ret == Z_STREAM_END;
+		}
+
+		// true if the If-None-Match header lists the etag
+		bool etag_matches(char const* if_none_match, std::string const& etag)
+		{
+			if (if_none_match == NULL) return false;
+			if (strcmp(if_none_match, "*") == 0) return true;
+			return strstr(if_none_match, etag.c_str()) != NULL;
+		}
+	}
+
+	static_assets::static_assets(std::string const& root, std::string const& prefix)
+		: m_root(root)
+		, m_prefix(prefix)
+		, m_max_age(0)
+	{}
+
+	static_assets::~static_assets() {}
+
+	void static_assets::set_max_age(int seconds)
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		m_max_age = seconds;
+	}
+
+	void static_assets::load(error_code& ec)
+	{
+		assets_t assets;
+		load_dir(m_root, m_prefix, assets, ec);
+		if (ec) return;
+
+		std::unique_lock<std::mutex> l(m_mutex);
+		m_assets.swap(assets);
+	}
+
+	void static_assets::load_dir(std::string const& dir, std::string const& uri
+		, assets_t& assets, error_code& ec)
+	{
+		for (directory d(dir, ec); !ec && !d.done(); d.next(ec))
+		{
+			std::string const name = d.file();
+			if (name.empty() || name[0] == '.') continue;
+
+			std::string const path = combine_path(dir, name);
+			file_status st;
+			error_code sec;
+			stat_file(path, &st, sec);
+			if (sec) continue;
+
+			if (st.mode & file_status::directory)
+			{
+				load_dir(path, uri + name + "/", assets, ec);
+				if (ec) return;
+				continue;
+			}
+			if (st.file_size > max_file_size) continue;
+
+			std::shared_ptr<asset> a = std::make_shared<asset>();
+			if (!read_file(path, a->data)) continue;
+
+			char const* mime = mg_get_builtin_mime_type(name.c_str());
+			a->content_type = mime ? mime : "application/octet-stream";
+
+			// prefer the compressed file built along with it, if there is one
+			if (!read_file(path + ".gz", a->gzip_data) && !gzip(a->data, a->gzip_data))
+				a->gzip_data.clear();
+			if (a->gzip_data.size() >= a->data.size()) a->gzip_data.clear();
+
+			// the two representations need distinct strong etags
+			std::string const hash = to_hex(hasher(a->data.data(), a->data.size())
+				.final().to_string()).substr(0, 20);
+			a->etag = "\"" + hash + "\"";
+			a->gzip_etag = "\"" + hash + "-gz\"";
+
+			assets[uri + name] = a;
+		}
+	}
+
+	bool static_assets::handle_http(mg_connection* conn
+		, mg_request_info const* request_info)
+	{
+		bool const head = strcmp(request_info->request_method, "HEAD") == 0;
+		if (!head && strcmp(request_info->request_method, "GET") != 0) return false;
+
+		std::string uri = request_info->uri;
+		if (!uri.empty() && uri[uri.size()-1] == '/') uri += "index.html";
+
+		std::unique_lock<std::mutex> l(m_mutex);
+		assets_t::const_iterator i = m_assets.find(uri);
+		if (i == m_assets.end()) return false;
+		std::shared_ptr<asset const> a = i->second;
+		int const max_age = m_max_age;
+		l.unlock();
+
+		char const* accept_encoding = mg_get_header(conn, "accept-encoding");
+		bool const gzipped = !a->gzip_data.empty() && accept_encoding
+			&& strstr(accept_encoding, "gzip") != NULL;
+		std::string const& etag = gzipped ? a->gzip_etag : a->etag;
+		std::string const& body = gzipped ? a->gzip_data : a->data;
+
+		char cache_control[50];
+		if (max_age > 0)
+			snprintf(cache_control, sizeof(cache_control), "max-age=%d", max_age);
+		else
+			snprintf(cache_control, sizeof(cache_control), "no-cache");
+
+		if (etag_matches(mg_get_header(conn, "if-none-match"), etag))
+		{
+			mg_printf(conn, "HTTP/1.1 304 Not Modified\r\n"
+				"ETag: %s\r\n"
+				"Cache-Control: %s\r\n"
+				"Vary: Accept-Encoding\r\n\r\n"
+				, etag.c_str(), cache_control);
+			return true;
+		}
+
+		char header[500];
+		int const header_len = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %d\r\n"
+			"ETag: %s\r\n"
+			"Cache-Control: %s\r\n"
+			"Vary: Accept-Encoding\r\n"
+			"%s"
+			"\r\n"
+			, a->content_type, int(body.size()), etag.c_str(), cache_control
+			, gzipped ? "Content-Encoding: gzip\r\n" : "");
+
+		mg_iovec iov[2];
+		iov[0].buf = header;
+		iov[0].len = header_len;
+		iov[1].buf = body.data();
+		iov[1].len = head ? 0 : body.size();
+		mg_writev(conn, iov, 2);
+		return true;
+	}
+}
+
@@ -0,0 +1,106 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_STATIC_ASSETS_HPP
+#define TORRENT_STATIC_ASSETS_HPP
+
+#include "webui.hpp"
+#include "libtorrent/error_code.hpp"
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <boost/unordered_map.hpp>
+
+namespace libtorrent
+{
+	/**
+		Serves the files of a directory from memory. The files are read (and
+		gzip compressed) once, by load(), and served with strong ETags, so a
+		client revalidating a file it has already gets a 304 Not Modified.
+		Requests for anything not loaded are left for the next handler (or
+		mongoose's document root) to serve.
+	*/
+	struct static_assets : http_handler
+	{
+		/// serves the files under root, recursively, for URIs beginning
+		/// with prefix. For example, with root "bt" and prefix "/bt/",
+		/// /bt/dashboard.html is bt/dashboard.html. A URI ending with a / is
+		/// served its index.html
+		static_assets(std::string const& root, std::string const& prefix);
+		~static_assets();
+
+		/// (re)loads all files under the root. Files larger than
+		/// max_file_size are not loaded. If the file foo has a foo.gz next to
+		/// it, that is used as its compressed form, otherwise it's
+		/// compressed here
+		void load(error_code& ec);
+
+		/// the number of seconds clients may use a file without revalidating
+		/// it. Defaults to 0, which means always revalidate
+		void set_max_age(int seconds);
+
+		enum { max_file_size = 8 * 1024 * 1024 };
+
+		virtual bool handle_http(mg_connection* conn
+			, mg_request_info const* request_info);
+
+	private:
+
+		struct asset
+		{
+			char const* content_type;
+			std::string etag;
+			std::string gzip_etag;
+			std::string data;
+
+			// empty if compressing the file doesn't make it smaller
+			std::string gzip_data;
+		};
+		typedef boost::unordered_map<std::string, std::shared_ptr<asset const> > assets_t;
+
+		void load_dir(std::string const& dir, std::string const& uri
+			, assets_t& assets, error_code& ec);
+
+		std::string m_root;
+		std::string m_prefix;
+
+		// protects m_assets and m_max_age. The assets themselves are
+		// immutable once loaded
+		mutable std::mutex m_mutex;
+		assets_t m_assets;
+		int m_max_age;
+	};
+}
+
+#endif
+
@@ -0,0 +1,169 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "stats_frame.hpp"
+#include "libtorrent/io.hpp"
+#include "libtorrent/assert.hpp"
+
+#include <iterator>
+
+namespace libtorrent
+{
+	namespace io = libtorrent::detail;
+
+	stats_frame::stats_frame()
+		: m_seq(0)
+	{
+		for (int b = 0; b < 2; ++b)
+		{
+			for (int i = 0; i < counters::num_counters; ++i)
+			{
+				m_buffers[b].values[i].store(0, std::memory_order_relaxed);
+				m_buffers[b].rates[i].store(0., std::memory_order_relaxed);
+				m_buffers[b].changed[i].store(0, std::memory_order_relaxed);
+			}
+			m_buffers[b].frame.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	int stats_frame::update(std::uint64_t const* values, time_point timestamp)
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		std::uint32_t const seq = m_seq.load(std::memory_order_relaxed);
+		buffer const& cur = m_buffers[seq & 1];
+		buffer& next = m_buffers[(seq + 1) & 1];
+
+		std::uint32_t const frame = cur.frame.load(std::memory_order_relaxed) + 1;
+
+		// the first sample doesn't have anything to compute rates against
+		double const seconds = frame == 1 ? 0.
+			: total_microseconds(timestamp - m_last_update) / 1000000.;
+		m_last_update = timestamp;
+
+		// a reader that sees any of the stores below must also see the
+		// m_seq it started with having been replaced
+		std::atomic_thread_fence(std::memory_order_release);
+
+		int num_changed = 0;
+		for (int i = 0; i < counters::num_counters; ++i)
+		{
+			std::uint64_t const prev = cur.values[i].load(std::memory_order_relaxed);
+			std::uint32_t changed = cur.changed[i].load(std::memory_order_relaxed);
+			double rate = 0.;
+			if (prev != values[i])
+			{
+				changed = frame;
+				++num_changed;
+				if (seconds > 0.) rate = double(std::int64_t(values[i] - prev)) / seconds;
+			}
+			next.values[i].store(values[i], std::memory_order_relaxed);
+			next.rates[i].store(rate, std::memory_order_relaxed);
+			next.changed[i].store(changed, std::memory_order_relaxed);
+		}
+		next.frame.store(frame, std::memory_order_relaxed);
+
+		// publish
+		m_seq.store(seq + 1, std::memory_order_release);
+		return num_changed;
+	}
+
+	std::uint32_t stats_frame::frame() const
+	{
+		return m_buffers[m_seq.load(std::memory_order_acquire) & 1]
+			.frame.load(std::memory_order_relaxed);
+	}
+
+	std::uint64_t stats_frame::value(int idx) const
+	{
+		if (idx < 0 || idx >= counters::num_counters) return 0;
+		for (;;)
+		{
+			std::uint32_t const seq = m_seq.load(std::memory_order_acquire);
+			std::uint64_t const ret = m_buffers[seq & 1].values[idx].load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (m_seq.load(std::memory_order_relaxed) == seq) return ret;
+		}
+	}
+
+	double stats_frame::rate(int idx) const
+	{
+		if (idx < 0 || idx >= counters::num_counters) return 0.;
+		for (;;)
+		{
+			std::uint32_t const seq = m_seq.load(std::memory_order_acquire);
+			double const ret = m_buffers[seq & 1].rates[idx].load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (m_seq.load(std::memory_order_relaxed) == seq) return ret;
+		}
+	}
+
+	void stats_frame::encode(std::uint32_t since, std::vector<int> const& ids
+		, std::vector<char>& out) const
+	{
+		int const start = out.size();
+		for (;;)
+		{
+			out.resize(start);
+			std::back_insert_iterator<std::vector<char> > ptr(out);
+
+			std::uint32_t const seq = m_seq.load(std::memory_order_acquire);
+			buffer const& b = m_buffers[seq & 1];
+			io::write_uint32(b.frame.load(std::memory_order_relaxed), ptr);
+
+			// we'll fill in the counter later
+			int counter_pos = out.size();
+			io::write_uint16(0, ptr);
+
+			int num_updates = 0;
+			for (std::vector<int>::const_iterator i = ids.begin()
+				, end(ids.end()); i != end; ++i)
+			{
+				TORRENT_ASSERT(*i >= 0 && *i < counters::num_counters);
+				if (b.changed[*i].load(std::memory_order_relaxed) <= since) continue;
+				io::write_uint16(*i, ptr);
+				io::write_uint64(b.values[*i].load(std::memory_order_relaxed), ptr);
+				++num_updates;
+			}
+
+			// if a new sample was published while we were reading this one,
+			// start over
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (m_seq.load(std::memory_order_relaxed) != seq) continue;
+
+			// now that we know what the number of updates is, fill it in
+			char* counter_ptr = &out[counter_pos];
+			io::write_uint16(num_updates, counter_ptr);
+			return;
+		}
+	}
+}
+
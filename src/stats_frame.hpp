@@ -0,0 +1,105 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_STATS_FRAME_HPP
+#define TORRENT_STATS_FRAME_HPP
+
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+#include "libtorrent/performance_counters.hpp"
+#include "libtorrent/time.hpp"
+
+namespace libtorrent
+{
+	// keeps a copy of the session stats counters along with the frame number
+	// each counter last changed in and how fast it changed. Every sample
+	// (typically a session_stats_alert) advances the frame number. This lets
+	// clients ask for only the counters that changed since the last frame
+	// they saw.
+	//
+	// All member functions are thread safe. Readers never block; the last
+	// sample is published in one of two buffers, guarded by a sequence
+	// number, while the next one is written to the other
+	struct stats_frame
+	{
+		stats_frame();
+
+		// record a new sample of all counters::num_counters values taken at
+		// timestamp and stamp the ones that changed with the new frame
+		// number. Returns the number of counters that changed
+		int update(std::uint64_t const* values, time_point timestamp);
+
+		// the current frame number. This is 0 until the first sample is
+		// recorded
+		std::uint32_t frame() const;
+
+		// the last recorded value of the specified counter
+		std::uint64_t value(int idx) const;
+
+		// the change per second of the specified counter, between the last
+		// two samples
+		double rate(int idx) const;
+
+		// appends the current frame number, the number of updates (uint16)
+		// followed by (counter-id (uint16), value (uint64)) for every counter
+		// in ids that changed after ``since``, to out.
+		void encode(std::uint32_t since, std::vector<int> const& ids
+			, std::vector<char>& out) const;
+
+	private:
+
+		struct buffer
+		{
+			std::atomic<std::uint64_t> values[counters::num_counters];
+			std::atomic<double> rates[counters::num_counters];
+			// the frame each counter last changed in
+			std::atomic<std::uint32_t> changed[counters::num_counters];
+			std::atomic<std::uint32_t> frame;
+		};
+
+		// the buffer holding the last sample is m_buffers[m_seq & 1].
+		// update() writes the other one and then increments m_seq. A reader
+		// that sees m_seq change while it was reading retries
+		buffer m_buffers[2];
+		std::atomic<std::uint32_t> m_seq;
+
+		// serializes calls to update()
+		std::mutex m_mutex;
+		time_point m_last_update;
+	};
+}
+
+#endif
+
@@ -0,0 +1,325 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "stats_log.hpp"
+
+#include <string.h>
+#include <errno.h>
+#include <zlib.h>
+
+namespace libtorrent
+{
+namespace
+{
+	char const magic[] = "LTSTATS1";
+	int const magic_size = 8;
+
+	void write_varint(std::vector<char>& out, std::uint64_t v)
+	{
+		while (v >= 0x80)
+		{
+			out.push_back(char(v | 0x80));
+			v >>= 7;
+		}
+		out.push_back(char(v));
+	}
+
+	void write_signed(std::vector<char>& out, std::int64_t v)
+	{
+		write_varint(out, (std::uint64_t(v) << 1) ^ std::uint64_t(v >> 63));
+	}
+
+	// returns false if the varint runs past end
+	bool read_varint(char const*& ptr, char const* end, std::uint64_t& v)
+	{
+		v = 0;
+		for (int shift = 0; ptr != end && shift < 64; shift += 7)
+		{
+			std::uint8_t const c = std::uint8_t(*ptr++);
+			v |= std::uint64_t(c & 0x7f) << shift;
+			if ((c & 0x80) == 0) return true;
+		}
+		return false;
+	}
+
+	bool read_signed(char const*& ptr, char const* end, std::int64_t& v)
+	{
+		std::uint64_t u;
+		if (!read_varint(ptr, end, u)) return false;
+		v = std::int64_t(u >> 1) ^ -std::int64_t(u & 1);
+		return true;
+	}
+
+	error_code errno_error()
+	{
+		return error_code(errno, boost::system::generic_category());
+	}
+}
+
+stats_log_writer::stats_log_writer()
+	: m_file(NULL)
+	, m_flags(0)
+	, m_last_timestamp(0)
+	, m_block_samples(0)
+{}
+
+stats_log_writer::~stats_log_writer()
+{
+	close();
+}
+
+void stats_log_writer::open(std::string const& filename
+	, std::vector<std::string> const& names, std::int64_t start_time
+	, int flags, error_code& ec)
+{
+	close();
+
+	m_file = fopen(filename.c_str(), "wb");
+	if (m_file == NULL)
+	{
+		ec = errno_error();
+		return;
+	}
+
+	m_flags = flags;
+	m_last.assign(names.size(), 0);
+	m_last_timestamp = 0;
+
+	std::vector<char> header(magic, magic + magic_size);
+	header.push_back(char(flags));
+	write_varint(header, start_time);
+	write_varint(header, names.size());
+	for (std::vector<std::string>::const_iterator i = names.begin()
+		, end(names.end()); i != end; ++i)
+	{
+		write_varint(header, i->size());
+		header.insert(header.end(), i->begin(), i->end());
+	}
+
+	if (fwrite(&header[0], 1, header.size(), m_file) != header.size())
+	{
+		ec = errno_error();
+		fclose(m_file);
+		m_file = NULL;
+	}
+}
+
+void stats_log_writer::write(std::int64_t timestamp, std::uint64_t const* values)
+{
+	if (m_file == NULL) return;
+
+	write_signed(m_block, timestamp - m_last_timestamp);
+	m_last_timestamp = timestamp;
+
+	int num_changed = 0;
+	for (int i = 0; i < int(m_last.size()); ++i)
+		if (values[i] != m_last[i]) ++num_changed;
+	write_varint(m_block, num_changed);
+
+	int prev = -1;
+	for (int i = 0; i < int(m_last.size()); ++i)
+	{
+		if (values[i] == m_last[i]) continue;
+		write_varint(m_block, i - prev - 1);
+		write_signed(m_block, std::int64_t(values[i] - m_last[i]));
+		m_last[i] = values[i];
+		prev = i;
+	}
+
+	// uncompressed logs are written one sample at a time, so that they're
+	// up to date for anyone reading them while they're being written
+	++m_block_samples;
+	if ((m_flags & compressed) == 0 || m_block_samples >= block_samples)
+		flush();
+}
+
+void stats_log_writer::flush()
+{
+	if (m_file == NULL || m_block.empty()) return;
+
+	if (m_flags & compressed)
+	{
+		uLongf size = compressBound(m_block.size());
+		std::vector<char> data(size);
+		if (compress2(reinterpret_cast<Bytef*>(&data[0]), &size
+			, reinterpret_cast<Bytef const*>(&m_block[0]), m_block.size(), 6) == Z_OK)
+		{
+			std::vector<char> header;
+			write_varint(header, m_block.size());
+			write_varint(header, size);
+			fwrite(&header[0], 1, header.size(), m_file);
+			fwrite(&data[0], 1, size, m_file);
+		}
+	}
+	else
+	{
+		fwrite(&m_block[0], 1, m_block.size(), m_file);
+	}
+	fflush(m_file);
+	m_block.clear();
+	m_block_samples = 0;
+}
+
+void stats_log_writer::close()
+{
+	if (m_file == NULL) return;
+	flush();
+	fclose(m_file);
+	m_file = NULL;
+}
+
+stats_log_reader::stats_log_reader()
+	: m_start_time(0)
+	, m_cursor(NULL)
+	, m_timestamp(0)
+{}
+
+bool stats_log_reader::open(std::string const& filename, error_code& ec)
+{
+	m_names.clear();
+	m_records.clear();
+	m_cursor = NULL;
+	m_timestamp = 0;
+
+	FILE* f = fopen(filename.c_str(), "rb");
+	if (f == NULL)
+	{
+		ec = errno_error();
+		return false;
+	}
+
+	std::vector<char> file;
+	char buf[64 * 1024];
+	int ret;
+	while ((ret = fread(buf, 1, sizeof(buf), f)) > 0)
+		file.insert(file.end(), buf, buf + ret);
+	fclose(f);
+
+	if (int(file.size()) < magic_size + 1
+		|| memcmp(&file[0], magic, magic_size) != 0)
+	{
+		ec = error_code(boost::system::errc::invalid_argument, boost::system::generic_category());
+		return false;
+	}
+
+	char const* ptr = &file[0] + magic_size;
+	char const* const end = &file[0] + file.size();
+	int const flags = std::uint8_t(*ptr++);
+
+	std::uint64_t start_time;
+	std::uint64_t num_names;
+	if (!read_varint(ptr, end, start_time)
+		|| !read_varint(ptr, end, num_names)
+		|| num_names > std::uint64_t(end - ptr))
+	{
+		ec = error_code(boost::system::errc::invalid_argument, boost::system::generic_category());
+		return false;
+	}
+	m_start_time = start_time;
+
+	for (int i = 0; i < int(num_names); ++i)
+	{
+		std::uint64_t len;
+		if (!read_varint(ptr, end, len) || len > std::uint64_t(end - ptr))
+		{
+			ec = error_code(boost::system::errc::invalid_argument, boost::system::generic_category());
+			return false;
+		}
+		m_names.push_back(std::string(ptr, len));
+		ptr += len;
+	}
+	m_values.assign(m_names.size(), 0);
+
+	if ((flags & stats_log_writer::compressed) == 0)
+	{
+		m_records.assign(ptr, end);
+	}
+	else
+	{
+		// inflate every complete block. A block that was cut short (the
+		// process died while writing it) ends the log
+		while (ptr != end)
+		{
+			std::uint64_t raw_size;
+			std::uint64_t size;
+			if (!read_varint(ptr, end, raw_size)
+				|| !read_varint(ptr, end, size)
+				|| size > std::uint64_t(end - ptr)
+				|| raw_size > 64 * 1024 * 1024) break;
+
+			std::size_t const offset = m_records.size();
+			m_records.resize(offset + raw_size);
+			uLongf out_size = raw_size;
+			if (uncompress(reinterpret_cast<Bytef*>(&m_records[offset]), &out_size
+				, reinterpret_cast<Bytef const*>(ptr), size) != Z_OK
+				|| out_size != raw_size)
+			{
+				m_records.resize(offset);
+				break;
+			}
+			ptr += size;
+		}
+	}
+
+	m_cursor = m_records.empty() ? NULL : &m_records[0];
+	return true;
+}
+
+bool stats_log_reader::next()
+{
+	if (m_cursor == NULL) return false;
+	char const* const end = &m_records[0] + m_records.size();
+	char const* ptr = m_cursor;
+
+	std::int64_t dt;
+	std::uint64_t num_changed;
+	if (!read_signed(ptr, end, dt)
+		|| !read_varint(ptr, end, num_changed)) return false;
+
+	int idx = -1;
+	for (std::uint64_t i = 0; i < num_changed; ++i)
+	{
+		std::uint64_t gap;
+		std::int64_t delta;
+		if (!read_varint(ptr, end, gap)
+			|| !read_signed(ptr, end, delta)) return false;
+		if (gap >= m_values.size() - idx - 1) return false;
+		idx += int(gap) + 1;
+		m_values[idx] += std::uint64_t(delta);
+	}
+
+	m_timestamp += dt;
+	m_cursor = ptr;
+	return true;
+}
+
+}
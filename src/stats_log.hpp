@@ -0,0 +1,144 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_STATS_LOG_HPP
+#define TORRENT_STATS_LOG_HPP
+
+#include "libtorrent/error_code.hpp"
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <stdio.h>
+
+namespace libtorrent
+{
+	/*
+		The binary session stats log format. A file starts with a header:
+
+			"LTSTATS1"            magic
+			uint8                 flags (stats_log_writer::compressed)
+			varint                the unix time the log was started
+			varint                number of counters
+			(varint, bytes)...    the name of each counter
+
+		followed by one record per sample:
+
+			signed varint         microseconds since the previous sample
+			varint                number of counters that changed
+			(varint, signed varint)...
+			                      for every changed counter, the distance
+			                      in index from the previous changed one
+			                      (minus one) and how much it changed by
+
+		The first sample is relative to the start time and all zero
+		counters. Signed varints are zig-zag encoded. In compressed logs the
+		records are grouped in blocks, each one stored as (varint raw size,
+		varint compressed size, zlib stream), so a log that was cut short
+		can still be read up to its last complete block.
+	*/
+
+	struct stats_log_writer
+	{
+		enum flags_t { compressed = 1 };
+
+		// the number of samples buffered for each compressed block
+		enum { block_samples = 60 };
+
+		stats_log_writer();
+		~stats_log_writer();
+
+		// creates (or truncates) filename and writes the header to it
+		void open(std::string const& filename, std::vector<std::string> const& names
+			, std::int64_t start_time, int flags, error_code& ec);
+
+		bool is_open() const { return m_file != NULL; }
+
+		// records a sample. values holds one value per counter name and
+		// timestamp is in microseconds since the start time
+		void write(std::int64_t timestamp, std::uint64_t const* values);
+
+		// writes any buffered samples to disk and closes the file
+		void close();
+
+	private:
+
+		void flush();
+
+		FILE* m_file;
+		int m_flags;
+
+		// the sample last written, which the next one is encoded relative to
+		std::vector<std::uint64_t> m_last;
+		std::int64_t m_last_timestamp;
+
+		// encoded samples not yet written to the file
+		std::vector<char> m_block;
+		int m_block_samples;
+	};
+
+	struct stats_log_reader
+	{
+		stats_log_reader();
+
+		// reads and decompresses the log file. Returns false if it's not a
+		// stats log
+		bool open(std::string const& filename, error_code& ec);
+
+		std::vector<std::string> const& names() const { return m_names; }
+		std::int64_t start_time() const { return m_start_time; }
+
+		// advances to the next sample. Returns false at the end of the log
+		bool next();
+
+		// the microseconds between the start time and the current sample
+		std::int64_t timestamp() const { return m_timestamp; }
+
+		// the counter values of the current sample, one per name
+		std::vector<std::uint64_t> const& values() const { return m_values; }
+
+	private:
+
+		std::vector<std::string> m_names;
+		std::int64_t m_start_time;
+
+		// the uncompressed records
+		std::vector<char> m_records;
+		char const* m_cursor;
+
+		std::int64_t m_timestamp;
+		std::vector<std::uint64_t> m_values;
+	};
+}
+
+#endif
+
@@ -31,11 +31,11 @@ POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <functional>
+#include <time.h>
 
 #include "stats_logging.hpp"
-#include "libtorrent/session.hpp"
 #include "libtorrent/file.hpp"
-#include "alert_handler.hpp"
+#include "libtorrent/alert_types.hpp"
 #include "libtorrent/session_stats.hpp"
 
 using namespace libtorrent;
@@ -76,30 +76,26 @@ using namespace std::placeholders;
 	thread_cpu_usage m_network_thread_cpu_usage;
 */
 
-stats_logging::stats_logging(session& s, alert_handler* h)
-	: m_alerts(h)
-	, m_ses(s)
-	, m_stats_logger(NULL)
+stats_logging::stats_logging(stats_snapshot* stats, int flags)
+	: m_stats(stats)
+	, m_flags(flags)
 	, m_log_seq(0)
 {
-	m_alerts->subscribe(this, 0
-		, session_stats_alert::alert_type
-		, stats_alert::alert_type
-		, 0);
 	rotate_stats_log();
+	m_stats->subscribe(this);
 }
 
 stats_logging::~stats_logging()
 {
-	m_alerts->unsubscribe(this);
+	m_stats->unsubscribe(this);
 }
 
 void stats_logging::rotate_stats_log()
 {
-	if (m_stats_logger)
+	if (m_stats_logger.is_open())
 	{
 		++m_log_seq;
-		fclose(m_stats_logger);
+		m_stats_logger.close();
 	}
 
 	error_code ec;
@@ -110,57 +106,36 @@ void stats_logging::rotate_stats_log()
 #else
 	const int pid = getpid();
 #endif
-	snprintf(filename, sizeof(filename), "session_stats/%d.%04d.log", pid, m_log_seq);
-	m_stats_logger = fopen(filename, "w+");
+	snprintf(filename, sizeof(filename), "session_stats/%d.%04d.stats", pid, m_log_seq);
 	m_last_log_rotation = time_now();
-	if (m_stats_logger == 0)
-	{
-		fprintf(stderr, "Failed to create session stats log file \"%s\": (%d) %s\n"
-			, filename, errno, strerror(errno));
-		return;
-	}
 
+	// the counter names, by index. Just in case there are some indices
+	// that don't have names (it shouldn't really happen) they're left empty
+	std::vector<std::string> names(counters::num_counters);
 	std::vector<stats_metric> cnts = session_stats_metrics();
-	std::sort(cnts.begin(), cnts.end()
-		, [](stats_metric const& lhs, stats_metric const& rhs)
-		{ return lhs.value_index < rhs.value_index; });
-
-	int idx = 0;
-	fputs("second", m_stats_logger);
 	for (int i = 0; i < cnts.size(); ++i)
 	{
-		// just in case there are some indices that don't have names
-		// (it shouldn't really happen)
-		while (idx < cnts[i].value_index)
-		{
-			fprintf(m_stats_logger, ":");
-			++idx;
-		}
-
-		fprintf(m_stats_logger, ":%s", cnts[i].name);
-		++idx;
+		if (cnts[i].value_index < 0 || cnts[i].value_index >= int(names.size())) continue;
+		names[cnts[i].value_index] = cnts[i].name;
 	}
-	fputs("\n\n", m_stats_logger);
-}
-
-void stats_logging::handle_alert(alert const* a)
-{
-	session_stats_alert const* s = alert_cast<session_stats_alert>(a);
 
-	if (s == NULL)
+	m_stats_logger.open(filename, names, time(NULL), m_flags, ec);
+	if (ec)
 	{
-		m_ses.post_session_stats();
-		return;
+		fprintf(stderr, "Failed to create session stats log file \"%s\": %s\n"
+			, filename, ec.message().c_str());
 	}
+}
 
+void stats_logging::on_stats(session_stats_alert const* s, int num_changed)
+{
 	if (time_now_hires() - m_last_log_rotation > hours(1))
 		rotate_stats_log();
 
-	fprintf(m_stats_logger, "%f", double(total_microseconds(s->timestamp() - m_last_log_rotation)) / 1000000.0);
-	for (int i = 0; i < counters::num_counters; ++i)
-	{
-		fprintf(m_stats_logger, "\t%" PRId64, s->values[i]);
-	}
-	fprintf(m_stats_logger, "\n");
-}
+	// other parts of the client ask for samples too. Samples where no
+	// counter changed are not logged
+	if (num_changed == 0) return;
 
+	m_stats_logger.write(total_microseconds(s->timestamp() - m_last_log_rotation)
+		, s->values);
+}
@@ -33,35 +33,38 @@ POSSIBILITY OF SUCH DAMAGE.
 #ifndef TORRENT_STATS_LOGGING_HPP
 #define TORRENT_STATS_LOGGING_HPP
 
-#include "alert_observer.hpp"
+#include "stats_snapshot.hpp"
+#include "stats_log.hpp"
 #include "libtorrent/time.hpp"
-#include <stdio.h>
 
 namespace libtorrent
 {
-struct alert_handler;
-class session;
-
 /// writes logs to directory 'session_stats' in current working directory.
-/// logs are rotated each hour. Use parse_session_stats.py to parse logs.
-struct stats_logging : alert_observer
+/// logs are rotated each hour. They are in the binary format of
+/// stats_log_writer, compressed unless flags says otherwise. Use
+/// stats_log_dump to convert them to text, or parse_session_stats.py
+/// to graph them.
+struct stats_logging : stats_observer
 {
-	stats_logging(session& s, alert_handler* h);
+	stats_logging(stats_snapshot* stats
+		, int flags = stats_log_writer::compressed);
 	~stats_logging();
 
 private:
 
 	void rotate_stats_log();
-	void handle_alert(alert const* a);
+	void on_stats(session_stats_alert const* a, int num_changed);
 
-	alert_handler* m_alerts;
+	stats_snapshot* m_stats;
 
 	// the last time we rotated the log file
 	time_point m_last_log_rotation;
 
-	session& m_ses;
+	stats_log_writer m_stats_logger;
+
+	// stats_log_writer::flags_t
+	int m_flags;
 
-	FILE* m_stats_logger;
 	// sequence number for log file. Log files are
 	// rotated every hour and the sequence number is
 	// incremented by one
@@ -0,0 +1,161 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "stats_snapshot.hpp"
+#include "alert_handler.hpp"
+#include "libtorrent/session.hpp"
+#include "libtorrent/alert_types.hpp"
+
+#include <algorithm>
+
+namespace libtorrent
+{
+	stats_snapshot::stats_snapshot(session& s, alert_handler* h)
+		: m_ses(s)
+		, m_alerts(h)
+		, m_in_flight(false)
+	{
+		m_alerts->subscribe(this, 0
+			, session_stats_alert::alert_type
+			, stats_alert::alert_type
+			, 0);
+	}
+
+	stats_snapshot::~stats_snapshot()
+	{
+		m_alerts->unsubscribe(this);
+
+		std::vector<std::pair<std::function<void(bool)>, time_point> > waiting;
+		{
+			std::unique_lock<std::mutex> l(m_mutex);
+			waiting.swap(m_waiting);
+		}
+		for (int i = 0; i < int(waiting.size()); ++i)
+			waiting[i].first(false);
+	}
+
+	void stats_snapshot::request(time_duration max_age)
+	{
+		time_point const now = clock_type::now();
+		std::unique_lock<std::mutex> l(m_mutex);
+		if (m_in_flight && now - m_requested < seconds(10)) return;
+		if (m_stats.frame() != 0 && now - m_last_sample < max_age) return;
+		m_in_flight = true;
+		m_requested = now;
+		l.unlock();
+		m_ses.post_session_stats();
+	}
+
+	void stats_snapshot::async_sample(std::function<void(bool)> const& handler
+		, time_duration max_age)
+	{
+		time_point const now = clock_type::now();
+		std::unique_lock<std::mutex> l(m_mutex);
+		if (m_stats.frame() != 0 && now - m_last_sample < max_age)
+		{
+			l.unlock();
+			handler(true);
+			return;
+		}
+		m_waiting.push_back(std::make_pair(handler, now));
+		l.unlock();
+
+		// the sample is handed to the handler in handle_alert(). If alerts
+		// stop being dispatched (e.g. when shutting down), the next caller
+		// fails the ones waiting too long
+		expire_waiting(now);
+		request();
+	}
+
+	void stats_snapshot::expire_waiting(time_point now)
+	{
+		std::vector<std::function<void(bool)> > expired;
+		{
+			std::unique_lock<std::mutex> l(m_mutex);
+			for (int i = 0; i < int(m_waiting.size());)
+			{
+				if (now - m_waiting[i].second < seconds(10)) { ++i; continue; }
+				expired.push_back(m_waiting[i].first);
+				m_waiting.erase(m_waiting.begin() + i);
+			}
+		}
+		for (int i = 0; i < int(expired.size()); ++i)
+			expired[i](false);
+	}
+
+	void stats_snapshot::subscribe(stats_observer* o)
+	{
+		std::unique_lock<std::mutex> l(m_observer_mutex);
+		m_observers.push_back(o);
+	}
+
+	void stats_snapshot::unsubscribe(stats_observer* o)
+	{
+		std::unique_lock<std::mutex> l(m_observer_mutex);
+		m_observers.erase(std::remove(m_observers.begin(), m_observers.end(), o)
+			, m_observers.end());
+	}
+
+	void stats_snapshot::handle_alert(alert const* a)
+	{
+		session_stats_alert const* s = alert_cast<session_stats_alert>(a);
+		if (s == NULL)
+		{
+			// every torrent posts a stats_alert once a second. Take that as
+			// the cue to sample the session counters, but only once
+			request(milliseconds(sample_interval_ms - 100));
+			expire_waiting(clock_type::now());
+			return;
+		}
+
+		// the new frame is published under the same lock as the time it
+		// was sampled at and the hand-over of the waiting handlers. That way
+		// async_sample() either sees the new sample or is handed it
+		int num_changed;
+		std::vector<std::pair<std::function<void(bool)>, time_point> > waiting;
+		{
+			std::unique_lock<std::mutex> l(m_mutex);
+			num_changed = m_stats.update(s->values, s->timestamp());
+			m_in_flight = false;
+			m_last_sample = clock_type::now();
+			waiting.swap(m_waiting);
+		}
+		for (int i = 0; i < int(waiting.size()); ++i)
+			waiting[i].first(true);
+
+		std::unique_lock<std::mutex> l(m_observer_mutex);
+		for (std::vector<stats_observer*>::iterator i = m_observers.begin()
+			, end(m_observers.end()); i != end; ++i)
+			(*i)->on_stats(s, num_changed);
+	}
+}
+
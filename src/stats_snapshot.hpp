@@ -0,0 +1,127 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_STATS_SNAPSHOT_HPP
+#define TORRENT_STATS_SNAPSHOT_HPP
+
+#include "alert_observer.hpp"
+#include "stats_frame.hpp"
+#include "libtorrent/time.hpp"
+
+#include <mutex>
+#include <functional>
+#include <vector>
+
+namespace libtorrent
+{
+	struct alert_handler;
+	struct session_stats_alert;
+	class session;
+
+	struct stats_observer
+	{
+		// called from the alert thread for every new sample, once it has
+		// been published in the snapshot. num_changed is the number of
+		// counters that changed since the previous sample
+		virtual void on_stats(session_stats_alert const* a, int num_changed) = 0;
+
+	protected:
+		~stats_observer() {}
+	};
+
+	// the one place session_stats_alerts are requested and received. The
+	// last sample is kept in a stats_frame that readers (like SNMP queries
+	// or get-stats RPCs) access without locking, along with the rate of
+	// each counter. Components that need every sample (like the stats log)
+	// subscribe as a stats_observer.
+	//
+	// A new sample is requested whenever a torrent posts its (once per
+	// second) stats_alert, or explicitly with request(), but never more
+	// than one at a time.
+	struct stats_snapshot : alert_observer
+	{
+		stats_snapshot(session& s, alert_handler* h);
+		~stats_snapshot();
+
+		stats_frame const& stats() const { return m_stats; }
+
+		// asks the session for a new sample, unless one has already been
+		// asked for, or the last one is younger than max_age
+		void request(time_duration max_age = seconds(0));
+
+		// calls handler once there's a sample younger than max_age,
+		// requesting a new one if necessary. If there already is one, handler
+		// is called right away, on the calling thread. Otherwise it's called
+		// on the alert thread when the sample arrives, or with false if it
+		// doesn't arrive within 10 seconds. Nothing blocks waiting for it
+		void async_sample(std::function<void(bool)> const& handler
+			, time_duration max_age = seconds(1));
+
+		void subscribe(stats_observer* o);
+		void unsubscribe(stats_observer* o);
+
+		enum { sample_interval_ms = 1000 };
+
+	private:
+
+		void handle_alert(alert const* a);
+
+		// fails the handlers that have been waiting too long
+		void expire_waiting(time_point now);
+
+		session& m_ses;
+		alert_handler* m_alerts;
+
+		stats_frame m_stats;
+
+		// protects the request state below
+		mutable std::mutex m_mutex;
+
+		// the handlers waiting for the next sample, and when they started
+		// waiting
+		std::vector<std::pair<std::function<void(bool)>, time_point> > m_waiting;
+
+		// set while a session_stats_alert has been asked for but hasn't
+		// arrived. If it doesn't arrive in 10 seconds, it's asked for again
+		bool m_in_flight;
+		time_point m_requested;
+		time_point m_last_sample;
+
+		// held while calling observers, so that once unsubscribe() returns
+		// the observer won't be called again
+		std::mutex m_observer_mutex;
+		std::vector<stats_observer*> m_observers;
+	};
+}
+
+#endif
+
@@ -0,0 +1,228 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "status_encoding.hpp"
+#include "libtorrent/time.hpp"
+
+#include <string.h>
+
+namespace libtorrent
+{
+namespace
+{
+	void write_varint(std::vector<char>& out, std::uint64_t v)
+	{
+		while (v >= 0x80)
+		{
+			out.push_back(char(v | 0x80));
+			v >>= 7;
+		}
+		out.push_back(char(v));
+	}
+
+	void write_signed(std::vector<char>& out, std::int64_t v)
+	{
+		write_varint(out, (std::uint64_t(v) << 1) ^ std::uint64_t(v >> 63));
+	}
+
+	void write_string(std::vector<char>& out, std::string const& s)
+	{
+		write_varint(out, s.size());
+		out.insert(out.end(), s.begin(), s.end());
+	}
+
+	void write_hash(std::vector<char>& out, sha1_hash const& h)
+	{
+		out.insert(out.end(), h.begin(), h.end());
+	}
+
+	void write_float(std::vector<char>& out, float f)
+	{
+		std::uint32_t v;
+		memcpy(&v, &f, sizeof(v));
+		write_varint(out, v);
+	}
+
+	bool read_varint(char const*& ptr, char const* end, std::uint64_t& v)
+	{
+		v = 0;
+		for (int shift = 0; ptr != end && shift < 64; shift += 7)
+		{
+			std::uint8_t const c = std::uint8_t(*ptr++);
+			v |= std::uint64_t(c & 0x7f) << shift;
+			if ((c & 0x80) == 0) return true;
+		}
+		return false;
+	}
+
+	// reads a signed varint into any integer or enum type
+	template <class T>
+	bool read_int(char const*& ptr, char const* end, T& v)
+	{
+		std::uint64_t u;
+		if (!read_varint(ptr, end, u)) return false;
+		v = T(std::int64_t(u >> 1) ^ -std::int64_t(u & 1));
+		return true;
+	}
+
+	bool read_string(char const*& ptr, char const* end, std::string& s)
+	{
+		std::uint64_t len;
+		if (!read_varint(ptr, end, len) || len > std::uint64_t(end - ptr)) return false;
+		s.assign(ptr, len);
+		ptr += len;
+		return true;
+	}
+
+	bool read_hash(char const*& ptr, char const* end, sha1_hash& h)
+	{
+		if (end - ptr < sha1_hash::size) return false;
+		std::copy(ptr, ptr + sha1_hash::size, h.begin());
+		ptr += sha1_hash::size;
+		return true;
+	}
+
+	bool read_float(char const*& ptr, char const* end, float& f)
+	{
+		std::uint64_t v;
+		if (!read_varint(ptr, end, v)) return false;
+		std::uint32_t const bits = std::uint32_t(v);
+		memcpy(&f, &bits, sizeof(f));
+		return true;
+	}
+
+	// the flags of torrent_status, in the order of their bits
+	enum
+	{
+		flag_paused = 1 << 0,
+		flag_auto_managed = 1 << 1,
+		flag_sequential_download = 1 << 2,
+		flag_is_seeding = 1 << 3,
+		flag_is_finished = 1 << 4,
+		flag_is_loaded = 1 << 5,
+		flag_has_metadata = 1 << 6,
+		flag_has_incoming = 1 << 7,
+		flag_seed_mode = 1 << 8,
+		flag_upload_mode = 1 << 9,
+		flag_share_mode = 1 << 10,
+		flag_super_seeding = 1 << 11,
+		flag_need_save_resume = 1 << 12,
+		flag_ip_filter_applies = 1 << 13
+	};
+
+	// the fields of torrent_status torrent_history keeps track of. The
+	// handle, the piece bitfields and the torrent_info are left out
+#define INT_FIELDS(F) \
+	F(progress_ppm) F(total_download) F(total_upload) \
+	F(total_payload_download) F(total_payload_upload) F(total_failed_bytes) \
+	F(total_redundant_bytes) F(download_rate) F(upload_rate) \
+	F(download_payload_rate) F(upload_payload_rate) F(num_seeds) F(num_peers) \
+	F(num_complete) F(num_incomplete) F(list_seeds) F(list_peers) \
+	F(connect_candidates) F(num_pieces) F(total_done) F(total_wanted_done) \
+	F(total_wanted) F(distributed_full_copies) F(distributed_fraction) \
+	F(block_size) F(num_uploads) F(num_connections) F(uploads_limit) \
+	F(connections_limit) F(storage_mode) F(up_bandwidth_queue) \
+	F(down_bandwidth_queue) F(all_time_upload) F(all_time_download) \
+	F(active_time) F(finished_time) F(seeding_time) F(seed_rank) \
+	F(last_scrape) F(sparse_regions) F(priority) F(added_time) \
+	F(completed_time) F(last_seen_complete) F(time_since_upload) \
+	F(time_since_download) F(queue_position) F(listen_port)
+
+#define FLAG_FIELDS(F) \
+	F(paused) F(auto_managed) F(sequential_download) F(is_seeding) \
+	F(is_finished) F(is_loaded) F(has_metadata) F(has_incoming) F(seed_mode) \
+	F(upload_mode) F(share_mode) F(super_seeding) F(need_save_resume) \
+	F(ip_filter_applies)
+}
+
+void encode_status(std::vector<char>& out, torrent_status const& s)
+{
+	write_hash(out, s.info_hash);
+	write_signed(out, s.state);
+
+	std::uint64_t flags = 0;
+#define WRITE_FLAG(x) if (s.x) flags |= flag_ ## x;
+	FLAG_FIELDS(WRITE_FLAG)
+#undef WRITE_FLAG
+	write_varint(out, flags);
+
+#define WRITE_INT(x) write_signed(out, s.x);
+	INT_FIELDS(WRITE_INT)
+#undef WRITE_INT
+
+	write_signed(out, total_seconds(s.next_announce));
+	write_signed(out, total_seconds(s.announce_interval));
+	write_float(out, s.progress);
+	write_float(out, s.distributed_copies);
+	write_string(out, s.error);
+	write_string(out, s.save_path);
+	write_string(out, s.name);
+	write_string(out, s.current_tracker);
+}
+
+bool decode_status(char const*& ptr, char const* end, torrent_status& s)
+{
+	std::uint64_t flags;
+	int next_announce;
+	int announce_interval;
+	if (!read_hash(ptr, end, s.info_hash)
+		|| !read_int(ptr, end, s.state)
+		|| !read_varint(ptr, end, flags))
+		return false;
+
+#define READ_FLAG(x) s.x = (flags & flag_ ## x) != 0;
+	FLAG_FIELDS(READ_FLAG)
+#undef READ_FLAG
+
+#define READ_INT(x) if (!read_int(ptr, end, s.x)) return false;
+	INT_FIELDS(READ_INT)
+#undef READ_INT
+
+	if (!read_int(ptr, end, next_announce)
+		|| !read_int(ptr, end, announce_interval)
+		|| !read_float(ptr, end, s.progress)
+		|| !read_float(ptr, end, s.distributed_copies)
+		|| !read_string(ptr, end, s.error)
+		|| !read_string(ptr, end, s.save_path)
+		|| !read_string(ptr, end, s.name)
+		|| !read_string(ptr, end, s.current_tracker))
+		return false;
+
+	s.next_announce = seconds(next_announce);
+	s.announce_interval = seconds(announce_interval);
+	return true;
+}
+
+#undef INT_FIELDS
+#undef FLAG_FIELDS
+}
+
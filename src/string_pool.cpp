@@ -0,0 +1,83 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+#include "string_pool.hpp"
+
+#include <algorithm>
+
+namespace libtorrent
+{
+	string_pool::string_pool()
+		: m_sweep_size(64)
+		, m_empty(std::make_shared<std::string const>())
+	{}
+
+	interned_string string_pool::intern(std::string const& s)
+	{
+		// most torrents don't have an error, or a tracker before their
+		// first announce
+		if (s.empty()) return m_empty;
+
+		std::unique_lock<std::mutex> l(m_mutex);
+		std::weak_ptr<std::string const>& slot = m_strings[s];
+		interned_string ret = slot.lock();
+		if (ret) return ret;
+
+		ret = std::make_shared<std::string const>(s);
+		slot = ret;
+
+		if (m_strings.size() < m_sweep_size) return ret;
+
+		// weed out the strings nobody refers to anymore. The next sweep is
+		// when the pool has doubled from what's left, to keep the cost of
+		// sweeping proportional to the number of strings interned
+		for (map_t::iterator i = m_strings.begin(); i != m_strings.end();)
+		{
+			if (i->second.expired()) i = m_strings.erase(i);
+			else ++i;
+		}
+		m_sweep_size = (std::max)(std::size_t(64), m_strings.size() * 2);
+		return ret;
+	}
+
+	int string_pool::size() const
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		return int(m_strings.size());
+	}
+
+	interned_string intern_string(std::string const& s)
+	{
+		static string_pool pool;
+		return pool.intern(s);
+	}
+}
+
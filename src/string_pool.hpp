@@ -0,0 +1,79 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+#ifndef TORRENT_STRING_POOL_HPP
+#define TORRENT_STRING_POOL_HPP
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace libtorrent
+{
+	// a string shared by everything that holds an equal one. Never null
+	typedef std::shared_ptr<std::string const> interned_string;
+
+	// hands out one shared copy of each distinct string. Torrents mostly
+	// have one of a handful of save paths and trackers, interning them
+	// makes the copy of a torrent's state a reference count, rather than an
+	// allocation. Strings are freed once the last reference to them is
+	// dropped
+	struct string_pool
+	{
+		string_pool();
+
+		interned_string intern(std::string const& s);
+
+		// the number of distinct strings, including ones that have been
+		// released but not weeded out yet
+		int size() const;
+
+	private:
+
+		typedef std::unordered_map<std::string
+			, std::weak_ptr<std::string const> > map_t;
+
+		mutable std::mutex m_mutex;
+		map_t m_strings;
+
+		// the pool is swept for released strings once it grows to this size
+		std::size_t m_sweep_size;
+
+		interned_string m_empty;
+	};
+
+	// interns s in the pool shared by the whole process
+	interned_string intern_string(std::string const& s);
+}
+
+#endif
+
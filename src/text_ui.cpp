@@ -35,6 +35,9 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "alert_handler.hpp"
 
+#include <algorithm>
+#include <stdio.h>
+
 extern "C" {
 #include <ncurses.h>
 #include <cdk/cdk.h>
@@ -158,5 +161,136 @@ error_log::~error_log()
 	m_alerts->unsubscribe(this);
 }
 
+namespace
+{
+	// the width of every column but the name, which gets the rest
+	int const column_width[torrent_view::num_columns] =
+	{ 0, 12, 9, 11, 13, 13, 7, 7 };
+}
+
+torrent_list::torrent_list(torrent_history const& hist, int x, int y, int w, int h)
+	: m_win(newwin(h, w, y, x))
+	, m_view(hist)
+{
+	layout();
+	m_view.set_window(0, (std::max)(h - 1, 0));
+	draw_header();
+}
+
+torrent_list::~torrent_list()
+{
+	delwin(m_win);
+}
+
+int torrent_list::width() const
+{
+	int h, w;
+	getmaxyx(m_win, h, w);
+	return w;
+}
+
+int torrent_list::height() const
+{
+	int h, w;
+	getmaxyx(m_win, h, w);
+	return h;
+}
+
+void torrent_list::set_pos(int x, int y, int w, int h)
+{
+	wresize(m_win, h, w);
+	mvwin(m_win, y, x);
+	werase(m_win);
+	layout();
+	m_view.set_window(m_view.offset(), (std::max)(h - 1, 0));
+	m_view.invalidate();
+	draw_header();
 }
 
+void torrent_list::layout()
+{
+	int fixed = 0;
+	for (int c = 1; c < torrent_view::num_columns; ++c)
+		fixed += column_width[c];
+
+	m_column_x[0] = 0;
+	m_column_x[1] = (std::max)(width() - fixed, 10);
+	for (int c = 1; c < torrent_view::num_columns; ++c)
+		m_column_x[c + 1] = m_column_x[c] + column_width[c];
+}
+
+void torrent_list::draw_header()
+{
+	wattron(m_win, A_REVERSE);
+	mvwhline(m_win, 0, 0, ' ', width());
+	for (int c = 0; c < torrent_view::num_columns; ++c)
+	{
+		mvwaddnstr(m_win, 0, m_column_x[c] + (c == 0 ? 0 : 1)
+			, torrent_view::column_name(c), m_column_x[c + 1] - m_column_x[c] - 1);
+	}
+	wattroff(m_win, A_REVERSE);
+}
+
+void torrent_list::draw_cell(int row, int column)
+{
+	// the name is left aligned, the numbers right aligned. Every cell
+	// is padded to its full width, to overwrite what was there before
+	int const w = m_column_x[column + 1] - m_column_x[column];
+	if (w <= 0) return;
+	std::string const& t = m_view.text(row, column);
+	std::string cell(w, ' ');
+	int const len = (std::min)(int(t.size()), w - 1);
+	if (column == torrent_view::name || column == torrent_view::state)
+		cell.replace(0, len, t, 0, len);
+	else
+		cell.replace(w - len, len, t, 0, len);
+	mvwaddnstr(m_win, row + 1, m_column_x[column], cell.c_str(), w);
+}
+
+void torrent_list::update()
+{
+	m_dirty.clear();
+	if (!m_view.update(m_dirty)) return;
+
+	for (std::vector<torrent_view::cell>::iterator i = m_dirty.begin()
+		, end(m_dirty.end()); i != end; ++i)
+	{
+		draw_cell(i->row, i->column);
+	}
+
+	// the number of torrents, at the end of the header
+	char count[50];
+	int const len = snprintf(count, sizeof(count), " %d torrents ", m_view.matching());
+	wattron(m_win, A_REVERSE);
+	mvwaddnstr(m_win, 0, (std::max)(width() - len, 0), count, len);
+	wattroff(m_win, A_REVERSE);
+
+	wnoutrefresh(m_win);
+	doupdate();
+}
+
+bool torrent_list::handle_key(int key)
+{
+	int const page = (std::max)(m_view.rows(), 1);
+	switch (key)
+	{
+		case KEY_UP: m_view.scroll_by(-1); break;
+		case KEY_DOWN: m_view.scroll_by(1); break;
+		case KEY_PPAGE: m_view.scroll_by(-page); break;
+		case KEY_NPAGE: m_view.scroll_by(page); break;
+		case KEY_HOME: m_view.set_window(0, m_view.rows()); break;
+		case 's':
+			m_view.set_sort((m_view.sort() + 1) % torrent_index::num_sort_keys
+				, m_view.descending());
+			break;
+		case 'r': m_view.set_sort(m_view.sort(), !m_view.descending()); break;
+		case 'f':
+			m_view.set_filter((m_view.filter() + 1) % torrent_index::num_filters);
+			break;
+		default: return false;
+	}
+	update();
+	return true;
+}
+
+}
@@ -34,7 +34,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_TEXT_UI_HPP
 
 #include <string>
+#include <vector>
 #include "alert_observer.hpp"
+#include "torrent_view.hpp"
 
 extern "C" {
 #include <ncurses.h>
@@ -95,12 +97,42 @@ namespace libtorrent
 		alert_handler* m_alerts;
 	};
 
-	struct torrent_list : window, alert_observer
+	// a top-like list of the torrents in a history. Each update() only
+	// writes the cells torrent_view reports changed, and curses only sends
+	// the characters that differ from what's on the terminal, so keeping
+	// up with a large number of torrents, over a slow connection, is cheap.
+	// The first line holds the column names
+	struct torrent_list : window
 	{
-	
+		torrent_list(torrent_history const& hist, int x, int y, int width, int height);
+		~torrent_list();
+
+		// draws the changes to the torrents since the last update
+		void update();
+
+		// scrolls, changes the sort order (s, r) or the filter (f).
+		// Returns false if the key isn't one of the list's
+		bool handle_key(int key);
+
+		torrent_view& view() { return m_view; }
+
+		virtual int width() const;
+		virtual int height() const;
+		virtual void set_pos(int x, int y, int width, int height);
 	private:
-		virtual void handle_alert(alert const* a);
-		alert_handler* m_alerts;
+
+		void layout();
+		void draw_header();
+		void draw_cell(int row, int column);
+
+		WINDOW* m_win;
+		torrent_view m_view;
+
+		// the first column of each column of the view, and the width
+		int m_column_x[torrent_view::num_columns + 1];
+
+		// the cells to draw, kept around to not allocate every update
+		std::vector<torrent_view::cell> m_dirty;
 	};
 }
 
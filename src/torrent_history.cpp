@@ -33,14 +33,132 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "torrent_history.hpp"
 #include "libtorrent/alert_types.hpp"
 #include "alert_handler.hpp"
+#include "escape_json.hpp"
+#include "status_encoding.hpp"
+
+#include <algorithm>
+#include <future>
+#include <random>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 namespace libtorrent
 {
+	// when a state update contains more torrents than this, the shards
+	// are updated in parallel
+	static const int parallel_update_threshold = 10000;
+
+	// removals are remembered for this many frames. Beyond that they're
+	// only kept while there are fewer than max_removed, clients that have
+	// been away longer than that have to start over
+	static const int removed_frames = 3600;
+	static const int max_removed = 100000;
+
+	// epochs are kept small enough for a uTorrent cid, which carries the
+	// epoch above a 32 bit frame, to be exact in a JavaScript number
+	static const std::uint32_t max_epoch = 1 << 20;
+
+	torrent_json_strings::torrent_json_strings(torrent_status const& st)
+		: name(escape_json(st.name))
+		, save_path(intern_string(escape_json(st.save_path)))
+	{
+		static char const hex[] = "0123456789abcdef";
+		for (int i = 0; i < 20; ++i)
+		{
+			info_hash[i * 2] = hex[st.info_hash[i] >> 4];
+			info_hash[i * 2 + 1] = hex[st.info_hash[i] & 0xf];
+		}
+		info_hash[40] = '\0';
+	}
+
+	torrent_counts::torrent_counts()
+		: error(0)
+		, paused(0)
+		, queued(0)
+		, active(0)
+		, total(0)
+	{
+		for (int i = 0; i < num_states; ++i)
+			state[i] = 0;
+	}
+
+	void torrent_counts::count(torrent_history_entry const& e, int sign)
+	{
+		total += sign;
+		count_state(e.status, sign);
+		count_tracker(*e.tracker, sign);
+	}
+
+	void torrent_counts::update(torrent_history_entry const& prev
+		, torrent_history_entry const& e)
+	{
+		count_state(prev.status, -1);
+		count_state(e.status, 1);
+
+		// this is the only one that needs to parse strings and touch the
+		// map, only do it when it matters. Interned strings are equal when
+		// they're the same string
+		if (prev.tracker == e.tracker) return;
+		count_tracker(*prev.tracker, -1);
+		count_tracker(*e.tracker, 1);
+	}
+
+	void torrent_counts::count_labels(std::vector<std::string> const* l, int sign)
+	{
+		if (l == NULL) return;
+		for (std::vector<std::string>::const_iterator i = l->begin()
+			, end(l->end()); i != end; ++i)
+		{
+			std::map<std::string, int>::iterator c = labels.insert(
+				std::make_pair(*i, 0)).first;
+			c->second += sign;
+			if (c->second <= 0) labels.erase(c);
+		}
+	}
+
+	void torrent_counts::count_state(torrent_status const& st, int sign)
+	{
+		if (!st.error.empty()) error += sign;
+		else if (st.paused && st.auto_managed) queued += sign;
+		else if (st.paused) paused += sign;
+		else if (st.state >= 0 && st.state < num_states) state[st.state] += sign;
+
+		if (st.download_payload_rate > 0 || st.upload_payload_rate > 0)
+			active += sign;
+	}
+
+	void torrent_counts::count_tracker(std::string const& url, int sign)
+	{
+		if (url.empty()) return;
+
+		// the host is what's between the scheme and the port or path
+		std::string::size_type start = url.find("://");
+		start = (start == std::string::npos) ? 0 : start + 3;
+		std::string::size_type end = url.find_first_of(":/", start);
+		std::string const host = url.substr(start, end == std::string::npos
+			? std::string::npos : end - start);
+		if (host.empty()) return;
+
+		std::map<std::string, int>::iterator i = trackers.insert(
+			std::make_pair(host, 0)).first;
+		i->second += sign;
+		if (i->second <= 0) trackers.erase(i);
+	}
+
 	torrent_history::torrent_history(alert_handler* h)
-		: m_alerts(h)
-		, m_frame(1)
-		, m_deferred_frame_count(false)
+		: m_num_removed(0)
+		, m_removed_horizon(0)
+		, m_alerts(h)
+		, m_frame_state(1 << 1)
 	{
+		std::random_device rd;
+		m_epoch = rd() % (max_epoch - 1) + 1;
+
 		m_alerts->subscribe(this, 0
 			, add_torrent_alert::alert_type
 			, torrent_removed_alert::alert_type
@@ -51,156 +169,1044 @@ namespace libtorrent
 
 	torrent_history::~torrent_history()
 	{
+		m_sources.clear();
 		m_alerts->unsubscribe(this);
 	}
 
+	int torrent_history::add_source(alert_handler* h)
+	{
+		int const index = int(m_sources.size()) + 1;
+		m_sources.push_back(std::make_shared<source_observer>(this, h, index));
+		return index;
+	}
+
+	torrent_history::source_observer::source_observer(torrent_history* hist
+		, alert_handler* h, int index)
+		: m_hist(hist)
+		, m_alerts(h)
+		, m_index(index)
+	{
+		m_alerts->subscribe(this, 0
+			, add_torrent_alert::alert_type
+			, torrent_removed_alert::alert_type
+			, state_update_alert::alert_type
+			, torrent_update_alert::alert_type
+			, 0);
+	}
+
+	torrent_history::source_observer::~source_observer()
+	{
+		m_alerts->unsubscribe(this);
+	}
+
+	void torrent_history::source_observer::handle_alert(alert const* a)
+	{
+		m_hist->handle_source_alert(a, m_index);
+	}
+
+	torrent_history::shard& torrent_history::shard_for(sha1_hash const& ih)
+	{
+		// info-hashes are uniformly distributed, the first byte
+		// is as good as any hash
+		return m_shards[ih[0] % num_shards];
+	}
+
+	torrent_history::shard const& torrent_history::shard_for(sha1_hash const& ih) const
+	{
+		return m_shards[ih[0] % num_shards];
+	}
+
+	void torrent_history::update_shard(shard& s
+		, std::vector<torrent_status const*> const& st, int frame, int source)
+	{
+		// first grab the current entries for the torrents that were
+		// updated. Only the alert thread modifies the queue, so these
+		// stay current while we're not holding the lock
+		std::vector<history_entry_ptr> entries;
+		entries.reserve(st.size());
+		{
+			std::unique_lock<std::mutex> l(s.mutex);
+			for (std::vector<torrent_status const*>::const_iterator i = st.begin()
+				, end(st.end()); i != end; ++i)
+			{
+				queue_t::right_iterator it = s.queue.right.find((*i)->info_hash);
+				entries.push_back(it == s.queue.right.end()
+					? history_entry_ptr() : it->info);
+			}
+		}
+
+		// then build the new entries, without holding the lock. Most
+		// torrents haven't changed in any of the fields we track, those are
+		// compared against the published entry and never copied
+		std::vector<history_entry_ptr> updated;
+		std::vector<history_entry_ptr> previous;
+		updated.reserve(st.size());
+		previous.reserve(st.size());
+		std::uint64_t changed[torrent_history_entry::mask_words];
+		for (int i = 0; i < int(st.size()); ++i)
+		{
+			if (!entries[i] || entries[i]->source != source) continue;
+			if (!entries[i]->changed_fields(*st[i], changed)) continue;
+			std::shared_ptr<torrent_history_entry> e
+				= std::make_shared<torrent_history_entry>(*entries[i]);
+			e->apply_status(*st[i], frame, changed);
+			updated.push_back(e);
+			previous.push_back(entries[i]);
+		}
+		entries.clear();
+
+		// move the changed torrents between counts. This takes the counts
+		// mutex once per shard, not once per torrent
+		{
+			std::unique_lock<std::mutex> l(m_counts_mutex);
+			for (int i = 0; i < int(updated.size()); ++i)
+				m_counts.update(*previous[i], *updated[i]);
+		}
+		previous.clear();
+		{
+			std::unique_lock<std::mutex> l(m_index_mutex);
+			for (int i = 0; i < int(updated.size()); ++i)
+				m_index.update(updated[i]->status);
+		}
+
+		// and publish them. The old entries are swapped into the updated
+		// vector and released once the lock has been dropped
+		std::unique_lock<std::mutex> l(s.mutex);
+		for (std::vector<history_entry_ptr>::iterator i = updated.begin()
+			, end(updated.end()); i != end; ++i)
+		{
+			queue_t::right_iterator it = s.queue.right.find((*i)->status.info_hash);
+			if (it == s.queue.right.end()) continue;
+			it->info.swap(*i);
+			s.queue.right.replace_data(it, frame);
+			// bump this torrent to the beginning of the list
+			s.queue.left.relocate(s.queue.left.begin(), s.queue.project_left(it));
+		}
+	}
+
+	void torrent_history::add_torrent(torrent_status const& st, int source)
+	{
+		std::unique_lock<std::mutex> fl(m_frame_mutex);
+		int const frame = next_frame();
+		if (!m_restored.empty() && m_restored.erase(st.info_hash))
+		{
+			claim_restored(st, frame, source);
+			return;
+		}
+
+		history_entry_ptr e = std::make_shared<torrent_history_entry>(st, frame, source);
+		shard& s = shard_for(st.info_hash);
+		{
+			std::unique_lock<std::mutex> l(s.mutex);
+			// another session already has this torrent
+			if (s.queue.right.find(st.info_hash) != s.queue.right.end()) return;
+			s.queue.left.push_front(queue_t::left_value_type(frame, st.info_hash, e));
+		}
+		{
+			std::unique_lock<std::mutex> l(m_counts_mutex);
+			m_counts.count(*e, 1);
+		}
+		{
+			std::unique_lock<std::mutex> l(m_index_mutex);
+			m_index.update(st);
+		}
+		m_frame_state |= deferred_frame_count;
+	}
+
+	void torrent_history::claim_restored(torrent_status const& st, int frame
+		, int source)
+	{
+		shard& s = shard_for(st.info_hash);
+		history_entry_ptr prev;
+		{
+			std::unique_lock<std::mutex> l(s.mutex);
+			queue_t::right_iterator it = s.queue.right.find(st.info_hash);
+			if (it != s.queue.right.end()) prev = it->info;
+		}
+		TORRENT_ASSERT(prev);
+		if (!prev) return;
+
+		// clients already have the restored state. Fields that are the same
+		// keep their old frame numbers, and if none changed the torrent
+		// keeps its place in the queue
+		std::shared_ptr<torrent_history_entry> e
+			= std::make_shared<torrent_history_entry>(*prev);
+		bool const changed = e->update_status(st, frame);
+		e->status.handle = st.handle;
+		e->id = st.handle.id();
+		e->source = source;
+
+		{
+			std::unique_lock<std::mutex> l(m_counts_mutex);
+			m_counts.update(*prev, *e);
+		}
+		{
+			std::unique_lock<std::mutex> l(m_index_mutex);
+			m_index.update(e->status);
+		}
+
+		std::unique_lock<std::mutex> l(s.mutex);
+		queue_t::right_iterator it = s.queue.right.find(st.info_hash);
+		if (it == s.queue.right.end()) return;
+		history_entry_ptr published(e);
+		it->info.swap(published);
+		if (!changed) return;
+		s.queue.right.replace_data(it, frame);
+		s.queue.left.relocate(s.queue.left.begin(), s.queue.project_left(it));
+		l.unlock();
+		m_frame_state |= deferred_frame_count;
+	}
+
+	void torrent_history::remove_torrent(sha1_hash const& ih, int source)
+	{
+		std::unique_lock<std::mutex> fl(m_frame_mutex);
+		int const frame = next_frame();
+		std::uint32_t id = 0;
+		history_entry_ptr removed;
+		{
+			shard& s = shard_for(ih);
+			std::unique_lock<std::mutex> l(s.mutex);
+			queue_t::right_iterator it = s.queue.right.find(ih);
+			if (it != s.queue.right.end() && source >= 0
+				&& it->info->source != source)
+			{
+				return;
+			}
+			if (it != s.queue.right.end())
+			{
+				removed = it->info;
+				id = removed->id;
+				s.queue.right.erase(it);
+			}
+		}
+		m_restored.erase(ih);
+
+		if (removed)
+		{
+			std::unique_lock<std::mutex> l(m_counts_mutex);
+			m_counts.count(*removed, -1);
+			m_counts.count_labels(removed->labels.get(), -1);
+		}
+		if (removed)
+		{
+			std::unique_lock<std::mutex> l(m_index_mutex);
+			m_index.remove(ih);
+		}
+
+		{
+			std::unique_lock<std::mutex> l(m_removed_mutex);
+			add_removed(frame, ih, id);
+		}
+
+		m_frame_state |= deferred_frame_count;
+	}
+
 	void torrent_history::handle_alert(alert const* a)
 	{
+		handle_source_alert(a, 0);
+	}
+
+	void torrent_history::handle_source_alert(alert const* a, int source)
+	{
+		std::unique_lock<std::mutex> dl(m_dispatch_mutex);
+
 		add_torrent_alert const* ta = alert_cast<add_torrent_alert>(a);
 		torrent_removed_alert const* td = alert_cast<torrent_removed_alert>(a);
 		state_update_alert const* su = alert_cast<state_update_alert>(a);
 		torrent_update_alert const* tu = alert_cast<torrent_update_alert>(a);
 		if (tu)
 		{
-			std::unique_lock<std::mutex> l(m_mutex);
+			std::unique_lock<std::mutex> fl(m_frame_mutex);
+			int const frame = next_frame();
 
-			// first remove the old hash
-			m_removed.push_front(std::make_pair(m_frame + 1, tu->old_ih));
-			torrent_history_entry st;
-			st.status.info_hash = tu->old_ih;
-			queue_t::right_iterator it = m_queue.right.find(st);
-			if (it == m_queue.right.end()) return;
+			history_entry_ptr old_entry;
+			{
+				shard& s = shard_for(tu->old_ih);
+				std::unique_lock<std::mutex> l(s.mutex);
+				queue_t::right_iterator it = s.queue.right.find(tu->old_ih);
+				if (it == s.queue.right.end()) return;
+				if (it->info->source != source) return;
 
-			st = it->first;
-			m_queue.right.erase(st);
+				old_entry = it->info;
+				s.queue.right.erase(it);
+			}
 
-			// then add the torrent under the new inf-hash
-			st.status.info_hash = tu->new_ih;
-			m_queue.left.push_front(std::make_pair(m_frame + 1, st));
+			{
+				// first remove the old hash
+				std::unique_lock<std::mutex> l(m_removed_mutex);
+				add_removed(frame, tu->old_ih, 0);
+			}
 
-			// weed out torrents that were removed a long time ago
-			while (m_removed.size() > 1000 && m_removed.back().first < m_frame - 10)
-				m_removed.pop_back();
+			// then add the torrent under the new info-hash
+			std::shared_ptr<torrent_history_entry> e
+				= std::make_shared<torrent_history_entry>(*old_entry);
+			e->status.info_hash = tu->new_ih;
+			// clients don't know the torrent by its new info-hash
+			e->clear_previous();
+			e->json = std::make_shared<torrent_json_strings>(e->full_status());
+			{
+				shard& s = shard_for(tu->new_ih);
+				std::unique_lock<std::mutex> l(s.mutex);
+				s.queue.left.push_front(queue_t::left_value_type(frame, tu->new_ih, e));
+			}
+			{
+				std::unique_lock<std::mutex> l(m_index_mutex);
+				m_index.remove(tu->old_ih);
+				m_index.update(e->status);
+				if (e->labels) m_index.set_labels(tu->new_ih, *e->labels);
+			}
 
-			m_deferred_frame_count = true;
+			m_frame_state |= deferred_frame_count;
 		}
 		else if (ta)
 		{
 			torrent_status st = ta->handle.status();
 			TORRENT_ASSERT(st.info_hash == st.handle.info_hash());
 			TORRENT_ASSERT(st.handle == ta->handle);
-
-			std::unique_lock<std::mutex> l(m_mutex);
-			m_queue.left.push_front(std::make_pair(m_frame + 1, torrent_history_entry(st, m_frame + 1)));
-			m_deferred_frame_count = true;
+			add_torrent(st, source);
 		}
 		else if (td)
 		{
-			std::unique_lock<std::mutex> l(m_mutex);
-
-			m_removed.push_front(std::make_pair(m_frame + 1, td->info_hash));
-			torrent_history_entry st;
-			st.status.info_hash = td->info_hash;
-			m_queue.right.erase(st);
-			// weed out torrents that were removed a long time ago
-			while (m_removed.size() > 1000 && m_removed.back().first < m_frame - 10)
-				m_removed.pop_back();
-
-			m_deferred_frame_count = true;
+			remove_torrent(td->info_hash, source);
 		}
 		else if (su)
 		{
-			std::unique_lock<std::mutex> l(m_mutex);
-
-			++m_frame;
-			m_deferred_frame_count = false;
+			// clearing the deferred flag prevents readers from bumping the
+			// frame counter under our feet. Any torrents added or removed
+			// since the last update fall into this new frame. The new frame
+			// isn't published until all shards have been updated, readers
+			// keep seeing the previous frame until then
+			int const frame = (m_frame_state.fetch_and(~int(deferred_frame_count)) >> 1) + 1;
 
+			// bucket the updates by shard, to only take each shard's
+			// mutex once
+			std::vector<torrent_status const*> buckets[num_shards];
 			std::vector<torrent_status> const& st = su->status;
 			for (std::vector<torrent_status>::const_iterator i = st.begin()
 				, end(st.end()); i != end; ++i)
 			{
-				torrent_history_entry e;
-				e.status.info_hash = i->info_hash;
-
-				queue_t::right_iterator it = m_queue.right.find(e);
-				if (it == m_queue.right.end()) continue;
-				const_cast<torrent_history_entry&>(it->first).update_status(*i, m_frame);
-				m_queue.right.replace_data(it, m_frame);
-				// bump this torrent to the beginning of the list
-				m_queue.left.relocate(m_queue.left.begin(), m_queue.project_left(it));
+				buckets[i->info_hash[0] % num_shards].push_back(&*i);
 			}
-/*
-			printf("===== frame: %d =====\n", m_frame);
-			for (queue_t::left_iterator i = m_queue.left.begin()
-				, end(m_queue.left.end()); i != end; ++i)
+
+			if (int(st.size()) > parallel_update_threshold)
 			{
-				i->second.debug_print(m_frame);
-//				printf("%3d: (%s) %s\n", i->first, i->second.error.c_str(), i->second.name.c_str());
+				std::vector<std::future<void> > jobs;
+				for (int i = 0; i < num_shards; ++i)
+				{
+					if (buckets[i].empty()) continue;
+					jobs.push_back(std::async(std::launch::async, &torrent_history::update_shard
+						, this, std::ref(m_shards[i]), std::cref(buckets[i]), frame, source));
+				}
+				for (std::vector<std::future<void> >::iterator i = jobs.begin()
+					, end(jobs.end()); i != end; ++i)
+				{
+					i->get();
+				}
+			}
+			else
+			{
+				for (int i = 0; i < num_shards; ++i)
+				{
+					if (buckets[i].empty()) continue;
+					update_shard(m_shards[i], buckets[i], frame, source);
+				}
+			}
+
+			m_frame_state = frame << 1;
+		}
+	}
+
+	void torrent_history::add_removed(int frame, sha1_hash const& ih
+		, std::uint32_t id)
+	{
+		if (m_removed.empty() || m_removed.back().frame != frame)
+		{
+			m_removed.push_back(removed_bucket());
+			m_removed.back().frame = frame;
+		}
+		m_removed.back().torrents.push_back(removed_torrent(ih, id));
+		++m_num_removed;
+
+		// weed out torrents that were removed a long time ago, or the
+		// oldest ones when there are too many. The bucket of the current
+		// frame is always kept
+		while (m_removed.size() > 1
+			&& (m_removed.front().frame < frame - removed_frames
+				|| m_num_removed > max_removed))
+		{
+			m_num_removed -= int(m_removed.front().torrents.size());
+			m_removed_horizon = m_removed.front().frame;
+			m_removed.pop_front();
+		}
+	}
+
+	std::deque<torrent_history::removed_bucket>::const_iterator
+	torrent_history::removed_after(int frame) const
+	{
+		return std::upper_bound(m_removed.begin(), m_removed.end(), frame
+			, [](int f, removed_bucket const& b) { return f < b.frame; });
+	}
+
+	bool torrent_history::removed_since(int frame, std::vector<sha1_hash>& torrents) const
+	{
+		std::unique_lock<std::mutex> l(m_removed_mutex);
+		for (std::deque<removed_bucket>::const_iterator i = removed_after(frame)
+			, end(m_removed.end()); i != end; ++i)
+		{
+			for (std::vector<removed_torrent>::const_iterator t = i->torrents.begin()
+				, tend(i->torrents.end()); t != tend; ++t)
+			{
+				torrents.push_back(t->info_hash);
 			}
-*/
 		}
+		return frame >= m_removed_horizon;
 	}
 
-	void torrent_history::removed_since(int frame, std::vector<sha1_hash>& torrents) const
+	bool torrent_history::removed_ids_since(int frame, std::vector<std::uint32_t>& ids) const
 	{
-		torrents.clear();
-		std::unique_lock<std::mutex> l(m_mutex);
-		for (std::deque<std::pair<int, sha1_hash> >::const_iterator i = m_removed.begin()
+		std::unique_lock<std::mutex> l(m_removed_mutex);
+		for (std::deque<removed_bucket>::const_iterator i = removed_after(frame)
 			, end(m_removed.end()); i != end; ++i)
 		{
-			if (i->first <= frame) break;
-			torrents.push_back(i->second);
+			for (std::vector<removed_torrent>::const_iterator t = i->torrents.begin()
+				, tend(i->torrents.end()); t != tend; ++t)
+			{
+				if (t->id == 0) continue;
+				ids.push_back(t->id);
+			}
 		}
+		return frame >= m_removed_horizon;
+	}
+
+	int torrent_history::removed_horizon() const
+	{
+		std::unique_lock<std::mutex> l(m_removed_mutex);
+		return m_removed_horizon;
 	}
 
 	void torrent_history::updated_since(int frame, std::vector<torrent_status>& torrents) const
 	{
-		std::unique_lock<std::mutex> l(m_mutex);
-		for (queue_t::left_const_iterator i = m_queue.left.begin()
-			, end(m_queue.left.end()); i != end; ++i)
+		std::vector<history_entry_ptr> entries;
+		updated_fields_since(frame, entries);
+
+		torrents.reserve(torrents.size() + entries.size());
+		for (std::vector<history_entry_ptr>::iterator i = entries.begin()
+			, end(entries.end()); i != end; ++i)
 		{
-			if (i->first <= frame) break;
-			torrents.push_back(i->second.status);
+			torrents.push_back((*i)->full_status());
 		}
 	}
 
-	void torrent_history::updated_fields_since(int frame, std::vector<torrent_history_entry>& torrents) const
+	void torrent_history::updated_fields_since(int frame, std::vector<history_entry_ptr>& torrents) const
 	{
-		std::unique_lock<std::mutex> l(m_mutex);
-		for (queue_t::left_const_iterator i = m_queue.left.begin()
-			, end(m_queue.left.end()); i != end; ++i)
+		for (int k = 0; k < num_shards; ++k)
 		{
-			if (i->first <= frame) break;
-			torrents.push_back(i->second);
+			shard const& s = m_shards[k];
+			std::unique_lock<std::mutex> l(s.mutex);
+			for (queue_t::left_const_iterator i = s.queue.left.begin()
+				, end(s.queue.left.end()); i != end; ++i)
+			{
+				if (i->first <= frame) break;
+				torrents.push_back(i->info);
+			}
 		}
 	}
 
 	torrent_status torrent_history::get_torrent_status(sha1_hash const& ih) const
 	{
-		torrent_history_entry st;
-		st.status.info_hash = ih;
+		history_entry_ptr e;
+		{
+			shard const& s = shard_for(ih);
+			std::unique_lock<std::mutex> l(s.mutex);
 
-		std::unique_lock<std::mutex> l(m_mutex);
+			queue_t::right_const_iterator it = s.queue.right.find(ih);
+			if (it != s.queue.right.end()) e = it->info;
+		}
+		if (e) return e->full_status();
 
-		queue_t::right_const_iterator it = m_queue.right.find(st);
-		if (it != m_queue.right.end()) return it->first.status;
-		return st.status;
+		torrent_status st;
+		st.info_hash = ih;
+		return st;
+	}
+
+	void torrent_history::get_torrents(std::vector<sha1_hash> const& ih
+		, std::vector<history_entry_ptr>& torrents) const
+	{
+		// torrents restored from a snapshot aren't in the session until
+		// they're added back. They have no handle to act on yet
+		std::vector<sha1_hash const*> buckets[num_shards];
+		std::unique_lock<std::mutex> fl(m_frame_mutex);
+		for (std::vector<sha1_hash>::const_iterator i = ih.begin()
+			, end(ih.end()); i != end; ++i)
+		{
+			if (!m_restored.empty() && m_restored.count(*i)) continue;
+			buckets[(*i)[0] % num_shards].push_back(&*i);
+		}
+		fl.unlock();
+
+		torrents.reserve(torrents.size() + ih.size());
+		for (int k = 0; k < num_shards; ++k)
+		{
+			if (buckets[k].empty()) continue;
+			shard const& s = m_shards[k];
+			std::unique_lock<std::mutex> l(s.mutex);
+			for (std::vector<sha1_hash const*>::const_iterator i = buckets[k].begin()
+				, end(buckets[k].end()); i != end; ++i)
+			{
+				queue_t::right_const_iterator it = s.queue.right.find(**i);
+				if (it == s.queue.right.end()) continue;
+				torrents.push_back(it->info);
+			}
+		}
+	}
+
+	void torrent_history::get_counts(torrent_counts& c) const
+	{
+		std::unique_lock<std::mutex> l(m_counts_mutex);
+		c = m_counts;
+	}
+
+	bool torrent_history::set_labels(sha1_hash const& ih
+		, std::vector<std::string> labels)
+	{
+		std::sort(labels.begin(), labels.end());
+		labels.erase(std::unique(labels.begin(), labels.end()), labels.end());
+		if (!labels.empty() && labels.front().empty()) labels.erase(labels.begin());
+
+		// this is called from the clients' threads. Holding the dispatch
+		// mutex keeps the alert thread from replacing the entry while its
+		// successor is built, and from changing the frame under our feet
+		std::unique_lock<std::mutex> dl(m_dispatch_mutex);
+		std::unique_lock<std::mutex> fl(m_frame_mutex);
+		int const frame = next_frame();
+
+		shard& s = shard_for(ih);
+		history_entry_ptr prev;
+		{
+			std::unique_lock<std::mutex> l(s.mutex);
+			queue_t::right_iterator it = s.queue.right.find(ih);
+			if (it == s.queue.right.end()) return false;
+			prev = it->info;
+		}
+
+		std::vector<std::string> const empty;
+		std::vector<std::string> const& prev_labels = prev->labels ? *prev->labels : empty;
+		if (prev_labels == labels) return true;
+
+		std::shared_ptr<torrent_history_entry> e
+			= std::make_shared<torrent_history_entry>(*prev);
+		if (labels.empty()) e->labels.reset();
+		else e->labels = std::make_shared<std::vector<std::string> const>(labels);
+		e->labels_frame = frame;
+
+		{
+			std::unique_lock<std::mutex> l(m_counts_mutex);
+			m_counts.count_labels(prev->labels.get(), -1);
+			m_counts.count_labels(e->labels.get(), 1);
+		}
+		{
+			std::unique_lock<std::mutex> l(m_index_mutex);
+			m_index.set_labels(ih, labels);
+		}
+
+		std::unique_lock<std::mutex> l(s.mutex);
+		queue_t::right_iterator it = s.queue.right.find(ih);
+		if (it == s.queue.right.end()) return false;
+		history_entry_ptr published(e);
+		it->info.swap(published);
+		s.queue.right.replace_data(it, frame);
+		s.queue.left.relocate(s.queue.left.begin(), s.queue.project_left(it));
+		l.unlock();
+		m_frame_state |= deferred_frame_count;
+		return true;
+	}
+
+	int torrent_history::query_torrents(int sort, bool descending, int filter
+		, std::string const& search, std::string const& label
+		, int offset, int limit, std::vector<history_entry_ptr>& torrents) const
+	{
+		std::vector<sha1_hash> window;
+		int matching;
+		{
+			std::unique_lock<std::mutex> l(m_index_mutex);
+			matching = m_index.query(sort, descending, filter, search, label
+				, offset, limit, window);
+		}
+
+		// the window is small, unlike the number of torrents. Looking them
+		// up one by one keeps them in order
+		torrents.reserve(torrents.size() + window.size());
+		for (std::vector<sha1_hash>::iterator i = window.begin()
+			, end(window.end()); i != end; ++i)
+		{
+			shard const& s = shard_for(*i);
+			std::unique_lock<std::mutex> l(s.mutex);
+			queue_t::right_const_iterator it = s.queue.right.find(*i);
+			// the torrent was removed since the index was queried
+			if (it == s.queue.right.end()) continue;
+			torrents.push_back(it->info);
+		}
+		return matching;
 	}
 
 	int torrent_history::frame() const
 	{
-		std::unique_lock<std::mutex> l(m_mutex);
-		if (m_deferred_frame_count)
+		int st = m_frame_state;
+		if ((st & deferred_frame_count) == 0) return st >> 1;
+
+		// there are deferred changes, bump the frame counter. Only one
+		// reader gets to do it. Hold the frame mutex to make sure the
+		// torrents added or removed in the deferred frame are all
+		// visible before we publish it
+		std::unique_lock<std::mutex> l(m_frame_mutex);
+		st = m_frame_state;
+		while (st & deferred_frame_count)
+		{
+			int const new_state = ((st >> 1) + 1) << 1;
+			if (m_frame_state.compare_exchange_weak(st, new_state))
+				return new_state >> 1;
+		}
+		return st >> 1;
+	}
+
+	int torrent_history::cursor_frame(std::uint32_t epoch, int frame) const
+	{
+		if (epoch != m_epoch || frame < 0 || frame > this->frame()) return 0;
+		if (frame < removed_horizon()) return 0;
+		return frame;
+	}
+
+	/*
+		The history snapshot format. All numbers are varints:
+
+			"LTHIST02"            magic
+			epoch
+			the current frame
+			number of fields per torrent (torrent_history_entry::num_fields)
+
+		followed by one section per shard, each one listing its torrents most
+		recently changed first:
+
+			number of torrents
+			(frame, status, frame...)...
+			                      the frame the torrent was last changed in,
+			                      its status (see encode_status()) and the
+			                      frame each field was last changed in
+
+		and the recently removed torrents:
+
+			number of removed torrents
+			(frame, uint8[20])... the frame and info-hash of each one, oldest
+			                      first
+			horizon               the frame the removals before have been
+			                      forgotten
+
+		Frames are stored as their distance back from the current frame.
+		Version 1 snapshots don't have the horizon. Every frame before the
+		one they were saved in is taken to be behind it.
+	*/
+
+	namespace
+	{
+		char const snapshot_magic[] = "LTHIST02";
+		char const snapshot_magic_v1[] = "LTHIST01";
+		int const snapshot_magic_size = 8;
+
+		void write_varint(std::vector<char>& out, std::uint64_t v)
+		{
+			while (v >= 0x80)
+			{
+				out.push_back(char(v | 0x80));
+				v >>= 7;
+			}
+			out.push_back(char(v));
+		}
+
+		bool read_varint(char const*& ptr, char const* end, std::uint64_t& v)
+		{
+			v = 0;
+			for (int shift = 0; ptr != end && shift < 64; shift += 7)
+			{
+				std::uint8_t const c = std::uint8_t(*ptr++);
+				v |= std::uint64_t(c & 0x7f) << shift;
+				if ((c & 0x80) == 0) return true;
+			}
+			return false;
+		}
+
+		// reads a frame stored relative to the current one
+		bool read_frame(char const*& ptr, char const* end, int current, int& f)
+		{
+			std::uint64_t v;
+			if (!read_varint(ptr, end, v) || v > std::uint64_t(current)) return false;
+			f = current - int(v);
+			return true;
+		}
+
+		error_code errno_error()
+		{
+			return error_code(errno, boost::system::generic_category());
+		}
+
+		error_code invalid_snapshot()
+		{
+			return error_code(boost::system::errc::invalid_argument
+				, boost::system::generic_category());
+		}
+	}
+
+	void torrent_history::save_snapshot(std::string const& filename
+		, error_code& ec) const
+	{
+		int const current = frame();
+
+		std::string const tmp = filename + ".tmp";
+		FILE* f = fopen(tmp.c_str(), "wb");
+		if (f == NULL)
+		{
+			ec = errno_error();
+			return;
+		}
+
+		std::vector<char> buf(snapshot_magic, snapshot_magic + snapshot_magic_size);
+		write_varint(buf, m_epoch);
+		write_varint(buf, current);
+		write_varint(buf, torrent_history_entry::num_fields);
+
+		// one shard is buffered at a time
+		bool failed = false;
+		for (int k = 0; k < num_shards && !failed; ++k)
+		{
+			shard const& s = m_shards[k];
+			std::unique_lock<std::mutex> l(s.mutex);
+			write_varint(buf, s.queue.size());
+			for (queue_t::left_const_iterator i = s.queue.left.begin()
+				, end(s.queue.left.end()); i != end; ++i)
+			{
+				torrent_history_entry const& e = *i->info;
+				write_varint(buf, current - (std::min)(i->first, current));
+				encode_status(buf, e.full_status());
+				for (int j = 0; j < torrent_history_entry::num_fields; ++j)
+					write_varint(buf, current - (std::min)(e.frame(j), current));
+			}
+			l.unlock();
+
+			if (fwrite(&buf[0], 1, buf.size(), f) != buf.size()) failed = true;
+			buf.clear();
+		}
+
+		{
+			std::unique_lock<std::mutex> l(m_removed_mutex);
+			write_varint(buf, m_num_removed);
+			for (std::deque<removed_bucket>::const_iterator i = m_removed.begin()
+				, end(m_removed.end()); i != end; ++i)
+			{
+				for (std::vector<removed_torrent>::const_iterator t = i->torrents.begin()
+					, tend(i->torrents.end()); t != tend; ++t)
+				{
+					write_varint(buf, current - (std::min)(i->frame, current));
+					buf.insert(buf.end(), t->info_hash.begin(), t->info_hash.end());
+				}
+			}
+			write_varint(buf, current - (std::min)(m_removed_horizon, current));
+		}
+		if (!failed && fwrite(&buf[0], 1, buf.size(), f) != buf.size()) failed = true;
+
+		if (failed) ec = errno_error();
+		if (fclose(f) != 0 && !ec) ec = errno_error();
+		if (!ec && ::rename(tmp.c_str(), filename.c_str()) != 0) ec = errno_error();
+		if (ec) ::remove(tmp.c_str());
+	}
+
+	bool torrent_history::load_snapshot(std::string const& filename, error_code& ec)
+	{
+		int fd = ::open(filename.c_str(), O_RDONLY);
+		if (fd < 0)
+		{
+			ec = errno_error();
+			return false;
+		}
+
+		struct stat st;
+		if (fstat(fd, &st) != 0)
+		{
+			ec = errno_error();
+			::close(fd);
+			return false;
+		}
+		if (st.st_size < snapshot_magic_size)
+		{
+			ec = invalid_snapshot();
+			::close(fd);
+			return false;
+		}
+
+		void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (map == MAP_FAILED)
+		{
+			ec = errno_error();
+			return false;
+		}
+
+		char const* ptr = static_cast<char const*>(map);
+		char const* const end = ptr + st.st_size;
+
+		// the snapshot is decoded in full before any of it is used, for a
+		// corrupt one to leave the history empty
+		std::vector<std::vector<history_entry_ptr> > shards(num_shards);
+		std::vector<std::vector<int> > shard_frames(num_shards);
+		std::deque<removed_bucket> removed;
+		int num_removed = 0;
+		int horizon = 0;
+
+		std::uint64_t epoch;
+		std::uint64_t current;
+		std::uint64_t num_fields;
+		bool const v1 = memcmp(ptr, snapshot_magic_v1, snapshot_magic_size) == 0;
+		bool ok = v1 || memcmp(ptr, snapshot_magic, snapshot_magic_size) == 0;
+		ptr += snapshot_magic_size;
+		ok = ok && read_varint(ptr, end, epoch)
+			&& read_varint(ptr, end, current)
+			&& read_varint(ptr, end, num_fields)
+			&& epoch > 0 && epoch < max_epoch
+			&& current < (1 << 29)
+			&& num_fields == torrent_history_entry::num_fields;
+
+		for (int k = 0; k < num_shards && ok; ++k)
+		{
+			std::uint64_t num_torrents;
+			if (!read_varint(ptr, end, num_torrents)
+				|| num_torrents > std::uint64_t(end - ptr))
+			{
+				ok = false;
+				break;
+			}
+			shards[k].reserve(num_torrents);
+			shard_frames[k].reserve(num_torrents);
+			for (std::uint64_t i = 0; i < num_torrents && ok; ++i)
+			{
+				std::shared_ptr<torrent_history_entry> e
+					= std::make_shared<torrent_history_entry>();
+				int queue_frame = 0;
+				torrent_status status;
+				int frames[torrent_history_entry::num_fields];
+				ok = read_frame(ptr, end, current, queue_frame)
+					&& decode_status(ptr, end, status);
+				for (int j = 0; j < torrent_history_entry::num_fields && ok; ++j)
+					ok = read_frame(ptr, end, current, frames[j]);
+				if (!ok) break;
+
+				// the torrent isn't in this session yet, there's nothing to
+				// save resume data for
+				status.need_save_resume = false;
+				e->json = std::make_shared<torrent_json_strings>(status);
+				e->set_status(status);
+				e->set_frames(frames);
+				shards[k].push_back(e);
+				shard_frames[k].push_back(queue_frame);
+			}
+		}
+
+		std::uint64_t count = 0;
+		ok = ok && read_varint(ptr, end, count)
+			&& count <= std::uint64_t(end - ptr);
+		for (std::uint64_t i = 0; i < count && ok; ++i)
+		{
+			int f = 0;
+			sha1_hash ih;
+			ok = read_frame(ptr, end, current, f) && end - ptr >= 20;
+			if (!ok) break;
+			std::copy(ptr, ptr + 20, ih.begin());
+			ptr += 20;
+
+			// version 1 lists the most recent removals first
+			if (v1 && (removed.empty() || removed.front().frame != f))
+			{
+				removed.push_front(removed_bucket());
+				removed.front().frame = f;
+			}
+			else if (!v1 && (removed.empty() || removed.back().frame != f))
+			{
+				ok = removed.empty() || removed.back().frame < f;
+				removed.push_back(removed_bucket());
+				removed.back().frame = f;
+			}
+			// restored torrents don't have handle ids
+			(v1 ? removed.front() : removed.back()).torrents.push_back(
+				removed_torrent(ih, 0));
+			++num_removed;
+		}
+		if (v1) horizon = int(current);
+		else ok = ok && read_frame(ptr, end, current, horizon);
+
+		munmap(map, st.st_size);
+		if (!ok)
+		{
+			ec = invalid_snapshot();
+			return false;
+		}
+
+		std::unique_lock<std::mutex> fl(m_frame_mutex);
+		for (int k = 0; k < num_shards; ++k)
+		{
+			shard& s = m_shards[k];
+			std::unique_lock<std::mutex> l(s.mutex);
+			TORRENT_ASSERT(s.queue.empty());
+			for (int i = 0; i < int(shards[k].size()); ++i)
+			{
+				history_entry_ptr const& e = shards[k][i];
+				sha1_hash const& ih = e->status.info_hash;
+				// the torrents are listed most recently changed first
+				s.queue.left.push_back(queue_t::left_value_type(shard_frames[k][i], ih, e));
+				m_restored.insert(ih);
+
+				std::unique_lock<std::mutex> cl(m_counts_mutex);
+				m_counts.count(*e, 1);
+				cl.unlock();
+
+				std::unique_lock<std::mutex> il(m_index_mutex);
+				m_index.update(e->status);
+			}
+		}
+		{
+			std::unique_lock<std::mutex> l(m_removed_mutex);
+			m_removed.swap(removed);
+			m_num_removed = num_removed;
+			m_removed_horizon = horizon;
+		}
+		m_epoch = std::uint32_t(epoch);
+		m_frame_state = int(current) << 1;
+		fl.unlock();
+
+		::remove(filename.c_str());
+		return true;
+	}
+
+	void torrent_history::drop_restored()
+	{
+		boost::unordered_set<sha1_hash> restored;
 		{
-			m_deferred_frame_count = false;
-			++m_frame;
+			std::unique_lock<std::mutex> l(m_frame_mutex);
+			restored.swap(m_restored);
 		}
-		return m_frame;
+
+		for (boost::unordered_set<sha1_hash>::iterator i = restored.begin()
+			, end(restored.end()); i != end; ++i)
+		{
+			remove_torrent(*i, -1);
+		}
+	}
+
+	int const torrent_history_entry::counter_fields[num_counters] =
+	{
+		total_download,
+		total_upload,
+		total_payload_download,
+		total_payload_upload,
+		total_failed_bytes,
+		total_redundant_bytes,
+		total_done,
+		total_wanted_done,
+		all_time_upload,
+		all_time_download,
+		active_time,
+		finished_time,
+		seeding_time,
+	};
+
+	std::int64_t torrent_history_entry::counter(torrent_status const& s, int c)
+	{
+		switch (counter_fields[c])
+		{
+			case total_download: return s.total_download;
+			case total_upload: return s.total_upload;
+			case total_payload_download: return s.total_payload_download;
+			case total_payload_upload: return s.total_payload_upload;
+			case total_failed_bytes: return s.total_failed_bytes;
+			case total_redundant_bytes: return s.total_redundant_bytes;
+			case total_done: return s.total_done;
+			case total_wanted_done: return s.total_wanted_done;
+			case all_time_upload: return s.all_time_upload;
+			case all_time_download: return s.all_time_download;
+			case active_time: return s.active_time;
+			case finished_time: return s.finished_time;
+			case seeding_time: return s.seeding_time;
+		}
+		TORRENT_ASSERT(false);
+		return 0;
+	}
+
+	torrent_history_entry::torrent_history_entry(torrent_status const& st
+		, int f, int src)
+		: base_frame(f)
+		, id(st.handle.id())
+		, source(src)
+		, json(std::make_shared<torrent_json_strings>(st))
+		, labels_frame(0)
+	{
+		set_status(st);
+		std::fill(frame_delta, frame_delta + num_fields, 0);
+		clear_previous();
+	}
+
+	void torrent_history_entry::set_status(torrent_status const& st)
+	{
+		status = st;
+		path = intern_string(st.save_path);
+		tracker = intern_string(st.current_tracker);
+		// swapping with an empty string releases the copies' buffers
+		std::string().swap(status.save_path);
+		std::string().swap(status.current_tracker);
+	}
+
+	torrent_status torrent_history_entry::full_status() const
+	{
+		torrent_status ret = status;
+		ret.save_path = *path;
+		ret.current_tracker = *tracker;
+		return ret;
+	}
+
+	void torrent_history_entry::rebase(int b)
+	{
+		TORRENT_ASSERT(b > base_frame);
+		for (int i = 0; i < num_fields; ++i)
+			frame_delta[i] = std::uint16_t((std::max)(frame(i), b) - b);
+		base_frame = b;
+
+		// a counter stamped with the new base may not have changed after a
+		// client's frame, the previous values can't be trusted
+		clear_previous();
+	}
+
+	void torrent_history_entry::set_frames(int const* frames)
+	{
+		int const newest = *std::max_element(frames, frames + num_fields);
+		int const oldest = *std::min_element(frames, frames + num_fields);
+		base_frame = (std::max)(oldest, newest - int(max_frame_delta));
+		for (int i = 0; i < num_fields; ++i)
+			frame_delta[i] = std::uint16_t((std::max)(frames[i], base_frame) - base_frame);
 	}
 
-	void torrent_history_entry::update_status(torrent_status const& s, int f)
+	bool torrent_history_entry::update_status(torrent_status const& s, int f)
 	{
-#define CMP_SET(x) if (s.x != status.x) frame[int(x)] = f
+		std::uint64_t changed[mask_words];
+		if (!changed_fields(s, changed)) return false;
+		apply_status(s, f, changed);
+		return true;
+	}
+
+	bool torrent_history_entry::changed_fields(torrent_status const& s
+		, std::uint64_t* changed) const
+	{
+		// build a bitmask of all fields that changed. The comparisons are
+		// independent of each other and don't branch, which lets the
+		// compiler interleave and vectorize them, rather than taking a
+		// (mispredicted) branch per field
+		std::fill(changed, changed + mask_words, 0);
+
+#define CMP_SET(x) changed[int(x) / 64] |= std::uint64_t(s.x != status.x) << (int(x) % 64)
 
 		CMP_SET(state);
 		CMP_SET(paused);
@@ -213,10 +1219,8 @@ namespace libtorrent
 		CMP_SET(progress);
 		CMP_SET(progress_ppm);
 		CMP_SET(error);
-		CMP_SET(save_path);
 		CMP_SET(name);
 		CMP_SET(next_announce);
-		CMP_SET(current_tracker);
 		CMP_SET(total_download);
 		CMP_SET(total_upload);
 		CMP_SET(total_payload_download);
@@ -271,7 +1275,62 @@ namespace libtorrent
 		CMP_SET(need_save_resume);
 		CMP_SET(ip_filter_applies);
 
+#undef CMP_SET
+
+		// the strings are kept out of status
+		changed[int(save_path) / 64] |= std::uint64_t(s.save_path != *path)
+			<< (int(save_path) % 64);
+		changed[int(current_tracker) / 64] |= std::uint64_t(s.current_tracker != *tracker)
+			<< (int(current_tracker) % 64);
+
+		std::uint64_t any = 0;
+		for (int i = 0; i < int(mask_words); ++i)
+			any |= changed[i];
+
+		// none of the fields we track changed. Don't bother copying the
+		// status (and don't bump the torrent in the queue)
+		return any != 0;
+	}
+
+	void torrent_history_entry::apply_status(torrent_status const& s, int f
+		, std::uint64_t const* changed)
+	{
+		if (f - base_frame > int(max_frame_delta))
+			rebase(f - int(max_frame_delta));
+
+		// the counters that changed remember what they changed from, and
+		// since when, for clients to be sent the difference
+		for (int c = 0; c < num_counters; ++c)
+		{
+			int const k = counter_fields[c];
+			if (((changed[k / 64] >> (k % 64)) & 1) == 0) continue;
+			prev_value[c] = counter(status, c);
+			prev_frame[c] = frame(k);
+		}
+
+		// stamp all changed fields with the current frame. This is a
+		// select rather than a branch, and vectorizes well
+		std::uint16_t const d = std::uint16_t(f - base_frame);
+		for (int i = 0; i < num_fields; ++i)
+		{
+			bool const c = (changed[i / 64] >> (i % 64)) & 1;
+			frame_delta[i] = c ? d : frame_delta[i];
+		}
+
+		bool const path_changed = (changed[save_path / 64] >> (save_path % 64)) & 1;
+		if (((changed[name / 64] >> (name % 64)) & 1) || path_changed)
+			json = std::make_shared<torrent_json_strings>(s);
+
+		// the name, if it hasn't changed, has the same length and is
+		// assigned into its existing buffer without allocating. The save
+		// path and tracker keep their interned copies unless they changed,
+		// sparing the pool's lock
 		status = s;
+		std::string().swap(status.save_path);
+		std::string().swap(status.current_tracker);
+		if (path_changed) path = intern_string(s.save_path);
+		if ((changed[current_tracker / 64] >> (current_tracker % 64)) & 1)
+			tracker = intern_string(s.current_tracker);
 	}
 
 	char const* fmt(std::string const& s) { return s.c_str(); }
@@ -284,8 +1343,8 @@ namespace libtorrent
 	{
 		int frame_diff;
 
-#define PRINT(x, type) frame_diff = (std::min)(current_frame - frame[x], 20); \
-		printf("%s\x1b[38;5;%dm%" type "\x1b[0m ", frame[x] >= current_frame  ? "\x1b[41m" : "", 255 - frame_diff, fmt(status.x));
+#define PRINT(x, type) frame_diff = (std::min)(current_frame - frame(x), 20); \
+		printf("%s\x1b[38;5;%dm%" type "\x1b[0m ", frame(x) >= current_frame  ? "\x1b[41m" : "", 255 - frame_diff, fmt(status.x));
 	
 		PRINT(state, PRId64);
 		PRINT(paused, PRId64);
@@ -301,7 +1360,7 @@ namespace libtorrent
 //		PRINT(save_path, "s");
 		PRINT(name, "s");
 //		PRINT(next_announce, PRId64);
-		PRINT(current_tracker, "s");
+		printf("%s ", tracker->c_str());
 		PRINT(total_download, PRId64);
 		PRINT(total_upload, PRId64);
 		PRINT(total_payload_download, PRId64);
@@ -34,27 +34,67 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_TORRENT_HISTORY_HPP
 
 #include "alert_observer.hpp"
+#include "torrent_index.hpp"
+#include "string_pool.hpp"
 #include "libtorrent/torrent_status.hpp"
+#include "libtorrent/error_code.hpp"
 #include <mutex> // for mutex
+#include <limits.h> // for INT_MAX
+#include <algorithm>
+#include <atomic>
 #include <boost/bimap.hpp>
 #include <boost/bimap/list_of.hpp>
 #include <boost/bimap/unordered_set_of.hpp>
+#include <boost/unordered_set.hpp>
 #include <deque>
+#include <memory>
+#include <map>
+#include <string>
+#include <vector>
 
 namespace libtorrent
 {
 	struct alert_handler;
 
+	// the JSON forms of the strings that are sent for every torrent in a
+	// list. They're shared between the versions of a history entry, and only
+	// built again when the fields they're made from change, so serializers
+	// can copy them into responses as-is
+	struct torrent_json_strings
+	{
+		explicit torrent_json_strings(torrent_status const& st);
+
+		// the info-hash in hex, null terminated
+		char info_hash[41];
+
+		// escaped, but not quoted. The save path is interned, like the
+		// one of the entry
+		std::string name;
+		interned_string save_path;
+	};
+
 	// this is the type that keeps track of frame counters for each
 	// field in torrent_status. The frame counters indicate which frame
 	// they were last modified in. This is used to send minimal updates
 	// of changes to torrents.
 	struct torrent_history_entry
 	{
-		// this is the current state of the torrent
+		// this is the current state of the torrent. Its save_path and
+		// current_tracker are left empty, they're kept in path and tracker
 		torrent_status status;
 
-		void update_status(torrent_status const& s, int frame);
+		// the save path and current tracker of the torrent, shared with all
+		// other torrents that have the same ones. Never null
+		interned_string path;
+		interned_string tracker;
+
+		// a copy of status with the save path and tracker filled in
+		torrent_status full_status() const;
+
+		// updates the status and stamps the fields that changed with the
+		// specified frame. Returns false if none of the tracked fields
+		// changed, in which case the status is left untouched
+		bool update_status(torrent_status const& s, int frame);
 
 		bool operator==(torrent_history_entry const& e) const { return e.status.info_hash == status.info_hash; }
 
@@ -136,66 +176,402 @@ namespace libtorrent
 			num_fields,
 		};
 
-		// these are the frames each individual field was last changed
-		int frame[num_fields];
+		// a bit per field
+		enum { mask_words = (num_fields + 63) / 64 };
+
+		// sets the bits of the fields of s that differ from this entry's.
+		// Returns false if none of them do. This doesn't modify the entry,
+		// to tell whether it needs to be copied before it's updated
+		bool changed_fields(torrent_status const& s, std::uint64_t* changed) const;
+
+		// like update_status(), for the changed fields as returned by
+		// changed_fields()
+		void apply_status(torrent_status const& s, int frame
+			, std::uint64_t const* changed);
+
+		// the frame field i was last changed in
+		int frame(int i) const { return base_frame + frame_delta[i]; }
+
+		// the frames each individual field was last changed in, relative
+		// to base_frame. 16 bits cover 18 hours of a frame a second. When a
+		// change is further than that from the base, the base moves up and
+		// the fields last changed before it are stamped with the new base.
+		// Clients that far behind may be sent fields they already have,
+		// but never miss a change
+		enum { max_frame_delta = 0xffff };
+		int base_frame;
+		std::uint16_t frame_delta[num_fields];
+
+		// sets the frames of all fields. They may be spread out further
+		// than max_frame_delta, in which case the oldest ones are clamped
+		void set_frames(int const* frames);
+
+		// the fields that only count up (bytes and seconds). Serializers
+		// may send changes to these as the difference from the value the
+		// client already has. prev_value and prev_frame are indexed by the
+		// position in counter_fields
+		enum { num_counters = 13 };
+		static int const counter_fields[num_counters];
+
+		// the value of counter c in s
+		static std::int64_t counter(torrent_status const& s, int c);
+
+		// the value each counter had before its last change, and the frame
+		// that value was set in. INT_MAX if there is no previous value
+		std::int64_t prev_value[num_counters];
+		int prev_frame[num_counters];
+
+		// sets v to the value of counter c as of frame since, and returns
+		// true, if the counter changed after that frame and the value it
+		// changed from was already set then
+		bool previous_value(int c, int since, std::int64_t& v) const
+		{
+			if (since <= 0 || prev_frame[c] > since
+				|| frame(counter_fields[c]) <= since) return false;
+			v = prev_value[c];
+			return true;
+		}
 
-		torrent_history_entry() {}
+		// forgets the previous values, for clients to be sent the counters in
+		// full. For instance when the torrent is new to them
+		void clear_previous()
+		{
+			for (int c = 0; c < num_counters; ++c)
+				prev_frame[c] = INT_MAX;
+		}
 
-		torrent_history_entry(torrent_status const& st, int f)
-			: status(st)
+		// the torrent's handle id. It's captured when the torrent is added,
+		// since it can't be queried from the handle once the torrent is gone
+		std::uint32_t id;
+
+		// the index of the session the torrent belongs to, as returned by
+		// torrent_history::add_source(). 0 for the session the history was
+		// constructed with
+		int source;
+
+		// this is never null for entries in the history
+		std::shared_ptr<torrent_json_strings const> json;
+
+		// the labels the user tagged the torrent with, sorted and without
+		// duplicates. Null if it has none. Like json, it's shared between
+		// the versions of the entry
+		std::shared_ptr<std::vector<std::string> const> labels;
+
+		bool has_label(std::string const& l) const
+		{ return labels && std::binary_search(labels->begin(), labels->end(), l); }
+
+		// the frame the labels were last changed in. 0 if they never were,
+		// torrents added after a frame are sent in full anyway
+		int labels_frame;
+
+		torrent_history_entry()
+			: path(intern_string(std::string()))
+			, tracker(path)
+			, base_frame(0)
+			, id(0)
+			, source(0)
+			, labels_frame(0)
 		{
-			for (int i = 0; i < num_fields; ++i)
-				frame[i] = f;
+			std::fill(frame_delta, frame_delta + num_fields, 0);
+			clear_previous();
 		}
 
+		torrent_history_entry(torrent_status const& st, int f, int src = 0);
+
+		// stores st as the current state, interning its strings
+		void set_status(torrent_status const& st);
+
 		void debug_print(int current_frame) const;
+
+	private:
+
+		// moves base_frame up to b, clamping the fields that are older
+		void rebase(int b);
 	};
 
 	inline std::size_t hash_value(torrent_history_entry const& te)
 	{ return hash_value(te.status.info_hash); }
 
+	// aggregate counts of the torrents in the history, by the categories
+	// the clients' filter sidebars use. They're kept up to date as torrents
+	// are added, removed and updated, so reading them doesn't require a
+	// scan over all torrents
+	struct torrent_counts
+	{
+		torrent_counts();
+
+		// every torrent is counted in exactly one of error, paused, queued
+		// or, for the rest, state (indexed by torrent_status::state_t)
+		enum { num_states = 8 };
+		int state[num_states];
+		int error;
+		// paused and not auto-managed
+		int paused;
+		// paused and auto-managed
+		int queued;
+
+		// torrents transferring payload in either direction
+		int active;
+		int total;
+
+		// the number of torrents by the host name of their current
+		// tracker. Torrents without a working tracker aren't counted
+		std::map<std::string, int> trackers;
+
+		// the number of torrents with each label
+		std::map<std::string, int> labels;
+
+		// adds (sign = 1) or removes (sign = -1) a torrent
+		void count(torrent_history_entry const& e, int sign);
+
+		// adds or removes a torrent's labels. l may be null
+		void count_labels(std::vector<std::string> const* l, int sign);
+
+		// moves a torrent from the categories of its previous status to
+		// the ones of its new status
+		void update(torrent_history_entry const& prev, torrent_history_entry const& e);
+
+	private:
+		void count_state(torrent_status const& st, int sign);
+		void count_tracker(std::string const& url, int sign);
+	};
+
+	// entries in the history are immutable once published. Updates replace
+	// the entry with a new copy. This lets readers hold on to entries
+	// without copying them and without holding any lock
+	typedef std::shared_ptr<torrent_history_entry const> history_entry_ptr;
+
 	struct torrent_history : alert_observer
 	{
 
 		torrent_history(alert_handler* h);
 		~torrent_history();
 
-		// returns the info-hashes of the torrents that have been
-		// removed since the specified frame number
-		void removed_since(int frame, std::vector<sha1_hash>& torrents) const;
+		// merges the torrents of another session into the history. Its
+		// entries are stamped with the returned index, and their
+		// frame numbers are shared with the other sessions'. The alerts of
+		// all sessions are handled one at a time, so they may be dispatched
+		// from different threads. If two sessions have the same torrent,
+		// the one that added it first owns the entry. This must be called
+		// before any alerts are dispatched by h
+		int add_source(alert_handler* h);
+
+		// appends the info-hashes of the torrents that have been
+		// removed since the specified frame number. Returns false if frame
+		// is older than removed_horizon(), in which case some of the
+		// removals are no longer known and the client has to start over
+		bool removed_since(int frame, std::vector<sha1_hash>& torrents) const;
+
+		// appends the handle ids of the torrents that have been removed since
+		// the specified frame number. Torrents that only changed info-hash
+		// are not included. Returns false like removed_since()
+		bool removed_ids_since(int frame, std::vector<std::uint32_t>& ids) const;
+
+		// the oldest frame the removals since are all still known. Clients
+		// behind it have to be sent the full list of torrents, for them to
+		// drop the ones that are gone
+		int removed_horizon() const;
 
 		// returns the torrent_status structures for the torrents
 		// that have changed since the specified frame number
 		void updated_since(int frame, std::vector<torrent_status>& torrents) const;
 
-		void updated_fields_since(int frame, std::vector<torrent_history_entry>& torrents) const;
+		// returns references to the entries of the torrents that have
+		// changed since the specified frame number. The entries have
+		// per-field frame numbers, indicating which fields changed.
+		void updated_fields_since(int frame, std::vector<history_entry_ptr>& torrents) const;
 
 		torrent_status get_torrent_status(sha1_hash const& ih) const;
 
+		// looks up the entries for all the specified info-hashes, taking each
+		// shard's mutex only once. Info-hashes of torrents that aren't in the
+		// history, or are restored from a snapshot but not added back to the
+		// session yet, are skipped. The entries are appended to torrents in
+		// no particular order
+		void get_torrents(std::vector<sha1_hash> const& ih
+			, std::vector<history_entry_ptr>& torrents) const;
+
 		// the current frame number
 		int frame() const;
 
+		// identifies the frame numbers of this history. It's only carried
+		// over a restart when the history is restored from a snapshot.
+		// Clients holding frame numbers of another epoch have to start over
+		std::uint32_t epoch() const { return m_epoch; }
+
+		// returns frame if it's a frame number of the specified epoch, that
+		// isn't in the future and isn't behind removed_horizon(). Otherwise
+		// returns 0, meaning everything
+		int cursor_frame(std::uint32_t epoch, int frame) const;
+
+		// writes the torrents, the frames their fields changed in and the
+		// recently removed torrents to filename, for load_snapshot() to
+		// pick up after a restart. This must not be called while alerts are
+		// being dispatched
+		void save_snapshot(std::string const& filename, error_code& ec) const;
+
+		// restores the epoch, frame numbers and torrents of a snapshot. The
+		// restored torrents are listed with their saved state until they're
+		// added to the session again, at which point only the fields that
+		// differ are stamped with a new frame. The file is removed once it's
+		// loaded, for a crash not to restore it again. This must be called
+		// before any torrents are added
+		bool load_snapshot(std::string const& filename, error_code& ec);
+
+		// removes the restored torrents that haven't been added back to the
+		// session. Call this once all torrents have been loaded
+		void drop_restored();
+
+		// copies the current aggregate counts
+		void get_counts(torrent_counts& c) const;
+
+		// replaces the labels of a torrent. They're sorted and duplicates
+		// and empty labels are dropped. The torrent is stamped with a new
+		// frame, like any other change. Returns false if the torrent isn't
+		// in the history
+		bool set_labels(sha1_hash const& ih, std::vector<std::string> labels);
+
+		// looks up the entries of a sorted and filtered window of the
+		// torrents, in order. The arguments are the ones of
+		// torrent_index::query(). Returns the number of torrents matching
+		// filter, search and label
+		int query_torrents(int sort, bool descending, int filter
+			, std::string const& search, std::string const& label
+			, int offset, int limit, std::vector<history_entry_ptr>& torrents) const;
+
 		virtual void handle_alert(alert const* a);
 
+		// adds a torrent to the history the way an add_torrent_alert does,
+		// once it has the torrent's status. This lets a history be filled
+		// in without a session, by benchmarks for instance
+		void add_torrent(torrent_status const& st, int source = 0);
+
 	private:	
 
+		// hands the alerts of a session added by add_source() to the
+		// history, along with the session's index
+		struct source_observer : alert_observer
+		{
+			source_observer(torrent_history* hist, alert_handler* h, int index);
+			~source_observer();
+			virtual void handle_alert(alert const* a);
+
+			torrent_history* m_hist;
+			alert_handler* m_alerts;
+			int m_index;
+		};
+
+		void handle_source_alert(alert const* a, int source);
+
 		// first is the frame this torrent was last
-		// seen modified in, second is the information
-		// about the torrent that was modified
+		// seen modified in, second is the info-hash of
+		// the torrent and the info is the current state
+		// of the torrent. The list is ordered by frame,
+		// most recently modified first, so the torrents
+		// updated since a frame is always a prefix of it
 		typedef boost::bimap<boost::bimaps::list_of<int>
-			, boost::bimaps::unordered_set_of<torrent_history_entry> > queue_t;
+			, boost::bimaps::unordered_set_of<sha1_hash>
+			, boost::bimaps::with_info<history_entry_ptr> > queue_t;
+
+		// the torrents are split up into shards, by info-hash. Each shard
+		// has its own mutex, so readers only ever contend with the alert
+		// thread on the one shard it's currently updating, and shards can
+		// be updated in parallel.
+		struct shard
+		{
+			mutable std::mutex mutex;
+			queue_t queue;
+		};
+
+		enum { num_shards = 16 };
+
+		shard& shard_for(sha1_hash const& ih);
+		shard const& shard_for(sha1_hash const& ih) const;
+
+		// source is the session the torrent was removed from. Entries of
+		// other sessions are left alone. -1 removes the entry regardless
+		void remove_torrent(sha1_hash const& ih, int source);
+
+		// replaces a restored entry with the torrent's live status. Must be
+		// called with m_frame_mutex held
+		void claim_restored(torrent_status const& st, int frame, int source);
+
+		// update all torrents in the specified shard with the new status
+		// and stamp changed fields with the specified frame. Only the
+		// entries owned by source are updated
+		void update_shard(shard& s, std::vector<torrent_status const*> const& st
+			, int frame, int source);
+
+		shard m_shards[num_shards];
+
+		struct removed_torrent
+		{
+			removed_torrent(sha1_hash const& ih, std::uint32_t i)
+				: info_hash(ih), id(i) {}
+			sha1_hash info_hash;
+			// zero for torrents that were re-added under a new info-hash
+			std::uint32_t id;
+		};
+
+		// the torrents removed in one frame
+		struct removed_bucket
+		{
+			int frame;
+			std::vector<removed_torrent> torrents;
+		};
+
+		// records a removal in the bucket of the frame, and weeds out old
+		// buckets. Must be called with m_removed_mutex held
+		void add_removed(int frame, sha1_hash const& ih, std::uint32_t id);
+
+		// the first bucket with removals after frame. Must be called with
+		// m_removed_mutex held
+		std::deque<removed_bucket>::const_iterator removed_after(int frame) const;
 
-		mutable std::mutex m_mutex;
+		// the removed torrents by frame, oldest first. Looking up the
+		// removals since a frame is a binary search
+		mutable std::mutex m_removed_mutex;
+		std::deque<removed_bucket> m_removed;
 
-		queue_t m_queue;
+		// the number of torrents in all buckets
+		int m_num_removed;
 
-		std::deque<std::pair<int, sha1_hash> > m_removed;
+		// the most recent frame whose removals have been weeded out
+		int m_removed_horizon;
+
+		// the aggregate counts of all torrents in the shards
+		mutable std::mutex m_counts_mutex;
+		torrent_counts m_counts;
+
+		// the torrents of the shards by sort keys, filter categories and
+		// name, for query_torrents()
+		mutable std::mutex m_index_mutex;
+		torrent_index m_index;
 
 		alert_handler* m_alerts;
 
+		// the sessions added by add_source(). Their indices start at 1
+		std::vector<std::shared_ptr<source_observer> > m_sources;
+
+		// held while handling an alert, for the alerts of several sessions
+		// to not be handled at the same time
+		std::mutex m_dispatch_mutex;
+
+		std::uint32_t m_epoch;
+
+		// the info-hashes of the torrents restored from a snapshot that
+		// haven't been added to the session yet. Protected by m_frame_mutex
+		boost::unordered_set<sha1_hash> m_restored;
+
 		// frame counter. This is incremented every
-		// time we get a status update for torrents
-		mutable int m_frame;
+		// time we get a status update for torrents.
+		// The frame number is stored shifted up one bit, the
+		// lowest bit is the deferred-frame-count flag. Keeping
+		// both in the same atomic lets frame() be lock-free
+		// while the alert thread is updating the shards. The new
+		// frame is only published once all shards have been updated,
+		// so readers never observe a frame whose updates aren't
+		// visible yet.
 
 		// if we haven't gotten any status updates
 		// but we have received add or delete alerts,
@@ -205,7 +581,17 @@ namespace libtorrent
 		// potentially returned twice, once when they
 		// happen and once after we've received an
 		// update and increment the frame counter
-		mutable bool m_deferred_frame_count;
+		mutable std::atomic<int> m_frame_state;
+
+		// serializes bumping the frame counter for deferred changes with
+		// adding and removing torrents. This is only taken by readers
+		// when there are deferred frame counts.
+		mutable std::mutex m_frame_mutex;
+
+		enum { deferred_frame_count = 1 };
+
+		// the frame the next change will be stamped with
+		int next_frame() const { return (m_frame_state >> 1) + 1; }
 	};
 }
 
@@ -0,0 +1,381 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "torrent_index.hpp"
+
+#include <algorithm>
+#include <ctype.h>
+
+namespace libtorrent
+{
+	namespace
+	{
+		std::string to_lower(std::string s)
+		{
+			for (std::string::iterator i = s.begin(), end(s.end()); i != end; ++i)
+				*i = tolower(std::uint8_t(*i));
+			return s;
+		}
+
+		// the distinct trigrams of s
+		void trigrams(std::string const& s, std::vector<std::uint32_t>& grams)
+		{
+			grams.clear();
+			for (int i = 0; i + 2 < int(s.size()); ++i)
+			{
+				grams.push_back((std::uint32_t(std::uint8_t(s[i])) << 16)
+					| (std::uint32_t(std::uint8_t(s[i + 1])) << 8)
+					| std::uint8_t(s[i + 2]));
+			}
+			std::sort(grams.begin(), grams.end());
+			grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+		}
+
+		int category(torrent_status const& st)
+		{
+			if (!st.error.empty()) return torrent_index::error;
+			if (st.paused && st.auto_managed) return torrent_index::queued;
+			if (st.paused) return torrent_index::paused;
+			switch (st.state)
+			{
+				case torrent_status::downloading:
+				case torrent_status::downloading_metadata:
+					return torrent_index::downloading;
+				case torrent_status::finished:
+				case torrent_status::seeding:
+					return torrent_index::seeding;
+				default:
+					return torrent_index::checking;
+			}
+		}
+
+		// collects the slots of a window while walking one of the orders
+		template <class Iter, class Records>
+		void walk(Iter i, Iter end, Records const& records
+			, int filter, int offset, int limit, std::vector<std::uint32_t>& window)
+		{
+			int matched = 0;
+			for (; i != end && int(window.size()) < limit; ++i)
+			{
+				if ((records[i->second].categories & (1 << filter)) == 0) continue;
+				if (matched++ < offset) continue;
+				window.push_back(i->second);
+			}
+		}
+	}
+
+	torrent_index::torrent_index()
+	{
+		for (int i = 0; i < num_filters; ++i)
+			m_count[i] = 0;
+	}
+
+	void torrent_index::make_record(torrent_status const& st, record& r)
+	{
+		r.info_hash = st.info_hash;
+		r.key[queue_position] = st.queue_position;
+		r.key[download_rate] = st.download_rate;
+		r.key[upload_rate] = st.upload_rate;
+		r.key[progress] = st.progress_ppm;
+		r.key[added_time] = st.added_time;
+		r.key[state] = st.state;
+		r.categories = (1 << all) | (1 << category(st));
+		if (st.download_payload_rate > 0 || st.upload_payload_rate > 0)
+			r.categories |= 1 << active;
+	}
+
+	void torrent_index::update(torrent_status const& st)
+	{
+		boost::unordered_map<sha1_hash, std::uint32_t>::iterator i
+			= m_slots.find(st.info_hash);
+		if (i == m_slots.end())
+		{
+			std::uint32_t slot;
+			if (!m_free_slots.empty())
+			{
+				slot = m_free_slots.back();
+				m_free_slots.pop_back();
+			}
+			else
+			{
+				slot = std::uint32_t(m_records.size());
+				m_records.push_back(record());
+			}
+			m_slots.insert(std::make_pair(st.info_hash, slot));
+
+			record& r = m_records[slot];
+			make_record(st, r);
+			r.name = to_lower(st.name);
+			for (int k = 0; k < num_sort_keys; ++k)
+				m_order[k].insert(std::make_pair(r.key[k], slot));
+			add_grams(r.name, slot);
+			count(r.categories, 1);
+			return;
+		}
+
+		std::uint32_t const slot = i->second;
+		record& r = m_records[slot];
+		record updated;
+		make_record(st, updated);
+
+		// only touch the orders whose key changed. Most updates are rates
+		// of a few torrents
+		for (int k = 0; k < num_sort_keys; ++k)
+		{
+			if (updated.key[k] == r.key[k]) continue;
+			m_order[k].erase(std::make_pair(r.key[k], slot));
+			m_order[k].insert(std::make_pair(updated.key[k], slot));
+			r.key[k] = updated.key[k];
+		}
+
+		if (updated.categories != r.categories)
+		{
+			count(r.categories, -1);
+			count(updated.categories, 1);
+			r.categories = updated.categories;
+		}
+
+		// comparing the lower case name first would mean building it for
+		// every update
+		if (st.name.size() != r.name.size() || to_lower(st.name) != r.name)
+		{
+			remove_grams(r.name, slot);
+			r.name = to_lower(st.name);
+			add_grams(r.name, slot);
+		}
+	}
+
+	void torrent_index::remove(sha1_hash const& ih)
+	{
+		boost::unordered_map<sha1_hash, std::uint32_t>::iterator i = m_slots.find(ih);
+		if (i == m_slots.end()) return;
+
+		std::uint32_t const slot = i->second;
+		m_slots.erase(i);
+
+		record& r = m_records[slot];
+		for (int k = 0; k < num_sort_keys; ++k)
+			m_order[k].erase(std::make_pair(r.key[k], slot));
+		remove_grams(r.name, slot);
+		remove_labels(r, slot);
+		count(r.categories, -1);
+		r = record();
+		m_free_slots.push_back(slot);
+	}
+
+	void torrent_index::set_labels(sha1_hash const& ih
+		, std::vector<std::string> const& labels)
+	{
+		boost::unordered_map<sha1_hash, std::uint32_t>::iterator i = m_slots.find(ih);
+		if (i == m_slots.end()) return;
+
+		std::uint32_t const slot = i->second;
+		record& r = m_records[slot];
+		if (r.labels == labels) return;
+		remove_labels(r, slot);
+		r.labels = labels;
+		for (std::vector<std::string>::const_iterator l = r.labels.begin()
+			, end(r.labels.end()); l != end; ++l)
+		{
+			m_labels[*l].push_back(slot);
+		}
+	}
+
+	void torrent_index::remove_labels(record const& r, std::uint32_t slot)
+	{
+		for (std::vector<std::string>::const_iterator i = r.labels.begin()
+			, end(r.labels.end()); i != end; ++i)
+		{
+			boost::unordered_map<std::string, std::vector<std::uint32_t> >::iterator l
+				= m_labels.find(*i);
+			if (l == m_labels.end()) continue;
+			std::vector<std::uint32_t>& slots = l->second;
+			std::vector<std::uint32_t>::iterator s = std::find(slots.begin(), slots.end(), slot);
+			if (s == slots.end()) continue;
+			*s = slots.back();
+			slots.pop_back();
+			if (slots.empty()) m_labels.erase(l);
+		}
+	}
+
+	void torrent_index::count(std::uint32_t categories, int sign)
+	{
+		for (int i = 0; i < num_filters; ++i)
+			if (categories & (1 << i)) m_count[i] += sign;
+	}
+
+	void torrent_index::add_grams(std::string const& name, std::uint32_t slot)
+	{
+		std::vector<std::uint32_t> grams;
+		trigrams(name, grams);
+		for (std::vector<std::uint32_t>::iterator i = grams.begin()
+			, end(grams.end()); i != end; ++i)
+		{
+			m_grams[*i].push_back(slot);
+		}
+	}
+
+	void torrent_index::remove_grams(std::string const& name, std::uint32_t slot)
+	{
+		std::vector<std::uint32_t> grams;
+		trigrams(name, grams);
+		for (std::vector<std::uint32_t>::iterator i = grams.begin()
+			, end(grams.end()); i != end; ++i)
+		{
+			boost::unordered_map<std::uint32_t, std::vector<std::uint32_t> >::iterator g
+				= m_grams.find(*i);
+			if (g == m_grams.end()) continue;
+			std::vector<std::uint32_t>& slots = g->second;
+			std::vector<std::uint32_t>::iterator s = std::find(slots.begin(), slots.end(), slot);
+			if (s == slots.end()) continue;
+			*s = slots.back();
+			slots.pop_back();
+			if (slots.empty()) m_grams.erase(g);
+		}
+	}
+
+	void torrent_index::find_matches(std::string const& search
+		, std::string const& label, int filter
+		, std::vector<std::uint32_t>& slots) const
+	{
+		std::vector<std::uint32_t> grams;
+		trigrams(search, grams);
+
+		// the candidates are the torrents with the label, or with the least
+		// common trigram of the search string if there are fewer of those.
+		// Searches too short for a trigram, without a label, look at all
+		// torrents
+		std::vector<std::uint32_t> all_slots;
+		std::vector<std::uint32_t> const* candidates = NULL;
+		if (!label.empty())
+		{
+			boost::unordered_map<std::string, std::vector<std::uint32_t> >::const_iterator l
+				= m_labels.find(label);
+			// no torrent has this label
+			if (l == m_labels.end()) return;
+			candidates = &l->second;
+		}
+		for (std::vector<std::uint32_t>::iterator i = grams.begin()
+			, end(grams.end()); i != end; ++i)
+		{
+			boost::unordered_map<std::uint32_t, std::vector<std::uint32_t> >::const_iterator g
+				= m_grams.find(*i);
+			// no torrent has this trigram
+			if (g == m_grams.end()) return;
+			if (candidates == NULL || g->second.size() < candidates->size())
+				candidates = &g->second;
+		}
+		if (candidates == NULL)
+		{
+			for (boost::unordered_map<sha1_hash, std::uint32_t>::const_iterator i
+				= m_slots.begin(), end(m_slots.end()); i != end; ++i)
+			{
+				all_slots.push_back(i->second);
+			}
+			candidates = &all_slots;
+		}
+
+		for (std::vector<std::uint32_t>::const_iterator i = candidates->begin()
+			, end(candidates->end()); i != end; ++i)
+		{
+			record const& r = m_records[*i];
+			if ((r.categories & (1 << filter)) == 0) continue;
+			if (r.name.find(search) == std::string::npos) continue;
+			if (!label.empty() && !std::binary_search(r.labels.begin()
+				, r.labels.end(), label)) continue;
+			slots.push_back(*i);
+		}
+	}
+
+	int torrent_index::query(int sort, bool descending, int filter
+		, std::string const& search, std::string const& label
+		, int offset, int limit, std::vector<sha1_hash>& window) const
+	{
+		if (sort < 0 || sort >= num_sort_keys) sort = queue_position;
+		if (filter < 0 || filter >= num_filters) filter = all;
+		if (offset < 0) offset = 0;
+		if (limit < 0) limit = 0;
+
+		std::vector<std::uint32_t> slots;
+		int matching;
+		if (search.empty() && label.empty())
+		{
+			// walk the order until the window is full. The number of matches
+			// is known from the counts
+			order_t const& o = m_order[sort];
+			if (descending)
+				walk(o.rbegin(), o.rend(), m_records, filter, offset, limit, slots);
+			else
+				walk(o.begin(), o.end(), m_records, filter, offset, limit, slots);
+			matching = m_count[filter];
+		}
+		else
+		{
+			// with a search or a label, there are only the matches to sort
+			std::vector<std::pair<std::int64_t, std::uint32_t> > matches;
+			{
+				std::vector<std::uint32_t> found;
+				find_matches(to_lower(search), label, filter, found);
+				matches.reserve(found.size());
+				for (std::vector<std::uint32_t>::iterator i = found.begin()
+					, end(found.end()); i != end; ++i)
+				{
+					matches.push_back(std::make_pair(m_records[*i].key[sort], *i));
+				}
+			}
+			matching = int(matches.size());
+
+			int const first = (std::min)(offset, matching);
+			int const last = int((std::min)(std::int64_t(offset) + limit, std::int64_t(matching)));
+			if (descending)
+			{
+				std::partial_sort(matches.begin(), matches.begin() + last, matches.end()
+					, std::greater<std::pair<std::int64_t, std::uint32_t> >());
+			}
+			else
+			{
+				std::partial_sort(matches.begin(), matches.begin() + last, matches.end());
+			}
+			for (int i = first; i < last; ++i)
+				slots.push_back(matches[i].second);
+		}
+
+		window.reserve(window.size() + slots.size());
+		for (std::vector<std::uint32_t>::iterator i = slots.begin()
+			, end(slots.end()); i != end; ++i)
+		{
+			window.push_back(m_records[*i].info_hash);
+		}
+		return matching;
+	}
+}
+
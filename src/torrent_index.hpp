@@ -0,0 +1,153 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_TORRENT_INDEX_HPP
+#define TORRENT_TORRENT_INDEX_HPP
+
+#include "libtorrent/torrent_status.hpp"
+#include <boost/unordered_map.hpp>
+#include <cstdint>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace libtorrent
+{
+	// secondary indexes of the torrents in a history. They keep the
+	// torrents sorted by a number of keys, counted by the categories of the
+	// clients' filter sidebars, and their names broken up into trigrams for
+	// searching. This lets a client be sent a sorted, filtered window of the
+	// torrents without the list being sorted, or sent, in full. It's not
+	// thread safe, torrent_history serializes access to it
+	struct torrent_index
+	{
+		enum sort_key_t
+		{
+			queue_position,
+			download_rate,
+			upload_rate,
+			progress,
+			added_time,
+			state,
+
+			num_sort_keys
+		};
+
+		// every torrent is in exactly one of error, queued, paused,
+		// downloading, seeding and checking (the same categories as
+		// torrent_counts). Torrents transferring payload are active too
+		enum filter_t
+		{
+			all,
+			downloading,
+			seeding,
+			checking,
+			paused,
+			queued,
+			error,
+			active,
+
+			num_filters
+		};
+
+		torrent_index();
+
+		// adds the torrent, or updates it if it's already indexed
+		void update(torrent_status const& st);
+		void remove(sha1_hash const& ih);
+
+		// replaces the labels of an indexed torrent. labels is sorted and
+		// has no duplicates
+		void set_labels(sha1_hash const& ih, std::vector<std::string> const& labels);
+
+		int size() const { return int(m_slots.size()); }
+
+		// the number of torrents in the filter category
+		int count(int filter) const { return m_count[filter]; }
+
+		// appends the info-hashes of at most limit torrents, starting at
+		// offset, in the order of the sort key. Only torrents in the filter
+		// category, whose name contains search (ignoring case) and that have
+		// label, are included. An empty search or label matches every
+		// torrent. Torrents with the same key are in no particular order.
+		// Returns the number of torrents matching in total
+		int query(int sort, bool descending, int filter, std::string const& search
+			, std::string const& label, int offset, int limit
+			, std::vector<sha1_hash>& window) const;
+
+	private:
+
+		struct record
+		{
+			sha1_hash info_hash;
+			std::int64_t key[num_sort_keys];
+			// bit n is set if the torrent is in filter category n
+			std::uint32_t categories;
+			// lower case
+			std::string name;
+			// sorted
+			std::vector<std::string> labels;
+		};
+
+		static void make_record(torrent_status const& st, record& r);
+
+		void add_grams(std::string const& name, std::uint32_t slot);
+		void remove_grams(std::string const& name, std::uint32_t slot);
+		void remove_labels(record const& r, std::uint32_t slot);
+		void count(std::uint32_t categories, int sign);
+
+		// the slots of the torrents whose name contains search and that have
+		// label, in filter
+		void find_matches(std::string const& search, std::string const& label
+			, int filter, std::vector<std::uint32_t>& slots) const;
+
+		std::vector<record> m_records;
+		std::vector<std::uint32_t> m_free_slots;
+		boost::unordered_map<sha1_hash, std::uint32_t> m_slots;
+
+		// the slots ordered by each key. The slot breaks ties
+		typedef std::set<std::pair<std::int64_t, std::uint32_t> > order_t;
+		order_t m_order[num_sort_keys];
+
+		// the slots of the torrents with each trigram in their name. A
+		// trigram is its three bytes, in the low 24 bits
+		boost::unordered_map<std::uint32_t, std::vector<std::uint32_t> > m_grams;
+
+		// the slots of the torrents with each label
+		boost::unordered_map<std::string, std::vector<std::uint32_t> > m_labels;
+
+		int m_count[num_filters];
+	};
+}
+
+#endif
+
@@ -31,8 +31,7 @@ POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include "torrent_post.hpp"
-#include "transmission_webui.hpp"
-#include "libtorrent/http_parser.hpp" // for http_parser
+#include "multipart.hpp"
 #include "libtorrent/torrent_info.hpp"
 
 extern "C" {
@@ -41,76 +40,126 @@ extern "C" {
 
 using namespace libtorrent;
 
-bool parse_torrent_post(mg_connection* conn, add_torrent_params& params, error_code& ec)
+namespace {
+
+	// collects the parts of a multipart body that look like .torrent files
+	// and turns them into add_torrent_params
+	struct torrent_parts : multipart_parser::handler
+	{
+		torrent_parts(add_torrent_params const& model
+			, std::vector<add_torrent_params>& torrents, error_code& ec)
+			: m_model(model), m_torrents(torrents), m_ec(ec), m_in_torrent(false)
+		{}
+
+		virtual bool on_part(std::map<std::string, std::string> const& headers)
+		{
+			m_in_torrent = false;
+			std::map<std::string, std::string>::const_iterator i = headers.find("content-type");
+			if (i == headers.end()) return true;
+
+			// ignore any parameters to the media type
+			std::string type = i->second.substr(0, i->second.find(';'));
+			while (!type.empty() && (type[type.size()-1] == ' ' || type[type.size()-1] == '\t'))
+				type.resize(type.size() - 1);
+			if (type != "application/octet-stream"
+				&& type != "application/x-bittorrent") return true;
+
+			if (int(m_torrents.size()) >= max_torrents_per_post)
+			{
+				m_ec = error_code(boost::system::errc::argument_list_too_long, boost::system::generic_category());
+				return false;
+			}
+
+			m_in_torrent = true;
+			m_buffer.clear();
+			return true;
+		}
+
+		virtual bool on_data(char const* buf, int len)
+		{
+			if (!m_in_torrent) return true;
+			if (int(m_buffer.size()) + len > max_torrent_size)
+			{
+				m_ec = error_code(boost::system::errc::file_too_large, boost::system::generic_category());
+				return false;
+			}
+			m_buffer.insert(m_buffer.end(), buf, buf + len);
+			return true;
+		}
+
+		virtual bool on_part_end()
+		{
+			if (!m_in_torrent) return true;
+			m_in_torrent = false;
+
+			if (m_buffer.empty())
+			{
+				m_ec = error_code(boost::system::errc::invalid_argument, boost::system::generic_category());
+				return false;
+			}
+
+			add_torrent_params p = m_model;
+			p.ti = make_shared<torrent_info>(&m_buffer[0], int(m_buffer.size()), boost::ref(m_ec), 0);
+			if (m_ec) return false;
+			m_torrents.push_back(p);
+			return true;
+		}
+
+	private:
+		add_torrent_params const& m_model;
+		std::vector<add_torrent_params>& m_torrents;
+		error_code& m_ec;
+		std::vector<char> m_buffer;
+		bool m_in_torrent;
+	};
+}
+
+bool parse_torrent_post(mg_connection* conn, add_torrent_params const& model
+	, std::vector<add_torrent_params>& torrents, error_code& ec)
 {
 	char const* cl = mg_get_header(conn, "content-length");
 	if (cl == NULL) return false;
 
-	std::vector<char> post_body;
-
-	int content_length = atoi(cl);
+	long long content_length = strtoll(cl, NULL, 10);
 	if (content_length <= 0)
 	{
 		ec = error_code(boost::system::errc::invalid_argument, boost::system::generic_category());
 		return false;
 	}
-
-	if (content_length > 10 * 1024 * 1024)
+	if (content_length > max_post_size)
 	{
 		ec = error_code(boost::system::errc::file_too_large, boost::system::generic_category());
 		return false;
 	}
 
-	post_body.resize(content_length + 1);
-	// minus one here since we shouldn't read the null terminator
-	mg_read(conn, &post_body[0], content_length);
-	post_body[content_length] = 0;
-	// null terminate
-
 	// expect a multipart message here
 	char const* content_type = mg_get_header(conn, "content-type");
-	if (strstr(content_type, "multipart/form-data") == NULL) return false;
-
-	char const* boundary = strstr(content_type, "boundary=");
-	if (boundary == NULL) return false;
-
-	boundary += 9;
+	if (content_type == NULL || strstr(content_type, "multipart/form-data") == NULL) return false;
 
-	char const* body_end = &post_body[0] + content_length;
+	std::string const boundary = multipart_boundary(content_type);
+	if (boundary.empty()) return false;
 
-	char const* part_start = strstr(&post_body[0], boundary);
-	if (part_start == NULL) return false;
+	torrent_parts parts(model, torrents, ec);
+	multipart_parser parser(boundary, parts);
 
-	part_start += strlen(boundary);
-	char const* part_end = NULL;
-
-	// loop through all parts
-	for(; part_start < body_end; part_start = (std::min)(body_end, part_end + strlen(boundary)))
+	char buf[16 * 1024];
+	while (content_length > 0 && !parser.done())
 	{
-		part_end = strstr(part_start, boundary);
-		if (part_end == NULL) part_end = body_end;
-
-		http_parser part;
-		bool error = false;
-		part.incoming(buffer::const_interval(part_start, part_end), error);
-/*
-		std::multimap<std::string, std::string> const& part_headers = part.headers();
-		for (std::multimap<std::string, std::string>::const_iterator i = part_headers.begin()
-			, end(part_headers.end()); i != end; ++i)
+		int const ret = mg_read(conn, buf, int((std::min)(content_length, (long long)sizeof(buf))));
+		if (ret <= 0) break;
+		content_length -= ret;
+		if (!parser.incoming(buf, ret))
 		{
-			printf("  %s: %s\n", i->first.c_str(), i->second.c_str());
+			if (!ec) ec = error_code(boost::system::errc::invalid_argument, boost::system::generic_category());
+			return false;
 		}
-*/
-		std::string const& disposition = part.header("content-type");
-		if (disposition != "application/octet-stream"
-			&& disposition != "application/x-bittorrent") continue;
-
-		char const* torrent_start = part.get_body().begin;
-		params.ti = make_shared<torrent_info>(torrent_start, part_end - torrent_start, boost::ref(ec), 0);
-		if (ec) return false;
-		return true;
 	}
 
-	return false;
-}
+	if (!parser.done())
+	{
+		ec = error_code(boost::system::errc::invalid_argument, boost::system::generic_category());
+		return false;
+	}
 
+	return !torrents.empty();
+}
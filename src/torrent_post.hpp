@@ -38,7 +38,25 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/error_code.hpp"
 #include "libtorrent/add_torrent_params.hpp"
 
-bool parse_torrent_post(mg_connection* conn, libtorrent::add_torrent_params& p, libtorrent::error_code& ec);
+#include <vector>
+
+// the largest .torrent file accepted in an upload, the most files accepted
+// in a single POST and the largest POST body. The body limit bounds the
+// memory all the torrents of one POST can take together
+enum
+{
+	max_torrent_size = 32 * 1024 * 1024,
+	max_torrents_per_post = 64,
+	max_post_size = 64 * 1024 * 1024
+};
+
+// reads a multipart/form-data POST body off of conn and parses every
+// .torrent file in it. Each torrent is appended to torrents as a copy of
+// model with its torrent_info set. The body is parsed as it's read, so
+// an oversized file is rejected as soon as it exceeds max_torrent_size.
+// Bodies larger than max_post_size are rejected without being read
+bool parse_torrent_post(mg_connection* conn, libtorrent::add_torrent_params const& model
+	, std::vector<libtorrent::add_torrent_params>& torrents, libtorrent::error_code& ec);
 
 #endif
 
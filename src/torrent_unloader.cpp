@@ -0,0 +1,304 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "torrent_unloader.hpp"
+#include "torrent_history.hpp"
+#include "save_resume.hpp"
+#include "file_history.hpp"
+#include "alert_handler.hpp"
+
+#include "libtorrent/alert_types.hpp"
+#include "libtorrent/settings_pack.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+
+namespace s = std::placeholders;
+
+namespace libtorrent
+{
+	torrent_unloader::torrent_unloader(session& ses, alert_handler* alerts
+		, torrent_history* hist, save_resume* resume, file_history const* files
+		, std::int64_t budget)
+		: m_ses(ses)
+		, m_alerts(alerts)
+		, m_hist(hist)
+		, m_resume(resume)
+		, m_files(files)
+		, m_frame(-1)
+		, m_last_tick(clock_type::now())
+		, m_budget(budget)
+		, m_prefetch(1)
+	{
+		m_alerts->subscribe(this, 0
+			, torrent_removed_alert::alert_type
+			, stats_alert::alert_type // just to get woken up regularly
+			, 0);
+
+		m_ses.set_load_function(std::bind(
+			&torrent_unloader::load_torrent, this, s::_1, s::_2, s::_3));
+	}
+
+	torrent_unloader::~torrent_unloader()
+	{
+		m_alerts->unsubscribe(this);
+		m_ses.set_load_function(std::bind(
+			&save_resume::load_torrent, m_resume, s::_1, s::_2, s::_3));
+	}
+
+	void torrent_unloader::set_budget(std::int64_t bytes)
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		m_budget = bytes;
+	}
+
+	std::int64_t torrent_unloader::budget() const
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		return m_budget;
+	}
+
+	torrent_unloader::stats_t torrent_unloader::stats() const
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		return m_stats;
+	}
+
+	void torrent_unloader::load_torrent(sha1_hash const& ih
+		, std::vector<char>& buf, error_code& ec)
+	{
+		m_resume->load_torrent(ih, buf, ec);
+
+		std::unique_lock<std::mutex> l(m_mutex);
+		if (ec)
+		{
+			++m_stats.load_failures;
+			return;
+		}
+		++m_stats.loads;
+		m_sizes[ih] = buf.size();
+	}
+
+	std::int64_t torrent_unloader::resident_size(sha1_hash const& ih
+		, torrent_state const& t) const
+	{
+		boost::unordered_map<sha1_hash, std::int64_t>::const_iterator i
+			= m_sizes.find(ih);
+		if (i != m_sizes.end()) return i->second + torrent_overhead;
+		// the piece hashes are most of an info dict
+		return std::int64_t(t.num_pieces) * 20 + torrent_overhead;
+	}
+
+	void torrent_unloader::handle_alert(alert const* a)
+	{
+		if (torrent_removed_alert const* td = alert_cast<torrent_removed_alert>(a))
+		{
+			m_torrents.erase(td->info_hash);
+			std::unique_lock<std::mutex> l(m_mutex);
+			m_sizes.erase(td->info_hash);
+			return;
+		}
+
+		time_point const now = clock_type::now();
+		update(now);
+		if (now - m_last_tick < seconds(tick_interval)) return;
+		m_last_tick = now;
+		rebalance(now);
+	}
+
+	void torrent_unloader::update(time_point now)
+	{
+		// the cursor is taken before the query, for changes made meanwhile
+		// to be seen again rather than missed
+		int const frame = m_hist->frame();
+		std::vector<history_entry_ptr> changed;
+		m_hist->updated_fields_since(m_frame, changed);
+
+		int unloads = 0;
+		for (std::vector<history_entry_ptr>::iterator i = changed.begin()
+			, end(changed.end()); i != end; ++i)
+		{
+			torrent_status const& st = (*i)->status;
+
+			// the history may be shared with other sessions. Only the
+			// torrents of this one are managed here
+			if (!m_resume->has_torrent(st.handle)) continue;
+
+			torrent_state& t = m_torrents[st.info_hash];
+			t.handle = st.handle;
+			if (t.loaded && !st.is_loaded) ++unloads;
+			t.loaded = st.is_loaded;
+			if (t.loaded) t.prefetching = false;
+			t.paused = st.paused;
+			t.num_pieces = st.num_pieces;
+			t.next_announce = now + st.next_announce;
+			if (st.num_peers > 0 || st.upload_payload_rate > 0)
+				t.last_active = now;
+			else if (t.last_active == time_point() && st.time_since_upload >= 0)
+				t.last_active = now - seconds(st.time_since_upload);
+		}
+		m_frame = frame;
+
+		if (unloads == 0) return;
+		std::unique_lock<std::mutex> l(m_mutex);
+		m_stats.unloads += unloads;
+	}
+
+	void torrent_unloader::rebalance(time_point now)
+	{
+		std::vector<sha1_hash> watched;
+		if (m_files) m_files->watched_torrents(watched);
+		std::sort(watched.begin(), watched.end());
+
+		struct candidate
+		{
+			// 0 for the torrents looked at or about to announce, 1 for the
+			// recently active ones
+			int rank;
+			std::int64_t size;
+			torrents_t::iterator torrent;
+		};
+		std::vector<candidate> candidates;
+
+		std::unique_lock<std::mutex> l(m_mutex);
+		std::int64_t const budget = m_budget;
+		std::int64_t resident_bytes = 0;
+		int resident_torrents = 0;
+		for (torrents_t::iterator i = m_torrents.begin(), end(m_torrents.end());
+			i != end; ++i)
+		{
+			torrent_state& t = i->second;
+			t.keep = false;
+			std::int64_t const size = resident_size(i->first, t);
+			if (t.loaded)
+			{
+				resident_bytes += size;
+				++resident_torrents;
+			}
+
+			candidate c;
+			c.size = size;
+			c.torrent = i;
+			if (std::binary_search(watched.begin(), watched.end(), i->first)
+				|| (!t.paused && t.next_announce - now < seconds(prefetch_window)))
+				c.rank = 0;
+			else if (t.loaded && now - t.last_active < seconds(idle_timeout))
+				c.rank = 1;
+			else
+				continue;
+			candidates.push_back(c);
+		}
+		l.unlock();
+
+		std::sort(candidates.begin(), candidates.end()
+			, [](candidate const& lhs, candidate const& rhs)
+			{
+				if (lhs.rank != rhs.rank) return lhs.rank < rhs.rank;
+				return lhs.torrent->second.last_active > rhs.torrent->second.last_active;
+			});
+
+		// the wanted torrents are kept regardless of the budget, they'd be
+		// loaded on demand anyway. The active ones are kept as long as they
+		// fit
+		std::int64_t used = 0;
+		for (std::vector<candidate>::iterator i = candidates.begin()
+			, end(candidates.end()); i != end; ++i)
+		{
+			if (i->rank > 0 && used + i->size > budget) break;
+			used += i->size;
+			i->torrent->second.keep = true;
+		}
+
+		int pinned = 0;
+		int prefetches = 0;
+		for (torrents_t::iterator i = m_torrents.begin(), end(m_torrents.end());
+			i != end; ++i)
+		{
+			torrent_state& t = i->second;
+			// save_resume unpins torrents once their resume data is
+			// committed. It's told which ones are kept, to leave them pinned
+			if (t.keep && !t.pinned)
+			{
+				m_resume->set_kept(t.handle, true);
+				t.handle.set_pinned(true);
+				t.pinned = true;
+			}
+			// save_resume keeps torrents pinned until their metadata is
+			// stored. Those aren't unpinned here
+			else if (!t.keep && t.pinned && m_resume->can_unload(t.handle))
+			{
+				m_resume->set_kept(t.handle, false);
+				t.handle.set_pinned(false);
+				t.pinned = false;
+			}
+			if (t.pinned) ++pinned;
+
+			if (!t.keep || t.loaded || t.prefetching) continue;
+
+			// anything that needs the metadata loads the torrent. The file
+			// progress, at piece granularity, is about the cheapest
+			t.prefetching = true;
+			++prefetches;
+			torrent_handle const h = t.handle;
+			m_prefetch.post([h]
+			{
+				std::vector<std::int64_t> progress;
+				h.file_progress(progress, torrent_handle::piece_granularity);
+			});
+		}
+
+		// libtorrent counts torrents, not bytes. Translate the budget using
+		// the average size of the loaded torrents
+		std::int64_t const average = resident_torrents > 0
+			? (std::max)(resident_bytes / resident_torrents, std::int64_t(1))
+			: std::int64_t(torrent_overhead);
+		std::int64_t limit = budget / average;
+		limit = (std::max)(limit, std::int64_t((std::max)(int(min_loaded), pinned)));
+		limit = (std::min)(limit, std::int64_t((std::numeric_limits<int>::max)()));
+
+		l.lock();
+		int const old_limit = m_stats.limit;
+		m_stats.prefetches += prefetches;
+		m_stats.resident_bytes = resident_bytes;
+		m_stats.resident_torrents = resident_torrents;
+		m_stats.pinned = pinned;
+		m_stats.limit = int(limit);
+		l.unlock();
+
+		if (limit == old_limit) return;
+		settings_pack p;
+		p.set_int(settings_pack::active_loaded_limit, int(limit));
+		m_ses.apply_settings(p);
+	}
+}
+
@@ -0,0 +1,201 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_TORRENT_UNLOADER_HPP
+#define TORRENT_TORRENT_UNLOADER_HPP
+
+#include "libtorrent/session.hpp"
+#include "libtorrent/torrent_handle.hpp"
+#include "libtorrent/sha1_hash.hpp"
+#include "libtorrent/time.hpp"
+#include "libtorrent/error_code.hpp"
+#include "alert_observer.hpp"
+#include "rpc_executor.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+
+#include <boost/unordered_map.hpp>
+
+namespace libtorrent
+{
+	struct alert_handler;
+	struct torrent_history;
+	struct save_resume;
+	struct file_history;
+
+	// keeps the metadata of a session's torrents within a memory budget.
+	// libtorrent unloads the least recently used torrents that aren't
+	// pinned once more than active_loaded_limit are loaded, and loads them
+	// back through the load function when they're needed. This sets the
+	// limit to the number of torrents the budget holds, and pins the ones
+	// that should stay loaded, most wanted first, until the budget is used
+	// up:
+	//
+	// 1. the torrents clients are looking at (see file_history), and the
+	//    ones about to announce. These are loaded ahead if they aren't
+	// 2. the torrents that had peers or uploaded in the last idle_timeout
+	//    seconds, the most recently active first
+	//
+	// Everything else is left to libtorrent to unload. The load function is
+	// save_resume's, wrapped to count the loads and measure the torrents
+	struct torrent_unloader : alert_observer
+	{
+		// budget is the number of bytes of metadata to keep loaded. files
+		// may be NULL
+		torrent_unloader(session& s, alert_handler* alerts, torrent_history* hist
+			, save_resume* resume, file_history const* files, std::int64_t budget);
+		~torrent_unloader();
+
+		void set_budget(std::int64_t bytes);
+		std::int64_t budget() const;
+
+		struct stats_t
+		{
+			stats_t(): loads(0), load_failures(0), unloads(0), prefetches(0)
+				, resident_bytes(0), resident_torrents(0), pinned(0), limit(0) {}
+
+			// the torrents loaded by libtorrent through the load function,
+			// the ones that failed to, and the unloads seen
+			std::uint64_t loads;
+			std::uint64_t load_failures;
+			std::uint64_t unloads;
+
+			// the torrents loaded ahead of being needed
+			std::uint64_t prefetches;
+
+			// the estimated size of the metadata of the loaded torrents, and
+			// their number, as of the last time the policy ran
+			std::int64_t resident_bytes;
+			int resident_torrents;
+
+			// the torrents pinned by the policy, and the active_loaded_limit
+			// it set
+			int pinned;
+			int limit;
+		};
+
+		stats_t stats() const;
+
+		virtual void handle_alert(alert const* a);
+
+		enum
+		{
+			// seconds between runs of the policy
+			tick_interval = 5,
+
+			// seconds without peers or upload before a torrent is left for
+			// libtorrent to unload
+			idle_timeout = 600,
+
+			// torrents are loaded this many seconds before they announce
+			prefetch_window = 60,
+
+			// the active_loaded_limit is never set below this
+			min_loaded = 16,
+
+			// added to the estimated size of every torrent, for the parts
+			// of a torrent_info that aren't its info dict
+			torrent_overhead = 1024
+		};
+
+	private:
+
+		// the load function. Runs on libtorrent's thread
+		void load_torrent(sha1_hash const& ih, std::vector<char>& buf
+			, error_code& ec);
+
+		// picks up the changes of the session's torrents from the history
+		void update(time_point now);
+
+		// pins, unpins and prefetches torrents, and adjusts the limit
+		void rebalance(time_point now);
+
+		struct torrent_state
+		{
+			torrent_state(): num_pieces(0), loaded(false), paused(true)
+				, pinned(false), prefetching(false), keep(false) {}
+
+			torrent_handle handle;
+			int num_pieces;
+			bool loaded;
+			bool paused;
+
+			// the last time the torrent had peers or uploaded
+			time_point last_active;
+			time_point next_announce;
+
+			// pinned by us, and loaded ahead by us
+			bool pinned;
+			bool prefetching;
+
+			// set while rebalancing, for the torrents within the budget
+			bool keep;
+		};
+
+		// the estimated size of a loaded torrent. The size of its info dict,
+		// if it's been loaded through the load function, otherwise estimated
+		// from the number of pieces. m_mutex must be held
+		std::int64_t resident_size(sha1_hash const& ih, torrent_state const& t) const;
+
+		session& m_ses;
+		alert_handler* m_alerts;
+		torrent_history* m_hist;
+		save_resume* m_resume;
+		file_history const* m_files;
+
+		// the rest is only used by the alert thread
+		typedef boost::unordered_map<sha1_hash, torrent_state> torrents_t;
+		torrents_t m_torrents;
+		int m_frame;
+		time_point m_last_tick;
+
+		// protects the budget, the sizes and the stats
+		mutable std::mutex m_mutex;
+		std::int64_t m_budget;
+
+		// the sizes of the info dicts of the torrents loaded through the
+		// load function
+		boost::unordered_map<sha1_hash, std::int64_t> m_sizes;
+		stats_t m_stats;
+
+		// prefetches wait for the session to load the torrent. They're run
+		// here, not to hold up the alert thread. This is the last member,
+		// for its threads to be joined first
+		rpc_executor m_prefetch;
+	};
+}
+
+#endif
+
@@ -0,0 +1,311 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "torrent_view.hpp"
+
+#include <boost/unordered_map.hpp>
+#include <algorithm>
+#include <stdio.h>
+
+namespace libtorrent
+{
+	namespace
+	{
+		// the history fields each column is made from
+		int const column_fields[torrent_view::num_columns][4] =
+		{
+			{ torrent_history_entry::name, -1 },
+			{ torrent_history_entry::state, torrent_history_entry::paused
+				, torrent_history_entry::auto_managed, torrent_history_entry::error },
+			{ torrent_history_entry::progress_ppm, -1 },
+			{ torrent_history_entry::total_wanted, -1 },
+			{ torrent_history_entry::download_payload_rate, -1 },
+			{ torrent_history_entry::upload_payload_rate, -1 },
+			{ torrent_history_entry::num_seeds, -1 },
+			{ torrent_history_entry::num_peers, -1 },
+		};
+
+		// the history field of each torrent_index::sort_key_t
+		int const sort_fields[torrent_index::num_sort_keys] =
+		{
+			torrent_history_entry::queue_position,
+			torrent_history_entry::download_rate,
+			torrent_history_entry::upload_rate,
+			torrent_history_entry::progress_ppm,
+			torrent_history_entry::added_time,
+			torrent_history_entry::state,
+		};
+
+		// the history fields the filter categories are made from
+		int const filter_fields[] =
+		{
+			torrent_history_entry::state,
+			torrent_history_entry::paused,
+			torrent_history_entry::auto_managed,
+			torrent_history_entry::error,
+			torrent_history_entry::download_payload_rate,
+			torrent_history_entry::upload_payload_rate,
+		};
+
+		std::string add_suffix(std::int64_t val, char const* unit)
+		{
+			static char const* prefix[] = { "", "k", "M", "G", "T" };
+			double v = double(val);
+			int i = 0;
+			for (; i < 4 && v >= 1000.; ++i) v /= 1000.;
+			char ret[30];
+			if (i == 0) snprintf(ret, sizeof(ret), "%d %s", int(val), unit);
+			else snprintf(ret, sizeof(ret), "%.1f %s%s", v, prefix[i], unit);
+			return ret;
+		}
+
+		char const* state_name(torrent_status const& st)
+		{
+			if (!st.error.empty()) return "error";
+			if (st.paused) return st.auto_managed ? "queued" : "paused";
+			switch (st.state)
+			{
+				case torrent_status::checking_files: return "checking";
+				case torrent_status::downloading_metadata: return "metadata";
+				case torrent_status::downloading: return "downloading";
+				case torrent_status::finished: return "finished";
+				case torrent_status::seeding: return "seeding";
+				case torrent_status::allocating: return "allocating";
+				case torrent_status::checking_resume_data: return "checking";
+				default: return "";
+			}
+		}
+	}
+
+	torrent_view::torrent_view(torrent_history const& hist)
+		: m_hist(hist)
+		, m_sort(torrent_index::queue_position)
+		, m_descending(false)
+		, m_filter(torrent_index::all)
+		, m_offset(0)
+		, m_height(0)
+		, m_matching(0)
+		, m_frame(0)
+	{}
+
+	void torrent_view::set_sort(int sort, bool descending)
+	{
+		if (sort < 0 || sort >= torrent_index::num_sort_keys) return;
+		if (sort == m_sort && descending == m_descending) return;
+		m_sort = sort;
+		m_descending = descending;
+		m_frame = 0;
+	}
+
+	void torrent_view::set_filter(int filter)
+	{
+		if (filter < 0 || filter >= torrent_index::num_filters) return;
+		if (filter == m_filter) return;
+		m_filter = filter;
+		m_offset = 0;
+		m_frame = 0;
+	}
+
+	void torrent_view::set_window(int offset, int rows)
+	{
+		offset = (std::max)(offset, 0);
+		rows = (std::max)(rows, 0);
+		if (offset == m_offset && rows == m_height) return;
+		m_offset = offset;
+		m_height = rows;
+		m_rows.resize(rows);
+		m_text.resize(rows * num_columns);
+		m_frame = 0;
+	}
+
+	void torrent_view::scroll_by(int rows)
+	{
+		int offset = (std::min)(m_offset + rows, m_matching - m_height);
+		set_window((std::max)(offset, 0), m_height);
+	}
+
+	void torrent_view::invalidate()
+	{
+		std::fill(m_text.begin(), m_text.end(), std::string());
+		m_frame = 0;
+	}
+
+	bool torrent_view::moved(torrent_history_entry const& e) const
+	{
+		// torrents new to the history have every field stamped with the
+		// frame they were added in, the sort key included
+		if (e.frame(sort_fields[m_sort]) > m_frame) return true;
+		if (m_filter == torrent_index::all) return false;
+		for (int i = 0; i < int(sizeof(filter_fields) / sizeof(filter_fields[0])); ++i)
+		{
+			if (e.frame(filter_fields[i]) > m_frame) return true;
+		}
+		return false;
+	}
+
+	void torrent_view::set_row(int row, history_entry_ptr const& e
+		, std::vector<cell>& dirty)
+	{
+		history_entry_ptr& cur = m_rows[row];
+		bool const same = cur && e && cur->status.info_hash == e->status.info_hash;
+		for (int c = 0; c < num_columns; ++c)
+		{
+			// the fields of the cell haven't changed since it was drawn
+			if (same && column_frame(*e, c) <= m_frame) continue;
+
+			std::string t = e ? cell_text(*e, c) : std::string();
+			std::string& old = m_text[row * num_columns + c];
+			if (t == old) continue;
+			old.swap(t);
+			cell dc = { row, c };
+			dirty.push_back(dc);
+		}
+		cur = e;
+	}
+
+	bool torrent_view::update(std::vector<cell>& dirty)
+	{
+		int const frame = m_hist.frame();
+		if (frame == m_frame) return false;
+
+		std::size_t const num_dirty = dirty.size();
+		int const matching = m_matching;
+
+		// the window only has to be queried from the index again if
+		// torrents may have been added, removed or reordered. Otherwise the
+		// torrents that changed are just looked for among the rows
+		bool const redraw = m_frame == 0;
+		bool query = redraw;
+		std::vector<history_entry_ptr> updated;
+		if (!query)
+		{
+			std::vector<sha1_hash> removed;
+			if (!m_hist.removed_since(m_frame, removed) || !removed.empty())
+				query = true;
+		}
+		if (!query)
+		{
+			m_hist.updated_fields_since(m_frame, updated);
+			for (std::vector<history_entry_ptr>::iterator i = updated.begin()
+				, end(updated.end()); i != end; ++i)
+			{
+				if (!moved(**i)) continue;
+				query = true;
+				break;
+			}
+		}
+
+		if (query)
+		{
+			std::vector<history_entry_ptr> window;
+			m_matching = m_hist.query_torrents(m_sort, m_descending, m_filter
+				, "", "", m_offset, m_height, window);
+
+			// the torrents the window was scrolled to are gone. Show the
+			// last ones instead
+			if (window.empty() && m_offset > 0 && m_matching > 0)
+			{
+				m_offset = (std::max)(m_matching - m_height, 0);
+				m_matching = m_hist.query_torrents(m_sort, m_descending, m_filter
+					, "", "", m_offset, m_height, window);
+			}
+
+			for (int r = 0; r < m_height; ++r)
+			{
+				set_row(r, r < int(window.size()) ? window[r] : history_entry_ptr()
+					, dirty);
+			}
+		}
+		else if (!updated.empty())
+		{
+			boost::unordered_map<sha1_hash, int> rows;
+			for (int r = 0; r < m_height; ++r)
+			{
+				if (!m_rows[r]) break;
+				rows[m_rows[r]->status.info_hash] = r;
+			}
+
+			for (std::vector<history_entry_ptr>::iterator i = updated.begin()
+				, end(updated.end()); i != end; ++i)
+			{
+				boost::unordered_map<sha1_hash, int>::iterator r
+					= rows.find((*i)->status.info_hash);
+				if (r == rows.end()) continue;
+				set_row(r->second, *i, dirty);
+			}
+		}
+
+		m_frame = frame;
+		return redraw || dirty.size() != num_dirty || m_matching != matching;
+	}
+
+	char const* torrent_view::column_name(int column)
+	{
+		static char const* names[num_columns] =
+		{ "name", "state", "progress", "size", "down", "up", "seeds", "peers" };
+		if (column < 0 || column >= num_columns) return "";
+		return names[column];
+	}
+
+	std::string torrent_view::cell_text(torrent_history_entry const& e, int column)
+	{
+		torrent_status const& st = e.status;
+		char ret[30];
+		switch (column)
+		{
+			case name: return st.name;
+			case state: return state_name(st);
+			case progress:
+				snprintf(ret, sizeof(ret), "%.1f%%", st.progress_ppm / 10000.);
+				return ret;
+			case size: return add_suffix(st.total_wanted, "B");
+			case download_rate: return add_suffix(st.download_payload_rate, "B/s");
+			case upload_rate: return add_suffix(st.upload_payload_rate, "B/s");
+			case seeds:
+				snprintf(ret, sizeof(ret), "%d", st.num_seeds);
+				return ret;
+			case peers:
+				snprintf(ret, sizeof(ret), "%d", st.num_peers);
+				return ret;
+			default: return std::string();
+		}
+	}
+
+	int torrent_view::column_frame(torrent_history_entry const& e, int column)
+	{
+		int ret = 0;
+		for (int i = 0; i < 4 && column_fields[column][i] >= 0; ++i)
+			ret = (std::max)(ret, e.frame(column_fields[column][i]));
+		return ret;
+	}
+}
+
@@ -0,0 +1,157 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_TORRENT_VIEW_HPP
+#define TORRENT_TORRENT_VIEW_HPP
+
+#include "torrent_history.hpp"
+#include "torrent_index.hpp"
+
+#include <string>
+#include <vector>
+
+namespace libtorrent
+{
+	// a sorted, filtered window of the torrents in a history, laid out as
+	// rows of text cells, for a terminal to show. Each update() asks the
+	// history for the torrents that changed since the previous one, and
+	// only reports the cells whose fields have a newer frame and whose text
+	// came out different. Drawing the torrent list is then proportional to
+	// what changed on the screen, not to the number of torrents. The window
+	// is only queried from the history's index again when the order or
+	// membership of the torrents may have changed. It's not thread safe
+	struct torrent_view
+	{
+		enum column_t
+		{
+			name,
+			state,
+			progress,
+			size,
+			download_rate,
+			upload_rate,
+			seeds,
+			peers,
+
+			num_columns
+		};
+
+		// a cell whose text changed
+		struct cell
+		{
+			int row;
+			int column;
+		};
+
+		torrent_view(torrent_history const& hist);
+
+		// the order of the rows, a torrent_index::sort_key_t, and the
+		// category of the torrents to show, a torrent_index::filter_t
+		void set_sort(int sort, bool descending);
+		void set_filter(int filter);
+
+		// the index of the first torrent shown and the number of rows.
+		// The offset is clamped to the torrents matching the filter
+		void set_window(int offset, int rows);
+		void scroll_by(int rows);
+
+		// brings the rows up to date with the history and appends the cells
+		// whose text changed to dirty. Returns false if neither the cells nor
+		// the number of matching torrents changed, and the window hasn't been
+		// changed or invalidated since the last update
+		bool update(std::vector<cell>& dirty);
+
+		// forgets the text of the cells, for the next update to report every
+		// cell that isn't empty. For when the screen has been cleared
+		void invalidate();
+
+		// the text of a cell as of the last update. Empty for rows past the
+		// last torrent
+		std::string const& text(int row, int column) const
+		{ return m_text[row * num_columns + column]; }
+
+		// the torrent shown in a row, or null
+		history_entry_ptr const& torrent(int row) const { return m_rows[row]; }
+
+		int rows() const { return m_height; }
+		int offset() const { return m_offset; }
+		int sort() const { return m_sort; }
+		bool descending() const { return m_descending; }
+		int filter() const { return m_filter; }
+
+		// the number of torrents matching the filter, as of the last update
+		int matching() const { return m_matching; }
+
+		// the history frame the rows are up to date with
+		int frame() const { return m_frame; }
+
+		static char const* column_name(int column);
+
+		// the text of a column for a torrent
+		static std::string cell_text(torrent_history_entry const& e, int column);
+
+		// the last frame any of the fields shown in the column changed in
+		static int column_frame(torrent_history_entry const& e, int column);
+
+	private:
+
+		// true if the torrent may have moved in, out of or within the window
+		// since the frame the rows are up to date with
+		bool moved(torrent_history_entry const& e) const;
+
+		// puts e in the row and appends its cells whose text changed
+		void set_row(int row, history_entry_ptr const& e
+			, std::vector<cell>& dirty);
+
+		torrent_history const& m_hist;
+
+		int m_sort;
+		bool m_descending;
+		int m_filter;
+		int m_offset;
+		int m_height;
+		int m_matching;
+
+		// the history frame of the last update. 0 makes the next update
+		// query the window and redraw every cell
+		int m_frame;
+
+		// the torrents in the rows, m_height of them
+		std::vector<history_entry_ptr> m_rows;
+
+		// the text of every cell, row by row
+		std::vector<std::string> m_text;
+	};
+}
+
+#endif
+
@@ -66,7 +66,11 @@ extern "C" {
 #include "response_buffer.hpp" // for appendf
 #include "torrent_post.hpp" // for parse_torrent_post
 #include "escape_json.hpp" // for escape_json
+#include "json_writer.hpp"
 #include "save_settings.hpp"
+#include "torrent_history.hpp"
+#include "file_history.hpp"
+#include "bulk_jobs.hpp"
 
 namespace libtorrent
 {
@@ -81,6 +85,7 @@ void return_error(mg_connection* conn, char const* msg)
 
 void return_failure(std::vector<char>& buf, char const* msg, std::int64_t tag)
 {
+	rpc_stats::set_error();
 	buf.clear();
 	appendf(buf, "{ \"result\": \"%s\", \"tag\": %" PRId64 "}", msg, tag);
 }
@@ -103,11 +108,27 @@ static method_handler handlers[] =
 	{"torrent-verify", &transmission_webui::verify_torrent },
 	{"torrent-reannounce", &transmission_webui::reannounce_torrent },
 	{"torrent-remove", &transmission_webui::remove_torrent},
+	{"torrent-set-location", &transmission_webui::set_torrent_location},
 	{"session-stats", &transmission_webui::session_stats},
 	{"session-get", &transmission_webui::get_session},
 	{"session-set", &transmission_webui::set_session},
+	{"bulk-jobs-get", &transmission_webui::get_bulk_jobs},
+	{"bulk-job-cancel", &transmission_webui::cancel_bulk_job},
 };
 
+// the pseudo function following the methods in the rpc stats
+static int const num_handlers = sizeof(handlers)/sizeof(handlers[0]);
+enum { upload_function = num_handlers };
+
+static std::vector<std::string> rpc_function_names()
+{
+	std::vector<std::string> ret;
+	for (int i = 0; i < num_handlers; ++i)
+		ret.push_back(handlers[i].method_name);
+	ret.push_back("upload");
+	return ret;
+}
+
 void transmission_webui::handle_json_rpc(std::vector<char>& buf, jsmntok_t* tokens
 	, char* buffer, permissions_interface const* p)
 {
@@ -123,10 +144,13 @@ void transmission_webui::handle_json_rpc(std::vector<char>& buf, jsmntok_t* toke
 	buffer[method->end] = 0;
 	char const* m = &buffer[method->start];
 	jsmntok_t* args = NULL;
-	for (int i = 0; i < sizeof(handlers)/sizeof(handlers[0]); ++i)
+	for (int i = 0; i < num_handlers; ++i)
 	{
 		if (strcmp(m, handlers[i].method_name)) continue;
 
+		// the response is written by the caller, once we return
+		rpc_stats::call call(m_rpc_stats, i);
+
 		args = find_key(tokens, buffer, "arguments", JSMN_OBJECT);
 		std::int64_t tag = find_int(tokens, buffer, "tag");
 		handled = true;
@@ -135,6 +159,7 @@ void transmission_webui::handle_json_rpc(std::vector<char>& buf, jsmntok_t* toke
 //		printf("%s: %s\n", m, args ? buffer + args->start : "{}");
 
 		(this->*handlers[i].fun)(buf, args, tag, buffer, p);
+		call.add_bytes(buf.size());
 		break;
 	}
 	if (!handled)
@@ -201,7 +226,7 @@ void transmission_webui::add_torrent(std::vector<char>& buf, jsmntok_t* args
 	}
 
 	error_code ec;
-	torrent_handle h = m_ses.add_torrent(params);
+	torrent_handle h = m_sessions->session_for(params).add_torrent(params);
 	if (ec)
 	{
 		return_failure(buf, ec.message().c_str(), tag);
@@ -219,11 +244,6 @@ void transmission_webui::add_torrent(std::vector<char>& buf, jsmntok_t* args
 
 char const* to_bool(bool b) { return b ? "true" : "false"; }
 
-bool all_torrents(torrent_status const& s)
-{
-	return true;
-}
-
 std::uint32_t tracker_id(announce_entry const& ae)
 {
 	sha1_hash urlhash = hasher(ae.url.c_str(), ae.url.size()).final();
@@ -324,6 +344,342 @@ void transmission_webui::parse_ids(std::set<std::uint32_t>& torrent_ids, jsmntok
 	}
 }
 
+// the state a torrent-get field is formatted from. The values that need a
+// round-trip to the session thread are only fetched when one of the
+// requested fields uses them, and only once per torrent
+struct tr_torrent_fields
+{
+	tr_torrent_fields(torrent_history_entry const& e, torrent_info const& i
+		, bool metadata, time_t t)
+		: ts(e.status), json(*e.json), labels(e.labels.get()), ti(i)
+		, has_metadata(metadata), id(e.id), now(t)
+		, download_limit(0), upload_limit(0), max_connections(0)
+	{}
+
+	torrent_status const& ts;
+	torrent_json_strings const& json;
+	// null if the torrent has no labels
+	std::vector<std::string> const* labels;
+	torrent_info const& ti;
+	bool has_metadata;
+	std::uint32_t id;
+	time_t now;
+
+	int download_limit;
+	int upload_limit;
+	int max_connections;
+	// the progress and priorities of the files. Null for torrents without
+	// metadata
+	file_entry_ptr files;
+	std::vector<announce_entry> trackers;
+};
+
+// flags for the session state a field needs
+enum
+{
+	need_download_limit = 1,
+	need_upload_limit = 2,
+	need_max_connections = 4,
+	need_file_progress = 8,
+	need_file_priorities = 16,
+	need_trackers = 32
+};
+
+struct torrent_field
+{
+	char const* name;
+	void (*emit)(json_writer& out, tr_torrent_fields const& f);
+	// the need_* flags for this field
+	int needs;
+};
+
+void emit_files(json_writer& out, tr_torrent_fields const& f)
+{
+	out.raw('[');
+	file_history_entry const* e = f.files.get();
+	for (int i = 0; e && i < int(e->progress.size()); ++i)
+	{
+		out.raw(", { \"bytesCompleted\": " + (i?0:2));
+		out.integer(e->progress[i]);
+		out.raw(",\"length\": ");
+		out.integer(e->torrent->files().file_size(i));
+		out.raw(",\"name\": ");
+		out.escaped(e->json->paths[i]);
+		out.raw(" }");
+	}
+	out.raw(']');
+}
+
+void emit_file_stats(json_writer& out, tr_torrent_fields const& f)
+{
+	out.raw('[');
+	file_history_entry const* e = f.files.get();
+	for (int i = 0; e && i < int(e->progress.size()); ++i)
+	{
+		int prio = e->priority[i];
+		out.raw(", { \"bytesCompleted\": " + (i?0:2));
+		out.integer(e->progress[i]);
+		out.raw(",\"wanted\": ");
+		out.boolean(prio);
+		out.raw(",\"priority\": ");
+		out.integer(tr_file_priority(prio));
+		out.raw(" }");
+	}
+	out.raw(']');
+}
+
+void emit_wanted(json_writer& out, tr_torrent_fields const& f)
+{
+	out.raw('[');
+	file_history_entry const* e = f.files.get();
+	for (int i = 0; e && i < int(e->priority.size()); ++i)
+	{
+		if (i > 0) out.raw(", ");
+		out.boolean(e->priority[i]);
+	}
+	out.raw(']');
+}
+
+void emit_priorities(json_writer& out, tr_torrent_fields const& f)
+{
+	out.raw('[');
+	file_history_entry const* e = f.files.get();
+	for (int i = 0; e && i < int(e->priority.size()); ++i)
+	{
+		if (i > 0) out.raw(", ");
+		out.integer(tr_file_priority(e->priority[i]));
+	}
+	out.raw(']');
+}
+
+void emit_labels(json_writer& out, tr_torrent_fields const& f)
+{
+	out.raw('[');
+	for (int i = 0; f.labels && i < int(f.labels->size()); ++i)
+	{
+		if (i > 0) out.raw(", ");
+		out.string((*f.labels)[i]);
+	}
+	out.raw(']');
+}
+
+void emit_webseeds(json_writer& out, tr_torrent_fields const& f)
+{
+	std::vector<web_seed_entry> const& webseeds = f.ti.web_seeds();
+	out.raw('[');
+	for (int i = 0; i < int(webseeds.size()); ++i)
+	{
+		if (i > 0) out.raw(", ");
+		out.string(webseeds[i].url);
+	}
+	out.raw(']');
+}
+
+void emit_pieces(json_writer& out, tr_torrent_fields const& f)
+{
+	int const len = (f.ts.pieces.size() + 7) / 8;
+	std::string pieces(base64_encoded_size(len), '\0');
+	pieces.resize(base64_encode(f.ts.pieces.data(), len, &pieces[0]));
+	out.string(pieces);
+}
+
+void emit_peers(json_writer& out, tr_torrent_fields const& f)
+{
+	std::vector<peer_info> peers;
+	f.ts.handle.get_peer_info(peers);
+	out.raw('[');
+	for (int i = 0; i < peers.size(); ++i)
+	{
+		peer_info const& p = peers[i];
+		appendf(out.buffer(), ", { \"address\": \"%s\""
+			", \"clientName\": \"%s\""
+			", \"clientIsChoked\": %s"
+			", \"clientIsInterested\": %s"
+			", \"flagStr\": \"\""
+			", \"isDownloadingFrom\": %s"
+			", \"isEncrypted\": %s"
+			", \"isIncoming\": %s"
+			", \"isUploadingTo\": %s"
+			", \"isUTP\": %s"
+			", \"peerIsChoked\": %s"
+			", \"peerIsInterested\": %s"
+			", \"port\": %d"
+			", \"progress\": %f"
+			", \"rateToClient\": %d"
+			", \"rateToPeer\": %d"
+			"}"
+			+ (i?0:2)
+			, print_address(p.ip.address()).c_str()
+			, escape_json(p.client).c_str()
+			, to_bool(p.flags & peer_info::choked)
+			, to_bool(p.flags & peer_info::interesting)
+			, to_bool(p.downloading_piece_index != -1)
+			, to_bool(p.flags & (peer_info::rc4_encrypted | peer_info::plaintext_encrypted))
+			, to_bool(p.source & peer_info::incoming)
+			, to_bool(p.used_send_buffer)
+			, to_bool(p.flags & peer_info::utp_socket)
+			, to_bool(p.flags & peer_info::remote_choked)
+			, to_bool(p.flags & peer_info::remote_interested)
+			, p.ip.port()
+			, p.progress
+			, p.down_speed
+			, p.up_speed
+			);
+	}
+	out.raw(']');
+}
+
+void emit_trackers(json_writer& out, tr_torrent_fields const& f)
+{
+	out.raw('[');
+	for (int i = 0; i < f.trackers.size(); ++i)
+	{
+		announce_entry const& a = f.trackers[i];
+		appendf(out.buffer(), ", { \"announce\": \"%s\""
+			", \"id\": %u"
+			", \"scrape\": \"%s\""
+			", \"tier\": %d"
+			"}"
+			+ (i?0:2)
+			, a.url.c_str(), tracker_id(a), a.url.c_str(), a.tier);
+	}
+	out.raw(']');
+}
+
+void emit_tracker_stats(json_writer& out, tr_torrent_fields const& f)
+{
+	out.raw('[');
+	for (int i = 0; i < f.trackers.size(); ++i)
+	{
+		announce_entry const& a = f.trackers[i];
+		using boost::tuples::ignore;
+		error_code ec;
+		std::string hostname;
+		boost::tie(ignore, ignore, hostname, ignore, ignore)
+			= parse_url_components(a.url, ec);
+		appendf(out.buffer(), ", { \"announce\": \"%s\""
+			", \"announceState\": %u"
+			", \"downloadCount\": %d"
+			", \"hasAnnounced\": %s"
+			", \"hasScraped\": %s"
+			", \"host\": \"%s\""
+			", \"id\": %u"
+			", \"isBackup\": %s"
+			", \"lastAnnouncePeerCount\": %d"
+			", \"lastAnnounceResult\": \"%s\""
+			", \"lastAnnounceStartTime\": %" PRId64
+			", \"lastAnnounceSucceeded\": %" PRId64
+			", \"lastAnnounceTime\": %" PRId64
+			", \"lastAnnounceTimeOut\": %s"
+			", \"lastScrapePeerCount\": %d"
+			", \"lastScrapeResult\": \"%s\""
+			", \"lastScrapeStartTime\": %" PRId64
+			", \"lastScrapeSucceeded\": %" PRId64
+			", \"lastScrapeTime\": %" PRId64
+			", \"lastScrapeTimeOut\": %s"
+			", \"leecherCount\": %d"
+			", \"nextAnnounceTime\": %" PRId64
+			", \"nextScrapeTime\": %" PRId64
+			", \"scrape\": \"%s\""
+			", \"scrapeState\": %d"
+			", \"seederCount\": %d"
+			", \"tier\": %d"
+			"}"
+			+ (i?0:2)
+			, escape_json(a.url).c_str()
+			, tracker_status(a, f.ts)
+			, 0
+			, to_bool(a.start_sent)
+			, to_bool(false)
+			, hostname.c_str()
+			, tracker_id(a)
+			, to_bool(false)
+			, 0 // lastAnnouncePeerCount
+			, a.last_error.message().c_str() // lastAnnounceResult
+			, 0 // lastAnnounceStartTime
+			, to_bool(!a.last_error) // lastAnnounceSucceeded
+			, 0 // lastAnnounceTime
+			, to_bool(a.last_error == boost::asio::error::timed_out) // lastAnnounceTimeOut
+			, 0, "", 0, "false", 0, "false"
+			, 0 // leecherCount
+			, time(NULL) + a.next_announce_in()
+			, 0
+			, a.url.c_str()
+			, 0
+			, 0 // seederCount
+			, a.tier);
+	}
+	out.raw(']');
+}
+
+// type is the json_writer function used to format the value
+#define TORRENT_PROPERTY(name, type, prop, needs) \
+	{ name, [](json_writer& out, tr_torrent_fields const& f) { out.type(prop); }, needs }
+
+static torrent_field const torrent_fields[] =
+{
+	TORRENT_PROPERTY("activityDate", integer, f.now - (std::min)(f.ts.time_since_download
+		, f.ts.time_since_upload), 0),
+	TORRENT_PROPERTY("addedDate", integer, f.ts.added_time, 0),
+	TORRENT_PROPERTY("comment", string, f.ti.comment(), 0),
+	TORRENT_PROPERTY("creator", string, f.ti.creator(), 0),
+	TORRENT_PROPERTY("dateCreated", integer, f.ti.creation_date() ? f.ti.creation_date().get() : 0, 0),
+	TORRENT_PROPERTY("doneDate", integer, f.ts.completed_time, 0),
+	TORRENT_PROPERTY("downloadDir", escaped, *f.json.save_path, 0),
+	TORRENT_PROPERTY("error", integer, f.ts.errc ? 0 : 1, 0),
+	TORRENT_PROPERTY("errorString", string, f.ts.errc.message(), 0),
+	TORRENT_PROPERTY("eta", integer, f.ts.download_payload_rate <= 0 ? -1
+		: (f.ts.total_wanted - f.ts.total_wanted_done) / f.ts.download_payload_rate, 0),
+	TORRENT_PROPERTY("hashString", escaped, f.json.info_hash, 0),
+	TORRENT_PROPERTY("downloadedEver", integer, f.ts.all_time_download, 0),
+	TORRENT_PROPERTY("downloadLimit", integer, f.download_limit, need_download_limit),
+	TORRENT_PROPERTY("downloadLimited", boolean, f.download_limit > 0, need_download_limit),
+	TORRENT_PROPERTY("haveValid", integer, f.ts.num_pieces, 0),
+	TORRENT_PROPERTY("id", integer, f.id, 0),
+	TORRENT_PROPERTY("isFinished", boolean, f.ts.is_finished, 0),
+	TORRENT_PROPERTY("isPrivate", boolean, f.ti.priv(), 0),
+	TORRENT_PROPERTY("isStalled", boolean, f.ts.download_payload_rate == 0, 0),
+	TORRENT_PROPERTY("leftUntilDone", integer, f.ts.total_wanted - f.ts.total_wanted_done, 0),
+	TORRENT_PROPERTY("magnetLink", string, f.has_metadata ? make_magnet_uri(f.ti) : std::string(), 0),
+	TORRENT_PROPERTY("metadataPercentComplete", floating, f.ts.has_metadata ? 1.f : f.ts.progress_ppm / 1000000.f, 0),
+	TORRENT_PROPERTY("name", escaped, f.json.name, 0),
+	TORRENT_PROPERTY("peer-limit", integer, f.max_connections, need_max_connections),
+	TORRENT_PROPERTY("peersConnected", integer, f.ts.num_peers, 0),
+	// even though this is called "percentDone", it's really expecting the
+	// progress in the range [0, 1]
+	TORRENT_PROPERTY("percentDone", floating, f.ts.progress_ppm / 1000000.f, 0),
+	TORRENT_PROPERTY("pieceCount", integer, f.has_metadata ? f.ti.num_pieces() : 0, 0),
+	TORRENT_PROPERTY("pieceSize", integer, f.has_metadata ? f.ti.piece_length() : 0, 0),
+	TORRENT_PROPERTY("queuePosition", integer, f.ts.queue_position, 0),
+	TORRENT_PROPERTY("rateDownload", integer, f.ts.download_rate, 0),
+	TORRENT_PROPERTY("rateUpload", integer, f.ts.upload_rate, 0),
+	TORRENT_PROPERTY("recheckProgress", floating, f.ts.progress_ppm / 1000000.f, 0),
+	TORRENT_PROPERTY("secondsDownloading", integer, f.ts.active_time, 0),
+	TORRENT_PROPERTY("secondsSeeding", integer, f.ts.finished_time, 0),
+	TORRENT_PROPERTY("sizeWhenDone", integer, f.has_metadata ? f.ti.total_size() : 0, 0),
+	TORRENT_PROPERTY("totalSize", integer, f.ts.total_done, 0),
+	TORRENT_PROPERTY("uploadedEver", integer, f.ts.all_time_upload, 0),
+	TORRENT_PROPERTY("uploadLimit", integer, f.upload_limit, need_upload_limit),
+	TORRENT_PROPERTY("uploadLimited", boolean, f.upload_limit > 0, need_upload_limit),
+	TORRENT_PROPERTY("uploadedRatio", integer, f.ts.all_time_download == 0
+		? -2 : f.ts.all_time_upload / f.ts.all_time_download, 0),
+	TORRENT_PROPERTY("status", integer, torrent_tr_status(f.ts), 0),
+	{ "files", &emit_files, need_file_progress },
+	{ "fileStats", &emit_file_stats, need_file_progress | need_file_priorities },
+	{ "wanted", &emit_wanted, need_file_priorities },
+	{ "priorities", &emit_priorities, need_file_priorities },
+	{ "labels", &emit_labels, 0 },
+	{ "webseeds", &emit_webseeds, 0 },
+	{ "pieces", &emit_pieces, 0 },
+	{ "peers", &emit_peers, 0 },
+	{ "trackers", &emit_trackers, need_trackers },
+	{ "trackerStats", &emit_tracker_stats, need_trackers },
+};
+
+#undef TORRENT_PROPERTY
+
+static const int num_torrent_fields = sizeof(torrent_fields) / sizeof(torrent_fields[0]);
+
 void transmission_webui::get_torrent(std::vector<char>& buf, jsmntok_t* args
 	, std::int64_t tag, char* buffer, permissions_interface const* p)
 {
@@ -339,321 +695,121 @@ void transmission_webui::get_torrent(std::vector<char>& buf, jsmntok_t* args
 		return;
 	}
 
-	std::set<std::string> fields;
+	// compile the requested fields into the list of emitters to run for
+	// each torrent. Unknown and duplicate fields are ignored. The emitters
+	// run in table order
+	std::uint64_t requested = 0;
+	int needs = 0;
 	int num_fields = field_ent->size;
 	for (int i = 0; i < num_fields; ++i)
 	{
 		jsmntok_t* item = &field_ent[i+1];
-		fields.insert(std::string(buffer + item->start, buffer + item->end));
+		int const len = item->end - item->start;
+		for (int k = 0; k < num_torrent_fields; ++k)
+		{
+			if (strncmp(torrent_fields[k].name, buffer + item->start, len) != 0
+				|| torrent_fields[k].name[len] != 0) continue;
+			requested |= std::uint64_t(1) << k;
+			needs |= torrent_fields[k].needs;
+			break;
+		}
 	}
 
-	std::set<std::uint32_t> torrent_ids;
-	parse_ids(torrent_ids, args, buffer);
+	std::vector<torrent_field const*> emitters;
+	for (int k = 0; k < num_torrent_fields; ++k)
+	{
+		if (requested & (std::uint64_t(1) << k))
+			emitters.push_back(&torrent_fields[k]);
+	}
 
-	std::vector<torrent_status> t;
-	m_ses.get_torrent_status(&t, &all_torrents);
+	// "recently-active" returns the torrents that changed in the last
+	// recently_active_frames frames, along with the ids of the ones that
+	// were removed. Otherwise "ids" is a list of torrent ids
+	int since_frame = 0;
+	bool const recently_active = strcmp(find_string(args, buffer, "ids")
+		, "recently-active") == 0;
+	std::set<std::uint32_t> torrent_ids;
+	if (recently_active)
+		since_frame = (std::max)(0, m_hist->frame() - recently_active_frames);
+	else
+		parse_ids(torrent_ids, args, buffer);
+
+	// when the history no longer knows all the torrents removed in the
+	// window, every torrent is sent, along with "resync" for the client to
+	// drop the ones it has that aren't in the list
+	std::vector<std::uint32_t> removed;
+	bool resync = false;
+	if (recently_active && !m_hist->removed_ids_since(since_frame, removed))
+	{
+		resync = true;
+		since_frame = 0;
+		removed.clear();
+	}
 
-	appendf(buf, "{ \"result\": \"success\", \"arguments\": { \"torrents\": [");
+	// read the cached state from the history rather than asking the session
+	// thread for every torrent's status
+	std::vector<history_entry_ptr> t;
+	m_hist->updated_fields_since(since_frame, t);
 
-#define TORRENT_PROPERTY(name, format_code, prop) \
-	if (fields.count(name)) { \
-		appendf(buf, ", \"" name "\": " format_code "" + (count?0:2), prop); \
-		++count; \
-	}
+	json_writer out(buf);
+	out.raw("{ \"result\": \"success\", \"arguments\": { \"torrents\": [");
 
 	int returned_torrents = 0;
+	time_t const now = time(NULL);
 	error_code ec;
 	torrent_info empty("", ec);
 	for (int i = 0; i < t.size(); ++i)
 	{
-		torrent_info const* ti = &empty;
-		shared_ptr<torrent_info const> holder;
-		if (t[i].has_metadata)
-		{
-			holder = t[i].torrent_file.lock();
-			ti = holder.get();
-		}
-		torrent_status const& ts = t[i];
-
-		if (!torrent_ids.empty() && torrent_ids.count(ts.handle.id()) == 0)
+		if (!torrent_ids.empty() && torrent_ids.count(t[i]->id) == 0)
 			continue;
 
-		// skip comma on any item that's not the first one
-		appendf(buf, ", {" + (returned_torrents?0:2));
-		int count = 0;
-		TORRENT_PROPERTY("activityDate", "%" PRId64, time(0) - (std::min)(ts.time_since_download
-			, ts.time_since_upload));
-		TORRENT_PROPERTY("addedDate", "%" PRId64, ts.added_time);
-		TORRENT_PROPERTY("comment", "\"%s\"", escape_json(ti->comment()).c_str());
-		TORRENT_PROPERTY("creator", "\"%s\"", escape_json(ti->creator()).c_str());
-		TORRENT_PROPERTY("dateCreated", "%" PRId64, ti->creation_date() ? ti->creation_date().get() : 0);
-		TORRENT_PROPERTY("doneDate", "%" PRId64, ts.completed_time);
-		TORRENT_PROPERTY("downloadDir", "\"%s\"", escape_json(ts.save_path).c_str());
-		TORRENT_PROPERTY("error", "%d", ts.errc ? 0 : 1);
-		TORRENT_PROPERTY("errorString", "\"%s\"", escape_json(ts.errc.message()).c_str());
-		TORRENT_PROPERTY("eta", "%d", ts.download_payload_rate <= 0 ? -1
-			: (ts.total_wanted - ts.total_wanted_done) / ts.download_payload_rate);
-		TORRENT_PROPERTY("hashString", "\"%s\"", to_hex(ts.handle.info_hash().to_string()).c_str());
-		TORRENT_PROPERTY("downloadedEver", "%" PRId64, ts.all_time_download);
-		TORRENT_PROPERTY("downloadLimit", "%d", ts.handle.download_limit());
-		TORRENT_PROPERTY("downloadLimited", "%s", to_bool(ts.handle.download_limit() > 0));
-		TORRENT_PROPERTY("haveValid", "%d", ts.num_pieces);
-		TORRENT_PROPERTY("id", "%u", ts.handle.id());
-		TORRENT_PROPERTY("isFinished", "%s", to_bool(ts.is_finished));
-		TORRENT_PROPERTY("isPrivate", "%s", to_bool(ti->priv()));
-		TORRENT_PROPERTY("isStalled", "%s", to_bool(ts.download_payload_rate == 0));
-		TORRENT_PROPERTY("leftUntilDone", "%" PRId64, ts.total_wanted - ts.total_wanted_done);
-		TORRENT_PROPERTY("magnetLink", "\"%s\"", ti == &empty ? "" : make_magnet_uri(*ti).c_str());
-		TORRENT_PROPERTY("metadataPercentComplete", "%f", ts.has_metadata ? 1.f : ts.progress_ppm / 1000000.f);
-		TORRENT_PROPERTY("name", "\"%s\"", escape_json(ts.name).c_str());
-		TORRENT_PROPERTY("peer-limit", "%d", ts.handle.max_connections());
-		TORRENT_PROPERTY("peersConnected", "%d", ts.num_peers);
-		// even though this is called "percentDone", it's really expecting the
-		// progress in the range [0, 1]
-		TORRENT_PROPERTY("percentDone", "%f", ts.progress_ppm / 1000000.f);
-		TORRENT_PROPERTY("pieceCount", "%d", ti != &empty ? ti->num_pieces() : 0);
-		TORRENT_PROPERTY("pieceSize", "%d", ti != &empty ? ti->piece_length() : 0);
-		TORRENT_PROPERTY("queuePosition", "%d", ts.queue_position);
-		TORRENT_PROPERTY("rateDownload", "%d", ts.download_rate);
-		TORRENT_PROPERTY("rateUpload", "%d", ts.upload_rate);
-		TORRENT_PROPERTY("recheckProgress", "%f", ts.progress_ppm / 1000000.f);
-		TORRENT_PROPERTY("secondsDownloading", "%" PRId64 , ts.active_time);
-		TORRENT_PROPERTY("secondsSeeding", "%" PRId64, ts.finished_time);
-		TORRENT_PROPERTY("sizeWhenDone", "%" PRId64, ti != &empty ? ti->total_size() : 0);
-		TORRENT_PROPERTY("totalSize", "%" PRId64, ts.total_done);
-		TORRENT_PROPERTY("uploadedEver", "%" PRId64, ts.all_time_upload);
-		TORRENT_PROPERTY("uploadLimit", "%d", ts.handle.upload_limit());
-		TORRENT_PROPERTY("uploadLimited", "%s", to_bool(ts.handle.upload_limit() > 0));
-		TORRENT_PROPERTY("uploadedRatio", "%ld", ts.all_time_download == 0
-			? -2 : ts.all_time_upload / ts.all_time_download);
-
-		if (fields.count("status"))
-		{
-			appendf(buf, ", \"status\": %d" + (count?0:2), torrent_tr_status(ts));
-			++count;
-		}
+		// torrents restored from a history snapshot have no id until
+		// they're loaded again
+		if (t[i]->id == 0) continue;
 
-		if (fields.count("files"))
-		{
-			file_storage const& files = ti->files();
-			std::vector<std::int64_t> progress;
-			ts.handle.file_progress(progress);
-			appendf(buf, ", \"files\": [" + (count?0:2));
-			for (int i = 0; i < files.num_files(); ++i)
-			{
-				appendf(buf, ", { \"bytesCompleted\": %" PRId64 ","
-					"\"length\": %" PRId64 ","
-					"\"name\": \"%s\" }" + (i?0:2)
-					, progress[i], files.file_size(i), escape_json(files.file_path(i)).c_str());
-			}
-			appendf(buf, "]");
-			++count;
-		}
-
-		if (fields.count("fileStats"))
-		{
-			file_storage const& files = ti->files();
-			std::vector<std::int64_t> progress;
-			ts.handle.file_progress(progress);
-			appendf(buf, ", \"fileStats\": [" + (count?0:2));
-			for (int i = 0; i < files.num_files(); ++i)
-			{
-				int prio = ts.handle.file_priority(i);
-				appendf(buf, ", { \"bytesCompleted\": %" PRId64 ","
-					"\"wanted\": %s,"
-					"\"priority\": %d }" + (i?0:2)
-					, progress[i], to_bool(prio), tr_file_priority(prio));
-			}
-			appendf(buf, "]");
-			++count;
-		}
-
-		if (fields.count("wanted"))
-		{
-			file_storage const& files = ti->files();
-			appendf(buf, ", \"wanted\": [" + (count?0:2));
-			for (int i = 0; i < files.num_files(); ++i)
-			{
-				appendf(buf, ", %s" + (i?0:2)
-					, to_bool(ts.handle.file_priority(i)));
-			}
-			appendf(buf, "]");
-			++count;
-		}
-
-		if (fields.count("priorities"))
-		{
-			file_storage const& files = ti->files();
-			appendf(buf, ", \"priorities\": [" + (count?0:2));
-			for (int i = 0; i < files.num_files(); ++i)
-			{
-				appendf(buf, ", %d" + (i?0:2)
-					, tr_file_priority(ts.handle.file_priority(i)));
-			}
-			appendf(buf, "]");
-			++count;
-		}
-
-		if (fields.count("webseeds"))
-		{
-			std::vector<web_seed_entry> const& webseeds = ti->web_seeds();
-			appendf(buf, ", \"webseeds\": [" + (count?0:2));
-			for (int i = 0; i < webseeds.size(); ++i)
-			{
-				appendf(buf, ", \"%s\"" + (i?0:2)
-					, escape_json(webseeds[i].url).c_str());
-			}
-			appendf(buf, "]");
-			++count;
-		}
+		torrent_status const& ts = t[i]->status;
+		shared_ptr<torrent_info const> holder;
+		if (ts.has_metadata) holder = ts.torrent_file.lock();
 
-		if (fields.count("pieces"))
+		tr_torrent_fields f(*t[i], holder ? *holder : empty, bool(holder), now);
+		if (needs & need_download_limit) f.download_limit = ts.handle.download_limit();
+		if (needs & need_upload_limit) f.upload_limit = ts.handle.upload_limit();
+		if (needs & need_max_connections) f.max_connections = ts.handle.max_connections();
+		if (needs & (need_file_progress | need_file_priorities))
 		{
-			std::string encoded_pieces = base64encode(
-				std::string(ts.pieces.data(), (ts.pieces.size() + 7) / 8));
-			appendf(buf, ", \"pieces\": \"%s\"" + (count?0:2)
-				, encoded_pieces.c_str());
-			++count;
+			f.files = m_files ? m_files->get_file_updates(ts.handle)
+				: read_files(ts.handle);
 		}
+		if (needs & need_trackers) f.trackers = ts.handle.trackers();
 
-		if (fields.count("peers"))
+		// skip comma on any item that's not the first one
+		out.raw(", {" + (returned_torrents?0:2));
+		for (int k = 0; k < int(emitters.size()); ++k)
 		{
-			std::vector<peer_info> peers;
-			ts.handle.get_peer_info(peers);
-			appendf(buf, ", \"peers\": [" + (count?0:2));
-			for (int i = 0; i < peers.size(); ++i)
-			{
-				peer_info const& p = peers[i];
-				appendf(buf, ", { \"address\": \"%s\""
-					", \"clientName\": \"%s\""
-					", \"clientIsChoked\": %s"
-					", \"clientIsInterested\": %s"
-					", \"flagStr\": \"\""
-					", \"isDownloadingFrom\": %s"
-					", \"isEncrypted\": %s"
-					", \"isIncoming\": %s"
-					", \"isUploadingTo\": %s"
-					", \"isUTP\": %s"
-					", \"peerIsChoked\": %s"
-					", \"peerIsInterested\": %s"
-					", \"port\": %d"
-					", \"progress\": %f"
-					", \"rateToClient\": %d"
-					", \"rateToPeer\": %d"
-					"}"
-					+ (i?0:2)
-					, print_address(p.ip.address()).c_str()
-					, escape_json(p.client).c_str()
-					, to_bool(p.flags & peer_info::choked)
-					, to_bool(p.flags & peer_info::interesting)
-					, to_bool(p.downloading_piece_index != -1)
-					, to_bool(p.flags & (peer_info::rc4_encrypted | peer_info::plaintext_encrypted))
-					, to_bool(p.source & peer_info::incoming)
-					, to_bool(p.used_send_buffer)
-					, to_bool(p.flags & peer_info::utp_socket)
-					, to_bool(p.flags & peer_info::remote_choked)
-					, to_bool(p.flags & peer_info::remote_interested)
-					, p.ip.port()
-					, p.progress
-					, p.down_speed
-					, p.up_speed
-					);
-			}
-			appendf(buf, "]");
-			++count;
+			out.raw(", \"" + (k?0:2));
+			out.raw(emitters[k]->name);
+			out.raw("\": ");
+			emitters[k]->emit(out, f);
 		}
+		out.raw('}');
+		++returned_torrents;
+	}
 
-		if (fields.count("trackers"))
-		{
-			std::vector<announce_entry> trackers = ts.handle.trackers();
-			appendf(buf, ", \"trackers\": [" + (count?0:2));
-			for (int i = 0; i < trackers.size(); ++i)
-			{
-				announce_entry const& a = trackers[i];
-				appendf(buf, ", { \"announce\": \"%s\""
-					", \"id\": %u"
-					", \"scrape\": \"%s\""
-					", \"tier\": %d"
-					"}"
-					+ (i?0:2)
-					, a.url.c_str(), tracker_id(a), a.url.c_str(), a.tier);
-			}
-			appendf(buf, "]");
-			++count;
-		}
+	out.raw(']');
 
-		if (fields.count("trackerStats"))
+	if (recently_active)
+	{
+		out.raw(", \"removed\": [");
+		for (int i = 0; i < int(removed.size()); ++i)
 		{
-			std::vector<announce_entry> trackers = ts.handle.trackers();
-			appendf(buf, ", \"trackerStats\": [" + (count?0:2));
-			for (int i = 0; i < trackers.size(); ++i)
-			{
-				announce_entry const& a = trackers[i];
-				using boost::tuples::ignore;
-				error_code ec;
-				std::string hostname;
-				boost::tie(ignore, ignore, hostname, ignore, ignore)
-					= parse_url_components(a.url, ec);
-				appendf(buf, ", { \"announce\": \"%s\""
-					", \"announceState\": %u"
-					", \"downloadCount\": %d"
-					", \"hasAnnounced\": %s"
-					", \"hasScraped\": %s"
-					", \"host\": \"%s\""
-					", \"id\": %u"
-					", \"isBackup\": %s"
-					", \"lastAnnouncePeerCount\": %d"
-					", \"lastAnnounceResult\": \"%s\""
-					", \"lastAnnounceStartTime\": %" PRId64
-					", \"lastAnnounceSucceeded\": %" PRId64
-					", \"lastAnnounceTime\": %" PRId64
-					", \"lastAnnounceTimeOut\": %s"
-					", \"lastScrapePeerCount\": %d"
-					", \"lastScrapeResult\": \"%s\""
-					", \"lastScrapeStartTime\": %" PRId64
-					", \"lastScrapeSucceeded\": %" PRId64
-					", \"lastScrapeTime\": %" PRId64
-					", \"lastScrapeTimeOut\": %s"
-					", \"leecherCount\": %d"
-					", \"nextAnnounceTime\": %" PRId64
-					", \"nextScrapeTime\": %" PRId64
-					", \"scrape\": \"%s\""
-					", \"scrapeState\": %d"
-					", \"seederCount\": %d"
-					", \"tier\": %d"
-					"}"
-					+ (i?0:2)
-					, escape_json(a.url).c_str()
-					, tracker_status(a, ts)
-					, 0
-					, to_bool(a.start_sent)
-					, to_bool(false)
-					, hostname.c_str()
-					, tracker_id(a)
-					, to_bool(false)
-					, 0 // lastAnnouncePeerCount
-					, a.last_error.message().c_str() // lastAnnounceResult
-					, 0 // lastAnnounceStartTime
-					, to_bool(!a.last_error) // lastAnnounceSucceeded
-					, 0 // lastAnnounceTime
-					, to_bool(a.last_error == boost::asio::error::timed_out) // lastAnnounceTimeOut
-					, 0, "", 0, "false", 0, "false"
-					, 0 // leecherCount
-					, time(NULL) + a.next_announce_in()
-					, 0
-					, a.url.c_str()
-					, 0
-					, 0 // seederCount
-					, a.tier);
-			}
-			appendf(buf, "]");
-			++count;
+			if (i > 0) out.raw(", ");
+			out.unsigned_integer(removed[i]);
 		}
-		appendf(buf, "}");
-		++returned_torrents;
+		out.raw(']');
+		if (resync) out.raw(", \"resync\": true");
 	}
 
-	appendf(buf, "] }, \"tag\": %" PRId64 " }", tag);
+	appendf(buf, " }, \"tag\": %" PRId64 " }", tag);
 }
 
 void transmission_webui::set_torrent(std::vector<char>& buf, jsmntok_t* args
@@ -697,6 +853,20 @@ void transmission_webui::set_torrent(std::vector<char>& buf, jsmntok_t* args
 		}
 	}
 
+	// the labels replace the torrents' current ones. An empty list
+	// removes them
+	std::vector<std::string> labels;
+	jsmntok_t* labels_ent = find_key(args, buffer, "labels", JSMN_ARRAY);
+	if (labels_ent)
+	{
+		jsmntok_t* item = labels_ent + 1;
+		for (int i = 0; i < labels_ent->size; ++i, item = skip_item(item))
+		{
+			if (item->type != JSMN_STRING) continue;
+			labels.push_back(std::string(buffer + item->start, item->end - item->start));
+		}
+	}
+
 	int all_file_prio = -1;
 	std::vector<std::pair<int, int> > file_priority;
 
@@ -774,6 +944,7 @@ void transmission_webui::set_torrent(std::vector<char>& buf, jsmntok_t* args
 		if (set_ul_limit) h.set_upload_limit(upload_limit * 1000);
 		if (move_storage) h.move_storage(location);
 		if (set_max_conns) h.set_max_connections(max_connections);
+		if (labels_ent) m_hist->set_labels(h.info_hash(), labels);
 		if (!add_trackers.empty())
 		{
 			std::vector<announce_entry> trackers =  h.trackers();
@@ -792,6 +963,7 @@ void transmission_webui::set_torrent(std::vector<char>& buf, jsmntok_t* args
 				prio[i->first] = i->second;
 			}
 			h.prioritize_files(prio);
+			if (m_files) m_files->priorities_changed(h.info_hash());
 		}
 	}
 }
@@ -870,6 +1042,11 @@ void transmission_webui::verify_torrent(std::vector<char>& buf, jsmntok_t* args
 
 	std::vector<torrent_handle> handles;
 	get_torrents(handles, args, buffer);
+	if (m_bulk)
+	{
+		submit_bulk_job(buf, handles, bulk_jobs::recheck_op, "", tag);
+		return;
+	}
 	for (std::vector<torrent_handle>::iterator i = handles.begin()
 		, end(handles.end()); i != end; ++i)
 	{
@@ -912,10 +1089,115 @@ void transmission_webui::remove_torrent(std::vector<char>& buf, jsmntok_t* args
 
 	std::vector<torrent_handle> handles;
 	get_torrents(handles, args, buffer);
+	if (m_bulk)
+	{
+		submit_bulk_job(buf, handles
+			, delete_data ? bulk_jobs::remove_data_op : bulk_jobs::remove_op, "", tag);
+		return;
+	}
 	for (std::vector<torrent_handle>::iterator i = handles.begin()
 		, end(handles.end()); i != end; ++i)
 	{
-		m_ses.remove_torrent(*i, delete_data ? session::delete_files : 0);
+		m_sessions->remove_torrent(*i, delete_data ? session::delete_files : 0);
+	}
+	appendf(buf, "{ \"result\": \"success\", \"tag\": %" PRId64 ", "
+		"\"arguments\": {} }", tag);
+}
+
+void transmission_webui::set_torrent_location(std::vector<char>& buf, jsmntok_t* args
+	, std::int64_t tag, char* buffer, permissions_interface const* p)
+{
+	if (!p->allow_set_settings(-1))
+	{
+		return_failure(buf, "permission denied", tag);
+		return;
+	}
+
+	std::string location = find_string(args, buffer, "location");
+	if (location.empty())
+	{
+		return_failure(buf, "missing location", tag);
+		return;
+	}
+
+	// the files are always moved. "move": false would mean the files
+	// are already there, which libtorrent has no way of being told
+	std::vector<torrent_handle> handles;
+	get_torrents(handles, args, buffer);
+	if (m_bulk)
+	{
+		submit_bulk_job(buf, handles, bulk_jobs::move_op, location, tag);
+		return;
+	}
+	for (std::vector<torrent_handle>::iterator i = handles.begin()
+		, end(handles.end()); i != end; ++i)
+	{
+		i->move_storage(location);
+	}
+	appendf(buf, "{ \"result\": \"success\", \"tag\": %" PRId64 ", "
+		"\"arguments\": {} }", tag);
+}
+
+void transmission_webui::submit_bulk_job(std::vector<char>& buf
+	, std::vector<torrent_handle> const& handles, int op
+	, std::string const& path, std::int64_t tag)
+{
+	std::vector<sha1_hash> hashes;
+	hashes.reserve(handles.size());
+	for (std::vector<torrent_handle>::const_iterator i = handles.begin()
+		, end(handles.end()); i != end; ++i)
+		hashes.push_back(i->info_hash());
+	int const id = m_bulk->submit(op, hashes, path);
+
+	appendf(buf, "{ \"result\": \"success\", \"tag\": %" PRId64 ", "
+		"\"arguments\": { \"bulk-job\": %d } }", tag, id);
+}
+
+// a non-standard method, listing the jobs of the operations the user may
+// carry out
+void transmission_webui::get_bulk_jobs(std::vector<char>& buf, jsmntok_t* args
+	, std::int64_t tag, char* buffer, permissions_interface const* p)
+{
+	std::vector<bulk_jobs::job_status> jobs;
+	if (m_bulk) m_bulk->jobs(jobs);
+
+	appendf(buf, "{ \"result\": \"success\", \"tag\": %" PRId64 ", "
+		"\"arguments\": { \"bulk-jobs\": [", tag);
+	bool first = true;
+	for (std::vector<bulk_jobs::job_status>::iterator i = jobs.begin()
+		, end(jobs.end()); i != end; ++i)
+	{
+		if (!bulk_jobs::allowed(p, i->operation)) continue;
+		appendf(buf, "%s{ \"id\": %d, \"operation\": \"%s\", \"path\": \"%s\""
+			", \"total\": %d, \"done\": %d, \"cancelled\": %s, \"finished\": %s }"
+			, first ? "" : ", "
+			, i->id, bulk_jobs::operation_name(i->operation)
+			, escape_json(i->path).c_str(), i->total, i->done
+			, i->cancelled ? "true" : "false", i->finished ? "true" : "false");
+		first = false;
+	}
+	appendf(buf, "] } }");
+}
+
+void transmission_webui::cancel_bulk_job(std::vector<char>& buf, jsmntok_t* args
+	, std::int64_t tag, char* buffer, permissions_interface const* p)
+{
+	int const id = find_int(args, buffer, "id");
+	bulk_jobs::job_status st;
+	if (m_bulk == NULL || !m_bulk->status(id, st))
+	{
+		return_failure(buf, "no such job", tag);
+		return;
+	}
+	if (!bulk_jobs::allowed(p, st.operation))
+	{
+		return_failure(buf, "permission denied", tag);
+		return;
+	}
+	if (!m_bulk->cancel(id))
+	{
+		return_failure(buf, "job already finished", tag);
+		return;
 	}
 	appendf(buf, "{ \"result\": \"success\", \"tag\": %" PRId64 ", "
 		"\"arguments\": {} }", tag);
@@ -931,7 +1213,12 @@ void transmission_webui::session_stats(std::vector<char>& buf, jsmntok_t* args
 	}
 
 	// TODO: post session stats instead, and capture the performance counters
-	session_status st = m_ses.status();
+	session_status st = m_sessions->status();
+
+	// the torrent counts are maintained by the history, which is cheaper
+	// than having the session count them
+	torrent_counts counts;
+	m_hist->get_counts(counts);
 
 	appendf(buf, "{ \"result\": \"success\", \"tag\": %" PRId64 ", "
 		"\"arguments\": { "
@@ -955,21 +1242,21 @@ void transmission_webui::session_stats(std::vector<char>& buf, jsmntok_t* args
 			"\"secondsActive\": %d"
 			"}"
 		"}}", tag
-		, st.num_torrents - st.num_paused_torrents
+		, counts.total - counts.paused - counts.queued
 		, st.payload_download_rate
-		, st.num_paused_torrents
-		, st.num_torrents
+		, counts.paused + counts.queued
+		, counts.total
 		, st.payload_upload_rate
 		// cumulative-stats (not supported)
 		, st.total_payload_upload
 		, st.total_payload_download
-		, st.num_torrents
+		, counts.total
 		, 1
 		, time(nullptr) - m_start_time
 		// current-stats
 		, st.total_payload_upload
 		, st.total_payload_download
-		, st.num_torrents
+		, counts.total
 		, 1
 		, time(nullptr) - m_start_time);
 }
@@ -1245,7 +1532,7 @@ void transmission_webui::set_session(std::vector<char>& buf, jsmntok_t* args, st
 		}
 	}
 
-	m_ses.apply_settings(pack);
+	m_sessions->apply_settings(pack);
 
 	if (m_settings)
 	{
@@ -1257,7 +1544,7 @@ void transmission_webui::set_session(std::vector<char>& buf, jsmntok_t* args, st
 void transmission_webui::get_torrents(std::vector<torrent_handle>& handles, jsmntok_t* args
 	, char* buffer)
 {
-	std::vector<torrent_handle> h = m_ses.get_torrents();
+	std::vector<torrent_handle> h = m_sessions->get_torrents();
 
 	std::set<std::uint32_t> torrent_ids;
 	parse_ids(torrent_ids, args, buffer);
@@ -1276,10 +1563,17 @@ void transmission_webui::get_torrents(std::vector<torrent_handle>& handles, jsmn
 	}
 }
 
-transmission_webui::transmission_webui(session& s, save_settings_interface* sett, auth_interface const* auth)
+transmission_webui::transmission_webui(session& s, save_settings_interface* sett
+	, torrent_history* hist, auth_interface const* auth)
 	: m_ses(s)
+	, m_own_sessions(s)
+	, m_sessions(&m_own_sessions)
+	, m_hist(hist)
+	, m_files(NULL)
 	, m_settings(sett)
 	, m_auth(auth)
+	, m_bulk(NULL)
+	, m_rpc_stats("transmission", rpc_function_names())
 {
 	if (m_auth == NULL)
 	{
@@ -1304,6 +1598,44 @@ transmission_webui::transmission_webui(session& s, save_settings_interface* sett
 
 transmission_webui::~transmission_webui() {}
 
+// the buffers are released after a request that grew them past these, for
+// one oversized request to not pin the memory for the life of the thread
+static const std::size_t max_kept_tokens = 16 * 1024;
+static const std::size_t max_kept_bytes = 1024 * 1024;
+
+struct rpc_arena
+{
+	std::vector<char> post_body;
+	std::vector<jsmntok_t> tokens;
+	std::vector<char> response;
+
+	void trim()
+	{
+		if (tokens.capacity() > max_kept_tokens)
+			std::vector<jsmntok_t>().swap(tokens);
+		if (post_body.capacity() > max_kept_bytes)
+			std::vector<char>().swap(post_body);
+		if (response.capacity() > max_kept_bytes)
+			std::vector<char>().swap(response);
+	}
+};
+
+// trims the arena when the request is done with it
+struct arena_trimmer
+{
+	explicit arena_trimmer(rpc_arena& a) : m_arena(a) {}
+	~arena_trimmer() { m_arena.trim(); }
+private:
+	rpc_arena& m_arena;
+};
+
+// the number of tokens to parse a request with is estimated from the size
+// of its body, assuming a token per this many bytes. jsmn initializes every
+// token it's handed, so this is kept close to what's needed. It's grown for
+// requests that need more
+static const std::size_t bytes_per_token = 8;
+static const std::size_t min_tokens = 32;
+
 bool transmission_webui::handle_http(mg_connection* conn, mg_request_info const* request_info)
 {
 	// we only provide access to paths under /web and /upload
@@ -1323,21 +1655,16 @@ bool transmission_webui::handle_http(mg_connection* conn, mg_request_info const*
 
 	if (strcmp(request_info->uri, "/upload") == 0)
 	{
+		rpc_stats::call call(m_rpc_stats, upload_function, conn);
 		if (!perms->allow_add())
 		{
+			rpc_stats::set_error();
 			mg_printf(conn, "HTTP/1.1 401 Unauthorized\r\n"
 				"WWW-Authenticate: Basic realm=\"BitTorrent\"\r\n"
 				"Content-Length: 0\r\n\r\n");
 			return true;
 		}
 		add_torrent_params p = m_params_model;
-		error_code ec;
-		if (!parse_torrent_post(conn, p, ec))
-		{
-			mg_printf(conn, "HTTP/1.1 400 Invalid Request\r\n"
-				"Connection: close\r\n\r\n");
-			return true;
-		}
 
 		char buf[10];
 		if (mg_get_var(request_info->query_string, strlen(request_info->query_string)
@@ -1348,7 +1675,19 @@ bool transmission_webui::handle_http(mg_connection* conn, mg_request_info const*
 			p.flags &= ~add_torrent_params::flag_auto_managed;
 		}
 
-		m_ses.async_add_torrent(p);
+		std::vector<add_torrent_params> torrents;
+		error_code ec;
+		if (!parse_torrent_post(conn, p, torrents, ec))
+		{
+			rpc_stats::set_error();
+			mg_printf(conn, "HTTP/1.1 400 Invalid Request\r\n"
+				"Connection: close\r\n\r\n");
+			return true;
+		}
+
+		for (std::vector<add_torrent_params>::iterator i = torrents.begin()
+			, end(torrents.end()); i != end; ++i)
+			m_sessions->session_for(*i).async_add_torrent(*i);
 
 		mg_printf(conn, "HTTP/1.1 200 OK\r\n"
 			"Content-Type: text/json\r\n"
@@ -1356,8 +1695,18 @@ bool transmission_webui::handle_http(mg_connection* conn, mg_request_info const*
 		return true;
 	}
 
+	// the request body, its tokens and the response are kept in per-thread
+	// buffers which are reused across requests. Once they have grown to fit
+	// the typical request, handling one doesn't touch the heap
+	static thread_local rpc_arena arena;
+	arena_trimmer trimmer(arena);
+	std::vector<char>& post_body = arena.post_body;
+	std::vector<jsmntok_t>& tokens = arena.tokens;
+	std::vector<char>& response = arena.response;
+	post_body.clear();
+	response.clear();
+
 	char const* cl = mg_get_header(conn, "content-length");
-	std::vector<char> post_body;
 	if (cl != NULL)
 	{
 		int content_length = atoi(cl);
@@ -1374,17 +1723,31 @@ bool transmission_webui::handle_http(mg_connection* conn, mg_request_info const*
 //		, request_info->query_string ? "?" : ""
 //		, request_info->query_string ? request_info->query_string : "");
 
-	std::vector<char> response;
 	if (post_body.empty())
 	{
 		return_error(conn, "request with no POST body");
 		return true;
 	}
-	jsmntok_t tokens[256];
+	// every token covers at least one byte of the body, so there's never a
+	// need for more tokens than that
+	std::size_t num_tokens = (std::min)((std::max)(post_body.size() / bytes_per_token
+		, min_tokens), post_body.size());
+	if (tokens.size() < num_tokens) tokens.resize(num_tokens);
 	jsmn_parser p;
 	jsmn_init(&p);
 
-	int r = jsmn_parse(&p, &post_body[0], tokens, sizeof(tokens)/sizeof(tokens[0]));
+	int r;
+	for (;;)
+	{
+		r = jsmn_parse(&p, &post_body[0], &tokens[0], num_tokens);
+		if (r != JSMN_ERROR_NOMEM) break;
+
+		// the parser picks up where it left off once it has more tokens
+		if (num_tokens >= post_body.size()) break;
+		num_tokens = (std::min)(num_tokens * 2, post_body.size());
+		if (tokens.size() < num_tokens) tokens.resize(num_tokens);
+	}
+
 	if (r == JSMN_ERROR_INVAL)
 	{
 		return_error(conn, "request not JSON");
@@ -1406,17 +1769,12 @@ bool transmission_webui::handle_http(mg_connection* conn, mg_request_info const*
 		return true;
 	}
 
-	handle_json_rpc(response, tokens, &post_body[0], perms);
+	handle_json_rpc(response, &tokens[0], &post_body[0], perms);
 
-	// we need a null terminator
-	response.push_back('\0');
-	// subtract one from content-length
-	// to not count null terminator
-	mg_printf(conn, "HTTP/1.1 200 OK\r\n"
-		"Content-Type: text/json\r\n"
-		"Content-Length: %d\r\n\r\n", int(response.size()) - 1);
-	mg_write(conn, &response[0], response.size());
-//	printf("%s\n", &response[0]);
+	// the response is compressed if the client accepts it and it's big
+	// enough to be worth it
+	http_response_writer stream(conn, "text/json", m_compression);
+	stream.finish(response);
 	return true;
 }
 
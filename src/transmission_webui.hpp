@@ -34,6 +34,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_TRANSMISSION_WEBUI_HPP
 
 #include "webui.hpp"
+#include "rpc_stats.hpp"
+#include "session_set.hpp"
+#include "http_compression.hpp"
 
 extern "C" {
 #include "jsmn.h"
@@ -50,15 +53,41 @@ namespace libtorrent
 	struct save_settings_interface;
 	struct permissions_interface;
 	struct auth_interface;
+	struct torrent_history;
+	struct file_history;
+	struct bulk_jobs;
 
 	struct transmission_webui : http_handler
 	{
-		transmission_webui(session& s, save_settings_interface* sett, auth_interface const* auth = NULL);
+		transmission_webui(session& s, save_settings_interface* sett
+			, torrent_history* hist, auth_interface const* auth = NULL);
 		~transmission_webui();
 
 		void set_params_model(add_torrent_params const& p)
 		{ m_params_model = p; }
 
+		// passes the commands that concern the session as a whole, like
+		// adding and removing torrents and changing settings, on to a set of
+		// sessions rather than just the one this was constructed with. NULL
+		// goes back to that one
+		void set_sessions(session_set* s)
+		{ m_sessions = s ? s : &m_own_sessions; }
+
+		// the files and fileStats fields of torrent-get are formatted from
+		// the file lists kept by files
+		void set_file_history(file_history* files)
+		{ m_files = files; }
+
+		// how responses are compressed for clients that accept it
+		void set_compression(http_compression const& c)
+		{ m_compression = c; }
+
+		// torrent-remove, torrent-verify and torrent-set-location are queued
+		// as jobs to carry out in the background. Without it, they're
+		// carried out before responding
+		void set_bulk_jobs(bulk_jobs* jobs)
+		{ m_bulk = jobs; }
+
 		virtual bool handle_http(mg_connection* conn,
 			mg_request_info const* request_info);
 
@@ -71,6 +100,9 @@ namespace libtorrent
 		void verify_torrent(std::vector<char>&, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
 		void reannounce_torrent(std::vector<char>&, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
 		void remove_torrent(std::vector<char>&, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
+		void set_torrent_location(std::vector<char>&, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
+		void get_bulk_jobs(std::vector<char>&, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
+		void cancel_bulk_job(std::vector<char>&, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
 		void session_stats(std::vector<char>&, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
 		void get_session(std::vector<char>& buf, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
 		void set_session(std::vector<char>& buf, jsmntok_t* args, std::int64_t tag, char* buffer, permissions_interface const* p);
@@ -82,11 +114,35 @@ namespace libtorrent
 		void handle_json_rpc(std::vector<char>& buf, jsmntok_t* tokens, char* buffer, permissions_interface const* p);
 		void parse_ids(std::set<std::uint32_t>& torrent_ids, jsmntok_t* args, char* buffer);
 
+		// queues op on the torrents, as a bulk job, and responds with the
+		// job's id
+		void submit_bulk_job(std::vector<char>& buf, std::vector<torrent_handle> const& handles
+			, int op, std::string const& path, std::int64_t tag);
+
+		// the number of frames a torrent counts as recently active for. The
+		// history gets a new frame every time torrent updates are posted
+		enum { recently_active_frames = 120 };
+
 		time_t m_start_time;
 		session& m_ses;
+
+		// the session as a set of one, unless set_sessions() has been called
+		session_set m_own_sessions;
+		session_set* m_sessions;
+		torrent_history* m_hist;
+
+		// the cached file lists, or NULL to read them on every request
+		file_history* m_files;
 		auth_interface const* m_auth;
 		save_settings_interface* m_settings;
 		add_torrent_params m_params_model;
+		http_compression m_compression;
+
+		// the queue of operations on many torrents, or NULL
+		bulk_jobs* m_bulk;
+
+		// indexed by the methods, followed by upload
+		rpc_stats m_rpc_stats;
 	};
 }
 
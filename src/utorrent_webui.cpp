@@ -41,6 +41,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <stdio.h>
 #include <vector>
 #include <map>
+#include <algorithm> // for sort
+#include <limits>
 #include <boost/cstdint.hpp>
 
 extern "C" {
@@ -62,27 +64,39 @@ extern "C" {
 #include "response_buffer.hpp" // for appendf
 #include "torrent_post.hpp"
 #include "escape_json.hpp"
+#include "json_writer.hpp"
 #include "auto_load.hpp"
 #include "save_settings.hpp"
 #include "torrent_history.hpp"
+#include "bulk_jobs.hpp"
 #include "rss_filter.hpp"
+#include "peer_history.hpp"
+#include "file_history.hpp"
 
 namespace libtorrent
 {
 
 	namespace io = detail;
 
+static std::vector<std::string> rpc_function_names();
+
 utorrent_webui::utorrent_webui(session& s, save_settings_interface* sett
 	, auto_load* al, torrent_history* hist
 	, rss_filter_handler* rss_filter
 	, auth_interface const* auth)
 	: m_ses(s)
+	, m_own_sessions(s)
+	, m_sessions(&m_own_sessions)
 	, m_al(al)
 	, m_auth(auth)
 	, m_settings(sett)
 	, m_rss_filter(rss_filter)
 	, m_hist(hist)
+	, m_peers(NULL)
+	, m_files(NULL)
 	, m_listener(NULL)
+	, m_bulk(NULL)
+	, m_rpc_stats("utorrent", rpc_function_names())
 {
 	if (m_auth == NULL)
 	{
@@ -147,7 +161,7 @@ static const method_handler handlers[] =
 	{ "getsettings", &utorrent_webui::get_settings },
 	{ "setsetting", &utorrent_webui::set_settings },
 	{ "add-url", &utorrent_webui::add_url },
-//	{ "setprops", &utorrent_webui:: },
+	{ "setprops", &utorrent_webui::set_properties },
 	{ "removedata", &utorrent_webui::remove_torrent_and_data },
 	{ "list-dirs", &utorrent_webui::list_dirs },
 //	{ "rss-update", &utorrent_webui::rss_update },
@@ -157,6 +171,8 @@ static const method_handler handlers[] =
 	{ "removetorrent", &utorrent_webui::remove_torrent },
 	{ "removedatatorrent", &utorrent_webui::remove_torrent_and_data },
 	{ "getversion", &utorrent_webui::get_version },
+	{ "getbulkjobs", &utorrent_webui::get_bulk_jobs },
+	{ "cancelbulkjob", &utorrent_webui::cancel_bulk_job },
 //	{ "add-peer", &utorrent_webui:: },
 };
 
@@ -166,6 +182,23 @@ void return_error(mg_connection* conn)
 		"Content-Length: 0\r\n\r\n");
 }
 
+// the size at which a streamed torrent list is written as a chunk
+static const std::size_t chunk_size = 64 * 1024;
+
+// the pseudo functions following the actions in the rpc stats
+static int const num_handlers = sizeof(handlers)/sizeof(handlers[0]);
+enum { add_file_function = num_handlers, list_function };
+
+static std::vector<std::string> rpc_function_names()
+{
+	std::vector<std::string> ret;
+	for (int i = 0; i < num_handlers; ++i)
+		ret.push_back(handlers[i].action_name);
+	ret.push_back("add-file");
+	ret.push_back("list");
+	return ret;
+}
+
 bool utorrent_webui::handle_http(mg_connection* conn, mg_request_info const* request_info)
 {
 	// redirect to /gui/
@@ -191,7 +224,10 @@ bool utorrent_webui::handle_http(mg_connection* conn, mg_request_info const* req
 		return true;
 	}
 
-	std::vector<char> response;
+	// the response buffer is reused across requests served by this thread,
+	// to not have to grow it from scratch every time
+	static thread_local std::vector<char> response;
+	response.clear();
 
 	// Auth token handling
 	if (strcmp(request_info->uri, "/gui/token.html") == 0)
@@ -221,6 +257,9 @@ bool utorrent_webui::handle_http(mg_connection* conn, mg_request_info const* req
 
 	m_listener = (webui_base*)request_info->user_data;
 
+	// the function is known once the action has been parsed
+	rpc_stats::call call(m_rpc_stats, -1, conn);
+
 //	printf("%s%s%s\n", request_info->uri
 //		, request_info->query_string ? "?" : ""
 //		, request_info->query_string ? request_info->query_string : "");
@@ -252,56 +291,63 @@ bool utorrent_webui::handle_http(mg_connection* conn, mg_request_info const* req
 		// add-file is special, since it posts the torrent
 		if (strcmp(action, "add-file") == 0)
 		{
+			call.set_function(add_file_function);
 			if (!perms->allow_add())
 			{
+				rpc_stats::set_error();
 				mg_printf(conn, "HTTP/1.1 401 Unauthorized\r\n"
 					"WWW-Authenticate: Basic realm=\"BitTorrent\"\r\n"
 					"Content-Length: 0\r\n\r\n");
 				return true;
 			}
-			add_torrent_params p = m_params_model;
+			std::vector<add_torrent_params> torrents;
 			error_code ec;
-			if (!parse_torrent_post(conn, p, ec))
+			if (!parse_torrent_post(conn, m_params_model, torrents, ec))
 			{
+				rpc_stats::set_error();
 				mg_printf(conn, "HTTP/1.1 400 Invalid Request (%s)\r\n"
 					"Connection: close\r\n\r\n", ec.message().c_str());
 				return true;
 			}
 
-			m_ses.async_add_torrent(p);
+			for (std::vector<add_torrent_params>::iterator i = torrents.begin()
+				, end(torrents.end()); i != end; ++i)
+				m_sessions->session_for(*i).async_add_torrent(*i);
 		}
 		else
 		{
-			for (int i = 0; i < sizeof(handlers)/sizeof(handlers[0]); ++i)
+			for (int i = 0; i < num_handlers; ++i)
 			{
 				if (strcmp(action, handlers[i].action_name)) continue;
 
+				call.set_function(i);
 				(this->*handlers[i].fun)(response, request_info->query_string, perms);
 				break;
 			}
 		}
 	}
 
+	// the response is compressed if the client accepts it and it's big
+	// enough to be worth it
+	http_response_writer stream(conn, "text/json", m_compression);
+
 	char buf[10];
 	if (mg_get_var(request_info->query_string, strlen(request_info->query_string)
 		, "list", buf, sizeof(buf)) > 0
 		&& atoi(buf) > 0)
 	{
-		send_torrent_list(response, request_info->query_string, perms);
+		// a list request on its own, not on behalf of an action
+		if (ret <= 0) call.set_function(list_function);
+
+		// HTTP/1.1 clients get the list streamed as it's being formatted,
+		// with chunked encoding, instead of buffering all of it up first
+		send_torrent_list(response, request_info->query_string, perms
+			, strcmp(request_info->http_version, "1.1") == 0 ? &stream : NULL);
 //		send_rss_list(response, request_info->query_string, perms);
 	}
 
-	// we need a null terminator
-	appendf(response, "}");
-	response.push_back('\0');
-
-	// subtract one from content-length
-	// to not count null terminator
-	mg_printf(conn, "HTTP/1.1 200 OK\r\n"
-		"Content-Type: text/json\r\n"
-		"Content-Length: %d\r\n\r\n", int(response.size()) - 1);
-	mg_write(conn, &response[0], response.size()-1);
-//	printf("%s\n", &response[0]);
+	response.push_back('}');
+	stream.finish(response);
 	return true;
 }
 
@@ -349,6 +395,12 @@ void utorrent_webui::recheck(std::vector<char>&, char const* args, permissions_i
 {
 	if (!p->allow_recheck()) return;
 
+	if (m_bulk)
+	{
+		submit_bulk_job(args, bulk_jobs::recheck_op);
+		return;
+	}
+
 	TORRENT_APPLY_FUN
 	{
 		i->handle.force_recheck();
@@ -399,9 +451,15 @@ void utorrent_webui::remove_torrent(std::vector<char>&, char const* args, permis
 {
 	if (!p->allow_remove()) return;
 
+	if (m_bulk)
+	{
+		submit_bulk_job(args, bulk_jobs::remove_op);
+		return;
+	}
+
 	TORRENT_APPLY_FUN
 	{
-		m_ses.remove_torrent(i->handle);
+		m_sessions->remove_torrent(i->handle);
 	}
 }
 
@@ -435,6 +493,7 @@ void utorrent_webui::set_file_priority(std::vector<char>&, char const* args, per
 	{
 		for (std::vector<int>::iterator j = files.begin(), end(files.end()); j != end; ++j)
 			i->handle.file_priority(*j, prio);
+		if (m_files) m_files->priorities_changed(i->info_hash);
 	}
 }
 
@@ -442,9 +501,15 @@ void utorrent_webui::remove_torrent_and_data(std::vector<char>&, char const* arg
 {
 	if (!p->allow_remove() || !p->allow_remove_data()) return;
 
+	if (m_bulk)
+	{
+		submit_bulk_job(args, bulk_jobs::remove_data_op);
+		return;
+	}
+
 	TORRENT_APPLY_FUN
 	{
-		m_ses.remove_torrent(i->handle, session::delete_files);
+		m_sessions->remove_torrent(i->handle, session::delete_files);
 	}
 }
 
@@ -455,6 +520,27 @@ void utorrent_webui::list_dirs(std::vector<char>& response, char const* args, pe
 		, free_disk_space(m_params_model.save_path) / 1024 / 1024);
 }
 
+// [&hash=<info-hash>]...&s=<property>&v=<value>
+// only the label can be set. An empty value removes it
+void utorrent_webui::set_properties(std::vector<char>&, char const* args, permissions_interface const* p)
+{
+	if (!p->allow_queue_change()) return;
+
+	char prop[20];
+	if (mg_get_var(args, strlen(args), "s", prop, sizeof(prop)) <= 0) return;
+	if (strcmp(prop, "label") != 0) return;
+
+	char value[256];
+	int const len = mg_get_var(args, strlen(args), "v", value, sizeof(value));
+	std::vector<std::string> labels;
+	if (len > 0) labels.push_back(std::string(value, len));
+
+	TORRENT_APPLY_FUN
+	{
+		m_hist->set_labels(i->info_hash, labels);
+	}
+}
+
 #undef TORRENT_APPLY_FUN
 
 char const* settings_name(int s)
@@ -842,62 +928,101 @@ void utorrent_webui::set_settings(std::vector<char>& response, char const* args,
 			}
 		}
 	}
-	m_ses.apply_settings(pack);
+	m_sessions->apply_settings(pack);
 
 	error_code ec;
 	if (m_settings) m_settings->save(ec);
 }
 
+static void append_file(json_writer& out, file_history_entry const& e, int i
+	, int version)
+{
+	file_storage const& files = e.torrent->files();
+	out.escaped(e.json->names[i]);
+	out.raw(", ");
+	out.integer(files.file_size(i));
+	out.raw(", ");
+	out.integer(e.progress[i]);
+	out.raw(", ");
+	// uTorrent's web UI uses 4 priority levels, libtorrent uses 8. Don't
+	// round 1 down to 0. 0 is special (do-not-download)
+	int const prio = e.priority[i];
+	out.integer((prio == 1 ? 2 : prio) / 2);
+
+	if (version > 0)
+	{
+		int const first_piece = files.file_offset(i) / files.piece_length();
+		int const last_piece = (files.file_offset(i) + files.file_size(i)) / files.piece_length();
+		out.raw(", ");
+		out.integer(first_piece);
+		out.raw(", ");
+		out.integer(last_piece - first_piece);
+	}
+}
+
+// the file lists are kept by the file_history, with the names escaped once.
+// With a cid from a previous getfiles response, the torrents whose files
+// can be told apart from then are sent in "filesp", with only the files that
+// changed since, each prefixed by its index. The others are sent in full, in
+// "files", like without a cid
 void utorrent_webui::send_file_list(std::vector<char>& response, char const* args, permissions_interface const* p)
 {
 	if (!p->allow_list()) return;
 
+	char buf[50];
+	int cid = 0;
+	if (m_files && mg_get_var(args, strlen(args), "cid", buf, sizeof(buf)) > 0)
+		cid = atoi(buf);
+
 	std::vector<torrent_status> t = parse_torrents(args);
-	appendf(response, ",\"files\":[");
-	int first = 1;
-	std::vector<std::int64_t> progress;
-	std::vector<int> file_prio;
+
+	std::vector<char> full;
+	std::vector<char> delta;
+	json_writer full_out(full);
+	json_writer delta_out(delta);
+	int frame = 0;
+
 	for (std::vector<torrent_status>::iterator i = t.begin()
 		, end(t.end()); i != end; ++i)
 	{
-		i->handle.file_progress(progress);
-		file_prio = i->handle.file_priorities();
-		shared_ptr<const torrent_info> ti = i->torrent_file.lock();
-		if (!ti || !ti->is_valid()) continue;
-		file_storage const& files = ti->files();
-
-		appendf(response, ",\"%s\",["+first, to_hex(ti->info_hash().to_string()).c_str());
-		int first_file = 1;
-		for (int i = 0; i < files.num_files(); ++i)
+		file_entry_ptr e = m_files ? m_files->get_file_updates(i->handle)
+			: read_files(i->handle);
+		if (!e || !e->torrent->is_valid()) continue;
+		frame = (std::max)(frame, e->frame);
+
+		bool const incremental = cid > 0 && e->static_frame <= cid;
+		json_writer& out = incremental ? delta_out : full_out;
+		if (!out.buffer().empty()) out.raw(',');
+		out.hex(i->info_hash);
+		out.raw(",[");
+
+		int const num_files = e->progress.size();
+		bool first_file = true;
+		for (int k = 0; k < num_files; ++k)
 		{
-			int first_piece = files.file_offset(i) / files.piece_length();
-			int last_piece = (files.file_offset(i) + files.file_size(i)) / files.piece_length();
-			// don't round 1 down to 0. 0 is special (do-not-download)
-			if (file_prio[i] == 1) file_prio[i] = 2;
-			appendf(response, ",[\"%s\", %" PRId64 ", %" PRId64 ", %d" + first_file
-				, escape_json(files.file_name(i)).c_str()
-				, files.file_size(i)
-				, progress[i]
-				, file_prio[i] / 2 // uTorrent's web UI uses 4 priority levels, libtorrent uses 8
-				);
-
-			if (m_version > 0)
+			if (incremental && !e->file_changed(k, cid)) continue;
+			out.raw(first_file ? "[" : ",[");
+			first_file = false;
+			if (incremental)
 			{
-				appendf(response, ", %d, %d]"
-					, first_piece
-					, last_piece - first_piece);
+				out.integer(k);
+				out.raw(", ");
 			}
-			else
-			{
-				response.push_back(']');
-			}
-			first_file = 0;
+			append_file(out, *e, k, m_version);
+			out.raw(']');
 		}
-
-		response.push_back(']');
-		first = 0;
+		out.raw(']');
 	}
-	response.push_back(']');
+
+	if (m_files) frame = (std::max)(frame, m_files->frame());
+
+	json_writer out(response);
+	out.raw(",\"files\":[");
+	out.raw(full.empty() ? "" : &full[0], full.size());
+	out.raw("],\"filesp\":[");
+	out.raw(delta.empty() ? "" : &delta[0], delta.size());
+	out.raw("],\"filec\":");
+	out.integer(frame);
 }
 
 std::string trackers_as_string(torrent_handle h)
@@ -934,7 +1059,7 @@ void utorrent_webui::add_url(std::vector<char>&, char const* args, permissions_i
 	add_torrent_params atp = m_params_model;
 	atp.url = url;
 
-	m_ses.async_add_torrent(atp);
+	m_sessions->session_for(atp).async_add_torrent(atp);
 }
 
 void utorrent_webui::get_properties(std::vector<char>& response, char const* args, permissions_interface const* p)
@@ -979,7 +1104,7 @@ void utorrent_webui::get_properties(std::vector<char>& response, char const* arg
 	response.push_back(']');
 }
 
-std::string utorrent_peer_flags(peer_info const& pi)
+std::string utorrent_peer_flags(peer_state const& pi)
 {
 	std::string ret;
 	if (pi.flags & peer_info::remote_interested)
@@ -1036,59 +1161,106 @@ std::string utorrent_peer_flags(peer_info const& pi)
 	return ret;
 }
 
+static void append_peer(std::vector<char>& response, peer_history_peer const& p
+	, int num_pieces, bool first)
+{
+	appendf(response, ",[\"  \",\"%s\",\"%s\",%d,%d,\"%s\",\"%s\",%d,%d,%d,%d,%d"
+		",%d,%" PRId64 ",%" PRId64 ",%d,%d,%d,%d,%d,%d,%d]" + first
+		, print_endpoint(p.ip).c_str()
+		, ""
+		, (p.state.flags & peer_info::utp_socket) != 0
+		, p.ip.port()
+		, escape_json(p.state.client).c_str()
+		, utorrent_peer_flags(p.state).c_str()
+		, num_pieces > 0 ? p.state.num_pieces * 1000 / num_pieces : 0
+		, p.state.down_speed
+		, p.state.up_speed
+		, p.state.download_queue_length
+		, p.state.upload_queue_length
+		, p.state.last_request
+		, p.state.total_upload
+		, p.state.total_download
+		, p.state.num_hashfails
+		, 0
+		, 0
+		, 0
+		, p.state.send_buffer_size
+		, p.state.last_active
+		, 0
+		);
+}
+
+// the peer lists are cached by the peer_history, which refreshes them in
+// the background. With a cid from a previous getpeers response, only the
+// peers that changed since then are sent, in "peerp", along with the ones
+// that disconnected, in "peerm". Torrents whose changes can't be told from
+// that far back are sent in full, in "peers", like without a cid
 void utorrent_webui::send_peer_list(std::vector<char>& response, char const* args, permissions_interface const* p)
 {
 	if (!p->allow_list()) return;
 
+	char buf[50];
+	int cid = 0;
+	if (mg_get_var(args, strlen(args), "cid", buf, sizeof(buf)) > 0)
+		cid = atoi(buf);
+
 	std::vector<torrent_status> torrents = parse_torrents(args);
-	appendf(response, ",\"peers\":[");
-	int first = 1;
+
+	// the peer lists are sent in the "peers" or "peerp" list depending on
+	// whether they're complete
+	std::vector<char> full;
+	std::vector<char> delta;
+	std::vector<char> removed;
+	int frame = 0;
+
+	std::vector<peer_history_peer const*> peers;
+	std::vector<tcp::endpoint> gone;
 	for (std::vector<torrent_status>::iterator i = torrents.begin()
 		, end(torrents.end()); i != end; ++i)
 	{
 		shared_ptr<const torrent_info> ti = i->torrent_file.lock();
 		if (!ti || !ti->is_valid()) continue;
 
-		appendf(response, ",\"%s\",[" + first
-			, to_hex(i->info_hash.to_string()).c_str());
+		peer_entry_ptr e = m_peers ? m_peers->get_peers(i->handle) : read_peers(i->handle);
+		if (!e) continue;
+		frame = (std::max)(frame, e->frame);
 
-		int first_peer = 1;
-		std::vector<peer_info> peers;
-		i->handle.get_peer_info(peers);
-		for (std::vector<peer_info>::iterator p = peers.begin()
-			, pend(peers.end()); p != pend; ++p)
+		// without a peer_history, every list is read from scratch
+		peers.clear();
+		gone.clear();
+		bool const incremental = e->updates_since(m_peers ? cid : 0, peers, gone);
+
+		std::vector<char>& out = incremental ? delta : full;
+		appendf(out, ",\"%s\",[" + out.empty()
+			, to_hex(i->info_hash.to_string()).c_str());
+		for (std::vector<peer_history_peer const*>::iterator k = peers.begin()
+			, pend(peers.end()); k != pend; ++k)
 		{
-			appendf(response, ",[\"  \",\"%s\",\"%s\",%d,%d,\"%s\",\"%s\",%d,%d,%d,%d,%d"
-				",%d,%" PRId64 ",%" PRId64 ",%d,%d,%d,%d,%d,%d,%d]" + first_peer
-				, print_endpoint(p->ip).c_str()
-				, ""
-				, (p->flags & peer_info::utp_socket) != 0
-				, p->ip.port()
-				, escape_json(p->client).c_str()
-				, utorrent_peer_flags(*p).c_str()
-				, p->num_pieces * 1000 / ti->num_pieces()
-				, p->down_speed
-				, p->up_speed
-				, p->download_queue_length
-				, p->upload_queue_length
-				, total_seconds(p->last_request)
-				, p->total_upload
-				, p->total_download
-				, p->num_hashfails
-				, 0
-				, 0
-				, 0
-				, p->send_buffer_size
-				, total_seconds(p->last_active)
-				, 0
-				);
-			first_peer = 0;
+			append_peer(out, **k, ti->num_pieces(), k == peers.begin());
 		}
+		out.push_back(']');
 
-		response.push_back(']');
-		first = 0;
+		if (!incremental) continue;
+		appendf(removed, ",\"%s\",[" + removed.empty()
+			, to_hex(i->info_hash.to_string()).c_str());
+		for (std::vector<tcp::endpoint>::iterator k = gone.begin()
+			, gend(gone.end()); k != gend; ++k)
+		{
+			appendf(removed, ",\"%s\"" + (k == gone.begin())
+				, print_endpoint(*k).c_str());
+		}
+		removed.push_back(']');
 	}
-	response.push_back(']');
+
+	if (m_peers) frame = (std::max)(frame, m_peers->frame());
+
+	appendf(response, ",\"peers\":[");
+	response.insert(response.end(), full.begin(), full.end());
+	appendf(response, "],\"peerp\":[");
+	response.insert(response.end(), delta.begin(), delta.end());
+	appendf(response, "],\"peerm\":[");
+	response.insert(response.end(), removed.begin(), removed.end());
+	appendf(response, "],\"peerc\":%d", frame);
 }
 
 void utorrent_webui::get_version(std::vector<char>& response, char const* args, permissions_interface const* p)
@@ -1104,6 +1276,54 @@ void utorrent_webui::get_version(std::vector<char>& response, char const* args,
 		, to_hex(m_ses.id().to_string()).c_str(), m_ses.get_settings().get_str(settings_pack::user_agent).c_str());
 }
 
+// the jobs of the operations the user may carry out, as
+// "bulkjobs": [{"id": ..., "operation": "remove", ...}, ...]
+void utorrent_webui::get_bulk_jobs(std::vector<char>& response, char const* args, permissions_interface const* p)
+{
+	std::vector<bulk_jobs::job_status> jobs;
+	if (m_bulk) m_bulk->jobs(jobs);
+
+	appendf(response, ",\"bulkjobs\":[");
+	bool first = true;
+	for (std::vector<bulk_jobs::job_status>::iterator i = jobs.begin()
+		, end(jobs.end()); i != end; ++i)
+	{
+		if (!bulk_jobs::allowed(p, i->operation)) continue;
+		appendf(response, "%s{\"id\":%d,\"operation\":\"%s\",\"path\":\"%s\""
+			",\"total\":%d,\"done\":%d,\"cancelled\":%s,\"finished\":%s}"
+			, first ? "" : ","
+			, i->id, bulk_jobs::operation_name(i->operation)
+			, escape_json(i->path).c_str(), i->total, i->done
+			, i->cancelled ? "true" : "false", i->finished ? "true" : "false");
+		first = false;
+	}
+	appendf(response, "]");
+}
+
+void utorrent_webui::cancel_bulk_job(std::vector<char>& response, char const* args, permissions_interface const* p)
+{
+	if (m_bulk == NULL) return;
+
+	char buf[20];
+	if (mg_get_var(args, strlen(args), "id", buf, sizeof(buf)) <= 0) return;
+	int const id = atoi(buf);
+
+	bulk_jobs::job_status st;
+	if (!m_bulk->status(id, st) || !bulk_jobs::allowed(p, st.operation)) return;
+	m_bulk->cancel(id);
+}
+
+void utorrent_webui::submit_bulk_job(char const* args, int op)
+{
+	std::vector<torrent_status> t = parse_torrents(args);
+	std::vector<sha1_hash> hashes;
+	hashes.reserve(t.size());
+	for (std::vector<torrent_status>::iterator i = t.begin()
+		, end(t.end()); i != end; ++i)
+		hashes.push_back(i->info_hash);
+	m_bulk->submit(op, hashes);
+}
+
 void utorrent_webui::rss_update(std::vector<char>& response, char const* args, permissions_interface const* p)
 {
 	char buf[20];
@@ -1321,96 +1541,208 @@ std::string utorrent_message(torrent_status const& st)
 	return "??";
 }
 
-void utorrent_webui::send_torrent_list(std::vector<char>& response, char const* args, permissions_interface const* p)
+// the cid handed to clients is the history's epoch above its frame number.
+// A cid from before a restart is only honored if the history was restored,
+// otherwise the client gets the full list. So does a cid from before the
+// history's removal horizon, the full list in "torrents" makes the client
+// drop the torrents that aren't in it. Returns the frame to send updates
+// since
+static int parse_cid(char const* args, torrent_history const* hist)
+{
+	char buf[50];
+	int ret = mg_get_var(args, strlen(args), "cid", buf, sizeof(buf));
+	if (ret <= 0 || hist == NULL) return 0;
+	std::uint64_t const cid = strtoull(buf, NULL, 10);
+	return hist->cursor_frame(std::uint32_t(cid >> 32), int(cid & 0xffffffff));
+}
+
+void utorrent_webui::send_torrent_list(std::vector<char>& response, char const* args
+	, permissions_interface const* p, http_response_writer* stream)
 {
 	if (!p->allow_list()) return;
 
-	int cid = 0;
+	int const cid = parse_cid(args, m_hist);
 	char buf[50];
-	// first, find the action
-	int ret = mg_get_var(args, strlen(args)
-		, "cid", buf, sizeof(buf));
-	if (ret > 0) cid = atoi(buf);
 
-	appendf(response, cid > 0 ? ",\"torrentp\":[" : ",\"torrents\":[");
+	json_writer out(response);
+	out.raw(cid > 0 ? ",\"torrentp\":[" : ",\"torrents\":[");
 
-	std::vector<torrent_status> torrents;
-	m_hist->updated_since(cid, torrents);
+	// with the optional label argument, only the torrents with that label
+	// are listed. The full list is looked up in the history's label index.
+	// Torrents that lost the label since cid are sent in torrentm, as if
+	// they had been removed
+	char label_buf[256];
+	int const label_len = mg_get_var(args, strlen(args), "label"
+		, label_buf, sizeof(label_buf));
+	std::string const label = label_len > 0 ? std::string(label_buf, label_len) : "";
 
-	int first = 1;
-	for (std::vector<torrent_status>::iterator i = torrents.begin()
-		, end(torrents.end()); i != end; ++i)
+	std::vector<history_entry_ptr> torrents;
+	std::vector<sha1_hash> removed;
+	if (label.empty())
 	{
-		shared_ptr<const torrent_info> ti = i->torrent_file.lock();
-		appendf(response, ",[\"%s\",%d,\"%s\",%" PRId64 ",%d,%" PRId64 ",%" PRId64 ",%f,%d,%d,%d,\"%s\",%d,%d,%d,%d,%d,%d,%" PRId64 "" + first
-			, to_hex(i->info_hash.to_string()).c_str()
-			, utorrent_status(*i)
-			, escape_json(i->name).c_str()
-			, ti ? ti->total_size() : 0
-			, i->progress_ppm / 1000
-			, i->all_time_download
-			, i->all_time_upload
-			, i->all_time_download == 0 ? 0 : float(i->all_time_upload) * 1000.f / i->all_time_download
-			, i->upload_payload_rate
-			, i->download_payload_rate
-			, i->download_payload_rate == 0 ? 0 : (i->total_wanted - i->total_wanted_done) / i->download_payload_rate
-			, "" // label
-			, i->num_peers - i->num_seeds
-			, i->list_peers - i->list_seeds
-			, i->num_seeds
-			, i->list_seeds
-			, i->distributed_full_copies < 0 ? 0
-				: int(i->distributed_full_copies << 16) + int(i->distributed_fraction * 65536 / 1000)
-			, i->queue_position
-			, i->total_wanted - i->total_wanted_done
-			);
-
-		if (m_version > 0)
+		m_hist->updated_fields_since(cid, torrents);
+	}
+	else if (cid == 0)
+	{
+		m_hist->query_torrents(torrent_index::queue_position, false
+			, torrent_index::all, "", label, 0, (std::numeric_limits<int>::max)()
+			, torrents);
+	}
+	else
+	{
+		m_hist->updated_fields_since(cid, torrents);
+		std::vector<history_entry_ptr>::iterator i = torrents.begin();
+		while (i != torrents.end())
 		{
-			appendf(response, ",\"%s\",\"%s\",\"%s\",\"%s\",%" PRId64 ",%" PRId64 ",\"%s\",\"%s\",%d,\"%s\"]"
-			, "" // url this torrent came from
-			, "" // feed URL this torrent belongs to
-			, escape_json(utorrent_message(*i)).c_str()
-			, to_hex(i->info_hash.to_string()).c_str()
-			, i->added_time
-			, i->completed_time
-			, "" // app
-			, escape_json(i->save_path).c_str()
-			, 0
-			, "");
+			if ((*i)->has_label(label)) { ++i; continue; }
+			if ((*i)->labels_frame > cid) removed.push_back((*i)->status.info_hash);
+			i = torrents.erase(i);
 		}
-		else
+	}
+
+	// large lists can be requested one page at a time, with the optional
+	// limit and page arguments. Pages are in info-hash order, to be stable
+	// across requests
+	std::vector<history_entry_ptr>::iterator begin = torrents.begin();
+	std::vector<history_entry_ptr>::iterator end = torrents.end();
+	int limit = 0;
+	if (mg_get_var(args, strlen(args), "limit", buf, sizeof(buf)) > 0)
+		limit = atoi(buf);
+	if (limit > 0)
+	{
+		int page = 0;
+		if (mg_get_var(args, strlen(args), "page", buf, sizeof(buf)) > 0)
+			page = (std::max)(atoi(buf), 0);
+
+		std::sort(torrents.begin(), torrents.end()
+			, [](history_entry_ptr const& lhs, history_entry_ptr const& rhs)
+			{ return lhs->status.info_hash < rhs->status.info_hash; });
+		std::int64_t const skip = (std::min)(std::int64_t(page) * limit
+			, std::int64_t(torrents.size()));
+		begin = torrents.begin() + skip;
+		end = begin + (std::min)(std::int64_t(limit), std::int64_t(torrents.end() - begin));
+	}
+
+	// this is called for every torrent in the session, format fields
+	// directly into the response rather than going through appendf()
+	bool first = true;
+	for (std::vector<history_entry_ptr>::iterator i = begin; i != end; ++i)
+	{
+		// when streaming, hand off what's been formatted so far once it
+		// fills a chunk
+		if (stream != NULL && response.size() >= chunk_size)
+			stream->write(response);
+
+		torrent_status const& st = (*i)->status;
+		torrent_json_strings const& json = *(*i)->json;
+		shared_ptr<const torrent_info> ti = st.torrent_file.lock();
+		if (!first) out.raw(',');
+		first = false;
+
+		out.raw('[');
+		out.escaped(json.info_hash, 40);
+		out.raw(',');
+		out.integer(utorrent_status(st));
+		out.raw(',');
+		out.escaped(json.name);
+		out.raw(',');
+		out.integer(ti ? ti->total_size() : 0);
+		out.raw(',');
+		out.integer(st.progress_ppm / 1000);
+		out.raw(',');
+		out.integer(st.all_time_download);
+		out.raw(',');
+		out.integer(st.all_time_upload);
+		out.raw(',');
+		out.floating(st.all_time_download == 0 ? 0
+			: float(st.all_time_upload) * 1000.f / st.all_time_download);
+		out.raw(',');
+		out.integer(st.upload_payload_rate);
+		out.raw(',');
+		out.integer(st.download_payload_rate);
+		out.raw(',');
+		out.integer(st.download_payload_rate == 0 ? 0
+			: (st.total_wanted - st.total_wanted_done) / st.download_payload_rate);
+		// label. uTorrent has one per torrent, it's sent the first
+		out.raw(',');
+		if ((*i)->labels) out.string((*i)->labels->front());
+		else out.raw("\"\"");
+		out.raw(',');
+		out.integer(st.num_peers - st.num_seeds);
+		out.raw(',');
+		out.integer(st.list_peers - st.list_seeds);
+		out.raw(',');
+		out.integer(st.num_seeds);
+		out.raw(',');
+		out.integer(st.list_seeds);
+		out.raw(',');
+		out.integer(st.distributed_full_copies < 0 ? 0
+			: int(st.distributed_full_copies << 16) + int(st.distributed_fraction * 65536 / 1000));
+		out.raw(',');
+		out.integer(st.queue_position);
+		out.raw(',');
+		out.integer(st.total_wanted - st.total_wanted_done);
+
+		if (m_version > 0)
 		{
-			response.push_back(']');
+			// url this torrent came from, feed URL this torrent belongs to
+			out.raw(",\"\",\"\",");
+			out.string(utorrent_message(st));
+			out.raw(',');
+			out.escaped(json.info_hash, 40);
+			out.raw(',');
+			out.integer(st.added_time);
+			out.raw(',');
+			out.integer(st.completed_time);
+			// app
+			out.raw(",\"\",");
+			out.escaped(*json.save_path);
+			out.raw(",0,\"\"");
 		}
-		first = 0;
+		out.raw(']');
 	}
 
-	std::vector<sha1_hash> removed;
-	m_hist->removed_since(cid, removed);
+	// the cid was checked against the removal horizon when it was parsed.
+	// If it moved since, the removals may be incomplete and the client is
+	// told to start over with a cid of 0
+	bool const complete = m_hist->removed_since(cid, removed);
 
-	appendf(response, "], \"torrentm\": [");
-	first = 1;
+	out.raw("], \"torrentm\": [");
+	first = true;
 	for (std::vector<sha1_hash>::iterator i = removed.begin()
-		, end(removed.end()); i != end; ++i)
+		, e(removed.end()); i != e; ++i)
 	{
-		appendf(response, ",\"%s\"" + first, to_hex(i->to_string()).c_str());
-		first = 0;
+		if (!first) out.raw(',');
+		first = false;
+		out.hex(*i);
 	}
-	// TODO: support labels
-	appendf(response, "], \"label\": [], \"torrentc\": \"%d\"", m_hist->frame());
+	// the labels and how many torrents have each, from the history's counts
+	out.raw("], \"label\": [");
+	torrent_counts c;
+	m_hist->get_counts(c);
+	first = true;
+	for (std::map<std::string, int>::const_iterator i = c.labels.begin()
+		, e(c.labels.end()); i != e; ++i)
+	{
+		if (!first) out.raw(',');
+		first = false;
+		out.raw('[');
+		out.string(i->first);
+		out.raw(',');
+		out.integer(i->second);
+		out.raw(']');
+	}
+	out.raw("], \"torrentc\": \"");
+	out.unsigned_integer((std::uint64_t(m_hist->epoch()) << 32)
+		| std::uint32_t(complete ? m_hist->frame() : 0));
+	out.raw('"');
 }
 
 void utorrent_webui::send_rss_list(std::vector<char>& response, char const* args, permissions_interface const* p)
 {
 	if (!p->allow_list()) return;
 
-	int cid = 0;
-	char buf[50];
-	// first, find the action
-	int ret = mg_get_var(args, strlen(args)
-		, "cid", buf, sizeof(buf));
-	if (ret > 0) cid = atoi(buf);
+	int const cid = parse_cid(args, m_hist);
 
 	appendf(response, cid > 0 ? ",\"rssfeedp\":[" : ",\"rssfeeds\":[");
 
@@ -34,6 +34,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_UT_WEBUI_HPP
 
 #include "webui.hpp"
+#include "rpc_stats.hpp"
+#include "session_set.hpp"
+#include "http_compression.hpp"
 #include "libtorrent/torrent_handle.hpp"
 #include "libtorrent/add_torrent_params.hpp"
 #include <boost/cstdint.hpp>
@@ -49,6 +52,9 @@ namespace libtorrent
 	struct permissions_interface;
 	struct auth_interface;
 	struct rss_filter_handler;
+	struct peer_history;
+	struct file_history;
+	struct bulk_jobs;
 
 	struct utorrent_webui : http_handler
 	{
@@ -61,6 +67,31 @@ namespace libtorrent
 		void set_params_model(add_torrent_params const& p)
 		{ m_params_model = p; }
 
+		// passes the commands that concern the session as a whole, like
+		// adding and removing torrents and changing settings, on to a set of
+		// sessions rather than just the one this was constructed with. NULL
+		// goes back to that one
+		void set_sessions(session_set* s)
+		{ m_sessions = s ? s : &m_own_sessions; }
+
+		// getpeers is answered from the peer lists kept by peers, rather
+		// than by asking the session for every request
+		void set_peer_history(peer_history* peers)
+		{ m_peers = peers; }
+
+		// getfiles is answered from the file lists kept by files
+		void set_file_history(file_history* files)
+		{ m_files = files; }
+
+		// how responses are compressed for clients that accept it
+		void set_compression(http_compression const& c)
+		{ m_compression = c; }
+
+		// remove, removedata and recheck are queued as jobs to carry out in
+		// the background. Without it, they're carried out before responding
+		void set_bulk_jobs(bulk_jobs* jobs)
+		{ m_bulk = jobs; }
+
 		virtual bool handle_http(mg_connection* conn
 			, mg_request_info const* request_info);
 
@@ -82,14 +113,21 @@ namespace libtorrent
 		void set_settings(std::vector<char>&, char const* args, permissions_interface const* p);
 
 		void get_properties(std::vector<char>&, char const* args, permissions_interface const* p);
+		void set_properties(std::vector<char>&, char const* args, permissions_interface const* p);
 		void add_url(std::vector<char>&, char const* args, permissions_interface const* p);
 
 		void send_file_list(std::vector<char>&, char const* args, permissions_interface const* p);
-		void send_torrent_list(std::vector<char>&, char const* args, permissions_interface const* p);
+		// if stream is set, the response is handed to it in pieces as it's
+		// being formatted
+		void send_torrent_list(std::vector<char>&, char const* args, permissions_interface const* p
+			, http_response_writer* stream);
 		void send_peer_list(std::vector<char>& response, char const* args, permissions_interface const* p);
 
 		void get_version(std::vector<char>& response, char const* args, permissions_interface const* p);
 
+		void get_bulk_jobs(std::vector<char>& response, char const* args, permissions_interface const* p);
+		void cancel_bulk_job(std::vector<char>& response, char const* args, permissions_interface const* p);
+
 		void send_rss_list(std::vector<char>&, char const* args, permissions_interface const* p);
 		void rss_update(std::vector<char>& response, char const* args, permissions_interface const* p);
 		void rss_remove(std::vector<char>& response, char const* args, permissions_interface const* p);
@@ -100,8 +138,15 @@ namespace libtorrent
 
 		std::vector<torrent_status> parse_torrents(char const* args) const;
 
+		// queues op on the torrents in args, as a bulk job
+		void submit_bulk_job(char const* args, int op);
+
 		time_t m_start_time;
 		session& m_ses;
+
+		// the session as a set of one, unless set_sessions() has been called
+		session_set m_own_sessions;
+		session_set* m_sessions;
 		add_torrent_params m_params_model;
 		std::string m_webui_cookie;
 
@@ -123,9 +168,23 @@ namespace libtorrent
 		// since last time
 		torrent_history* m_hist;
 
+		// the cached peer lists, or NULL to read them on every request
+		peer_history* m_peers;
+
+		// the cached file lists, or NULL to read them on every request
+		file_history* m_files;
+
 		int m_version;
 		std::string m_token;
 		webui_base* m_listener;
+
+		http_compression m_compression;
+
+		// the queue of operations on many torrents, or NULL
+		bulk_jobs* m_bulk;
+
+		// indexed by the actions, followed by add-file and list
+		rpc_stats m_rpc_stats;
 	};
 }
 
@@ -31,32 +31,337 @@ POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include "websocket_handler.hpp"
+#include "rpc_stats.hpp"
 #include "libtorrent/io.hpp"
 #include "local_mongoose.h"
+#include "libtorrent/assert.hpp"
+
+#include <algorithm>
+#include <utility>
+#include <string.h>
+#include <stdlib.h>
+#include <zlib.h>
 
 namespace libtorrent
 {
-	// TODO: this should be a writev-like function
-	bool websocket_handler::send_packet(mg_connection* conn, int type, char const* buffer, int len)
+	void deflate_stream_deleter::operator()(z_stream_s* s) const
 	{
-		std::unique_lock<std::mutex> l(m_mutex);
+		deflateEnd(s);
+		delete s;
+	}
 
-		namespace io = libtorrent::detail;
+	void inflate_stream_deleter::operator()(z_stream_s* s) const
+	{
+		inflateEnd(s);
+		delete s;
+	}
 
-		auto i = m_open_sockets.find(conn);
-		if (i == m_open_sockets.end())
+	websocket_handler::websocket_handler()
+		: m_stop_writers(false)
+		, m_queue_stats(NULL)
+	{}
+
+	websocket_handler::~websocket_handler()
+	{
+		// normally every connection has ended before this. If not, the
+		// writers still have to be done with them. The connections are left
+		// to mongoose
+		std::map<mg_connection*, socket_state> sockets;
+		{
+			std::unique_lock<std::mutex> l(m_mutex);
+			sockets.swap(m_open_sockets);
+		}
+		for (std::map<mg_connection*, socket_state>::iterator i = sockets.begin()
+			, end(sockets.end()); i != end; ++i)
+		{
+			detach_sender(*i->second.send, i->first);
+		}
+
+		std::unique_lock<std::mutex> l(m_writers_mutex);
+		m_stop_writers = true;
+		m_writers_cond.notify_all();
+		l.unlock();
+		for (std::vector<std::thread>::iterator i = m_writers.begin()
+			, end(m_writers.end()); i != end; ++i)
+		{
+			i->join();
+		}
+	}
+
+	bool websocket_handler::send_packet(mg_connection* conn, int type, char const* buffer, int len)
+	{
+		send_buffer buf(buffer, len);
+		return send_packet(conn, type, &buf, 1);
+	}
+
+	bool websocket_handler::send_packet(mg_connection* conn, int type
+		, send_buffer const* bufs, int num_bufs, int key)
+	{
+		std::shared_ptr<sender> s = socket_sender(conn);
+		if (!s)
 		{
 			fprintf(stderr, "ERROR: send_packet, socket not open\n");
 			return false;
 		}
-		std::mutex& m = *i->second;
-		std::unique_lock<std::mutex> l2(m);
+
+		queued_frame f;
+		f.opcode = type;
+		f.key = key;
+		int len = 0;
+		for (int i = 0; i < num_bufs; ++i) len += bufs[i].len;
+		f.payload.reserve(len);
+		for (int i = 0; i < num_bufs; ++i)
+			f.payload.insert(f.payload.end(), bufs[i].buf, bufs[i].buf + bufs[i].len);
+
+		// only data frames may be compressed
+		f.compressed = s->deflate && (type == 0x1 || type == 0x2)
+			&& len >= min_deflate_size;
+
+		std::unique_lock<std::mutex> l(s->mutex);
+		return queue_frame(*s, f);
+	}
+
+	bool websocket_handler::is_queued(mg_connection* conn, int key)
+	{
+		std::shared_ptr<sender> s = socket_sender(conn);
+		if (!s) return false;
+
+		std::unique_lock<std::mutex> l(s->queue_mutex);
+		for (std::deque<queued_frame>::iterator i = s->queue.begin()
+			, end(s->queue.end()); i != end; ++i)
+		{
+			if (i->key == key) return true;
+		}
+		return false;
+	}
+
+	bool websocket_handler::queue_frame(sender& s, queued_frame& f, bool stream)
+	{
+		rpc_stats::add_bytes(f.payload.size());
+
+		std::unique_lock<std::mutex> l(s.queue_mutex);
+		if (s.closed) return false;
+
+		// a message waiting under the same key is superseded by this one.
+		// It takes its place in the queue
+		if (f.key != 0)
+		{
+			for (std::deque<queued_frame>::iterator i = s.queue.begin()
+				, end(s.queue.end()); i != end; ++i)
+			{
+				if (i->key != f.key) continue;
+				std::int64_t const diff = std::int64_t(f.payload.size())
+					- std::int64_t(i->payload.size());
+				s.queued_bytes += diff;
+				if (m_queue_stats)
+				{
+					m_queue_stats->bytes += diff;
+					++m_queue_stats->coalesced;
+				}
+				*i = std::move(f);
+				return true;
+			}
+		}
+
+		// a streamed message is produced as fast as the client takes it.
+		// The writer fails the write if the client stops reading, which
+		// closes the sender and wakes us up
+		if (stream)
+		{
+			while (!s.closed && !s.queue.empty()
+				&& s.queued_bytes + std::int64_t(f.payload.size()) > max_stream_queue)
+			{
+				s.cond.wait(l);
+			}
+			if (s.closed) return false;
+		}
+
+		// the client isn't keeping up. Rather than buffering an unbounded
+		// amount of data for it, disconnect it. It can reconnect and start
+		// over from a full update
+		if (!s.queue.empty()
+			&& s.queued_bytes + std::int64_t(f.payload.size()) > max_send_queue)
+		{
+			fprintf(stderr, "ERROR: websocket client too far behind (%d bytes "
+				"queued), disconnecting\n", int(s.queued_bytes));
+			if (m_queue_stats) ++m_queue_stats->evicted;
+			close_sender(s);
+			// unblock the writer, and the thread reading from the socket.
+			// The connection is still alive, since it's not closed
+			mg_shutdown_connection(s.conn);
+			return false;
+		}
+
+		s.queued_bytes += f.payload.size();
+		if (m_queue_stats)
+		{
+			m_queue_stats->bytes += f.payload.size();
+			++m_queue_stats->messages;
+		}
+		s.queue.push_back(std::move(f));
+		if (!s.scheduled) schedule(s);
+		return true;
+	}
+
+	void websocket_handler::close_sender(sender& s)
+	{
+		if (s.closed) return;
+		s.closed = true;
+		if (m_queue_stats)
+		{
+			m_queue_stats->bytes -= s.queued_bytes;
+			m_queue_stats->messages -= s.queue.size();
+		}
+		s.queued_bytes = 0;
+		s.queue.clear();
+		s.cond.notify_all();
+	}
+
+	void websocket_handler::detach_sender(sender& s, mg_connection* conn)
+	{
+		std::unique_lock<std::mutex> l(s.queue_mutex);
+		close_sender(s);
+		s.conn = NULL;
 		l.unlock();
 
+		// unblocks a writer stuck on a client that stopped reading
+		mg_shutdown_connection(conn);
+
+		l.lock();
+		while (s.writing) s.cond.wait(l);
+	}
+
+	void websocket_handler::schedule(sender& s)
+	{
+		s.scheduled = true;
+		std::unique_lock<std::mutex> l(m_writers_mutex);
+		if (m_writers.empty())
+		{
+			for (int i = 0; i < num_writers; ++i)
+				m_writers.push_back(std::thread(&websocket_handler::writer_loop, this));
+		}
+		m_ready.push_back(s.shared_from_this());
+		m_writers_cond.notify_one();
+	}
+
+	void websocket_handler::writer_loop()
+	{
+		for (;;)
+		{
+			std::unique_lock<std::mutex> wl(m_writers_mutex);
+			while (m_ready.empty() && !m_stop_writers) m_writers_cond.wait(wl);
+			if (m_stop_writers) return;
+			std::shared_ptr<sender> s = m_ready.front();
+			m_ready.pop_front();
+			wl.unlock();
+
+			std::unique_lock<std::mutex> l(s->queue_mutex);
+			if (s->closed || s->queue.empty())
+			{
+				s->scheduled = false;
+				continue;
+			}
+
+			queued_frame f = std::move(s->queue.front());
+			s->queue.pop_front();
+			s->queued_bytes -= f.payload.size();
+			if (m_queue_stats)
+			{
+				m_queue_stats->bytes -= f.payload.size();
+				--m_queue_stats->messages;
+			}
+			mg_connection* conn = s->conn;
+			s->writing = true;
+			l.unlock();
+
+			send_buffer buf(f.payload.empty() ? NULL : &f.payload[0]
+				, f.payload.size());
+			bool ok = true;
+			if (f.compressed)
+			{
+				ok = deflate_buffers(*s, &buf, 1, f.fin);
+				if (ok) buf = send_buffer(&s->deflate_buffer[0], s->deflate_buffer.size());
+			}
+			// the RSV1 bit is only set on the first frame of a message
+			if (ok) ok = write_frame(conn, f.opcode, f.fin
+				, f.compressed && f.opcode != 0, &buf, 1);
+
+			l.lock();
+			s->writing = false;
+			// wakes up streams waiting for room, and detach_sender()
+			s->cond.notify_all();
+
+			if (!ok && !s->closed)
+			{
+				// the connection is broken. Make sure the thread reading from
+				// it notices too. The connection stays alive until
+				// detach_sender() has seen this write finish
+				close_sender(*s);
+				mg_shutdown_connection(conn);
+			}
+
+			// the other connections get their turns before this one's next
+			// frame
+			if (s->closed || s->queue.empty())
+			{
+				s->scheduled = false;
+				continue;
+			}
+			wl.lock();
+			m_ready.push_back(s);
+			m_writers_cond.notify_one();
+		}
+	}
+
+	namespace
+	{
+		// the innermost bound_connection of the thread
+		thread_local websocket_handler::bound_connection* bound = NULL;
+	}
+
+	websocket_handler::connection_ref websocket_handler::connection(mg_connection* conn)
+	{
+		return socket_sender(conn);
+	}
+
+	websocket_handler::bound_connection::bound_connection(mg_connection* conn
+		, connection_ref const& ref)
+		: m_conn(conn)
+		, m_sender(ref.lock())
+		, m_prev(bound)
+	{
+		bound = this;
+	}
+
+	websocket_handler::bound_connection::~bound_connection()
+	{
+		bound = m_prev;
+	}
+
+	std::shared_ptr<websocket_handler::sender> websocket_handler::socket_sender(
+		mg_connection* conn)
+	{
+		if (bound && bound->m_conn == conn)
+			return std::static_pointer_cast<sender>(bound->m_sender);
+
+		std::unique_lock<std::mutex> l(m_mutex);
+		auto i = m_open_sockets.find(conn);
+		if (i == m_open_sockets.end()) return std::shared_ptr<sender>();
+		return i->second.send;
+	}
+
+	bool websocket_handler::write_frame(mg_connection* conn, int opcode, bool fin
+		, bool compressed, send_buffer const* bufs, int num_bufs)
+	{
+		namespace io = libtorrent::detail;
+
+		std::int64_t len = 0;
+		for (int i = 0; i < num_bufs; ++i) len += bufs[i].len;
+
 		// header
 		int header_len = 2;
 		std::uint8_t h[20];
-		h[0] = 0x80 | (type & 0xf);
+		h[0] = (fin ? 0x80 : 0) | (compressed ? 0x40 : 0) | (opcode & 0xf);
 		if (len < 126)
 			h[1] = len;
 		else if (len < 65536)
@@ -74,42 +379,361 @@ namespace libtorrent
 			header_len = 10;
 		}
 
-		// TODO: it would be nice to have an mg_writev()
-		int ret = mg_write(conn, h, header_len);
-		if (ret < header_len)
+		mg_iovec iov[8];
+		TORRENT_ASSERT(num_bufs < 8);
+		if (num_bufs >= 8) return false;
+
+		iov[0].buf = h;
+		iov[0].len = header_len;
+		int iovcnt = 1;
+		for (int i = 0; i < num_bufs; ++i)
+		{
+			if (bufs[i].len == 0) continue;
+			iov[iovcnt].buf = bufs[i].buf;
+			iov[iovcnt].len = bufs[i].len;
+			++iovcnt;
+		}
+
+		int ret = mg_writev(conn, iov, iovcnt);
+		if (ret < header_len + len)
 		{
-			fprintf(stderr, "ERROR: send_packet, short write (%d < %d)\n", ret, header_len);
+			fprintf(stderr, "ERROR: send_packet, short write (%d < %d)\n"
+				, ret, int(header_len + len));
 			return false;
 		}
+		return true;
+	}
+
+	// runs the compressor over its current input, appending the output to
+	// out. For Z_SYNC_FLUSH it also makes sure all pending output is flushed
+	static bool run_deflate(z_stream& zs, std::vector<char>& out, int flush)
+	{
+		for (;;)
+		{
+			size_t const used = out.size();
+			size_t const chunk = (std::max)(size_t(4096), size_t(zs.avail_in / 2));
+			out.resize(used + chunk);
+			zs.next_out = reinterpret_cast<Bytef*>(&out[used]);
+			zs.avail_out = chunk;
+			int const ret = deflate(&zs, flush);
+			out.resize(used + chunk - zs.avail_out);
+
+			// Z_BUF_ERROR just means no progress was possible
+			if (ret != Z_OK && ret != Z_BUF_ERROR) return false;
+
+			if (zs.avail_in > 0) continue;
+			if (flush == Z_NO_FLUSH || zs.avail_out != 0) return true;
+		}
+	}
+
+	bool websocket_handler::deflate_buffers(sender& s, send_buffer const* bufs
+		, int num_bufs, bool fin)
+	{
+		z_stream& zs = *s.deflate;
+		std::vector<char>& out = s.deflate_buffer;
+		out.clear();
+
+		for (int i = 0; i < num_bufs; ++i)
+		{
+			if (bufs[i].len == 0) continue;
+			zs.next_in = (Bytef*)bufs[i].buf;
+			zs.avail_in = bufs[i].len;
+			if (!run_deflate(zs, out, Z_NO_FLUSH)) return false;
+		}
+
+		// every fragment ends on a byte boundary. The empty stored block the
+		// flush ends with is stripped from the end of the message, as
+		// required by permessage-deflate
+		if (!run_deflate(zs, out, Z_SYNC_FLUSH)) return false;
+		if (fin)
+		{
+			TORRENT_ASSERT(out.size() >= 4);
+			TORRENT_ASSERT(memcmp(&out[out.size() - 4], "\0\0\xff\xff", 4) == 0);
+			out.resize(out.size() - 4);
+			if (s.deflate_no_context_takeover) deflateReset(&zs);
+		}
+
+		// an empty message still needs a byte to be a valid deflate stream
+		if (out.empty()) out.push_back(0);
+		return true;
+	}
+
+	bool websocket_handler::inflate_message(socket_state& s, char const* data
+		, size_t length, std::vector<char>& out)
+	{
+		z_stream& zs = *s.inflate;
+		out.clear();
+
+		// the sender strips the tail of the final flush. add it back
+		char const tail[] = { 0, 0, char(0xff), char(0xff) };
+		send_buffer const input[] = {
+			send_buffer(data, length),
+			send_buffer(tail, sizeof(tail))
+		};
 
-		if (len > 0)
+		for (int i = 0; i < 2; ++i)
 		{
-			ret = mg_write(conn, buffer, len);
-			if (ret < len)
+			zs.next_in = (Bytef*)input[i].buf;
+			zs.avail_in = input[i].len;
+			do
 			{
-				fprintf(stderr, "ERROR: send_packet, short write (%d < %d)\n", ret, len);
-				return false;
-			}
+				size_t const used = out.size();
+				// don't let a small message inflate to an unbounded size
+				if (used >= max_message_size)
+				{
+					fprintf(stderr, "ERROR: compressed websocket message too large\n");
+					return false;
+				}
+				size_t const chunk = (std::min)(size_t(16 * 1024)
+					, size_t(max_message_size - used));
+				out.resize(used + chunk);
+				zs.next_out = reinterpret_cast<Bytef*>(&out[used]);
+				zs.avail_out = chunk;
+				int const ret = inflate(&zs, Z_SYNC_FLUSH);
+				out.resize(used + chunk - zs.avail_out);
+				if (ret == Z_STREAM_END)
+				{
+					// the client ended the deflate stream. The next message
+					// starts a new one
+					inflateReset(&zs);
+					return true;
+				}
+				if (ret != Z_OK && ret != Z_BUF_ERROR)
+				{
+					fprintf(stderr, "ERROR: failed to inflate websocket message: %d\n", ret);
+					return false;
+				}
+			} while (zs.avail_in > 0 || zs.avail_out == 0);
 		}
 		return true;
 	}
 
+	std::string websocket_handler::negotiate_deflate(char const* offer, socket_state& s)
+	{
+		// the header is a comma separated list of extensions, in order of
+		// preference. Each has a semicolon separated list of parameters
+		std::string offers = offer;
+		std::string::size_type start = 0;
+		while (start < offers.size())
+		{
+			std::string::size_type end = offers.find(',', start);
+			if (end == std::string::npos) end = offers.size();
+			std::string ext = offers.substr(start, end - start);
+			start = end + 1;
+
+			bool accept = true;
+			bool first = true;
+			int window_bits = 15;
+			bool no_context_takeover = false;
+			std::string response = "permessage-deflate";
+
+			std::string::size_type pstart = 0;
+			while (pstart <= ext.size() && accept)
+			{
+				std::string::size_type pend = ext.find(';', pstart);
+				if (pend == std::string::npos) pend = ext.size();
+				std::string param = ext.substr(pstart, pend - pstart);
+				pstart = pend + 1;
+
+				// trim whitespace
+				param.erase(0, param.find_first_not_of(" \t"));
+				param.erase(param.find_last_not_of(" \t") + 1);
+
+				std::string value;
+				std::string::size_type eq = param.find('=');
+				if (eq != std::string::npos)
+				{
+					value = param.substr(eq + 1);
+					param.resize(param.find_last_not_of(" \t", eq - 1) + 1);
+					value.erase(0, value.find_first_not_of(" \t\""));
+					value.erase(value.find_last_not_of(" \t\"") + 1);
+				}
+
+				if (first)
+				{
+					first = false;
+					if (param != "permessage-deflate") accept = false;
+				}
+				else if (param == "server_no_context_takeover")
+				{
+					no_context_takeover = true;
+					response += "; server_no_context_takeover";
+				}
+				else if (param == "server_max_window_bits")
+				{
+					window_bits = atoi(value.c_str());
+					// zlib doesn't support a window of 256 bytes
+					if (window_bits < 9 || window_bits > 15) accept = false;
+					response += "; server_max_window_bits=" + value;
+				}
+				else if (param == "client_no_context_takeover"
+					|| param == "client_max_window_bits")
+				{
+					// our decompressor always uses the largest window. It can
+					// decode anything the client sends
+				}
+				else
+				{
+					// we don't know what this means
+					accept = false;
+				}
+			}
+			if (!accept) continue;
+
+			std::unique_ptr<z_stream_s, deflate_stream_deleter> def(new z_stream);
+			memset(def.get(), 0, sizeof(z_stream));
+			if (deflateInit2(def.get(), Z_DEFAULT_COMPRESSION, Z_DEFLATED
+				, -window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			{
+				// deflateEnd() must not be called on a failed stream
+				delete def.release();
+				return std::string();
+			}
+
+			std::unique_ptr<z_stream_s, inflate_stream_deleter> inf(new z_stream);
+			memset(inf.get(), 0, sizeof(z_stream));
+			if (inflateInit2(inf.get(), -15) != Z_OK)
+			{
+				delete inf.release();
+				return std::string();
+			}
+
+			s.send->deflate = std::move(def);
+			s.send->deflate_no_context_takeover = no_context_takeover;
+			s.inflate = std::move(inf);
+			return response;
+		}
+		return std::string();
+	}
+
 	bool websocket_handler::handle_websocket_connect(mg_connection* conn
 		, mg_request_info const* request_info)
 	{
+		socket_state s;
+		s.send = std::make_shared<sender>();
+		s.send->conn = conn;
+
+		char const* offer = mg_get_header(conn, "Sec-WebSocket-Extensions");
+		if (offer != NULL)
+		{
+			std::string const response = negotiate_deflate(offer, s);
+			if (!response.empty())
+				mg_set_websocket_extensions(conn, response.c_str());
+		}
+
 		std::unique_lock<std::mutex> l(m_mutex);
-		m_open_sockets.insert(std::make_pair(conn, std::unique_ptr<std::mutex>(new std::mutex())));
+		m_open_sockets[conn] = std::move(s);
 		return true;
 	}
 
-	// TODO: it would be nice to have a layer that merges fragments.
-	// there need to be a number of fragments per frame limit and
-	// a total size limit per frame
-	// This layer should also handle ping messages
-//	bool libtorrent_webui::handle_websocket_data(mg_connection* conn
-//		, int bits, char* data, size_t length)
-//	{
-//	}
+	bool websocket_handler::handle_websocket_data(mg_connection* conn
+		, int bits, char* data, size_t length)
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+		auto i = m_open_sockets.find(conn);
+		if (i == m_open_sockets.end()) return false;
+		// the entry is only erased by handle_end_request(), which is called
+		// by the same thread as this, so it's safe to use without the lock
+		socket_state& s = i->second;
+		l.unlock();
+
+		bool const fin = (bits & 0x80) != 0;
+		bool const rsv1 = (bits & 0x40) != 0;
+		int const opcode = bits & 0xf;
+
+		// control frames
+		if (opcode & 0x8)
+		{
+			if (!fin || rsv1 || length > 125)
+			{
+				fprintf(stderr, "ERROR: invalid websocket control frame\n");
+				return false;
+			}
+
+			switch (opcode)
+			{
+				// ping. reply with a pong echoing the payload
+				case 0x9: return send_packet(conn, 0xa, data, length);
+				// pong
+				case 0xa: return true;
+				// close (and anything else)
+				default: return false;
+			}
+		}
+
+		if (opcode != 0 && s.opcode != 0)
+		{
+			fprintf(stderr, "ERROR: new websocket message before previous one completed\n");
+			return false;
+		}
+		if (opcode == 0 && s.opcode == 0)
+		{
+			fprintf(stderr, "ERROR: websocket continuation frame without a message\n");
+			return false;
+		}
+		// RSV1 marks compressed messages, and is only set on the first frame
+		if (rsv1 && (opcode == 0 || !s.inflate))
+		{
+			fprintf(stderr, "ERROR: unexpected compressed websocket frame\n");
+			return false;
+		}
+
+		// the common case. Don't copy the payload of unfragmented messages
+		if (fin && opcode != 0)
+		{
+			if (length > max_message_size)
+			{
+				fprintf(stderr, "ERROR: websocket message too large (%d bytes)\n"
+					, int(length));
+				return false;
+			}
+			if (!rsv1) return handle_websocket_message(conn, opcode, data, length);
+
+			std::vector<char> message;
+			if (!inflate_message(s, data, length, message)) return false;
+			return handle_websocket_message(conn, opcode
+				, message.empty() ? NULL : &message[0], message.size());
+		}
+
+		if (opcode != 0)
+		{
+			s.opcode = opcode;
+			s.compressed = rsv1;
+		}
+		++s.num_fragments;
+
+		if (s.num_fragments > max_fragments
+			|| s.message.size() + length > max_message_size)
+		{
+			fprintf(stderr, "ERROR: fragmented websocket message too large "
+				"(%d fragments, %d bytes)\n", s.num_fragments
+				, int(s.message.size() + length));
+			return false;
+		}
+
+		s.message.insert(s.message.end(), data, data + length);
+		if (!fin) return true;
+
+		std::vector<char> message;
+		if (s.compressed)
+		{
+			if (!inflate_message(s, s.message.empty() ? NULL : &s.message[0]
+				, s.message.size(), message))
+				return false;
+			s.message.clear();
+		}
+		else
+		{
+			message.swap(s.message);
+		}
+		int const type = s.opcode;
+		s.opcode = 0;
+		s.compressed = false;
+		s.num_fragments = 0;
+
+		return handle_websocket_message(conn, type
+			, message.empty() ? NULL : &message[0], message.size());
+	}
 
 	void websocket_handler::handle_end_request(mg_connection* conn)
 	{
@@ -117,7 +741,76 @@ namespace libtorrent
 		auto i = m_open_sockets.find(conn);
 		if (i == m_open_sockets.end()) return;
 
+		std::shared_ptr<sender> s = i->second.send;
 		m_open_sockets.erase(i);
+		l.unlock();
+
+		// messages still queued are dropped. Once closed, nothing uses the
+		// connection but a writer that's in the middle of a frame
+		detach_sender(*s, conn);
+	}
+
+	websocket_writer::websocket_writer(websocket_handler& h, mg_connection* conn
+		, int type)
+		: m_handler(h)
+		, m_sender(h.socket_sender(conn))
+		, m_opcode(type)
+		, m_ok(m_sender.get() != NULL)
+		, m_compress(false)
+		, m_finished(false)
+	{
+		if (!m_sender)
+		{
+			fprintf(stderr, "ERROR: websocket_writer, socket not open\n");
+			return;
+		}
+		m_lock = std::unique_lock<std::mutex>(m_sender->mutex);
+		m_compress = bool(m_sender->deflate);
+		m_buffer.reserve(fragment_size);
 	}
-}
 
+	websocket_writer::~websocket_writer()
+	{
+		finish();
+	}
+
+	bool websocket_writer::write(char const* buf, int len)
+	{
+		TORRENT_ASSERT(!m_finished);
+		while (len > 0 && m_ok)
+		{
+			int const n = (std::min)(len, int(fragment_size - m_buffer.size()));
+			m_buffer.insert(m_buffer.end(), buf, buf + n);
+			buf += n;
+			len -= n;
+			if (m_buffer.size() == fragment_size) flush(false);
+		}
+		return m_ok;
+	}
+
+	bool websocket_writer::finish()
+	{
+		if (m_finished) return m_ok;
+		m_finished = true;
+		flush(true);
+		if (m_lock.owns_lock()) m_lock.unlock();
+		return m_ok;
+	}
+
+	bool websocket_writer::flush(bool fin)
+	{
+		if (!m_ok) return false;
+		websocket_handler::queued_frame f;
+		// the first fragment carries the opcode
+		f.opcode = m_opcode;
+		f.fin = fin;
+		f.compressed = m_compress;
+		f.payload.swap(m_buffer);
+		m_ok = m_handler.queue_frame(*m_sender, f, true);
+		m_buffer.clear();
+		m_buffer.reserve(fragment_size);
+		// subsequent fragments are continuation frames
+		m_opcode = 0;
+		return m_ok;
+	}
+}
@@ -34,28 +34,326 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_WEBSOCKET_HPP
 
 #include "webui.hpp"
+#include "rpc_stats.hpp"
 #include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
 #include <map>
 #include <memory>
 #include <cstdint>
+#include <vector>
+#include <string>
+
+struct z_stream_s;
 
 namespace libtorrent
 {
+	struct websocket_writer;
+
+	// free zlib streams. These are defined in websocket_handler.cpp, to not
+	// require zlib.h here
+	struct deflate_stream_deleter { void operator()(z_stream_s* s) const; };
+	struct inflate_stream_deleter { void operator()(z_stream_s* s) const; };
+
+	// a buffer to send as part of a websocket message. See send_packet()
+	struct send_buffer
+	{
+		send_buffer(char const* b, int l) : buf(b), len(l) {}
+		char const* buf;
+		int len;
+	};
+
+	// websocket_handler negotiates the permessage-deflate extension (RFC
+	// 7692) with clients that offer it. Messages of at least
+	// min_deflate_size bytes are then sent compressed, using a sliding
+	// window shared by all messages on the connection.
+	//
+	// Messages aren't written by the thread sending them. They're put on a
+	// queue of the connection, which a pool of writer threads shared by all
+	// connections drains (compressing them on the way). A connection is
+	// only written by one of them at a time, and gets a turn per message.
+	// Messages queued under the same key replace each other while they
+	// wait, and a client more than max_send_queue bytes behind is
+	// disconnected. Messages streamed by websocket_writer aren't dropped,
+	// the writer waits for the queue to drain instead
 	struct websocket_handler : http_handler
 	{
+		websocket_handler();
+
+		// closes the queues of any connections still open
+		~websocket_handler();
+
 		bool send_packet(mg_connection* conn, int type, char const* buffer, int len);
+
+		// queues the concatenation of the buffers as a single websocket
+		// message. If key is not 0, and a message with the same key is still
+		// waiting in the connection's queue, this message takes its place.
+		// Returns false if the connection is closed (or evicted)
+		bool send_packet(mg_connection* conn, int type
+			, send_buffer const* bufs, int num_bufs, int key = 0);
+
+		// returns true if a message queued with key is waiting to be sent
+		// to conn. A message sent under the same key now would replace it
+		bool is_queued(mg_connection* conn, int key);
+
+		// refers to a connection beyond the call it was taken in. Unlike
+		// the mg_connection pointer, which mongoose reuses for new
+		// connections, it never refers to another connection. It's empty
+		// once the connection is gone
+		typedef std::weak_ptr<void> connection_ref;
+		connection_ref connection(mg_connection* conn);
+
+		// while in scope, the messages this thread sends to conn go to the
+		// connection ref was taken from, or are dropped if it's gone, rather
+		// than to whichever connection has the address now. For responses
+		// written after the call that asked for them returned
+		struct bound_connection
+		{
+			bound_connection(mg_connection* conn, connection_ref const& ref);
+			~bound_connection();
+
+			// false if the connection is gone
+			bool valid() const { return bool(m_sender); }
+
+		private:
+			friend struct websocket_handler;
+			mg_connection* m_conn;
+			std::shared_ptr<void> m_sender;
+			bound_connection* m_prev;
+		};
+
 		virtual bool handle_websocket_connect(mg_connection* conn,
 			mg_request_info const* request_info);
 		virtual void handle_end_request(mg_connection* conn);
 
+		// reassembles fragmented messages and answers pings. Complete text
+		// and binary messages are passed on to handle_websocket_message()
+		virtual bool handle_websocket_data(mg_connection* conn
+			, int bits, char* data, size_t length);
+
+		// called once for every complete message. type is the opcode of the
+		// message, 0x1 (text) or 0x2 (binary). Return false to close the
+		// connection
+		virtual bool handle_websocket_message(mg_connection* conn
+			, int type, char* data, size_t length) = 0;
+
+		// the limits on messages received from clients. Messages exceeding
+		// them close the connection
+		enum
+		{
+			max_message_size = 1024 * 1024,
+			max_fragments = 256
+		};
+
+		// messages smaller than this are not worth compressing
+		enum { min_deflate_size = 256 };
+
+		// the number of bytes a connection may have waiting to be sent. A
+		// message is always queued if the queue is empty, however large
+		enum { max_send_queue = 16 * 1024 * 1024 };
+
+		// a websocket_writer waits for the connection's queue to drain below
+		// this many bytes before it queues another fragment
+		enum { max_stream_queue = 1024 * 1024 };
+
+		// the threads writing the queues to the sockets. A write to a client
+		// that stopped reading ties one up until the socket times out
+		enum { num_writers = 8 };
+
+	protected:
+
+		// the depth of the send queues, and the messages coalesced and
+		// connections evicted, are added to stats. It must outlive the
+		// connections
+		void set_queue_stats(rpc_stats::queue_stats* stats) { m_queue_stats = stats; }
+
 	private:
 
+		friend struct websocket_writer;
+
+		// a websocket frame waiting to be sent. compressed is set for all
+		// frames of a compressed message, but the opcode (and RSV1 bit) is
+		// only sent on the first
+		struct queued_frame
+		{
+			queued_frame() : opcode(0), fin(true), compressed(false), key(0) {}
+			int opcode;
+			bool fin;
+			bool compressed;
+			int key;
+			std::vector<char> payload;
+		};
+
+		// the state for sending messages on a socket. It's shared with
+		// in-progress sends and the writer pool, which may outlive the
+		// socket's entry in m_open_sockets
+		struct sender : std::enable_shared_from_this<sender>
+		{
+			sender() : deflate_no_context_takeover(false), conn(NULL)
+				, queued_bytes(0), closed(false), scheduled(false), writing(false) {}
+
+			// serializes the senders, to keep the fragments of a message
+			// together in the queue. Taken before queue_mutex
+			std::mutex mutex;
+
+			// the compressor. Only set if permessage-deflate was negotiated.
+			// Only used by the writer that has the connection's turn
+			std::unique_ptr<z_stream_s, deflate_stream_deleter> deflate;
+
+			// when set, the compressor is reset after every message
+			bool deflate_no_context_takeover;
+
+			// compressed messages are built here, by the writer
+			std::vector<char> deflate_buffer;
+
+			// the rest is protected by queue_mutex. cond is signalled
+			// whenever a frame is queued or written, and when the sender is
+			// closed
+			std::mutex queue_mutex;
+			std::condition_variable cond;
+
+			// the connection, while it's alive
+			mg_connection* conn;
+
+			std::deque<queued_frame> queue;
+			std::int64_t queued_bytes;
+
+			// set once the connection ends, is evicted or a write fails.
+			// Nothing more is queued or written
+			bool closed;
+
+			// set while the sender is on the writers' ready list, or one of
+			// them is writing to it. It's never on the list twice
+			bool scheduled;
+
+			// set while a writer is writing a frame to conn.
+			// handle_end_request() waits for it to be cleared
+			bool writing;
+		};
+
+		struct socket_state
+		{
+			socket_state() : opcode(0), compressed(false), num_fragments(0) {}
+
+			std::shared_ptr<sender> send;
+
+			// the reassembly state of a fragmented message. These are only
+			// touched by the thread serving the connection. opcode is 0 when
+			// no message is in progress
+			int opcode;
+			bool compressed;
+			int num_fragments;
+			std::vector<char> message;
+
+			// the decompressor, if permessage-deflate was negotiated
+			std::unique_ptr<z_stream_s, inflate_stream_deleter> inflate;
+		};
+
+		// returns the send state of the specified socket, or an empty
+		// pointer if it's not open
+		std::shared_ptr<sender> socket_sender(mg_connection* conn);
+
+		// adds f to the queue of s, or replaces the queued frame with the
+		// same key. If that puts the connection more than max_send_queue
+		// bytes behind, it's closed instead. A streamed fragment waits for
+		// the queue to drain below max_stream_queue rather than closing it.
+		// s.mutex must be held
+		bool queue_frame(sender& s, queued_frame& f, bool stream = false);
+
+		// marks s closed and drops its queue. s.queue_mutex must be held
+		void close_sender(sender& s);
+
+		// closes s and waits for the writer using its connection (if any)
+		// to be done with it. The connection is shut down, to not wait for a
+		// client that stopped reading
+		void detach_sender(sender& s, mg_connection* conn);
+
+		// puts s on the writers' ready list, starting the writers the first
+		// time. s.queue_mutex must be held
+		void schedule(sender& s);
+
+		// a thread of the writer pool. Writes one queued frame of the
+		// connection at the front of the ready list at a time, until the
+		// handler is destructed
+		void writer_loop();
+
+		// writes a single websocket frame. Only called by the writers.
+		// compressed sets the RSV1 bit, and must only be set on the first
+		// frame of a compressed message
+		static bool write_frame(mg_connection* conn, int opcode, bool fin
+			, bool compressed, send_buffer const* bufs, int num_bufs);
+
+		// compresses the buffers into s.deflate_buffer. fin is set for the
+		// last part of a message. Only called by the writer thread
+		static bool deflate_buffers(sender& s, send_buffer const* bufs
+			, int num_bufs, bool fin);
+
+		// decompresses a complete message into out. Fails if the message
+		// inflates to more than max_message_size
+		static bool inflate_message(socket_state& s, char const* data
+			, size_t length, std::vector<char>& out);
+
+		// parses the client's Sec-WebSocket-Extensions header. If it offers
+		// permessage-deflate with parameters we support, sets up the
+		// compression for s and returns the extension response to send
+		static std::string negotiate_deflate(char const* offer, socket_state& s);
+
 		// all currently alive web sockets
-		std::map<mg_connection*, std::unique_ptr<std::mutex>> m_open_sockets;
+		std::map<mg_connection*, socket_state> m_open_sockets;
 
 		// serialize access to the map itself
 		std::mutex m_mutex;
 
+		// the connections with frames to write, in the order they get their
+		// turns, and the writer pool draining them. Taken after a sender's
+		// queue_mutex
+		std::mutex m_writers_mutex;
+		std::condition_variable m_writers_cond;
+		std::deque<std::shared_ptr<sender> > m_ready;
+		std::vector<std::thread> m_writers;
+		bool m_stop_writers;
+
+		rpc_stats::queue_stats* m_queue_stats;
+	};
+
+	// writes a single websocket message in pieces, without knowing its size
+	// up-front. Data is buffered and queued as a fragment every time the
+	// buffer fills up, and the last fragment is queued by finish() (or the
+	// destructor). The socket is locked for the lifetime of the writer, to
+	// not interleave other messages with the fragments. While the
+	// connection is more than max_stream_queue bytes behind, writing blocks
+	// until it catches up
+	struct websocket_writer
+	{
+		websocket_writer(websocket_handler& h, mg_connection* conn, int type);
+		~websocket_writer();
+
+		bool write(char const* buf, int len);
+		bool finish();
+
+		// returns false if the connection closed before the message was
+		// queued
+		bool ok() const { return m_ok; }
+
+		enum { fragment_size = 64 * 1024 };
+
+	private:
+
+		bool flush(bool fin);
+
+		websocket_handler& m_handler;
+		std::shared_ptr<websocket_handler::sender> m_sender;
+		std::unique_lock<std::mutex> m_lock;
+
+		// the opcode of the next fragment. The first fragment carries the
+		// message type, all subsequent ones are continuation frames (0)
+		int m_opcode;
+		bool m_ok;
+		// true if permessage-deflate is used for this message
+		bool m_compress;
+		bool m_finished;
+		std::vector<char> m_buffer;
 	};
 }
 
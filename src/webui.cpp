@@ -38,6 +38,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "libtorrent/session.hpp"
 #include "libtorrent/alert_types.hpp"
+#include "libtorrent/string_util.hpp" // for to_lower
 #include "webui.hpp"
 
 extern "C" {
@@ -95,36 +96,218 @@ static void end_request(mg_connection const* c, int reply_status_code)
 }
 
 webui_base::webui_base()
-	: m_document_root(".")
+	: m_routes(1)
+	, m_requests(0)
+	, m_rejected(0)
+	, m_unhandled(0)
+	, m_websockets(0)
+	, m_document_root(".")
 	, m_ctx(NULL)
 {}
 
 webui_base::~webui_base() {}
 
+void webui_base::add_handler(http_handler* h, std::string const& prefix)
+{
+	m_handlers.push_back(std::make_pair(h, prefix));
+	build_routes();
+}
+
 void webui_base::remove_handler(http_handler* h)
 {
-	std::vector<http_handler*>::iterator i = std::find(m_handlers.begin(), m_handlers.end(), h);
-	if (i != m_handlers.end()) m_handlers.erase(i);
+	for (std::vector<std::pair<http_handler*, std::string> >::iterator i
+		= m_handlers.begin(); i != m_handlers.end();)
+	{
+		if (i->first == h) i = m_handlers.erase(i);
+		else ++i;
+	}
+	build_routes();
+}
+
+void webui_base::build_routes()
+{
+	m_routes.clear();
+	m_routes.resize(1);
+
+	for (int i = 0; i < int(m_handlers.size()); ++i)
+	{
+		std::string const& prefix = m_handlers[i].second;
+		int n = 0;
+		for (std::string::const_iterator c = prefix.begin(), end(prefix.end());
+			c != end; ++c)
+		{
+			char const ch = to_lower(*c);
+			std::vector<std::pair<char, int> >& children = m_routes[n].children;
+			std::vector<std::pair<char, int> >::iterator k = children.begin();
+			for (; k != children.end(); ++k)
+				if (k->first == ch) break;
+
+			if (k != children.end())
+			{
+				n = k->second;
+				continue;
+			}
+			int const next = m_routes.size();
+			children.push_back(std::make_pair(ch, next));
+			// this may reallocate, invalidating children
+			m_routes.push_back(route_node());
+			n = next;
+		}
+		m_routes[n].handlers.push_back(i);
+	}
+}
+
+void webui_base::find_handlers(char const* uri
+	, std::vector<http_handler*>& ret) const
+{
+	// the handlers of every node along the URI's path in the trie
+	int matches[32];
+	int num_matches = 0;
+
+	int n = 0;
+	for (;;)
+	{
+		std::vector<int> const& handlers = m_routes[n].handlers;
+		for (std::vector<int>::const_iterator i = handlers.begin()
+			, end(handlers.end()); i != end
+				&& num_matches < int(sizeof(matches)/sizeof(matches[0])); ++i)
+		{
+			matches[num_matches++] = *i;
+		}
+
+		if (*uri == '\0') break;
+		char const ch = to_lower(*uri++);
+		std::vector<std::pair<char, int> > const& children = m_routes[n].children;
+		std::vector<std::pair<char, int> >::const_iterator k = children.begin();
+		for (; k != children.end(); ++k)
+			if (k->first == ch) break;
+		if (k == children.end()) break;
+		n = k->second;
+	}
+
+	std::sort(matches, matches + num_matches);
+	for (int i = 0; i < num_matches; ++i)
+	{
+		http_handler* h = m_handlers[matches[i]].first;
+		if (std::find(ret.begin(), ret.end(), h) != ret.end()) continue;
+		ret.push_back(h);
+	}
+}
+
+void webui_base::bind_connection(mg_connection* conn, http_handler* h)
+{
+	std::unique_lock<std::mutex> l(m_connections_mutex);
+	m_connections[conn] = h;
+}
+
+http_handler* webui_base::bound_handler(mg_connection* conn) const
+{
+	std::unique_lock<std::mutex> l(m_connections_mutex);
+	boost::unordered_map<mg_connection*, http_handler*>::const_iterator i
+		= m_connections.find(conn);
+	if (i == m_connections.end()) return NULL;
+	return i->second;
+}
+
+http_handler* webui_base::unbind_connection(mg_connection* conn)
+{
+	std::unique_lock<std::mutex> l(m_connections_mutex);
+	boost::unordered_map<mg_connection*, http_handler*>::iterator i
+		= m_connections.find(conn);
+	if (i == m_connections.end()) return NULL;
+	http_handler* ret = i->second;
+	m_connections.erase(i);
+	return ret;
+}
+
+void webui_base::set_max_concurrent(http_handler* h, int limit)
+{
+	if (limit <= 0)
+	{
+		m_admission.erase(h);
+		return;
+	}
+	std::shared_ptr<admission>& a = m_admission[h];
+	if (!a) a = std::make_shared<admission>();
+	a->limit = limit;
+}
+
+bool webui_base::admit(http_handler* h)
+{
+	boost::unordered_map<http_handler*, std::shared_ptr<admission> >::const_iterator i
+		= m_admission.find(h);
+	if (i == m_admission.end()) return true;
+	admission& a = *i->second;
+	if (a.in_flight.fetch_add(1) < a.limit) return true;
+	a.in_flight.fetch_sub(1);
+	return false;
+}
+
+void webui_base::release(http_handler* h)
+{
+	boost::unordered_map<http_handler*, std::shared_ptr<admission> >::const_iterator i
+		= m_admission.find(h);
+	if (i == m_admission.end()) return;
+	i->second->in_flight.fetch_sub(1);
 }
 
 bool webui_base::handle_http(mg_connection* conn
 	, mg_request_info const* request_info)
 {
-	for (std::vector<http_handler*>::iterator i = m_handlers.begin()
-		, end(m_handlers.end()); i != end; ++i)
+	// reused across the requests served by this thread
+	static thread_local std::vector<http_handler*> handlers;
+	handlers.clear();
+	find_handlers(request_info->uri, handlers);
+
+	for (std::vector<http_handler*>::iterator i = handlers.begin()
+		, end(handlers.end()); i != end; ++i)
 	{
-		if ((*i)->handle_http(conn, request_info)) return true;
+		// the slot is held until the end of the request
+		if (!admit(*i))
+		{
+			++m_rejected;
+			mg_printf(conn, "HTTP/1.1 503 Service Unavailable\r\n"
+				"Retry-After: 1\r\n"
+				"Content-Length: 0\r\n\r\n");
+			return true;
+		}
+		if (!(*i)->handle_http(conn, request_info))
+		{
+			release(*i);
+			continue;
+		}
+		++m_requests;
+		bind_connection(conn, *i);
+		return true;
 	}
+	++m_unhandled;
 	return false;
 }
 
 bool webui_base::handle_websocket_connect(mg_connection* conn
 	, mg_request_info const* request_info)
 {
-	for (std::vector<http_handler*>::iterator i = m_handlers.begin()
-		, end(m_handlers.end()); i != end; ++i)
+	static thread_local std::vector<http_handler*> handlers;
+	handlers.clear();
+	find_handlers(request_info->uri, handlers);
+
+	for (std::vector<http_handler*>::iterator i = handlers.begin()
+		, end(handlers.end()); i != end; ++i)
 	{
-		if ((*i)->handle_websocket_connect(conn, request_info)) return true;
+		// refusing the connection closes it
+		if (!admit(*i))
+		{
+			++m_rejected;
+			return false;
+		}
+		if (!(*i)->handle_websocket_connect(conn, request_info))
+		{
+			release(*i);
+			continue;
+		}
+		++m_websockets;
+		bind_connection(conn, *i);
+		return true;
 	}
 	return false;
 }
@@ -132,21 +315,29 @@ bool webui_base::handle_websocket_connect(mg_connection* conn
 bool webui_base::handle_websocket_data(mg_connection* conn
 	, int bits, char* data, size_t data_len)
 {
-	for (std::vector<http_handler*>::iterator i = m_handlers.begin()
-		, end(m_handlers.end()); i != end; ++i)
-	{
-		if ((*i)->handle_websocket_data(conn, bits, data, data_len)) return true;
-	}
-	return false;
+	http_handler* h = bound_handler(conn);
+	if (h == NULL) return false;
+	return h->handle_websocket_data(conn, bits, data, data_len);
 }
 
 void webui_base::handle_end_request(mg_connection* conn)
 {
-	for (std::vector<http_handler*>::iterator i = m_handlers.begin()
-		, end(m_handlers.end()); i != end; ++i)
-	{
-		(*i)->handle_end_request(conn);
-	}
+	http_handler* h = unbind_connection(conn);
+	if (h == NULL) return;
+	h->handle_end_request(conn);
+	release(h);
+}
+
+webui_stats webui_base::stats() const
+{
+	webui_stats ret;
+	ret.requests = m_requests.load(std::memory_order_relaxed);
+	ret.rejected = m_rejected.load(std::memory_order_relaxed);
+	ret.unhandled = m_unhandled.load(std::memory_order_relaxed);
+	ret.websockets = m_websockets.load(std::memory_order_relaxed);
+	std::unique_lock<std::mutex> l(m_connections_mutex);
+	ret.active = int(m_connections.size());
+	return ret;
 }
 
 bool webui_base::is_running() const
@@ -154,7 +345,8 @@ bool webui_base::is_running() const
 	return m_ctx;
 }
 
-void webui_base::start(int port, char const* cert_path, int num_threads)
+void webui_base::start(int port, char const* cert_path, int num_threads
+	, int max_threads)
 {
 	if (m_ctx) mg_stop(m_ctx);
 
@@ -182,6 +374,11 @@ void webui_base::start(int port, char const* cert_path, int num_threads)
 	snprintf(threads_str, sizeof(threads_str), "%d", num_threads);
 	options[i++] = "num_threads";
 	options[i++] = threads_str;
+
+	char max_threads_str[20];
+	snprintf(max_threads_str, sizeof(max_threads_str), "%d", max_threads);
+	options[i++] = "max_threads";
+	options[i++] = max_threads_str;
 	options[i++] = NULL;
 
 	mg_callbacks cb;
@@ -35,6 +35,12 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <vector>
 #include <string>
+#include <utility>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <boost/unordered_map.hpp>
 
 struct mg_context;
 struct mg_connection;
@@ -55,17 +61,51 @@ namespace libtorrent
 {
 	class session;
 
+	// counters of what the web server has been doing, for monitoring
+	struct webui_stats
+	{
+		// HTTP requests a handler served
+		std::uint64_t requests;
+		// requests turned away with 503, because their handler was at its
+		// concurrency limit
+		std::uint64_t rejected;
+		// requests no handler wanted, left to mongoose
+		std::uint64_t unhandled;
+		// websocket connections a handler accepted
+		std::uint64_t websockets;
+		// requests and websockets being served right now
+		int active;
+	};
+
 	struct webui_base
 	{
 		webui_base();
 		~webui_base();
 
+		// the handler is offered every request
 		void add_handler(http_handler* h)
-		{ m_handlers.push_back(h); }
+		{ add_handler(h, std::string()); }
+
+		// the handler is only offered requests whose URI begins with prefix,
+		// compared case insensitively. A handler may be added with several
+		// prefixes. Every request is offered to the handlers matching it in
+		// the order they were added, until one of them handles it
+		void add_handler(http_handler* h, std::string const& prefix);
 
 		void remove_handler(http_handler* h);
 
-		void start(int port, char const* cert_path = 0, int num_threads = 10);
+		// limits the number of requests (and websockets) h may be serving at
+		// once. Requests routed to it beyond that are turned away with 503
+		// Service Unavailable, so a handler with long running requests, like
+		// streams, can't tie up every thread of the server. 0 means no
+		// limit. This must be set before start()
+		void set_max_concurrent(http_handler* h, int limit);
+
+		// the server starts num_threads threads. When all of them are busy,
+		// more are started, up to max_threads. The ones beyond num_threads
+		// exit again once they've been idle for a while
+		void start(int port, char const* cert_path = 0, int num_threads = 10
+			, int max_threads = 50);
 		void stop();
 		bool is_running() const;
 
@@ -80,9 +120,57 @@ namespace libtorrent
 
 		int listen_port() const { return m_listen_port; }
 
+		webui_stats stats() const;
+
 	private:
 
-		std::vector<http_handler*> m_handlers;
+		// appends the handlers whose prefix matches uri to ret, in the order
+		// they were added
+		void find_handlers(char const* uri, std::vector<http_handler*>& ret) const;
+
+		// rebuilds m_routes from m_handlers
+		void build_routes();
+
+		// the connection's websocket frames and its end of request are only
+		// passed to the handler that accepted it
+		void bind_connection(mg_connection* conn, http_handler* h);
+		http_handler* bound_handler(mg_connection* conn) const;
+		http_handler* unbind_connection(mg_connection* conn);
+
+		// takes one of h's slots, if it's limited. Returns false if they're
+		// all taken
+		bool admit(http_handler* h);
+		void release(http_handler* h);
+
+		// the handlers and their prefixes, in the order they were added
+		std::vector<std::pair<http_handler*, std::string> > m_handlers;
+
+		// a trie of the (lower case) prefixes, m_routes[0] is the root. The
+		// handlers of a node are indices into m_handlers
+		struct route_node
+		{
+			std::vector<std::pair<char, int> > children;
+			std::vector<int> handlers;
+		};
+		std::vector<route_node> m_routes;
+
+		struct admission
+		{
+			admission() : limit(0), in_flight(0) {}
+			int limit;
+			std::atomic<int> in_flight;
+		};
+		boost::unordered_map<http_handler*, std::shared_ptr<admission> > m_admission;
+
+		// the handler that accepted each request or websocket in flight
+		mutable std::mutex m_connections_mutex;
+		boost::unordered_map<mg_connection*, http_handler*> m_connections;
+
+		std::atomic<std::uint64_t> m_requests;
+		std::atomic<std::uint64_t> m_rejected;
+		std::atomic<std::uint64_t> m_unhandled;
+		std::atomic<std::uint64_t> m_websockets;
+
 		std::string m_document_root;
 
 		mg_context* m_ctx;
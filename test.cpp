@@ -6,17 +6,29 @@
 #include "auto_load.hpp"
 #include "save_settings.hpp"
 #include "save_resume.hpp"
+#include "torrent_unloader.hpp"
 #include "torrent_history.hpp"
+#include "peer_history.hpp"
+#include "file_history.hpp"
 #include "auth.hpp"
 #include "pam_auth.hpp"
+#include "static_assets.hpp"
+#include "bulk_jobs.hpp"
+#include "metrics_exporter.hpp"
 //#include "text_ui.hpp"
 
 #include "libtorrent/session.hpp"
 #include "alert_handler.hpp"
 #include "stats_logging.hpp"
+#include "stats_snapshot.hpp"
 #include "rss_filter.hpp"
+#include "alert_trace.hpp"
+#include "session_set.hpp"
 
 #include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <memory>
 
 bool quit = false;
 bool force_quit = false;
@@ -81,8 +93,43 @@ struct external_ip_observer : alert_observer
 	address m_last_known_addr;
 };
 
+// the sessions after the first one, when running more than one. Each has
+// its own resume database and listen port, and its torrents are merged into
+// the first session's history
+struct extra_session
+{
+	extra_session(int index, torrent_history* hist)
+		: ses(make_settings(index))
+		, alerts(ses)
+		, resume(ses, "resume-" + std::to_string(index) + ".dat", &alerts, hist)
+	{}
+
+	static settings_pack make_settings(int index)
+	{
+		settings_pack s;
+		s.set_str(settings_pack::listen_interfaces
+			, "0.0.0.0:" + std::to_string(6881 + index));
+		s.set_int(settings_pack::alert_mask, 0xffffffff);
+		return s;
+	}
+
+	lt::session ses;
+	alert_handler alerts;
+	save_resume resume;
+};
+
 int main(int argc, char *const argv[])
 {
+	// -r <file> records the alerts the observers see, for alert_replay
+	// -n <count> runs count sessions, fronted by the same web UIs
+	char const* record_file = NULL;
+	int num_sessions = 1;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "-r") == 0) record_file = argv[i + 1];
+		else if (strcmp(argv[i], "-n") == 0) num_sessions = (std::max)(1, atoi(argv[i + 1]));
+	}
+
 	settings_pack s;
 	s.set_str(settings_pack::listen_interfaces, "0.0.0.0:6881");
 	s.set_int(settings_pack::alert_mask, 0xffffffff);
@@ -95,6 +142,17 @@ int main(int argc, char *const argv[])
 	sett.load(ec);
 
 	torrent_history hist(&alerts);
+
+	// pick up the frame numbers of the last run, for clients to not have to
+	// start over with a full update
+	hist.load_snapshot("history.dat", ec);
+	ec.clear();
+
+	alert_recorder recorder(ses, &alerts);
+	if (record_file && !recorder.start(record_file, ec))
+		fprintf(stderr, "failed to record alerts to \"%s\": %s\n", record_file, ec.message().c_str());
+	ec.clear();
+
 	auth authorizer;
 	ec.clear();
 	authorizer.load_accounts("users.conf", ec);
@@ -103,27 +161,100 @@ int main(int argc, char *const argv[])
 	ec.clear();
 //	pam_auth authorizer("bittorrent");
 
-	save_resume resume(ses, "resume.dat", &alerts);
+	save_resume resume(ses, "resume.dat", &alerts, &hist);
 	add_torrent_params p;
 	p.save_path = sett.get_str("save_path", ".");
 	resume.load(ec, p);
 
+	// the set is declared after the extra sessions, to stop their alert
+	// loops before they're destructed
+	std::vector<std::shared_ptr<extra_session> > extra;
+	session_set sessions(ses, &hist);
+	for (int i = 1; i < num_sessions; ++i)
+	{
+		extra.push_back(std::make_shared<extra_session>(i, &hist));
+		sessions.add(extra.back()->ses, &extra.back()->alerts);
+		extra.back()->resume.load(ec, p);
+	}
+
+	// true once all sessions are done saving, or loading, resume data
+	auto all_resume = [&](std::function<bool(save_resume&)> const& f)
+	{
+		if (!f(resume)) return false;
+		for (int i = 0; i < int(extra.size()); ++i)
+			if (!f(extra[i]->resume)) return false;
+		return true;
+	};
+
 //	external_ip_observer eip(ses, &alerts);
 
 	auto_load al(ses, &sett);
 	rss_filter_handler rss_filter(alerts, ses);
 
-	transmission_webui tr_handler(ses, &sett, &authorizer);
+	// the peer lists of the torrents the web UIs are showing, refreshed in
+	// the background
+	peer_history peers(&alerts);
+
+	// the file lists of the torrents the web UIs are showing
+	file_history files(&alerts, &hist);
+
+	// keeps the metadata of the loaded torrents within a budget, unloading
+	// the idle ones
+	torrent_unloader unloader(ses, &alerts, &hist, &resume, &files
+		, std::int64_t(sett.get_int("metadata_budget_mb", 1024)) * 1024 * 1024);
+
+	// removing, rechecking and moving many torrents at once is done in the
+	// background, at a limited rate
+	bulk_jobs bulk(sessions, sett.get_int("bulk_job_rate", bulk_jobs::default_rate));
+
+	// the JSON responses are compressed for clients that accept it
+	http_compression compression;
+	compression.level = sett.get_int("http_compression_level", 6);
+	compression.min_size = sett.get_int("http_compression_threshold", 1024);
+
+	transmission_webui tr_handler(ses, &sett, &hist, &authorizer);
+	tr_handler.set_sessions(&sessions);
+	tr_handler.set_file_history(&files);
+	tr_handler.set_compression(compression);
+	tr_handler.set_bulk_jobs(&bulk);
 	utorrent_webui ut_handler(ses, &sett, &al, &hist, &rss_filter, &authorizer);
+	ut_handler.set_sessions(&sessions);
+	ut_handler.set_peer_history(&peers);
+	ut_handler.set_file_history(&files);
+	ut_handler.set_compression(compression);
+	ut_handler.set_bulk_jobs(&bulk);
 	file_downloader file_handler(ses, &authorizer);
-	libtorrent_webui lt_handler(ses, &hist, &authorizer, &alerts);
-	stats_logging log(ses, &alerts);
+	stats_snapshot stats(ses, &alerts);
+	libtorrent_webui lt_handler(ses, &hist, &authorizer, &alerts, &stats);
+	lt_handler.set_sessions(&sessions);
+	lt_handler.set_peer_history(&peers);
+	lt_handler.set_file_history(&files);
+	lt_handler.set_bulk_jobs(&bulk);
+	stats_logging log(&stats);
+
+	// the dashboard is served from memory
+	static_assets assets("bt", "/bt/");
+	assets.load(ec);
+	if (ec) fprintf(stderr, "failed to load static assets: %s\n", ec.message().c_str());
+	ec.clear();
 
 	webui_base webport;
-	webport.add_handler(&lt_handler);
-	webport.add_handler(&ut_handler);
-	webport.add_handler(&tr_handler);
-	webport.add_handler(&file_handler);
+	webport.add_handler(&assets, "/bt/");
+	webport.add_handler(&lt_handler, "/bt/control");
+	webport.add_handler(&ut_handler, "/gui");
+	webport.add_handler(&tr_handler, "/transmission/rpc");
+	webport.add_handler(&tr_handler, "/rpc");
+	webport.add_handler(&tr_handler, "/upload");
+	webport.add_handler(&file_handler, "/download");
+	webport.add_handler(&file_handler, "/proxy");
+
+	// for Prometheus to scrape, with the credentials of an account that
+	// may see the session status
+	metrics_exporter metrics(&stats, &authorizer, &webport);
+	webport.add_handler(&metrics, "/metrics");
+
+	// streams may block on pieces for a long time. Leave room for the UIs
+	webport.set_max_concurrent(&file_handler, 32);
 	webport.start(8090);
 	if (!webport.is_running())
 	{
@@ -131,21 +262,33 @@ int main(int argc, char *const argv[])
 		return 1;
 	}
 
-	deluge dlg(ses, "server.pem", &authorizer);
+	deluge dlg(ses, "server.pem", &hist, &alerts, &authorizer);
 	dlg.start(58846);
 
 	signal(SIGTERM, &sighandler);
 	signal(SIGINT, &sighandler);
 
 	bool shutting_down = false;
-	while (!quit || !resume.ok_to_quit())
+	bool restored = false;
+	alerts.run([&]
 	{
-		usleep(500000);
-		alerts.dispatch_alerts();
+		if (quit && all_resume([](save_resume& r) { return r.ok_to_quit(); }))
+			return false;
+		if (!restored && all_resume([](save_resume& r)
+			{
+				save_resume::load_stats_t const st = r.load_stats();
+				return st.done && st.added + st.failed + st.lost >= st.queued;
+			}))
+		{
+			// once the resume databases are loaded, whatever is left of the
+			// history snapshot is no longer around
+			hist.drop_restored();
+			restored = true;
+		}
 		if (!shutting_down) ses.post_torrent_updates();
 		if (quit && !shutting_down)
 		{
-			resume.save_all();
+			all_resume([](save_resume& r) { r.save_all(); return true; });
 			shutting_down = true;
 			fprintf(stderr, "saving resume data\n");
 			signal(SIGTERM, &sighandler_forcequit);
@@ -154,9 +297,10 @@ int main(int argc, char *const argv[])
 		if (force_quit)
 		{
 			fprintf(stderr, "force quitting\n");
-			break;
+			return false;
 		}
-	}
+		return true;
+	});
 
 	fprintf(stderr, "abort alerts\n");
 	// it's important to disable any more alert subscriptions
@@ -165,6 +309,11 @@ int main(int argc, char *const argv[])
 	// for alerts. Those alerts aren't likely to ever arrive at
 	// this point.
 	alerts.abort();
+	sessions.stop();
+
+	fprintf(stderr, "saving torrent history\n");
+	hist.save_snapshot("history.dat", ec);
+	ec.clear();
 	fprintf(stderr, "closing web server\n");
 	dlg.stop();
 	webport.stop();
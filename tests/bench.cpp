@@ -0,0 +1,133 @@
+/*
+
+Copyright (c) 2013, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "bench.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <chrono>
+#include <atomic>
+#include <new>
+#include <cinttypes>
+
+// micro-benchmarks of the code that runs for every request or every torrent.
+// Each result is printed as one line of JSON:
+//
+//   {"name": "...", "iterations": N, "ns_per_op": x, "bytes_per_op": y, "allocs_per_op": z}
+//
+// usage: bench [-t <min-milliseconds>] [filter]
+
+namespace
+{
+	std::atomic<std::uint64_t> num_allocs(0);
+
+	std::string filter;
+	int min_time_ms = 500;
+}
+
+// count every heap allocation, to report allocations per operation
+void* operator new(std::size_t size)
+{
+	num_allocs.fetch_add(1, std::memory_order_relaxed);
+	void* ret = malloc(size == 0 ? 1 : size);
+	if (ret == NULL) throw std::bad_alloc();
+	return ret;
+}
+
+void* operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+
+bool bench_enabled(char const* name)
+{
+	return filter.empty() || strstr(name, filter.c_str()) != NULL;
+}
+
+void run_bench(char const* name, std::function<std::size_t()> const& op)
+{
+	if (!bench_enabled(name)) return;
+
+	typedef std::chrono::steady_clock clock;
+	using std::chrono::duration_cast;
+	using std::chrono::nanoseconds;
+
+	// once, to warm up caches and let buffers grow to their final size
+	op();
+
+	std::int64_t iterations = 0;
+	std::uint64_t bytes = 0;
+	std::uint64_t const allocs_start = num_allocs.load(std::memory_order_relaxed);
+	clock::time_point const start = clock::now();
+	clock::duration elapsed(0);
+
+	// run in batches, doubling in size, to not read the clock between
+	// every call to fast operations
+	for (std::int64_t batch = 1;; batch *= 2)
+	{
+		for (std::int64_t i = 0; i < batch; ++i)
+			bytes += op();
+		iterations += batch;
+		elapsed = clock::now() - start;
+		if (elapsed >= std::chrono::milliseconds(min_time_ms)) break;
+	}
+
+	std::uint64_t const allocs = num_allocs.load(std::memory_order_relaxed) - allocs_start;
+	double const ns = double(duration_cast<nanoseconds>(elapsed).count());
+
+	printf("{\"name\": \"%s\", \"iterations\": %" PRId64 ", \"ns_per_op\": %.1f"
+		", \"bytes_per_op\": %.1f, \"allocs_per_op\": %.2f}\n"
+		, name, iterations, ns / iterations, double(bytes) / iterations
+		, double(allocs) / iterations);
+	fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+			min_time_ms = atoi(argv[++i]);
+		else
+			filter = argv[i];
+	}
+
+	bench_encoders();
+	bench_torrents();
+	return 0;
+}
+
@@ -0,0 +1,100 @@
+/*
+
+Copyright (c) 2013, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "base64.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <chrono>
+
+extern "C" {
+#include "cdecode.h"
+}
+
+using namespace libtorrent;
+
+// compares base64_decode() to the libb64 decoder it replaced, on a buffer
+// the size of a typical torrent-add metainfo payload
+
+int main(int argc, char* argv[])
+{
+	int const size = argc > 1 ? atoi(argv[1]) : 4 * 1024 * 1024;
+	int const rounds = argc > 2 ? atoi(argv[2]) : 20;
+
+	typedef std::chrono::steady_clock clock;
+	using std::chrono::duration_cast;
+	using std::chrono::microseconds;
+
+	std::string data;
+	for (int i = 0; i < size; ++i) data += char(rand());
+
+	std::string encoded(base64_encoded_size(size), '\0');
+	clock::time_point start = clock::now();
+	for (int r = 0; r < rounds; ++r)
+		base64_encode(data.c_str(), size, &encoded[0]);
+	clock::duration encode = clock::now() - start;
+
+	std::string decoded(base64_decoded_size(encoded.size()), '\0');
+	start = clock::now();
+	int libb64_len = 0;
+	for (int r = 0; r < rounds; ++r)
+	{
+		base64_decodestate ctx;
+		base64_init_decodestate(&ctx);
+		libb64_len = base64_decode_block(encoded.c_str(), encoded.size(), &decoded[0], &ctx);
+	}
+	clock::duration libb64 = clock::now() - start;
+	bool const libb64_ok = libb64_len == size && decoded.compare(0, size, data) == 0;
+
+	start = clock::now();
+	int len = 0;
+	for (int r = 0; r < rounds; ++r)
+		len = base64_decode(encoded.c_str(), encoded.size(), &decoded[0]);
+	clock::duration decode = clock::now() - start;
+	bool const ok = len == size && decoded.compare(0, size, data) == 0;
+
+	// MB/s of encoded text
+	double const mbytes = double(encoded.size()) * rounds / 1000000.;
+	printf("%d bytes, %d rounds, %s\n", size, rounds, base64_implementation());
+	printf("encode:        %8.1f MB/s\n"
+		, mbytes / duration_cast<microseconds>(encode).count() * 1000000.);
+	printf("libb64 decode: %8.1f MB/s%s\n"
+		, mbytes / duration_cast<microseconds>(libb64).count() * 1000000.
+		, libb64_ok ? "" : " (wrong result)");
+	printf("decode:        %8.1f MB/s%s\n"
+		, mbytes / duration_cast<microseconds>(decode).count() * 1000000.
+		, ok ? "" : " (wrong result)");
+
+	return ok ? 0 : 1;
+}
+
@@ -0,0 +1,134 @@
+/*
+
+Copyright (c) 2013, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "bench.hpp"
+#include "escape_json.hpp"
+#include "rencode.hpp"
+#include "base64.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+using namespace libtorrent;
+
+namespace
+{
+	// a torrent-list like message: a list of dicts with a few strings and
+	// numbers each
+	void encode_torrent_list(rencoder& out, int num_torrents)
+	{
+		bool const need_term = out.append_list(num_torrents);
+		for (int i = 0; i < num_torrents; ++i)
+		{
+			char name[100];
+			snprintf(name, sizeof(name), "Some.Linux.Distribution.%d.x86_64.DVD.iso", i);
+			out.append_dict(6);
+			out.append_string("name");
+			out.append_string(name);
+			out.append_string("state");
+			out.append_string("Downloading");
+			out.append_string("total_size");
+			out.append_int(std::int64_t(i) * 1024 * 1024 * 3);
+			out.append_string("progress");
+			out.append_float(float(i % 100) / 100.f);
+			out.append_string("download_payload_rate");
+			out.append_int(i * 37 % 100000);
+			out.append_string("is_finished");
+			out.append_bool(i % 3 == 0);
+		}
+		if (need_term) out.append_term();
+	}
+}
+
+void bench_encoders()
+{
+	// torrent names, mostly plain ASCII, and the same with characters that
+	// need escaping
+	std::string plain;
+	std::string mixed;
+	for (int i = 0; plain.size() < 1024; ++i)
+	{
+		plain += "Some.Linux.Distribution.x86_64.DVD ";
+		mixed += "Some \"Linux\"\tDistribution\\x86_64 \xc3\xa5\xc3\xa4\xc3\xb6 ";
+	}
+
+	std::vector<char> json;
+	run_bench("escape_json/plain", [&]() {
+		json.clear();
+		escape_json(plain.c_str(), plain.size(), json);
+		return plain.size();
+	});
+	run_bench("escape_json/mixed", [&]() {
+		json.clear();
+		escape_json(mixed.c_str(), mixed.size(), json);
+		return mixed.size();
+	});
+	run_bench("escape_json/string", [&]() {
+		return escape_json(mixed).size();
+	});
+
+	rencoder encoded;
+	encode_torrent_list(encoded, 1000);
+
+	run_bench("rencoder/torrent_list/1000", [&]() {
+		rencoder out;
+		encode_torrent_list(out, 1000);
+		return std::size_t(out.len());
+	});
+
+	std::vector<rtok_t> tokens(1000 * 13 + 1);
+	run_bench("rdecode/torrent_list/1000", [&]() {
+		int const ret = rdecode(&tokens[0], tokens.size(), encoded.data(), encoded.len());
+		if (ret <= 0) fprintf(stderr, "rdecode failed: %d\n", ret);
+		return std::size_t(encoded.len());
+	});
+
+	// the size of a typical metainfo file posted to torrent-add
+	int const size = 256 * 1024;
+	std::string data;
+	for (int i = 0; i < size; ++i) data += char(rand());
+	std::string b64(base64_encoded_size(size), '\0');
+	std::string decoded(base64_decoded_size(b64.size()), '\0');
+
+	std::string const encode_name = std::string("base64/encode/") + base64_implementation();
+	run_bench(encode_name.c_str(), [&]() {
+		return std::size_t(base64_encode(data.c_str(), size, &b64[0]));
+	});
+	std::string const decode_name = std::string("base64/decode/") + base64_implementation();
+	run_bench(decode_name.c_str(), [&]() {
+		base64_decode(b64.c_str(), b64.size(), &decoded[0]);
+		return b64.size();
+	});
+}
+
@@ -0,0 +1,149 @@
+/*
+
+Copyright (c) 2013, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "rss_filter.hpp"
+#include "multi_match.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+using namespace libtorrent;
+
+// compares matching RSS item titles against rules the way rss_filter_handler
+// used to, with one strstr() per rule, to the compiled multi_match
+
+namespace
+{
+	char const* words[] =
+	{
+		"the", "show", "foo", "bar", "night", "live", "late", "news", "world",
+		"house", "game", "star", "dark", "blue", "city", "life", "man", "girl",
+		"doctor", "island", "river", "king", "lost", "first", "last", "big"
+	};
+	int const num_words = sizeof(words)/sizeof(words[0]);
+
+	std::string random_name(int len)
+	{
+		std::string ret;
+		for (int i = 0; i < len; ++i)
+		{
+			if (!ret.empty()) ret += ' ';
+			ret += words[rand() % num_words];
+		}
+		return ret;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	int const num_rules = argc > 1 ? atoi(argv[1]) : 3000;
+	int const num_items = argc > 2 ? atoi(argv[2]) : 10000;
+
+	typedef std::chrono::steady_clock clock;
+
+	std::vector<std::string> search;
+	std::vector<std::string> search_not;
+	for (int i = 0; i < num_rules; ++i)
+	{
+		search.push_back(random_name(3));
+		search_not.push_back(i % 3 == 0 ? "720p" : "");
+	}
+
+	std::vector<std::string> titles;
+	for (int i = 0; i < num_items; ++i)
+	{
+		char ep[30];
+		snprintf(ep, sizeof(ep), ".S%02dE%02d.%s", rand() % 10, rand() % 30
+			, i % 2 ? "720p.HDTV" : "HDTV");
+		titles.push_back(random_name(4) + ep);
+	}
+
+	clock::time_point start = clock::now();
+	int naive_hits = 0;
+	for (std::vector<std::string>::iterator t = titles.begin(); t != titles.end(); ++t)
+	{
+		std::string title = normalize_title(*t);
+		for (int i = 0; i < num_rules; ++i)
+		{
+			std::string s = normalize_title(search[i]);
+			if (!s.empty() && strstr(title.c_str(), s.c_str()) == NULL) continue;
+			std::string sn = normalize_title(search_not[i]);
+			if (!sn.empty() && strstr(title.c_str(), sn.c_str()) != NULL) continue;
+			++naive_hits;
+			break;
+		}
+	}
+	clock::duration naive = clock::now() - start;
+
+	start = clock::now();
+	multi_match m;
+	std::vector<int> search_idx;
+	std::vector<int> search_not_idx;
+	for (int i = 0; i < num_rules; ++i)
+	{
+		std::string s = normalize_title(search[i]);
+		std::string sn = normalize_title(search_not[i]);
+		search_idx.push_back(s.empty() ? -1 : m.add(s));
+		search_not_idx.push_back(sn.empty() ? -1 : m.add(sn));
+	}
+	m.compile();
+	clock::duration compile = clock::now() - start;
+
+	start = clock::now();
+	int compiled_hits = 0;
+	std::vector<bool> found;
+	for (std::vector<std::string>::iterator t = titles.begin(); t != titles.end(); ++t)
+	{
+		m.find(normalize_title(*t), found);
+		for (int i = 0; i < num_rules; ++i)
+		{
+			if (search_idx[i] >= 0 && !found[search_idx[i]]) continue;
+			if (search_not_idx[i] >= 0 && found[search_not_idx[i]]) continue;
+			++compiled_hits;
+			break;
+		}
+	}
+	clock::duration compiled = clock::now() - start;
+
+	using std::chrono::duration_cast;
+	using std::chrono::microseconds;
+	printf("%d rules, %d items\n", num_rules, num_items);
+	printf("strstr:      %8d us (%d hits)\n"
+		, int(duration_cast<microseconds>(naive).count()), naive_hits);
+	printf("multi_match: %8d us (%d hits, %d us to compile)\n"
+		, int(duration_cast<microseconds>(compiled).count()), compiled_hits
+		, int(duration_cast<microseconds>(compile).count()));
+
+	return naive_hits == compiled_hits ? 0 : 1;
+}
+
@@ -0,0 +1,214 @@
+/*
+
+Copyright (c) 2013, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "bench.hpp"
+#include "torrent_history.hpp"
+#include "alert_handler.hpp"
+#include "stats_snapshot.hpp"
+#include "libtorrent_webui.hpp"
+#include "utorrent_webui.hpp"
+#include "transmission_webui.hpp"
+#include "auth_interface.hpp"
+
+#include "libtorrent/session.hpp"
+#include "libtorrent/alert_types.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "jsmn.h"
+}
+
+using namespace libtorrent;
+
+// the history and the front-ends, with synthetic torrents. The session is
+// only there to construct the front-ends against, it doesn't have any
+// torrents
+
+namespace
+{
+	torrent_status make_status(int i)
+	{
+		torrent_status st;
+		for (int k = 0; k < 20; ++k) st.info_hash[k] = rand();
+		char name[100];
+		snprintf(name, sizeof(name), "Some.Linux.Distribution.%d.x86_64.DVD.iso", i);
+		st.name = name;
+		st.save_path = "/home/user/Downloads";
+		st.state = i % 4 == 0 ? torrent_status::seeding : torrent_status::downloading;
+		st.total_wanted = std::int64_t(i % 1000 + 1) * 1024 * 1024;
+		st.total_wanted_done = st.total_wanted / 3;
+		st.progress = 1.f / 3;
+		st.progress_ppm = 333333;
+		st.num_peers = i % 50;
+		st.num_seeds = i % 7;
+		st.download_payload_rate = i * 37 % 100000;
+		st.upload_payload_rate = i * 13 % 50000;
+		st.queue_position = i;
+		return st;
+	}
+
+	// every update changes the rates of a tenth of the torrents
+	void churn(std::vector<torrent_status>& st, int round)
+	{
+		for (int i = round % 10; i < int(st.size()); i += 10)
+		{
+			st[i].download_payload_rate += 1000;
+			st[i].upload_payload_rate += 100;
+			st[i].total_wanted_done += 16 * 1024;
+		}
+	}
+
+	bool any_enabled(char const* const* names, int num, int num_torrents)
+	{
+		for (int i = 0; i < num; ++i)
+		{
+			char name[200];
+			snprintf(name, sizeof(name), "%s/%d", names[i], num_torrents);
+			if (bench_enabled(name)) return true;
+		}
+		return false;
+	}
+
+	void bench_history(session& ses, alert_handler& alerts, int num_torrents)
+	{
+		char const* names[] = {
+			"torrent_history/handle_alert",
+			"libtorrent_webui/get_torrent_updates/full",
+			"libtorrent_webui/get_torrent_updates/delta",
+			"utorrent_webui/send_torrent_list",
+			"transmission_webui/get_torrent",
+		};
+		if (!any_enabled(names, sizeof(names)/sizeof(names[0]), num_torrents))
+			return;
+
+		torrent_history hist(&alerts);
+		std::vector<torrent_status> torrents;
+		torrents.reserve(num_torrents);
+		for (int i = 0; i < num_torrents; ++i)
+		{
+			torrents.push_back(make_status(i));
+			hist.add_torrent(torrents.back());
+		}
+
+		char name[200];
+
+		// the updates alternate between two alerts, to always have a tenth
+		// of the torrents changed compared to the history
+		state_update_alert updates[2];
+		updates[0].status = torrents;
+		churn(updates[0].status, 0);
+		updates[1].status = updates[0].status;
+		churn(updates[1].status, 1);
+		int round = 0;
+		snprintf(name, sizeof(name), "%s/%d", names[0], num_torrents);
+		run_bench(name, [&]() {
+			hist.handle_alert(&updates[round++ & 1]);
+			// bump the frame, like a reader would
+			hist.frame();
+			return std::size_t(0);
+		});
+
+		stats_snapshot stats(ses, &alerts);
+		libtorrent_webui lt(ses, &hist, NULL, &alerts, &stats);
+		std::vector<char> response;
+
+		snprintf(name, sizeof(name), "%s/%d", names[1], num_torrents);
+		run_bench(name, [&]() {
+			response.clear();
+			lt.encode_torrent_updates(0, hist.frame(), ~std::uint64_t(0), response);
+			return response.size();
+		});
+
+		// the torrents changed by one update
+		hist.handle_alert(&updates[round++ & 1]);
+		std::uint32_t const frame = hist.frame();
+		hist.handle_alert(&updates[round++ & 1]);
+		snprintf(name, sizeof(name), "%s/%d", names[2], num_torrents);
+		run_bench(name, [&]() {
+			response.clear();
+			lt.encode_torrent_updates(frame, hist.frame(), ~std::uint64_t(0), response);
+			return response.size();
+		});
+
+		full_permissions perms;
+		utorrent_webui ut(ses, NULL, NULL, &hist);
+		snprintf(name, sizeof(name), "%s/%d", names[3], num_torrents);
+		run_bench(name, [&]() {
+			response.clear();
+			ut.send_torrent_list(response, "list=1", &perms, NULL);
+			return response.size();
+		});
+
+		// the fields the transmission web UI asks for in its torrent list
+		char const request[] = "{\"fields\": [\"id\", \"name\", \"status\""
+			", \"percentDone\", \"rateDownload\", \"rateUpload\", \"totalSize\""
+			", \"sizeWhenDone\", \"leftUntilDone\", \"eta\", \"peersConnected\""
+			", \"uploadRatio\", \"error\", \"errorString\", \"queuePosition\""
+			", \"isFinished\", \"downloadDir\"]}";
+		std::vector<char> buffer(request, request + sizeof(request));
+		std::vector<jsmntok_t> tokens(100);
+		jsmn_parser p;
+		jsmn_init(&p);
+		if (jsmn_parse(&p, &buffer[0], &tokens[0], tokens.size()) != JSMN_SUCCESS)
+		{
+			fprintf(stderr, "failed to parse transmission request\n");
+			return;
+		}
+
+		transmission_webui tr(ses, NULL, &hist, NULL);
+		snprintf(name, sizeof(name), "%s/%d", names[4], num_torrents);
+		run_bench(name, [&]() {
+			response.clear();
+			tr.get_torrent(response, &tokens[0], 1, &buffer[0], &perms);
+			return response.size();
+		});
+	}
+}
+
+void bench_torrents()
+{
+	settings_pack s;
+	s.set_str(settings_pack::listen_interfaces, "127.0.0.1:0");
+	s.set_int(settings_pack::alert_mask, 0);
+	session ses(s);
+	alert_handler alerts(ses);
+
+	int const sizes[] = { 1000, 10000, 200000 };
+	for (int i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i)
+		bench_history(ses, alerts, sizes[i]);
+}
+
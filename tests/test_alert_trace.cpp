@@ -0,0 +1,270 @@
+/*
+
+Copyright (c) 2013, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "test.hpp"
+#include "alert_trace.hpp"
+#include "libtorrent/bencode.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iterator>
+
+using namespace libtorrent;
+
+int main_ret = 0;
+
+namespace {
+
+	sha1_hash make_hash(int i)
+	{
+		sha1_hash ret;
+		for (int k = 0; k < 20; ++k) ret[k] = std::uint8_t(i + k);
+		return ret;
+	}
+
+	torrent_status make_status(int i)
+	{
+		torrent_status st;
+		st.info_hash = make_hash(i);
+		st.state = torrent_status::downloading;
+		st.paused = i & 1;
+		st.auto_managed = true;
+		st.has_metadata = true;
+		st.need_save_resume = i & 2;
+		st.progress = 0.25f * (i % 4);
+		st.progress_ppm = 250000 * (i % 4);
+		st.total_download = std::int64_t(i) << 34;
+		st.download_rate = i * 1000;
+		st.num_peers = i;
+		st.queue_position = -1;
+		st.added_time = 1400000000 + i;
+		st.next_announce = seconds(i);
+		st.name = "torrent";
+		st.save_path = "/downloads";
+		st.current_tracker = "http://tracker.com/announce";
+		return st;
+	}
+
+	bool same_status(torrent_status const& lhs, torrent_status const& rhs)
+	{
+		return lhs.info_hash == rhs.info_hash
+			&& lhs.state == rhs.state
+			&& lhs.paused == rhs.paused
+			&& lhs.auto_managed == rhs.auto_managed
+			&& lhs.has_metadata == rhs.has_metadata
+			&& lhs.need_save_resume == rhs.need_save_resume
+			&& lhs.progress == rhs.progress
+			&& lhs.progress_ppm == rhs.progress_ppm
+			&& lhs.total_download == rhs.total_download
+			&& lhs.download_rate == rhs.download_rate
+			&& lhs.num_peers == rhs.num_peers
+			&& lhs.queue_position == rhs.queue_position
+			&& lhs.added_time == rhs.added_time
+			&& lhs.next_announce == rhs.next_announce
+			&& lhs.name == rhs.name
+			&& lhs.save_path == rhs.save_path
+			&& lhs.current_tracker == rhs.current_tracker;
+	}
+
+	void write_trace(std::vector<char>* resume)
+	{
+		alert_trace_writer w;
+		error_code ec;
+		TEST_CHECK(w.open("test.trace", 1400000000, ec));
+		TEST_CHECK(!ec);
+		TEST_CHECK(w.is_open());
+
+		// the torrents already in the session
+		w.torrent_added(make_status(1));
+		w.torrent_added(make_status(2));
+		w.end_batch(0);
+
+		// an empty batch isn't written
+		w.end_batch(500);
+
+		std::vector<torrent_status> st;
+		st.push_back(make_status(1));
+		st.push_back(make_status(2));
+		st[0].download_rate = 5;
+		w.state_update(st);
+		w.torrent_alert(trace_alert::torrent_finished, make_hash(2));
+		w.end_batch(1000000);
+
+		entry rd;
+		rd["info-hash"] = make_hash(2).to_string();
+		rd["paused"] = entry::integer_type(1);
+		bencode(std::back_inserter(*resume), rd);
+		w.resume_saved(make_hash(2), rd);
+		w.torrent_updated(make_hash(1), make_hash(3));
+		w.torrent_alert(trace_alert::torrent_removed, make_hash(3));
+		w.end_batch(1500000);
+
+		feed_item item;
+		item.url = "http://feed.com/torrent";
+		item.title = "Show S01E02 720p";
+		item.size = 1234567;
+		w.rss_item(item);
+
+		// the last batch is written by close
+		w.close();
+		TEST_CHECK(!w.is_open());
+	}
+
+	void test_round_trip()
+	{
+		std::vector<char> resume;
+		write_trace(&resume);
+
+		alert_trace_reader r;
+		error_code ec;
+		TEST_CHECK(r.open("test.trace", ec));
+		TEST_CHECK(!ec);
+		TEST_CHECK(r.start_time() == 1400000000);
+
+		TEST_CHECK(r.next());
+		TEST_CHECK(r.timestamp() == 0);
+		TEST_CHECK(r.alerts().size() == 2);
+		if (r.alerts().size() == 2)
+		{
+			TEST_CHECK(r.alerts()[0].type == trace_alert::torrent_added);
+			TEST_CHECK(r.alerts()[0].info_hash == make_hash(1));
+			TEST_CHECK(r.alerts()[0].status.size() == 1);
+			TEST_CHECK(same_status(r.alerts()[0].status[0], make_status(1)));
+			TEST_CHECK(same_status(r.alerts()[1].status[0], make_status(2)));
+		}
+
+		TEST_CHECK(r.next());
+		TEST_CHECK(r.timestamp() == 1000000);
+		TEST_CHECK(r.alerts().size() == 2);
+		if (r.alerts().size() == 2)
+		{
+			trace_alert const& su = r.alerts()[0];
+			TEST_CHECK(su.type == trace_alert::state_update);
+			TEST_CHECK(su.status.size() == 2);
+			TEST_CHECK(su.status.size() == 2 && su.status[0].download_rate == 5);
+			TEST_CHECK(su.status.size() == 2 && same_status(su.status[1], make_status(2)));
+			TEST_CHECK(r.alerts()[1].type == trace_alert::torrent_finished);
+			TEST_CHECK(r.alerts()[1].info_hash == make_hash(2));
+		}
+
+		TEST_CHECK(r.next());
+		TEST_CHECK(r.timestamp() == 1500000);
+		TEST_CHECK(r.alerts().size() == 3);
+		if (r.alerts().size() == 3)
+		{
+			trace_alert const& sr = r.alerts()[0];
+			TEST_CHECK(sr.type == trace_alert::resume_saved);
+			TEST_CHECK(sr.info_hash == make_hash(2));
+			TEST_CHECK(sr.resume_data);
+			std::vector<char> buf;
+			if (sr.resume_data) bencode(std::back_inserter(buf), *sr.resume_data);
+			TEST_CHECK(buf == resume);
+
+			TEST_CHECK(r.alerts()[1].type == trace_alert::torrent_updated);
+			TEST_CHECK(r.alerts()[1].info_hash == make_hash(1));
+			TEST_CHECK(r.alerts()[1].new_info_hash == make_hash(3));
+			TEST_CHECK(r.alerts()[2].type == trace_alert::torrent_removed);
+			TEST_CHECK(r.alerts()[2].info_hash == make_hash(3));
+		}
+
+		TEST_CHECK(r.next());
+		TEST_CHECK(r.timestamp() == 1500000);
+		TEST_CHECK(r.alerts().size() == 1);
+		if (r.alerts().size() == 1)
+		{
+			feed_item const& item = r.alerts()[0].item;
+			TEST_CHECK(r.alerts()[0].type == trace_alert::rss_item);
+			TEST_CHECK(item.url == "http://feed.com/torrent");
+			TEST_CHECK(item.title == "Show S01E02 720p");
+			TEST_CHECK(item.uuid.empty());
+			TEST_CHECK(item.size == 1234567);
+		}
+
+		TEST_CHECK(!r.next());
+		TEST_CHECK(r.alerts().empty());
+	}
+
+	// a trace cut short is read up to its last complete batch
+	void test_truncated()
+	{
+		std::vector<char> resume;
+		write_trace(&resume);
+
+		std::vector<char> raw;
+		gzFile in = gzopen("test.trace", "rb");
+		char buf[4096];
+		int len;
+		while ((len = gzread(in, buf, sizeof(buf))) > 0)
+			raw.insert(raw.end(), buf, buf + len);
+		gzclose(in);
+
+		gzFile out = gzopen("test.trace", "wb");
+		gzwrite(out, &raw[0], raw.size() - 3);
+		gzclose(out);
+
+		alert_trace_reader r;
+		error_code ec;
+		TEST_CHECK(r.open("test.trace", ec));
+		int batches = 0;
+		while (r.next()) ++batches;
+		TEST_CHECK(batches == 3);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	test_round_trip();
+	test_truncated();
+
+	// not a trace
+	{
+		FILE* f = fopen("test.trace", "wb");
+		fputs("LTSTATS1 not an alert trace", f);
+		fclose(f);
+
+		alert_trace_reader r;
+		error_code ec;
+		TEST_CHECK(!r.open("test.trace", ec));
+		TEST_CHECK(ec);
+	}
+
+	{
+		alert_trace_reader r;
+		error_code ec;
+		TEST_CHECK(!r.open("non-existent.trace", ec));
+		TEST_CHECK(ec);
+	}
+
+	remove("test.trace");
+	return main_ret;
+}
+
@@ -0,0 +1,128 @@
+/*
+
+Copyright (c) 2013, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "test.hpp"
+#include "base64.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+using namespace libtorrent;
+
+int main_ret = 0;
+
+namespace {
+
+	std::string encode(std::string const& in)
+	{
+		std::string ret(base64_encoded_size(in.size()), '\0');
+		ret.resize(base64_encode(in.c_str(), in.size(), &ret[0]));
+		return ret;
+	}
+
+	std::string decode(std::string const& in)
+	{
+		std::string ret(base64_decoded_size(in.size()), '\0');
+		ret.resize(base64_decode(in.c_str(), in.size(), &ret[0]));
+		return ret;
+	}
+
+	// one character at a time, the way it's spelled out in RFC 4648
+	std::string reference_encode(std::string const& in)
+	{
+		char const* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+		std::string ret;
+		for (int i = 0; i < int(in.size()); i += 3)
+		{
+			int const n = (std::min)(3, int(in.size()) - i);
+			unsigned int v = 0;
+			for (int k = 0; k < 3; ++k)
+				v = (v << 8) | (k < n ? (unsigned char)in[i + k] : 0);
+			for (int k = 0; k < 4; ++k)
+				ret += k <= n ? alphabet[(v >> (18 - 6 * k)) & 0x3f] : '=';
+		}
+		return ret;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	fprintf(stderr, "base64 implementation: %s\n", base64_implementation());
+
+	TEST_CHECK(encode("") == "");
+	TEST_CHECK(encode("f") == "Zg==");
+	TEST_CHECK(encode("fo") == "Zm8=");
+	TEST_CHECK(encode("foo") == "Zm9v");
+	TEST_CHECK(encode("foob") == "Zm9vYg==");
+	TEST_CHECK(encode("fooba") == "Zm9vYmE=");
+	TEST_CHECK(encode("foobar") == "Zm9vYmFy");
+
+	TEST_CHECK(decode("Zg==") == "f");
+	TEST_CHECK(decode("Zm8=") == "fo");
+	TEST_CHECK(decode("Zm9vYmFy") == "foobar");
+	TEST_CHECK(base64decode("dXNlcjpwYXNzd29yZA==") == "user:password");
+	TEST_CHECK(base64decode("Zm8") == "");
+
+	// characters outside of the alphabet are skipped
+	TEST_CHECK(decode("Zm9v\r\nYm Fy") == "foobar");
+	TEST_CHECK(decode("Zm9v\xffYmFy") == "foobar");
+
+	// long enough inputs to go through the vectorized code, with all
+	// possible alignments of the tail
+	for (int len = 0; len < 600; ++len)
+	{
+		std::string data;
+		for (int i = 0; i < len; ++i) data += char(rand());
+
+		std::string const encoded = encode(data);
+		TEST_CHECK(encoded == reference_encode(data));
+		TEST_CHECK(decode(encoded) == data);
+
+		// break the lines the way MIME does
+		std::string wrapped;
+		for (int i = 0; i < int(encoded.size()); i += 76)
+		{
+			wrapped += encoded.substr(i, 76);
+			wrapped += "\r\n";
+		}
+		TEST_CHECK(decode(wrapped) == data);
+
+		// and some random garbage between blocks
+		std::string garbled = encoded;
+		if (len > 0) garbled.insert(rand() % garbled.size(), "\x80 *");
+		TEST_CHECK(decode(garbled) == data);
+	}
+
+	return main_ret;
+}
+
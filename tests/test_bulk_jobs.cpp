@@ -0,0 +1,267 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "test.hpp"
+#include "bulk_jobs.hpp"
+
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <stdio.h>
+
+using namespace libtorrent;
+
+int main_ret = 0;
+
+namespace {
+
+	sha1_hash make_hash(int i)
+	{
+		sha1_hash ret;
+		ret[0] = i & 0xff;
+		ret[1] = (i >> 8) & 0xff;
+		return ret;
+	}
+
+	std::vector<sha1_hash> make_hashes(int first, int num)
+	{
+		std::vector<sha1_hash> ret;
+		for (int i = first; i < first + num; ++i) ret.push_back(make_hash(i));
+		return ret;
+	}
+
+	// records the operations carried out, and blocks them until released
+	struct recorder
+	{
+		recorder() : blocked(false) {}
+
+		void apply(int op, sha1_hash const& ih, std::string const& path)
+		{
+			std::unique_lock<std::mutex> l(mutex);
+			while (blocked) cond.wait(l);
+			ops.push_back(op);
+			hashes.push_back(ih);
+			paths.push_back(path);
+		}
+
+		void block()
+		{
+			std::unique_lock<std::mutex> l(mutex);
+			blocked = true;
+		}
+
+		void release()
+		{
+			std::unique_lock<std::mutex> l(mutex);
+			blocked = false;
+			cond.notify_all();
+		}
+
+		int count()
+		{
+			std::unique_lock<std::mutex> l(mutex);
+			return int(ops.size());
+		}
+
+		std::mutex mutex;
+		std::condition_variable cond;
+		bool blocked;
+		std::vector<int> ops;
+		std::vector<sha1_hash> hashes;
+		std::vector<std::string> paths;
+	};
+
+	bulk_jobs::apply_fun bind_recorder(recorder& r)
+	{
+		using namespace std::placeholders;
+		return std::bind(&recorder::apply, &r, _1, _2, _3);
+	}
+
+	// waits for the job to finish, or up to a few seconds
+	bool wait_finished(bulk_jobs& b, int id)
+	{
+		for (int i = 0; i < 500; ++i)
+		{
+			bulk_jobs::job_status st;
+			if (b.status(id, st) && st.finished) return true;
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		return false;
+	}
+
+	void test_run()
+	{
+		recorder r;
+		bulk_jobs b(bind_recorder(r), 0);
+
+		int const id = b.submit(bulk_jobs::move_op, make_hashes(0, 10), "/data");
+		TEST_CHECK(id == 1);
+		TEST_CHECK(wait_finished(b, id));
+
+		bulk_jobs::job_status st;
+		TEST_CHECK(b.status(id, st));
+		TEST_CHECK(st.total == 10);
+		TEST_CHECK(st.done == 10);
+		TEST_CHECK(!st.cancelled);
+		TEST_CHECK(st.path == "/data");
+
+		TEST_CHECK(r.count() == 10);
+		for (int i = 0; i < r.count(); ++i)
+		{
+			TEST_CHECK(r.ops[i] == bulk_jobs::move_op);
+			TEST_CHECK(r.hashes[i] == make_hash(i));
+			TEST_CHECK(r.paths[i] == "/data");
+		}
+
+		// an empty job finishes right away
+		int const empty = b.submit(bulk_jobs::recheck_op, std::vector<sha1_hash>());
+		TEST_CHECK(empty == 2);
+		TEST_CHECK(b.status(empty, st));
+		TEST_CHECK(st.finished && st.total == 0);
+		TEST_CHECK(!b.status(100, st));
+	}
+
+	void test_coalesce_and_cancel()
+	{
+		recorder r;
+		r.block();
+		bulk_jobs b(bind_recorder(r), 0);
+
+		int const first = b.submit(bulk_jobs::remove_data_op, make_hashes(0, 5));
+
+		// the same torrents again are already waiting, except for the one
+		// in progress (which may not have been picked up yet)
+		int const second = b.submit(bulk_jobs::remove_data_op, make_hashes(1, 4));
+		TEST_CHECK(second == first);
+
+		// a different operation on the same torrents is a new job, as are
+		// new torrents
+		int const third = b.submit(bulk_jobs::recheck_op, make_hashes(0, 5));
+		TEST_CHECK(third != first);
+		int const fourth = b.submit(bulk_jobs::remove_data_op, make_hashes(3, 4));
+		TEST_CHECK(fourth != first && fourth != third);
+		bulk_jobs::job_status st;
+		TEST_CHECK(b.status(fourth, st));
+		TEST_CHECK(st.total == 2);
+
+		std::vector<bulk_jobs::job_status> jobs;
+		b.jobs(jobs);
+		TEST_CHECK(jobs.size() == 3);
+		TEST_CHECK(jobs.size() == 3 && jobs[0].id == first && jobs[2].id == fourth);
+
+		TEST_CHECK(b.cancel(third));
+		TEST_CHECK(!b.cancel(third));
+		TEST_CHECK(b.status(third, st));
+		TEST_CHECK(st.cancelled && st.finished);
+
+		// the cancelled torrents can be queued again
+		int const fifth = b.submit(bulk_jobs::recheck_op, make_hashes(0, 1));
+		TEST_CHECK(fifth != third);
+
+		r.release();
+		TEST_CHECK(wait_finished(b, fifth));
+		TEST_CHECK(wait_finished(b, fourth));
+		TEST_CHECK(wait_finished(b, first));
+
+		// 5 removes, 2 more removes and 1 recheck. The cancelled job didn't
+		// get to run
+		TEST_CHECK(r.count() == 8);
+		int rechecks = 0;
+		for (int i = 0; i < r.count(); ++i)
+			if (r.ops[i] == bulk_jobs::recheck_op) ++rechecks;
+		TEST_CHECK(rechecks == 1);
+	}
+
+	void test_remove_with_data()
+	{
+		recorder r;
+		r.block();
+		bulk_jobs b(bind_recorder(r), 0);
+
+		// the first torrent may have been picked up already, leave it out
+		int const first = b.submit(bulk_jobs::recheck_op, make_hashes(0, 1));
+		int const remove = b.submit(bulk_jobs::remove_op, make_hashes(1, 4));
+
+		// removing the torrents with their data upgrades the waiting
+		// removes, instead of queuing removes that would find them gone
+		int const with_data = b.submit(bulk_jobs::remove_data_op, make_hashes(2, 2));
+		TEST_CHECK(with_data == remove);
+
+		// and removing torrents that are waiting to be removed with their
+		// data is already taken care of
+		int const second = b.submit(bulk_jobs::remove_data_op, make_hashes(5, 1));
+		int const again = b.submit(bulk_jobs::remove_op, make_hashes(5, 1));
+		TEST_CHECK(again == second);
+
+		r.release();
+		TEST_CHECK(wait_finished(b, first));
+		TEST_CHECK(wait_finished(b, remove));
+		TEST_CHECK(wait_finished(b, second));
+
+		TEST_CHECK(r.count() == 6);
+		for (int i = 1; i < r.count(); ++i)
+		{
+			int const expect = (r.hashes[i] == make_hash(2) || r.hashes[i] == make_hash(3)
+				|| r.hashes[i] == make_hash(5))
+				? bulk_jobs::remove_data_op : bulk_jobs::remove_op;
+			TEST_CHECK(r.ops[i] == expect);
+		}
+	}
+
+	void test_rate()
+	{
+		recorder r;
+		bulk_jobs b(bind_recorder(r), 20);
+		TEST_CHECK(b.rate() == 20);
+
+		std::chrono::steady_clock::time_point const start
+			= std::chrono::steady_clock::now();
+		int const id = b.submit(bulk_jobs::recheck_op, make_hashes(0, 5));
+		TEST_CHECK(wait_finished(b, id));
+
+		// 5 torrents at 20 per second take at least 200 ms
+		TEST_CHECK(std::chrono::steady_clock::now() - start
+			>= std::chrono::milliseconds(190));
+		TEST_CHECK(r.count() == 5);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	test_run();
+	test_coalesce_and_cancel();
+	test_remove_with_data();
+	test_rate();
+
+	return main_ret;
+}
@@ -0,0 +1,67 @@
+/*
+
+Copyright (c) 2013, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include <stdio.h>
+#include "test.hpp"
+#include "escape_json.hpp"
+
+using namespace libtorrent;
+
+int main_ret = 0;
+
+int main(int argc, char* argv[])
+{
+	TEST_CHECK(escape_json("") == "");
+	TEST_CHECK(escape_json("plain ascii string, longer than one block")
+		== "plain ascii string, longer than one block");
+	TEST_CHECK(escape_json("0123456789abcdef\"\\") == "0123456789abcdef\\\"\\\\");
+	TEST_CHECK(escape_json("a\nb\tc\x01") == "a\\nb\\tc\\u0001");
+
+	// non-ASCII is emitted as \u escapes, with surrogate pairs outside the BMP
+	TEST_CHECK(escape_json("\xc3\xa5") == "\\u00e5");
+	TEST_CHECK(escape_json("0123456789abcdef\xe2\x82\xac") == "0123456789abcdef\\u20ac");
+	TEST_CHECK(escape_json("\xf0\x9f\x98\x80") == "\\ud83d\\ude00");
+
+	// invalid UTF-8 is replaced, one byte at a time
+	TEST_CHECK(escape_json("\xff" "a") == "\\ufffda");
+	TEST_CHECK(escape_json("\xc3") == "\\ufffd");
+	TEST_CHECK(escape_json("\xc0\x80") == "\\ufffd\\ufffd");
+	TEST_CHECK(escape_json("\xed\xa0\x80") == "\\ufffd\\ufffd\\ufffd");
+
+	// the buffer version appends
+	std::vector<char> out(1, '"');
+	escape_json("x\"y", 3, out);
+	TEST_CHECK(std::string(out.begin(), out.end()) == "\"x\\\"y");
+
+	return main_ret;
+}
+
@@ -0,0 +1,126 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "test.hpp"
+#include "http_compression.hpp"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <string.h>
+#include <stdio.h>
+#include <zlib.h>
+
+using namespace libtorrent;
+
+int main_ret = 0;
+
+namespace {
+
+	void test_accepted_coding()
+	{
+		TEST_CHECK(accepted_coding(NULL) == identity_coding);
+		TEST_CHECK(accepted_coding("") == identity_coding);
+		TEST_CHECK(accepted_coding("identity") == identity_coding);
+		TEST_CHECK(accepted_coding("gzip") == gzip_coding);
+		TEST_CHECK(accepted_coding("GZIP") == gzip_coding);
+		TEST_CHECK(accepted_coding("deflate") == deflate_coding);
+		TEST_CHECK(accepted_coding("gzip, deflate, br") == gzip_coding);
+		TEST_CHECK(accepted_coding("deflate, gzip;q=0.5") == deflate_coding);
+		TEST_CHECK(accepted_coding("gzip;q=0, deflate") == deflate_coding);
+		TEST_CHECK(accepted_coding("gzip; q=0") == identity_coding);
+		TEST_CHECK(accepted_coding("x-gzip") == gzip_coding);
+		TEST_CHECK(accepted_coding("*") == gzip_coding);
+		TEST_CHECK(accepted_coding("*;q=0") == identity_coding);
+		TEST_CHECK(accepted_coding("gzip;q=0, *") == deflate_coding);
+		TEST_CHECK(accepted_coding("gzipx, deflatey") == identity_coding);
+
+		TEST_CHECK(strcmp(coding_name(gzip_coding), "gzip") == 0);
+		TEST_CHECK(strcmp(coding_name(deflate_coding), "deflate") == 0);
+	}
+
+	// inflates a gzip or zlib stream
+	std::string inflate_all(std::vector<char> const& in)
+	{
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+		// 32 + 15 detects gzip or zlib headers
+		if (inflateInit2(&zs, 32 + 15) != Z_OK) return "";
+		std::string ret;
+		char buf[1024];
+		zs.next_in = (Bytef*)&in[0];
+		zs.avail_in = in.size();
+		int r;
+		do
+		{
+			zs.next_out = (Bytef*)buf;
+			zs.avail_out = sizeof(buf);
+			r = inflate(&zs, Z_NO_FLUSH);
+			ret.append(buf, sizeof(buf) - zs.avail_out);
+		} while (r == Z_OK);
+		inflateEnd(&zs);
+		return r == Z_STREAM_END ? ret : "";
+	}
+
+	void test_compressor(int coding)
+	{
+		std::string body;
+		for (int i = 0; i < 5000; ++i)
+			body += "{\"hash\":\"0123456789abcdef\",\"progress\":1000},";
+
+		body_compressor c(coding, 6);
+		std::vector<char> out;
+
+		// fed in pieces, the way a streamed response is
+		int const piece = 7000;
+		for (int i = 0; i < int(body.size()); i += piece)
+		{
+			int const len = (std::min)(piece, int(body.size()) - i);
+			bool const last = i + len == int(body.size());
+			TEST_CHECK(c.compress(body.data() + i, len, out, last));
+		}
+
+		TEST_CHECK(out.size() < body.size() / 10);
+		if (coding == gzip_coding)
+			TEST_CHECK(out.size() > 2 && out[0] == '\x1f' && out[1] == '\x8b');
+		TEST_CHECK(inflate_all(out) == body);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	test_accepted_coding();
+	test_compressor(gzip_coding);
+	test_compressor(deflate_coding);
+
+	return main_ret;
+}
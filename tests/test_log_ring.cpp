@@ -0,0 +1,181 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "test.hpp"
+#include "log_ring.hpp"
+
+#include <thread>
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+
+using namespace libtorrent;
+
+int main_ret = 0;
+
+namespace {
+
+	// the messages written to f, without their time stamps
+	std::vector<std::string> read_log(FILE* f)
+	{
+		std::vector<std::string> ret;
+		rewind(f);
+		char line[512];
+		while (fgets(line, sizeof(line), f))
+		{
+			char const* msg = strchr(line, '\t');
+			if (msg == NULL) continue;
+			std::string m(msg + 1);
+			if (!m.empty() && m[m.size() - 1] == '\n') m.resize(m.size() - 1);
+			ret.push_back(m);
+		}
+		return ret;
+	}
+
+	void test_post()
+	{
+		FILE* f = tmpfile();
+		{
+			log_ring log(f, 16);
+			TEST_CHECK(log.post(log_ring::peer_error, "error %d", 1));
+			TEST_CHECK(log.post(log_ring::request, "request %s", "foo"));
+			TEST_CHECK(!log.post(log_ring::num_categories, "invalid"));
+			log.flush();
+
+			std::vector<std::string> msgs = read_log(f);
+			TEST_CHECK(msgs.size() == 2);
+			if (msgs.size() == 2)
+			{
+				TEST_CHECK(msgs[0] == "error 1");
+				TEST_CHECK(msgs[1] == "request foo");
+			}
+			TEST_CHECK(log.posted() == 2);
+			TEST_CHECK(log.dropped() == 0);
+
+			// long messages are truncated
+			std::string big(1000, 'x');
+			TEST_CHECK(log.post(log_ring::request, "%s", big.c_str()));
+		}
+
+		// the destructor writes what's left
+		std::vector<std::string> msgs = read_log(f);
+		TEST_CHECK(msgs.size() == 3);
+		if (msgs.size() == 3)
+			TEST_CHECK(msgs[2] == std::string(log_ring::max_message - 1, 'x'));
+		fclose(f);
+	}
+
+	void test_sampling()
+	{
+		FILE* f = tmpfile();
+		log_ring log(f, 64);
+		log.set_sample_rate(log_ring::peer_disconnect, 3);
+		log.set_sample_rate(log_ring::network_error, 0);
+
+		for (int i = 0; i < 9; ++i)
+		{
+			log.post(log_ring::peer_disconnect, "disconnect %d", i);
+			log.post(log_ring::network_error, "network %d", i);
+		}
+		log.post(log_ring::torrent_error, "torrent");
+		log.flush();
+
+		std::vector<std::string> msgs = read_log(f);
+		TEST_CHECK(msgs.size() == 4);
+		if (msgs.size() == 4)
+		{
+			TEST_CHECK(msgs[0] == "disconnect 0");
+			TEST_CHECK(msgs[1] == "disconnect 3");
+			TEST_CHECK(msgs[2] == "disconnect 6");
+			TEST_CHECK(msgs[3] == "torrent");
+		}
+		TEST_CHECK(log.posted() == 4);
+		TEST_CHECK(log.sampled_out() == 15);
+		fclose(f);
+	}
+
+	void test_threads()
+	{
+		FILE* f = tmpfile();
+		int const num_threads = 4;
+		int const per_thread = 5000;
+		std::uint64_t posted = 0;
+		std::uint64_t dropped = 0;
+		{
+			// a small ring, for the producers to run into the writer
+			log_ring log(f, 64);
+			std::vector<std::thread> threads;
+			for (int t = 0; t < num_threads; ++t)
+			{
+				threads.push_back(std::thread([&log, t, per_thread]()
+				{
+					for (int i = 0; i < per_thread; ++i)
+						log.post(log_ring::request, "thread %d record %d", t, i);
+				}));
+			}
+			for (int t = 0; t < num_threads; ++t) threads[t].join();
+			log.flush();
+			posted = log.posted();
+			dropped = log.dropped();
+		}
+		TEST_CHECK(posted + dropped == std::uint64_t(num_threads * per_thread));
+
+		// every record that made it in is written, whole and in the order
+		// its thread posted it
+		std::vector<std::string> msgs = read_log(f);
+		std::vector<int> last(num_threads, -1);
+		std::uint64_t records = 0;
+		for (std::vector<std::string>::iterator i = msgs.begin()
+			, end(msgs.end()); i != end; ++i)
+		{
+			int t, r;
+			if (sscanf(i->c_str(), "thread %d record %d", &t, &r) != 2) continue;
+			TEST_CHECK(t >= 0 && t < num_threads);
+			if (t < 0 || t >= num_threads) continue;
+			TEST_CHECK(r > last[t]);
+			last[t] = r;
+			++records;
+		}
+		TEST_CHECK(records == posted);
+		fclose(f);
+	}
+}
+
+int main(int argc, char const* argv[])
+{
+	test_post();
+	test_sampling();
+	test_threads();
+	return main_ret;
+}
+
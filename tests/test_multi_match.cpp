@@ -0,0 +1,96 @@
+/*
+
+Copyright (c) 2013, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "test.hpp"
+#include "multi_match.hpp"
+
+#include <stdio.h>
+#include <algorithm>
+
+using namespace libtorrent;
+
+int main_ret = 0;
+
+int main(int argc, char* argv[])
+{
+	multi_match m;
+	int he = m.add("he");
+	int she = m.add("she");
+	int his = m.add("his");
+	int hers = m.add("hers");
+	TEST_CHECK(m.add("she") == she);
+	TEST_CHECK(m.num_patterns() == 4);
+	m.compile();
+
+	std::vector<bool> found;
+	m.find("ushers", found);
+	TEST_CHECK(found.size() == 4);
+	TEST_CHECK(found[he]);
+	TEST_CHECK(found[she]);
+	TEST_CHECK(found[hers]);
+	TEST_CHECK(!found[his]);
+
+	// the previous result is cleared
+	m.find("this", found);
+	TEST_CHECK(!found[he]);
+	TEST_CHECK(!found[she]);
+	TEST_CHECK(!found[hers]);
+	TEST_CHECK(found[his]);
+
+	m.find("", found);
+	TEST_CHECK(std::count(found.begin(), found.end(), true) == 0);
+
+	// matching is case sensitive
+	m.find("SHE", found);
+	TEST_CHECK(!found[she]);
+
+	// a pattern that's a suffix of another one, found through the
+	// failure links
+	multi_match m2;
+	int a = m2.add("foo bar s01");
+	int b = m2.add("bar");
+	int c = m2.add("o b");
+	m2.compile();
+	m2.find("the foo bar s02", found);
+	TEST_CHECK(!found[a]);
+	TEST_CHECK(found[b]);
+	TEST_CHECK(found[c]);
+
+	m2.clear();
+	TEST_CHECK(m2.num_patterns() == 0);
+	m2.compile();
+	m2.find("foo bar", found);
+	TEST_CHECK(found.empty());
+
+	return main_ret;
+}
+
@@ -0,0 +1,193 @@
+/*
+
+Copyright (c) 2013, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "test.hpp"
+#include "multipart.hpp"
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+using namespace libtorrent;
+
+int main_ret = 0;
+
+namespace {
+
+	struct part_t
+	{
+		std::map<std::string, std::string> headers;
+		std::string body;
+		bool complete;
+	};
+
+	struct collect_parts : multipart_parser::handler
+	{
+		virtual bool on_part(std::map<std::string, std::string> const& h)
+		{
+			part_t p;
+			p.headers = h;
+			p.complete = false;
+			parts.push_back(p);
+			return true;
+		}
+
+		virtual bool on_data(char const* buf, int len)
+		{
+			parts.back().body.append(buf, len);
+			return true;
+		}
+
+		virtual bool on_part_end()
+		{
+			parts.back().complete = true;
+			return true;
+		}
+
+		std::vector<part_t> parts;
+	};
+
+	// feeds body to a parser in chunks of chunk_size bytes
+	bool parse(std::string const& body, int chunk_size, collect_parts& h
+		, std::string const& boundary = "xyz")
+	{
+		multipart_parser p(boundary, h);
+		for (int i = 0; i < int(body.size()); i += chunk_size)
+		{
+			int const len = (std::min)(chunk_size, int(body.size()) - i);
+			if (!p.incoming(body.c_str() + i, len)) return false;
+		}
+		return p.done();
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	std::string const body =
+		"preamble\r\n"
+		"--xyz\r\n"
+		"Content-Disposition: form-data; name=\"torrent_file\"; filename=\"a.torrent\"\r\n"
+		"Content-Type:   application/x-bittorrent\r\n"
+		"\r\n"
+		"d4:infod--xy\r\n-xyzee\r\n"
+		"--xyz\r\n"
+		"\r\n"
+		"second\r\n"
+		"--xyz--\r\n"
+		"epilogue";
+
+	// the result must not depend on how the body is split up
+	int const chunk_sizes[] = { 1, 2, 3, 7, 100, 10000 };
+	for (int c = 0; c < int(sizeof(chunk_sizes)/sizeof(chunk_sizes[0])); ++c)
+	{
+		collect_parts h;
+		TEST_CHECK(parse(body, chunk_sizes[c], h));
+		TEST_CHECK(h.parts.size() == 2);
+		if (h.parts.size() != 2) continue;
+
+		TEST_CHECK(h.parts[0].complete);
+		TEST_CHECK(h.parts[0].headers.size() == 2);
+		TEST_CHECK(h.parts[0].headers["content-type"] == "application/x-bittorrent");
+		TEST_CHECK(h.parts[0].body == "d4:infod--xy\r\n-xyzee");
+
+		// a part without headers
+		TEST_CHECK(h.parts[1].complete);
+		TEST_CHECK(h.parts[1].headers.empty());
+		TEST_CHECK(h.parts[1].body == "second");
+	}
+
+	// the first delimiter doesn't need a preceding line break
+	{
+		collect_parts h;
+		TEST_CHECK(parse("--xyz\r\n\r\nfoo\r\n--xyz--", 1, h));
+		TEST_CHECK(h.parts.size() == 1);
+		TEST_CHECK(h.parts.size() == 1 && h.parts[0].body == "foo");
+	}
+
+	// an empty part
+	{
+		collect_parts h;
+		TEST_CHECK(parse("--xyz\r\n\r\n\r\n--xyz--", 3, h));
+		TEST_CHECK(h.parts.size() == 1);
+		TEST_CHECK(h.parts.size() == 1 && h.parts[0].body.empty());
+	}
+
+	// a truncated body never completes
+	{
+		collect_parts h;
+		TEST_CHECK(!parse("--xyz\r\n\r\nfoo\r\n--xy", 4, h));
+		TEST_CHECK(h.parts.size() == 1);
+		TEST_CHECK(h.parts.size() == 1 && !h.parts[0].complete);
+	}
+
+	// a header line without a colon
+	{
+		collect_parts h;
+		multipart_parser p("xyz", h);
+		std::string const b = "--xyz\r\nfoobar\r\n\r\nfoo\r\n--xyz--";
+		TEST_CHECK(!p.incoming(b.c_str(), b.size()));
+		TEST_CHECK(!p.done());
+
+		// once failed, the parser stays failed
+		TEST_CHECK(!p.incoming("--xyz--", 7));
+	}
+
+	// headers can't grow without bounds
+	{
+		collect_parts h;
+		multipart_parser p("xyz", h);
+		std::string b = "--xyz\r\nX-Foo: ";
+		b.append(multipart_parser::max_header_size, 'a');
+		TEST_CHECK(!p.incoming(b.c_str(), b.size()));
+	}
+
+	// a handler can abort the parse
+	{
+		struct reject_parts : collect_parts
+		{
+			virtual bool on_part(std::map<std::string, std::string> const&)
+			{ return false; }
+		} h;
+		multipart_parser p("xyz", h);
+		std::string const b = "--xyz\r\n\r\nfoo\r\n--xyz--";
+		TEST_CHECK(!p.incoming(b.c_str(), b.size()));
+	}
+
+	TEST_CHECK(multipart_boundary("multipart/form-data; boundary=abc") == "abc");
+	TEST_CHECK(multipart_boundary("multipart/form-data; boundary=\"a b\"; foo=bar") == "a b");
+	TEST_CHECK(multipart_boundary("multipart/form-data; boundary=abc; charset=utf-8") == "abc");
+	TEST_CHECK(multipart_boundary("multipart/form-data").empty());
+	TEST_CHECK(multipart_boundary(NULL).empty());
+
+	return main_ret;
+}
+
@@ -0,0 +1,103 @@
+/*
+
+Copyright (c) 2014, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "piece_cache.hpp"
+
+#include "test.hpp"
+
+using namespace libtorrent;
+
+int main_ret = 0;
+
+boost::shared_array<char> make_buffer(int size)
+{
+	boost::shared_array<char> ret(new char[size]);
+	memset(ret.get(), 0, size);
+	return ret;
+}
+
+int main(int argc, char* argv[])
+{
+	sha1_hash ih1;
+	sha1_hash ih2;
+	ih2[0] = 1;
+
+	piece_cache c(300);
+	boost::shared_array<char> buf;
+	int size = 0;
+
+	TEST_CHECK(c.find(ih1, 0, buf, size) == false);
+
+	boost::shared_array<char> b0 = make_buffer(100);
+	c.insert(ih1, 0, b0, 100);
+	c.insert(ih1, 1, make_buffer(100), 100);
+	c.insert(ih2, 0, make_buffer(100), 100);
+
+	// the buffers are shared, not copied
+	TEST_CHECK(c.find(ih1, 0, buf, size));
+	TEST_CHECK(buf.get() == b0.get());
+	TEST_CHECK(size == 100);
+
+	// pieces are keyed by info-hash and piece
+	TEST_CHECK(c.find(ih2, 0, buf, size));
+	TEST_CHECK(c.find(ih2, 1, buf, size) == false);
+
+	// (ih1, 1) is the least recently used, it's evicted first
+	c.insert(ih2, 1, make_buffer(100), 100);
+	TEST_CHECK(c.find(ih1, 1, buf, size) == false);
+	TEST_CHECK(c.find(ih1, 0, buf, size));
+
+	piece_cache::stats_t st = c.stats();
+	TEST_CHECK(st.num_pieces == 3);
+	TEST_CHECK(st.size == 300);
+	TEST_CHECK(st.evictions == 1);
+	TEST_CHECK(st.hits == 3);
+	TEST_CHECK(st.misses == 3);
+
+	// pieces bigger than the whole cache aren't cached
+	c.insert(ih1, 5, make_buffer(400), 400);
+	TEST_CHECK(c.find(ih1, 5, buf, size) == false);
+	TEST_CHECK(c.stats().num_pieces == 3);
+
+	c.evict_torrent(ih2);
+	st = c.stats();
+	TEST_CHECK(st.num_pieces == 1);
+	TEST_CHECK(st.size == 100);
+
+	c.set_max_size(50);
+	st = c.stats();
+	TEST_CHECK(st.num_pieces == 0);
+	TEST_CHECK(st.size == 0);
+
+	return main_ret;
+}
+
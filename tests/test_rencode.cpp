@@ -32,6 +32,9 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "rencode.hpp"
 
+#include <chrono>
+#include <stdio.h>
+
 #include "test.hpp"
 
 enum renc_typecode
@@ -70,6 +73,119 @@ using namespace libtorrent;
 
 int main_ret = 0;
 
+// feeds the input to an rdecoder one byte at a time and makes sure it ends
+// up with the same tokens as rdecode()
+void test_streaming(char const* input, int len)
+{
+	rtok_t tokens[100];
+	int num_tokens = rdecode(tokens, 100, input, len);
+
+	rdecoder dec;
+	int ret = 0;
+	for (int i = 1; i <= len && ret == 0; ++i)
+		ret = dec.feed(input, i);
+
+	TEST_CHECK(ret == 1);
+	TEST_CHECK(dec.num_tokens() == num_tokens);
+	if (dec.num_tokens() != num_tokens) return;
+	for (int i = 0; i < num_tokens; ++i)
+	{
+		TEST_CHECK(dec.tokens()[i].type() == tokens[i].type());
+		TEST_CHECK(dec.tokens()[i].num_items() == tokens[i].num_items());
+	}
+}
+
+// collects the output of a streaming rencoder
+struct buffer_sink : rencoder::sink
+{
+	buffer_sink() : finished(0) {}
+	virtual void write(char const* buf, int len, bool finish)
+	{
+		out.insert(out.end(), buf, buf + len);
+		if (finish) ++finished;
+	}
+	std::vector<char> out;
+	int finished;
+};
+
+void encode_items(rencoder& out, std::string const& big)
+{
+	out.append_list(7);
+	out.append_int(1);
+	out.append_int(-0x70);
+	out.append_int(0x4080);
+	out.append_int(0x12345678);
+	out.append_int(0x123456789LL);
+	out.append_string("foo");
+	out.append_string(big);
+}
+
+// builds a message of at least size bytes, shaped like a get_torrents_status
+// response: a dict of info-hash -> dict of fields
+void build_message(rencoder& out, int size)
+{
+	out.append_dict();
+	char hash[41];
+	for (int i = 0; out.len() < size; ++i)
+	{
+		snprintf(hash, sizeof(hash), "%040d", i);
+		out.append_string(hash, 40);
+		out.append_dict(5);
+		out.append_string("name");
+		out.append_string("ubuntu-16.04-desktop-amd64.iso");
+		out.append_string("total_done");
+		out.append_int(1485881344LL + i);
+		out.append_string("progress");
+		out.append_float(0.5f);
+		out.append_string("paused");
+		out.append_bool(i & 1);
+		out.append_string("file_priorities");
+		out.append_list(8);
+		for (int k = 0; k < 8; ++k) out.append_int(k & 3);
+	}
+	out.append_term();
+}
+
+void bench_decode()
+{
+	rencoder out;
+	build_message(out, 1024 * 1024);
+
+	rdecoder dec(10000000);
+	int const iterations = 20;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	int num_tokens = 0;
+	for (int i = 0; i < iterations; ++i)
+		num_tokens = dec.decode(out.data(), out.len());
+	std::chrono::steady_clock::duration const one_shot
+		= std::chrono::steady_clock::now() - start;
+	TEST_CHECK(num_tokens > 0);
+
+	// the way messages arrive from the network, a chunk at a time
+	start = std::chrono::steady_clock::now();
+	int ret = 0;
+	for (int i = 0; i < iterations; ++i)
+	{
+		dec.reset();
+		for (int len = 16 * 1024; ; len += 16 * 1024)
+		{
+			ret = dec.feed(out.data(), (std::min)(len, out.len()));
+			if (ret != 0 || len >= out.len()) break;
+		}
+	}
+	std::chrono::steady_clock::duration const streaming
+		= std::chrono::steady_clock::now() - start;
+	TEST_CHECK(ret == 1);
+	TEST_CHECK(dec.num_tokens() == num_tokens);
+
+	double const mb = double(out.len()) * iterations / (1024 * 1024);
+	printf("decoding %d byte messages (%d tokens): %.1f MB/s, streamed: %.1f MB/s\n"
+		, out.len(), num_tokens
+		, mb / std::chrono::duration<double>(one_shot).count()
+		, mb / std::chrono::duration<double>(streaming).count());
+}
+
 int main(int argc, char* argv[])
 {
 	rtok_t tokens[100];
@@ -170,6 +286,91 @@ int main(int argc, char* argv[])
 	TEST_CHECK(tokens[0].type() == type_dict);
 	TEST_CHECK(tokens[0].num_items() == 0);
 
+	test_streaming(input1, sizeof(input1));
+	test_streaming(input2, sizeof(input2));
+	test_streaming(input3, sizeof(input3));
+	test_streaming(input4, sizeof(input4));
+	test_streaming(input5, sizeof(input5));
+	test_streaming(input6, sizeof(input6) - 1);
+	test_streaming(input7, sizeof(input7));
+	test_streaming(input8, sizeof(input8));
+	test_streaming(input9, sizeof(input9));
+	test_streaming(input10, sizeof(input10));
+
+	{
+		// a truncated item is not complete
+		rdecoder dec;
+		TEST_CHECK(dec.feed(input5, sizeof(input5) - 1) == 0);
+
+		// dict keys must be strings
+		char bad_key[] = { DICT_FIXED_START+1, CHR_TRUE, CHR_FALSE };
+		dec.reset();
+		TEST_CHECK(dec.feed(bad_key, sizeof(bad_key)) == -1);
+
+		// integers must be terminated within the size of an int64
+		char bad_int[] = { CHR_INT, '1', '1', '1', '1', '1', '1', '1', '1', '1'
+			, '1', '1', '1', '1', '1', '1', '1', '1', '1', '1', '1', '1', '1' };
+		dec.reset();
+		TEST_CHECK(dec.feed(bad_int, sizeof(bad_int)) == -1);
+
+		// the token limit is enforced
+		rdecoder small(3);
+		TEST_CHECK(small.feed(input5, sizeof(input5)) == -1);
+
+		// releasing the token pool leaves the decoder usable
+		dec.reset();
+		TEST_CHECK(dec.feed(input5, sizeof(input5)) == 1);
+		int const num = dec.num_tokens();
+		dec.reset();
+		dec.shrink(0);
+		TEST_CHECK(dec.num_tokens() == 0);
+		TEST_CHECK(dec.feed(input5, sizeof(input5)) == 1);
+		TEST_CHECK(dec.num_tokens() == num);
+	}
+
+	{
+		std::string big(100000, 'x');
+		rencoder out;
+		encode_items(out, big);
+
+		ret = rdecode(tokens, 100, out.data(), out.len());
+		TEST_CHECK(ret == 8);
+		TEST_CHECK(tokens[0].type() == type_list);
+		TEST_CHECK(tokens[0].num_items() == 7);
+		TEST_CHECK(tokens[1].integer(out.data()) == 1);
+		TEST_CHECK(tokens[2].integer(out.data()) == -0x70);
+		TEST_CHECK(tokens[3].integer(out.data()) == 0x4080);
+		TEST_CHECK(tokens[4].integer(out.data()) == 0x12345678);
+		TEST_CHECK(tokens[5].integer(out.data()) == 0x123456789LL);
+		TEST_CHECK(tokens[6].string(out.data()) == "foo");
+		TEST_CHECK(tokens[7].string(out.data()) == big);
+
+		// a streaming rencoder produces the same bytes, without holding on
+		// to all of them
+		buffer_sink sink;
+		rencoder stream(&sink, 16);
+		encode_items(stream, big);
+		TEST_CHECK(stream.len() <= 16);
+		stream.finish();
+		TEST_CHECK(stream.len() == 0);
+		TEST_CHECK(sink.finished == 1);
+		TEST_CHECK(int(sink.out.size()) == out.len());
+		TEST_CHECK(std::equal(sink.out.begin(), sink.out.end(), out.data()));
+	}
+
+	{
+		// containers with more than 65535 items
+		rencoder out;
+		out.append_list();
+		for (int i = 0; i < 100000; ++i) out.append_int(i & 31);
+		out.append_term();
+
+		rdecoder dec(200000);
+		TEST_CHECK(dec.decode(out.data(), out.len()) == 100001);
+		TEST_CHECK(dec.tokens()[0].num_items() == 100000);
+	}
+
+	bench_decode();
+
 	return main_ret;
 }
-
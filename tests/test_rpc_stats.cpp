@@ -0,0 +1,346 @@
+/*
+
+Copyright (c) 2013, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "test.hpp"
+#include "rpc_stats.hpp"
+
+#include <thread>
+#include <memory>
+#include <stdio.h>
+
+using namespace libtorrent;
+
+int main_ret = 0;
+
+namespace {
+
+	void test_buckets()
+	{
+		// the small values have a bucket each
+		for (int i = 0; i < 8; ++i)
+		{
+			TEST_CHECK(log_histogram::bucket(i) == i);
+			TEST_CHECK(log_histogram::bucket_max(i) == std::uint64_t(i));
+		}
+
+		// every value falls in a bucket whose range contains it, and the
+		// buckets are contiguous
+		std::uint64_t prev_max = 7;
+		for (int b = 8; b < log_histogram::num_buckets - 1; ++b)
+		{
+			std::uint64_t const lo = prev_max + 1;
+			std::uint64_t const hi = log_histogram::bucket_max(b);
+			TEST_CHECK(hi >= lo);
+			TEST_CHECK(log_histogram::bucket(lo) == b);
+			TEST_CHECK(log_histogram::bucket(hi) == b);
+			// within 25% of the bottom of the bucket
+			TEST_CHECK(hi - lo <= lo / 4);
+			prev_max = hi;
+		}
+
+		TEST_CHECK(log_histogram::bucket(~std::uint64_t(0)) == log_histogram::num_buckets - 1);
+		TEST_CHECK(log_histogram::bucket(std::uint64_t(1) << 50) == log_histogram::num_buckets - 1);
+	}
+
+	void test_quantiles()
+	{
+		log_histogram h;
+		TEST_CHECK(h.count() == 0);
+		TEST_CHECK(h.quantile(0.5) == 0);
+
+		for (int i = 1; i <= 1000; ++i) h.record(i);
+
+		TEST_CHECK(h.count() == 1000);
+		TEST_CHECK(h.sum() == 500500);
+		TEST_CHECK(h.max() == 1000);
+
+		std::uint64_t const p50 = h.quantile(0.5);
+		TEST_CHECK(p50 >= 500 && p50 <= 500 * 5 / 4);
+		std::uint64_t const p99 = h.quantile(0.99);
+		TEST_CHECK(p99 >= 990 && p99 <= 1000);
+		TEST_CHECK(h.quantile(1.) == 1000);
+		TEST_CHECK(h.quantile(0.) == 1);
+	}
+
+	void test_calls()
+	{
+		std::vector<std::string> names;
+		names.push_back("get");
+		names.push_back("set");
+
+		std::vector<rpc_metric> before = rpc_metrics();
+
+		rpc_stats s("test", names);
+		{
+			rpc_stats::call c(s, 0);
+			c.add_bytes(100);
+		}
+		{
+			rpc_stats::call c(s, 1);
+			rpc_stats::wait_timer w;
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			rpc_stats::set_error();
+		}
+		{
+			// not an RPC, it's not recorded
+			rpc_stats::call c(s, -1);
+			rpc_stats::set_error();
+		}
+		// not in a call, this is a no-op
+		rpc_stats::set_error();
+
+		TEST_CHECK(s.function(0).calls == 1);
+		TEST_CHECK(s.function(0).errors == 0);
+		TEST_CHECK(s.function(0).bytes.sum() == 100);
+		TEST_CHECK(s.function(1).calls == 1);
+		TEST_CHECK(s.function(1).errors == 1);
+		TEST_CHECK(s.function(1).wait_us.sum() >= 2000);
+		TEST_CHECK(s.function(1).latency_us.sum() >= s.function(1).wait_us.sum());
+
+		std::vector<rpc_metric> m = rpc_metrics();
+		TEST_CHECK(m.size() == before.size() + 18);
+		int const base = before.size();
+		TEST_CHECK(m[base].name == "rpc.test.get.calls");
+		TEST_CHECK(m[base].counter);
+		TEST_CHECK(m[base + 9 + 1].name == "rpc.test.set.errors");
+		TEST_CHECK(m[base + 3].name == "rpc.test.get.latency_p50_us");
+		TEST_CHECK(!m[base + 3].counter);
+
+		std::uint64_t v = 0;
+		TEST_CHECK(rpc_metric_value(m[base + 6].id, v));
+		TEST_CHECK(v == 100);
+		TEST_CHECK(rpc_metric_value(m[base + 9 + 1].id, v));
+		TEST_CHECK(v == 1);
+		TEST_CHECK(!rpc_metric_value(num_rpc_metric_ids(), v));
+		TEST_CHECK(!rpc_metric_value(-1, v));
+	}
+
+	void test_deferred_calls()
+	{
+		std::vector<std::string> names;
+		names.push_back("get");
+		rpc_stats s("deferred", names);
+
+		// a deferred call is recorded once, by the call completing it, with
+		// the time in between as waiting
+		time_point start;
+		{
+			rpc_stats::call c(s, 0);
+			start = rpc_stats::defer();
+		}
+		TEST_CHECK(s.function(0).calls == 0);
+
+		std::thread t([&]
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			rpc_stats::call c(s, 0, NULL, start);
+			c.add_bytes(10);
+		});
+		t.join();
+
+		TEST_CHECK(s.function(0).calls == 1);
+		TEST_CHECK(s.function(0).bytes.sum() == 10);
+		TEST_CHECK(s.function(0).wait_us.sum() >= 2000);
+		TEST_CHECK(s.function(0).latency_us.sum() >= s.function(0).wait_us.sum());
+	}
+
+	void test_send_queues()
+	{
+		std::vector<std::string> names;
+		names.push_back("get");
+
+		std::vector<rpc_metric> before = rpc_metrics();
+
+		rpc_stats s("queued", names, rpc_stats::send_queue_metrics);
+		TEST_CHECK(s.send_queues() != NULL);
+
+		// bytes queued for the response count as the call's response size
+		{
+			rpc_stats::call c(s, 0);
+			rpc_stats::add_bytes(42);
+		}
+		// not in a call, this is a no-op
+		rpc_stats::add_bytes(1000);
+		TEST_CHECK(s.function(0).bytes.sum() == 42);
+
+		s.send_queues()->bytes += 300;
+		s.send_queues()->messages += 2;
+		s.send_queues()->evicted += 1;
+
+		// the queue metrics follow the ones of the functions
+		std::vector<rpc_metric> m = rpc_metrics();
+		TEST_CHECK(m.size() == before.size() + 9 + 4);
+		int const base = before.size() + 9;
+		TEST_CHECK(m[base].name == "rpc.queued.send_queue.bytes");
+		TEST_CHECK(!m[base].counter);
+		TEST_CHECK(m[base + 3].name == "rpc.queued.send_queue.evicted");
+		TEST_CHECK(m[base + 3].counter);
+
+		std::uint64_t v = 0;
+		TEST_CHECK(rpc_metric_value(m[base].id, v));
+		TEST_CHECK(v == 300);
+		TEST_CHECK(rpc_metric_value(m[base + 1].id, v));
+		TEST_CHECK(v == 2);
+		TEST_CHECK(rpc_metric_value(m[base + 3].id, v));
+		TEST_CHECK(v == 1);
+		TEST_CHECK(!rpc_metric_value(num_rpc_metric_ids(), v));
+
+		// protocols without queues don't have them
+		rpc_stats plain("plain", names);
+		TEST_CHECK(plain.send_queues() == NULL);
+		TEST_CHECK(rpc_metrics().size() == m.size() + 9);
+		TEST_CHECK(plain.handshakes() == NULL);
+	}
+
+	void test_handshakes()
+	{
+		std::vector<std::string> names;
+		names.push_back("get");
+
+		std::vector<rpc_metric> before = rpc_metrics();
+
+		rpc_stats s("tls", names
+			, rpc_stats::send_queue_metrics | rpc_stats::handshake_metrics);
+		TEST_CHECK(s.send_queues() != NULL);
+		TEST_CHECK(s.handshakes() != NULL);
+
+		s.handshakes()->full += 2;
+		s.handshakes()->resumed += 5;
+		s.handshakes()->failed += 1;
+		s.handshakes()->latency_us.record(1000);
+
+		// the handshake metrics follow the queue metrics
+		std::vector<rpc_metric> m = rpc_metrics();
+		TEST_CHECK(m.size() == before.size() + 9 + 4 + 5);
+		int const base = before.size() + 9 + 4;
+		TEST_CHECK(m[base].name == "rpc.tls.handshake.full");
+		TEST_CHECK(m[base + 1].name == "rpc.tls.handshake.resumed");
+		TEST_CHECK(m[base + 4].name == "rpc.tls.handshake.latency_p99_us");
+		TEST_CHECK(!m[base + 4].counter);
+
+		std::uint64_t v = 0;
+		TEST_CHECK(rpc_metric_value(m[base].id, v));
+		TEST_CHECK(v == 2);
+		TEST_CHECK(rpc_metric_value(m[base + 1].id, v));
+		TEST_CHECK(v == 5);
+		TEST_CHECK(rpc_metric_value(m[base + 2].id, v));
+		TEST_CHECK(v == 1);
+		TEST_CHECK(rpc_metric_value(m[base + 3].id, v));
+		TEST_CHECK(v == 1000);
+		TEST_CHECK(!rpc_metric_value(num_rpc_metric_ids(), v));
+
+		// without send queues, they follow the functions
+		rpc_stats h("tls2", names, rpc_stats::handshake_metrics);
+		s.handshakes()->full += 1;
+		h.handshakes()->full += 7;
+		m = rpc_metrics();
+		TEST_CHECK(m.size() == before.size() + 9 + 4 + 5 + 9 + 5);
+		TEST_CHECK(m[base + 5 + 9].name == "rpc.tls2.handshake.full");
+		TEST_CHECK(rpc_metric_value(m[base].id, v));
+		TEST_CHECK(v == 3);
+		TEST_CHECK(rpc_metric_value(m[base + 5 + 9].id, v));
+		TEST_CHECK(v == 7);
+		TEST_CHECK(!rpc_metric_value(num_rpc_metric_ids(), v));
+	}
+
+	void test_stable_ids()
+	{
+		std::vector<std::string> names;
+		names.push_back("get");
+
+		std::unique_ptr<rpc_stats> first(new rpc_stats("first", names));
+		rpc_stats second("second", names);
+
+		std::vector<rpc_metric> m = rpc_metrics();
+		TEST_CHECK(m.size() >= 18);
+		int const base = m.size() - 18;
+		TEST_CHECK(m[base].name == "rpc.first.get.calls");
+		TEST_CHECK(m[base + 9].name == "rpc.second.get.calls");
+		int const first_id = m[base].id;
+		int const second_id = m[base + 9].id;
+
+		{
+			rpc_stats::call c(second, 0);
+		}
+
+		// destroying a source doesn't move the metrics of the others, and
+		// its ids stay reserved
+		int const num_ids = num_rpc_metric_ids();
+		first.reset();
+		std::uint64_t v = 0;
+		TEST_CHECK(!rpc_metric_value(first_id, v));
+		TEST_CHECK(rpc_metric_value(second_id, v));
+		TEST_CHECK(v == 1);
+		m = rpc_metrics();
+		TEST_CHECK(m.back().name == "rpc.second.get.wait_us");
+		TEST_CHECK(m.back().id == second_id + 8);
+
+		// a source of the same metrics gets the same ids back
+		rpc_stats again("first", names);
+		TEST_CHECK(num_rpc_metric_ids() == num_ids);
+		TEST_CHECK(rpc_metric_value(first_id, v));
+		TEST_CHECK(v == 0);
+
+		// other parts of the web UI can export values too
+		std::vector<rpc_metric> values(2);
+		values[0].name = "test.value";
+		values[0].counter = false;
+		values[1].name = "test.count";
+		values[1].counter = true;
+		{
+			metric_source src(values, [](int i) { return std::uint64_t(i + 10); });
+			m = rpc_metrics();
+			TEST_CHECK(m[m.size() - 2].name == "test.value");
+			TEST_CHECK(!m[m.size() - 2].counter);
+			TEST_CHECK(rpc_metric_value(m.back().id, v));
+			TEST_CHECK(v == 11);
+		}
+		TEST_CHECK(!rpc_metric_value(m.back().id, v));
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	test_buckets();
+	test_quantiles();
+	test_calls();
+	test_deferred_calls();
+	test_send_queues();
+	test_handshakes();
+	test_stable_ids();
+
+	// once destroyed, the metrics are gone
+	TEST_CHECK(rpc_metrics().empty());
+
+	return main_ret;
+}
+
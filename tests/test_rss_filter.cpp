@@ -74,6 +74,20 @@ int main(int argc, char* argv[])
 	TEST_CHECK(p.season == 2013);
 	TEST_CHECK(p.episode == 513);
 
+	// the last token is parsed too
+	item_properties p2;
+	parse_name("Foo.Bar.S01E02.720p", p2);
+	TEST_CHECK(p2.season == 1);
+	TEST_CHECK(p2.episode == 2);
+	TEST_CHECK(p2.quality == item_properties::hd720);
+	TEST_CHECK(p2.source == item_properties::unknown);
+
+	item_properties p3;
+	parse_name("Foo Bar", p3);
+	TEST_CHECK(p3.season == 0);
+	TEST_CHECK(p3.episode == 0);
+	TEST_CHECK(p3.quality == 0);
+
 	TEST_CHECK(normalize_title("Foo.. Bar.>< [hdtv] __ test") == "foo bar hdtv test");
 	TEST_CHECK(normalize_title("Foo_Bar_2013-05-13_[brrip.1080p]") == "foo bar 2013-05-13 brrip 1080p");
 
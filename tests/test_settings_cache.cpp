@@ -0,0 +1,117 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "test.hpp"
+#include "settings_cache.hpp"
+
+#include <algorithm>
+
+using namespace libtorrent;
+
+int main_ret = 0;
+
+namespace {
+
+	void test_index()
+	{
+		int const n = settings_cache::num_settings();
+		TEST_CHECK(n > 0);
+		for (int i = 0; i < n; ++i)
+			TEST_CHECK(settings_cache::index(settings_cache::setting_name(i)) == i);
+
+		TEST_CHECK(settings_cache::index(settings_pack::user_agent) >= 0);
+		TEST_CHECK(settings_cache::index(settings_pack::active_loaded_limit) >= 0);
+		TEST_CHECK(settings_cache::index(settings_pack::max_string_setting_internal) == -1);
+		TEST_CHECK(settings_cache::index(0xffff) == -1);
+	}
+
+	void test_frames()
+	{
+		settings_cache c;
+		TEST_CHECK(c.frame() == 0);
+		TEST_CHECK(!c.settings());
+
+		settings_pack p;
+		p.set_int(settings_pack::active_loaded_limit, 10);
+		p.set_bool(settings_pack::enable_dht, true);
+		TEST_CHECK(c.update(p));
+		TEST_CHECK(c.frame() == 1);
+		TEST_CHECK(c.settings());
+		TEST_CHECK(c.setting_frame(settings_pack::active_loaded_limit) == 1);
+		TEST_CHECK(c.setting_frame(0xffff) == -1);
+
+		// a client that has nothing gets everything
+		std::vector<int> names;
+		c.changed_since(0, names);
+		TEST_CHECK(int(names.size()) == settings_cache::num_settings());
+
+		// nothing changed, the frame stays the same
+		TEST_CHECK(!c.update(p));
+		TEST_CHECK(c.frame() == 1);
+		names.clear();
+		c.changed_since(1, names);
+		TEST_CHECK(names.empty());
+
+		p.set_int(settings_pack::active_loaded_limit, 20);
+		TEST_CHECK(c.update(p));
+		TEST_CHECK(c.frame() == 2);
+		TEST_CHECK(c.settings()->get_int(settings_pack::active_loaded_limit) == 20);
+		TEST_CHECK(c.setting_frame(settings_pack::active_loaded_limit) == 2);
+		TEST_CHECK(c.setting_frame(settings_pack::enable_dht) == 1);
+
+		names.clear();
+		c.changed_since(1, names);
+		TEST_CHECK(names.size() == 1);
+		TEST_CHECK(names.size() == 1
+			&& names[0] == settings_pack::active_loaded_limit);
+
+		p.set_bool(settings_pack::enable_dht, false);
+		TEST_CHECK(c.update(p));
+		names.clear();
+		c.changed_since(1, names);
+		TEST_CHECK(names.size() == 2);
+		TEST_CHECK(std::find(names.begin(), names.end()
+			, int(settings_pack::enable_dht)) != names.end());
+		names.clear();
+		c.changed_since(2, names);
+		TEST_CHECK(names.size() == 1
+			&& names[0] == settings_pack::enable_dht);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	test_index();
+	test_frames();
+
+	return main_ret;
+}
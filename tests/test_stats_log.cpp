@@ -0,0 +1,126 @@
+/*
+
+Copyright (c) 2013, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "test.hpp"
+#include "stats_log.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace libtorrent;
+
+int main_ret = 0;
+
+namespace {
+
+	void test_round_trip(int flags, int num_samples)
+	{
+		std::vector<std::string> names;
+		names.push_back("net.sent_bytes");
+		names.push_back("");
+		names.push_back("peer.num_peers_connected");
+		names.push_back("disk.queued_disk_jobs");
+
+		std::vector<std::vector<std::uint64_t> > samples;
+		std::vector<std::uint64_t> values(names.size(), 0);
+		for (int i = 0; i < num_samples; ++i)
+		{
+			// a counter that only grows, one that never changes, a gauge and
+			// one that jumps between very large and small values
+			values[0] += rand() % 100000;
+			values[2] = rand() % 50;
+			values[3] = i % 3 == 0 ? 0xffffffffffffull : i;
+			samples.push_back(values);
+		}
+
+		error_code ec;
+		stats_log_writer w;
+		w.open("test.stats", names, 1400000000, flags, ec);
+		TEST_CHECK(!ec);
+		TEST_CHECK(w.is_open());
+		for (int i = 0; i < num_samples; ++i)
+			w.write(std::int64_t(i) * 1000000 + (i % 7), &samples[i][0]);
+		w.close();
+		TEST_CHECK(!w.is_open());
+
+		stats_log_reader r;
+		TEST_CHECK(r.open("test.stats", ec));
+		TEST_CHECK(!ec);
+		TEST_CHECK(r.names() == names);
+		TEST_CHECK(r.start_time() == 1400000000);
+
+		int n = 0;
+		while (r.next())
+		{
+			TEST_CHECK(n < num_samples);
+			if (n >= num_samples) break;
+			TEST_CHECK(r.timestamp() == std::int64_t(n) * 1000000 + (n % 7));
+			TEST_CHECK(r.values() == samples[n]);
+			++n;
+		}
+		TEST_CHECK(n == num_samples);
+		TEST_CHECK(!r.next());
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	test_round_trip(0, 0);
+	test_round_trip(0, 200);
+	test_round_trip(stats_log_writer::compressed, 0);
+	test_round_trip(stats_log_writer::compressed, 1);
+	// more than one block
+	test_round_trip(stats_log_writer::compressed, 200);
+
+	// not a stats log
+	{
+		FILE* f = fopen("test.stats", "wb");
+		fputs("second:net.sent_bytes\n\n0.000\t0\n", f);
+		fclose(f);
+
+		stats_log_reader r;
+		error_code ec;
+		TEST_CHECK(!r.open("test.stats", ec));
+		TEST_CHECK(ec);
+	}
+
+	{
+		stats_log_reader r;
+		error_code ec;
+		TEST_CHECK(!r.open("non-existent.stats", ec));
+		TEST_CHECK(ec);
+	}
+
+	remove("test.stats");
+	return main_ret;
+}
+
@@ -0,0 +1,502 @@
+/*
+
+Copyright (c) 2013, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "test.hpp"
+#include "torrent_history.hpp"
+#include "alert_handler.hpp"
+
+#include "libtorrent/session.hpp"
+#include "libtorrent/settings_pack.hpp"
+#include "libtorrent/alert_types.hpp"
+
+#include <stdio.h>
+#include <algorithm>
+
+using namespace libtorrent;
+
+int main_ret = 0;
+
+namespace {
+
+	torrent_status make_status(int i)
+	{
+		torrent_status st;
+		for (int k = 0; k < 20; ++k) st.info_hash[k] = std::uint8_t(i * 7 + k);
+		st.state = torrent_status::downloading;
+		st.paused = false;
+		st.auto_managed = true;
+		st.need_save_resume = true;
+		st.progress = 0.5f;
+		st.progress_ppm = 500000;
+		st.total_download = std::int64_t(i) << 33;
+		st.download_rate = 1000 * i;
+		st.num_peers = i;
+		st.queue_position = i;
+		st.name = "torrent";
+		st.save_path = "/downloads";
+		return st;
+	}
+
+	bool has_torrent(std::vector<history_entry_ptr> const& v, sha1_hash const& ih)
+	{
+		for (std::vector<history_entry_ptr>::const_iterator i = v.begin()
+			, end(v.end()); i != end; ++i)
+		{
+			if ((*i)->status.info_hash == ih) return true;
+		}
+		return false;
+	}
+
+	void test_snapshot(alert_handler& alerts)
+	{
+		int frame;
+		std::uint32_t epoch;
+		{
+			torrent_history hist(&alerts);
+			for (int i = 0; i < 50; ++i)
+				hist.add_torrent(make_status(i));
+			hist.frame();
+			hist.add_torrent(make_status(50));
+			frame = hist.frame();
+			epoch = hist.epoch();
+			TEST_CHECK(epoch != 0);
+			TEST_CHECK(hist.cursor_frame(epoch, frame) == frame);
+			TEST_CHECK(hist.cursor_frame(epoch + 1, frame) == 0);
+			TEST_CHECK(hist.cursor_frame(epoch, frame + 1) == 0);
+
+			error_code ec;
+			hist.save_snapshot("test.history", ec);
+			TEST_CHECK(!ec);
+		}
+
+		torrent_history hist(&alerts);
+		error_code ec;
+		TEST_CHECK(hist.load_snapshot("test.history", ec));
+		TEST_CHECK(!ec);
+		TEST_CHECK(hist.epoch() == epoch);
+		TEST_CHECK(hist.frame() == frame);
+
+		// the snapshot is only restored once
+		FILE* f = fopen("test.history", "rb");
+		TEST_CHECK(f == NULL);
+		if (f) fclose(f);
+
+		torrent_counts c;
+		hist.get_counts(c);
+		TEST_CHECK(c.total == 51);
+
+		// the restored torrents keep their frame numbers
+		std::vector<history_entry_ptr> updated;
+		hist.updated_fields_since(frame - 1, updated);
+		TEST_CHECK(updated.size() == 1);
+		TEST_CHECK(has_torrent(updated, make_status(50).info_hash));
+
+		torrent_status const st = hist.get_torrent_status(make_status(3).info_hash);
+		TEST_CHECK(st.total_download == make_status(3).total_download);
+		TEST_CHECK(st.name == "torrent");
+		TEST_CHECK(!st.need_save_resume);
+
+		// re-adding a torrent as it was doesn't make it an update
+		torrent_status same = make_status(3);
+		same.need_save_resume = false;
+		hist.add_torrent(same);
+		updated.clear();
+		hist.updated_fields_since(hist.frame(), updated);
+		TEST_CHECK(updated.empty());
+
+		// only the fields that differ get the new frame
+		torrent_status changed = make_status(4);
+		changed.need_save_resume = false;
+		changed.download_rate = 1;
+		hist.add_torrent(changed);
+		int const now = hist.frame();
+		TEST_CHECK(now > frame);
+		updated.clear();
+		hist.updated_fields_since(frame, updated);
+		TEST_CHECK(updated.size() == 1);
+		if (updated.size() == 1)
+		{
+			torrent_history_entry const& e = *updated[0];
+			TEST_CHECK(e.status.info_hash == changed.info_hash);
+			TEST_CHECK(e.frame(torrent_history_entry::download_rate) == now);
+			TEST_CHECK(e.frame(torrent_history_entry::total_download) < frame);
+		}
+
+		// the torrents that weren't added back are removed
+		hist.drop_restored();
+		std::vector<sha1_hash> removed;
+		hist.removed_since(now, removed);
+		TEST_CHECK(removed.size() == 49);
+		TEST_CHECK(std::find(removed.begin(), removed.end()
+			, make_status(3).info_hash) == removed.end());
+		hist.get_counts(c);
+		TEST_CHECK(c.total == 2);
+	}
+
+	// removing a torrent looks it up in the history, like the remove RPC
+	// does, and removes it from the session by its handle
+	void test_remove_restored(session& ses, alert_handler& alerts)
+	{
+		{
+			torrent_history hist(&alerts);
+			hist.add_torrent(make_status(1));
+			hist.add_torrent(make_status(2));
+			error_code ec;
+			hist.save_snapshot("test.history", ec);
+			TEST_CHECK(!ec);
+		}
+
+		torrent_history hist(&alerts);
+		error_code ec;
+		TEST_CHECK(hist.load_snapshot("test.history", ec));
+		torrent_status same = make_status(2);
+		same.need_save_resume = false;
+		hist.add_torrent(same);
+
+		// the torrent that hasn't been added back isn't in the session. It
+		// has no handle to remove it by
+		std::vector<sha1_hash> hashes(1, make_status(1).info_hash);
+		std::vector<history_entry_ptr> torrents;
+		hist.get_torrents(hashes, torrents);
+		TEST_CHECK(torrents.empty());
+		try
+		{
+			for (std::vector<history_entry_ptr>::iterator i = torrents.begin()
+				, end(torrents.end()); i != end; ++i)
+			{
+				ses.remove_torrent((*i)->status.handle);
+			}
+		}
+		catch (libtorrent_exception const&)
+		{
+			TEST_CHECK(false);
+		}
+
+		// it's still listed, until it's dropped
+		torrent_counts c;
+		hist.get_counts(c);
+		TEST_CHECK(c.total == 2);
+
+		// the one that was added back is found
+		hashes.push_back(make_status(2).info_hash);
+		torrents.clear();
+		hist.get_torrents(hashes, torrents);
+		TEST_CHECK(torrents.size() == 1);
+		TEST_CHECK(has_torrent(torrents, make_status(2).info_hash));
+	}
+
+	void test_bad_snapshot(alert_handler& alerts)
+	{
+		FILE* f = fopen("test.history", "wb");
+		fputs("LTHIST01\x01\x05", f);
+		fclose(f);
+
+		torrent_history hist(&alerts);
+		std::uint32_t const epoch = hist.epoch();
+		error_code ec;
+		TEST_CHECK(!hist.load_snapshot("test.history", ec));
+		TEST_CHECK(ec);
+		TEST_CHECK(hist.epoch() == epoch);
+		TEST_CHECK(hist.frame() == 1);
+
+		ec.clear();
+		TEST_CHECK(!hist.load_snapshot("non-existent.history", ec));
+		TEST_CHECK(ec);
+		remove("test.history");
+	}
+
+	void test_sources(alert_handler& alerts, alert_handler& other)
+	{
+		torrent_history hist(&alerts);
+		TEST_CHECK(hist.add_source(&other) == 1);
+
+		hist.add_torrent(make_status(1), 0);
+		hist.add_torrent(make_status(2), 1);
+
+		// the torrent is already in the history, as the first session's
+		torrent_status dup = make_status(1);
+		dup.name = "duplicate";
+		hist.add_torrent(dup, 1);
+
+		torrent_counts counts;
+		hist.get_counts(counts);
+		TEST_CHECK(counts.total == 2);
+
+		std::vector<history_entry_ptr> entries;
+		hist.updated_fields_since(0, entries);
+		TEST_CHECK(entries.size() == 2);
+		for (std::vector<history_entry_ptr>::iterator i = entries.begin()
+			, end(entries.end()); i != end; ++i)
+		{
+			torrent_history_entry const& e = **i;
+			if (e.status.info_hash == make_status(1).info_hash)
+			{
+				TEST_CHECK(e.source == 0);
+				TEST_CHECK(e.status.name == "torrent");
+			}
+			else
+			{
+				TEST_CHECK(e.source == 1);
+			}
+		}
+	}
+
+	void test_query(alert_handler& alerts)
+	{
+		torrent_history hist(&alerts);
+		for (int i = 0; i < 10; ++i)
+			hist.add_torrent(make_status(i));
+
+		// the entries come back in the order of the index
+		std::vector<history_entry_ptr> entries;
+		int const matching = hist.query_torrents(torrent_index::download_rate, true
+			, torrent_index::all, "", "", 2, 3, entries);
+		TEST_CHECK(matching == 10);
+		TEST_CHECK(entries.size() == 3);
+		for (int i = 0; i < int(entries.size()); ++i)
+			TEST_CHECK(entries[i]->status.info_hash == make_status(7 - i).info_hash);
+	}
+
+	void test_labels(alert_handler& alerts)
+	{
+		torrent_history hist(&alerts);
+		for (int i = 0; i < 4; ++i)
+			hist.add_torrent(make_status(i));
+
+		std::vector<std::string> labels;
+		labels.push_back("video");
+		labels.push_back("");
+		labels.push_back("distro");
+		labels.push_back("video");
+		int const before = hist.frame();
+		TEST_CHECK(hist.set_labels(make_status(1).info_hash, labels));
+		TEST_CHECK(hist.set_labels(make_status(2).info_hash
+			, std::vector<std::string>(1, "video")));
+		TEST_CHECK(!hist.set_labels(make_status(9).info_hash, labels));
+
+		// the labels are sorted, and the torrents stamped with a new frame
+		std::vector<history_entry_ptr> entries;
+		hist.updated_fields_since(before, entries);
+		TEST_CHECK(entries.size() == 2);
+		entries.clear();
+		std::vector<sha1_hash> ih(1, make_status(1).info_hash);
+		hist.get_torrents(ih, entries);
+		TEST_CHECK(entries.size() == 1);
+		TEST_CHECK(entries[0]->labels && entries[0]->labels->size() == 2);
+		TEST_CHECK(entries[0]->labels && entries[0]->labels->front() == "distro");
+		TEST_CHECK(entries[0]->labels_frame > before);
+
+		torrent_counts c;
+		hist.get_counts(c);
+		TEST_CHECK(c.labels.size() == 2);
+		TEST_CHECK(c.labels["video"] == 2);
+		TEST_CHECK(c.labels["distro"] == 1);
+
+		entries.clear();
+		int matching = hist.query_torrents(torrent_index::queue_position, false
+			, torrent_index::all, "", "video", 0, 10, entries);
+		TEST_CHECK(matching == 2);
+
+		// clearing and removing update the counts
+		hist.set_labels(make_status(1).info_hash, std::vector<std::string>());
+		torrent_removed_alert removed(torrent_handle(), make_status(2).info_hash);
+		hist.handle_alert(&removed);
+		hist.get_counts(c);
+		TEST_CHECK(c.labels.empty());
+	}
+
+	void test_removed_horizon(alert_handler& alerts)
+	{
+		torrent_history hist(&alerts);
+		hist.add_torrent(make_status(1));
+		hist.add_torrent(make_status(2));
+		int const start = hist.frame();
+
+		torrent_removed_alert removed1(torrent_handle(), make_status(1).info_hash);
+		hist.handle_alert(&removed1);
+		int const first = hist.frame();
+
+		std::vector<sha1_hash> removed;
+		TEST_CHECK(hist.removed_since(start, removed));
+		TEST_CHECK(removed.size() == 1);
+		removed.clear();
+		TEST_CHECK(hist.removed_since(first, removed));
+		TEST_CHECK(removed.empty());
+
+		// a removal long after the first one weeds it out
+		for (int i = 0; i < 4000; ++i)
+		{
+			hist.add_torrent(make_status(10 + i));
+			hist.frame();
+		}
+		torrent_removed_alert removed2(torrent_handle(), make_status(2).info_hash);
+		hist.handle_alert(&removed2);
+		hist.frame();
+
+		TEST_CHECK(hist.removed_horizon() >= first);
+		removed.clear();
+		TEST_CHECK(!hist.removed_since(start, removed));
+		TEST_CHECK(hist.cursor_frame(hist.epoch(), start) == 0);
+
+		// clients that saw the first removal still get the second one
+		removed.clear();
+		TEST_CHECK(hist.removed_since(first, removed));
+		TEST_CHECK(removed.size() == 1);
+		TEST_CHECK(hist.cursor_frame(hist.epoch(), first) == first);
+	}
+
+	void test_previous_values()
+	{
+		typedef torrent_history_entry te;
+		TEST_CHECK(te::counter_fields[0] == te::total_download);
+		TEST_CHECK(te::counter_fields[1] == te::total_upload);
+
+		torrent_status st = make_status(1);
+		std::int64_t const first = st.total_download;
+		te e(st, 5);
+		TEST_CHECK(te::counter(e.status, 0) == first);
+
+		// a new torrent has nothing for clients to diff against
+		std::int64_t v = 0;
+		TEST_CHECK(!e.previous_value(0, 5, v));
+
+		st.total_download += 1000;
+		TEST_CHECK(e.update_status(st, 7));
+
+		// clients at frame 5 and 6 have the value from frame 5
+		TEST_CHECK(e.previous_value(0, 5, v));
+		TEST_CHECK(v == first);
+		TEST_CHECK(e.previous_value(0, 6, v));
+		TEST_CHECK(v == first);
+
+		// one from before it was set doesn't, one at frame 7 is up to date,
+		// and a client at frame 0 is sent everything in full
+		TEST_CHECK(!e.previous_value(0, 4, v));
+		TEST_CHECK(!e.previous_value(0, 7, v));
+		TEST_CHECK(!e.previous_value(0, 0, v));
+
+		// counters that didn't change have no previous value
+		TEST_CHECK(!e.previous_value(1, 5, v));
+
+		st.total_download += 1;
+		st.download_rate += 1;
+		TEST_CHECK(e.update_status(st, 9));
+		TEST_CHECK(e.previous_value(0, 8, v));
+		TEST_CHECK(v == first + 1000);
+		TEST_CHECK(!e.previous_value(0, 6, v));
+
+		// changes to other fields leave the counter's previous value alone
+		st.download_rate += 1;
+		TEST_CHECK(e.update_status(st, 11));
+		TEST_CHECK(e.previous_value(0, 8, v));
+		TEST_CHECK(v == first + 1000);
+		TEST_CHECK(!e.previous_value(0, 10, v));
+
+		e.clear_previous();
+		TEST_CHECK(!e.previous_value(0, 8, v));
+	}
+
+	void test_compact_entries()
+	{
+		typedef torrent_history_entry te;
+
+		// torrents with the same save path share one copy of it, and it's
+		// only in the status handed out
+		te a(make_status(1), 5);
+		te b(make_status(2), 5);
+		TEST_CHECK(a.path.get() == b.path.get());
+		TEST_CHECK(*a.path == "/downloads");
+		TEST_CHECK(a.status.save_path.empty());
+		TEST_CHECK(a.full_status().save_path == "/downloads");
+
+		torrent_status st = make_status(1);
+		st.save_path = "/elsewhere";
+		st.current_tracker = "http://tracker.com/announce";
+		TEST_CHECK(a.update_status(st, 6));
+		TEST_CHECK(a.frame(te::save_path) == 6);
+		TEST_CHECK(a.frame(te::current_tracker) == 6);
+		TEST_CHECK(*a.path == "/elsewhere");
+		TEST_CHECK(*a.tracker == "http://tracker.com/announce");
+		TEST_CHECK(*a.json->save_path == "/elsewhere");
+		TEST_CHECK(a.path.get() != b.path.get());
+
+		// the same strings again aren't a change
+		TEST_CHECK(!a.update_status(st, 7));
+
+		// a change further away than 16 bits of frames moves the base up.
+		// The fields that didn't change are clamped to it, and the previous
+		// values of the counters are forgotten
+		st.total_download += 1000;
+		TEST_CHECK(a.update_status(st, 8));
+		std::int64_t v = 0;
+		TEST_CHECK(a.previous_value(0, 7, v));
+
+		int const later = 8 + te::max_frame_delta + 10;
+		st.download_rate += 1;
+		TEST_CHECK(a.update_status(st, later));
+		TEST_CHECK(a.frame(te::download_rate) == later);
+		TEST_CHECK(a.frame(te::save_path) == later - te::max_frame_delta);
+		TEST_CHECK(a.frame(te::total_download) == later - te::max_frame_delta);
+		TEST_CHECK(!a.previous_value(0, 7, v));
+
+		// so are frames restored from a snapshot
+		int frames[te::num_fields];
+		for (int i = 0; i < te::num_fields; ++i) frames[i] = 100000 + i;
+		frames[te::name] = 1;
+		b.set_frames(frames);
+		TEST_CHECK(b.frame(te::state) == 100000);
+		TEST_CHECK(b.frame(te::name) == 100000 + te::num_fields - 1 - te::max_frame_delta);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	settings_pack s;
+	s.set_str(settings_pack::listen_interfaces, "");
+	session ses(s);
+	alert_handler alerts(ses);
+
+	test_snapshot(alerts);
+	test_remove_restored(ses, alerts);
+	test_bad_snapshot(alerts);
+
+	session other_ses(s);
+	alert_handler other(other_ses);
+	test_sources(alerts, other);
+	test_query(alerts);
+	test_labels(alerts);
+	test_removed_horizon(alerts);
+	test_previous_values();
+	test_compact_entries();
+	return main_ret;
+}
+
@@ -0,0 +1,215 @@
+/*
+
+Copyright (c) 2013, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+#include "test.hpp"
+#include "torrent_index.hpp"
+
+#include <stdio.h>
+
+using namespace libtorrent;
+
+int main_ret = 0;
+
+namespace {
+
+	torrent_status make_status(int i, char const* name)
+	{
+		torrent_status st;
+		for (int k = 0; k < 20; ++k) st.info_hash[k] = std::uint8_t(i * 7 + k);
+		st.state = torrent_status::downloading;
+		st.paused = false;
+		st.auto_managed = false;
+		st.error.clear();
+		st.download_rate = 1000 * i;
+		st.upload_rate = 0;
+		st.download_payload_rate = 0;
+		st.upload_payload_rate = 0;
+		st.progress_ppm = 0;
+		st.added_time = 100 - i;
+		st.queue_position = i;
+		st.name = name;
+		return st;
+	}
+
+	int index_of(std::vector<sha1_hash> const& v, torrent_status const& st)
+	{
+		for (int i = 0; i < int(v.size()); ++i)
+			if (v[i] == st.info_hash) return i;
+		return -1;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	torrent_index idx;
+	std::vector<torrent_status> torrents;
+	char const* names[] = { "Ubuntu 14.04 Desktop", "debian netinst"
+		, "Big Buck Bunny", "ubuntu server", "Sintel" };
+	for (int i = 0; i < 5; ++i)
+	{
+		torrents.push_back(make_status(i, names[i]));
+		idx.update(torrents.back());
+	}
+	TEST_CHECK(idx.size() == 5);
+	TEST_CHECK(idx.count(torrent_index::downloading) == 5);
+
+	// sorted by queue position, a page at a time
+	std::vector<sha1_hash> window;
+	int matching = idx.query(torrent_index::queue_position, false
+		, torrent_index::all, "", "", 1, 2, window);
+	TEST_CHECK(matching == 5);
+	TEST_CHECK(window.size() == 2);
+	TEST_CHECK(index_of(window, torrents[1]) == 0);
+	TEST_CHECK(index_of(window, torrents[2]) == 1);
+
+	window.clear();
+	idx.query(torrent_index::download_rate, true, torrent_index::all, "", "", 0, 10, window);
+	TEST_CHECK(window.size() == 5);
+	TEST_CHECK(index_of(window, torrents[4]) == 0);
+	TEST_CHECK(index_of(window, torrents[0]) == 4);
+
+	// the search ignores case, and trigrams only narrow down the candidates
+	window.clear();
+	matching = idx.query(torrent_index::queue_position, false
+		, torrent_index::all, "UBUNTU", "", 0, 10, window);
+	TEST_CHECK(matching == 2);
+	TEST_CHECK(index_of(window, torrents[0]) == 0);
+	TEST_CHECK(index_of(window, torrents[3]) == 1);
+
+	window.clear();
+	matching = idx.query(torrent_index::queue_position, false
+		, torrent_index::all, "un", "", 0, 10, window);
+	TEST_CHECK(matching == 3);
+
+	window.clear();
+	matching = idx.query(torrent_index::queue_position, false
+		, torrent_index::all, "ubuntux", "", 0, 10, window);
+	TEST_CHECK(matching == 0);
+	TEST_CHECK(window.empty());
+
+	// moving torrents between categories
+	torrents[1].paused = true;
+	idx.update(torrents[1]);
+	torrents[2].error = "failed";
+	idx.update(torrents[2]);
+	torrents[3].upload_payload_rate = 10;
+	idx.update(torrents[3]);
+	TEST_CHECK(idx.count(torrent_index::downloading) == 3);
+	TEST_CHECK(idx.count(torrent_index::paused) == 1);
+	TEST_CHECK(idx.count(torrent_index::error) == 1);
+	TEST_CHECK(idx.count(torrent_index::active) == 1);
+
+	window.clear();
+	matching = idx.query(torrent_index::queue_position, false
+		, torrent_index::downloading, "", "", 0, 10, window);
+	TEST_CHECK(matching == 3);
+	TEST_CHECK(window.size() == 3);
+	TEST_CHECK(index_of(window, torrents[1]) == -1);
+
+	window.clear();
+	matching = idx.query(torrent_index::queue_position, false
+		, torrent_index::downloading, "ubuntu", "", 0, 10, window);
+	TEST_CHECK(matching == 2);
+
+	// renaming a torrent updates its trigrams
+	torrents[0].name = "Fedora Workstation";
+	idx.update(torrents[0]);
+	window.clear();
+	matching = idx.query(torrent_index::queue_position, false
+		, torrent_index::all, "ubuntu", "", 0, 10, window);
+	TEST_CHECK(matching == 1);
+	window.clear();
+	matching = idx.query(torrent_index::queue_position, false
+		, torrent_index::all, "fedora", "", 0, 10, window);
+	TEST_CHECK(matching == 1);
+
+	// a changed key moves the torrent in that order
+	torrents[4].queue_position = -1;
+	idx.update(torrents[4]);
+	window.clear();
+	idx.query(torrent_index::queue_position, false, torrent_index::all, "", "", 0, 1, window);
+	TEST_CHECK(index_of(window, torrents[4]) == 0);
+
+	idx.remove(torrents[3].info_hash);
+	TEST_CHECK(idx.size() == 4);
+	TEST_CHECK(idx.count(torrent_index::active) == 0);
+	window.clear();
+	matching = idx.query(torrent_index::queue_position, false
+		, torrent_index::all, "server", "", 0, 10, window);
+	TEST_CHECK(matching == 0);
+
+	// labels narrow down the list, on their own or with a search
+	std::vector<std::string> labels;
+	labels.push_back("distro");
+	idx.set_labels(torrents[0].info_hash, labels);
+	idx.set_labels(torrents[1].info_hash, labels);
+	labels.push_back("video");
+	idx.set_labels(torrents[2].info_hash, labels);
+	window.clear();
+	matching = idx.query(torrent_index::queue_position, false
+		, torrent_index::all, "", "distro", 0, 10, window);
+	TEST_CHECK(matching == 3);
+	TEST_CHECK(index_of(window, torrents[1]) == 1);
+	window.clear();
+	matching = idx.query(torrent_index::queue_position, false
+		, torrent_index::all, "bunny", "distro", 0, 10, window);
+	TEST_CHECK(matching == 1);
+	TEST_CHECK(index_of(window, torrents[2]) == 0);
+	window.clear();
+	matching = idx.query(torrent_index::queue_position, false
+		, torrent_index::error, "", "video", 0, 10, window);
+	TEST_CHECK(matching == 1);
+	window.clear();
+	matching = idx.query(torrent_index::queue_position, false
+		, torrent_index::all, "", "music", 0, 10, window);
+	TEST_CHECK(matching == 0);
+
+	// removing a label, or the torrent, takes it off the label's list
+	idx.set_labels(torrents[1].info_hash, std::vector<std::string>());
+	idx.remove(torrents[2].info_hash);
+	window.clear();
+	matching = idx.query(torrent_index::queue_position, false
+		, torrent_index::all, "", "distro", 0, 10, window);
+	TEST_CHECK(matching == 1);
+	TEST_CHECK(index_of(window, torrents[0]) == 0);
+	idx.update(torrents[2]);
+
+	// the freed slot is reused
+	idx.update(make_status(9, "ubuntu server"));
+	TEST_CHECK(idx.size() == 5);
+	window.clear();
+	matching = idx.query(torrent_index::queue_position, false
+		, torrent_index::all, "server", "", 0, 10, window);
+	TEST_CHECK(matching == 1);
+
+	return main_ret;
+}
+
@@ -0,0 +1,214 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "test.hpp"
+#include "torrent_view.hpp"
+#include "torrent_history.hpp"
+#include "alert_handler.hpp"
+
+#include "libtorrent/session.hpp"
+#include "libtorrent/settings_pack.hpp"
+#include "libtorrent/alert_types.hpp"
+
+#include <stdio.h>
+
+using namespace libtorrent;
+
+int main_ret = 0;
+
+namespace {
+
+	torrent_status make_status(int i)
+	{
+		torrent_status st;
+		for (int k = 0; k < 20; ++k) st.info_hash[k] = std::uint8_t(i * 7 + k);
+		st.state = torrent_status::downloading;
+		st.paused = false;
+		st.auto_managed = true;
+		st.progress_ppm = 500000;
+		st.num_peers = i;
+		st.queue_position = i;
+		char name[20];
+		snprintf(name, sizeof(name), "torrent %d", i);
+		st.name = name;
+		st.save_path = "/downloads";
+		return st;
+	}
+
+	bool is_dirty(std::vector<torrent_view::cell> const& dirty, int row, int column)
+	{
+		for (std::vector<torrent_view::cell>::const_iterator i = dirty.begin()
+			, end(dirty.end()); i != end; ++i)
+		{
+			if (i->row == row && i->column == column) return true;
+		}
+		return false;
+	}
+
+	void test_window(alert_handler& alerts)
+	{
+		torrent_history hist(&alerts);
+		for (int i = 0; i < 10; ++i)
+			hist.add_torrent(make_status(i));
+
+		torrent_view view(hist);
+		view.set_window(2, 5);
+		std::vector<torrent_view::cell> dirty;
+		TEST_CHECK(view.update(dirty));
+		TEST_CHECK(view.matching() == 10);
+		TEST_CHECK(dirty.size() == 5 * torrent_view::num_columns);
+		TEST_CHECK(view.text(0, torrent_view::name) == "torrent 2");
+		TEST_CHECK(view.text(4, torrent_view::name) == "torrent 6");
+		TEST_CHECK(view.text(0, torrent_view::state) == "downloading");
+		TEST_CHECK(view.text(0, torrent_view::progress) == "50.0%");
+
+		// nothing changed
+		dirty.clear();
+		TEST_CHECK(!view.update(dirty));
+		TEST_CHECK(dirty.empty());
+
+		// scrolling stops at the last page
+		view.scroll_by(100);
+		TEST_CHECK(view.offset() == 5);
+		TEST_CHECK(view.update(dirty));
+		TEST_CHECK(view.text(4, torrent_view::name) == "torrent 9");
+	}
+
+	void test_delta(alert_handler& alerts)
+	{
+		torrent_history hist(&alerts);
+		for (int i = 0; i < 10; ++i)
+			hist.add_torrent(make_status(i));
+
+		torrent_view view(hist);
+		view.set_window(0, 5);
+		std::vector<torrent_view::cell> dirty;
+		view.update(dirty);
+
+		// only the cell of the field that changed is redrawn
+		torrent_status st = make_status(2);
+		st.num_peers = 50;
+		hist.add_torrent(st);
+		dirty.clear();
+		TEST_CHECK(view.update(dirty));
+		TEST_CHECK(dirty.size() == 1);
+		TEST_CHECK(is_dirty(dirty, 2, torrent_view::peers));
+		TEST_CHECK(view.text(2, torrent_view::peers) == "50");
+
+		// changes to torrents outside the window aren't drawn
+		st = make_status(8);
+		st.num_peers = 50;
+		hist.add_torrent(st);
+		dirty.clear();
+		TEST_CHECK(!view.update(dirty));
+		TEST_CHECK(dirty.empty());
+
+		// neither are changes that come out as the same text
+		st = make_status(1);
+		st.download_payload_rate = 1000;
+		hist.add_torrent(st);
+		view.update(dirty);
+		dirty.clear();
+		st.download_payload_rate = 1001;
+		hist.add_torrent(st);
+		TEST_CHECK(!view.update(dirty));
+		TEST_CHECK(dirty.empty());
+		TEST_CHECK(view.text(1, torrent_view::download_rate) == "1.0 kB/s");
+	}
+
+	void test_reorder(alert_handler& alerts)
+	{
+		torrent_history hist(&alerts);
+		for (int i = 0; i < 10; ++i)
+			hist.add_torrent(make_status(i));
+
+		torrent_view view(hist);
+		view.set_window(0, 3);
+		std::vector<torrent_view::cell> dirty;
+		view.update(dirty);
+
+		// moving a torrent into the window puts it in its place
+		torrent_status st = make_status(9);
+		st.queue_position = -1;
+		hist.add_torrent(st);
+		dirty.clear();
+		TEST_CHECK(view.update(dirty));
+		TEST_CHECK(view.text(0, torrent_view::name) == "torrent 9");
+		TEST_CHECK(view.text(1, torrent_view::name) == "torrent 0");
+		TEST_CHECK(view.text(2, torrent_view::name) == "torrent 1");
+		TEST_CHECK(is_dirty(dirty, 0, torrent_view::peers));
+		// torrent 0 and 1 both have 50% progress, its cell stays
+		TEST_CHECK(!is_dirty(dirty, 1, torrent_view::progress));
+
+		// removing one moves the others up
+		torrent_removed_alert removed(torrent_handle(), make_status(0).info_hash);
+		hist.handle_alert(&removed);
+		dirty.clear();
+		TEST_CHECK(view.update(dirty));
+		TEST_CHECK(view.matching() == 9);
+		TEST_CHECK(view.text(1, torrent_view::name) == "torrent 1");
+		TEST_CHECK(view.text(2, torrent_view::name) == "torrent 2");
+
+		// the filter and sort order are those of the index
+		view.set_filter(torrent_index::paused);
+		dirty.clear();
+		TEST_CHECK(view.update(dirty));
+		TEST_CHECK(view.matching() == 0);
+		TEST_CHECK(view.text(0, torrent_view::name).empty());
+		TEST_CHECK(!view.torrent(0));
+
+		view.set_filter(torrent_index::all);
+		view.set_sort(torrent_index::queue_position, true);
+		view.update(dirty);
+		TEST_CHECK(view.text(0, torrent_view::name) == "torrent 8");
+
+		// after the screen is cleared every cell is drawn again
+		view.invalidate();
+		dirty.clear();
+		TEST_CHECK(view.update(dirty));
+		TEST_CHECK(dirty.size() == 3 * torrent_view::num_columns);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	settings_pack s;
+	s.set_str(settings_pack::listen_interfaces, "");
+	session ses(s);
+	alert_handler alerts(ses);
+
+	test_window(alerts);
+	test_delta(alerts);
+	test_reorder(alerts);
+	return main_ret;
+}
+
@@ -0,0 +1,281 @@
+#include "alert_trace.hpp"
+#include "alert_handler.hpp"
+#include "torrent_history.hpp"
+#include "save_resume.hpp"
+#include "rss_filter.hpp"
+
+#include "libtorrent/session.hpp"
+#include "libtorrent/settings_pack.hpp"
+#include "libtorrent/alert_types.hpp"
+#include "libtorrent/add_torrent_params.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <chrono>
+#include <thread>
+#include <map>
+
+using namespace libtorrent;
+
+namespace lt = libtorrent;
+
+// feeds an alert trace recorded by alert_recorder to torrent_history,
+// save_resume and rss_filter_handler, the way the session would have. The
+// recorded torrents are added to a session that doesn't connect anywhere,
+// for the alerts to have handles the observers can call into
+
+void print_usage()
+{
+	fprintf(stderr, "usage: alert_replay [-s speed] [-r resume-file] [-f search] trace\n\n"
+		"   -s   replay at speed times the recorded rate. 0 dispatches the\n"
+		"        batches back to back (default: 1)\n"
+		"   -r   the resume database save_resume writes to\n"
+		"        (default: replay_resume.dat)\n"
+		"   -f   add an RSS filter rule matching titles containing search.\n"
+		"        Matching items are added to the session, by their url.\n"
+		"        May be given more than once\n");
+	exit(1);
+}
+
+namespace
+{
+	typedef std::chrono::steady_clock clock_type;
+
+	// the recorded torrents, by info-hash
+	typedef std::map<sha1_hash, torrent_handle> torrents_t;
+
+	torrent_handle find_torrent(torrents_t const& torrents, sha1_hash const& ih)
+	{
+		torrents_t::const_iterator i = torrents.find(ih);
+		if (i == torrents.end()) return torrent_handle();
+		return i->second;
+	}
+
+	// these are made up from the trace. The session's own are dropped, for
+	// the observers to not see its torrents twice
+	bool is_replayed(int type)
+	{
+		return type == add_torrent_alert::alert_type
+			|| type == state_update_alert::alert_type
+			|| type == torrent_removed_alert::alert_type
+			|| type == torrent_update_alert::alert_type
+			|| type == torrent_finished_alert::alert_type
+			|| type == metadata_received_alert::alert_type
+			|| type == rss_item_alert::alert_type;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	double speed = 1.;
+	std::string resume_file = "replay_resume.dat";
+	std::vector<std::string> filters;
+
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; ++i)
+	{
+		if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+		{
+			speed = atof(argv[++i]);
+			if (speed < 0.) print_usage();
+		}
+		else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+		{
+			resume_file = argv[++i];
+		}
+		else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+		{
+			filters.push_back(argv[++i]);
+		}
+		else
+		{
+			print_usage();
+		}
+	}
+	if (i + 1 != argc) print_usage();
+
+	alert_trace_reader trace;
+	error_code ec;
+	if (!trace.open(argv[i], ec))
+	{
+		fprintf(stderr, "failed to open \"%s\": %s\n", argv[i], ec.message().c_str());
+		return 1;
+	}
+
+	settings_pack s;
+	s.set_str(settings_pack::listen_interfaces, "");
+	s.set_bool(settings_pack::enable_dht, false);
+	s.set_bool(settings_pack::enable_lsd, false);
+	s.set_bool(settings_pack::enable_upnp, false);
+	s.set_bool(settings_pack::enable_natpmp, false);
+	s.set_int(settings_pack::alert_mask, alert::error_notification
+		| alert::storage_notification | alert::status_notification);
+	lt::session ses(s);
+
+	alert_handler alerts(ses);
+	torrent_history hist(&alerts);
+	save_resume resume(ses, resume_file, &alerts, &hist);
+	rss_filter_handler rss_filter(alerts, ses);
+
+	for (std::vector<std::string>::iterator k = filters.begin()
+		, end(filters.end()); k != end; ++k)
+	{
+		rss_rule r;
+		r.name = *k;
+		r.search = *k;
+		r.params.save_path = ".";
+		r.params.flags = add_torrent_params::flag_paused;
+		rss_filter.add_rule(r);
+	}
+
+	torrents_t torrents;
+	std::int64_t num_batches = 0;
+	std::int64_t num_alerts = 0;
+	std::int64_t num_status = 0;
+	std::int64_t dispatch_us = 0;
+	std::int64_t max_dispatch_us = 0;
+
+	clock_type::time_point const start = clock_type::now();
+	while (trace.next())
+	{
+		if (speed > 0.)
+		{
+			std::this_thread::sleep_until(start + std::chrono::microseconds(
+				std::int64_t(trace.timestamp() / speed)));
+		}
+
+		std::vector<alert*> batch;
+		std::vector<torrent_handle> removed;
+		std::vector<trace_alert> const& recorded = trace.alerts();
+		for (std::vector<trace_alert>::const_iterator k = recorded.begin()
+			, end(recorded.end()); k != end; ++k)
+		{
+			trace_alert const& ta = *k;
+			torrent_handle h = find_torrent(torrents, ta.info_hash);
+			switch (ta.type)
+			{
+				case trace_alert::torrent_added:
+				{
+					if (h.is_valid()) break;
+					torrent_status const& st = ta.status[0];
+					add_torrent_params p;
+					p.info_hash = st.info_hash;
+					p.name = st.name;
+					p.save_path = st.save_path.empty() ? "." : st.save_path;
+					p.flags = add_torrent_params::flag_paused;
+					error_code add_ec;
+					h = ses.add_torrent(p, add_ec);
+					if (add_ec) break;
+					torrents[st.info_hash] = h;
+					batch.push_back(new add_torrent_alert(h, p, add_ec));
+
+					// the session reports its own status for the new torrent.
+					// Follow up with the recorded one
+					state_update_alert* su = new state_update_alert();
+					su->status.push_back(st);
+					su->status.back().handle = h;
+					batch.push_back(su);
+					break;
+				}
+				case trace_alert::state_update:
+				{
+					state_update_alert* su = new state_update_alert();
+					su->status.reserve(ta.status.size());
+					for (std::vector<torrent_status>::const_iterator st = ta.status.begin()
+						, st_end(ta.status.end()); st != st_end; ++st)
+					{
+						torrent_handle sh = find_torrent(torrents, st->info_hash);
+						if (!sh.is_valid()) continue;
+						su->status.push_back(*st);
+						su->status.back().handle = sh;
+					}
+					num_status += su->status.size();
+					batch.push_back(su);
+					break;
+				}
+				case trace_alert::torrent_removed:
+					if (!h.is_valid()) break;
+					batch.push_back(new torrent_removed_alert(h, ta.info_hash));
+					removed.push_back(h);
+					torrents.erase(ta.info_hash);
+					break;
+				case trace_alert::torrent_finished:
+					if (!h.is_valid()) break;
+					batch.push_back(new torrent_finished_alert(h));
+					break;
+				case trace_alert::metadata_received:
+					if (!h.is_valid()) break;
+					batch.push_back(new metadata_received_alert(h));
+					break;
+				case trace_alert::torrent_updated:
+					if (!h.is_valid()) break;
+					batch.push_back(new torrent_update_alert(h, ta.info_hash, ta.new_info_hash));
+					torrents.erase(ta.info_hash);
+					torrents[ta.new_info_hash] = h;
+					break;
+				case trace_alert::resume_saved:
+					if (!h.is_valid()) break;
+					batch.push_back(new save_resume_data_alert(ta.resume_data, h));
+					break;
+				case trace_alert::resume_failed:
+					if (!h.is_valid()) break;
+					batch.push_back(new save_resume_data_failed_alert(h
+						, error_code(boost::system::errc::io_error
+							, boost::system::generic_category())));
+					break;
+				case trace_alert::rss_item:
+					batch.push_back(new rss_item_alert(feed_handle(), ta.item));
+					break;
+			}
+		}
+
+		// the alerts are dispatched from a copy, since dispatch_alerts()
+		// clears the vector it's passed
+		std::vector<alert*> dispatch = batch;
+		clock_type::time_point const dispatch_start = clock_type::now();
+		alerts.dispatch_alerts(dispatch);
+		std::int64_t const us = std::chrono::duration_cast<std::chrono::microseconds>(
+			clock_type::now() - dispatch_start).count();
+		dispatch_us += us;
+		max_dispatch_us = (std::max)(max_dispatch_us, us);
+		++num_batches;
+		num_alerts += batch.size();
+
+		for (std::vector<alert*>::iterator k = batch.begin()
+			, end(batch.end()); k != end; ++k)
+		{
+			delete *k;
+		}
+
+		for (std::vector<torrent_handle>::iterator k = removed.begin()
+			, end(removed.end()); k != end; ++k)
+		{
+			ses.remove_torrent(*k);
+		}
+
+		// the observers' requests to the session, like saving resume data,
+		// are answered by alerts of its own
+		std::vector<alert*> own;
+		ses.pop_alerts(&own);
+		for (std::vector<alert*>::iterator k = own.begin(); k != own.end();)
+		{
+			if (is_replayed((*k)->type())) k = own.erase(k);
+			else ++k;
+		}
+		alerts.dispatch_alerts(own);
+	}
+
+	double const wall = std::chrono::duration_cast<std::chrono::microseconds>(
+		clock_type::now() - start).count() / 1000000.;
+
+	printf("batches: %" PRId64 " alerts: %" PRId64 " torrent updates: %" PRId64 "\n"
+		, num_batches, num_alerts, num_status);
+	printf("trace: %.3f s replay: %.3f s\n", trace.timestamp() / 1000000., wall);
+	printf("dispatch: %.3f s (%.1f alerts/s) max batch: %.3f ms\n"
+		, dispatch_us / 1000000.
+		, dispatch_us > 0 ? num_alerts * 1000000. / dispatch_us : 0.
+		, max_dispatch_us / 1000.);
+	return 0;
+}
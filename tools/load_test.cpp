@@ -0,0 +1,756 @@
+#include "rencode.hpp"
+#include "base64.hpp"
+#include "libtorrent/io.hpp"
+#include "libtorrent/error_code.hpp"
+
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <zlib.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <string>
+
+using namespace libtorrent;
+namespace io = libtorrent::detail;
+using boost::asio::ip::tcp;
+
+// opens a number of clients for each of the front-end protocols against a
+// running webui_test, each polling the way its dashboard does, and reports
+// the request rate and latency per protocol along with the CPU time the
+// server used meanwhile
+
+namespace
+{
+	typedef std::chrono::steady_clock clock_type;
+	using std::chrono::duration_cast;
+	using std::chrono::microseconds;
+	using std::chrono::milliseconds;
+
+	struct options
+	{
+		options()
+			: host("127.0.0.1")
+			, web_port(8090)
+			, deluge_port(58846)
+			, user("admin")
+			, password("test")
+			, duration(10)
+			, interval_ms(1000)
+			, server_pid(0)
+		{
+			for (int i = 0; i < num_protocols; ++i) clients[i] = 0;
+		}
+
+		enum { websocket, utorrent, transmission, deluge, num_protocols };
+
+		std::string host;
+		int web_port;
+		int deluge_port;
+		std::string user;
+		std::string password;
+		int clients[num_protocols];
+		int duration;
+		int interval_ms;
+		int server_pid;
+	};
+
+	char const* protocol_names[] = { "libtorrent", "utorrent", "transmission", "deluge" };
+
+	struct results
+	{
+		results(): requests(0), errors(0), bytes(0) {}
+
+		void add(std::vector<std::uint32_t> const& latency, std::uint64_t errs
+			, std::uint64_t received)
+		{
+			std::unique_lock<std::mutex> l(mutex);
+			latency_us.insert(latency_us.end(), latency.begin(), latency.end());
+			requests += latency.size();
+			errors += errs;
+			bytes += received;
+		}
+
+		std::mutex mutex;
+		std::vector<std::uint32_t> latency_us;
+		std::uint64_t requests;
+		std::uint64_t errors;
+		std::uint64_t bytes;
+	};
+
+	std::string basic_auth(options const& o)
+	{
+		std::string const cred = o.user + ":" + o.password;
+		std::string ret(base64_encoded_size(cred.size()), '\0');
+		ret.resize(base64_encode(cred.c_str(), cred.size(), &ret[0]));
+		return "Authorization: Basic " + ret + "\r\n";
+	}
+
+	// a stalled server fails the request rather than hanging the client
+	void set_timeout(int fd, int seconds)
+	{
+		timeval tv;
+		tv.tv_sec = seconds;
+		tv.tv_usec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	}
+
+	bool connect_socket(boost::asio::io_service& ios, tcp::socket& sock
+		, std::string const& host, int port)
+	{
+		error_code ec;
+		tcp::resolver r(ios);
+		tcp::resolver::iterator i = r.resolve(tcp::resolver::query(host
+			, std::to_string(port)), ec);
+		if (ec) return false;
+		boost::asio::connect(sock, i, ec);
+		if (ec) return false;
+		sock.set_option(tcp::no_delay(true), ec);
+		set_timeout(sock.native_handle(), 10);
+		return true;
+	}
+
+	// a plain TCP connection to the web port, with buffered reads
+	struct web_connection
+	{
+		web_connection(options const& o): m_opt(o), m_sock(m_ios), m_closed(false) {}
+
+		bool connect() { return connect_socket(m_ios, m_sock, m_opt.host, m_opt.web_port); }
+
+		// connects again if the server closed the connection after the
+		// last response
+		bool reconnect_if_closed()
+		{
+			if (!m_closed) return true;
+			error_code ec;
+			m_sock.close(ec);
+			m_buf.consume(m_buf.size());
+			m_closed = false;
+			return connect();
+		}
+
+		bool write(char const* buf, std::size_t len)
+		{
+			error_code ec;
+			boost::asio::write(m_sock, boost::asio::buffer(buf, len), ec);
+			return !ec;
+		}
+
+		bool read(char* buf, std::size_t len)
+		{
+			error_code ec;
+			if (m_buf.size() < len)
+			{
+				boost::asio::read(m_sock, m_buf
+					, boost::asio::transfer_at_least(len - m_buf.size()), ec);
+				if (ec) return false;
+			}
+			boost::asio::buffer_copy(boost::asio::buffer(buf, len), m_buf.data());
+			m_buf.consume(len);
+			return true;
+		}
+
+		// reads up to and including delim
+		bool read_until(char const* delim, std::string& out)
+		{
+			error_code ec;
+			std::size_t const len = boost::asio::read_until(m_sock, m_buf, delim, ec);
+			if (ec) return false;
+			out.resize(len);
+			return read(&out[0], len);
+		}
+
+		// reads an HTTP response. Returns the status code, or -1 if the
+		// connection failed
+		int read_response(std::string& body)
+		{
+			std::string headers;
+			if (!read_until("\r\n\r\n", headers)) return -1;
+
+			int status = 0;
+			if (sscanf(headers.c_str(), "HTTP/%*d.%*d %d", &status) != 1) return -1;
+
+			for (std::string::iterator i = headers.begin(); i != headers.end(); ++i)
+				*i = tolower(*i);
+			m_closed = headers.find("connection: close") != std::string::npos;
+
+			body.clear();
+			std::string::size_type const cl = headers.find("content-length:");
+			if (cl != std::string::npos)
+			{
+				body.resize(atoi(headers.c_str() + cl + 15));
+				if (!body.empty() && !read(&body[0], body.size())) return -1;
+			}
+			else if (headers.find("transfer-encoding: chunked") != std::string::npos)
+			{
+				for (;;)
+				{
+					std::string line;
+					if (!read_until("\r\n", line)) return -1;
+					int const size = strtol(line.c_str(), NULL, 16);
+					// including the CRLF following the chunk
+					std::string::size_type const pos = body.size();
+					body.resize(pos + size + 2);
+					if (!read(&body[pos], size + 2)) return -1;
+					body.resize(pos + size);
+					if (size == 0) break;
+				}
+			}
+			else
+			{
+				// the body ends when the connection is closed
+				error_code ec;
+				boost::asio::read(m_sock, m_buf, boost::asio::transfer_all(), ec);
+				if (ec != boost::asio::error::eof) return -1;
+				body.resize(m_buf.size());
+				read(&body[0], body.size());
+				m_closed = true;
+			}
+			return status;
+		}
+
+		options const& m_opt;
+		boost::asio::io_service m_ios;
+		tcp::socket m_sock;
+		boost::asio::streambuf m_buf;
+		bool m_closed;
+	};
+
+	// polls the torrent list with get-torrent-updates over the
+	// libtorrent_webui websocket, asking for what changed since the last
+	// frame it got, like the dashboard
+	struct websocket_client
+	{
+		websocket_client(options const& o): m_conn(o), m_transaction_id(0), m_frame(0) {}
+
+		bool connect()
+		{
+			if (!m_conn.connect()) return false;
+			std::string const req = "GET /bt/control HTTP/1.1\r\n"
+				"Host: " + m_conn.m_opt.host + "\r\n"
+				"Upgrade: websocket\r\n"
+				"Connection: Upgrade\r\n"
+				"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+				"Sec-WebSocket-Version: 13\r\n"
+				+ basic_auth(m_conn.m_opt) + "\r\n";
+			if (!m_conn.write(req.c_str(), req.size())) return false;
+			std::string headers;
+			if (!m_conn.read_until("\r\n\r\n", headers)) return false;
+			return strncmp(headers.c_str(), "HTTP/1.1 101", 12) == 0;
+		}
+
+		// returns the number of bytes received, or -1 on failure
+		int request()
+		{
+			std::uint16_t const tid = ++m_transaction_id;
+			char rpc[15];
+			char* ptr = rpc;
+			io::write_uint8(0, ptr); // get-torrent-updates
+			io::write_uint16(tid, ptr);
+			io::write_uint32(m_frame, ptr);
+			io::write_uint64(~std::uint64_t(0), ptr);
+			if (!send_frame(rpc, sizeof(rpc))) return -1;
+
+			// skip anything pushed to us until the response arrives
+			std::vector<char> msg;
+			for (;;)
+			{
+				if (!read_message(msg)) return -1;
+				if (msg.size() < 4) return -1;
+				char const* p = &msg[0];
+				int const fun = io::read_uint8(p);
+				int const id = io::read_uint16(p);
+				int const status = io::read_uint8(p);
+				if (fun != 0x80 || id != tid) continue;
+				if (status != 0 || msg.size() < 8) return -1;
+				m_frame = io::read_uint32(p);
+				return msg.size();
+			}
+		}
+
+	private:
+
+		// client frames are always masked. The mask doesn't need to be
+		// unpredictable here, a zero mask leaves the payload as it is
+		bool send_frame(char const* buf, int len)
+		{
+			char header[8];
+			char* ptr = header;
+			io::write_uint8(0x82, ptr);
+			io::write_uint8(0x80 | len, ptr);
+			io::write_uint32(0, ptr);
+			std::vector<boost::asio::const_buffer> bufs;
+			bufs.push_back(boost::asio::buffer(header, ptr - header));
+			bufs.push_back(boost::asio::buffer(buf, len));
+			error_code ec;
+			boost::asio::write(m_conn.m_sock, bufs, ec);
+			return !ec;
+		}
+
+		// reads one (possibly fragmented) data message
+		bool read_message(std::vector<char>& msg)
+		{
+			msg.clear();
+			for (;;)
+			{
+				char header[2];
+				if (!m_conn.read(header, 2)) return false;
+				bool const fin = header[0] & 0x80;
+				int const opcode = header[0] & 0xf;
+				std::uint64_t len = header[1] & 0x7f;
+				char ext[8];
+				char const* ptr = ext;
+				if (len == 126)
+				{
+					if (!m_conn.read(ext, 2)) return false;
+					len = io::read_uint16(ptr);
+				}
+				else if (len == 127)
+				{
+					if (!m_conn.read(ext, 8)) return false;
+					len = io::read_uint64(ptr);
+				}
+				if (header[1] & 0x80)
+				{
+					char mask[4];
+					if (!m_conn.read(mask, 4)) return false;
+				}
+
+				// the connection is being closed
+				if (opcode == 0x8) return false;
+
+				std::size_t const pos = msg.size();
+				msg.resize(pos + len);
+				if (len > 0 && !m_conn.read(&msg[pos], len)) return false;
+
+				// control frames (like pings) may be interleaved with the
+				// fragments of a message
+				if (opcode >= 0x8)
+				{
+					msg.resize(pos);
+					continue;
+				}
+				if (fin) return true;
+			}
+		}
+
+		web_connection m_conn;
+		std::uint16_t m_transaction_id;
+		std::uint32_t m_frame;
+	};
+
+	// polls list=1 with the cache ID of the previous response, like the
+	// uTorrent web UI
+	struct utorrent_client
+	{
+		utorrent_client(options const& o): m_conn(o), m_cid(0) {}
+
+		bool connect() { return m_conn.connect(); }
+
+		int request()
+		{
+			if (!m_conn.reconnect_if_closed()) return -1;
+
+			char path[100];
+			snprintf(path, sizeof(path), "/gui/?list=1&cid=%d", m_cid);
+			std::string const req = std::string("GET ") + path + " HTTP/1.1\r\n"
+				"Host: " + m_conn.m_opt.host + "\r\n"
+				+ basic_auth(m_conn.m_opt) + "\r\n";
+			if (!m_conn.write(req.c_str(), req.size())) return -1;
+
+			std::string body;
+			if (m_conn.read_response(body) != 200) return -1;
+
+			std::string::size_type const pos = body.find("\"torrentc\":");
+			if (pos == std::string::npos) return -1;
+			char const* cid = body.c_str() + pos + 11;
+			while (*cid == ' ' || *cid == '"') ++cid;
+			m_cid = atoi(cid);
+			return body.size();
+		}
+
+	private:
+		web_connection m_conn;
+		int m_cid;
+	};
+
+	// polls torrent-get for the recently active torrents, after getting the
+	// full list once, like the transmission web UI
+	struct transmission_client
+	{
+		transmission_client(options const& o): m_conn(o), m_first(true) {}
+
+		bool connect() { return m_conn.connect(); }
+
+		int request()
+		{
+			if (!m_conn.reconnect_if_closed()) return -1;
+
+			std::string body = "{\"method\": \"torrent-get\", \"arguments\": {"
+				"\"fields\": [\"id\", \"name\", \"status\", \"percentDone\""
+				", \"rateDownload\", \"rateUpload\", \"totalSize\", \"sizeWhenDone\""
+				", \"leftUntilDone\", \"eta\", \"peersConnected\", \"uploadRatio\""
+				", \"error\", \"errorString\", \"queuePosition\"]";
+			if (!m_first) body += ", \"ids\": \"recently-active\"";
+			body += "}, \"tag\": 1}";
+
+			char cl[50];
+			snprintf(cl, sizeof(cl), "Content-Length: %d\r\n", int(body.size()));
+			std::string const req = "POST /transmission/rpc HTTP/1.1\r\n"
+				"Host: " + m_conn.m_opt.host + "\r\n"
+				"Content-Type: application/json\r\n"
+				+ cl + basic_auth(m_conn.m_opt) + "\r\n" + body;
+			if (!m_conn.write(req.c_str(), req.size())) return -1;
+
+			if (m_conn.read_response(body) != 200) return -1;
+			if (body.find("\"success\"") == std::string::npos) return -1;
+			m_first = false;
+			return body.size();
+		}
+
+	private:
+		web_connection m_conn;
+		bool m_first;
+	};
+
+	// logs in and polls core.get_torrents_status in diff mode, like the
+	// deluge GTK client
+	struct deluge_client
+	{
+		deluge_client(options const& o)
+			: m_opt(o)
+			, m_context(m_ios, boost::asio::ssl::context::sslv23)
+			, m_sock(m_ios, m_context)
+			, m_request_id(0)
+		{
+			memset(&m_zs, 0, sizeof(m_zs));
+			inflateInit(&m_zs);
+		}
+		~deluge_client() { inflateEnd(&m_zs); }
+
+		bool connect()
+		{
+			if (!connect_socket(m_ios, m_sock.next_layer(), m_opt.host, m_opt.deluge_port))
+				return false;
+			error_code ec;
+			m_sock.set_verify_mode(boost::asio::ssl::verify_none, ec);
+			m_sock.handshake(boost::asio::ssl::stream_base::client, ec);
+			if (ec) return false;
+
+			rencoder out;
+			out.append_list(1);
+			out.append_list(4);
+			out.append_int(++m_request_id);
+			out.append_string("daemon.login");
+			out.append_list(2);
+			out.append_string(m_opt.user);
+			out.append_string(m_opt.password);
+			out.append_dict(0);
+			return send(out) && read_response() >= 0;
+		}
+
+		int request()
+		{
+			rencoder out;
+			out.append_list(1);
+			out.append_list(4);
+			out.append_int(++m_request_id);
+			out.append_string("core.get_torrents_status");
+			out.append_list(3);
+			out.append_dict(0);
+			out.append_list(5);
+			out.append_string("name");
+			out.append_string("state");
+			out.append_string("progress");
+			out.append_string("download_payload_rate");
+			out.append_string("upload_payload_rate");
+			// diff mode
+			out.append_bool(true);
+			out.append_dict(0);
+			if (!send(out)) return -1;
+			return read_response();
+		}
+
+	private:
+
+		// every message is a zlib stream of its own
+		bool send(rencoder const& out)
+		{
+			uLongf len = compressBound(out.len());
+			std::vector<char> buf(len);
+			if (compress((Bytef*)&buf[0], &len, (Bytef const*)out.data(), out.len()) != Z_OK)
+				return false;
+			error_code ec;
+			boost::asio::write(m_sock, boost::asio::buffer(&buf[0], len), ec);
+			return !ec;
+		}
+
+		// reads messages until the response to the last request arrives.
+		// Returns the number of (compressed) bytes received, or -1 if it's
+		// an error
+		int read_response()
+		{
+			int received = 0;
+			for (;;)
+			{
+				std::vector<char> msg;
+				int const ret = read_message(msg);
+				if (ret < 0) return -1;
+				received += ret;
+
+				if (msg.empty() || m_decoder.decode(&msg[0], msg.size()) < 3) return -1;
+				rtok_t const* tokens = m_decoder.tokens();
+				if (tokens[0].type() != type_list) return -1;
+				int const type = tokens[1].integer(&msg[0]);
+				// RPC_EVENT
+				if (type == 3) continue;
+				if (tokens[2].integer(&msg[0]) != m_request_id) continue;
+				// RPC_RESPONSE
+				return type == 1 ? received : -1;
+			}
+		}
+
+		// inflates the next message into msg. Bytes past the end of its
+		// zlib stream are kept for the next message
+		int read_message(std::vector<char>& msg)
+		{
+			int received = 0;
+			inflateReset(&m_zs);
+			for (;;)
+			{
+				if (m_pending.empty())
+				{
+					char buf[16 * 1024];
+					error_code ec;
+					std::size_t const len = m_sock.read_some(boost::asio::buffer(buf), ec);
+					if (ec) return -1;
+					m_pending.assign(buf, buf + len);
+					received += len;
+				}
+
+				std::size_t const pos = msg.size();
+				msg.resize(pos + 64 * 1024);
+				m_zs.next_in = (Bytef*)&m_pending[0];
+				m_zs.avail_in = m_pending.size();
+				m_zs.next_out = (Bytef*)&msg[pos];
+				m_zs.avail_out = msg.size() - pos;
+				int const ret = inflate(&m_zs, Z_NO_FLUSH);
+				msg.resize(msg.size() - m_zs.avail_out);
+				m_pending.erase(m_pending.begin(), m_pending.end() - m_zs.avail_in);
+				if (ret == Z_STREAM_END) return received;
+				if (ret != Z_OK && ret != Z_BUF_ERROR) return -1;
+			}
+		}
+
+		options const& m_opt;
+		boost::asio::io_service m_ios;
+		boost::asio::ssl::context m_context;
+		boost::asio::ssl::stream<tcp::socket> m_sock;
+		z_stream m_zs;
+		std::vector<char> m_pending;
+		rdecoder m_decoder;
+		int m_request_id;
+	};
+
+	// runs one client until the end of the test, one request per interval
+	// (or back to back with an interval of 0). Failed requests count as
+	// errors, and the client reconnects
+	template <class Client>
+	void run_client(options const& o, clock_type::time_point end, results& r)
+	{
+		std::vector<std::uint32_t> latency;
+		std::uint64_t errors = 0;
+		std::uint64_t bytes = 0;
+		std::unique_ptr<Client> c;
+		while (clock_type::now() < end)
+		{
+			if (!c)
+			{
+				c.reset(new Client(o));
+				if (!c->connect())
+				{
+					++errors;
+					c.reset();
+					std::this_thread::sleep_for(milliseconds(500));
+					continue;
+				}
+			}
+
+			clock_type::time_point const start = clock_type::now();
+			int const ret = c->request();
+			clock_type::time_point const done = clock_type::now();
+			if (ret < 0)
+			{
+				++errors;
+				c.reset();
+				continue;
+			}
+			latency.push_back(duration_cast<microseconds>(done - start).count());
+			bytes += ret;
+			std::this_thread::sleep_until(start + milliseconds(o.interval_ms));
+		}
+		r.add(latency, errors, bytes);
+	}
+
+	// the user and system CPU time of the process, in seconds. -1 if it
+	// can't be read (/proc is Linux specific)
+	double process_cpu(int pid)
+	{
+		char path[100];
+		snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+		FILE* f = fopen(path, "r");
+		if (f == NULL) return -1.;
+		char buf[1024];
+		int const len = fread(buf, 1, sizeof(buf) - 1, f);
+		fclose(f);
+		if (len <= 0) return -1.;
+		buf[len] = 0;
+
+		// the command name may contain spaces, the fields we want are
+		// counted from the parenthesis ending it. utime and stime are the
+		// 14th and 15th fields
+		char const* p = strrchr(buf, ')');
+		if (p == NULL) return -1.;
+		unsigned long utime = 0;
+		unsigned long stime = 0;
+		if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu"
+			, &utime, &stime) != 2) return -1.;
+		return double(utime + stime) / sysconf(_SC_CLK_TCK);
+	}
+
+	void print_usage()
+	{
+		fprintf(stderr, "usage: load_test [options]\n\n"
+			"   -w <n>      libtorrent_webui websocket clients\n"
+			"   -u <n>      uTorrent list=1 pollers\n"
+			"   -t <n>      Transmission torrent-get pollers\n"
+			"   -g <n>      Deluge RPC clients\n"
+			"   -h <host>   the server (default: 127.0.0.1)\n"
+			"   -p <port>   the web port (default: 8090)\n"
+			"   -d <port>   the deluge port (default: 58846)\n"
+			"   -a <user:password>\n"
+			"               the account to log in with (default: admin:test)\n"
+			"   -s <secs>   how long to run for (default: 10)\n"
+			"   -i <ms>     time between the requests of a client, 0 means\n"
+			"               back to back (default: 1000)\n"
+			"   -P <pid>    the server process, to report its CPU usage\n");
+		exit(1);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	options o;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (argv[i][0] != '-' || strlen(argv[i]) != 2 || i + 1 >= argc) print_usage();
+		char const* arg = argv[++i];
+		switch (argv[i-1][1])
+		{
+			case 'w': o.clients[options::websocket] = atoi(arg); break;
+			case 'u': o.clients[options::utorrent] = atoi(arg); break;
+			case 't': o.clients[options::transmission] = atoi(arg); break;
+			case 'g': o.clients[options::deluge] = atoi(arg); break;
+			case 'h': o.host = arg; break;
+			case 'p': o.web_port = atoi(arg); break;
+			case 'd': o.deluge_port = atoi(arg); break;
+			case 'a':
+			{
+				char const* colon = strchr(arg, ':');
+				if (colon == NULL) print_usage();
+				o.user.assign(arg, colon);
+				o.password = colon + 1;
+				break;
+			}
+			case 's': o.duration = atoi(arg); break;
+			case 'i': o.interval_ms = atoi(arg); break;
+			case 'P': o.server_pid = atoi(arg); break;
+			default: print_usage();
+		}
+	}
+
+	int total_clients = 0;
+	for (int p = 0; p < options::num_protocols; ++p) total_clients += o.clients[p];
+	if (total_clients == 0) print_usage();
+
+	double const cpu_start = o.server_pid ? process_cpu(o.server_pid) : -1.;
+	clock_type::time_point const start = clock_type::now();
+	clock_type::time_point const end = start + std::chrono::seconds(o.duration);
+
+	results r[options::num_protocols];
+	std::vector<std::thread> threads;
+	for (int p = 0; p < options::num_protocols; ++p)
+	{
+		for (int i = 0; i < o.clients[p]; ++i)
+		{
+			switch (p)
+			{
+				case options::websocket:
+					threads.emplace_back(&run_client<websocket_client>, std::cref(o), end, std::ref(r[p]));
+					break;
+				case options::utorrent:
+					threads.emplace_back(&run_client<utorrent_client>, std::cref(o), end, std::ref(r[p]));
+					break;
+				case options::transmission:
+					threads.emplace_back(&run_client<transmission_client>, std::cref(o), end, std::ref(r[p]));
+					break;
+				case options::deluge:
+					threads.emplace_back(&run_client<deluge_client>, std::cref(o), end, std::ref(r[p]));
+					break;
+			}
+		}
+	}
+
+	for (std::vector<std::thread>::iterator i = threads.begin(); i != threads.end(); ++i)
+		i->join();
+
+	double const elapsed = duration_cast<milliseconds>(clock_type::now() - start).count() / 1000.;
+	double const cpu_end = o.server_pid ? process_cpu(o.server_pid) : -1.;
+
+	printf("%-13s %7s %9s %7s %8s %9s %9s %9s %9s %9s\n", "protocol", "clients"
+		, "requests", "errors", "req/s", "kB/s", "p50 ms", "p99 ms", "p99.9 ms", "max ms");
+	for (int p = 0; p < options::num_protocols; ++p)
+	{
+		if (o.clients[p] == 0) continue;
+		std::vector<std::uint32_t>& lat = r[p].latency_us;
+		std::sort(lat.begin(), lat.end());
+		double pct[4] = { 0., 0., 0., 0. };
+		double const quantiles[3] = { 0.5, 0.99, 0.999 };
+		if (!lat.empty())
+		{
+			for (int q = 0; q < 3; ++q)
+				pct[q] = lat[std::min(lat.size() - 1, std::size_t(quantiles[q] * lat.size()))] / 1000.;
+			pct[3] = lat.back() / 1000.;
+		}
+
+		printf("%-13s %7d %9" PRIu64 " %7" PRIu64 " %8.1f %9.1f %9.2f %9.2f %9.2f %9.2f\n"
+			, protocol_names[p], o.clients[p], r[p].requests, r[p].errors
+			, r[p].requests / elapsed, r[p].bytes / elapsed / 1000.
+			, pct[0], pct[1], pct[2], pct[3]);
+	}
+
+	if (cpu_start >= 0. && cpu_end >= 0.)
+	{
+		printf("\nserver CPU: %.1f s in %.1f s (%.0f%% of one core)\n"
+			, cpu_end - cpu_start, elapsed, (cpu_end - cpu_start) * 100. / elapsed);
+	}
+	else if (o.server_pid)
+	{
+		fprintf(stderr, "failed to read the CPU time of process %d\n", o.server_pid);
+	}
+
+	return 0;
+}
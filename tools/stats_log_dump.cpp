@@ -0,0 +1,113 @@
+#include "stats_log.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <algorithm>
+
+using namespace libtorrent;
+
+// converts binary session stats logs (written by stats_logging) to the
+// text format parse_session_stats.py and gnuplot understand. One line per
+// sample, with the number of seconds into the log followed by every
+// counter, tab separated
+
+void print_usage()
+{
+	fprintf(stderr, "usage: stats_log_dump [-c counter[,counter...]] [-i] file...\n\n"
+		"   -c   only print the listed counters, in that order\n"
+		"   -i   print the names of the counters in the log and exit\n");
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	std::vector<std::string> filter;
+	bool list_names = false;
+
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; ++i)
+	{
+		if (strcmp(argv[i], "-i") == 0)
+		{
+			list_names = true;
+		}
+		else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+		{
+			++i;
+			char const* c = argv[i];
+			while (*c)
+			{
+				char const* sep = strchr(c, ',');
+				if (sep == NULL) sep = c + strlen(c);
+				if (sep > c) filter.push_back(std::string(c, sep));
+				c = *sep ? sep + 1 : sep;
+			}
+		}
+		else
+		{
+			print_usage();
+		}
+	}
+	if (i == argc) print_usage();
+
+	int ret = 0;
+	for (; i < argc; ++i)
+	{
+		stats_log_reader log;
+		error_code ec;
+		if (!log.open(argv[i], ec))
+		{
+			fprintf(stderr, "%s: %s\n", argv[i], ec.message().c_str());
+			ret = 1;
+			continue;
+		}
+
+		std::vector<std::string> const& names = log.names();
+		if (list_names)
+		{
+			for (int k = 0; k < int(names.size()); ++k)
+				if (!names[k].empty()) printf("%s\n", names[k].c_str());
+			continue;
+		}
+
+		// the indices of the counters to print
+		std::vector<int> columns;
+		if (filter.empty())
+		{
+			for (int k = 0; k < int(names.size()); ++k) columns.push_back(k);
+		}
+		else
+		{
+			for (std::vector<std::string>::iterator f = filter.begin()
+				, end(filter.end()); f != end; ++f)
+			{
+				std::vector<std::string>::const_iterator n
+					= std::find(names.begin(), names.end(), *f);
+				if (n == names.end())
+				{
+					fprintf(stderr, "%s: no counter named \"%s\"\n", argv[i], f->c_str());
+					return 1;
+				}
+				columns.push_back(n - names.begin());
+			}
+		}
+
+		fputs("second", stdout);
+		for (std::vector<int>::iterator c = columns.begin(); c != columns.end(); ++c)
+			printf(":%s", names[*c].c_str());
+		fputs("\n\n", stdout);
+
+		while (log.next())
+		{
+			std::vector<std::uint64_t> const& values = log.values();
+			printf("%f", double(log.timestamp()) / 1000000.0);
+			for (std::vector<int>::iterator c = columns.begin(); c != columns.end(); ++c)
+				printf("\t%" PRId64, std::int64_t(values[*c]));
+			putchar('\n');
+		}
+	}
+	return ret;
+}
+
@@ -0,0 +1,94 @@
+#include "text_ui.hpp"
+#include "alert_handler.hpp"
+#include "torrent_history.hpp"
+#include "save_resume.hpp"
+
+#include "libtorrent/session.hpp"
+#include "libtorrent/settings_pack.hpp"
+#include "libtorrent/add_torrent_params.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+using namespace libtorrent;
+
+namespace lt = libtorrent;
+
+// a top-like view of the torrents in a resume database. They're loaded into
+// a session the way webui_test loads them, and listed by torrent_list
+
+void print_usage()
+{
+	fprintf(stderr, "usage: torrent_top [-r resume-file] [-p port]\n\n"
+		"   -r   the resume database to load the torrents from\n"
+		"        (default: resume.dat)\n"
+		"   -p   the port for the session to listen on (default: 6891)\n\n"
+		"the arrow keys, page up, page down and home scroll the list. s and r\n"
+		"change the sort order, f the filter, q quits\n");
+	exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+	std::string resume_file = "resume.dat";
+	int port = 6891;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+			resume_file = argv[++i];
+		else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+			port = atoi(argv[++i]);
+		else
+			print_usage();
+	}
+
+	settings_pack s;
+	s.set_str(settings_pack::listen_interfaces, "0.0.0.0:" + std::to_string(port));
+	s.set_int(settings_pack::alert_mask, 0xffffffff);
+	lt::session ses(s);
+
+	alert_handler alerts(ses);
+	torrent_history hist(&alerts);
+
+	error_code ec;
+	save_resume resume(ses, resume_file, &alerts, &hist);
+	add_torrent_params p;
+	p.save_path = ".";
+	resume.load(ec, p);
+
+	{
+		screen scr;
+		torrent_list list(hist, 0, 0, scr.width(), scr.height());
+
+		// keys are picked up between alert dispatches, without waiting
+		cbreak();
+		noecho();
+		nodelay(stdscr, TRUE);
+		keypad(stdscr, TRUE);
+
+		bool quit = false;
+		alerts.run([&]
+		{
+			for (int key = getch(); key != ERR; key = getch())
+			{
+				if (key == 'q') quit = true;
+				else if (key == KEY_RESIZE) list.set_pos(0, 0, scr.width(), scr.height());
+				else list.handle_key(key);
+			}
+			if (quit) return false;
+
+			ses.post_torrent_updates();
+			list.update();
+			return true;
+		}, 100);
+	}
+
+	// the screen is gone, for the progress to be printed
+	fprintf(stderr, "saving resume data\n");
+	resume.save_all();
+	alerts.run([&] { return !resume.ok_to_quit(); });
+	return 0;
+}
+